@@ -45,6 +45,7 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <htslib/sam.h>
 #include <htslib/khash.h>
+#include <htslib/thread_pool.h>
 
 #include "samtools.h"
 #include "sam_opts.h"
@@ -110,6 +111,8 @@ typedef struct {
     // 0 is correct pair, 1 is incorrect pair, 2 is unidentified
     int     (*amp_dist)[3];             // [MAX_AMP][3];
 
+    // These and coverage are kept as differences from the previous position
+    // while a file is read, see depth_add and stats_finish.
     int *depth_valid; // [max_len]
     int *depth_all;   // [max_len]
     khash_t(qname) *qend;  // queryname end, for overlap removal
@@ -145,27 +148,35 @@ typedef struct {
 
 // Reinitialised for each new reference/chromosome.
 // Counts from 1 to namp, -1 for no match and 0 for ?.
-static int *pos2start = NULL;
-static int *pos2end = NULL;
-static int pos2size = 0; // allocated size of pos2start/end
+// Each thread reading a file has its own.
+typedef struct {
+    int *pos2start;
+    int *pos2end;
+    int64_t pos2size; // allocated size of pos2start/end
+} amp_lookup_t;
 
 // Lookup table to go from position to amplicon based on
 // read start / end.
 static int initialise_amp_pos_lookup(astats_args_t *args,
                                      amplicons_t *amps,
-                                     int ref) {
+                                     int ref, amp_lookup_t *lk) {
     int64_t i, j;
     amplicon_t *amp = amps[ref].amp;
     int64_t max_len = amps[ref].len;
     int namp = amps[ref].namp;
+    int *pos2start, *pos2end;
 
-    if (max_len+1 > pos2size) {
-        if (!(pos2start = realloc(pos2start, (max_len+1)*sizeof(*pos2start))))
+    if (max_len+1 > lk->pos2size) {
+        if (!(pos2start = realloc(lk->pos2start, (max_len+1)*sizeof(*pos2start))))
             return -1;
-        if (!(pos2end   = realloc(pos2end,   (max_len+1)*sizeof(*pos2end))))
+        lk->pos2start = pos2start;
+        if (!(pos2end   = realloc(lk->pos2end,   (max_len+1)*sizeof(*pos2end))))
             return -1;
-        pos2size = max_len;
+        lk->pos2end = pos2end;
+        lk->pos2size = max_len+1;
     }
+    pos2start = lk->pos2start;
+    pos2end = lk->pos2end;
     for (i = 0; i < max_len; i++)
         pos2start[i] = pos2end[i] = -1;
 
@@ -478,12 +489,64 @@ static void amp_stats_reset(amplicons_t *amps, int nref) {
     }
 }
 
+// Adds v to the depth over [start,end) of an array of depth differences.
+// This keeps the per-read cost independent of the read length.
+static inline void depth_add(int64_t len, int64_t start, int64_t end,
+                             int v, int *d) {
+    if (start < 0)
+        start = 0;
+    if (end > len)
+        end = len;
+    if (start >= end)
+        return;
+    d[start] += v;
+    if (end < len)
+        d[end] -= v;
+}
+
+static inline void coverage_add(int64_t len, int64_t start, int64_t end,
+                                int64_t *d) {
+    if (start >= end)
+        return;
+    d[start]++;
+    if (end < len)
+        d[end]--;
+}
+
+// Turns the depth differences gathered by accumulate_stats into depths,
+// once the whole file has been read.
+static void stats_finish(astats_t *st, int namp) {
+    int64_t i;
+    int a;
+
+    for (i = 1; i < st->max_len; i++) {
+        st->depth_valid[i] += st->depth_valid[i-1];
+        st->depth_all[i]   += st->depth_all[i-1];
+    }
+
+    for (a = 0; a < namp; a++) {
+        int64_t *cov = &st->coverage[a*st->max_amp_len];
+        for (i = 1; i < st->max_amp_len; i++)
+            cov[i] += cov[i-1];
+    }
+}
+
+static void amp_stats_finish(amplicons_t *amps, int nref) {
+    int i;
+    for (i = 0; i < nref; i++) {
+        if (!amps[i].sites)
+            continue;
+        stats_finish(amps[i].lstats, amps[i].namp);
+    }
+}
+
 static int accumulate_stats(astats_args_t *args, amplicons_t *amps,
-                            bam1_t *b) {
+                            amp_lookup_t *lk, bam1_t *b) {
     int ref = b->core.tid;
     amplicon_t *amp = amps[ref].amp;
     astats_t *stats = amps[ref].lstats;
     int len = amps[ref].len;
+    int *pos2start = lk->pos2start, *pos2end = lk->pos2end;
 
     if (!stats)
         return 0;
@@ -496,7 +559,7 @@ static int accumulate_stats(astats_args_t *args, amplicons_t *amps,
     }
 
     int64_t start = b->core.pos, mstart = start; // modified start
-    int64_t end = bam_endpos(b), i;
+    int64_t end = bam_endpos(b);
 
     // Compute all-template-depth and valid-template-depth.
     // We track current end location per read name so we can remove overlaps.
@@ -525,9 +588,8 @@ static int accumulate_stats(astats_args_t *args, amplicons_t *amps,
             kh_value(stats->qend, k) = start | (end << 32);
         }
     }
-    for (i = mstart; i < end && i < len; i++)
-        stats->depth_all[i]++;
-    if (i < end) {
+    depth_add(len, mstart, end, 1, stats->depth_all);
+    if (mstart < end && end > len) {
         print_error("ampliconstats", "record %s overhangs end of reference",
                     bam_get_qname(b));
         // But keep going, as it's harmless.
@@ -556,15 +618,14 @@ static int accumulate_stats(astats_args_t *args, amplicons_t *amps,
             // NB: ref bases rather than read bases
             stats->nbases[anum] += c;
 
-            int64_t i;
             if (start < 0) start = 0;
             if (end > len) end = len;
 
             int64_t ostart = MAX(start, amp[anum].min_left-1);
             int64_t oend = MIN(end, amp[anum].max_right);
             int64_t offset = amp[anum].min_left-1;
-            for (i = ostart; i < oend; i++)
-                stats->coverage[anum*stats->max_amp_len + i-offset]++;
+            coverage_add(stats->max_amp_len, ostart-offset, oend-offset,
+                         &stats->coverage[anum*stats->max_amp_len]);
         } else {
             stats->nfailprimer++;
         }
@@ -615,13 +676,11 @@ static int accumulate_stats(astats_args_t *args, amplicons_t *amps,
     if (astatus == 0 && !(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP))) {
         if (prev_end && mstart > prev_end) {
             // 2nd read with gap to 1st; undo previous increment.
-            for (i = prev_start; i < prev_end; i++)
-                stats->depth_valid[i]--;
+            depth_add(len, prev_start, prev_end, -1, stats->depth_valid);
             stats->nfull_reads[anum] -= (b->core.flag & BAM_FPAIRED) ? 0.5 : 1;
         } else {
             // 1st read, or 2nd read that overlaps 1st
-            for (i = mstart; i < end; i++)
-                stats->depth_valid[i]++;
+            depth_add(len, mstart, end, 1, stats->depth_valid);
             stats->nfull_reads[anum] += (b->core.flag & BAM_FPAIRED) ? 0.5 : 1;
         }
     }
@@ -753,6 +812,53 @@ static int tcoord_freq_sort(const void *vp1, const void *vp2) {
 }
 
 
+// A square of tcoord_bin/2 by tcoord_bin/2 start,end coordinates with
+// one status, and the items in it not yet merged.  Items closer than
+// tcoord_bin/2 in both coordinates must be in the same or adjacent cells.
+typedef struct {
+    int64_t cstart, cend;
+    uint32_t status;
+    size_t off, live; // members are cidx[off] to cidx[off+live-1]
+} tcell_t;
+
+static inline int64_t tcell_coord(int64_t x, int64_t h) {
+    return x >= 0 ? x / h : -((h - 1 - x) / h);
+}
+
+static inline int tcell_cmp(const tcell_t *c, uint32_t status,
+                            int64_t cstart, int64_t cend) {
+    if (c->status != status)
+        return c->status < status ? -1 : 1;
+    if (c->cstart != cstart)
+        return c->cstart < cstart ? -1 : 1;
+    if (c->cend != cend)
+        return c->cend < cend ? -1 : 1;
+    return 0;
+}
+
+static int tcell_sort(const void *vp1, const void *vp2) {
+    const tcell_t *c1 = (const tcell_t *)vp1;
+    const tcell_t *c2 = (const tcell_t *)vp2;
+    int r = tcell_cmp(c1, c2->status, c2->cstart, c2->cend);
+    return r ? r : (c1->off < c2->off ? -1 : c1->off > c2->off);
+}
+
+static tcell_t *tcell_find(tcell_t *cell, size_t ncell, uint32_t status,
+                           int64_t cstart, int64_t cend) {
+    size_t l = 0, r = ncell;
+    while (l < r) {
+        size_t m = (l + r) / 2;
+        int c = tcell_cmp(&cell[m], status, cstart, cend);
+        if (c == 0)
+            return &cell[m];
+        if (c < 0)
+            l = m + 1;
+        else
+            r = m;
+    }
+    return NULL;
+}
+
 /*
  * Merges tcoord start,end,freq,status tuples if their coordinates are
  * close together.  We aim to keep the start,end for the most frequent
@@ -760,15 +866,15 @@ static int tcoord_freq_sort(const void *vp1, const void *vp2) {
  * minor fluctuations due to errors or variants.
  *
  * We sort by frequency first and then merge later items in the list into
- * the earlier more frequent ones.  It's O(N^2), but sufficient for now
- * given current scale of projects.
+ * the earlier more frequent ones.  Candidates for merging are found by
+ * placing the items in cells of tcoord_bin/2 along each coordinate, so
+ * each item only looks at its own and the eight neighbouring cells
+ * rather than the whole list.
  *
- * If we ever need to resolve that then consider sorting by start
- * coordinate and scanning the list to find all items within X, find
- * the most frequent of those, and then cluster that way.  (I'd have
- * done that had I thought of it at the time!)
+ * Returns 0 on success,
+ *        -1 on failure
  */
-static void aggregate_tcoord(astats_args_t *args, tcoord_t *tpos, size_t *np){
+static int aggregate_tcoord(astats_args_t *args, tcoord_t *tpos, size_t *np){
     size_t n = *np, j, j2, j3, k;
 
     // Sort by frequency and cluster infrequent coords into frequent
@@ -814,8 +920,50 @@ static void aggregate_tcoord(astats_args_t *args, tcoord_t *tpos, size_t *np){
     }
 
     // Now merge in coordinates.
-    // This bit is O(N^2), so consider binning first to reduce the
-    // size of the list if we have excessive positional variation.
+    // Group the items into cells.  Each cell's members sit together in
+    // cidx[], and cpos[] says where each item is so it can be removed
+    // from its cell once visited or merged.
+    int64_t h = args->tcoord_bin/2;
+    tcell_t *cell = malloc(n * sizeof(*cell));
+    size_t *cidx = malloc(n * sizeof(*cidx));
+    size_t *cpos = malloc(n * sizeof(*cpos));
+    tcell_t **item_cell = malloc(n * sizeof(*item_cell));
+    size_t ncell = 0;
+
+    if (n && (!cell || !cidx || !cpos || !item_cell)) {
+        free(cell);
+        free(cidx);
+        free(cpos);
+        free(item_cell);
+        return -1;
+    }
+
+    // cell[j].off is the item for now, so sorting keeps items in a cell in
+    // list order.
+    for (j = 0; j < n; j++) {
+        cell[j].cstart = tcell_coord(tpos[j].start, h);
+        cell[j].cend   = tcell_coord(tpos[j].end, h);
+        cell[j].status = tpos[j].status;
+        cell[j].off    = j;
+    }
+    qsort(cell, n, sizeof(*cell), tcell_sort);
+    for (j = 0; j < n; j++) {
+        cidx[j] = cell[j].off;
+        cpos[cell[j].off] = j;
+        if (ncell && tcell_cmp(&cell[ncell-1], cell[j].status,
+                               cell[j].cstart, cell[j].cend) == 0) {
+            cell[ncell-1].live++;
+        } else {
+            cell[ncell] = cell[j];
+            cell[ncell].off = j;
+            cell[ncell].live = 1;
+            ncell++;
+        }
+    }
+    for (j = 0; j < ncell; j++)
+        for (j2 = 0; j2 < cell[j].live; j2++)
+            item_cell[cidx[cell[j].off + j2]] = &cell[j];
+
     for (k = j = 0; j < n; j++) {
         if (!tpos[j].freq)
             continue;
@@ -823,18 +971,45 @@ static void aggregate_tcoord(astats_args_t *args, tcoord_t *tpos, size_t *np){
         if (k < j)
             tpos[k] = tpos[j];
 
-        for (j2 = j+1; j2 < n; j2++) {
-            if (ABS(tpos[j].start-tpos[j2].start) < args->tcoord_bin/2 &&
-                ABS(tpos[j].end  -tpos[j2].end)  < args->tcoord_bin/2 &&
-                tpos[j].status == tpos[j2].status) {
-                tpos[k].freq += tpos[j2].freq;
-                tpos[j2].freq = 0;
+        // Everything still in a cell is later in the list than j
+        tcell_t *c = item_cell[j];
+        size_t last = c->off + --c->live;
+        cidx[cpos[j]] = cidx[last];
+        cpos[cidx[last]] = cpos[j];
+
+        int64_t ds, de;
+        for (ds = -1; ds <= 1; ds++) {
+            for (de = -1; de <= 1; de++) {
+                c = tcell_find(cell, ncell, tpos[j].status,
+                               item_cell[j]->cstart + ds,
+                               item_cell[j]->cend + de);
+                if (c) {
+                    for (j3 = c->off; j3 < c->off + c->live; ) {
+                        j2 = cidx[j3];
+                        if (ABS(tpos[j].start-tpos[j2].start) < h &&
+                            ABS(tpos[j].end  -tpos[j2].end)  < h) {
+                            tpos[k].freq += tpos[j2].freq;
+                            tpos[j2].freq = 0;
+                            last = c->off + --c->live;
+                            cidx[j3] = cidx[last];
+                            cpos[cidx[last]] = j3;
+                        } else {
+                            j3++;
+                        }
+                    }
+                }
             }
         }
         k++;
     }
 
+    free(cell);
+    free(cidx);
+    free(cpos);
+    free(item_cell);
+
     *np = k;
+    return 0;
 }
 
 int dump_stats(astats_args_t *args, char type, char *name, int nfile,
@@ -1248,8 +1423,11 @@ int dump_stats(astats_args_t *args, char type, char *name, int nfile,
                 n++;
             }
 
-            if (args->tcoord_bin > 1)
-                aggregate_tcoord(args, tpos, &n);
+            if (args->tcoord_bin > 1 &&
+                aggregate_tcoord(args, tpos, &n) < 0) {
+                free(tpos);
+                return -1;
+            }
 
             fprintf(ofp, "%cTCOORD\t%s\t%d", type, name,
                     i+1+amps[r].first_amp); // per amplicon
@@ -1342,6 +1520,241 @@ int64_t get_ref_len(sam_hdr_t *header, const char *SQ) {
     }
 }
 
+// Reads one input file into the file-local stats in amps, after checking
+// its header matches the first file.  The sample name is returned in
+// *sname_out, either in sname_ or malloced.
+//
+// Returns 0 on success,
+//        -1 on failure
+static int amplicon_stats_file(astats_args_t *args, amplicons_t *amps,
+                               int nref, amp_lookup_t *lk, bam1_t *b,
+                               char *fn, int nthreads, char *sname_,
+                               char **sname_out) {
+    samFile *fp = NULL;
+    sam_hdr_t *header = NULL;
+    char *nstart = fn, *sname = NULL;
+    int r, ret = -1;
+
+    *sname_out = NULL;
+
+    fp = sam_open_format(fn, "r", &args->ga.in);
+    if (!fp) {
+        print_error_errno("ampliconstats",
+                          "Cannot open input file \"%s\"",
+                          fn);
+        return -1;
+    }
+
+    if (nthreads > 0)
+        hts_set_threads(fp, nthreads);
+
+    if (!(header = sam_hdr_read(fp)))
+        goto err;
+
+    if (nref != sam_hdr_nref(header)) {
+        print_error_errno("ampliconstats",
+                          "SAM headers are not consistent across input files");
+        goto err;
+    }
+    for (r = 0; r < nref; r++) {
+        if (!amps[r].sites)
+            continue;
+        if (!amps[r].ref ||
+            strcmp(amps[r].ref, sam_hdr_tid2name(header, r)) != 0 ||
+            amps[r].len != sam_hdr_tid2len(header, r)) {
+            print_error_errno("ampliconstats",
+                              "SAM headers are not consistent across "
+                              "input files");
+            goto err;
+        }
+    }
+
+    if (args->use_sample_name)
+        sname = (char *)get_sample_name(header, NULL);
+
+    if (!sname) {
+        sname = sname_;
+        char *nend = fn + strlen(fn), *cp;
+        if ((cp = strrchr(fn, '/')))
+            nstart = cp+1;
+        if ((cp = strrchr(nstart, '.')) &&
+            (strcmp(cp, ".bam") == 0 ||
+             strcmp(cp, ".sam") == 0 ||
+             strcmp(cp, ".cram") == 0))
+            nend = cp;
+        if (nend - nstart >= 8192) nend = nstart+8191;
+        memcpy(sname, nstart, nend-nstart);
+        sname[nend-nstart] = 0;
+    }
+
+    // Stats local to this sample only
+    amp_stats_reset(amps, nref);
+
+    int last_ref = -9;
+    while ((r = sam_read1(fp, header, b)) >= 0) {
+        // Other filter options useful here?
+        if (b->core.tid < 0)
+            continue;
+
+        if (last_ref != b->core.tid) {
+            last_ref  = b->core.tid;
+            if (initialise_amp_pos_lookup(args, amps, last_ref, lk) < 0)
+                goto err;
+        }
+
+        if (accumulate_stats(args, amps, lk, b) < 0)
+            goto err;
+    }
+
+    if (r < -1) {
+        print_error_errno("ampliconstats", "Fail reading record");
+        goto err;
+    }
+
+    amp_stats_finish(amps, nref);
+    ret = 0;
+
+ err:
+    if (header)
+        sam_hdr_destroy(header);
+    if (sam_close(fp) < 0)
+        ret = -1;
+
+    if (ret == 0)
+        *sname_out = sname;
+    else if (sname && sname != sname_)
+        free(sname);
+
+    return ret;
+}
+
+// Reading several files at once.  Each job reads a whole file into its
+// own copy of the file-local stats, so nothing is shared while reading.
+// Results are reported and added to the combined stats in input order,
+// so the output is unchanged.
+typedef struct {
+    astats_args_t *args;
+    amplicons_t *amps;  // copy of the amplicon data, with our own lstats
+    int nref;
+    amp_lookup_t lk;
+    bam1_t *b;
+    char *fn;
+    char sname_[8192], *sname;
+    int ret;
+} astats_job_t;
+
+static void *amplicon_stats_job(void *arg) {
+    astats_job_t *job = (astats_job_t *)arg;
+
+    // The pool is busy reading other files, so each one is decoded
+    // without extra threads.
+    job->ret = amplicon_stats_file(job->args, job->amps, job->nref,
+                                   &job->lk, job->b, job->fn, 0,
+                                   job->sname_, &job->sname);
+    return job;
+}
+
+// Returns 0 on success,
+//        -1 on failure
+static int amplicon_stats_threaded(astats_args_t *args, amplicons_t *amps,
+                                   int nref, char **filev, int filec) {
+    int njob = MIN(2 * args->ga.nthreads, filec), next = 0, in_flight = 0;
+    int nfile = 0, ret = 0, i, r;
+    astats_job_t *job = calloc(njob, sizeof(*job));
+    hts_tpool *pool = NULL;
+    hts_tpool_process *q = NULL;
+
+    if (!job)
+        goto nomem;
+    for (i = 0; i < njob; i++) {
+        job[i].args = args;
+        job[i].nref = nref;
+        if (!(job[i].b = bam_init1()))
+            goto nomem;
+        if (!(job[i].amps = malloc(nref * sizeof(*amps))))
+            goto nomem;
+        memcpy(job[i].amps, amps, nref * sizeof(*amps));
+        for (r = 0; r < nref; r++)
+            job[i].amps[r].lstats = NULL;
+        for (r = 0; r < nref; r++) {
+            if (!amps[r].sites)
+                continue;
+            if (!(job[i].amps[r].lstats = stats_alloc(amps[r].len,
+                                                      args->max_amp,
+                                                      args->max_amp_len)))
+                goto nomem;
+        }
+    }
+
+    if (!(pool = hts_tpool_init(args->ga.nthreads)))
+        goto nomem;
+
+    // The ring of jobs is no larger than the queue, so dispatching
+    // never waits on results we have yet to collect.
+    if (!(q = hts_tpool_process_init(pool, njob, 0)))
+        goto nomem;
+
+    for (;;) {
+        while (nfile < filec && ret == 0 && in_flight < njob) {
+            astats_job_t *jb = &job[next];
+            jb->fn = filev[nfile++];
+            if (hts_tpool_dispatch(pool, q, amplicon_stats_job, jb) < 0) {
+                ret = -1;
+                break;
+            }
+            next = (next + 1) % njob;
+            in_flight++;
+        }
+        if (!in_flight)
+            break;
+
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        if (!res) {
+            ret = -1;
+            break;
+        }
+        astats_job_t *jb = (astats_job_t *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+
+        // After an error the remaining jobs are only collected
+        if (ret == 0 && jb->ret < 0)
+            ret = -1;
+        if (ret == 0 &&
+            (dump_lstats(args, 'F', jb->sname, filec, jb->amps, nref) < 0 ||
+             append_stats(jb->amps, nref) < 0))
+            ret = -1;
+
+        if (jb->sname && jb->sname != jb->sname_)
+            free(jb->sname);
+        jb->sname = NULL;
+    }
+
+ out:
+    if (q)
+        hts_tpool_process_destroy(q);
+    if (pool)
+        hts_tpool_destroy(pool);
+    if (job) {
+        for (i = 0; i < njob; i++) {
+            if (job[i].amps)
+                for (r = 0; r < nref; r++)
+                    stats_free(job[i].amps[r].lstats);
+            free(job[i].amps);
+            free(job[i].lk.pos2start);
+            free(job[i].lk.pos2end);
+            bam_destroy1(job[i].b);
+        }
+        free(job);
+    }
+    return ret;
+
+ nomem:
+    print_error_errno("ampliconstats", "could not set up the reading threads");
+    ret = -1;
+    goto out;
+}
+
 static int amplicon_stats(astats_args_t *args,
                           khash_t(bed_list_hash) *bed_hash,
                           char **filev, int filec) {
@@ -1352,6 +1765,7 @@ static int amplicon_stats(astats_args_t *args,
     FILE *ofp = args->out_fp;
     char sname_[8192], *sname = NULL;
     amplicons_t *amps = NULL;
+    amp_lookup_t lk = {NULL, NULL, 0};
 
     // Report initial SS header.  We gather data from the bed_hash entries
     // as well as from the first SAM header (with the requirement that all
@@ -1450,103 +1864,27 @@ static int amplicon_stats(astats_args_t *args,
         offset += amps[i].namp; // cumulative amplicon number across refs
     }
 
-    // Now iterate over file contents, one at a time.
-    for (i = 0; i < filec; i++) {
-        char *nstart = filev[i];
-
-        fp = sam_open_format(filev[i], "r", &args->ga.in);
-        if (!fp) {
-            print_error_errno("ampliconstats",
-                              "Cannot open input file \"%s\"",
-                              filev[i]);
-            goto err;
-        }
-
-        if (args->ga.nthreads > 0)
-            hts_set_threads(fp, args->ga.nthreads);
-
-        if (!(header = sam_hdr_read(fp)))
+    // Now iterate over file contents, either one at a time or, given
+    // threads and several files, a file per thread.
+    if (args->ga.nthreads > 0 && filec > 1) {
+        if (amplicon_stats_threaded(args, amps, nref, filev, filec) < 0)
             goto err;
-
-        if (nref != sam_hdr_nref(header)) {
-            print_error_errno("ampliconstats",
-                              "SAM headers are not consistent across input files");
-            goto err;
-        }
-        int r;
-        for (r = 0; r < nref; r++) {
-            if (!amps[r].sites)
-                continue;
-            if (!amps[r].ref ||
-                strcmp(amps[r].ref, sam_hdr_tid2name(header, r)) != 0 ||
-                amps[r].len != sam_hdr_tid2len(header, r)) {
-                print_error_errno("ampliconstats",
-                                  "SAM headers are not consistent across "
-                                  "input files");
+    } else {
+        for (i = 0; i < filec; i++) {
+            if (amplicon_stats_file(args, amps, nref, &lk, b, filev[i],
+                                    args->ga.nthreads, sname_, &sname) < 0)
                 goto err;
-            }
-        }
-
-        if (args->use_sample_name)
-            sname = (char *)get_sample_name(header, NULL);
-
-        if (!sname) {
-            sname = sname_;
-            char *nend = filev[i] + strlen(filev[i]), *cp;
-            if ((cp = strrchr(filev[i], '/')))
-                nstart = cp+1;
-            if ((cp = strrchr(nstart, '.')) &&
-                (strcmp(cp, ".bam") == 0 ||
-                 strcmp(cp, ".sam") == 0 ||
-                 strcmp(cp, ".cram") == 0))
-                nend = cp;
-            if (nend - nstart >= 8192) nend = nstart+8191;
-            memcpy(sname, nstart, nend-nstart);
-            sname[nend-nstart] = 0;
-        }
-
-        // Stats local to this sample only
-        amp_stats_reset(amps, nref);
-
-        int last_ref = -9;
-        while ((r = sam_read1(fp, header, b)) >= 0) {
-            // Other filter options useful here?
-            if (b->core.tid < 0)
-                continue;
 
-            if (last_ref != b->core.tid) {
-                last_ref  = b->core.tid;
-                if (initialise_amp_pos_lookup(args, amps, last_ref) < 0)
-                    goto err;
-            }
-
-            if (accumulate_stats(args, amps, b) < 0)
+            if (dump_lstats(args, 'F', sname, filec, amps, nref) < 0)
                 goto err;
-        }
 
-        if (r < -1) {
-            print_error_errno("ampliconstats", "Fail reading record");
-            goto err;
-        }
+            if (append_stats(amps, nref) < 0)
+                goto err;
 
-        sam_hdr_destroy(header);
-        if (sam_close(fp) < 0) {
-            fp = NULL;
-            goto err;
+            if (sname && sname != sname_)
+                free(sname);
+            sname = NULL;
         }
-
-        fp = NULL;
-        header = NULL;
-
-        if (dump_lstats(args, 'F', sname, filec, amps, nref) < 0)
-            goto err;
-
-        if (append_stats(amps, nref) < 0)
-            goto err;
-
-        if (sname && sname != sname_)
-            free(sname);
-        sname = NULL;
     }
 
     if (dump_gstats(args, 'C', "COMBINED", filec, amps, nref) < 0)
@@ -1567,8 +1905,8 @@ static int amplicon_stats(astats_args_t *args,
         free(amps[i].amp);
     }
     free(amps);
-    free(pos2start);
-    free(pos2end);
+    free(lk.pos2start);
+    free(lk.pos2end);
     if (ret) {
         if (sname && sname != sname_)
             free(sname);
@@ -1635,7 +1973,7 @@ int main_ampliconstats(int argc, char **argv) {
 
     static const struct option loptions[] =
     {
-        SAM_OPT_GLOBAL_OPTIONS('I', 0, '-', '-', 0, '@'),
+        SAM_OPT_GLOBAL_OPTIONS('I', 0, '-', '-', 0, '@', '-', '-'),
         {"help", no_argument, NULL, 'h'},
         {"flag-require", required_argument, NULL, 'f'},
         {"flag-filter", required_argument, NULL, 'F'},
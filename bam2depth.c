@@ -38,11 +38,20 @@ DEALINGS IN THE SOFTWARE.  */
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
+#include <ctype.h>
+#include <inttypes.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 #include "htslib/sam.h"
+#include "htslib/bgzf.h"
+#include "htslib/thread_pool.h"
+#include "htslib/hts_endian.h"
+#include "htslib/faidx.h"
 #include "samtools.h"
 #include "bedidx.h"
 #include "sam_opts.h"
+#include "sam_prof.h"
 #include "htslib/khash.h"
 
 // From bam_plcmd.c
@@ -67,8 +76,82 @@ typedef struct {
     kstring_t ks;
     hts_pos_t beg, end; // limit to region
     int tid;
+    uint32_t *blk;      // blk[DEPTH_BLOCK][nfiles], see flush_depth
+    kstring_t rows;
+    bed_cursor_t bed_cur;
 } depth_hist;
 
+// Binary depth output.  This is a BGZF stream holding a header followed by
+// chunks of up to DEPTH_BIN_CHUNK positions on a single reference.
+//
+// Header:  "DPTH" magic, uint8 version (1), uint32 nfiles, then per file
+//          a uint32 name length and the name.
+// Chunk:   uint32 ref name length and name, int64 first 0-based position,
+//          uint32 number of positions N, uint8 depth width W (2 or 4),
+//          N LEB128 varint position deltas (the first relative to the
+//          chunk start, so 0), then nfiles columns of N little-endian
+//          W-byte depths.
+// The stream ends with a chunk with a zero length reference name.
+//
+// Each chunk starts a new BGZF block.  When writing to a file, FILE.idx
+// lists one chunk per line as ref, 1-based first and last position and
+// the virtual offset of the chunk, for random access.
+#define DEPTH_BIN_CHUNK 16384
+
+typedef struct {
+    BGZF *fp;
+    FILE *idx;          // region index, or NULL
+    const char *ref;    // reference of the current chunk
+    hts_pos_t *pos;     // pos[DEPTH_BIN_CHUNK]
+    uint32_t *depth;    // depth[nfiles][DEPTH_BIN_CHUNK]
+    uint32_t max;       // largest depth in the current chunk
+    int n, nfiles;
+    kstring_t ks;
+} depth_bin;
+
+// Run-length (bedGraph style) output.  Consecutive positions with the same
+// depth in every file are collapsed into a single [beg,end) interval,
+// which is only printed once the depths change.
+typedef struct {
+    const char *ref;    // reference of the pending interval, or NULL
+    hts_pos_t beg, end;
+    uint32_t *depth;    // depth[nfiles] of the pending interval
+    uint32_t *next;     // depth[nfiles] of the position being added
+    int nfiles;
+    kstring_t ks;
+} depth_run;
+
+// Summary output.  Instead of per-position rows, depth histograms are
+// accumulated per file, for the current reference and for the whole run,
+// and only the statistics derived from them are written.  Depths of
+// DEPTH_SUMM_MAX-1 and above share the last histogram bin.
+//
+// With a reference, positions are also stratified by the GC content of
+// the DEPTH_GC_WIN bases centred on them, as a sliding window.
+#define DEPTH_SUMM_MAX 10000
+#define DEPTH_GC_WIN 100
+
+typedef struct {
+    const char *ref;    // reference being accumulated, or NULL
+    int nfiles;
+    char **fn;
+    int *thresh, nthresh;
+    uint64_t *hist;     // hist[2*nfiles][DEPTH_SUMM_MAX], ref then total
+    uint64_t *sum;      // sum[2*nfiles]
+    uint32_t *max;      // max[2*nfiles]
+    uint32_t *depth;    // depth[nfiles] of the position being added
+    hts_reglist_t *reg; // merged BED regions, when used
+    int n_reg, last_reg, use_bed;
+    faidx_t *fai;       // for GC stratification, or NULL
+    const char *seq_ref;
+    char *seq;
+    hts_pos_t seq_len, gc_lo, gc_hi;
+    int gc, acgt;       // counts in seq[gc_lo..gc_hi)
+    uint64_t gc_pos[101];
+    uint64_t *gc_sum;   // gc_sum[nfiles][101]
+    kstring_t ks;
+} depth_summ;
+
 typedef struct {
     int header;
     int flag;
@@ -81,12 +164,565 @@ typedef struct {
     int all_pos;
     int remove_overlaps;
     FILE *out;
+    kstring_t *ks_out;  // text output is appended here instead, if set
+    depth_bin *bin;
+    depth_run *run;
+    depth_summ *summ;
     char *reg;
     void *bed;
+    uint64_t n_used;    // records added to the depth
 } depth_opt;
 
-static void zero_region(depth_opt *opt, depth_hist *dh,
-                        const char *name, hts_pos_t start, hts_pos_t end) {
+// Writes text output to opt->ks_out, or opt->out if that is not set.
+static int depth_write(depth_opt *opt, const char *s, size_t len) {
+    if (opt->ks_out)
+        return kputsn(s, len, opt->ks_out) < 0 ? -1 : 0;
+    return fwrite(s, 1, len, opt->out) != len ? -1 : 0;
+}
+
+static inline void kput_le(kstring_t *ks, uint64_t v, int len) {
+    int i;
+    for (i = 0; i < len; i++, v >>= 8)
+        kputc_(v & 0xff, ks);
+}
+
+static int depth_bin_open(depth_bin *bd, const char *fn, int nfiles,
+                          char **names, int nthreads) {
+    int i;
+
+    memset(bd, 0, sizeof(*bd));
+    bd->nfiles = nfiles;
+    bd->pos = malloc(DEPTH_BIN_CHUNK * sizeof(*bd->pos));
+    bd->depth = malloc((size_t)nfiles * DEPTH_BIN_CHUNK * sizeof(*bd->depth));
+    if (!bd->pos || !bd->depth) {
+        print_error_errno("depth", "Out of memory");
+        return -1;
+    }
+
+    bd->fp = fn && strcmp(fn, "-")
+        ? bgzf_open(fn, "w")
+        : bgzf_fdopen(fileno(stdout), "w");
+    if (!bd->fp) {
+        print_error_errno("depth", "Cannot open \"%s\" for writing",
+                          fn ? fn : "-");
+        return -1;
+    }
+    if (nthreads > 0)
+        bgzf_mt(bd->fp, nthreads, 256);
+
+    if (fn && strcmp(fn, "-")) {
+        kstring_t idx_fn = KS_INITIALIZE;
+        if (ksprintf(&idx_fn, "%s.idx", fn) < 0)
+            return -1;
+        bd->idx = fopen(idx_fn.s, "w");
+        if (!bd->idx) {
+            print_error_errno("depth", "Cannot open \"%s\" for writing",
+                              idx_fn.s);
+            ks_free(&idx_fn);
+            return -1;
+        }
+        ks_free(&idx_fn);
+    }
+
+    kputsn("DPTH", 4, ks_clear(&bd->ks));
+    kputc_(1, &bd->ks);
+    kput_le(&bd->ks, nfiles, 4);
+    for (i = 0; i < nfiles; i++) {
+        size_t len = strlen(names[i]);
+        kput_le(&bd->ks, len, 4);
+        kputsn(names[i], len, &bd->ks);
+    }
+    if (bgzf_write(bd->fp, bd->ks.s, bd->ks.l) < 0) {
+        print_error("depth", "Failed to write binary header");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Write the pending chunk, starting a new BGZF block for it.
+static int depth_bin_flush(depth_bin *bd) {
+    int i, n, w = bd->max > UINT16_MAX ? 4 : 2;
+    size_t ref_len;
+
+    if (!bd->n)
+        return 0;
+
+    if (bgzf_flush(bd->fp) < 0)
+        return -1;
+    int64_t voff = bgzf_tell(bd->fp);
+
+    ref_len = strlen(bd->ref);
+    kstring_t *ks = ks_clear(&bd->ks);
+    kput_le(ks, ref_len, 4);
+    kputsn(bd->ref, ref_len, ks);
+    kput_le(ks, bd->pos[0], 8);
+    kput_le(ks, bd->n, 4);
+    kputc_(w, ks);
+    for (i = 0; i < bd->n; i++) {
+        uint64_t delta = i ? bd->pos[i] - bd->pos[i-1] : 0;
+        do {
+            kputc_((delta & 0x7f) | (delta > 0x7f ? 0x80 : 0), ks);
+            delta >>= 7;
+        } while (delta);
+    }
+    if (ks_resize(ks, ks->l + (size_t)bd->nfiles * bd->n * w + 1) < 0)
+        return -1;
+    for (n = 0; n < bd->nfiles; n++) {
+        uint32_t *d = &bd->depth[(size_t)n * DEPTH_BIN_CHUNK];
+        uint8_t *out = (uint8_t *)ks->s + ks->l;
+        if (w == 2)
+            for (i = 0; i < bd->n; i++, out += 2)
+                u16_to_le(d[i], out);
+        else
+            for (i = 0; i < bd->n; i++, out += 4)
+                u32_to_le(d[i], out);
+        ks->l += (size_t)bd->n * w;
+    }
+    if (bgzf_write(bd->fp, ks->s, ks->l) < 0)
+        return -1;
+
+    if (bd->idx &&
+        fprintf(bd->idx, "%s\t%"PRIhts_pos"\t%"PRIhts_pos"\t%"PRId64"\n",
+                bd->ref, bd->pos[0]+1, bd->pos[bd->n-1]+1, voff) < 0)
+        return -1;
+
+    bd->n = 0;
+    bd->max = 0;
+    return 0;
+}
+
+// Start a new row for pos on ref, returning its index within the
+// depth columns.
+static int depth_bin_add(depth_bin *bd, const char *ref, hts_pos_t pos) {
+    if (bd->n && (bd->n == DEPTH_BIN_CHUNK ||
+                  (bd->ref != ref && strcmp(bd->ref, ref) != 0))) {
+        if (depth_bin_flush(bd) < 0) {
+            print_error("depth", "Failed to write binary output");
+            return -1;
+        }
+    }
+    bd->ref = ref;
+    bd->pos[bd->n] = pos;
+    return bd->n++;
+}
+
+static inline void depth_bin_set(depth_bin *bd, int row, int file,
+                                 uint32_t d) {
+    bd->depth[(size_t)file * DEPTH_BIN_CHUNK + row] = d;
+    if (bd->max < d)
+        bd->max = d;
+}
+
+static int depth_bin_close(depth_bin *bd) {
+    int ret = 0;
+
+    if (bd->fp) {
+        if (depth_bin_flush(bd) < 0)
+            ret = -1;
+        // Terminating chunk
+        kput_le(ks_clear(&bd->ks), 0, 4);
+        if (bgzf_write(bd->fp, bd->ks.s, bd->ks.l) < 0)
+            ret = -1;
+        if (bgzf_close(bd->fp) < 0)
+            ret = -1;
+        if (ret < 0)
+            print_error("depth", "Failed to write binary output");
+    }
+    if (bd->idx && fclose(bd->idx) != 0) {
+        print_error_errno("depth", "Failed to write binary output index");
+        ret = -1;
+    }
+    free(bd->pos);
+    free(bd->depth);
+    ks_free(&bd->ks);
+
+    return ret;
+}
+
+static int depth_run_init(depth_run *dr, int nfiles) {
+    memset(dr, 0, sizeof(*dr));
+    dr->nfiles = nfiles;
+    dr->depth = calloc(nfiles, sizeof(*dr->depth));
+    dr->next  = calloc(nfiles, sizeof(*dr->next));
+    if (!dr->depth || !dr->next) {
+        print_error_errno("depth", "Out of memory");
+        return -1;
+    }
+    return 0;
+}
+
+// Print the pending interval, if any.
+static int depth_run_flush(depth_run *dr, FILE *out) {
+    int n;
+
+    if (!dr->ref)
+        return 0;
+
+    kstring_t *ks = ks_clear(&dr->ks);
+    kputs(dr->ref, ks);
+    kputc_('\t', ks);
+    kputll(dr->beg, ks);
+    kputc_('\t', ks);
+    kputll(dr->end, ks);
+    for (n = 0; n < dr->nfiles; n++) {
+        kputc_('\t', ks);
+        kputuw(dr->depth[n], ks);
+    }
+    if (kputc('\n', ks) < 0 || fputs(ks->s, out) == EOF) {
+        print_error_errno("depth", "Failed to write output");
+        return -1;
+    }
+    dr->ref = NULL;
+    return 0;
+}
+
+// Add [beg,end) on ref with the depths in dr->next, extending the
+// pending interval when it is adjacent and has the same depths.
+static int depth_run_add(depth_run *dr, FILE *out, const char *ref,
+                         hts_pos_t beg, hts_pos_t end) {
+    if (dr->ref && dr->end == beg &&
+        (dr->ref == ref || strcmp(dr->ref, ref) == 0) &&
+        memcmp(dr->depth, dr->next, dr->nfiles * sizeof(*dr->next)) == 0) {
+        dr->end = end;
+        return 0;
+    }
+
+    if (depth_run_flush(dr, out) < 0)
+        return -1;
+
+    uint32_t *tmp = dr->depth;
+    dr->depth = dr->next;
+    dr->next = tmp;
+    dr->ref = ref;
+    dr->beg = beg;
+    dr->end = end;
+    return 0;
+}
+
+static int depth_run_close(depth_run *dr, FILE *out) {
+    int ret = dr->depth ? depth_run_flush(dr, out) : 0;
+    free(dr->depth);
+    free(dr->next);
+    ks_free(&dr->ks);
+    return ret;
+}
+
+static int depth_summ_init(depth_summ *ds, FILE *out, int nfiles, char **fn,
+                           const char *thresh, void *bed, const char *ref_fn) {
+    const char *s;
+    char *end;
+    int n;
+
+    memset(ds, 0, sizeof(*ds));
+    ds->nfiles = nfiles;
+    ds->fn = fn;
+    for (s = thresh, n = 1; *s; s++)
+        n += *s == ',';
+    ds->thresh = calloc(n, sizeof(*ds->thresh));
+    ds->hist   = calloc((size_t)2 * nfiles * DEPTH_SUMM_MAX, sizeof(*ds->hist));
+    ds->sum    = calloc(2 * nfiles, sizeof(*ds->sum));
+    ds->max    = calloc(2 * nfiles, sizeof(*ds->max));
+    ds->depth  = calloc(nfiles, sizeof(*ds->depth));
+    if (!ds->thresh || !ds->hist || !ds->sum || !ds->max || !ds->depth) {
+        print_error_errno("depth", "Out of memory");
+        return -1;
+    }
+
+    for (s = thresh; *s; s = *end ? end+1 : end) {
+        long v = strtol(s, &end, 10);
+        if (end == s || (*end && *end != ',') || v < 0) {
+            print_error("depth", "Invalid threshold list \"%s\"", thresh);
+            return -1;
+        }
+        ds->thresh[ds->nthresh++] = v;
+    }
+
+    // Sorted BED intervals, so zero depth stretches can be limited to them
+    // without testing every position.  Overlaps are merged here as the
+    // shared index must stay as it is for bed_overlap.
+    if (bed) {
+        int r, j, k;
+        ds->use_bed = 1;
+        ds->reg = bed_reglist(bed, ALL, &ds->n_reg);
+        for (r = 0; r < ds->n_reg; r++) {
+            hts_pair_pos_t *iv = ds->reg[r].intervals;
+            for (k = 0, j = 1; j < ds->reg[r].count; j++) {
+                if (iv[k].end < iv[j].beg)
+                    iv[++k] = iv[j];
+                else if (iv[k].end < iv[j].end)
+                    iv[k].end = iv[j].end;
+            }
+            if (ds->reg[r].count)
+                ds->reg[r].count = k+1;
+        }
+    }
+
+    if (ref_fn) {
+        if (!(ds->fai = fai_load(ref_fn))) {
+            print_error_errno("depth", "Could not load reference \"%s\"",
+                              ref_fn);
+            return -1;
+        }
+        if (!(ds->gc_sum = calloc((size_t)nfiles * 101, sizeof(*ds->gc_sum)))) {
+            print_error_errno("depth", "Out of memory");
+            return -1;
+        }
+    }
+
+    kstring_t *ks = &ds->ks;
+    kputs("# DP\tFILE\tREF\tPOSITIONS\tMEAN\tMIN\tP10\tP25\tMEDIAN"
+          "\tP75\tP90\tMAX", ks);
+    for (n = 0; n < ds->nthresh; n++)
+        ksprintf(ks, "\tPCT_GE_%dX", ds->thresh[n]);
+    kputc('\n', ks);
+    if (ds->fai)
+        kputs("# GC\tFILE\tGC_PCT\tPOSITIONS\tMEAN\n", ks);
+    if (fputs(ks->s, out) == EOF) {
+        print_error_errno("depth", "Failed to write output");
+        return -1;
+    }
+    return 0;
+}
+
+// Print one DP row per file from histograms [first, first+nfiles)
+static int depth_summ_print(depth_summ *ds, FILE *out, const char *ref,
+                            int first) {
+    static const int pct[] = {10, 25, 50, 75, 90};
+    int n, p, t;
+
+    for (n = 0; n < ds->nfiles; n++) {
+        uint64_t *hist = &ds->hist[(size_t)(first+n) * DEPTH_SUMM_MAX];
+        uint64_t npos = 0, cum = 0;
+        uint32_t d, min = 0;
+
+        for (d = 0; d < DEPTH_SUMM_MAX; d++)
+            npos += hist[d];
+        if (!npos)
+            continue;
+        for (d = 0; !hist[d]; d++);
+        min = d;
+
+        kstring_t *ks = ks_clear(&ds->ks);
+        ksprintf(ks, "DP\t%s\t%s\t%"PRIu64"\t%.2f\t%u", ds->fn[n], ref, npos,
+                 (double)ds->sum[first+n] / npos, min);
+
+        // Nearest rank percentiles
+        for (p = 0, d = 0; p < (int)(sizeof(pct)/sizeof(*pct)); p++) {
+            uint64_t rank = (npos * pct[p] + 99) / 100;
+            for (; d < DEPTH_SUMM_MAX-1 && cum + hist[d] < rank; d++)
+                cum += hist[d];
+            kputc('\t', ks);
+            kputuw(d, ks);
+        }
+        kputc('\t', ks);
+        kputuw(ds->max[first+n], ks);
+
+        for (t = 0; t < ds->nthresh; t++) {
+            uint64_t above = 0;
+            for (d = ds->thresh[t] < DEPTH_SUMM_MAX
+                     ? ds->thresh[t] : DEPTH_SUMM_MAX; d < DEPTH_SUMM_MAX; d++)
+                above += hist[d];
+            ksprintf(ks, "\t%.2f", 100.0 * above / npos);
+        }
+        if (kputc('\n', ks) < 0 || fputs(ks->s, out) == EOF) {
+            print_error_errno("depth", "Failed to write output");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Print the current reference and add it to the totals
+static int depth_summ_ref_end(depth_summ *ds, FILE *out) {
+    size_t i, nf = ds->nfiles, sz = nf * DEPTH_SUMM_MAX;
+    int n;
+
+    if (!ds->ref)
+        return 0;
+    if (depth_summ_print(ds, out, ds->ref, 0) < 0)
+        return -1;
+    for (i = 0; i < sz; i++) {
+        ds->hist[sz + i] += ds->hist[i];
+        ds->hist[i] = 0;
+    }
+    for (n = 0; n < nf; n++) {
+        ds->sum[nf + n] += ds->sum[n];
+        if (ds->max[nf + n] < ds->max[n])
+            ds->max[nf + n] = ds->max[n];
+        ds->sum[n] = ds->max[n] = 0;
+    }
+    ds->ref = NULL;
+    return 0;
+}
+
+static inline void depth_summ_gc_base(depth_summ *ds, char c, int dir) {
+    switch (toupper((unsigned char)c)) {
+    case 'G': case 'C':
+        ds->gc += dir;
+        // fall through
+    case 'A': case 'T':
+        ds->acgt += dir;
+    }
+}
+
+// GC percentage around pos, or -1 if unknown
+static int depth_summ_gc(depth_summ *ds, const char *ref, hts_pos_t pos) {
+    hts_pos_t lo, hi, len;
+
+    if (ds->seq_ref != ref && (!ds->seq_ref || strcmp(ds->seq_ref, ref))) {
+        free(ds->seq);
+        ds->seq = faidx_fetch_seq64(ds->fai, ref, 0, HTS_POS_MAX, &len);
+        ds->seq_len = ds->seq ? len : 0;
+        ds->seq_ref = ref;
+        ds->gc_lo = ds->gc_hi = 0;
+        ds->gc = ds->acgt = 0;
+        if (!ds->seq)
+            print_error("depth", "No sequence for \"%s\" in the reference, "
+                        "skipping GC", ref);
+    }
+    if (pos >= ds->seq_len)
+        return -1;
+
+    lo = pos > DEPTH_GC_WIN/2 ? pos - DEPTH_GC_WIN/2 : 0;
+    hi = MIN(pos + DEPTH_GC_WIN/2, ds->seq_len);
+    if (lo >= ds->gc_hi || lo < ds->gc_lo) {
+        // Too far to slide
+        ds->gc_lo = ds->gc_hi = lo;
+        ds->gc = ds->acgt = 0;
+    }
+    for (; ds->gc_lo < lo; ds->gc_lo++)
+        depth_summ_gc_base(ds, ds->seq[ds->gc_lo], -1);
+    for (; ds->gc_hi < hi; ds->gc_hi++)
+        depth_summ_gc_base(ds, ds->seq[ds->gc_hi], +1);
+
+    return ds->acgt ? (100 * ds->gc + ds->acgt/2) / ds->acgt : -1;
+}
+
+// Add count positions from beg on ref with the depths in ds->depth.
+// Positions are added in sorted order; count > 1 is only used without GC.
+static int depth_summ_add(depth_summ *ds, FILE *out, const char *ref,
+                          hts_pos_t beg, hts_pos_t count) {
+    int n;
+
+    if (ds->ref != ref && (!ds->ref || strcmp(ds->ref, ref))) {
+        if (depth_summ_ref_end(ds, out) < 0)
+            return -1;
+        ds->ref = ref;
+    }
+
+    for (n = 0; n < ds->nfiles; n++) {
+        uint32_t d = ds->depth[n];
+        ds->hist[(size_t)n * DEPTH_SUMM_MAX
+                 + (d < DEPTH_SUMM_MAX ? d : DEPTH_SUMM_MAX-1)] += count;
+        ds->sum[n] += (uint64_t)d * count;
+        if (ds->max[n] < d)
+            ds->max[n] = d;
+    }
+
+    if (ds->fai) {
+        int gc = depth_summ_gc(ds, ref, beg);
+        if (gc >= 0) {
+            ds->gc_pos[gc]++;
+            for (n = 0; n < ds->nfiles; n++)
+                ds->gc_sum[n*101 + gc] += ds->depth[n];
+        }
+    }
+    return 0;
+}
+
+// Add zero depth for [beg,end) on ref, restricted to the BED regions
+static int depth_summ_add_zeros(depth_summ *ds, FILE *out, const char *ref,
+                                hts_pos_t beg, hts_pos_t end) {
+    hts_pair_pos_t whole = {beg, end}, *iv = &whole;
+    int r, j, n = 1;
+    hts_pos_t i;
+
+    memset(ds->depth, 0, ds->nfiles * sizeof(*ds->depth));
+    if (ds->use_bed) {
+        r = ds->last_reg;
+        if (r >= ds->n_reg || strcmp(ds->reg[r].reg, ref) != 0) {
+            for (r = 0; r < ds->n_reg; r++)
+                if (strcmp(ds->reg[r].reg, ref) == 0)
+                    break;
+            if (r == ds->n_reg)
+                return 0;
+            ds->last_reg = r;
+        }
+        iv = ds->reg[r].intervals;
+        n = ds->reg[r].count;
+    }
+
+    // First interval ending after beg
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (iv[mid].end <= beg)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (j = lo; j < n; j++) {
+        hts_pos_t s = MAX(iv[j].beg, beg), e = MIN(iv[j].end, end);
+        if (iv[j].beg >= end)
+            break;
+        if (s >= e)
+            continue;
+        if (!ds->fai) {
+            if (depth_summ_add(ds, out, ref, s, e - s) < 0)
+                return -1;
+            continue;
+        }
+        for (i = s; i < e; i++)
+            if (depth_summ_add(ds, out, ref, i, 1) < 0)
+                return -1;
+    }
+    return 0;
+}
+
+static int depth_summ_close(depth_summ *ds, FILE *out) {
+    int ret = 0, n, gc;
+
+    if (ds->hist && out) {
+        if (depth_summ_ref_end(ds, out) < 0 ||
+            depth_summ_print(ds, out, "*", ds->nfiles) < 0)
+            ret = -1;
+    }
+    if (ret == 0 && out && ds->gc_sum) {
+        for (n = 0; n < ds->nfiles; n++) {
+            for (gc = 0; gc <= 100; gc++) {
+                if (!ds->gc_pos[gc])
+                    continue;
+                if (fprintf(out, "GC\t%s\t%d\t%"PRIu64"\t%.2f\n", ds->fn[n],
+                            gc, ds->gc_pos[gc],
+                            (double)ds->gc_sum[n*101 + gc] / ds->gc_pos[gc])
+                    < 0) {
+                    print_error_errno("depth", "Failed to write output");
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+    }
+
+    free(ds->thresh);
+    free(ds->hist);
+    free(ds->sum);
+    free(ds->max);
+    free(ds->depth);
+    free(ds->gc_sum);
+    free(ds->seq);
+    if (ds->reg)
+        hts_reglist_free(ds->reg, ds->n_reg);
+    if (ds->fai)
+        fai_destroy(ds->fai);
+    ks_free(&ds->ks);
+    return ret;
+}
+
+static int zero_region(depth_opt *opt, depth_hist *dh,
+                       const char *name, hts_pos_t start, hts_pos_t end) {
     hts_pos_t i;
     kstring_t *ks = &dh->ks;
 
@@ -98,23 +734,51 @@ static void zero_region(depth_opt *opt, depth_hist *dh,
     if (dh->end >= 0 && end > dh->end)
         end = dh->end;
 
+    if (opt->run && !opt->bed) {
+        // A single interval, no need to visit each position
+        if (start >= end)
+            return 0;
+        memset(opt->run->next, 0, dh->nfiles * sizeof(*opt->run->next));
+        return depth_run_add(opt->run, opt->out, name, start, end);
+    }
+    if (opt->summ)
+        return depth_summ_add_zeros(opt->summ, opt->out, name, start, end);
+
     for (i = start; i < end; i++) {
-        // Could be optimised, but needs better API to skip to next
-        // bed region.
-        if (opt->bed && bed_overlap(opt->bed, name, i, i+1) == 0)
+        if (opt->bed && bed_overlap_sorted(opt->bed, &dh->bed_cur, name, i, i+1) == 0)
+            continue;
+
+        int n;
+        if (opt->bin) {
+            int row = depth_bin_add(opt->bin, name, i);
+            if (row < 0)
+                return -1;
+            for (n = 0; n < dh->nfiles; n++)
+                depth_bin_set(opt->bin, row, n, 0);
+            continue;
+        }
+        if (opt->run) {
+            memset(opt->run->next, 0, dh->nfiles * sizeof(*opt->run->next));
+            if (depth_run_add(opt->run, opt->out, name, i, i+1) < 0)
+                return -1;
             continue;
+        }
 
         ks->l = cur_l;
         kputll(i+1,  ks);
-        int n;
         for (n = 0; n < dh->nfiles; n++) {
             kputc_('\t', ks);
             kputc_('0',  ks);
         }
         kputc('\n',  ks);
-        fputs(ks->s, opt->out);
+        if (depth_write(opt, ks->s, ks->l) < 0) {
+            print_error_errno("depth", "Failed to write output");
+            return -1;
+        }
     }
     ks->l = cur_l;
+
+    return 0;
 }
 
 // A variation of bam_cigar2qlen which doesn't count soft-clips in to the
@@ -195,6 +859,96 @@ incr_hist_qual(int *hist, uint8_t *qual, int min_qual, int oplen) {
 }
 
 // Adds the depth for a single read to a depth_hist struct.
+// Output the depths for positions from "from" up to "to" on the current
+// reference, stopping early where no file has any more data.  Returns the
+// position reached, or -1 on error.
+//
+// The histograms are per file, which keeps the per-read increments
+// contiguous.  Rows need one value from each, so with many files that
+// would be a scattered read per value.  Instead positions are taken in
+// blocks of DEPTH_BLOCK, transposed file by file into a position-major
+// matrix, and then emitted row by row with the text for the whole block
+// written at once.
+#define DEPTH_BLOCK 1024
+static hts_pos_t flush_depth(depth_opt *opt, depth_hist *dh,
+                             hts_pos_t from, hts_pos_t to) {
+    size_t hmask = dh->size-1, ref_len = strlen(dh->ref);
+    int n, nfiles = dh->nfiles;
+    hts_pos_t p0, k, stop = 0;
+
+    for (n = 0; n < nfiles; n++)
+        if (stop < dh->end_pos[n])
+            stop = dh->end_pos[n];
+    stop = MIN(stop, to);
+    if (stop <= from)
+        return from;
+
+    if (!dh->blk &&
+        !(dh->blk = malloc((size_t)DEPTH_BLOCK * nfiles * sizeof(*dh->blk)))) {
+        print_error_errno("depth", "Out of memory");
+        return -1;
+    }
+
+    for (p0 = from; p0 < stop; p0 += DEPTH_BLOCK) {
+        hts_pos_t nb = MIN(DEPTH_BLOCK, stop - p0);
+        uint32_t *blk = dh->blk;
+
+        for (n = 0; n < nfiles; n++) {
+            const int *hist = dh->hist[n];
+            hts_pos_t valid = MAX(0, MIN(nb, dh->end_pos[n] - p0));
+            for (k = 0; k < valid; k++)
+                blk[k*nfiles + n] = hist[(p0+k) & hmask];
+            for (; k < nb; k++)
+                blk[k*nfiles + n] = 0;
+        }
+
+        kstring_t *ks = ks_clear(&dh->rows);
+        for (k = 0; k < nb; k++) {
+            hts_pos_t i = p0 + k;
+            const uint32_t *row = &blk[k*nfiles];
+
+            if (opt->bed && bed_overlap_sorted(opt->bed, &dh->bed_cur, dh->ref, i, i+1) == 0)
+                continue;
+
+            if (opt->bin) {
+                int r = depth_bin_add(opt->bin, dh->ref, i);
+                if (r < 0)
+                    return -1;
+                for (n = 0; n < nfiles; n++)
+                    depth_bin_set(opt->bin, r, n, row[n]);
+                continue;
+            }
+            if (opt->run) {
+                memcpy(opt->run->next, row, nfiles * sizeof(*row));
+                if (depth_run_add(opt->run, opt->out, dh->ref, i, i+1) < 0)
+                    return -1;
+                continue;
+            }
+            if (opt->summ) {
+                memcpy(opt->summ->depth, row, nfiles * sizeof(*row));
+                if (depth_summ_add(opt->summ, opt->out, dh->ref, i, 1) < 0)
+                    return -1;
+                continue;
+            }
+
+            kputsn(dh->ref, ref_len, ks);
+            kputc_('\t', ks);
+            kputll(i+1, ks);
+            for (n = 0; n < nfiles; n++) {
+                kputc_('\t', ks);
+                kputuw(row[n], ks);
+            }
+            kputc('\n', ks);
+        }
+        if (ks->l && depth_write(opt, ks->s, ks->l) < 0) {
+            print_error_errno("depth", "Failed to write output");
+            return -1;
+        }
+    }
+
+    return stop;
+}
+
 // For just one file, this is easy.  We just have a circular buffer
 // where we increment values for bits that overlap existing data
 // and initialise values for coordinates which we're seeing for the first
@@ -217,37 +971,14 @@ static int add_depth(depth_opt *opt, depth_hist *dh, sam_hdr_t *h, bam1_t *b,
         if (dh->last_ref >= 0) {
             // do end
             size_t cur_l = dh->ks.l;
-            int nf = dh->nfiles;
-            i = dh->last_output;
-            for (i = dh->last_output; nf; i++) {
-                nf = 0;
-                for (n = 0; n < dh->nfiles; n++) {
-                    if (i < dh->end_pos[n])
-                        nf++;
-                }
-                if (!nf)
-                    break;
-
-                if (opt->bed && bed_overlap(opt->bed, dh->ref, i, i+1) == 0)
-                    continue;
-
-                dh->ks.l = cur_l;
-                kputll(i+1, &dh->ks);
-                for (n = 0; n < dh->nfiles; n++) {
-                    kputc_('\t', &dh->ks);
-                    int d = i < dh->end_pos[n]
-                        ? dh->hist[n][i & hmask]
-                        : 0;
-                    kputuw(d, &dh->ks);
-                }
-                kputc('\n', &dh->ks);
-                fputs(dh->ks.s, opt->out);
-            }
+            if ((i = flush_depth(opt, dh, dh->last_output, HTS_POS_MAX)) < 0)
+                return -1;
             if (opt->all_pos) {
                 // End of last ref
-                zero_region(opt, dh,
-                            sam_hdr_tid2name(h, dh->last_ref),
-                            i, sam_hdr_tid2len(h, dh->last_ref));
+                if (zero_region(opt, dh,
+                                sam_hdr_tid2name(h, dh->last_ref),
+                                i, sam_hdr_tid2len(h, dh->last_ref)) < 0)
+                    return -1;
             }
             dh->ks.l = cur_l;
         }
@@ -257,17 +988,19 @@ static int add_depth(depth_opt *opt, depth_hist *dh, sam_hdr_t *h, bam1_t *b,
             int lr = dh->last_ref < 0 ? 0 : dh->last_ref+1;
             int rr = b ? b->core.tid : sam_hdr_nref(h), r;
             for (r = lr; r < rr; r++)
-                zero_region(opt, dh,
-                            sam_hdr_tid2name(h, r),
-                            0, sam_hdr_tid2len(h, r));
+                if (zero_region(opt, dh,
+                                sam_hdr_tid2name(h, r),
+                                0, sam_hdr_tid2len(h, r)) < 0)
+                    return -1;
         }
 
         if (!b) {
             // we're just flushing to end of file
             if (opt->all_pos && opt->reg && dh->last_ref < 0)
                 // -a or -aa without a single read being output yet
-                zero_region(opt, dh, sam_hdr_tid2name(h, dh->tid), dh->beg,
-                            MIN(dh->end, sam_hdr_tid2len(h, dh->tid)));
+                return zero_region(opt, dh, sam_hdr_tid2name(h, dh->tid),
+                                   dh->beg,
+                                   MIN(dh->end, sam_hdr_tid2len(h, dh->tid)));
 
             return 0;
         }
@@ -284,39 +1017,18 @@ static int add_depth(depth_opt *opt, depth_hist *dh, sam_hdr_t *h, bam1_t *b,
 
         if (opt->all_pos)
             // Start of ref
-            zero_region(opt, dh, dh->ref, 0, b->core.pos);
+            if (zero_region(opt, dh, dh->ref, 0, b->core.pos) < 0)
+                return -1;
     } else {
         if (dh->last_output < b->core.pos) {
             // Flush any depth outputs up to start of new read
             size_t cur_l = dh->ks.l;
-            int nf = dh->nfiles;
-            for (i = dh->last_output; i < b->core.pos; i++) {
-                nf = 0;
-                for (n = 0; n < dh->nfiles; n++) {
-                    if (i < dh->end_pos[n])
-                        nf++;
-                }
-                if (!nf)
-                    break;
-
-                if (opt->bed && bed_overlap(opt->bed, dh->ref, i, i+1) == 0)
-                    continue;
-
-                dh->ks.l = cur_l;
-                kputll(i+1, &dh->ks);
-                for (n = 0; n < dh->nfiles; n++) {
-                    kputc_('\t', &dh->ks);
-                    int d = i < dh->end_pos[n]
-                        ? dh->hist[n][i & hmask]
-                        : 0;
-                    kputuw(d, &dh->ks);
-                }
-                kputc('\n', &dh->ks);
-                fputs(dh->ks.s, opt->out);
-            }
+            if ((i = flush_depth(opt, dh, dh->last_output, b->core.pos)) < 0)
+                return -1;
             if (opt->all_pos && i < b->core.pos)
                 // Hole in middle of ref
-                zero_region(opt, dh, dh->ref, i, b->core.pos);
+                if (zero_region(opt, dh, dh->ref, i, b->core.pos) < 0)
+                    return -1;
 
             dh->ks.l = cur_l;
             dh->last_output = b->core.pos;
@@ -487,6 +1199,7 @@ static int fastdepth_core(depth_opt *opt, uint32_t nfiles, char **fn,
     int ret = -1, err = 1, i;
     olap_hash_t **overlaps = NULL;
     depth_hist dh = {0};
+    uint64_t n_used = 0;
 
     // An array of bam structs, one per input file, to hold the next entry
     bam1_t **b = calloc(nfiles, sizeof(*b));
@@ -527,8 +1240,9 @@ static int fastdepth_core(depth_opt *opt, uint32_t nfiles, char **fn,
         dh.end = itr[0]->end;
     }
 
-    if (opt->header) {
-        fprintf(opt->out, "#CHROM\tPOS");
+    // The binary format carries the file names in its own header
+    if (opt->header && !opt->bin && !opt->summ) {
+        fprintf(opt->out, opt->run ? "#CHROM\tSTART\tEND" : "#CHROM\tPOS");
         for (i = 0; i < nfiles; i++)
             fprintf(opt->out, "\t%s", fn[i]);
         fputc('\n', opt->out);
@@ -626,6 +1340,7 @@ static int fastdepth_core(depth_opt *opt, uint32_t nfiles, char **fn,
             ret = -1;
             goto err;
         }
+        n_used++;
 
         // Populate next record from this file
         for(;!finished[i];) {
@@ -665,6 +1380,7 @@ static int fastdepth_core(depth_opt *opt, uint32_t nfiles, char **fn,
     // Tidy up end.
     ret = add_depth(opt, &dh, h[0], NULL, 0, 0);
     err = 0;
+    opt->n_used += n_used;
 
  err:
     if (ret == 0 && err)
@@ -679,6 +1395,8 @@ static int fastdepth_core(depth_opt *opt, uint32_t nfiles, char **fn,
     free(b);
     free(finished);
     ks_free(&dh.ks);
+    ks_free(&dh.rows);
+    free(dh.blk);
     free(dh.hist);
     free(dh.end_pos);
     if (overlaps) {
@@ -697,6 +1415,301 @@ static int fastdepth_core(depth_opt *opt, uint32_t nfiles, char **fn,
     return ret;
 }
 
+// Only the fields the depth needs are decoded from CRAM
+static int depth_set_fields(const depth_opt *opt, samFile *fp) {
+    if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS,
+                    SAM_FLAG | SAM_RNAME | SAM_POS | SAM_CIGAR
+                    | (opt->remove_overlaps ? SAM_QNAME|SAM_RNEXT|SAM_PNEXT
+                                            : 0)
+                    | (opt->min_mqual       ? SAM_MAPQ  : 0)
+                    | (opt->min_len         ? SAM_SEQ   : 0)
+                    | (opt->min_qual        ? SAM_QUAL  : 0))) {
+        fprintf(stderr, "Failed to set CRAM_OPT_REQUIRED_FIELDS value\n");
+        return -1;
+    }
+
+    if (hts_set_opt(fp, CRAM_OPT_DECODE_MD, 0)) {
+        fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Sharded depth (--shard-size).  The references, or the -r region, are
+ * split into fixed-size shards which are run through fastdepth_core() on
+ * a thread pool, each with its own iterators, as if given by -r.  The
+ * text of each shard is kept in memory and written out in order.
+ *
+ * Each worker takes a set of open inputs and indices from a shared list
+ * rather than opening the files for every shard.  As every shard is a
+ * region, -a without a second -a (which depends on whether a reference
+ * has any reads at all) and the formats carrying state from one position
+ * to the next (--binary, --bedgraph and --summary) are not supported.
+ */
+typedef struct {
+    samFile **fp;
+    sam_hdr_t **h;
+    hts_idx_t **idx;
+    hts_itr_t **itr;
+} depth_reader;
+
+typedef struct {
+    const depth_opt *opt;
+    const htsFormat *in_fmt;
+    int nfiles;
+    char **fn, **fn_idx;
+    depth_reader *r;
+    int *avail, navail;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} depth_readers;
+
+typedef struct {
+    depth_readers *readers;
+    int tid;
+    hts_pos_t beg, end;
+    kstring_t out;
+    uint64_t n_used;
+    int ret;
+} depth_shard;
+
+static void depth_reader_close(depth_readers *rd, depth_reader *r) {
+    int i;
+    for (i = 0; r->fp && r->h && r->idx && r->itr && i < rd->nfiles; i++) {
+        if (r->fp[i])
+            sam_close(r->fp[i]);
+        if (r->h[i])
+            sam_hdr_destroy(r->h[i]);
+        if (r->idx[i])
+            hts_idx_destroy(r->idx[i]);
+    }
+    free(r->fp);
+    free(r->h);
+    free(r->idx);
+    free(r->itr);
+    memset(r, 0, sizeof(*r));
+}
+
+static int depth_reader_open(depth_readers *rd, depth_reader *r) {
+    int i;
+
+    if (!(r->fp     = calloc(rd->nfiles, sizeof(*r->fp)))
+        || !(r->h   = calloc(rd->nfiles, sizeof(*r->h)))
+        || !(r->idx = calloc(rd->nfiles, sizeof(*r->idx)))
+        || !(r->itr = calloc(rd->nfiles, sizeof(*r->itr))))
+        goto err;
+
+    for (i = 0; i < rd->nfiles; i++) {
+        if (!(r->fp[i] = sam_open_format(rd->fn[i], "r", rd->in_fmt))) {
+            print_error_errno("depth", "Cannot open input file \"%s\"",
+                              rd->fn[i]);
+            goto err;
+        }
+        if (depth_set_fields(rd->opt, r->fp[i]) < 0)
+            goto err;
+        if (!(r->h[i] = sam_hdr_read(r->fp[i]))) {
+            print_error("depth", "Failed to read header for \"%s\"",
+                        rd->fn[i]);
+            goto err;
+        }
+        r->idx[i] = rd->fn_idx
+            ? sam_index_load2(r->fp[i], rd->fn[i], rd->fn_idx[i])
+            : sam_index_load(r->fp[i], rd->fn[i]);
+        if (!r->idx[i]) {
+            print_error("depth", "cannot load index for \"%s\"", rd->fn[i]);
+            goto err;
+        }
+    }
+    return 0;
+
+ err:
+    depth_reader_close(rd, r);
+    return -1;
+}
+
+static depth_reader *depth_reader_get(depth_readers *rd) {
+    depth_reader *r;
+    pthread_mutex_lock(&rd->lock);
+    while (!rd->navail)
+        pthread_cond_wait(&rd->cond, &rd->lock);
+    r = &rd->r[rd->avail[--rd->navail]];
+    pthread_mutex_unlock(&rd->lock);
+    return r;
+}
+
+static void depth_reader_put(depth_readers *rd, depth_reader *r) {
+    pthread_mutex_lock(&rd->lock);
+    rd->avail[rd->navail++] = r - rd->r;
+    pthread_cond_signal(&rd->cond);
+    pthread_mutex_unlock(&rd->lock);
+}
+
+static void *depth_shard_run(void *arg) {
+    depth_shard *c = (depth_shard *)arg;
+    depth_readers *rd = c->readers;
+    depth_reader *r = depth_reader_get(rd);
+    depth_opt opt = *rd->opt;
+    int i, ret = -1;
+
+    ks_clear(&c->out);
+    opt.out = NULL;
+    opt.ks_out = &c->out;
+    opt.header = 0;
+    opt.reg = "shard"; // fastdepth_core() only checks for a region
+    opt.n_used = 0;
+
+    if (!r->fp && depth_reader_open(rd, r) < 0)
+        goto out;
+
+    // Like the main loop, this assumes the inputs share their references
+    for (i = 0; i < rd->nfiles; i++)
+        if (!(r->itr[i] = sam_itr_queryi(r->idx[i], c->tid, c->beg, c->end)))
+            goto out;
+
+    ret = fastdepth_core(&opt, rd->nfiles, rd->fn, r->fp, r->itr, r->h);
+
+ out:
+    for (i = 0; r->itr && i < rd->nfiles; i++) {
+        if (r->itr[i])
+            hts_itr_destroy(r->itr[i]);
+        r->itr[i] = NULL;
+    }
+    depth_reader_put(rd, r);
+    c->n_used = opt.n_used;
+    c->ret = ret;
+    return c;
+}
+
+/*
+ * Computes the depth of tid0:beg0-end0, or of every reference if there is
+ * no region, in shards of shard_size on nthreads threads.
+ * Returns 0 on success, -1 on failure.
+ */
+static int depth_sharded(depth_opt *opt, int nfiles, char **fn,
+                         char **fn_idx, const htsFormat *in_fmt,
+                         sam_hdr_t *h, int tid0, hts_pos_t beg0,
+                         hts_pos_t end0, hts_pos_t shard_size,
+                         int nthreads) {
+    int nslot = 2 * nthreads, next = 0, in_flight = 0, ret = -1, i;
+    int tid = opt->reg ? tid0 : 0;
+    int tid_end = opt->reg ? tid0 + 1 : sam_hdr_nref(h);
+    hts_pos_t cbeg = -1;
+    depth_readers rd = { opt, in_fmt, nfiles, fn, fn_idx };
+    depth_shard *shards = NULL;
+    hts_tpool *pool = NULL;
+    hts_tpool_process *q = NULL;
+
+    pthread_mutex_init(&rd.lock, NULL);
+    pthread_cond_init(&rd.cond, NULL);
+    if (!(rd.r = calloc(nthreads, sizeof(*rd.r)))
+        || !(rd.avail = malloc(nthreads * sizeof(*rd.avail)))
+        || !(shards = calloc(nslot, sizeof(*shards)))) {
+        print_error_errno("depth", "Out of memory");
+        goto err;
+    }
+    for (rd.navail = 0; rd.navail < nthreads; rd.navail++)
+        rd.avail[rd.navail] = rd.navail;
+    for (i = 0; i < nslot; i++)
+        shards[i].readers = &rd;
+
+    if (!(pool = hts_tpool_init(nthreads))
+        || !(q = hts_tpool_process_init(pool, nslot, 0))) {
+        print_error_errno("depth", "Failed to set up the thread pool");
+        goto err;
+    }
+
+    if (opt->header) {
+        kstring_t ks = KS_INITIALIZE;
+        kputs("#CHROM\tPOS", &ks);
+        for (i = 0; i < nfiles; i++) {
+            kputc('\t', &ks);
+            kputs(fn[i], &ks);
+        }
+        kputc('\n', &ks);
+        i = depth_write(opt, ks.s, ks.l);
+        ks_free(&ks);
+        if (i < 0) {
+            print_error_errno("depth", "Failed to write output");
+            goto err;
+        }
+    }
+
+    for (;;) {
+        // Queue shards, one reference after another
+        while (tid < tid_end && in_flight < nslot) {
+            const char *name = sam_hdr_tid2name(h, tid);
+            hts_pos_t len = sam_hdr_tid2len(h, tid);
+            hts_pos_t beg = opt->reg ? beg0 : 0;
+            hts_pos_t end = opt->reg ? MIN(end0, len) : len;
+            if (cbeg < 0) {
+                if (beg >= end || (opt->bed
+                                   && !bed_overlap(opt->bed, name, beg, end))) {
+                    tid++; // nothing to report
+                    continue;
+                }
+                cbeg = beg;
+            }
+            depth_shard *c = &shards[next];
+            c->tid = tid;
+            c->beg = cbeg;
+            c->end = MIN(cbeg + shard_size, end);
+            if (c->end >= end) {
+                tid++;
+                cbeg = -1;
+            } else {
+                cbeg = c->end;
+            }
+            if (opt->bed && !bed_overlap(opt->bed, name, c->beg, c->end))
+                continue;
+            if (hts_tpool_dispatch(pool, q, depth_shard_run, c) < 0)
+                goto err;
+            next = (next + 1) % nslot;
+            in_flight++;
+        }
+        if (!in_flight)
+            break;
+
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        if (!res)
+            goto err;
+        depth_shard *c = (depth_shard *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+        if (c->ret < 0) {
+            print_error("depth", "error reading from input file");
+            goto err;
+        }
+        opt->n_used += c->n_used;
+        if (c->out.l && depth_write(opt, c->out.s, c->out.l) < 0) {
+            print_error_errno("depth", "Failed to write output");
+            goto err;
+        }
+    }
+
+    ret = 0;
+ err:
+    if (q)
+        hts_tpool_process_destroy(q);
+    if (pool)
+        hts_tpool_destroy(pool);
+    if (shards) {
+        for (i = 0; i < nslot; i++)
+            ks_free(&shards[i].out);
+        free(shards);
+    }
+    if (rd.r) {
+        for (i = 0; i < nthreads; i++)
+            depth_reader_close(&rd, &rd.r[i]);
+        free(rd.r);
+    }
+    free(rd.avail);
+    pthread_mutex_destroy(&rd.lock);
+    pthread_cond_destroy(&rd.cond);
+    return ret;
+}
+
 static void usage_exit(FILE *fp, int exit_status)
 {
     fprintf(fp, "Usage: samtools depth [options] in.bam [in.bam ...]\n");
@@ -718,13 +1731,31 @@ static void usage_exit(FILE *fp, int exit_status)
     fprintf(fp, "  -H           Print a file header line\n");
     fprintf(fp, "  -l INT       Minimum read length [0]\n");
     fprintf(fp, "  -o FILE      Write output to FILE [stdout]\n");
+    fprintf(fp, "      --bedgraph\n");
+    fprintf(fp, "               Output intervals of unchanged depth, as CHROM, 0-based\n"
+                "               START, END and depths\n");
+    fprintf(fp, "      --binary\n");
+    fprintf(fp, "               Write BGZF compressed binary depth columns, indexed\n"
+                "               in FILE.idx when -o FILE is used\n");
+    fprintf(fp, "      --summary\n");
+    fprintf(fp, "               Only write per reference and overall depth statistics\n"
+                "               (implies -a)\n");
+    fprintf(fp, "      --thresholds LIST\n");
+    fprintf(fp, "               Depths to report the percentage of positions at or\n"
+                "               above, for --summary [1,10,20,30,50,100]\n");
+    fprintf(fp, "      --summary-gc\n");
+    fprintf(fp, "               As --summary, adding mean depth by GC content of the\n"
+                "               --reference\n");
     fprintf(fp, "  -q, --min-BQ INT\n"
                 "               Filter bases with base quality smaller than INT [0]\n");
     fprintf(fp, "  -Q, --min-MQ INT\n"
                 "               Filter alignments with mapping quality smaller than INT [0]\n");
     fprintf(fp, "  -J           Include reads with deletions in depth computation\n");
     fprintf(fp, "  -s           Do not count overlapping reads within a template\n");
-    sam_global_opt_help(fp, "-.--.@-.");
+    fprintf(fp, "      --shard-size INT\n");
+    fprintf(fp, "               Work on the references in shards of INT bases, in\n"
+                "               parallel with -@, needs indexed inputs [0, off]\n");
+    sam_global_opt_help(fp, "-.--.@-..");
     exit(exit_status);
 }
 
@@ -736,6 +1767,12 @@ int main_depth(int argc, char *argv[])
     int c, has_index_file = 0;
     char *file_list = NULL, **fn = NULL;
     char *out_file = NULL;
+    int binary = 0, bedgraph = 0, summary = 0, summary_gc = 0;
+    hts_pos_t shard_size = 0;
+    const char *thresholds = "1,10,20,30,50,100";
+    depth_bin bin = {0};
+    depth_run run = {0};
+    depth_summ summ = {0};
     depth_opt opt = {
         .flag = BAM_FUNMAP | BAM_FSECONDARY | BAM_FDUP | BAM_FQCFAIL,
         .incl_flag = 0,
@@ -746,10 +1783,15 @@ int main_depth(int argc, char *argv[])
         .header = 0,
         .min_len = 0,
         .out = stdout,
+        .ks_out = NULL,
+        .bin = NULL,
+        .run = NULL,
+        .summ = NULL,
         .all_pos = 0,
         .remove_overlaps = 0,
         .reg = NULL,
         .bed = NULL,
+        .n_used = 0,
     };
 
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
@@ -761,7 +1803,13 @@ int main_depth(int argc, char *argv[])
         {"excl-flags",    required_argument, NULL, 'G'},
         {"incl-flags",    required_argument, NULL, 1},
         {"require-flags", required_argument, NULL, 2},
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '@'),
+        {"binary",        no_argument,       NULL, 3},
+        {"bedgraph",      no_argument,       NULL, 4},
+        {"summary",       no_argument,       NULL, 5},
+        {"thresholds",    required_argument, NULL, 6},
+        {"summary-gc",    no_argument,       NULL, 7},
+        {"shard-size",    required_argument, NULL, 8},
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '@', 0, '-'),
         {NULL, 0, NULL, 0}
     };
 
@@ -851,15 +1899,41 @@ int main_depth(int argc, char *argv[])
             break;
 
         case 'o':
-            if (opt.out != stdout)
-                break;
-            opt.out = fopen(out_file = optarg, "w");
-            if (!opt.out) {
-                print_error_errno("depth", "Cannot open \"%s\" for writing.",
-                                  optarg);
-                return EXIT_FAILURE;
+            if (!out_file)
+                out_file = optarg;
+            break;
+
+        case 3:
+            binary = 1;
+            break;
+
+        case 4:
+            bedgraph = 1;
+            break;
+
+        case 5:
+            summary = 1;
+            break;
+
+        case 6:
+            thresholds = optarg;
+            break;
+
+        case 7:
+            summary = summary_gc = 1;
+            break;
+
+        case 8: {
+            char *end;
+            errno = 0;
+            long long v = strtoll(optarg, &end, 10);
+            if (errno || end == optarg || *end || v < 1) {
+                print_error("depth", "Invalid --shard-size \"%s\"", optarg);
+                return 1;
             }
+            shard_size = v;
             break;
+        }
 
         case 'r':
             opt.reg = optarg;
@@ -887,6 +1961,40 @@ int main_depth(int argc, char *argv[])
             usage_exit(stderr, EXIT_FAILURE);
     }
 
+    if (binary + bedgraph + summary > 1) {
+        print_error("depth", "Only one of --binary, --bedgraph and --summary "
+                    "may be used");
+        return 1;
+    }
+    if (summary_gc && !ga.reference) {
+        print_error("depth", "--summary-gc needs a --reference file");
+        return 1;
+    }
+    // Zero depth positions are part of the distribution
+    if (summary && !opt.all_pos)
+        opt.all_pos = 1;
+    if (shard_size && (binary || bedgraph || summary)) {
+        print_error("depth", "--shard-size cannot be used with --binary, "
+                    "--bedgraph or --summary");
+        return 1;
+    }
+    if (shard_size && opt.all_pos == 1) {
+        print_error("depth", "--shard-size needs -aa rather than -a");
+        return 1;
+    }
+
+    if (sam_prof_init(&ga, "depth") < 0)
+        return 1;
+
+    if (out_file && !binary) {
+        opt.out = fopen(out_file, "w");
+        if (!opt.out) {
+            print_error_errno("depth", "Cannot open \"%s\" for writing.",
+                              out_file);
+            return EXIT_FAILURE;
+        }
+    }
+
     if (file_list) {
         if (has_index_file) {
             print_error("depth", "The -f option cannot be combined with -X");
@@ -933,21 +2041,8 @@ int main_depth(int argc, char *argv[])
         if (ga.nthreads > 0)
             hts_set_threads(fp[i], ga.nthreads);
 
-        if (hts_set_opt(fp[i], CRAM_OPT_REQUIRED_FIELDS,
-                        SAM_FLAG | SAM_RNAME | SAM_POS | SAM_CIGAR
-                        | (opt.remove_overlaps ? SAM_QNAME|SAM_RNEXT|SAM_PNEXT
-                                               : 0)
-                        | (opt.min_mqual       ? SAM_MAPQ  : 0)
-                        | (opt.min_len         ? SAM_SEQ   : 0)
-                        | (opt.min_qual        ? SAM_QUAL  : 0))) {
-            fprintf(stderr, "Failed to set CRAM_OPT_REQUIRED_FIELDS value\n");
+        if (depth_set_fields(&opt, fp[i]) < 0)
             return 1;
-        }
-
-        if (hts_set_opt(fp[i], CRAM_OPT_DECODE_MD, 0)) {
-            fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
-            return 1;
-        }
 
         // FIXME: what if headers differ?
         header[i] = sam_hdr_read(fp[i]);
@@ -974,10 +2069,62 @@ int main_depth(int argc, char *argv[])
         }
     }
 
-    int ret = fastdepth_core(&opt, nfiles, &argv[argc-nfiles], fp, itr, header)
-        ? 1 : 0;
+    if (binary) {
+        opt.bin = &bin;
+        if (depth_bin_open(&bin, out_file, nfiles, &argv[argc-nfiles],
+                           ga.nthreads) < 0) {
+            depth_bin_close(&bin);
+            return 1;
+        }
+    }
+
+    if (bedgraph) {
+        opt.run = &run;
+        if (depth_run_init(&run, nfiles) < 0) {
+            depth_run_close(&run, opt.out);
+            return 1;
+        }
+    }
+
+    if (summary) {
+        opt.summ = &summ;
+        if (depth_summ_init(&summ, opt.out, nfiles, &argv[argc-nfiles],
+                            thresholds, opt.bed,
+                            summary_gc ? ga.reference : NULL) < 0) {
+            depth_summ_close(&summ, NULL);
+            return 1;
+        }
+    }
+
+    int st_records = sam_prof_stage("records"), st_finish = sam_prof_stage("finish");
+    sam_prof_begin(st_records);
+    int ret;
+    if (shard_size) {
+        char **in_fn = &argv[optind-nfiles];
+        ret = depth_sharded(&opt, nfiles, in_fn,
+                            has_index_file ? &argv[optind] : NULL,
+                            &ga.in, header[0],
+                            itr ? itr[0]->tid : -1, itr ? itr[0]->beg : 0,
+                            itr ? itr[0]->end : HTS_POS_MAX, shard_size,
+                            MAX(ga.nthreads, 1)) ? 1 : 0;
+    } else {
+        ret = fastdepth_core(&opt, nfiles, &argv[argc-nfiles], fp, itr, header)
+            ? 1 : 0;
+    }
+    sam_prof_add("records_used", opt.n_used);
+    sam_prof_end(st_records);
+
+    sam_prof_begin(st_finish);
+    if (opt.bin && depth_bin_close(opt.bin) < 0)
+        ret = 1;
+    if (opt.run && depth_run_close(opt.run, opt.out) < 0)
+        ret = 1;
+    if (opt.summ && depth_summ_close(opt.summ, ret ? NULL : opt.out) < 0)
+        ret = 1;
+    sam_prof_end(st_finish);
 
     for (i = 0; i < nfiles; i++) {
+        sam_prof_file("bytes_in", fp[i]);
         sam_hdr_destroy(header[i]);
         sam_close(fp[i]);
         if (itr && itr[i])
@@ -29,6 +29,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include "samtools.h"
 #include "htslib/thread_pool.h"
 #include "sam_opts.h"
+#include "sam_utils.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -65,7 +66,10 @@ struct state {
     samFile* output_file;
     sam_hdr_t* output_header;
     char* rg_id;
-    void (*mode_func)(const state_t*, bam1_t*);
+    uint8_t* rg_aux;    // RG:Z:rg_id, encoded as in bam aux data
+    size_t rg_aux_len;
+    auxhash_t rg_tag;   // SET holding just RG
+    int (*mode_func)(const state_t*, bam1_t*);
 };
 
 static void cleanup_opts(parsed_opts_t* opts)
@@ -84,6 +88,8 @@ static void cleanup_state(state_t* state)
 {
     if (!state) return;
     free(state->rg_id);
+    free(state->rg_aux);
+    if (state->rg_tag) kh_destroy(aux_exists, state->rg_tag);
     if (state->output_file) sam_close(state->output_file);
     sam_hdr_destroy(state->output_header);
     if (state->input_file) sam_close(state->input_file);
@@ -196,7 +202,7 @@ static bool parse_args(int argc, char** argv, parsed_opts_t** opts)
     retval->mode = overwrite_all;
     sam_global_args_init(&retval->ga);
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS(0, 0, 'O', 0, 0, '@'),
+        SAM_OPT_GLOBAL_OPTIONS(0, 0, 'O', 0, 0, '@', '-', '-'),
         {"no-PG", no_argument, NULL, 1},
         { NULL, 0, NULL, 0 }
     };
@@ -297,30 +303,21 @@ static bool parse_args(int argc, char** argv, parsed_opts_t** opts)
     return true;
 }
 
-static void overwrite_all_func(const state_t* state, bam1_t* file_read)
+static int overwrite_all_func(const state_t* state, bam1_t* file_read)
 {
-    uint8_t* data = (uint8_t*)strdup(state->rg_id);
-    int len = strlen(state->rg_id)+1;
-    // If the old exists delete it
-    uint8_t* old = bam_aux_get(file_read, "RG");
-    if (old != NULL) {
-        bam_aux_del(file_read, old);
-    }
-
-    bam_aux_append(file_read, "RG", 'Z', len, data);
-    free(data);
+    // Drop any old RG and add ours on the end
+    return rewrite_aux(file_read, NULL, state->rg_tag,
+                       state->rg_aux, state->rg_aux_len);
 }
 
-static void orphan_only_func(const state_t* state, bam1_t* file_read)
+static int orphan_only_func(const state_t* state, bam1_t* file_read)
 {
-    uint8_t* data = (uint8_t*)strdup(state->rg_id);
-    int len = strlen(state->rg_id)+1;
     // If the old exists don't do anything
     uint8_t* old = bam_aux_get(file_read, "RG");
-    if (old == NULL) {
-        bam_aux_append(file_read, "RG",'Z',len,data);
-    }
-    free(data);
+    if (old == NULL)
+        return rewrite_aux(file_read, NULL, NULL,
+                           state->rg_aux, state->rg_aux_len);
+    return 0;
 }
 
 static bool init(const parsed_opts_t* opts, state_t** state_out) {
@@ -409,6 +406,21 @@ static bool init(const parsed_opts_t* opts, state_t** state_out) {
         }
     }
 
+    if (!retval->rg_id) {
+        fprintf(stderr, "[init] Out of memory.\n");
+        return false;
+    }
+    // Encode the tag once here rather than for every read
+    size_t id_len = strlen(retval->rg_id) + 1;
+    retval->rg_aux_len = id_len + 3;
+    retval->rg_aux = malloc(retval->rg_aux_len);
+    if (!retval->rg_aux || parse_aux_list(&retval->rg_tag, "RG", "[init]")) {
+        fprintf(stderr, "[init] Out of memory.\n");
+        return false;
+    }
+    memcpy(retval->rg_aux, "RGZ", 3);
+    memcpy(retval->rg_aux + 3, retval->rg_id, id_len);
+
     switch (opts->mode) {
         case overwrite_all:
             retval->mode_func = &overwrite_all_func;
@@ -421,6 +433,123 @@ static bool init(const parsed_opts_t* opts, state_t** state_out) {
     return true;
 }
 
+// With threads, records are read and written here in batches, and the
+// tag edits of each batch are done by the thread pool.  Results come back
+// in dispatch order, so the output order is unchanged.
+#define RG_BATCH_SIZE 1024
+
+typedef struct {
+    const state_t* state;
+    bam1_t* b[RG_BATCH_SIZE];
+    int n;
+    int ret;
+} rg_batch_t;
+
+static void *rg_batch_func(void *arg)
+{
+    rg_batch_t* bt = (rg_batch_t*)arg;
+    int i;
+    bt->ret = 0;
+    for (i = 0; i < bt->n; i++) {
+        if (bt->state->mode_func(bt->state, bt->b[i]) < 0) {
+            bt->ret = -1;
+            break;
+        }
+    }
+    return bt;
+}
+
+// Returns 0 on success,
+//        -1 on read error,
+//        -2 on other errors (already reported)
+static int readgroupise_threaded(parsed_opts_t *opts, state_t* state)
+{
+    int nbatch = 2 * hts_tpool_size(opts->p.pool), next = 0, in_flight = 0;
+    int r = 0, err = 0, i, j;
+    rg_batch_t* batch = calloc(nbatch, sizeof(*batch));
+    hts_tpool_process* q = NULL;
+
+    if (!batch)
+        goto nomem;
+    for (i = 0; i < nbatch; i++) {
+        batch[i].state = state;
+        for (j = 0; j < RG_BATCH_SIZE; j++)
+            if (!(batch[i].b[j] = bam_init1()))
+                goto nomem;
+    }
+
+    // The ring of batches is no larger than the queue, so dispatching
+    // never waits on results we have yet to collect.
+    if (!(q = hts_tpool_process_init(opts->p.pool, nbatch, 0)))
+        goto nomem;
+
+    for (;;) {
+        while (r >= 0 && !err && in_flight < nbatch) {
+            rg_batch_t* bt = &batch[next];
+            for (bt->n = 0; bt->n < RG_BATCH_SIZE; bt->n++)
+                if ((r = sam_read1(state->input_file, state->input_header,
+                                   bt->b[bt->n])) < 0)
+                    break;
+            if (!bt->n)
+                break;
+            if (hts_tpool_dispatch(opts->p.pool, q, rg_batch_func, bt) < 0) {
+                print_error_errno("addreplacerg", "[%s] Could not queue reads", __func__);
+                err = 1;
+                break;
+            }
+            next = (next + 1) % nbatch;
+            in_flight++;
+        }
+        if (!in_flight)
+            break;
+
+        hts_tpool_result* res = hts_tpool_next_result_wait(q);
+        if (!res) {
+            print_error_errno("addreplacerg", "[%s] Could not get results", __func__);
+            err = 1;
+            break;
+        }
+        rg_batch_t* bt = (rg_batch_t*)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+
+        // After an error the remaining batches are only collected
+        if (err)
+            continue;
+        if (bt->ret < 0) {
+            print_error_errno("addreplacerg", "[%s] Could not update read", __func__);
+            err = 1;
+            continue;
+        }
+        for (i = 0; i < bt->n; i++) {
+            if (sam_write1(state->output_file, state->output_header, bt->b[i]) < 0) {
+                print_error_errno("addreplacerg", "[%s] Could not write read to output file", __func__);
+                err = 1;
+                break;
+            }
+        }
+    }
+
+ out:
+    if (q)
+        hts_tpool_process_destroy(q);
+    if (batch) {
+        for (i = 0; i < nbatch; i++)
+            for (j = 0; j < RG_BATCH_SIZE; j++)
+                if (batch[i].b[j])
+                    bam_destroy1(batch[i].b[j]);
+        free(batch);
+    }
+    if (err)
+        return -2;
+    return r < -1 ? -1 : 0;
+
+ nomem:
+    print_error_errno("addreplacerg", "[%s] Out of memory", __func__);
+    err = 1;
+    goto out;
+}
+
 static bool readgroupise(parsed_opts_t *opts, state_t* state, char *arg_list)
 {
     if (!opts->no_pg && sam_hdr_add_pg(state->output_header, "samtools",
@@ -440,10 +569,25 @@ static bool readgroupise(parsed_opts_t *opts, state_t* state, char *arg_list)
             return false;
     }
 
-    bam1_t* file_read = bam_init1();
     int ret;
+    if (opts->p.pool) {
+        ret = readgroupise_threaded(opts, state);
+        if (ret == -2) {
+            free(idx_fn);
+            return false;
+        }
+        ret = ret < 0 ? -2 : -1;
+        goto done;
+    }
+
+    bam1_t* file_read = bam_init1();
     while ((ret = sam_read1(state->input_file, state->input_header, file_read)) >= 0) {
-        state->mode_func(state, file_read);
+        if (state->mode_func(state, file_read) < 0) {
+            print_error_errno("addreplacerg", "[%s] Could not update read", __func__);
+            bam_destroy1(file_read);
+            free(idx_fn);
+            return false;
+        }
 
         if (sam_write1(state->output_file, state->output_header, file_read) < 0) {
             print_error_errno("addreplacerg", "[%s] Could not write read to output file", __func__);
@@ -453,6 +597,7 @@ static bool readgroupise(parsed_opts_t *opts, state_t* state, char *arg_list)
         }
     }
     bam_destroy1(file_read);
+ done:
     if (ret != -1) {
         print_error_errno("addreplacerg", "[%s] Error reading from input file", __func__);
         free(idx_fn);
@@ -41,6 +41,7 @@ DEALINGS IN THE SOFTWARE
 #include "htslib/sam.h"
 #include "samtools.h"
 #include "bam_ampliconclip.h"
+#include "seq_utils.h"
 
 typedef enum {
     soft_clip,
@@ -161,6 +162,11 @@ int load_bed_file_multi_ref(char *infile, int get_strand, int sort_by_pos, khash
                 list->size = 0;
                 list->length = 0;
                 list->bp = NULL;
+                list->bin_off = NULL;
+                list->bin_idx = NULL;
+                list->bin_start = 0;
+                list->nbins = 0;
+                list->bin_shift = 0;
             } else {
                 fprintf(stderr, "[amplicon] error: ref hashing failure.\n");
                 ret = 1;
@@ -267,6 +273,8 @@ void destroy_bed_hash(khash_t(bed_list_hash) *hash) {
                free(list.bp[i].score);
            }
            free(list.bp);
+           free(list.bin_off);
+           free(list.bin_idx);
            free((char *)kh_key(hash, itr));
            kh_key(hash, itr) = NULL;
         }
@@ -276,29 +284,102 @@ void destroy_bed_hash(khash_t(bed_list_hash) *hash) {
 }
 
 
+// Builds the position index for a list of primer sites, so that each read
+// end can be matched against the handful of sites near it instead of
+// searching the list.  Every site is added to all the bins that its region,
+// widened by the tolerance on both sides, overlaps.  Entries within a bin
+// keep the order of the list.
+//
+// Bins are at least as wide as the average widened site, so most sites land
+// in one or two bins, and there are no more than about four per site.
+//
+// Returns 0 on success,
+//        -1 on failure
+static int index_clip_sites(bed_entry_list_t *sites, int tol) {
+    int64_t lo = INT64_MAX, hi = 0, span = 0, first, last, j;
+    int i, shift = 0, nbins;
+
+    if (sites->length == 0)
+        return 0;
+
+    for (i = 0; i < sites->length; i++) {
+        int64_t left = sites->bp[i].left > tol ? sites->bp[i].left - tol : 0;
+        int64_t right = sites->bp[i].right + tol;
+
+        if (lo > left) lo = left;
+        if (hi < right) hi = right;
+        span += right - left + 1;
+    }
+
+    while (((int64_t) 1 << shift) < span / sites->length
+           || ((hi - lo) >> shift) >= 4 * (int64_t) sites->length)
+        shift++;
+
+    nbins = ((hi - lo) >> shift) + 1;
+
+    if ((sites->bin_off = calloc(nbins + 1, sizeof(int))) == NULL)
+        return -1;
+
+    // Count entries per bin, then turn the counts into end offsets and
+    // fill backwards so that each bin comes out in list order.
+    for (i = 0; i < sites->length; i++) {
+        first = ((sites->bp[i].left > tol ? sites->bp[i].left - tol : 0) - lo) >> shift;
+        last = (sites->bp[i].right + tol - lo) >> shift;
+
+        for (j = first; j <= last; j++)
+            sites->bin_off[j]++;
+    }
+
+    for (j = 1; j <= nbins; j++)
+        sites->bin_off[j] += sites->bin_off[j - 1];
+
+    if ((sites->bin_idx = malloc(sites->bin_off[nbins] * sizeof(int))) == NULL) {
+        free(sites->bin_off);
+        sites->bin_off = NULL;
+        return -1;
+    }
+
+    for (i = sites->length - 1; i >= 0; i--) {
+        first = ((sites->bp[i].left > tol ? sites->bp[i].left - tol : 0) - lo) >> shift;
+        last = (sites->bp[i].right + tol - lo) >> shift;
+
+        for (j = first; j <= last; j++)
+            sites->bin_idx[--sites->bin_off[j]] = i;
+    }
+
+    sites->bin_start = lo;
+    sites->nbins = nbins;
+    sites->bin_shift = shift;
+
+    return 0;
+}
+
+
+// Returns the number of bases to clip for the read end at pos, storing
+// the site used in *used.
 static int matching_clip_site(bed_entry_list_t *sites, hts_pos_t pos,
-                              int is_rev, int use_strand, int64_t longest,
-                              cl_param_t *param) {
-    int i, size, used_i;
+                              int is_rev, int use_strand,
+                              cl_param_t *param, bed_entry_t **used) {
+    int i, k, size, used_i;
     int tol = param->tol;
-    int l = 0, mid = sites->length / 2, r = sites->length;
-    int pos_tol = is_rev ? (pos > tol ? pos - tol : 0) : pos;
+    int64_t bin;
 
-    while (r - l > 1) {
-        if (sites->bp[mid].right <= pos_tol) {
-            l = mid;
-        } else {
-            r = mid;
-        }
-        mid = (l + r) / 2;
-    }
+    if (pos < sites->bin_start)
+        return 0;
+
+    bin = (pos - sites->bin_start) >> sites->bin_shift;
+
+    if (bin >= sites->nbins)
+        return 0;
 
     size = 0;
     used_i = -1;
 
-    for (i = l; i < sites->length; i++) {
+    for (k = sites->bin_off[bin]; k < sites->bin_off[bin + 1]; k++) {
         hts_pos_t mod_left, mod_right;
 
+        i = sites->bin_idx[k];
+
         if (use_strand && is_rev != sites->bp[i].rev)
             continue;
 
@@ -314,9 +395,6 @@ static int matching_clip_site(bed_entry_list_t *sites, hts_pos_t pos,
             mod_right = sites->bp[i].right;
         }
 
-        if (pos + longest + tol < mod_right)
-            break;
-
         if (pos >= mod_left && pos <= mod_right) {
             if (is_rev) {
                 if (size < pos - sites->bp[i].left) {
@@ -332,7 +410,7 @@ static int matching_clip_site(bed_entry_list_t *sites, hts_pos_t pos,
         }
     }
     if (used_i >= 0) {
-        sites->bp[used_i].num_reads++;
+        *used = &sites->bp[used_i];
     }
     return size;
 }
@@ -686,295 +764,522 @@ static inline int tag_original_data(bam1_t *orig, kstring_t *oa_tag) {
 }
 
 
-static int bam_clip(samFile *in, samFile *out, samFile *reject, char *bedfile,
-                    clipping_type clipping, cl_param_t *param) {
-    int ret = 1, r, file_open = 0;
+// Totals reported in the stats file
+typedef struct {
+    long f_count, r_count, n_count, l_count, l_exclude, b_count;
+    long filtered, written, failed;
+} clip_counts_t;
 
-    bam_hdr_t *header = NULL;
-    bam1_t *b = NULL, *b_tmp = NULL;
-    long f_count = 0, r_count = 0, n_count = 0, l_count = 0, l_exclude = 0, b_count = 0;
-    long filtered = 0, written = 0, failed = 0;
-    kstring_t str = KS_INITIALIZE;
-    kstring_t oat = KS_INITIALIZE;
-    kstring_t seq = KS_INITIALIZE;
+// Per-thread scratch space for clip_record
+typedef struct {
+    bam1_t *b_tmp;
+    kstring_t oat;
+    kstring_t seq;
+    int32_t last_tid;
+    bed_entry_list_t *sites;    // NULL if last_tid has no BED entries
+} clip_buf_t;
+
+
+static void clip_buf_free(clip_buf_t *cb) {
+    bam_destroy1(cb->b_tmp);
+    ks_free(&cb->oat);
+    ks_free(&cb->seq);
+}
+
+
+// Clips one record.  *bp may be swapped with the scratch record in cb.
+// The primer sites matched are stored in hits[0] (and hits[1] with
+// --both-ends) for the caller to count, as the counts are shared between
+// threads.  The clipping totals are added to cnt.
+//
+// Returns 1 if the record should be filtered out,
+//         0 if it should be written,
+//        -1 on failure
+static int clip_record(sam_hdr_t *header, khash_t(bed_list_hash) *bed_hash,
+                       bam1_t **bp, clip_buf_t *cb, clipping_type clipping,
+                       cl_param_t *param, clip_counts_t *cnt,
+                       bed_entry_t **hits) {
+    bam1_t *b = *bp;
     bed_entry_list_t *sites;
-    FILE *stats_fp = stderr;
-    FILE *bed_count_summary_fp = stderr;
-    khash_t(bed_list_hash) *bed_hash = kh_init(bed_list_hash);
-    char **bed_ref_list = NULL;
-    size_t num_bed_refs = 0;
+    hts_pos_t pos;
+    int is_rev;
+    int p_size;
+    int been_clipped  = 0, filter = 0;
+    int exclude = (BAM_FUNMAP | BAM_FQCFAIL);
+    khiter_t itr;
 
-    if (load_bed_file_multi_ref(bedfile, param->use_strand, 1, bed_hash,
-                                &bed_ref_list, &num_bed_refs)) {
-        fprintf(stderr, "[ampliconclip] error: unable to load bed file.\n");
-        goto fail;
-    }
+    hits[0] = hits[1] = NULL;
 
-    if ((header = sam_hdr_read(in)) == NULL) {
-        fprintf(stderr, "[ampliconclip] error: could not read header\n");
-        goto fail;
-    }
+    if (b->core.tid != cb->last_tid) {
+        const char *ref_name;
 
-    // changing pos can ruin coordinate sort order
-    if (sam_hdr_find_tag_hd(header, "SO", &str) == 0 && str.s && strcmp(str.s, "coordinate") == 0) {
-        const char *new_order = "unknown";
+        cb->sites = NULL;
+        cb->last_tid = b->core.tid;
 
-        if (sam_hdr_update_hd(header, "SO", new_order) == -1) {
-            fprintf(stderr, "[ampliconclip] error: unable to change sort order to 'SO:%s'\n", new_order);
-            goto fail;
+        if ((ref_name = sam_hdr_tid2name(header, b->core.tid)) != NULL) {
+            itr = kh_get(bed_list_hash, bed_hash, ref_name);
+
+            if (itr != kh_end(bed_hash)) {
+                cb->sites = &kh_val(bed_hash, itr);
+            }
         }
     }
 
-    ks_free(&str);
+    sites = cb->sites;
 
-    if (param->add_pg && sam_hdr_add_pg(header, "samtools", "VN", samtools_version(),
-                        param->arg_list ? "CL" : NULL,
-                        param->arg_list ? param->arg_list : NULL,
-                        NULL) != 0) {
-        fprintf(stderr, "[ampliconclip] warning: unable to add @PG line to header.\n");
-    }
-    if (sam_hdr_write(out, header) < 0) {
-        fprintf(stderr, "[ampliconclip] error: could not write header.\n");
-        goto fail;
-    }
+    if (!(b->core.flag & exclude) && sites) {
+        if (param->oa_tag)
+            if (tag_original_data(b, &cb->oat))
+                goto fail;
 
-    if (reject) {
-       if (sam_hdr_write(reject, header) < 0) {
-           fprintf(stderr, "[ampliconclip] error: could not write header to rejects file.\n");
-           goto fail;
-       }
-    }
+        if (!param->both) {
+            if (bam_is_rev(b)) {
+                pos = bam_endpos(b);
+                is_rev = 1;
+            } else {
+                pos = b->core.pos;
+                is_rev = 0;
+            }
 
-    b = bam_init1();
-    b_tmp = bam_init1();
-    if (!b || !b_tmp) {
-        fprintf(stderr, "[ampliconclip] error: out of memory when trying to create record.\n");
-        goto fail;
-    }
+            if ((p_size = matching_clip_site(sites, pos, is_rev, param->use_strand, param, &hits[0]))) {
+                if (is_rev) {
+                    if (bam_trim_right(b, cb->b_tmp, p_size, clipping) != 0)
+                        goto fail;
 
-    int32_t last_tid = -1;
-    int ref_found = 0;
+                    swap_bams(&b, &cb->b_tmp);
+                    cnt->r_count++;
+                } else {
+                    if (bam_trim_left(b, cb->b_tmp, p_size, clipping) != 0)
+                        goto fail;
 
-    while ((r = sam_read1(in, header, b)) >= 0) {
-        hts_pos_t pos;
-        int is_rev;
-        int p_size;
-        int been_clipped  = 0, filter = 0;
-        int exclude = (BAM_FUNMAP | BAM_FQCFAIL);
-        khiter_t itr;
+                    swap_bams(&b, &cb->b_tmp);
+                    cnt->f_count++;
+                }
 
-        l_count++;
+                if (param->oa_tag) {
+                    if (bam_aux_update_str(b, "OA", cb->oat.l + 1, (const char *)cb->oat.s))
+                        goto fail;
+                }
 
-        if (b->core.tid != last_tid) {
-            const char *ref_name;
+                if (param->del_tag) {
+                    uint8_t *tag;
 
-            ref_found = 0;
-            last_tid = b->core.tid;
+                    if ((tag = bam_aux_get(b, "NM")))
+                        bam_aux_del(b, tag);
 
-            if ((ref_name = sam_hdr_tid2name(header, b->core.tid)) != NULL) {
-                itr = kh_get(bed_list_hash, bed_hash, ref_name);
+                    if ((tag = bam_aux_get(b, "MD")))
+                        bam_aux_del(b, tag);
+                }
 
-                if (itr != kh_end(bed_hash)) {
-                    sites = &kh_val(bed_hash, itr);
-                    ref_found = 1;
+                been_clipped = 1;
+            } else {
+                if (param->mark_fail) {
+                    b->core.flag |= BAM_FQCFAIL;
                 }
+
+                cnt->n_count++;
             }
-        }
+        } else {
+            int left = 0, right = 0;
+
+            // left first
+            pos = b->core.pos;
+            is_rev = 0;
 
-        if (!(b->core.flag & exclude) && ref_found) {
-            if (param->oa_tag)
-                if (tag_original_data(b, &oat))
+            if ((p_size = matching_clip_site(sites, pos, is_rev, param->use_strand, param, &hits[0]))) {
+                if (bam_trim_left(b, cb->b_tmp, p_size, clipping) != 0)
                     goto fail;
 
-            if (!param->both) {
-                if (bam_is_rev(b)) {
-                    pos = bam_endpos(b);
-                    is_rev = 1;
-                } else {
-                    pos = b->core.pos;
-                    is_rev = 0;
+                swap_bams(&b, &cb->b_tmp);
+                cnt->f_count++;
+                left = 1;
+                been_clipped = 1;
+            }
+
+            // the right
+            pos = bam_endpos(b);
+            is_rev = 1;
+
+            if ((p_size = matching_clip_site(sites, pos, is_rev, param->use_strand, param, &hits[1]))) {
+                if (bam_trim_right(b, cb->b_tmp, p_size, clipping) != 0)
+                    goto fail;
+
+                swap_bams(&b, &cb->b_tmp);
+                cnt->r_count++;
+                right = 1;
+                been_clipped = 1;
+            }
+
+            if (left || right) {
+                uint8_t *tag;
+
+                if (param->oa_tag) {
+                    if (bam_aux_update_str(b, "OA", cb->oat.l + 1, (const char *)cb->oat.s))
+                        goto fail;
                 }
 
-                if ((p_size = matching_clip_site(sites, pos, is_rev, param->use_strand, sites->longest, param))) {
-                    if (is_rev) {
-                        if (bam_trim_right(b, b_tmp, p_size, clipping) != 0)
-                            goto fail;
+                if (param->del_tag) {
+                    if ((tag = bam_aux_get(b, "NM")))
+                        bam_aux_del(b, tag);
 
-                        swap_bams(&b, &b_tmp);
-                        r_count++;
-                    } else {
-                        if (bam_trim_left(b, b_tmp, p_size, clipping) != 0)
-                            goto fail;
+                    if ((tag = bam_aux_get(b, "MD")))
+                        bam_aux_del(b, tag);
+                }
+            }
 
-                        swap_bams(&b, &b_tmp);
-                        f_count++;
-                    }
+            if (left && right) {
+                cnt->b_count++;
+            } else if (!left && !right) {
+                if (param->mark_fail) {
+                    b->core.flag |= BAM_FQCFAIL;
+                }
 
-                    if (param->oa_tag) {
-                        if (bam_aux_update_str(b, "OA", oat.l + 1, (const char *)oat.s))
-                            goto fail;
-                    }
+                cnt->n_count++;
+            }
+        }
 
-                    if (param->del_tag) {
-                        uint8_t *tag;
+        if (param->fail_len >= 0 || param->filter_len >= 0 || param->unmap_len >= 0) {
+            hts_pos_t aql = active_query_len(b);
 
-                        if ((tag = bam_aux_get(b, "NM")))
-                            bam_aux_del(b, tag);
+            if (param->fail_len >= 0 && aql <= param->fail_len) {
+                b->core.flag |= BAM_FQCFAIL;
+            }
 
-                        if ((tag = bam_aux_get(b, "MD")))
-                            bam_aux_del(b, tag);
-                    }
+            if (param->filter_len >= 0 && aql <= param->filter_len) {
+                filter = 1;
+            }
 
-                    been_clipped = 1;
-                } else {
-                    if (param->mark_fail) {
-                        b->core.flag |= BAM_FQCFAIL;
-                    }
+            if (param->unmap_len >= 0 && aql <= param->unmap_len) {
 
-                    n_count++;
+                if (ks_resize(&cb->seq, b->core.l_qseq) < 0) {
+                    fprintf(stderr, "[ampliconclip] error: allocate memory for sequence %s\n", bam_get_seq(b));
+                    goto fail;
                 }
-            } else {
-                int left = 0, right = 0;
-
-                // left first
-                pos = b->core.pos;
-                is_rev = 0;
 
-                if ((p_size = matching_clip_site(sites, pos, is_rev, param->use_strand, sites->longest, param))) {
-                    if (bam_trim_left(b, b_tmp, p_size, clipping) != 0)
-                        goto fail;
+                ks_clear(&cb->seq);
+                seq_nt16_unpack(ks_str(&cb->seq), bam_get_seq(b), b->core.l_qseq);
 
-                    swap_bams(&b, &b_tmp);
-                    f_count++;
-                    left = 1;
-                    been_clipped = 1;
+                if (bam_set1(cb->b_tmp, b->core.l_qname - b->core.l_extranul - 1, bam_get_qname(b),
+                             (b->core.flag | BAM_FUNMAP), b->core.tid, b->core.pos, 0,
+                             0, NULL, b->core.mtid, b->core.mpos, b->core.isize,
+                             b->core.l_qseq, cb->seq.s, (const char *)bam_get_qual(b),
+                             bam_get_l_aux(b)) < 0) {
+                    fprintf(stderr, "[ampliconclip] error: could not unmap read %s\n", bam_get_seq(b));
+                    goto fail;
                 }
 
-                // the right
-                pos = bam_endpos(b);
-                is_rev = 1;
+                memcpy(bam_get_aux(cb->b_tmp), bam_get_aux(b), bam_get_l_aux(b));
+                cb->b_tmp->l_data += bam_get_l_aux(b);
+                swap_bams(&b, &cb->b_tmp);
+            }
+       }
 
-                if ((p_size = matching_clip_site(sites, pos, is_rev, param->use_strand, sites->longest, param))) {
-                    if (bam_trim_right(b, b_tmp, p_size, clipping) != 0)
-                        goto fail;
+       if (b->core.flag & BAM_FQCFAIL) {
+           cnt->failed++;
+       }
 
-                    swap_bams(&b, &b_tmp);
-                    r_count++;
-                    right = 1;
-                    been_clipped = 1;
-                }
+       if (param->write_clipped && !been_clipped) {
+           filter = 1;
+       }
 
-                if (left || right) {
-                    uint8_t *tag;
+    } else {
+        cnt->l_exclude++;
 
-                    if (param->oa_tag) {
-                        if (bam_aux_update_str(b, "OA", oat.l + 1, (const char *)oat.s))
-                            goto fail;
-                    }
+        if (param->unmapped) {
+            filter = 1;
+        }
+    }
 
-                    if (param->del_tag) {
-                        if ((tag = bam_aux_get(b, "NM")))
-                            bam_aux_del(b, tag);
+    *bp = b;
+    return filter;
 
-                        if ((tag = bam_aux_get(b, "MD")))
-                            bam_aux_del(b, tag);
-                    }
-                }
+ fail:
+    *bp = b;
+    return -1;
+}
 
-                if (left && right) {
-                    b_count++;
-                } else if (!left && !right) {
-                    if (param->mark_fail) {
-                        b->core.flag |= BAM_FQCFAIL;
-                    }
 
-                    n_count++;
-                }
+static inline void count_hits(bed_entry_t **hits) {
+    if (hits[0])
+        hits[0]->num_reads++;
+    if (hits[1])
+        hits[1]->num_reads++;
+}
+
+
+static int write_clipped(samFile *out, samFile *reject, sam_hdr_t *header,
+                         bam1_t *b, int filter, cl_param_t *param,
+                         clip_counts_t *cnt) {
+    if (!filter) {
+        if (sam_write1(out, header, b) < 0) {
+            fprintf(stderr, "[ampliconclip] error: could not write line %ld.\n", cnt->l_count);
+            return -1;
+        }
+
+        cnt->written++;
+    } else {
+        if (reject) {
+            if (sam_write1(reject, header, b) < 0) {
+                fprintf(stderr, "[ampliconclip] error: could not write to reject file %s\n",
+                        param->rejects_file);
+                return -1;
             }
+        }
 
-            if (param->fail_len >= 0 || param->filter_len >= 0 || param->unmap_len >= 0) {
-                hts_pos_t aql = active_query_len(b);
+        cnt->filtered++;
+    }
 
-                if (param->fail_len >= 0 && aql <= param->fail_len) {
-                    b->core.flag |= BAM_FQCFAIL;
-                }
+    return 0;
+}
 
-                if (param->filter_len >= 0 && aql <= param->filter_len) {
-                    filter = 1;
-                }
 
-                if (param->unmap_len >= 0 && aql <= param->unmap_len) {
+// Clipping on several threads.  Records are read into batches, which the
+// thread pool clips, and the batches are written out in dispatch order so
+// the output order is unchanged.
+#define CLIP_BATCH_SIZE 1024
 
-                    if (ks_resize(&seq, b->core.l_qseq) < 0) {
-                        fprintf(stderr, "[ampliconclip] error: allocate memory for sequence %s\n", bam_get_seq(b));
-                        goto fail;
-                    }
-
-                    ks_clear(&seq);
-                    char *sb = ks_str(&seq);
-                    uint8_t *sequence = bam_get_seq(b);
-                    int i;
-
-                    for (i = 0; i < b->core.l_qseq ; ++i) {
-                        *sb++ = seq_nt16_str[bam_seqi(sequence, i)];
-                    }
-
-                    if (bam_set1(b_tmp, b->core.l_qname - b->core.l_extranul - 1, bam_get_qname(b),
-                                 (b->core.flag | BAM_FUNMAP), b->core.tid, b->core.pos, 0,
-                                 0, NULL, b->core.mtid, b->core.mpos, b->core.isize,
-                                 b->core.l_qseq, seq.s, (const char *)bam_get_qual(b),
-                                 bam_get_l_aux(b)) < 0) {
-                        fprintf(stderr, "[ampliconclip] error: could not unmap read %s\n", bam_get_seq(b));
-                        goto fail;
-                    }
+typedef struct {
+    bam1_t *b[CLIP_BATCH_SIZE];
+    int filter[CLIP_BATCH_SIZE];
+    bed_entry_t *hits[2 * CLIP_BATCH_SIZE];
+    int nb;
+    clip_buf_t cb;
+    clip_counts_t cnt;
+    sam_hdr_t *header;
+    khash_t(bed_list_hash) *bed_hash;
+    clipping_type clipping;
+    cl_param_t *param;
+    int ret;
+} clip_batch_t;
+
+static void *clip_batch(void *arg) {
+    clip_batch_t *bt = (clip_batch_t *)arg;
+    int i;
 
-                    memcpy(bam_get_aux(b_tmp), bam_get_aux(b), bam_get_l_aux(b));
-                    b_tmp->l_data += bam_get_l_aux(b);
-                    swap_bams(&b, &b_tmp);
-                }
-           }
+    memset(&bt->cnt, 0, sizeof(bt->cnt));
+    bt->ret = 0;
+    for (i = 0; i < bt->nb; i++) {
+        if ((bt->filter[i] = clip_record(bt->header, bt->bed_hash, &bt->b[i],
+                                         &bt->cb, bt->clipping, bt->param,
+                                         &bt->cnt, &bt->hits[2 * i])) < 0) {
+            bt->ret = -1;
+            break;
+        }
+    }
 
-           if (b->core.flag & BAM_FQCFAIL) {
-               failed++;
-           }
+    return bt;
+}
 
-           if (param->write_clipped && !been_clipped) {
-               filter = 1;
-           }
+// Returns 0 on success,
+//        -1 on failure
+static int clip_threaded(samFile *in, samFile *out, samFile *reject,
+                         sam_hdr_t *header, khash_t(bed_list_hash) *bed_hash,
+                         clipping_type clipping, cl_param_t *param,
+                         hts_tpool *pool, clip_counts_t *cnt) {
+    int nbatch = 2 * hts_tpool_size(pool), next = 0, in_flight = 0;
+    int r = 0, eof = 0, ret = 0, i, j;
+    clip_batch_t *batch = calloc(nbatch, sizeof(*batch));
+    hts_tpool_process *q = NULL;
+
+    if (!batch)
+        goto nomem;
+    for (i = 0; i < nbatch; i++) {
+        for (j = 0; j < CLIP_BATCH_SIZE; j++)
+            if (!(batch[i].b[j] = bam_init1()))
+                goto nomem;
+        if (!(batch[i].cb.b_tmp = bam_init1()))
+            goto nomem;
+        batch[i].cb.last_tid = -1;
+        batch[i].header = header;
+        batch[i].bed_hash = bed_hash;
+        batch[i].clipping = clipping;
+        batch[i].param = param;
+    }
 
-        } else {
-            l_exclude++;
+    // The ring of batches is no larger than the queue, so dispatching
+    // never waits on results we have yet to collect.
+    if (!(q = hts_tpool_process_init(pool, nbatch, 0)))
+        goto nomem;
 
-            if (param->unmapped) {
-                filter = 1;
+    for (;;) {
+        while (!eof && ret == 0 && in_flight < nbatch) {
+            clip_batch_t *bt = &batch[next];
+
+            for (bt->nb = 0; bt->nb < CLIP_BATCH_SIZE; bt->nb++)
+                if ((r = sam_read1(in, header, bt->b[bt->nb])) < 0)
+                    break;
+
+            if (r < -1) {
+                fprintf(stderr, "[ampliconclip] error: failed to read input.\n");
+                ret = -1;
+                break;
+            }
+            if (r == -1)
+                eof = 1;
+            if (!bt->nb)
+                break;
+
+            if (hts_tpool_dispatch(pool, q, clip_batch, bt) < 0) {
+                ret = -1;
+                break;
             }
+            next = (next + 1) % nbatch;
+            in_flight++;
         }
+        if (!in_flight)
+            break;
 
-        if (!filter) {
-            if (sam_write1(out, header, b) < 0) {
-                fprintf(stderr, "[ampliconclip] error: could not write line %ld.\n", l_count);
-                goto fail;
-            }
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        if (!res) {
+            ret = -1;
+            break;
+        }
+        clip_batch_t *bt = (clip_batch_t *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+
+        // After an error the remaining batches are only collected
+        if (ret == 0 && bt->ret < 0)
+            ret = -1;
+        if (ret < 0)
+            continue;
 
-            written++;
-        } else {
-            if (reject) {
-                if (sam_write1(reject, header, b) < 0) {
-                    fprintf(stderr, "[ampliconclip] error: could not write to reject file %s\n",
-                            param->rejects_file);
-                    goto fail;
-                }
-            }
+        cnt->f_count   += bt->cnt.f_count;
+        cnt->r_count   += bt->cnt.r_count;
+        cnt->n_count   += bt->cnt.n_count;
+        cnt->l_exclude += bt->cnt.l_exclude;
+        cnt->b_count   += bt->cnt.b_count;
+        cnt->failed    += bt->cnt.failed;
+
+        for (i = 0; i < bt->nb && ret == 0; i++) {
+            cnt->l_count++;
+            count_hits(&bt->hits[2 * i]);
+            if (write_clipped(out, reject, header, bt->b[i], bt->filter[i],
+                              param, cnt) < 0)
+                ret = -1;
+        }
+    }
+
+ out:
+    if (q)
+        hts_tpool_process_destroy(q);
+    if (batch) {
+        for (i = 0; i < nbatch; i++) {
+            for (j = 0; j < CLIP_BATCH_SIZE; j++)
+                bam_destroy1(batch[i].b[j]);
+            clip_buf_free(&batch[i].cb);
+        }
+        free(batch);
+    }
+    return ret;
+
+ nomem:
+    fprintf(stderr, "[ampliconclip] error: could not set up the clipping threads.\n");
+    ret = -1;
+    goto out;
+}
+
+
+static int bam_clip(samFile *in, samFile *out, samFile *reject, char *bedfile,
+                    clipping_type clipping, cl_param_t *param,
+                    hts_tpool *pool) {
+    int ret = 1, r, file_open = 0;
 
-            filtered++;
+    bam_hdr_t *header = NULL;
+    bam1_t *b = NULL;
+    clip_counts_t cnt = {0};
+    clip_buf_t cb = {NULL, KS_INITIALIZE, KS_INITIALIZE, -1, NULL};
+    bed_entry_t *hits[2];
+    kstring_t str = KS_INITIALIZE;
+    bed_entry_list_t *sites;
+    FILE *stats_fp = stderr;
+    FILE *bed_count_summary_fp = stderr;
+    khash_t(bed_list_hash) *bed_hash = kh_init(bed_list_hash);
+    char **bed_ref_list = NULL;
+    size_t num_bed_refs = 0;
+
+    if (load_bed_file_multi_ref(bedfile, param->use_strand, 1, bed_hash,
+                                &bed_ref_list, &num_bed_refs)) {
+        fprintf(stderr, "[ampliconclip] error: unable to load bed file.\n");
+        goto fail;
+    }
+
+    for (khiter_t itr = kh_begin(bed_hash); itr != kh_end(bed_hash); ++itr) {
+        if (kh_exist(bed_hash, itr)
+            && index_clip_sites(&kh_val(bed_hash, itr), param->tol) < 0) {
+            fprintf(stderr, "[ampliconclip] error: unable to allocate memory for bed index.\n");
+            goto fail;
         }
     }
 
-    if (r < -1) {
-        fprintf(stderr, "[ampliconclip] error: failed to read input.\n");
+    if ((header = sam_hdr_read(in)) == NULL) {
+        fprintf(stderr, "[ampliconclip] error: could not read header\n");
         goto fail;
     }
 
+    // changing pos can ruin coordinate sort order
+    if (sam_hdr_find_tag_hd(header, "SO", &str) == 0 && str.s && strcmp(str.s, "coordinate") == 0) {
+        const char *new_order = "unknown";
+
+        if (sam_hdr_update_hd(header, "SO", new_order) == -1) {
+            fprintf(stderr, "[ampliconclip] error: unable to change sort order to 'SO:%s'\n", new_order);
+            goto fail;
+        }
+    }
+
+    ks_free(&str);
+
+    if (param->add_pg && sam_hdr_add_pg(header, "samtools", "VN", samtools_version(),
+                        param->arg_list ? "CL" : NULL,
+                        param->arg_list ? param->arg_list : NULL,
+                        NULL) != 0) {
+        fprintf(stderr, "[ampliconclip] warning: unable to add @PG line to header.\n");
+    }
+    if (sam_hdr_write(out, header) < 0) {
+        fprintf(stderr, "[ampliconclip] error: could not write header.\n");
+        goto fail;
+    }
+
+    if (reject) {
+       if (sam_hdr_write(reject, header) < 0) {
+           fprintf(stderr, "[ampliconclip] error: could not write header to rejects file.\n");
+           goto fail;
+       }
+    }
+
+    if (pool) {
+        if (clip_threaded(in, out, reject, header, bed_hash, clipping, param,
+                          pool, &cnt) < 0)
+            goto fail;
+    } else {
+        b = bam_init1();
+        cb.b_tmp = bam_init1();
+        if (!b || !cb.b_tmp) {
+            fprintf(stderr, "[ampliconclip] error: out of memory when trying to create record.\n");
+            goto fail;
+        }
+
+        while ((r = sam_read1(in, header, b)) >= 0) {
+            int filter;
+
+            cnt.l_count++;
+
+            if ((filter = clip_record(header, bed_hash, &b, &cb, clipping,
+                                      param, &cnt, hits)) < 0)
+                goto fail;
+
+            count_hits(hits);
+
+            if (write_clipped(out, reject, header, b, filter, param, &cnt) < 0)
+                goto fail;
+        }
+
+        if (r < -1) {
+            fprintf(stderr, "[ampliconclip] error: failed to read input.\n");
+            goto fail;
+        }
+    }
+
     if (param->stats_file) {
         if ((stats_fp = fopen(param->stats_file, "w")) == NULL) {
             fprintf(stderr, "[ampliconclip] warning: cannot write stats to %s.\n", param->stats_file);
@@ -993,9 +1298,11 @@ static int bam_clip(samFile *in, samFile *out, samFile *reject, char *bedfile,
                     "EXCLUDED: %ld\n"
                     "FILTERED: %ld\n"
                     "FAILED: %ld\n"
-                    "WRITTEN: %ld\n", param->arg_list, l_count, f_count + r_count,
-                                    f_count, r_count, b_count, n_count, l_exclude,
-                                    filtered, failed, written);
+                    "WRITTEN: %ld\n", param->arg_list, cnt.l_count,
+                                    cnt.f_count + cnt.r_count,
+                                    cnt.f_count, cnt.r_count, cnt.b_count,
+                                    cnt.n_count, cnt.l_exclude,
+                                    cnt.filtered, cnt.failed, cnt.written);
 
     if (file_open) {
         fclose(stats_fp);
@@ -1037,11 +1344,9 @@ static int bam_clip(samFile *in, samFile *out, samFile *reject, char *bedfile,
 fail:
     free(bed_ref_list);
     destroy_bed_hash(bed_hash);
-    ks_free(&oat);
-    ks_free(&seq);
+    clip_buf_free(&cb);
     sam_hdr_destroy(header);
     bam_destroy1(b);
-    bam_destroy1(b_tmp);
     return ret;
 }
 
@@ -1086,7 +1391,7 @@ int amplicon_clip_main(int argc, char **argv) {
     cl_param_t param = {1, 0, 0, 0, 0, -1, -1, 0, 0, 1, 5, 0, NULL, NULL, NULL};
 
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@', '-', '-'),
         {"no-PG", no_argument, NULL, 1002},
         {"soft-clip", no_argument, NULL, 1003},
         {"hard-clip", no_argument, NULL, 1004},
@@ -1186,7 +1491,7 @@ int amplicon_clip_main(int argc, char **argv) {
 
     param.arg_list = stringify_argv(argc + 1, argv - 1);
 
-    ret = bam_clip(in, out, reject, bedfile, clipping, &param);
+    ret = bam_clip(in, out, reject, bedfile, clipping, &param, p.pool);
 
     // cleanup
     sam_close(in);
@@ -41,6 +41,14 @@ typedef struct {
     int64_t longest;
     int length;
     int size;
+    // Position index built by ampliconclip.  Bin i covers positions
+    // bin_start + (i << bin_shift) onwards; bin_idx[bin_off[i]] to
+    // bin_idx[bin_off[i+1]-1] are the entries that may match there.
+    int *bin_off;
+    int *bin_idx;
+    int64_t bin_start;
+    int nbins;
+    int bin_shift;
 } bed_entry_list_t;
 
 KHASH_MAP_INIT_STR(bed_list_hash, bed_entry_list_t)
@@ -42,12 +42,17 @@ Illumina.
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "htslib/bgzf.h"
 #include "htslib/sam.h"
 #include "htslib/cram.h"
 #include "htslib/kstring.h"
 #include "htslib/hfile.h"
+#include "htslib/thread_pool.h"
 #include "samtools.h"
 #include "sam_opts.h"
 
@@ -380,6 +385,169 @@ static int cram_subdivide_part(cram_fd *fd, hts_idx_t *idx, char *part,
     return 0;
 }
 
+// Containers that need no changes are copied as raw bytes, without being
+// parsed, through a buffer of CRAM_COPY_BUF bytes.  With threads the input
+// is instead read in CRAM_COPY_CHUNK pieces with positioned reads, several
+// at once, and written out in order.
+#define CRAM_COPY_BUF (1 << 20)
+#define CRAM_COPY_CHUNK (8 << 20)
+
+typedef struct {
+    int fd;
+    off_t offset;
+    size_t len;
+    char *buf;
+    int ok;
+} cram_copy_job_t;
+
+static void *cram_copy_read(void *arg) {
+    cram_copy_job_t *j = (cram_copy_job_t *)arg;
+    size_t got = 0;
+
+    while (got < j->len) {
+        ssize_t r = pread(j->fd, j->buf + got, j->len - got, j->offset + got);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        got += r;
+    }
+    j->ok = got == j->len;
+
+    return j;
+}
+
+// Copies len bytes from the current position of in to out.
+// Returns 0 on success, -1 on failure.
+static int cram_copy_bytes(hFILE *in, hFILE *out, char *buf, off_t len) {
+    while (len > 0) {
+        ssize_t n = len < CRAM_COPY_BUF ? len : CRAM_COPY_BUF;
+        if (hread(in, buf, n) != n || hwrite(out, buf, n) != n)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+#ifndef _WIN32
+// The threaded half of cram_copy_range.  Returns 0 on success, -1 on
+// failure, or 1 if fn cannot be read this way.
+static int cram_copy_range_mt(const char *fn, hFILE *out, off_t start,
+                              off_t end, hts_tpool *pool) {
+    int njobs = 2 * hts_tpool_size(pool), next = 0, in_flight = 0, i;
+    hts_tpool_process *q = NULL;
+    cram_copy_job_t *jobs = NULL;
+    struct stat st;
+    int fd, ret = -1;
+
+    if (strcmp(fn, "-") == 0 || (fd = open(fn, O_RDONLY)) < 0)
+        return 1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 1;
+    }
+
+    if (!(jobs = calloc(njobs, sizeof(*jobs)))
+        || !(q = hts_tpool_process_init(pool, njobs, 0)))
+        goto out;
+    for (i = 0; i < njobs; i++) {
+        if (!(jobs[i].buf = malloc(CRAM_COPY_CHUNK)))
+            goto out;
+        jobs[i].fd = fd;
+    }
+
+    while (start < end || in_flight) {
+        // The ring is no larger than the queue, so this never blocks
+        while (start < end && in_flight < njobs) {
+            cram_copy_job_t *j = &jobs[next];
+            j->offset = start;
+            j->len = end - start < CRAM_COPY_CHUNK ? end - start : CRAM_COPY_CHUNK;
+            if (hts_tpool_dispatch(pool, q, cram_copy_read, j) < 0)
+                goto out;
+            start += j->len;
+            next = (next + 1) % njobs;
+            in_flight++;
+        }
+
+        hts_tpool_result *r = hts_tpool_next_result_wait(q);
+        if (!r)
+            goto out;
+        cram_copy_job_t *j = (cram_copy_job_t *)hts_tpool_result_data(r);
+        hts_tpool_delete_result(r, 0);
+        in_flight--;
+        if (!j->ok || hwrite(out, j->buf, j->len) != j->len)
+            goto out;
+    }
+    ret = 0;
+
+ out:
+    if (q) {
+        while (in_flight-- > 0) {
+            hts_tpool_result *r = hts_tpool_next_result_wait(q);
+            if (!r)
+                break;
+            hts_tpool_delete_result(r, 0);
+        }
+        hts_tpool_process_destroy(q);
+    }
+    if (jobs)
+        for (i = 0; i < njobs; i++)
+            free(jobs[i].buf);
+    free(jobs);
+    close(fd);
+    return ret;
+}
+#endif
+
+// Copies the containers from offset start up to end verbatim.
+// Returns 0 on success, -1 on failure.
+static int cram_copy_range(cram_fd *in_c, const char *fn, cram_fd *out_c,
+                           off_t start, off_t end, hts_tpool *pool,
+                           char *buf) {
+    hFILE *out = cram_fd_get_fp(out_c);
+
+#ifndef _WIN32
+    if (pool) {
+        int r = cram_copy_range_mt(fn, out, start, end, pool);
+        if (r <= 0)
+            return r;
+    }
+#endif
+
+    if (cram_seek(in_c, start, SEEK_SET) != 0)
+        return -1;
+    return cram_copy_bytes(cram_fd_get_fp(in_c), out, buf, end - start);
+}
+
+// Finds where the container at offset last ends, or if last is negative
+// where the final container in the file ends, just before the EOF block.
+// Returns 0 on success, -1 if this cannot be told.
+static int cram_range_end(cram_fd *fd, off_t last, off_t *end) {
+    hFILE *fp = cram_fd_get_fp(fd);
+    off_t here = htell(fp), size;
+
+    if (last >= 0) {
+        cram_container *c;
+        if (cram_seek(fd, last, SEEK_SET) != 0
+            || !(c = cram_read_container(fd)))
+            return -1;
+        *end = htell(fp) + cram_container_get_length(c);
+        cram_free_container(c);
+        return cram_seek(fd, here, SEEK_SET) != 0 ? -1 : 0;
+    }
+
+    // Only when there is an EOF block of known size to stop before, and
+    // the file is seekable to find it.
+    int major = cram_major_vers(fd);
+    if ((major != 2 && major != 3) || cram_check_EOF(fd) != 1)
+        return -1;
+    if ((size = hseek(fp, 0, SEEK_END)) < 0
+        || hseek(fp, here, SEEK_SET) != here)
+        return -1;
+    *end = size - (major == 3 ? 38 : 30);
+    return *end >= here ? 0 : -1;
+}
+
 // The main cram_cat interface.
 // Returns 0 on success, < 0 on error.
 int cram_cat(samFile * const firstfile, int nfn, char * const *fn,
@@ -394,6 +562,8 @@ int cram_cat(samFile * const firstfile, int nfn, char * const *fn,
     hts_idx_t *idx = NULL;
     hts_itr_t *iter = NULL;
     sam_hdr_t *old_h = NULL;
+    hts_tpool *pool = NULL;
+    char *buf = NULL;
 
     // Check consistent versioning and compatible headers;
     // merges RG lines, opens all files and returns them that multiple
@@ -433,6 +603,15 @@ int cram_cat(samFile * const firstfile, int nfn, char * const *fn,
     }
     out_c = out->fp.cram;
 
+    if (!(buf = malloc(CRAM_COPY_BUF))) {
+        print_error_errno("cat", "Out of memory");
+        goto closefiles;
+    }
+    if (ga->nthreads > 0 && !(pool = hts_tpool_init(ga->nthreads))) {
+        print_error("cat", "Couldn't create thread pool");
+        goto closefiles;
+    }
+
     for (i = 0; i < nfn; ++i) {
         samFile *in;
         cram_fd *in_c;
@@ -522,6 +701,20 @@ int cram_cat(samFile * const firstfile, int nfn, char * const *fn,
             if (0 != cram_seek(in_c, cstart, SEEK_SET))
                 goto closefiles;
 
+        // Whole files and container ranges need no containers changing,
+        // so copy them in one go when the end of the range can be found.
+        off_t copy_end;
+        if (!new_rg && !iter
+            && cram_range_end(in_c, cstart ? cend : -1, &copy_end) == 0) {
+            off_t copy_start = cstart ? cstart : htell(cram_fd_get_fp(in_c));
+            if (cram_copy_range(in_c, fn[i], out_c, copy_start, copy_end,
+                                pool, buf) < 0) {
+                print_error_errno("cat", "failed to copy from '%s'", fn[i]);
+                goto closefiles;
+            }
+            goto next_file;
+        }
+
 
         // Make refid -2 ("*") come after other chromosomes, for easy sort
         int itid = iter
@@ -557,8 +750,6 @@ int cram_cat(samFile * const firstfile, int nfn, char * const *fn,
                 //fprintf(stderr, "Transcode RG %d to %d\n", 0, new_rg);
                 cram_transcode_rg(in_c, out_c, c, 1, &zero, &new_rg);
             } else {
-                int32_t num_slices;
-
                 if (reg) {
                     if (before_hdr > cend) {
                         cram_free_container(c);
@@ -613,31 +804,15 @@ int cram_cat(samFile * const firstfile, int nfn, char * const *fn,
                     // Filter or skip
                     cram_filter_container(in_c, out_c, c, &last_ref_id);
                 } else {
-                    // Copy. Consider adding a cram_copy_container API instead.
-
-                    // Container compression header
-                    cram_block *blk;
-                    if (!(blk = cram_read_block(in_c)))
-                        goto closefiles;
-
-                    // Not switching rg so do the usual read/write loop
-                    if (cram_write_container(out_c, c) != 0)
-                        goto closefiles;
-
-                    // Contatiner compression header
-                    if (cram_write_block(out_c, blk) != 0) {
-                        cram_free_block(blk);
-                        goto closefiles;
-                    }
-
-                    // Container num_blocks can be invalid, due to a bug.
-                    // Instead we iterate in slice context instead.
-                    (void)cram_container_get_landmarks(c, &num_slices);
-                    if (cram_copy_slice(in_c, out_c, num_slices) < 0) {
-                        cram_free_block(blk);
+                    // Copy.  The container body is copied as it stands,
+                    // so its blocks and slices need not be read.
+                    // (Their num_blocks can be invalid, due to a bug, but
+                    // the length is always right.)
+                    if (cram_write_container(out_c, c) != 0
+                        || cram_copy_bytes(cram_fd_get_fp(in_c),
+                                           cram_fd_get_fp(out_c), buf,
+                                           cram_container_get_length(c)) < 0)
                         goto closefiles;
-                    }
-                    cram_free_block(blk);
                 }
             }
             cram_free_container(c);
@@ -647,6 +822,8 @@ int cram_cat(samFile * const firstfile, int nfn, char * const *fn,
             if (filter_by_cnum && before_hdr > cend)
                 break;
         }
+
+    next_file:
         sam_hdr_destroy(old_h);
         old_h = NULL;
 
@@ -678,6 +855,10 @@ closefiles:
     if (new_h)
         sam_hdr_destroy(new_h);
 
+    if (pool)
+        hts_tpool_destroy(pool);
+    free(buf);
+
     for (i = 1; i < nfn; ++i) {     //skip firstfile and close rest
         if (files[i]) {
             sam_close(files[i]);
@@ -834,7 +1015,7 @@ int main_cat(int argc, char *argv[])
     char *reg = NULL, *part = NULL;
 
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', '-', '-', 0, '-', '-'),
+        SAM_OPT_GLOBAL_OPTIONS('-', '-', '-', 0, '-', '@', '-', '-'),
         {"no-PG", no_argument, NULL, 1},
         { NULL, 0, NULL, 0 }
     };
@@ -842,7 +1023,7 @@ int main_cat(int argc, char *argv[])
     char *arg_list = NULL;
 
     sam_global_args_init(&ga);
-    while ((c = getopt_long(argc, argv, "h:o:b:r:p:qf", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "h:o:b:r:p:qf@:", lopts, NULL)) >= 0) {
         switch (c) {
             case 'h': {
                 samFile *fph = sam_open(optarg, "r");
@@ -933,7 +1114,7 @@ int main_cat(int argc, char *argv[])
         fprintf(stderr, "         -f       Fast mode: don't filter containers to exactly match region\n");
         fprintf(stderr, "         -q       Query the total number of indexed containers\n");
         fprintf(stderr, "\nStandard options:\n");
-        sam_global_opt_help(stderr, "---.---.");
+        sam_global_opt_help(stderr, "---.-@-.");
         ret = 1;
         goto end;
     }
@@ -127,14 +127,18 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <math.h>
 #include <limits.h>
+#include <errno.h>
 #include <float.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include <htslib/sam.h>
 #include <htslib/hfile.h>
+#include <htslib/thread_pool.h>
 
 #include "samtools.h"
 #include "sam_opts.h"
@@ -146,6 +150,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #else
 #   define _mm_prefetch(a,b)
 #endif
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif
 
 #ifndef MIN
 #  define MIN(a,b) ((a)<(b)?(a):(b))
@@ -290,8 +297,8 @@ typedef struct {
 #define ALIGNED(x)
 #endif
 
-// Initialised once as a global array.  This won't work if threaded,
-// but we'll rewrite if and when that gets added later.
+// Initialised once as a global array, by consensus_init before any
+// threads are started, and read-only after that.
 static double e_tab_a[1002]  ALIGNED(16);
 static double *e_tab = &e_tab_a[500];
 static double e_tab2_a[1002] ALIGNED(16);
@@ -313,6 +320,12 @@ typedef struct {
     double pum[101] ALIGNED(16);
     double pmm[101] ALIGNED(16);
 
+    // What one observed base (ACGT*N) adds to each of the 15 scores,
+    // split into the terms indexed by qual and by the homopolymer
+    // adjusted qual2.  Padded to 16 for the vector kernel.
+    double sq[6][101][16]  ALIGNED(16);
+    double sq2[6][101][16] ALIGNED(16);
+
     // Multiplier on homopolymer length before reducing phred qual
     double poly_mul;
 } cons_probs;
@@ -817,6 +830,37 @@ static void consensus_init(double p_het, double p_indel, double het_scale,
     cp->poM[0] = cp->poM[1];
     cp->puu[0] = cp->puu[1];
     cp->pum[0] = cp->pum[1];
+
+    // The terms each base adds to S[0..14] in calculate_consensus_gap5.
+    // M=MM h=_M, using qual; o=oo O=oM d=o_ u=uu n=um m=mm, using qual2.
+    static const char *terms[6] = {
+        "MhhhO...d..d.do", // A
+        ".h..dMhhO..d.do", // C
+        "..h.d.h.dMhO.do", // G
+        "...hd..hd.hdMOo", // T
+        "uuuunuuunuununm", // *
+        "MMMMOMMMOMMOMOo", // N
+    };
+    int b, k;
+    for (b = 0; b < 6; b++) {
+        for (i = 0; i < 101; i++) {
+            double __ = cp->p__[i];
+            for (k = 0; k < 16; k++) {
+                double *s = &cp->sq[b][i][k], *s2 = &cp->sq2[b][i][k];
+                *s = *s2 = 0;
+                switch (k < 15 ? terms[b][k] : '.') {
+                case 'M': *s = cp->pMM[i] - __; break;
+                case 'h': *s = cp->p_M[i] - __; break;
+                case 'o': *s = -__; *s2 = cp->poo[i]; break;
+                case 'O': *s = -__; *s2 = cp->poM[i]; break;
+                case 'd': *s = -__; *s2 = cp->po_[i]; break;
+                case 'u': *s = -__; *s2 = cp->puu[i]; break;
+                case 'n': *s = -__; *s2 = cp->pum[i]; break;
+                case 'm': *s = -__; *s2 = cp->pmm[i]; break;
+                }
+            }
+        }
+    }
 }
 
 static inline double fast_exp(double y) {
@@ -877,13 +921,18 @@ int nins(const bam1_t *b){
  * We redistribute qualities within homopolymers in this style to fix
  * naive consensus or variant calling algorithms.
  */
+static double ph2err[256];
+static pthread_once_t ph2err_once = PTHREAD_ONCE_INIT;
+
+static void ph2err_init(void) {
+    int i;
+    for (i = 0; i < 256; i++)
+        ph2err[i] = pow(10, i/-10.0);
+}
+
 void homopoly_qual_fix(bam1_t *b) {
-    static double ph2err[256] = {0};
     int i;
-    if (!ph2err[0]) {
-        for (i = 0; i < 256; i++)
-            ph2err[i] = pow(10, i/-10.0);
-    }
+    pthread_once(&ph2err_once, ph2err_init);
     uint8_t *seq = bam_get_seq(b);
     uint8_t *qual = bam_get_qual(b);
     for (i = 0; i < b->core.l_qseq; i++) {
@@ -936,6 +985,82 @@ int poly_len(const pileup_t *p, const bam1_t *b, hts_pos_t pos) {
         return 0;
 }
 
+// Adds v to d[beg] .. d[end-1] of a difference array of length len+1,
+// clipped to 0 .. len-1.
+static inline void nm_diff_add(int *d, int len, int beg, int end, int v) {
+    beg = MAX(beg, 0);
+    end = MIN(end, len);
+    if (beg < end) {
+        d[beg] += v;
+        d[end] -= v;
+    }
+}
+
+/*
+ * Fills out local_nm (qlen+1 long and zeroed) with the cost of the
+ * edits within a defined region (pos +/- halo), plus the cost of being
+ * near a soft-clip.  Each edit adds a constant over a range of bases,
+ * so these are accumulated as a difference array and summed in one
+ * pass, rather than adding to every base in the range per edit.
+ */
+static void nm_edit_cost(consensus_opts *opts, const bam1_t *b,
+                         int *local_nm) {
+    int qlen = b->core.l_qseq, i;
+    const int halo = opts->nm_halo;
+    const uint8_t *md = bam_aux_get(b, "MD");
+    if (!md)
+        return;
+    md = (const uint8_t *)bam_aux2Z(md);
+
+    // Handle cost of being near a soft-clip
+    uint32_t *cig = bam_get_cigar(b);
+    int ncig = b->core.n_cigar;
+
+    if ( (cig[0] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP ||
+        ((cig[0] & BAM_CIGAR_MASK) == BAM_CHARD_CLIP && ncig > 1 &&
+         (cig[1] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP)) {
+        nm_diff_add(local_nm, qlen, 0, halo, opts->sc_cost);
+        nm_diff_add(local_nm, qlen, halo, halo*2, opts->sc_cost>>1);
+    }
+    if ( (cig[ncig-1] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP ||
+        ((cig[ncig-1] & BAM_CIGAR_MASK) == BAM_CHARD_CLIP && ncig > 1 &&
+         (cig[ncig-2] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP)) {
+        nm_diff_add(local_nm, qlen, qlen-halo, qlen, opts->sc_cost);
+        nm_diff_add(local_nm, qlen, qlen-halo*2, qlen-halo,
+                    opts->sc_cost>>1);
+    }
+
+    // Now iterate over MD tag
+    int pos = 0;
+    while (*md) {
+        if (isdigit(*md)) {
+            uint8_t *endptr;
+            long i = strtol((char *)md, (char **)&endptr, 10);
+            md = endptr;
+            pos += i;
+            continue;
+        }
+
+        // deletion.
+        // Should we bump local_nm here too?  Maybe
+        if (*md == '^') {
+            while (*++md && !isdigit(*md))
+                continue;
+            continue;
+        }
+
+        // substitution
+        nm_diff_add(local_nm, qlen, pos-halo*2, pos-halo, 5);
+        nm_diff_add(local_nm, qlen, pos-halo, pos+halo, 10);
+        nm_diff_add(local_nm, qlen, pos+halo, pos+halo*2, 5);
+        md++;
+    }
+
+    for (i = 1; i < qlen; i++)
+        local_nm[i] += local_nm[i-1];
+    local_nm[qlen] = 0;
+}
+
 /*
  * Initialise a new sequence appearing in the pileup.  We use this to
  * precompute some metrics that we'll repeatedly use in the consensus
@@ -955,11 +1080,15 @@ int nm_init(void *client_data, samFile *fp, sam_hdr_t *h, pileup_t *p) {
     int qlen = b->core.l_qseq, i;
     if (qlen <= 0)
         return 0;
-    int *local_nm = calloc(qlen, sizeof(*local_nm));
+    int *local_nm = calloc(qlen+1, sizeof(*local_nm));
     if (!local_nm)
         return -1;
     p->cd = local_nm;
 
+    // Edit costs go in first, as they're built up in place.  The values
+    // added below are independent of them.
+    nm_edit_cost(opts, b, local_nm);
+
     double poly_adj = opts->homopoly_fix ? opts->homopoly_fix : 1;
 
     if (opts->adj_qual) {
@@ -1081,64 +1210,6 @@ int nm_init(void *client_data, samFile *fp, sam_hdr_t *h, pileup_t *p) {
         i = j-1;
     }
 
-    // Adjust local_nm array by the number of edits within
-    // a defined region (pos +/- halo).
-    const int halo = opts->nm_halo;
-    const uint8_t *md = bam_aux_get(b, "MD");
-    if (!md)
-        return 1;
-    md = (const uint8_t *)bam_aux2Z(md);
-
-    // Handle cost of being near a soft-clip
-    uint32_t *cig = bam_get_cigar(b);
-    int ncig = b->core.n_cigar;
-
-    if ( (cig[0] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP ||
-        ((cig[0] & BAM_CIGAR_MASK) == BAM_CHARD_CLIP && ncig > 1 &&
-         (cig[1] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP)) {
-        for (i = 0; i < halo && i < qlen; i++)
-            local_nm[i]+=opts->sc_cost;
-        for (; i < halo*2 && i < qlen; i++)
-            local_nm[i]+=opts->sc_cost>>1;
-    }
-    if ( (cig[ncig-1] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP ||
-        ((cig[ncig-1] & BAM_CIGAR_MASK) == BAM_CHARD_CLIP && ncig > 1 &&
-         (cig[ncig-2] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP)) {
-        for (i = qlen-1; i >= qlen-halo && i >= 0; i--)
-            local_nm[i]+=opts->sc_cost;
-        for (; i >= qlen-halo*2 && i >= 0; i--)
-            local_nm[i]+=opts->sc_cost>>1;
-    }
-
-    // Now iterate over MD tag
-    int pos = 0;
-    while (*md) {
-        if (isdigit(*md)) {
-            uint8_t *endptr;
-            long i = strtol((char *)md, (char **)&endptr, 10);
-            md = endptr;
-            pos += i;
-            continue;
-        }
-
-        // deletion.
-        // Should we bump local_nm here too?  Maybe
-        if (*md == '^') {
-            while (*++md && !isdigit(*md))
-                continue;
-            continue;
-        }
-
-        // substitution
-        for (i = pos-halo*2 >= 0 ?pos-halo*2 :0; i < pos-halo && i < qlen; i++)
-            local_nm[i]+=5;
-        for (; i < pos+halo && i < qlen; i++)
-            local_nm[i]+=10;
-        for (; i < pos+halo*2 && i < qlen; i++)
-            local_nm[i]+=5;
-        md++;
-    }
-
     return 1;
 }
 
@@ -1189,19 +1260,84 @@ double lnbinprobhalf(int n, double k) {
 }
 #endif
 
+static double q2p[101], mqual_pow[256];
+static uint8_t mqual_adj[256][101]; // qual adjusted by mapping quality
+static pthread_once_t gap5_tables_once = PTHREAD_ONCE_INIT;
+
+static void gap5_tables_init(void) {
+    int i, j;
+    for (i = 0; i <= 100; i++) {
+        q2p[i] = pow(10, -i/10.0);
+    }
+
+    for (i = 0; i < 255; i++) {
+        //mqual_pow[i] = 1-pow(10, -(i+.01)/10.0);
+        mqual_pow[i] = 1-pow(10, -(i*.9)/10.0);
+        //mqual_pow[i] = 1-pow(10, -(i/3+.1)/10.0);
+        //mqual_pow[i] = 1-pow(10, -(i/2+.05)/10.0);
+    }
+    // unknown mqual
+    mqual_pow[255] = mqual_pow[10];
+
+    for (i = 0; i < 256; i++) {
+        for (j = 0; j <= 100; j++) {
+            double _p = 1-q2p[j];
+            double _m = mqual_pow[i];
+            mqual_adj[i][j] = ph_log(1-(_m * _p + (1 - _m)/4));
+        }
+    }
+}
+
+#define GAP5_BATCH 128
+
+/*
+ * Adds the scores for n observations, held as arrays of base type
+ * (ACGT*N), qual and qual2, to S.  Each observation adds the same
+ * terms in the same order as a term by term sum would, so the
+ * result is identical.
+ */
+static void gap5_score_batch(const cons_probs *cp, const uint8_t *base,
+                             const uint8_t *qual, const uint8_t *qual2,
+                             int n, double *S) {
+    int i, k;
+#ifdef __SSE2__
+    __m128d s[8];
+    for (k = 0; k < 8; k++)
+        s[k] = _mm_load_pd(&S[2*k]);
+    for (i = 0; i < n; i++) {
+        const double *a = cp->sq [base[i]][qual [i]];
+        const double *b = cp->sq2[base[i]][qual2[i]];
+        for (k = 0; k < 8; k++)
+            s[k] = _mm_add_pd(s[k], _mm_add_pd(_mm_load_pd(&a[2*k]),
+                                               _mm_load_pd(&b[2*k])));
+    }
+    for (k = 0; k < 8; k++)
+        _mm_store_pd(&S[2*k], s[k]);
+#else
+    for (i = 0; i < n; i++) {
+        const double *a = cp->sq [base[i]][qual [i]];
+        const double *b = cp->sq2[base[i]][qual2[i]];
+        for (k = 0; k < 16; k++)
+            S[k] += a[k] + b[k];
+    }
+#endif
+}
+
 static
 int calculate_consensus_gap5(hts_pos_t pos, int flags, int depth,
                              pileup_t *plp, consensus_opts *opts,
                              consensus_t *cons, int default_qual,
                              cons_probs *cp) {
     int i, j;
-    static int init_done =0;
-    static double q2p[101], mqual_pow[256];
     double min_e_exp = DBL_MIN_EXP * log(2) + 1;
 
-    double S[15] ALIGNED(16) = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+    double S[16] ALIGNED(16) = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
     double sumsC[6] = {0,0,0,0,0,0}; // A C G T * N
 
+    // Observations gathered for gap5_score_batch
+    uint8_t o_base[GAP5_BATCH], o_qual[GAP5_BATCH], o_qual2[GAP5_BATCH];
+    int nobs = 0;
+
     // Small hash on seq to check for uniqueness of surrounding bases.
     // If it's frequent, then it's more likely to be correctly called than
     // if it's rare.
@@ -1226,22 +1362,7 @@ int calculate_consensus_gap5(hts_pos_t pos, int flags, int depth,
                     18, 19,
                         24};
 
-    if (!init_done) {
-        init_done = 1;
-
-        for (i = 0; i <= 100; i++) {
-            q2p[i] = pow(10, -i/10.0);
-        }
-
-        for (i = 0; i < 255; i++) {
-            //mqual_pow[i] = 1-pow(10, -(i+.01)/10.0);
-            mqual_pow[i] = 1-pow(10, -(i*.9)/10.0);
-            //mqual_pow[i] = 1-pow(10, -(i/3+.1)/10.0);
-            //mqual_pow[i] = 1-pow(10, -(i/2+.05)/10.0);
-        }
-        // unknown mqual
-        mqual_pow[255] = mqual_pow[10];
-    }
+    pthread_once(&gap5_tables_once, gap5_tables_init);
 
     /* Initialise */
     int counts[6] = {0};
@@ -1326,7 +1447,7 @@ int calculate_consensus_gap5(hts_pos_t pos, int flags, int depth,
         // convert from sam base to acgt*n order.
         base = L[base];
 
-        double MM, __, _M, oo, oM, o_, uu, um, mm, qe;
+        double qe;
 
         // Correction for mapping quality.  Maybe speed up via lookups?
         // Cannot nullify mapping quality completely.  Lots of (true)
@@ -1351,11 +1472,9 @@ int calculate_consensus_gap5(hts_pos_t pos, int flags, int depth,
             if (mqual > opts->high_mqual)
                 mqual = opts->high_mqual;
 
-            double _p = 1-q2p[qual];
-            double _m = mqual_pow[mqual];
-            qual = ph_log(1-(_m * _p + (1 - _m)/4)); // CURRENT
-            //qual = ph_log(1-_p*_m); // testing
-            //qual *= 6/sqrt(td);
+            // ph_log(1-(_m * _p + (1 - _m)/4)), for _p = 1-q2p[qual]
+            // and _m = mqual_pow[mqual]
+            qual = mqual_adj[mqual][qual];
         }
 
         /* Quality 0 should never be permitted as it breaks the maths */
@@ -1373,21 +1492,6 @@ int calculate_consensus_gap5(hts_pos_t pos, int flags, int depth,
         // May wish to further separate to qual2 and qual3 for ins and del?
         int qual2 = MAX(1, qual-(poly-2)*cp->poly_mul);
 
-        /* MM=match  _M=half-match  __=mismatch */
-        __ = cp->p__[qual];       // neither match
-        MM = cp->pMM[qual] - __;  // both match
-        _M = cp->p_M[qual] - __;  // one allele only (half match)
-
-        /* observation ACGT, but against hypothesis ** or *base */
-        oo = cp->poo[qual2] - __;
-        oM = cp->poM[qual2] - __;
-        o_ = cp->po_[qual2] - __;
-
-        /* observation * */
-        uu = cp->puu[qual2] - __;
-        um = cp->pum[qual2] - __;
-        mm = cp->pmm[qual2] - __;
-
         if (flags & CONS_DISCREP) {
             qe = q2p[qual];
             sumsC[base] += 1 - qe;
@@ -1399,82 +1503,17 @@ int calculate_consensus_gap5(hts_pos_t pos, int flags, int depth,
         counts2[bam_is_rev(b)][base]++;
 #endif
 
-        // oM should never be higher than _M for actual bases!  or...
-        //printf("base %d@%d MM %f _M %f oM %f\n", base, qual, MM, _M, oM);
-
-        switch (base) {
-        case 0: // A
-            S[0]  += MM;
-            S[1]  += _M;
-            S[2]  += _M;
-            S[3]  += _M;
-            S[4]  += oM;
-            S[8]  += o_;
-            S[11] += o_;
-            S[13] += o_;
-            S[14] += oo;
-            break;
-
-        case 1: // C
-            S[1]  += _M;
-            S[5]  += MM;
-            S[6]  += _M;
-            S[7]  += _M;
-            S[8]  += oM;
-            S[4]  += o_;
-            S[11] += o_;
-            S[13] += o_;
-            S[14] += oo;
-
-            //fprintf(stderr, "%d %f %f %f\n", qual, MM+__, oo+__, MM-oo);
-            break;
-
-        case 2: // G
-            S[ 2] += _M;
-            S[ 6] += _M;
-            S[ 9] += MM;
-            S[10] += _M;
-            S[11] += oM;
-            S[4]  += o_;
-            S[8]  += o_;
-            S[13] += o_;
-            S[14] += oo;
-            break;
-
-        case 3: // T
-            S[ 3] += _M; // _m
-            S[ 7] += _M;
-            S[10] += _M;
-            S[12] += MM; // mm
-            S[13] += oM;
-            S[4]  += o_;
-            S[8]  += o_;
-            S[11] += o_;
-            S[14] += oo;
-            // S[14] oo
-
-            break;
-
-        case 4: // *
-            //   under       under       under       under   agree-no-base
-            S[0] += uu; S[1 ]+= uu; S[2 ]+= uu; S[3 ]+= uu; S[4 ]+= um;
-                        S[5 ]+= uu; S[6 ]+= uu; S[7 ]+= uu; S[8 ]+= um;
-                                    S[9 ]+= uu; S[10]+= uu; S[11]+= um;
-                                                S[12]+= uu; S[13]+= um;
-                                                            S[14]+= mm;
-            break;
-
-        case 5: /* N => equal weight to all A,C,G,T but not a pad */
-            S[0] += MM; S[1 ]+= MM; S[2 ]+= MM; S[3 ]+= MM; S[4 ]+= oM;
-                        S[5 ]+= MM; S[6 ]+= MM; S[7 ]+= MM; S[8 ]+= oM;
-                                    S[9 ]+= MM; S[10]+= MM; S[11]+= oM;
-                                                S[12]+= MM; S[13]+= oM;
-                                                            S[14]+= oo;
-            break;
+        o_base[nobs]  = base;
+        o_qual[nobs]  = qual;
+        o_qual2[nobs] = qual2;
+        if (++nobs == GAP5_BATCH) {
+            gap5_score_batch(cp, o_base, o_qual, o_qual2, nobs, S);
+            nobs = 0;
         }
 
         depth++;
     }
+    gap5_score_batch(cp, o_base, o_qual, o_qual2, nobs, S);
 
 #ifdef DO_POLY_DIST
     // Or compute mean and s.d per strand.
@@ -2164,67 +2203,18 @@ static int basic_pileup(void *cd, samFile *fp, sam_hdr_t *h, pileup_t *p,
     return 0;
 }
 
-static int basic_fasta(void *cd, samFile *fp, sam_hdr_t *h, pileup_t *p,
-                       int depth, hts_pos_t pos, int nth, int is_insert) {
+/*
+ * Calls the consensus for one column and appends it to the FASTA/FASTQ
+ * being built in opts->ks_ins_seq and ks_ins_qual, padding any
+ * uncovered gap since opts->last_pos with N.
+ */
+static int fasta_column(consensus_opts *opts, pileup_t *p, int depth,
+                        hts_pos_t pos, int nth) {
     int cb, cq;
-    consensus_opts *opts = (consensus_opts *)cd;
     int tid = p->b.core.tid;
     kstring_t *seq  = &opts->ks_ins_seq;
     kstring_t *qual = &opts->ks_ins_qual;
 
-    if (!opts->show_ins && nth)
-        return 0;
-
-    if (opts->iter) {
-        if (opts->iter->beg >= pos || opts->iter->end < pos)
-            return 0;
-    }
-
- next_ref:
-    if (tid != opts->last_tid) {
-        if (opts->last_tid != -1) {
-            if (opts->all_bases) {
-                // Fill in remainder of previous reference
-                int i, N;
-                if (opts->iter) {
-                    opts->last_pos = MAX(opts->last_pos, opts->iter->beg-1);
-                    N = opts->iter->end;
-                } else {
-                    N = INT_MAX;
-                }
-                N = MIN(N, sam_hdr_tid2len(opts->h, opts->last_tid))
-                    - opts->last_pos;
-                if (N > 0) {
-                    if (ks_expand(seq, N+1) < 0)
-                        return -1;
-                    if (ks_expand(qual, N+1) < 0)
-                        return -1;
-                    for (i = 0; i < N; i++) {
-                        seq->s[seq->l++] = 'N';
-                        qual->s[qual->l++] = '!';
-                    }
-                    seq->s[seq->l] = 0;
-                    qual->s[qual->l] = 0;
-                }
-            }
-            dump_fastq(opts, sam_hdr_tid2name(opts->h, opts->last_tid),
-                       seq->s, seq->l, qual->s, qual->l);
-        }
-
-        seq->l = 0; qual->l = 0;
-
-        if (!opts->iter && opts->all_bases > 1 && ++opts->last_tid < tid) {
-            opts->last_pos = 0;
-            goto next_ref;
-        }
-
-        opts->last_tid = tid;
-        if (opts->iter)
-            opts->last_pos = opts->iter->beg;
-        else
-            opts->last_pos = opts->all_bases ? 0 : pos-1;
-    }
-
     // share this with basic_pileup
     if (opts->mode != MODE_SIMPLE) {
         consensus_t cons;
@@ -2302,6 +2292,384 @@ static int basic_fasta(void *cd, samFile *fp, sam_hdr_t *h, pileup_t *p,
     return 0;
 }
 
+static int basic_fasta(void *cd, samFile *fp, sam_hdr_t *h, pileup_t *p,
+                       int depth, hts_pos_t pos, int nth, int is_insert) {
+    consensus_opts *opts = (consensus_opts *)cd;
+    int tid = p->b.core.tid;
+    kstring_t *seq  = &opts->ks_ins_seq;
+    kstring_t *qual = &opts->ks_ins_qual;
+
+    if (!opts->show_ins && nth)
+        return 0;
+
+    if (opts->iter) {
+        if (opts->iter->beg >= pos || opts->iter->end < pos)
+            return 0;
+    }
+
+ next_ref:
+    if (tid != opts->last_tid) {
+        if (opts->last_tid != -1) {
+            if (opts->all_bases) {
+                // Fill in remainder of previous reference
+                int i, N;
+                if (opts->iter) {
+                    opts->last_pos = MAX(opts->last_pos, opts->iter->beg-1);
+                    N = opts->iter->end;
+                } else {
+                    N = INT_MAX;
+                }
+                N = MIN(N, sam_hdr_tid2len(opts->h, opts->last_tid))
+                    - opts->last_pos;
+                if (N > 0) {
+                    if (ks_expand(seq, N+1) < 0)
+                        return -1;
+                    if (ks_expand(qual, N+1) < 0)
+                        return -1;
+                    for (i = 0; i < N; i++) {
+                        seq->s[seq->l++] = 'N';
+                        qual->s[qual->l++] = '!';
+                    }
+                    seq->s[seq->l] = 0;
+                    qual->s[qual->l] = 0;
+                }
+            }
+            dump_fastq(opts, sam_hdr_tid2name(opts->h, opts->last_tid),
+                       seq->s, seq->l, qual->s, qual->l);
+        }
+
+        seq->l = 0; qual->l = 0;
+
+        if (!opts->iter && opts->all_bases > 1 && ++opts->last_tid < tid) {
+            opts->last_pos = 0;
+            goto next_ref;
+        }
+
+        opts->last_tid = tid;
+        if (opts->iter)
+            opts->last_pos = opts->iter->beg;
+        else
+            opts->last_pos = opts->all_bases ? 0 : pos-1;
+    }
+
+    return fasta_column(opts, p, depth, pos, nth);
+}
+
+/* --------------------------------------------------------------------------
+ * Threaded FASTA/FASTQ consensus.
+ *
+ * Each reference is cut into windows, and each window is piled up from
+ * its own index query on a worker.  A window only calls the columns
+ * (beg,end], including any insertion columns following end, but sees
+ * every read overlapping those columns, so each column gets the same
+ * call as the serial code would give it.  The main thread stitches the
+ * windows back together in order, filling the gaps between them as
+ * basic_fasta does between columns.
+ */
+#define CONS_WINDOW_MIN 10000
+#define CONS_WINDOW_MAX (1<<20)
+
+typedef struct {
+    samFile *fp;
+    sam_hdr_t *h;
+    hts_idx_t *idx;
+} cons_reader_t;
+
+// As view's region readers: opened when first needed, then handed
+// between windows, so there are never more than the pool has threads.
+typedef struct {
+    const char *fn;
+    htsFormat *fmt;
+    cons_reader_t *r;
+    int *avail, navail, nr;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} cons_readers_t;
+
+typedef struct {
+    consensus_opts opts;   // first, as the callbacks are given a window
+                           // in place of the options
+    cons_readers_t *readers;
+    int tid;
+    hts_pos_t beg, end;    // 0-based, half open
+    hts_pos_t first;       // first column called, or -1
+    int fill_gap;          // the first column pads from the last window
+    int ret;
+} cons_window_t;
+
+static void cons_reader_close(cons_reader_t *r) {
+    if (r->idx) hts_idx_destroy(r->idx);
+    if (r->h) sam_hdr_destroy(r->h);
+    if (r->fp) sam_close(r->fp);
+    r->idx = NULL;
+    r->h = NULL;
+    r->fp = NULL;
+}
+
+static int cons_reader_open(cons_readers_t *rd, cons_reader_t *r) {
+    if (!(r->fp = sam_open_format(rd->fn, "r", rd->fmt))) {
+        print_error_errno("consensus", "failed to reopen \"%s\"", rd->fn);
+        return -1;
+    }
+    if (hts_set_opt(r->fp, CRAM_OPT_DECODE_MD, 0)
+        || !(r->h = sam_hdr_read(r->fp))
+        || !(r->idx = sam_index_load(r->fp, rd->fn))) {
+        print_error("consensus", "failed to set up a reader for \"%s\"",
+                    rd->fn);
+        cons_reader_close(r);
+        return -1;
+    }
+    return 0;
+}
+
+static cons_reader_t *cons_reader_get(cons_readers_t *rd) {
+    cons_reader_t *r;
+    pthread_mutex_lock(&rd->lock);
+    while (!rd->navail)
+        pthread_cond_wait(&rd->cond, &rd->lock);
+    r = &rd->r[rd->avail[--rd->navail]];
+    pthread_mutex_unlock(&rd->lock);
+    return r;
+}
+
+static void cons_reader_put(cons_readers_t *rd, cons_reader_t *r) {
+    pthread_mutex_lock(&rd->lock);
+    rd->avail[rd->navail++] = r - rd->r;
+    pthread_cond_signal(&rd->cond);
+    pthread_mutex_unlock(&rd->lock);
+}
+
+static int window_fasta(void *cd, samFile *fp, sam_hdr_t *h, pileup_t *p,
+                        int depth, hts_pos_t pos, int nth, int is_insert) {
+    cons_window_t *w = (cons_window_t *)cd;
+    consensus_opts *opts = &w->opts;
+    size_t len = opts->ks_ins_seq.l;
+    int ret;
+
+    if (pos > w->end)
+        return 1; // only reached once all the reads are in
+    if (pos <= w->beg || (!opts->show_ins && nth))
+        return 0;
+
+    if (w->first < 0) {
+        w->first = pos;
+        opts->last_pos = pos-1;
+        if ((ret = fasta_column(opts, p, depth, pos, nth)) < 0)
+            return ret;
+        // As in basic_fasta, a deletion that is not shown leaves the
+        // gap before it unfilled
+        w->fill_gap = opts->ks_ins_seq.l > len;
+        return ret;
+    }
+    return fasta_column(opts, p, depth, pos, nth);
+}
+
+static void *consensus_window(void *arg) {
+    cons_window_t *w = (cons_window_t *)arg;
+    cons_reader_t *r = cons_reader_get(w->readers);
+
+    w->opts.ks_ins_seq.l = w->opts.ks_ins_qual.l = 0;
+    w->opts.last_tid = w->tid;
+    w->opts.last_pos = -1;
+    w->first = -1;
+    w->fill_gap = 0;
+    w->ret = 0;
+    if (w->beg >= w->end)
+        goto out;
+
+    if (!r->fp && cons_reader_open(w->readers, r) < 0) {
+        w->ret = -1;
+        goto out;
+    }
+    w->opts.fp = r->fp;
+    w->opts.h = r->h;
+    // One base beyond the end picks up reads that start with an insertion
+    if (!(w->opts.iter = sam_itr_queryi(r->idx, w->tid, w->beg, w->end+1))) {
+        w->ret = -1;
+        goto out;
+    }
+    w->ret = pileup_loop(r->fp, r->h, readaln2,
+                         w->opts.mode != MODE_SIMPLE ? nm_init : NULL,
+                         window_fasta,
+                         w->opts.mode != MODE_SIMPLE ? nm_free : NULL,
+                         w);
+    hts_itr_destroy(w->opts.iter);
+    w->opts.iter = NULL;
+
+ out:
+    cons_reader_put(w->readers, r);
+    return w;
+}
+
+// Pads the consensus being built with N for positions from+1 to to
+static int pad_consensus(consensus_opts *opts, hts_pos_t from, hts_pos_t to) {
+    kstring_t *seq  = &opts->ks_ins_seq;
+    kstring_t *qual = &opts->ks_ins_qual;
+    if (to <= from)
+        return 0;
+    if (ks_expand(seq, to - from + 1) < 0 || ks_expand(qual, to - from + 1) < 0)
+        return -1;
+    memset(seq->s  + seq->l,  'N', to - from);
+    memset(qual->s + qual->l, '!', to - from);
+    seq->l  += to - from;
+    qual->l += to - from;
+    seq->s[seq->l] = qual->s[qual->l] = 0;
+    return 0;
+}
+
+static int consensus_threaded(consensus_opts *opts, htsFormat *fmt,
+                              const char *fn, int nthreads,
+                              hts_pos_t window) {
+    int nslot = 2 * nthreads, next = 0, in_flight = 0, ret = -1, i;
+    int tid = opts->iter ? opts->iter->tid : 0;
+    int tid_end = opts->iter ? tid + 1 : sam_hdr_nref(opts->h);
+    hts_pos_t wbeg = -1, cend = 0, last = -1, total = 0;
+    int cur_tid = -1, has_data = 0;
+    cons_readers_t rd = { fn, fmt, NULL, NULL, 0, nthreads };
+    cons_window_t *win = NULL;
+    hts_tpool *pool = NULL;
+    hts_tpool_process *q = NULL;
+
+    if (window <= 0) {
+        for (i = tid; i < tid_end; i++)
+            total += sam_hdr_tid2len(opts->h, i);
+        window = total / (8 * nthreads);
+        window = MAX(CONS_WINDOW_MIN, MIN(CONS_WINDOW_MAX, window));
+    }
+
+    pthread_mutex_init(&rd.lock, NULL);
+    pthread_cond_init(&rd.cond, NULL);
+    if (!(rd.r = calloc(nthreads, sizeof(*rd.r)))
+        || !(rd.avail = malloc(nthreads * sizeof(*rd.avail)))
+        || !(win = calloc(nslot, sizeof(*win))))
+        goto err;
+    for (rd.navail = 0; rd.navail < nthreads; rd.navail++)
+        rd.avail[rd.navail] = rd.navail;
+    for (i = 0; i < nslot; i++) {
+        win[i].opts = *opts;
+        win[i].opts.iter = NULL;
+        win[i].opts.ks_line = (kstring_t) KS_INITIALIZE;
+        win[i].opts.ks_ins_seq = (kstring_t) KS_INITIALIZE;
+        win[i].opts.ks_ins_qual = (kstring_t) KS_INITIALIZE;
+        win[i].readers = &rd;
+    }
+
+    if (!(pool = hts_tpool_init(nthreads))
+        || !(q = hts_tpool_process_init(pool, nslot, 0)))
+        goto err;
+
+    for (;;) {
+        // Queue windows, one reference after another
+        while (tid < tid_end && in_flight < nslot) {
+            uint64_t mapped, unmapped;
+            if (!opts->iter && opts->all_bases < 2 && wbeg < 0
+                && hts_idx_get_stat(opts->idx, tid, &mapped, &unmapped) == 0
+                && mapped == 0) {
+                tid++; // nothing to output
+                continue;
+            }
+            hts_pos_t len = sam_hdr_tid2len(opts->h, tid);
+            hts_pos_t beg = opts->iter ? opts->iter->beg : 0;
+            hts_pos_t end = opts->iter ? MIN(opts->iter->end, len) : len;
+            cons_window_t *w = &win[next];
+            if (wbeg < 0)
+                wbeg = beg;
+            w->tid = tid;
+            w->beg = MIN(wbeg, end);
+            w->end = MIN(w->beg + window, end);
+            if (w->end >= end) {
+                tid++;
+                wbeg = -1;
+            } else {
+                wbeg = w->end;
+            }
+            if (hts_tpool_dispatch(pool, q, consensus_window, w) < 0)
+                goto err;
+            next = (next + 1) % nslot;
+            in_flight++;
+        }
+        if (!in_flight)
+            break;
+
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        if (!res)
+            goto err;
+        cons_window_t *w = (cons_window_t *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+        if (w->ret < 0)
+            goto err;
+
+        // Stitch this window on to its reference
+        if (w->tid != cur_tid) {
+            cur_tid = w->tid;
+            has_data = 0;
+            opts->ks_ins_seq.l = opts->ks_ins_qual.l = 0;
+            if (opts->all_bases)
+                last = opts->iter ? opts->iter->beg : 0;
+            else
+                last = -1;
+            cend = sam_hdr_tid2len(opts->h, cur_tid);
+            if (opts->iter)
+                cend = MIN(opts->iter->end, cend);
+        }
+        if (w->first >= 0) {
+            has_data = 1;
+            if (last < 0)
+                last = w->first - 1;
+            if (w->fill_gap && pad_consensus(opts, last, w->first - 1) < 0)
+                goto err;
+            if (kputsn(w->opts.ks_ins_seq.s, w->opts.ks_ins_seq.l,
+                       &opts->ks_ins_seq) < 0 ||
+                kputsn(w->opts.ks_ins_qual.s, w->opts.ks_ins_qual.l,
+                       &opts->ks_ins_qual) < 0)
+                goto err;
+            last = w->opts.last_pos;
+        }
+
+        // Reference complete
+        if (w->end >= cend) {
+            if (opts->all_bases) {
+                if (opts->iter)
+                    last = MAX(last, opts->iter->beg);
+                if (pad_consensus(opts, last, cend) < 0)
+                    goto err;
+            }
+            if (has_data || (opts->all_bases && (opts->iter
+                                                 || opts->all_bases > 1)))
+                dump_fastq(opts, sam_hdr_tid2name(opts->h, cur_tid),
+                           opts->ks_ins_seq.s,  opts->ks_ins_seq.l,
+                           opts->ks_ins_qual.s, opts->ks_ins_qual.l);
+        }
+    }
+
+    ret = 0;
+ err:
+    if (ret < 0)
+        print_error("consensus", "failed to compute consensus windows");
+    if (q)
+        hts_tpool_process_destroy(q);
+    if (pool)
+        hts_tpool_destroy(pool);
+    if (win) {
+        for (i = 0; i < nslot; i++) {
+            ks_free(&win[i].opts.ks_line);
+            ks_free(&win[i].opts.ks_ins_seq);
+            ks_free(&win[i].opts.ks_ins_qual);
+        }
+        free(win);
+    }
+    pthread_mutex_destroy(&rd.lock);
+    pthread_cond_destroy(&rd.cond);
+    if (rd.r) {
+        for (i = 0; i < nthreads; i++)
+            cons_reader_close(&rd.r[i]);
+        free(rd.r);
+    }
+    free(rd.avail);
+    return ret;
+}
+
 // END OF NEW PILEUP
 //---------------------------------------------------------------------------
 
@@ -2326,6 +2694,7 @@ static void usage_exit(FILE *fp, int exit_status) {
     fprintf(fp, "  --mark-ins            Add '+' before every inserted base/qual [off]\n");
     fprintf(fp, "  -A, --ambig           Enable IUPAC ambiguity codes [off]\n");
     fprintf(fp, "  -d, --min-depth INT   Minimum depth of INT [1]\n");
+    fprintf(fp, "      --window INT      Size of region given to each thread [auto]\n");
     fprintf(fp, "\nFor simple consensus mode:\n");
     fprintf(fp, "  -q, --(no-)use-qual   Use quality values in calculation [off]\n");
     fprintf(fp, "  -c, --call-fract INT  At least INT portion of bases must agree [0.75]\n");
@@ -2361,6 +2730,7 @@ static void usage_exit(FILE *fp, int exit_status) {
 
 int main_consensus(int argc, char **argv) {
     int c, ret = 1;
+    hts_pos_t window = 0;
 
     consensus_opts opts = {
         // User options
@@ -2413,7 +2783,7 @@ int main_consensus(int argc, char **argv) {
 
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', '-', '-', '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', '-', '-', '@', '-', '-'),
         {"use-qual",           no_argument,       NULL, 'q'},
         {"no-use-qual",        no_argument,       NULL, 'q'+1000},
         {"adj-qual",           no_argument,       NULL, 'q'+100},
@@ -2456,6 +2826,7 @@ int main_consensus(int argc, char **argv) {
         {"homopoly-redux",     required_argument, NULL, 'p'+200},
         {"qual-calibration",   required_argument, NULL, 't'},
         {"config",             required_argument, NULL, 'X'},
+        {"window",             required_argument, NULL, 20},
         {NULL, 0, NULL, 0}
     };
 
@@ -2497,6 +2868,16 @@ int main_consensus(int argc, char **argv) {
         case 'm'+101: opts.nm_adjust = 0; break;
         case 'h'+100: opts.nm_halo = atoi(optarg); break;
         case 'h'+101: opts.sc_cost = atoi(optarg); break;
+        case 20: {
+            char *end;
+            errno = 0;
+            window = strtoll(optarg, &end, 0);
+            if (end == optarg || *end || errno == ERANGE || window < 1) {
+                print_error("consensus", "invalid --window \"%s\"", optarg);
+                return 1;
+            }
+            break;
+        }
 
         case 'm': // mode
             if (strcasecmp(optarg, "simple") == 0) {
@@ -2713,7 +3094,18 @@ int main_consensus(int argc, char **argv) {
         }
     }
 
-    if (opts.fmt == PILEUP) {
+    // With threads and an index, windows are called on the thread pool
+    if (ga.nthreads > 0 && opts.fmt != PILEUP && !opts.idx
+        && strcmp(argv[optind], "-") != 0)
+        opts.idx = sam_index_load3(opts.fp, argv[optind], NULL,
+                                   HTS_IDX_SILENT_FAIL);
+
+    if (ga.nthreads > 0 && opts.fmt != PILEUP && opts.idx) {
+        if (consensus_threaded(&opts, &ga.in, argv[optind],
+                               ga.nthreads, window) < 0)
+            goto err;
+
+    } else if (opts.fmt == PILEUP) {
         if (pileup_loop(opts.fp, opts.h, readaln2,
                         opts.mode != MODE_SIMPLE ? nm_init : NULL,
                         basic_pileup,
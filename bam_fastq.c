@@ -26,6 +26,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <config.h>
 
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
 #include <strings.h>
 #include <stdbool.h>
@@ -34,6 +35,9 @@ DEALINGS IN THE SOFTWARE.  */
 #include <inttypes.h>
 #include <unistd.h>
 #include <float.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "htslib/sam.h"
 #include "htslib/klist.h"
@@ -43,6 +47,8 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/khash.h"
 #include "samtools.h"
 #include "sam_opts.h"
+#include "tmp_file.h"
+#include "seq_utils.h"
 
 KHASH_SET_INIT_STR(str)
 typedef khash_t(str) strhash_t;
@@ -103,13 +109,19 @@ static void bam2fq_usage(FILE *to, const char *command)
 "  --quality-tag TAG\n"
 "               Quality tag [" DEFAULT_QUALITY_TAG "]\n"
 "  --index-format STR\n"
-"               How to parse barcode and quality tags\n\n");
+"               How to parse barcode and quality tags\n"
+"  --pair-mates pair READ1 and READ2 by name on input that is not collated\n"
+"  --max-unpaired INT\n"
+"               reads to hold awaiting their mates with --pair-mates [1000000]\n"
+"  --tmp-prefix STR\n"
+"               write temporary files to STR.NNNN [$TMPDIR or /tmp]\n\n");
     sam_global_opt_help(to, "-.--.@-.");
     fprintf(to,
 "\n"
 "The files will be automatically compressed if the file names have a .gz\n"
 "or .bgzf extension.  The input to this program must be collated by name.\n"
-"Run 'samtools collate' or 'samtools sort -n' to achieve this.\n"
+"Run 'samtools collate' or 'samtools sort -n' to achieve this, or use\n"
+"--pair-mates for coordinate sorted input.\n"
 "\n"
 "Reads are designated READ1 if FLAG READ1 is set and READ2 is not set.\n"
 "Reads are designated READ2 if FLAG READ1 is not set and READ2 is set.\n"
@@ -157,6 +169,9 @@ typedef struct bam2fq_opts {
     char compression_level;
     const char *filter_tag;       // -d opt
     strhash_t *filter_tag_vals;
+    bool pair_mates;
+    int64_t max_unpaired;
+    char *tmp_prefix;
 } bam2fq_opts_t;
 
 typedef struct bam2fq_state {
@@ -173,6 +188,8 @@ typedef struct bam2fq_state {
     char *index_sequence;
     char compression_level;
     htsThreadPool p;
+    struct fq_writer *w;
+    int nw;
 } bam2fq_state_t;
 
 // Adds a single tag value to the filter tag value hash
@@ -235,6 +252,7 @@ static void free_opts(bam2fq_opts_t *opts)
 
         kh_destroy(str, opts->filter_tag_vals);
     }
+    free(opts->tmp_prefix);
     free(opts);
 }
 
@@ -258,11 +276,13 @@ static bool parse_opts(int argc, char *argv[], bam2fq_opts_t** opts_out)
     opts->extra_tags = NULL;
     opts->compression_level = 1;
     opts->flag_off = BAM_FSECONDARY|BAM_FSUPPLEMENTARY;
+    opts->max_unpaired = 1000000;
 
     int c;
+    const char *tmp_arg = NULL;
     sam_global_args_init(&opts->ga);
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '@', '-', '-'),
         {"require-flags", required_argument, NULL, 'f'},
         {"excl-flags", required_argument, NULL, 'F'},
         {"exclude-flags", required_argument, NULL, 'F'},
@@ -282,6 +302,9 @@ static bool parse_opts(int argc, char *argv[], bam2fq_opts_t** opts_out)
         {"quality-tag", required_argument, NULL, 'q'},
         {"tag", required_argument, NULL, 'd'},
         {"tag-file", required_argument, NULL, 'D'},
+        {"pair-mates", no_argument, NULL, 4},
+        {"max-unpaired", required_argument, NULL, 5},
+        {"tmp-prefix", required_argument, NULL, 6},
         { NULL, 0, NULL, 0 }
     };
     while ((c = getopt_long(argc, argv, "0:1:2:o:f:F:G:niNOs:c:tT:v:@:d:D:",
@@ -292,6 +315,20 @@ static bool parse_opts(int argc, char *argv[], bam2fq_opts_t** opts_out)
             case  1 : opts->index_file[0] = optarg; break;
             case  2 : opts->index_file[1] = optarg; break;
             case  3 : opts->index_format = optarg; break;
+            case  4 : opts->pair_mates = true; break;
+            case  5 : {
+                char *end;
+                errno = 0;
+                opts->max_unpaired = strtoll(optarg, &end, 0);
+                if (end == optarg || *end || errno == ERANGE
+                    || opts->max_unpaired < 1) {
+                    print_error("bam2fq", "--max-unpaired must be an integer of at least 1, not \"%s\"", optarg);
+                    free_opts(opts);
+                    return false;
+                }
+                break;
+            }
+            case  6 : tmp_arg = optarg; break;
             case '0': opts->fnr[0] = optarg; break;
             case '1': opts->fnr[1] = optarg; break;
             case '2': opts->fnr[2] = optarg; break;
@@ -456,6 +493,29 @@ static bool parse_opts(int argc, char *argv[], bam2fq_opts_t** opts_out)
         return false;
     }
     opts->fn_input = argc > optind ? argv[optind] : "-";
+
+    if (opts->pair_mates) {
+        // Same naming scheme as markdup, in $TMPDIR unless told otherwise
+        kstring_t tmp_ks = KS_INITIALIZE;
+        struct stat st;
+        unsigned t = ((unsigned) time(NULL)) ^ ((unsigned) clock());
+        if (!tmp_arg) {
+            tmp_arg = getenv("TMPDIR");
+            if (!tmp_arg || !*tmp_arg)
+                tmp_arg = "/tmp";
+        }
+        kputs(tmp_arg, &tmp_ks);
+        if (stat(tmp_ks.s, &st) == 0 && S_ISDIR(st.st_mode)
+            && tmp_ks.s[tmp_ks.l-1] != '/')
+            kputc('/', &tmp_ks);
+        if (ksprintf(&tmp_ks, "samtools.%d.%u.tmp",
+                     (int) getpid(), t % 10000) < 0) {
+            free(tmp_ks.s);
+            free_opts(opts);
+            return false;
+        }
+        opts->tmp_prefix = ks_release(&tmp_ks);
+    }
     *opts_out = opts;
     return true;
 }
@@ -763,6 +823,156 @@ static inline bool filter_it_out(const bam1_t *b, const bam2fq_state_t *state,
 
 }
 
+// With -@, each output file gets a writer thread of its own.  The main
+// loop only picks which records go where; copies of them are handed
+// over in batches, and the FASTQ formatting and BGZF compression of the
+// streams then run alongside the reading and each other.
+#define FQ_BATCH 1024
+#define FQ_QUEUE 4  // batches per writer
+
+typedef struct {
+    bam1_t *b[FQ_BATCH];
+    int n;
+} fq_batch_t;
+
+typedef struct fq_writer {
+    samFile *fp;
+    sam_hdr_t *h;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    fq_batch_t batch[FQ_QUEUE];
+    int head, count; // batches queued for writing, from head
+    int fill;        // batch being filled, always (head + count) % FQ_QUEUE
+    int done, error;
+} fq_writer_t;
+
+static void *fq_writer_thread(void *arg) {
+    fq_writer_t *w = (fq_writer_t *)arg;
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        while (!w->count && !w->done)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->count) {
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        fq_batch_t *bt = &w->batch[w->head];
+        int error = w->error;
+        pthread_mutex_unlock(&w->lock);
+
+        int i;
+        for (i = 0; i < bt->n && !error; i++)
+            if (sam_write1(w->fp, w->h, bt->b[i]) < 0)
+                error = 1;
+
+        pthread_mutex_lock(&w->lock);
+        w->error |= error;
+        w->head = (w->head + 1) % FQ_QUEUE;
+        w->count--;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+// Queues the batch being filled and waits for a free one
+static int fq_writer_submit(fq_writer_t *w) {
+    int error;
+    pthread_mutex_lock(&w->lock);
+    w->count++;
+    pthread_cond_broadcast(&w->cond);
+    while (w->count == FQ_QUEUE)
+        pthread_cond_wait(&w->cond, &w->lock);
+    error = w->error;
+    pthread_mutex_unlock(&w->lock);
+    w->fill = (w->fill + 1) % FQ_QUEUE;
+    w->batch[w->fill].n = 0;
+    return error ? -1 : 0;
+}
+
+static int fq_write1(bam2fq_state_t *state, samFile *fp, const bam1_t *b) {
+    int i;
+    for (i = 0; i < state->nw; i++)
+        if (state->w[i].fp == fp)
+            break;
+    if (i == state->nw)
+        return sam_write1(fp, state->h, b);
+
+    fq_writer_t *w = &state->w[i];
+    fq_batch_t *bt = &w->batch[w->fill];
+    if (!bt->b[bt->n] && !(bt->b[bt->n] = bam_init1()))
+        return -1;
+    if (!bam_copy1(bt->b[bt->n], b))
+        return -1;
+    if (++bt->n == FQ_BATCH)
+        return fq_writer_submit(w);
+    return 0;
+}
+
+static int start_writers(bam2fq_state_t *state) {
+    samFile *fps[6] = {
+        state->fpse, state->fpr[0], state->fpr[1], state->fpr[2],
+        state->fpi[0], state->fpi[1]
+    };
+    int i, j;
+
+    if (!state->p.pool)
+        return 0;
+    if (!(state->w = calloc(6, sizeof(*state->w))))
+        return -1;
+    for (i = 0; i < 6; i++) {
+        if (!fps[i])
+            continue;
+        for (j = 0; j < state->nw; j++)
+            if (state->w[j].fp == fps[i])
+                break;
+        if (j < state->nw)
+            continue;
+
+        fq_writer_t *w = &state->w[state->nw];
+        w->fp = fps[i];
+        w->h = state->h;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if (pthread_create(&w->tid, NULL, fq_writer_thread, w) != 0) {
+            pthread_mutex_destroy(&w->lock);
+            pthread_cond_destroy(&w->cond);
+            w->fp = NULL;
+            return -1;
+        }
+        state->nw++;
+    }
+    return 0;
+}
+
+// Writes out what is left and stops the threads
+static int stop_writers(bam2fq_state_t *state) {
+    int i, j, k, ret = 0;
+    for (i = 0; i < state->nw; i++) {
+        fq_writer_t *w = &state->w[i];
+        if (w->batch[w->fill].n && fq_writer_submit(w) < 0)
+            ret = -1;
+        pthread_mutex_lock(&w->lock);
+        w->done = 1;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->tid, NULL);
+        if (w->error)
+            ret = -1;
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        for (j = 0; j < FQ_QUEUE; j++)
+            for (k = 0; k < FQ_BATCH; k++)
+                if (w->batch[j].b[k])
+                    bam_destroy1(w->batch[j].b[k]);
+    }
+    free(state->w);
+    state->w = NULL;
+    state->nw = 0;
+    return ret;
+}
+
 int write_index_rec(samFile *fp, bam1_t *b, bam2fq_state_t *state,
                     bam2fq_opts_t* opts, char *seq, int seq_len,
                     char *qual, int qual_len) {
@@ -786,16 +996,14 @@ int write_index_rec(samFile *fp, bam1_t *b, bam2fq_state_t *state,
 
     uint8_t *q = bam_get_qual(b2);
     if (qual) {
-        int i;
-        for (i = 0; i < seq_len; i++)
-            q[i] -= '!';
+        qual_sub_offset(q, seq_len, '!');
     } else {
         memset(q, opts->def_qual, seq_len);
     }
 
     memcpy(bam_get_aux(b2), bam_get_aux(b), aux_len);
     b2->l_data += aux_len;
-    if (sam_write1(fp, state->h, b2) < 0)
+    if (fq_write1(state, fp, b2) < 0)
         goto err;
 
     ret = 0;
@@ -906,9 +1114,9 @@ static int flush_rec(bam2fq_state_t *state, bam2fq_opts_t* opts,
                     goto err;
 
         }
-        if (sam_write1(state->fpr[1], state->h, b[best[1]]) < 0)
+        if (fq_write1(state, state->fpr[1], b[best[1]]) < 0)
             goto err;
-        if (sam_write1(state->fpr[2], state->h, b[best[2]]) < 0)
+        if (fq_write1(state, state->fpr[2], b[best[2]]) < 0)
             goto err;
 
         if (output_index(b[best[1]], b[best[2]], state, opts) < 0)
@@ -917,19 +1125,19 @@ static int flush_rec(bam2fq_state_t *state, bam2fq_opts_t* opts,
         if (state->fpse) {
             // print whichever one exists to fpse
             if (score[1] > 0) {
-                if (sam_write1(state->fpse, state->h, b[best[1]]) < 0)
+                if (fq_write1(state, state->fpse, b[best[1]]) < 0)
                     goto err;
             } else {
-                if (sam_write1(state->fpse, state->h, b[best[2]]) < 0)
+                if (fq_write1(state, state->fpse, b[best[2]]) < 0)
                     goto err;
             }
             ++(*n_singletons);
         } else {
             if (score[1] > 0) {
-                if (sam_write1(state->fpr[1], state->h, b[best[1]]) < 0)
+                if (fq_write1(state, state->fpr[1], b[best[1]]) < 0)
                     goto err;
             } else {
-                if (sam_write1(state->fpr[2], state->h, b[best[2]]) < 0)
+                if (fq_write1(state, state->fpr[2], b[best[2]]) < 0)
                     goto err;
             }
         }
@@ -941,7 +1149,7 @@ static int flush_rec(bam2fq_state_t *state, bam2fq_opts_t* opts,
     }
 
     if (score[0]) { // single ended data (neither READ1 nor READ2)
-        if (sam_write1(state->fpr[0], state->h, b[best[0]]) < 0)
+        if (fq_write1(state, state->fpr[0], b[best[0]]) < 0)
             goto err;
 
         if (output_index(b[best[0]], NULL, state, opts) < 0)
@@ -954,6 +1162,18 @@ static int flush_rec(bam2fq_state_t *state, bam2fq_opts_t* opts,
     return -1;
 }
 
+// Handle -O option: use OQ for qual
+static void apply_oq(const bam2fq_state_t *state, bam1_t *b)
+{
+    uint8_t *oq;
+    if (state->use_oq && (oq = bam_aux_get(b,"OQ")) && *oq == 'Z') {
+        int i, l = strlen((char *)++oq);
+        uint8_t *qual = bam_get_qual(b);
+        for (i = 0; i < l && i < b->core.l_qseq; i++)
+            qual[i] = oq[i] - '!';
+    }
+}
+
 static bool bam2fq_mainloop(bam2fq_state_t *state, bam2fq_opts_t* opts)
 {
     int n;
@@ -972,6 +1192,10 @@ static bool bam2fq_mainloop(bam2fq_state_t *state, bam2fq_opts_t* opts)
             return false;
         }
     }
+    if (start_writers(state) < 0) {
+        print_error_errno("bam2fq", "Failed to start writer threads");
+        goto err;
+    }
 
     n = 0;
     while (true) {
@@ -986,15 +1210,7 @@ static bool bam2fq_mainloop(bam2fq_state_t *state, bam2fq_opts_t* opts)
             continue;
         if (!at_eof) {
             ++n_reads;
-
-            // Handle -O option: use OQ for qual
-            uint8_t *oq;
-            if (state->use_oq && (oq = bam_aux_get(b[n],"OQ")) && *oq == 'Z') {
-                int i, l = strlen((char *)++oq);
-                uint8_t *qual = bam_get_qual(b[n]);
-                for (i = 0; i < l && i < b[n]->core.l_qseq; i++)
-                    qual[i] = oq[i] - '!';
-            }
+            apply_oq(state, b[n]);
         }
 
         if (at_eof
@@ -1031,6 +1247,8 @@ static bool bam2fq_mainloop(bam2fq_state_t *state, bam2fq_opts_t* opts)
 
     valid = true;
  err:
+    if (stop_writers(state) < 0)
+        valid = false;
     if (!valid)
         print_error_errno("bam2fq", "Error writing to FASTx files.");
 
@@ -1045,6 +1263,272 @@ static bool bam2fq_mainloop(bam2fq_state_t *state, bam2fq_opts_t* opts)
     return valid;
 }
 
+/*
+ * --pair-mates: pairing of input that is not collated by name.  READ1
+ * and READ2 records wait in a hash by name until their mate turns up,
+ * which on coordinate sorted data is usually soon.  When more than
+ * max_unpaired are waiting the oldest go to an LZ4 temporary file.
+ * After the input, that file is swept for their mates.  Sweeps spill
+ * new names to a further file whenever the hash is full, and repeat
+ * until nothing is left over.
+ */
+typedef struct {
+    bam1_t *b;   // NULL once output
+    readpart rp;
+    int score;
+    int pass;    // when it was stored; 0 is the input, then the sweeps
+} fq_pending_t;
+
+KHASH_MAP_INIT_STR(pend, fq_pending_t *)
+
+typedef struct {
+    khash_t(pend) *h;
+    fq_pending_t **q; // in order of arrival, from q[qhead]
+    size_t qhead, qlen, qmax;
+    int64_t live, max_live;
+    int pass;
+    char *prefix;
+    tmp_file_t *spill;
+} fq_pairer_t;
+
+static int fq_emit(bam2fq_state_t *state, bam2fq_opts_t *opts,
+                   bam1_t *r0, bam1_t *r1, bam1_t *r2,
+                   int64_t *n_singletons) {
+    bam1_t *b[4] = { r0, r1, r2, NULL };
+    int score[3] = { r0 != NULL, r1 != NULL, r2 != NULL };
+    int best[3] = { 0, 1, 2 };
+    return flush_rec(state, opts, b, score, best, n_singletons);
+}
+
+static int fq_spill(fq_pairer_t *pr, bam1_t *b) {
+    if (!pr->spill) {
+        if (!(pr->spill = calloc(1, sizeof(*pr->spill))))
+            return -1;
+        if (tmp_file_open_write(pr->spill, pr->prefix, 1) < 0) {
+            free(pr->spill);
+            pr->spill = NULL;
+            return -1;
+        }
+    }
+    return tmp_file_write(pr->spill, b) < 0 ? -1 : 0;
+}
+
+// Removes p from the hash and frees its record, leaving a dead entry
+// in the queue
+static void fq_pending_drop(fq_pairer_t *pr, fq_pending_t *p) {
+    khint_t k = kh_get(pend, pr->h, bam_get_qname(p->b));
+    if (k != kh_end(pr->h))
+        kh_del(pend, pr->h, k);
+    bam_destroy1(p->b);
+    p->b = NULL;
+    pr->live--;
+}
+
+static int fq_queue_push(fq_pairer_t *pr, fq_pending_t *p) {
+    if (pr->qhead + pr->qlen == pr->qmax) {
+        if (pr->qhead > pr->qlen) {
+            memmove(pr->q, pr->q + pr->qhead, pr->qlen * sizeof(*pr->q));
+        } else {
+            size_t m = pr->qmax ? pr->qmax * 2 : 1024;
+            fq_pending_t **q = malloc(m * sizeof(*q));
+            if (!q)
+                return -1;
+            if (pr->qlen)
+                memcpy(q, pr->q + pr->qhead, pr->qlen * sizeof(*q));
+            free(pr->q);
+            pr->q = q;
+            pr->qmax = m;
+        }
+        pr->qhead = 0;
+    }
+    pr->q[pr->qhead + pr->qlen++] = p;
+    return 0;
+}
+
+// Spills the oldest waiting records.  Dead queue entries are also
+// bounded, as they are only freed when they reach the front.
+static int fq_evict(fq_pairer_t *pr) {
+    while (pr->qlen && (pr->live > pr->max_live
+                        || pr->qlen > 4 * (size_t)pr->max_live + 1024)) {
+        fq_pending_t *p = pr->q[pr->qhead++];
+        pr->qlen--;
+        if (p->b) {
+            if (fq_spill(pr, p->b) < 0)
+                return -1;
+            fq_pending_drop(pr, p);
+        }
+        free(p);
+    }
+    return 0;
+}
+
+// Adds a record, writing it out with its mate if that is waiting.
+// When spill_new is set, a record whose mate is not waiting is spilled
+// if the hash is full, rather than pushing out the oldest.
+static int fq_pair_add(fq_pairer_t *pr, bam2fq_state_t *state,
+                       bam2fq_opts_t *opts, bam1_t *b, int spill_new,
+                       int64_t *n_singletons) {
+    readpart rp = which_readpart(b);
+    int score = bam_get_qual(b)[0] != 0xff ? 2 : 1, ret;
+    khint_t k;
+
+    if (rp == READ_UNKNOWN)
+        return fq_emit(state, opts, b, NULL, NULL, n_singletons);
+
+    k = kh_get(pend, pr->h, bam_get_qname(b));
+    if (k != kh_end(pr->h)) {
+        fq_pending_t *p = kh_val(pr->h, k);
+        if (p->rp != rp) {
+            ret = rp == READ_1
+                ? fq_emit(state, opts, NULL, b, p->b, n_singletons)
+                : fq_emit(state, opts, NULL, p->b, b, n_singletons);
+            fq_pending_drop(pr, p);
+            return ret;
+        }
+        // Another copy of the same end: prefer one that has qualities
+        if (score > p->score) {
+            if (!bam_copy1(p->b, b))
+                return -1;
+            kh_key(pr->h, k) = bam_get_qname(p->b);
+            p->score = score;
+        }
+        return 0;
+    }
+
+    if (spill_new && pr->live >= pr->max_live)
+        return fq_spill(pr, b);
+
+    fq_pending_t *p = malloc(sizeof(*p));
+    if (!p)
+        return -1;
+    if (!(p->b = bam_dup1(b))) {
+        free(p);
+        return -1;
+    }
+    p->rp = rp;
+    p->score = score;
+    p->pass = pr->pass;
+    k = kh_put(pend, pr->h, bam_get_qname(p->b), &ret);
+    if (ret < 0 || fq_queue_push(pr, p) < 0) {
+        if (ret >= 0)
+            kh_del(pend, pr->h, k);
+        bam_destroy1(p->b);
+        free(p);
+        return -1;
+    }
+    kh_val(pr->h, k) = p;
+    pr->live++;
+    return spill_new ? 0 : fq_evict(pr);
+}
+
+// Writes out as singletons the waiting records stored before pass
+// `before`, which have now been compared with everything left.
+static int fq_flush_waiting(fq_pairer_t *pr, bam2fq_state_t *state,
+                            bam2fq_opts_t *opts, int before,
+                            int64_t *n_singletons) {
+    size_t i, n = 0;
+    int ret = 0;
+    for (i = 0; i < pr->qlen; i++) {
+        fq_pending_t *p = pr->q[pr->qhead + i];
+        if (p->b && p->pass < before && ret == 0) {
+            ret = p->rp == READ_1
+                ? fq_emit(state, opts, NULL, p->b, NULL, n_singletons)
+                : fq_emit(state, opts, NULL, NULL, p->b, n_singletons);
+            fq_pending_drop(pr, p);
+        }
+        if (p->b)
+            pr->q[pr->qhead + n++] = p;
+        else
+            free(p);
+    }
+    pr->qlen = n;
+    return ret;
+}
+
+static bool bam2fq_pairloop(bam2fq_state_t *state, bam2fq_opts_t *opts)
+{
+    fq_pairer_t pr = { NULL, NULL, 0, 0, 0, 0, opts->max_unpaired, 0,
+                       opts->tmp_prefix, NULL };
+    int64_t n_reads = 0, n_singletons = 0;
+    bam1_t *b = bam_init1();
+    bool valid = false;
+    size_t i;
+    int r;
+
+    if (!b || !(pr.h = kh_init(pend))) {
+        perror("[bam2fq_pairloop] Malloc error");
+        goto err;
+    }
+    if (start_writers(state) < 0) {
+        print_error_errno("bam2fq", "Failed to start writer threads");
+        goto err;
+    }
+
+    while ((r = sam_read1(state->fp, state->h, b)) >= 0) {
+        if (filter_it_out(b, state, opts))
+            continue;
+        ++n_reads;
+        apply_oq(state, b);
+        if (fq_pair_add(&pr, state, opts, b, 0, &n_singletons) < 0)
+            goto err;
+    }
+    if (r < -1) {
+        print_error("bam2fq", "Failed to read bam record");
+        goto err;
+    }
+
+    while (pr.spill) {
+        tmp_file_t *in = pr.spill;
+        pr.spill = NULL;
+        pr.pass++;
+        if (tmp_file_end_write(in) < 0 || tmp_file_begin_read(in) < 0) {
+            tmp_file_destroy(in);
+            free(in);
+            goto err;
+        }
+        while ((r = tmp_file_read(in, b)) > 0)
+            if (fq_pair_add(&pr, state, opts, b, 1, &n_singletons) < 0)
+                break;
+        tmp_file_destroy(in);
+        free(in);
+        if (r != 0)
+            goto err;
+        if (fq_flush_waiting(&pr, state, opts, pr.pass, &n_singletons) < 0)
+            goto err;
+    }
+    if (fq_flush_waiting(&pr, state, opts, pr.pass + 1, &n_singletons) < 0)
+        goto err;
+
+    valid = true;
+ err:
+    if (stop_writers(state) < 0)
+        valid = false;
+    if (!valid)
+        print_error_errno("bam2fq", "Error writing to FASTx files.");
+    if (pr.spill) {
+        tmp_file_destroy(pr.spill);
+        free(pr.spill);
+    }
+    for (i = 0; i < pr.qlen; i++) {
+        fq_pending_t *p = pr.q[pr.qhead + i];
+        if (p->b)
+            bam_destroy1(p->b);
+        free(p);
+    }
+    free(pr.q);
+    if (pr.h)
+        kh_destroy(pend, pr.h);
+    if (b)
+        bam_destroy1(b);
+
+    fprintf(stderr, "[M::%s] discarded %" PRId64 " singletons\n",
+            __func__, n_singletons);
+    fprintf(stderr, "[M::%s] processed %" PRId64 " reads\n",
+            __func__, n_reads);
+
+    return valid;
+}
+
 int main_bam2fq(int argc, char *argv[])
 {
     int status = EXIT_FAILURE;
@@ -1056,7 +1540,11 @@ int main_bam2fq(int argc, char *argv[])
 
     if (!init_state(opts, &state)) goto err;
 
-    if (!bam2fq_mainloop(state,opts)) goto err;
+    if (opts->pair_mates) {
+        if (!bam2fq_pairloop(state, opts)) goto err;
+    } else {
+        if (!bam2fq_mainloop(state,opts)) goto err;
+    }
 
     if (!destroy_state(opts, state, &status)) goto err;
 
@@ -33,12 +33,14 @@ DEALINGS IN THE SOFTWARE.
 
 #include <config.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "htslib/sam.h"
 #include "htslib/thread_pool.h"
 
 #include "samtools.h"
 #include "sam_opts.h"
+#include "seq_utils.h"
 
 static int usage(FILE *fp, int exit_status) {
     fprintf(fp, "Usage: samtools import [options] [file.fastq ...]\n");
@@ -118,13 +120,10 @@ static int append_index(kstring_t *s, kstring_t *q, bam1_t *b) {
     if (q->l)
         *qp++ = ' ';
 
-    int i;
-    uint8_t *seq = bam_get_seq(b);
-    uint8_t *qual = bam_get_qual(b);
-    for (i = 0; i < b->core.l_qseq; i++) {
-        *sp++ = seq_nt16_str[bam_seqi(seq, i)];
-        *qp++ = qual[i] + '!';
-    }
+    seq_nt16_unpack(sp, bam_get_seq(b), b->core.l_qseq);
+    qual_add_offset(qp, bam_get_qual(b), b->core.l_qseq, '!');
+    sp += b->core.l_qseq;
+    qp += b->core.l_qseq;
     *sp++ = 0;
     *qp++ = 0;
 
@@ -134,6 +133,124 @@ static int append_index(kstring_t *s, kstring_t *q, bam1_t *b) {
     return 0;
 }
 
+/*
+ * With a thread pool, each input file is parsed by a thread of its own
+ * into batches of records, so R1, R2 and the index files are decoded in
+ * parallel while the main thread combines and writes them.  Batches are
+ * consumed in order from every file, so the Nth record of each still
+ * lines up with the Nth of the others.
+ */
+#define IMP_BATCH 1024
+#define IMP_QUEUE 4  // batches per reader
+
+typedef struct {
+    bam1_t *b[IMP_BATCH];
+    int n;
+    int res; // sam_read1 result that ended a short batch
+} imp_batch_t;
+
+typedef struct {
+    samFile *fp;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    imp_batch_t batch[IMP_QUEUE];
+    int head, count; // batches read, from head
+    int pos;         // next record of batch[head]
+    int stop;
+} imp_reader_t;
+
+static void *imp_reader_thread(void *arg) {
+    imp_reader_t *r = (imp_reader_t *)arg;
+    int res = 0;
+    while (res >= 0) {
+        pthread_mutex_lock(&r->lock);
+        while (r->count == IMP_QUEUE && !r->stop)
+            pthread_cond_wait(&r->cond, &r->lock);
+        if (r->stop) {
+            pthread_mutex_unlock(&r->lock);
+            break;
+        }
+        imp_batch_t *bt = &r->batch[(r->head + r->count) % IMP_QUEUE];
+        pthread_mutex_unlock(&r->lock);
+
+        for (bt->n = 0; bt->n < IMP_BATCH; bt->n++) {
+            if (!bt->b[bt->n] && !(bt->b[bt->n] = bam_init1())) {
+                res = -2;
+                break;
+            }
+            if ((res = sam_read1(r->fp, NULL, bt->b[bt->n])) < 0)
+                break;
+        }
+        bt->res = res;
+
+        pthread_mutex_lock(&r->lock);
+        r->count++;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+    return NULL;
+}
+
+// As sam_read1, but takes the next record from the reader thread.
+// The record is swapped into b rather than copied.
+static int imp_read1(imp_reader_t *r, bam1_t *b) {
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        while (!r->count)
+            pthread_cond_wait(&r->cond, &r->lock);
+        pthread_mutex_unlock(&r->lock);
+
+        imp_batch_t *bt = &r->batch[r->head];
+        if (r->pos < bt->n) {
+            bam1_t tmp = *b;
+            *b = *bt->b[r->pos];
+            *bt->b[r->pos++] = tmp;
+            return 0;
+        }
+        if (bt->n < IMP_BATCH)
+            return bt->res; // end of file or error; no more batches
+
+        pthread_mutex_lock(&r->lock);
+        r->head = (r->head + 1) % IMP_QUEUE;
+        r->count--;
+        r->pos = 0;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+static int start_reader(imp_reader_t *r, samFile *fp) {
+    r->fp = fp;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->tid, NULL, imp_reader_thread, r) != 0) {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+        r->fp = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_reader(imp_reader_t *r) {
+    int i, j;
+    if (!r->fp)
+        return;
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->tid, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    for (i = 0; i < IMP_QUEUE; i++)
+        for (j = 0; j < IMP_BATCH; j++)
+            if (r->batch[i].b[j])
+                bam_destroy1(r->batch[i].b[j]);
+    r->fp = NULL;
+}
+
 static int import_fastq(int argc, char **argv, opts_t *opts) {
     int i, n, ret = 0;
     samFile *fp_in[FQ_END] = {NULL};
@@ -148,6 +265,7 @@ static int import_fastq(int argc, char **argv, opts_t *opts) {
     uint64_t read_num = 0;
     kstring_t idx_seq  = {0};
     kstring_t idx_qual = {0};
+    imp_reader_t *rd = NULL;
 
     // Any additional arguments are assumed to be r1 r2, as a
     // short cut. We support reading index tags out of those too (eg
@@ -309,13 +427,28 @@ static int import_fastq(int argc, char **argv, opts_t *opts) {
         goto err;
 
 
+    if (opts->p.pool) {
+        if (!(rd = calloc(n, sizeof(*rd)))) {
+            ret = -1;
+            goto err;
+        }
+        for (i = 0; i < n; i++) {
+            if (start_reader(&rd[i], fp_in[ids[i]]) < 0) {
+                print_error_errno("import", "failed to start reader thread");
+                ret = -1;
+                goto err;
+            }
+        }
+    }
+
     // Interleave / combine from n files (ids[0..n-1]).
     int res = 0;
     int eof = 0;
     do {
         idx_seq.l = idx_qual.l = 0;
         for (i = 0; i < n; i++) {
-            if ((res = sam_read1(fp_in[ids[i]], NULL, b)) < 0) {
+            res = rd ? imp_read1(&rd[i], b) : sam_read1(fp_in[ids[i]], NULL, b);
+            if (res < 0) {
                 if (res == -1) {
                     eof++;
                     continue;
@@ -418,6 +551,11 @@ static int import_fastq(int argc, char **argv, opts_t *opts) {
     // Close and return
     ret = 0;
 err:
+    if (rd) {
+        for (i = 0; i < n; i++)
+            stop_reader(&rd[i]);
+        free(rd);
+    }
     bam_destroy1(b);
     sam_hdr_destroy(hdr_out);
     ks_free(&rg_line);
@@ -463,7 +601,7 @@ int main_import(int argc, char *argv[]) {
     kstring_t rg = {0};
 
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, '-', '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, '-', '@', '-', '-'),
         {"no-PG", no_argument, NULL, 9},
         {"i1", required_argument, NULL, 1},
         {"i2", required_argument, NULL, 2},
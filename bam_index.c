@@ -30,11 +30,15 @@ DEALINGS IN THE SOFTWARE.  */
 #include <htslib/sam.h>
 #include <htslib/hfile.h>
 #include <htslib/khash.h>
+#include <htslib/thread_pool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "samtools.h"
 #include "sam_opts.h"
@@ -81,7 +85,7 @@ int bam_index(int argc, char *argv[])
     const char *fn_idx = NULL;
 
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', '-', '-', '-', '-', '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', '-', '-', '-', '-', '@', '-', '-'),
         {"output",    required_argument, NULL, 'o'},
         {"bai",       no_argument,       NULL, 'b'},
         {"csi",       no_argument,       NULL, 'c'},
@@ -149,67 +153,346 @@ int bam_index(int argc, char *argv[])
 /*
  * Cram indices do not contain mapped/unmapped record counts, so we have to
  * decode each record and count.  However we can speed this up as much as
- * possible by using the required fields parameter.
+ * possible by using the required fields parameter.  BAM files without an
+ * index are read as the fixed-length part of each record only.
  *
- * This prints the stats to stdout in the same manner than the BAM function
- * does.
+ * The counts are per reference, with the unplaced reads at counts[-1].
  *
  * Returns 0 on success,
  *        -1 on failure.
  */
-int slow_idxstats(samFile *fp, sam_hdr_t *header) {
-    int ret, last_tid = -2;
-    bam1_t *b = bam_init1();
+static int idxstats_scan(samFile *fp, sam_hdr_t *header,
+                         uint64_t (*counts)[2]) {
+    int ret, last_tid = -2, nref = sam_hdr_nref(header);
+    int is_bam = hts_get_format(fp)->format == bam;
+    bam1_t *b = NULL;
+    bam1_core_t *c, core;
+    uint8_t *skip = NULL;
+    size_t mskip = 0;
 
     if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, SAM_RNAME | SAM_FLAG))
         return -1;
 
-    uint64_t (*count0)[2] = calloc(sam_hdr_nref(header)+1, sizeof(*count0));
-    uint64_t (*counts)[2] = count0+1;
-    if (!count0)
-        return -1;
-
-    while ((ret = sam_read1(fp, header, b)) >= 0) {
-        if (b->core.tid >= sam_hdr_nref(header) || b->core.tid < -1) {
-            free(count0);
+    if (is_bam) {
+        c = &core;
+    } else {
+        if (!(b = bam_init1()))
             return -1;
+        c = &b->core;
+    }
+
+    while ((ret = is_bam
+            ? read_bam_core(fp->fp.bgzf, c, &skip, &mskip)
+            : sam_read1(fp, header, b)) >= 0) {
+        if (c->tid >= nref || c->tid < -1) {
+            ret = -2;
+            break;
         }
 
-        if (b->core.tid != last_tid) {
+        if (c->tid != last_tid) {
             if (last_tid >= -1) {
-                if (counts[b->core.tid][0] + counts[b->core.tid][1]) {
+                if (counts[c->tid][0] + counts[c->tid][1]) {
                     print_error("idxstats", "file is not position sorted");
-                    free(count0);
-                    return -1;
+                    ret = -2;
+                    break;
                 }
             }
-            last_tid = b->core.tid;
+            last_tid = c->tid;
         }
 
-        counts[b->core.tid][(b->core.flag & BAM_FUNMAP) ? 1 : 0]++;
+        counts[c->tid][(c->flag & BAM_FUNMAP) ? 1 : 0]++;
     }
 
-    if (ret == -1) {
-        int i;
-        for (i = 0; i < sam_hdr_nref(header); i++) {
-            printf("%s\t%"PRId64"\t%"PRIu64"\t%"PRIu64"\n",
-                   sam_hdr_tid2name(header, i),
-                   (int64_t) sam_hdr_tid2len(header, i),
-                   counts[i][0], counts[i][1]);
+    free(skip);
+    bam_destroy1(b);
+
+    return (ret == -1) ? 0 : -1;
+}
+
+/*
+ * Counting an indexed file that has no stats in its index (CRAM, or
+ * compressed SAM).  Each job opens its own handle on the file and takes
+ * whole references in turn, longest first, iterating over each with the
+ * index.  Each reference is counted by exactly one job, so the counts
+ * need no locking.
+ */
+typedef struct {
+    const char *fn, *fnidx;
+    sam_global_args *ga;
+    const int *order;       // references to count, -1 for the unplaced
+    int norder, *next;
+    pthread_mutex_t *lock;
+    uint64_t (*counts)[2];
+    int ret;
+} idxstats_job_t;
+
+static void *idxstats_job(void *arg) {
+    idxstats_job_t *job = (idxstats_job_t *)arg;
+    samFile *fp = NULL;
+    sam_hdr_t *header = NULL;
+    hts_idx_t *idx = NULL;
+    bam1_t *b = NULL;
+    int r = -1;
+
+    job->ret = -1;
+    if (!(fp = sam_open_format(job->fn, "r", &job->ga->in))
+        || hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, SAM_RNAME | SAM_FLAG)
+        || !(header = sam_hdr_read(fp))
+        || !(idx = sam_index_load3(fp, job->fn, job->fnidx,
+                                   HTS_IDX_SILENT_FAIL))
+        || !(b = bam_init1()))
+        goto out;
+
+    for (;;) {
+        int i, tid;
+        hts_itr_t *itr;
+
+        pthread_mutex_lock(job->lock);
+        i = (*job->next)++;
+        pthread_mutex_unlock(job->lock);
+        if (i >= job->norder)
+            break;
+
+        tid = job->order[i];
+        itr = sam_itr_queryi(idx, tid < 0 ? HTS_IDX_NOCOOR : tid,
+                             0, HTS_POS_MAX);
+        if (!itr)
+            goto out;
+        while ((r = sam_itr_next(fp, itr, b)) >= 0) {
+            if (b->core.tid == tid)
+                job->counts[tid][(b->core.flag & BAM_FUNMAP) ? 1 : 0]++;
         }
-        printf("*\t0\t%"PRIu64"\t%"PRIu64"\n", counts[-1][0], counts[-1][1]);
+        hts_itr_destroy(itr);
+        if (r < -1)
+            goto out;
     }
+    job->ret = 0;
 
-    free(count0);
-
+ out:
     bam_destroy1(b);
+    if (idx)
+        hts_idx_destroy(idx);
+    if (header)
+        sam_hdr_destroy(header);
+    if (fp)
+        sam_close(fp);
+    return job;
+}
 
-    return (ret == -1) ? 0 : -1;
+typedef struct {
+    int64_t len;
+    int tid;
+} idxstats_ref_t;
+
+static int idxstats_ref_cmp(const void *av, const void *bv) {
+    const idxstats_ref_t *a = av, *b = bv;
+    if (a->len != b->len)
+        return a->len > b->len ? -1 : 1;
+    return a->tid - b->tid;
+}
+
+// Returns 0 on success,
+//        -1 on failure
+static int idxstats_scan_indexed(const char *fn, const char *fnidx,
+                                 sam_hdr_t *header, sam_global_args *ga,
+                                 uint64_t (*counts)[2]) {
+    int nref = sam_hdr_nref(header), njob = ga->nthreads, next = 0;
+    int i, ret = 0, in_flight = 0;
+    idxstats_ref_t *refs = malloc((nref + 1) * sizeof(*refs));
+    int *order = malloc((nref + 1) * sizeof(*order));
+    idxstats_job_t *job = calloc(njob, sizeof(*job));
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    hts_tpool *pool = NULL;
+    hts_tpool_process *q = NULL;
+
+    if (!refs || !order || !job || !(pool = hts_tpool_init(njob))
+        || !(q = hts_tpool_process_init(pool, njob, 0))) {
+        print_error_errno("idxstats", "could not set up the reading threads");
+        ret = -1;
+        goto out;
+    }
+
+    // The unplaced reads are at the end of the file, so they go first
+    // with the longest references, and the shortest ones fill in last.
+    for (i = 0; i < nref; i++) {
+        refs[i].len = sam_hdr_tid2len(header, i);
+        refs[i].tid = i;
+    }
+    refs[nref].len = INT64_MAX;
+    refs[nref].tid = -1;
+    qsort(refs, nref + 1, sizeof(*refs), idxstats_ref_cmp);
+    for (i = 0; i <= nref; i++)
+        order[i] = refs[i].tid;
+
+    for (i = 0; i < njob; i++) {
+        job[i].fn = fn;
+        job[i].fnidx = fnidx;
+        job[i].ga = ga;
+        job[i].order = order;
+        job[i].norder = nref + 1;
+        job[i].next = &next;
+        job[i].lock = &lock;
+        job[i].counts = counts;
+        if (hts_tpool_dispatch(pool, q, idxstats_job, &job[i]) < 0) {
+            ret = -1;
+            break;
+        }
+        in_flight++;
+    }
+
+    while (in_flight) {
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        if (!res) {
+            ret = -1;
+            break;
+        }
+        idxstats_job_t *jb = (idxstats_job_t *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+        if (jb->ret < 0)
+            ret = -1;
+    }
+
+ out:
+    if (q)
+        hts_tpool_process_destroy(q);
+    if (pool)
+        hts_tpool_destroy(pool);
+    pthread_mutex_destroy(&lock);
+    free(job);
+    free(order);
+    free(refs);
+    return ret;
+}
+
+static int print_idxstats(FILE *fp, sam_hdr_t *header,
+                          uint64_t (*counts)[2]) {
+    int i;
+    for (i = 0; i < sam_hdr_nref(header); i++) {
+        fprintf(fp, "%s\t%"PRId64"\t%"PRIu64"\t%"PRIu64"\n",
+                sam_hdr_tid2name(header, i),
+                (int64_t) sam_hdr_tid2len(header, i),
+                counts[i][0], counts[i][1]);
+    }
+    fprintf(fp, "*\t0\t%"PRIu64"\t%"PRIu64"\n", counts[-1][0], counts[-1][1]);
+    return ferror(fp) ? -1 : 0;
+}
+
+/*
+ * The counts for a file that had to be read are kept in FILE.idxstats, in
+ * the normal output format after a line giving the size and modification
+ * time of FILE.  It is only reused if these still match, and the
+ * reference names and lengths match the header.
+ */
+static char *idxstats_cache_name(const char *fn) {
+    char *cache_fn = malloc(strlen(fn) + 10);
+    if (cache_fn)
+        sprintf(cache_fn, "%s.idxstats", fn);
+    return cache_fn;
+}
+
+// Returns 0 if the counts were loaded from the cache,
+//        -1 if there is no usable cache.
+static int idxstats_read_cache(const char *fn, sam_hdr_t *header,
+                               uint64_t (*counts)[2]) {
+    char *cache_fn = NULL, *line = NULL, *cp;
+    size_t mline = 0;
+    int64_t size, mtime;
+    int i, nref = sam_hdr_nref(header), ret = -1;
+    struct stat st;
+    FILE *fp = NULL;
+
+    if (strcmp(fn, "-") == 0 || stat(fn, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+    if (!(cache_fn = idxstats_cache_name(fn))
+        || !(fp = fopen(cache_fn, "r")))
+        goto out;
+
+    if (getline(&line, &mline, fp) < 0
+        || sscanf(line, "#idxstats\t%"SCNd64"\t%"SCNd64, &size, &mtime) != 2
+        || size != (int64_t) st.st_size || mtime != (int64_t) st.st_mtime)
+        goto out;  // not ours, or out of date
+
+    for (i = 0; i <= nref; i++) {
+        const char *name = i < nref ? sam_hdr_tid2name(header, i) : "*";
+        int64_t len = i < nref ? sam_hdr_tid2len(header, i) : 0;
+        size_t name_len = strlen(name);
+        uint64_t *cnt = counts[i < nref ? i : -1];
+
+        if (getline(&line, &mline, fp) < 0
+            || strncmp(line, name, name_len) != 0 || line[name_len] != '\t')
+            goto corrupt;
+        cp = line + name_len + 1;
+        if (strtoll(cp, &cp, 10) != len || *cp++ != '\t')
+            goto corrupt;
+        cnt[0] = strtoull(cp, &cp, 10);
+        if (*cp++ != '\t')
+            goto corrupt;
+        cnt[1] = strtoull(cp, &cp, 10);
+        if (*cp != '\n')
+            goto corrupt;
+    }
+    ret = 0;
+    goto out;
+
+ corrupt:
+    print_error("idxstats", "ignoring \"%s\" as it does not match \"%s\"",
+                cache_fn, fn);
+    memset(counts - 1, 0, (nref + 1) * sizeof(*counts));
+ out:
+    if (fp)
+        fclose(fp);
+    free(line);
+    free(cache_fn);
+    return ret;
+}
+
+// Failing to write the cache is reported, but is not an error.
+static void idxstats_write_cache(const char *fn, sam_hdr_t *header,
+                                 uint64_t (*counts)[2]) {
+    char *cache_fn = NULL, *tmp_fn = NULL;
+    struct stat st;
+    FILE *fp = NULL;
+    int ok = 0;
+
+    if (strcmp(fn, "-") == 0 || stat(fn, &st) < 0 || !S_ISREG(st.st_mode))
+        return;
+    if (!(cache_fn = idxstats_cache_name(fn))
+        || !(tmp_fn = malloc(strlen(cache_fn) + 24)))
+        goto out;
+
+    // Written under a temporary name, so readers never see part of one
+    sprintf(tmp_fn, "%s.tmp%u", cache_fn, (unsigned) getpid());
+    if (!(fp = fopen(tmp_fn, "w")))
+        goto out;
+    fprintf(fp, "#idxstats\t%"PRId64"\t%"PRId64"\n",
+            (int64_t) st.st_size, (int64_t) st.st_mtime);
+    if (print_idxstats(fp, header, counts) < 0) {
+        fclose(fp);
+        fp = NULL;
+        goto out;
+    }
+    ok = fclose(fp) == 0;
+    fp = NULL;
+    if (ok && rename(tmp_fn, cache_fn) < 0)
+        ok = 0;
+
+ out:
+    if (!ok) {
+        print_error_errno("idxstats", "failed to write \"%s\"",
+                          cache_fn ? cache_fn : fn);
+        if (tmp_fn)
+            unlink(tmp_fn);
+    }
+    free(tmp_fn);
+    free(cache_fn);
 }
 
 static void usage_exit(FILE *fp, int exit_status)
 {
     fprintf(fp, "Usage: samtools idxstats [options] <in.bam>\n"
+                "  -C, --cache  Reuse or save counts in <in.bam>.idxstats when the\n"
+                "               file has to be read through\n"
                 "  -X           Include customized index file\n");
     sam_global_opt_help(fp, "-.---@-.");
     exit(exit_status);
@@ -220,17 +503,19 @@ int bam_idxstats(int argc, char *argv[])
     hts_idx_t* idx;
     sam_hdr_t* header;
     samFile* fp;
-    int c, has_index_file = 0, file_names = 1;
+    int c, has_index_file = 0, file_names = 1, use_cache = 0;
     char *index_name = NULL;
 
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', '-', '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', '-', '@', '-', '-'),
+        {"cache", no_argument, NULL, 'C'},
         {NULL, 0, NULL, 0}
     };
 
-    while ((c = getopt_long(argc, argv, "@:X", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "@:CX", lopts, NULL)) >= 0) {
         switch (c) {
+            case 'C': use_cache=1; break;
             case 'X': has_index_file=1; break;
             default:  if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
                 /* else fall-through */
@@ -261,14 +546,44 @@ int bam_idxstats(int argc, char *argv[])
     }
 
     if (hts_get_format(fp)->format != bam) {
-    slow_method:
-        if (ga.nthreads)
-            hts_set_threads(fp, ga.nthreads);
+    slow_method: ;
+        uint64_t (*count0)[2] = calloc(sam_hdr_nref(header)+1, sizeof(*count0));
+        uint64_t (*counts)[2] = count0+1;
+        int ret = -1;
+        if (!count0) {
+            print_error_errno("idxstats", "failed to allocate counts");
+            return 1;
+        }
+
+        if (use_cache && idxstats_read_cache(argv[optind], header, counts) == 0) {
+            ret = 0;
+        } else {
+            // With threads, an index without stats is used to read
+            // each reference on a thread of its own.
+            idx = NULL;
+            if (ga.nthreads > 0 && hts_get_format(fp)->format != bam)
+                idx = sam_index_load3(fp, argv[optind], index_name,
+                                      HTS_IDX_SILENT_FAIL);
+            if (idx) {
+                hts_idx_destroy(idx);
+                ret = idxstats_scan_indexed(argv[optind], index_name,
+                                            header, &ga, counts);
+            } else {
+                if (ga.nthreads)
+                    hts_set_threads(fp, ga.nthreads);
+                ret = idxstats_scan(fp, header, counts);
+            }
+            if (ret == 0 && use_cache)
+                idxstats_write_cache(argv[optind], header, counts);
+        }
 
-        if (slow_idxstats(fp, header) < 0) {
+        if (ret < 0) {
             print_error("idxstats", "failed to process \"%s\"", argv[optind]);
+            free(count0);
             return 1;
         }
+        print_idxstats(stdout, header, counts);
+        free(count0);
     } else {
         idx = sam_index_load2(fp, argv[optind], index_name);
         if (idx == NULL) {
@@ -29,6 +29,8 @@ Copyright (c) 2009,2018 The Broad Institute.  MIT license.
 
 #include <config.h>
 
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -42,6 +44,8 @@ Copyright (c) 2009,2018 The Broad Institute.  MIT license.
 #include "htslib/sam.h"
 #include "sam_opts.h"
 #include "samtools.h"
+#include "sam_prof.h"
+#include "sam_pipe.h"
 #include "htslib/khash.h"
 #include "htslib/klist.h"
 #include "htslib/kstring.h"
@@ -52,6 +56,8 @@ Copyright (c) 2009,2018 The Broad Institute.  MIT license.
 typedef struct {
     samFile *in;
     samFile *out;
+    sam_pipe *pipe_in;      // in place of in and out when running as
+    sam_pipe *pipe_out;     // a stage of samtools pipeline
     char *prefix;
     int remove_dups;
     int32_t max_length;
@@ -77,6 +83,13 @@ typedef struct {
     int read_groups;
     int json;
     int dc;
+    hts_tpool *pool;
+    size_t dup_mem;
+    struct dup_spill *dup_spill;
+    int mate_window;
+    char *progress_file;
+    long progress_interval;
+    int tmp_codec;
 } md_param_t;
 
 typedef struct {
@@ -101,6 +114,15 @@ typedef struct read_queue_s {
     hts_pos_t pos;
     int dup_checked;
     int read_group;
+    int64_t score;
+    int64_t mate_score;
+    int paired;         // has a usable mate, see prepare_read()
+    long x;             // optical coordinates from the read name,
+    long y;             // see read_coordinates()
+    int t_beg;
+    int t_end;
+    int coords_ret;
+    int coords_parsed;
 } read_queue_t;
 
 typedef struct {
@@ -110,6 +132,7 @@ typedef struct {
 typedef struct {
     char *name;
     char type;
+    char retag_only; // only records a later change of type to optical
     int read_group;
 } dup_map_t;
 
@@ -123,6 +146,10 @@ typedef struct {
     int beg;
     int end;
     int len;
+    long cx;    // grid cell, see check_duplicate_chain()
+    long cy;
+    int coords; // x and y could be read from the name
+    int paired;
 } check_t;
 
 typedef struct {
@@ -146,42 +173,37 @@ typedef struct {
     long np_opt_duplicate;
 } stats_block_t;
 
-static khint32_t do_hash(unsigned char *key, khint32_t len);
+/* Fold a 64 bit word into the hash.  The keys are mixed a word at a time
+   rather than byte by byte as lookups in the read hashes dominate the run
+   time on highly duplicated data. */
 
-static khint_t hash_key(key_data_t key) {
-    int i = 0;
-    khint_t hash;
-
-    if (key.single) {
-        unsigned char sig[21];
+static inline uint64_t hash_mix(uint64_t h, uint64_t v) {
+    h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 32);
+}
 
-        memcpy(sig + i, &key.this_ref, 4);      i += 4;
-        memcpy(sig + i, &key.this_coord, 8);    i += 8;
-        memcpy(sig + i, &key.orientation, 1);   i += 1;
-        memcpy(sig + i, &key.barcode, 4);       i += 4;
-        memcpy(sig + i, &key.read_group, 4);    i += 4;
 
-        hash = do_hash(sig, i);
-    } else {
-        unsigned char sig[34];
+static inline khint_t hash_key(key_data_t key) {
+    uint64_t hash = (uint64_t)key.this_coord;
 
-        memcpy(sig + i, &key.this_ref, 4);      i += 4;
-        memcpy(sig + i, &key.this_coord, 8);    i += 8;
-        memcpy(sig + i, &key.other_ref, 4);     i += 4;
-        memcpy(sig + i, &key.other_coord, 8);   i += 8;
-        memcpy(sig + i, &key.leftmost, 1);      i += 1;
-        memcpy(sig + i, &key.orientation, 1);   i += 1;
-        memcpy(sig + i, &key.barcode, 4);       i += 4;
-        memcpy(sig + i, &key.read_group, 4);    i += 4;
+    hash = hash_mix(hash, ((uint64_t)(uint32_t)key.this_ref << 32) | (uint32_t)key.barcode);
+    hash = hash_mix(hash, ((uint64_t)(uint32_t)key.read_group << 8) | (uint8_t)key.orientation);
 
-        hash = do_hash(sig, i);
+    if (!key.single) {
+        hash = hash_mix(hash, (uint64_t)key.other_coord);
+        hash = hash_mix(hash, ((uint64_t)(uint32_t)key.other_ref << 8) | (uint8_t)key.leftmost);
     }
 
-    return hash;
+    // final avalanche so the low bits used for the bucket are well mixed
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return (khint_t)hash;
 }
 
 
-static int key_equal(key_data_t a, key_data_t b) {
+static inline int key_equal(key_data_t a, key_data_t b) {
     int match = 1;
 
     if (a.this_coord != b.this_coord)
@@ -226,6 +248,12 @@ static int key_equal(key_data_t a, key_data_t b) {
 
 #define MD_MIN_QUALITY 15
 
+// Number of reads handed to a worker thread at a time
+#define MD_BATCH_SIZE 1024
+
+// Number of files the duplicate names are split between when spilled
+#define MD_DUP_PARTS 64
+
 // Duplicate finding mode
 #define MD_MODE_TEMPLATE 0
 #define MD_MODE_SEQUENCE 1
@@ -235,7 +263,68 @@ KLIST_INIT(read_queue, read_queue_t, __free_queue_element) // the reads buffer
 KHASH_MAP_INIT_STR(duplicates, dup_map_t) // map of duplicates for supplementary dup id
 KHASH_MAP_INIT_STR(read_groups, int) // read group lookup
 
-/* The Bob Jenkins one_at_a_time hash to reduce the key to a 32 bit value. */
+/* A read with the parts of duplicate marking that do not depend on the
+   other reads (read group, keys and scores) worked out by prepare_read(). */
+typedef struct {
+    bam1_t *b;
+    key_data_t pair_key;
+    key_data_t single_key;
+    int64_t score;
+    int64_t mate_score;
+    int read_group;
+    int examine;
+    int paired;
+    int key_err;
+} md_read_t;
+
+typedef struct {
+    md_param_t *param;
+    khash_t(read_groups) *rg_hash;
+    md_read_t *reads;
+    int n;
+    long warnings;
+    long warn_start;
+} md_batch_t;
+
+/* Supplies reads to bam_mark_duplicates().  With a thread pool the reads
+   are prepared in batches by the workers, otherwise one at a time as they
+   are read. */
+typedef struct {
+    md_param_t *param;
+    sam_hdr_t *header;
+    khash_t(read_groups) *rg_hash;
+    long *warnings;
+    hts_tpool_process *q;
+    md_batch_t *batch;
+    int n_batch;
+    int next_fill;
+    int in_flight;
+    md_batch_t *curr;
+    int curr_idx;
+    int end;
+    int failed;
+    md_read_t one;
+    struct mate_stage *mates;
+} md_reader_t;
+
+/* Duplicate names written to disk once the duplicate map grows past
+   --max-dup-mem.  The names are split between files on their hash so the
+   supplementary pass only needs one file's names in memory at a time. */
+typedef struct dup_spill {
+    FILE *fp[MD_DUP_PARTS];
+    char *fn[MD_DUP_PARTS];
+    FILE *cand[MD_DUP_PARTS];   // names and positions of possible hits
+    char *cand_fn[MD_DUP_PARTS];
+    size_t mem;     // estimated size of the in memory duplicate map
+    int spilled;
+    int n_files;    // for unique file names
+    int64_t hit_idx[MD_DUP_PARTS];
+    dup_map_t hit[MD_DUP_PARTS];
+    kstring_t hit_orig[MD_DUP_PARTS];
+    kstring_t name;
+} dup_spill_t;
+
+/* The Bob Jenkins one_at_a_time hash to reduce barcodes to a 32 bit value. */
 
 static khint32_t do_hash(unsigned char *key, khint32_t len) {
     khint32_t   hash, i;
@@ -254,6 +343,69 @@ static khint32_t do_hash(unsigned char *key, khint32_t len) {
 }
 
 
+/* Give back memory from a read hash once the window has moved on from a
+   dense region, so a burst of duplicates does not leave a large, mostly
+   empty table to probe for the rest of the run. */
+
+static void shrink_read_hash(khash_t(reads) *h) {
+    if (kh_n_buckets(h) > 4096 && kh_size(h) < kh_n_buckets(h) / 8)
+        kh_resize(reads, h, kh_size(h) * 2);
+}
+
+
+/* Spare alignments from reads that have left the window, reused for new
+   reads so their data buffers do not have to be allocated again.  The
+   read queue entries themselves are already recycled by klist's pool. */
+
+typedef struct {
+    bam1_t **b;
+    size_t n;
+    size_t size;
+} bam_pool_t;
+
+
+static bam1_t *bam_pool_get(bam_pool_t *pool) {
+    bam1_t *b;
+
+    if (pool->n == 0)
+        return bam_init1();
+
+    // mark as empty, see the end of list writing in bam_mark_duplicates()
+    b = pool->b[--pool->n];
+    b->l_data = 0;
+
+    return b;
+}
+
+
+static void bam_pool_put(bam_pool_t *pool, bam1_t *b) {
+    if (pool->n == pool->size) {
+        size_t new_size = pool->size ? pool->size * 2 : 1024;
+        bam1_t **tmp = realloc(pool->b, new_size * sizeof(bam1_t *));
+
+        if (!tmp) {
+            bam_destroy1(b);
+            return;
+        }
+
+        pool->b = tmp;
+        pool->size = new_size;
+    }
+
+    pool->b[pool->n++] = b;
+}
+
+
+static void bam_pool_destroy(bam_pool_t *pool) {
+    while (pool->n)
+        bam_destroy1(pool->b[--pool->n]);
+
+    free(pool->b);
+    pool->b = NULL;
+    pool->size = 0;
+}
+
+
 /* Get mate score from tag. */
 
 static int64_t get_mate_score(bam1_t *b) {
@@ -287,10 +439,260 @@ static int64_t calc_score(bam1_t *b)
 }
 
 
+/* With --mate-window the MC and ms tags that fixmate would have added are
+   filled in here instead, so markdup can be run straight after sort.  The
+   first read of a pair is held back until its mate turns up, which on
+   coordinate sorted data is at most the window further on, and then both
+   are tagged.  Pairs too distant or on different references are passed on
+   untouched, so they are still marked as pairs if fixmate has already
+   tagged them and as single reads if not. */
+
+typedef struct {
+    bam1_t *b;
+    int waiting;    // in the names hash, still looking for its mate
+} mate_entry_t;
+
+KLIST_INIT(mate_queue, mate_entry_t, __free_queue_element)
+KHASH_MAP_INIT_STR(mate_names, mate_entry_t *)
+
+typedef struct mate_stage {
+    klist_t(mate_queue) *queue;
+    khash_t(mate_names) *names;
+    bam_pool_t spare;
+    int32_t tid;    // position of the last read read
+    hts_pos_t pos;
+    int window;
+    int end;        // sam_read1() return once the input is finished
+} mate_stage_t;
+
+
+// Unmapped reads placed next to their mates are included, as fixmate
+// tags those pairs too.
+static inline int primary_pair(bam1_t *b) {
+    return (b->core.flag & BAM_FPAIRED) &&
+          !(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY));
+}
+
+
+static inline int mate_in_reach(bam1_t *b, int window) {
+    return b->core.tid >= 0 && b->core.mtid == b->core.tid &&
+           llabs(b->core.mpos - b->core.pos) <= window;
+}
+
+
+/* Add the mate cigar and mate score of src to dest, as fixmate does.  Like
+   fixmate, the mate cigar is left out if neither read is mapped. */
+
+static int add_mate_tags(bam1_t *src, bam1_t *dest) {
+    kstring_t mc = KS_INITIALIZE;
+    uint32_t score = calc_score(src);
+    uint32_t i, *cigar = bam_get_cigar(src);
+    uint8_t *data;
+    int ret = 0;
+
+    // an empty cigar is written as "*" rather than ""
+    if (src->core.n_cigar == 0 && kputc('*', &mc) == EOF)
+        ret = -1;
+
+    for (i = 0; i < src->core.n_cigar && ret == 0; i++) {
+        if (kputw(bam_cigar_oplen(cigar[i]), &mc) == EOF ||
+            kputc(bam_cigar_opchr(cigar[i]), &mc) == EOF)
+            ret = -1;
+    }
+
+    if (ret == 0) {
+        if ((data = bam_aux_get(dest, "MC")) != NULL)
+            bam_aux_del(dest, data);
+
+        if ((data = bam_aux_get(dest, "ms")) != NULL)
+            bam_aux_del(dest, data);
+
+        if (!(src->core.flag & dest->core.flag & BAM_FUNMAP))
+            ret = bam_aux_append(dest, "MC", 'Z', ks_len(&mc) + 1, (uint8_t *)ks_str(&mc));
+    }
+
+    if (ret == 0)
+        ret = bam_aux_append(dest, "ms", 'i', sizeof(uint32_t), (uint8_t *)&score);
+
+    ks_free(&mc);
+
+    return ret;
+}
+
+
+static mate_stage_t *mate_stage_init(int window) {
+    mate_stage_t *ms = calloc(1, sizeof(mate_stage_t));
+
+    if (!ms)
+        return NULL;
+
+    ms->window = window;
+
+    ms->queue = kl_init(mate_queue);
+    ms->names = kh_init(mate_names);
+
+    if (!ms->queue || !ms->names) {
+        if (ms->queue) kl_destroy(mate_queue, ms->queue);
+        if (ms->names) kh_destroy(mate_names, ms->names);
+        free(ms);
+        return NULL;
+    }
+
+    return ms;
+}
+
+
+static void mate_stage_destroy(mate_stage_t *ms) {
+    kliter_t(mate_queue) *mq;
+
+    if (!ms)
+        return;
+
+    for (mq = kl_begin(ms->queue); mq != kl_end(ms->queue); mq = kl_next(mq))
+        bam_destroy1(kl_val(mq).b);
+
+    kl_destroy(mate_queue, ms->queue);
+    kh_destroy(mate_names, ms->names);
+    bam_pool_destroy(&ms->spare);
+    free(ms);
+}
+
+
+/* Queue a newly read alignment, completing the tags of the read waiting
+   for it or leaving it waiting in turn.  Returns 0 on success, -1 on
+   failure. */
+
+static int mate_stage_add(mate_stage_t *ms, bam1_t *b) {
+    mate_entry_t *e;
+    khiter_t k;
+    int ret;
+
+    if ((e = kl_pushp(mate_queue, ms->queue)) == NULL)
+        return -1;
+
+    e->b = b;
+    e->waiting = 0;
+
+    if (!primary_pair(b))
+        return 0;
+
+    k = kh_get(mate_names, ms->names, bam_get_qname(b));
+
+    if (k != kh_end(ms->names)) {
+        mate_entry_t *m = kh_val(ms->names, k);
+
+        if ((m->b->core.flag & (BAM_FREAD1 | BAM_FREAD2)) == (b->core.flag & (BAM_FREAD1 | BAM_FREAD2)))
+            return 0;
+
+        // the key is the waiting read's name, so remove it before the
+        // new tags move that read's data
+        kh_del(mate_names, ms->names, k);
+        m->waiting = 0;
+
+        if (add_mate_tags(b, m->b) || add_mate_tags(m->b, b))
+            return -1;
+    } else if (mate_in_reach(b, ms->window) && b->core.mpos >= b->core.pos) {
+        // wait even if already tagged, as the mate may not be
+        k = kh_put(mate_names, ms->names, bam_get_qname(b), &ret);
+
+        if (ret < 0)
+            return -1;
+
+        kh_val(ms->names, k) = e;
+        e->waiting = 1;
+    }
+
+    return 0;
+}
+
+
+static inline int md_read1(md_param_t *param, sam_hdr_t *h, bam1_t *b) {
+    return param->pipe_in ? sam_pipe_read(param->pipe_in, h, b)
+                          : sam_read1(param->in, h, b);
+}
+
+static inline int md_write1(md_param_t *param, sam_hdr_t *h, bam1_t *b) {
+    return param->pipe_out ? sam_pipe_write(param->pipe_out, b)
+                           : sam_write1(param->out, h, b);
+}
+
+
+/* Read the next alignment into *b, through the mate window if there is
+   one.  Returns as sam_read1(); on errors other than reading rd->failed
+   is set. */
+
+static int md_read_record(md_reader_t *rd, bam1_t **b) {
+    mate_stage_t *ms = rd->mates;
+    kliter_t(mate_queue) *head;
+    bam1_t *nb;
+    int ret;
+
+    if (!ms)
+        return md_read1(rd->param, rd->header, *b);
+
+    while (1) {
+        head = kl_begin(ms->queue);
+
+        if (head != kl_end(ms->queue)) {
+            mate_entry_t *e = &kl_val(head);
+
+            // on sorted data the mate can no longer turn up once the reads
+            // have moved past its position
+            if (!e->waiting || ms->end || ms->tid != e->b->core.tid || ms->pos > e->b->core.mpos) {
+                if (e->waiting) {
+                    khiter_t k = kh_get(mate_names, ms->names, bam_get_qname(e->b));
+
+                    if (k != kh_end(ms->names))
+                        kh_del(mate_names, ms->names, k);
+                }
+
+                bam_pool_put(&ms->spare, *b);
+                *b = e->b;
+                kl_shift(mate_queue, ms->queue, NULL);
+
+                return 0;
+            }
+        }
+
+        if (ms->end)
+            return ms->end;
+
+        if ((nb = bam_pool_get(&ms->spare)) == NULL) {
+            print_error("markdup", "error, unable to allocate memory for alignment.\n");
+            rd->failed = 1;
+            return -2;
+        }
+
+        if ((ret = md_read1(rd->param, rd->header, nb)) < 0) {
+            bam_pool_put(&ms->spare, nb);
+
+            if (ret < -1)
+                return ret;
+
+            ms->end = ret;
+            continue;
+        }
+
+        ms->tid = nb->core.tid;
+        ms->pos = nb->core.pos;
+
+        if (mate_stage_add(ms, nb)) {
+            print_error("markdup", "error, unable to add mate tags to %s.\n", bam_get_qname(nb));
+            rd->failed = 1;
+            return -2;
+        }
+    }
+}
+
+
 /* Create a signature hash of the current read and its pair.
    Uses the unclipped start (or end depending on orientation),
    the reference id, orientation and whether the current
-   read is leftmost of the pair. */
+   read is leftmost of the pair.  Returns 0 on success, MD_KEY_MC_TYPE
+   or MD_KEY_NO_MC if the MC tag is unusable. */
+
+#define MD_KEY_MC_TYPE 1
+#define MD_KEY_NO_MC   2
 
 
 static int make_pair_key(md_param_t *param, key_data_t *key, bam1_t *bam, int rg_num, long *warnings) {
@@ -308,16 +710,13 @@ static int make_pair_key(md_param_t *param, key_data_t *key, bam1_t *bam, int rg
     this_end   = unclipped_end(bam);
 
     if ((data = bam_aux_get(bam, "MC"))) {
-        if (!(cig = bam_aux2Z(data))) {
-            print_error("markdup", "error, MC tag wrong type. Please use the MC tag provided by samtools fixmate.\n");
-            return 1;
-        }
+        if (!(cig = bam_aux2Z(data)))
+            return MD_KEY_MC_TYPE;
 
         other_end   = unclipped_other_end(bam->core.mpos, cig);
         other_coord = unclipped_other_start(bam->core.mpos, cig);
     } else {
-        print_error("markdup", "error, no MC tag. Please run samtools fixmate on file first.\n");
-        return 1;
+        return MD_KEY_NO_MC;
     }
 
     // work out orientations
@@ -632,9 +1031,399 @@ static void make_single_key(md_param_t *param, key_data_t *key, bam1_t *bam, int
 }
 
 
+static inline size_t dup_entry_mem(const char *name, const char *orig) {
+    return strlen(name) + 1 + (orig ? strlen(orig) + 1 : 0) + sizeof(char *) + sizeof(dup_map_t);
+}
+
+
+static inline int dup_part(const char *name) {
+    return do_hash((unsigned char *)name, strlen(name)) % MD_DUP_PARTS;
+}
+
+
+static void clear_dup_hash(khash_t(duplicates) *d_hash) {
+    khiter_t d;
+
+    for (d = kh_begin(d_hash); d != kh_end(d_hash); ++d) {
+        if (kh_exist(d_hash, d)) {
+            free(kh_val(d_hash, d).name);
+            free((char *)kh_key(d_hash, d));
+        }
+    }
+
+    // kh_clear() keeps the buckets, so shrink them back to stay inside --max-dup-mem
+    kh_clear(duplicates, d_hash);
+    kh_resize(duplicates, d_hash, 0);
+}
+
+
+static FILE *open_spill_file(md_param_t *param, dup_spill_t *spill, char **fn) {
+    kstring_t name = KS_INITIALIZE;
+    FILE *fp;
+
+    if (ksprintf(&name, "%s.dup.%d", param->prefix, spill->n_files++) < 0) {
+        print_error("markdup", "error, unable to allocate memory for file name.\n");
+        return NULL;
+    }
+
+    if ((fp = fopen(name.s, "w+b")) == NULL) {
+        print_error_errno("markdup", "error, unable to open tmp file %s", name.s);
+        ks_free(&name);
+        return NULL;
+    }
+
+    *fn = ks_release(&name);
+
+    return fp;
+}
+
+
+static void close_spill_file(FILE **fp, char **fn) {
+    if (*fp) {
+        fclose(*fp);
+        remove(*fn);
+    }
+
+    free(*fn);
+    *fp = NULL;
+    *fn = NULL;
+}
+
+
+static void dup_spill_destroy(dup_spill_t *spill) {
+    int i;
+
+    if (!spill)
+        return;
+
+    for (i = 0; i < MD_DUP_PARTS; i++) {
+        close_spill_file(&spill->fp[i], &spill->fn[i]);
+        close_spill_file(&spill->cand[i], &spill->cand_fn[i]);
+        ks_free(&spill->hit_orig[i]);
+    }
+
+    ks_free(&spill->name);
+    free(spill);
+}
+
+
+/* A spilled duplicate map entry is stored as the index of the read in the
+   temporary file (-1 if not known yet), the type, retag flag and read group,
+   then the read name and original name as length and bytes.  A zero length
+   original name is a NULL. */
+
+static int write_dup_record(FILE *fp, int64_t idx, const char *name, dup_map_t *d) {
+    uint32_t name_len = name ? strlen(name) : 0;
+    uint32_t orig_len = d->name ? strlen(d->name) : 0;
+    int32_t group = d->read_group;
+
+    if (fwrite(&idx, sizeof(idx), 1, fp) != 1
+        || fwrite(&d->type, 1, 1, fp) != 1
+        || fwrite(&d->retag_only, 1, 1, fp) != 1
+        || fwrite(&group, sizeof(group), 1, fp) != 1
+        || fwrite(&name_len, sizeof(name_len), 1, fp) != 1
+        || (name_len && fwrite(name, 1, name_len, fp) != name_len)
+        || fwrite(&orig_len, sizeof(orig_len), 1, fp) != 1
+        || (orig_len && fwrite(d->name, 1, orig_len, fp) != orig_len))
+        return -1;
+
+    return 0;
+}
+
+
+/* Returns 1 on success, 0 at the end of the file or -1 on error. */
+static int read_dup_record(FILE *fp, int64_t *idx, kstring_t *name, kstring_t *orig, dup_map_t *d) {
+    uint32_t name_len, orig_len;
+    int32_t group;
+
+    if (fread(idx, sizeof(*idx), 1, fp) != 1)
+        return feof(fp) ? 0 : -1;
+
+    if (fread(&d->type, 1, 1, fp) != 1
+        || fread(&d->retag_only, 1, 1, fp) != 1
+        || fread(&group, sizeof(group), 1, fp) != 1
+        || fread(&name_len, sizeof(name_len), 1, fp) != 1
+        || ks_resize(name, name_len + 1) < 0
+        || fread(name->s, 1, name_len, fp) != name_len
+        || fread(&orig_len, sizeof(orig_len), 1, fp) != 1
+        || ks_resize(orig, orig_len + 1) < 0
+        || fread(orig->s, 1, orig_len, fp) != orig_len)
+        return -1;
+
+    name->s[name->l = name_len] = '\0';
+    orig->s[orig->l = orig_len] = '\0';
+    d->name = orig_len ? orig->s : NULL;
+    d->read_group = group;
+
+    return 1;
+}
+
+
+/* Write the duplicate map out to the partition files and empty it. */
+static int dup_spill_write(md_param_t *param, khash_t(duplicates) *d_hash) {
+    dup_spill_t *spill = param->dup_spill;
+    khiter_t d;
+
+    for (d = kh_begin(d_hash); d != kh_end(d_hash); ++d) {
+        const char *name;
+        int part;
+
+        if (!kh_exist(d_hash, d))
+            continue;
+
+        name = kh_key(d_hash, d);
+        part = dup_part(name);
+
+        if (!spill->fp[part] && (spill->fp[part] = open_spill_file(param, spill, &spill->fn[part])) == NULL)
+            return -1;
+
+        if (write_dup_record(spill->fp[part], -1, name, &kh_val(d_hash, d))) {
+            print_error_errno("markdup", "error, unable to write duplicate names to %s", spill->fn[part]);
+            return -1;
+        }
+    }
+
+    clear_dup_hash(d_hash);
+    spill->mem = 0;
+    spill->spilled = 1;
+
+    return 0;
+}
+
+
+/* Account for a new duplicate map entry, spilling the map if it is over the limit. */
+static inline int dup_spill_check(md_param_t *param, khash_t(duplicates) *d_hash, const char *name, const char *orig) {
+    if (!param->dup_spill)
+        return 0;
+
+    param->dup_spill->mem += dup_entry_mem(name, orig);
+
+    if (param->dup_spill->mem > param->dup_mem)
+        return dup_spill_write(param, d_hash);
+
+    return 0;
+}
+
+
+/* Read one partition of spilled names back into the empty duplicate map.
+   Entries are in the order they were made, so the first one for a name is
+   kept as add_duplicate() would, with later optical retags applied to it. */
+static int dup_spill_load(dup_spill_t *spill, int part, khash_t(duplicates) *d_hash) {
+    kstring_t orig = KS_INITIALIZE;
+    dup_map_t d;
+    int64_t idx;
+    int r, ret = 0;
+
+    rewind(spill->fp[part]);
+
+    while ((r = read_dup_record(spill->fp[part], &idx, &spill->name, &orig, &d)) > 0) {
+        khiter_t k = kh_get(duplicates, d_hash, spill->name.s);
+
+        if (k == kh_end(d_hash)) {
+            char *key = strdup(spill->name.s);
+            int put = -1;
+
+            if (key)
+                k = kh_put(duplicates, d_hash, key, &put);
+
+            if (put < 0) {
+                free(key);
+                ret = -1;
+                break;
+            }
+
+            kh_val(d_hash, k) = d;
+
+            if (d.name && (kh_val(d_hash, k).name = strdup(d.name)) == NULL) {
+                ret = -1;
+                break;
+            }
+        } else if (d.retag_only) {
+            kh_val(d_hash, k).type = 'O';
+        } else if (kh_val(d_hash, k).retag_only) {
+            kh_val(d_hash, k).retag_only = 0;
+            kh_val(d_hash, k).read_group = d.read_group;
+
+            if (d.name && (kh_val(d_hash, k).name = strdup(d.name)) == NULL) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    if (r < 0)
+        ret = -1;
+
+    if (ret)
+        print_error("markdup", "error, unable to read back duplicate names from %s.\n", spill->fn[part]);
+
+    ks_free(&orig);
+
+    return ret;
+}
+
+
+static inline int supp_dup_candidate(bam1_t *b) {
+    return (b->core.flag & BAM_FSUPPLEMENTARY) || (b->core.flag & BAM_FUNMAP) || (b->core.flag & BAM_FSECONDARY);
+}
+
+
+/* Split the names of the reads in the temporary file that could be
+   supplementary duplicates between the partitions, with their position in
+   the file, so the file itself is only read once. */
+static int split_spill_candidates(md_param_t *param, tmp_file_t *temp, bam1_t *b) {
+    dup_spill_t *spill = param->dup_spill;
+    dup_map_t none = {NULL, 0, 0, 0};
+    int64_t idx = 0;
+    int r;
+
+    if (tmp_file_begin_read(temp))
+        return -1;
+
+    while ((r = tmp_file_read(temp, b)) > 0) {
+        if (supp_dup_candidate(b)) {
+            int part = dup_part(bam_get_qname(b));
+
+            if (spill->fp[part]) {
+                if (!spill->cand[part]
+                    && (spill->cand[part] = open_spill_file(param, spill, &spill->cand_fn[part])) == NULL)
+                    return -1;
+
+                if (write_dup_record(spill->cand[part], idx, bam_get_qname(b), &none)) {
+                    print_error_errno("markdup", "error, unable to write read names to %s", spill->cand_fn[part]);
+                    return -1;
+                }
+            }
+        }
+
+        idx++;
+    }
+
+    if (r < 0) {
+        print_error("markdup", "error, failed to read tmp file.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* With the duplicate names spilled, find the duplicates one partition at a
+   time: load the partition's names, go through the candidate reads split
+   out by split_spill_candidates() and write out the entries for the reads
+   that match, by their position in the temporary file.  These replace the
+   partition's names, ready to be read back in step by the final pass with
+   next_spilled_hit(). */
+static int find_spilled_duplicates(md_param_t *param, tmp_file_t *temp, bam1_t *b, khash_t(duplicates) *d_hash) {
+    dup_spill_t *spill = param->dup_spill;
+    kstring_t orig = KS_INITIALIZE;
+    int part, ret = 0;
+    khiter_t k;
+
+    if (split_spill_candidates(param, temp, b))
+        return -1;
+
+    for (part = 0; part < MD_DUP_PARTS && !ret; part++) {
+        FILE *hits = NULL;
+        char *hits_fn = NULL;
+        dup_map_t cand;
+        int64_t idx;
+        int r = 0;
+
+        spill->hit_idx[part] = -1;
+
+        if (!spill->fp[part])
+            continue;
+
+        if (dup_spill_load(spill, part, d_hash)
+            || (hits = open_spill_file(param, spill, &hits_fn)) == NULL) {
+            ret = -1;
+            break;
+        }
+
+        // an optical retag left on its own was for a name never stored
+        for (k = kh_begin(d_hash); k != kh_end(d_hash); ++k) {
+            if (kh_exist(d_hash, k) && kh_val(d_hash, k).retag_only) {
+                print_error("markdup", "error, duplicate name %s not found in hash.\n",
+                    kh_key(d_hash, k));
+                ret = -1;
+                break;
+            }
+        }
+
+        if (ret) {
+            close_spill_file(&hits, &hits_fn);
+            break;
+        }
+
+        if (spill->cand[part]) {
+            rewind(spill->cand[part]);
+
+            while ((r = read_dup_record(spill->cand[part], &idx, &spill->name, &orig, &cand)) > 0) {
+                khiter_t k = kh_get(duplicates, d_hash, spill->name.s);
+
+                if (k != kh_end(d_hash) && !kh_val(d_hash, k).retag_only
+                    && write_dup_record(hits, idx, NULL, &kh_val(d_hash, k))) {
+                    print_error_errno("markdup", "error, unable to write duplicates to %s", hits_fn);
+                    ret = -1;
+                    break;
+                }
+            }
+
+            if (r < 0) {
+                print_error("markdup", "error, unable to read back read names from %s.\n", spill->cand_fn[part]);
+                ret = -1;
+            }
+
+            close_spill_file(&spill->cand[part], &spill->cand_fn[part]);
+        }
+
+        close_spill_file(&spill->fp[part], &spill->fn[part]);
+        spill->fp[part] = hits;
+        spill->fn[part] = hits_fn;
+        rewind(hits);
+        clear_dup_hash(d_hash);
+    }
+
+    ks_free(&orig);
+
+    return ret;
+}
+
+
+/* Get the duplicate entry, if any, found by find_spilled_duplicates() for
+   the read at position idx in the temporary file.  Must be called in order
+   of idx.  Returns 1 if found, 0 if not or -1 on error. */
+static int next_spilled_hit(dup_spill_t *spill, const char *qname, int64_t idx, dup_map_t **d) {
+    int part = dup_part(qname);
+
+    if (!spill->fp[part])
+        return 0;
+
+    while (spill->hit_idx[part] < idx) {
+        int r = read_dup_record(spill->fp[part], &spill->hit_idx[part], &spill->name,
+                                &spill->hit_orig[part], &spill->hit[part]);
+
+        if (r < 0) {
+            print_error("markdup", "error, unable to read back duplicates from %s.\n", spill->fn[part]);
+            return -1;
+        } else if (r == 0) {
+            spill->hit_idx[part] = INT64_MAX;
+        }
+    }
+
+    if (spill->hit_idx[part] != idx)
+        return 0;
+
+    *d = &spill->hit[part];
+
+    return 1;
+}
+
+
 /* Add the duplicate name to a hash if it does not exist. */
 
-static int add_duplicate(khash_t(duplicates) *d_hash, bam1_t *dupe, char *orig_name, char type, int group) {
+static int add_duplicate(md_param_t *param, khash_t(duplicates) *d_hash, bam1_t *dupe, char *orig_name, char type, int group) {
     khiter_t d;
     int ret;
 
@@ -667,7 +1456,11 @@ static int add_duplicate(khash_t(duplicates) *d_hash, bam1_t *dupe, char *orig_n
             }
 
             kh_value(d_hash, d).type = type;
+            kh_value(d_hash, d).retag_only = 0;
             kh_value(d_hash, d).read_group = group;
+
+            if (dup_spill_check(param, d_hash, bam_get_qname(dupe), orig_name))
+                return 1;
         } else {
             print_error("markdup", "error, unable to store supplementary duplicates.\n");
             free(name);
@@ -856,111 +1649,94 @@ static int get_coordinates(md_param_t *param, const char *name, int *t_beg, int
 }
 
 
-/* Using the coordinates from the read name, see whether the duplicated read is
-   close enough (set by max_dist) to the original to be counted as optical.*/
-
-static int is_optical_duplicate(md_param_t *param, bam1_t *ori, bam1_t *dup, long max_dist, long *warnings) {
-    int ret = 0;
-    char *original, *duplicate;
-    long ox, oy, dx, dy;
-    int o_beg = 0, o_end = 0, d_beg = 0, d_end = 0;
-
-    original  = bam_get_qname(ori);
-    duplicate = bam_get_qname(dup);
-
-    if (get_coordinates(param, original, &o_beg, &o_end, &ox, &oy, warnings)) {
-        return ret;
-    }
+/* Coordinates of a read from its name for the optical duplicate checks.
+   The name is only parsed the first time they are needed, as a read can be
+   compared with many others.  Returns as get_coordinates(). */
 
-    if (get_coordinates(param, duplicate, &d_beg, &d_end, &dx, &dy, warnings)) {
-        return ret;
+static int read_coordinates(md_param_t *param, read_queue_t *r, long *warnings) {
+    if (!r->coords_parsed) {
+        r->t_beg = r->t_end = 0;
+        r->x = r->y = -1;
+        r->coords_ret = get_coordinates(param, bam_get_qname(r->b), &r->t_beg, &r->t_end, &r->x, &r->y, warnings);
+        r->coords_parsed = 1;
     }
 
-    int o_len = o_end - o_beg;
-    int d_len = d_end - d_beg;
+    return r->coords_ret;
+}
 
-    if ((o_len == d_len) && memcmp(original + o_beg, duplicate + d_beg, o_len) == 0) {
-        long xdiff, ydiff;
 
-        if (ox > dx) {
-            xdiff = ox - dx;
-        } else {
-            xdiff = dx - ox;
-        }
+/* With the coordinates already read, see whether two reads are in the same
+   tile (or other matching part of the name) and within max_dist of each other. */
 
-        if (xdiff <= max_dist) {
-            // still might be optical
+static int close_on_flowcell(read_queue_t *ori, read_queue_t *dup, long max_dist) {
+    int o_len = ori->t_end - ori->t_beg;
+    int d_len = dup->t_end - dup->t_beg;
+    long xdiff, ydiff;
 
-            if (oy > dy) {
-                ydiff = oy - dy;
-            } else {
-                ydiff = dy - oy;
-            }
+    if ((o_len != d_len) || memcmp(bam_get_qname(ori->b) + ori->t_beg, bam_get_qname(dup->b) + dup->t_beg, o_len) != 0)
+        return 0;
 
-            if (ydiff <= max_dist) ret = 1;
-        }
+    if (ori->x > dup->x) {
+        xdiff = ori->x - dup->x;
+    } else {
+        xdiff = dup->x - ori->x;
     }
 
-    return ret;
-}
+    if (xdiff > max_dist)
+        return 0;
 
+    if (ori->y > dup->y) {
+        ydiff = ori->y - dup->y;
+    } else {
+        ydiff = dup->y - ori->y;
+    }
 
-/* Using the coordinates from the Illumina read name, see whether the duplicated read is
-   close enough (set by max_dist) to the original to be counted as optical.
+    return ydiff <= max_dist;
+}
 
-   This function needs the values from the first read to be already calculated. */
 
-static int optical_duplicate_partial(md_param_t *param, const char *name, const int o_beg, const int o_end, const long ox, const long oy, bam1_t *dup, check_t *c, long max_dist, long *warnings) {
-    int ret = 0;
-    char *duplicate;
-    int d_beg = 0, d_end = 0;
-    long dx, dy;
+/* Using the coordinates from the read name, see whether the duplicated read is
+   close enough (set by max_dist) to the original to be counted as optical.*/
 
-    duplicate = bam_get_qname(dup);
+static int is_optical_duplicate(md_param_t *param, read_queue_t *ori, read_queue_t *dup, long max_dist, long *warnings) {
+    if (read_coordinates(param, ori, warnings))
+        return 0;
 
-    if (get_coordinates(param, duplicate, &d_beg, &d_end, &dx, &dy, warnings)) {
-        return ret;
-    }
+    if (read_coordinates(param, dup, warnings))
+        return 0;
 
-    int o_len = o_end - o_beg;
-    int d_len = d_end - d_beg;
+    return close_on_flowcell(ori, dup, max_dist);
+}
 
-    if ((o_len == d_len) && memcmp(name + o_beg, duplicate + d_beg, o_len) == 0) {
-        // the initial parts match, look at the numbers
-        long xdiff, ydiff;
 
-        if (ox > dx) {
-            xdiff = ox - dx;
-        } else {
-            xdiff = dx - ox;
-        }
+/* Using the coordinates from the Illumina read name, see whether the duplicated read is
+   close enough (set by max_dist) to the original to be counted as optical.
+   Also fills in the duplicate's coordinates in c for check_duplicate_chain.
 
-        if (xdiff <= max_dist) {
-            // still might be optical
+   This function needs the values from the first read to be already calculated. */
 
-            if (oy > dy) {
-                ydiff = oy - dy;
-            } else {
-                ydiff = dy - oy;
-            }
+static int optical_duplicate_partial(md_param_t *param, read_queue_t *ori, read_queue_t *dup, check_t *c, long max_dist, long *warnings) {
+    c->beg = c->end = c->len = 0;
+    c->coords = 0;
 
-            if (ydiff <= max_dist) ret = 1;
-        }
-    }
+    if (read_coordinates(param, dup, warnings))
+        return 0;
 
-    c->x = dx;
-    c->y = dy;
-    c->beg = d_beg;
-    c->end = d_end;
-    c->len = d_end - d_beg;
+    c->coords = 1;
+    c->x = dup->x;
+    c->y = dup->y;
+    c->beg = dup->t_beg;
+    c->end = dup->t_end;
+    c->len = dup->t_end - dup->t_beg;
 
-    return ret;
+    return close_on_flowcell(ori, dup, max_dist);
 }
 
 
 /* Mark the read as a duplicate and update the duplicate hash (if needed) */
-static int mark_duplicates(md_param_t *param, khash_t(duplicates) *dup_hash, bam1_t *ori, bam1_t *dup,
+static int mark_duplicates(md_param_t *param, khash_t(duplicates) *dup_hash, read_queue_t *ori_read, read_queue_t *dup_read,
                            int read_group, long *optical, long *warn) {
+    bam1_t *ori = ori_read->b, *dup = dup_read->b;
     char dup_type = 0;
     long incoming_warnings = *warn;
 
@@ -974,7 +1750,7 @@ static int mark_duplicates(md_param_t *param, khash_t(duplicates) *dup_hash, bam
     }
 
     if (param->opt_dist) { // mark optical duplicates
-        if (is_optical_duplicate(param, ori, dup, param->opt_dist, warn)) {
+        if (is_optical_duplicate(param, ori_read, dup_read, param->opt_dist, warn)) {
             bam_aux_update_str(dup, "dt", 3, "SQ");
             dup_type = 'O';
             (*optical)++;
@@ -989,72 +1765,359 @@ static int mark_duplicates(md_param_t *param, khash_t(duplicates) *dup_hash, bam
                         *warn);
     }
 
-    if (param->supp) {
-        if (bam_aux_get(dup, "SA") || (dup->core.flag & BAM_FMUNMAP) || bam_aux_get(dup, "XA")) {
-            char *original = NULL;
+    if (param->supp) {
+        if (bam_aux_get(dup, "SA") || (dup->core.flag & BAM_FMUNMAP) || bam_aux_get(dup, "XA")) {
+            char *original = NULL;
+
+            if (param->tag) {
+                original = bam_get_qname(ori);
+            }
+
+            if (add_duplicate(param, dup_hash, dup, original, dup_type, read_group))
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* If the duplicate type has changed to optical then retag and duplicate hash. */
+static inline int optical_retag(md_param_t *param, khash_t(duplicates) *dup_hash, bam1_t *b, int paired, stats_block_t *stats) {
+    int ret = 0;
+
+    if (bam_aux_update_str(b, "dt", 3, "SQ")) {
+        print_error("markdup", "error, unable to update 'dt' tag.\n");
+        ret = -1;
+    }
+
+    if (paired) {
+        stats->optical++;
+    } else {
+        stats->single_optical++;
+    }
+
+    if (param->supp) {
+        // Change the duplicate type
+
+        if (bam_aux_get(b, "SA") || (b->core.flag & BAM_FMUNMAP)
+            || bam_aux_get(b, "XA")) {
+            khiter_t d;
+
+            d = kh_get(duplicates, dup_hash, bam_get_qname(b));
+
+            if (d == kh_end(dup_hash) && param->dup_spill && param->dup_spill->spilled) {
+                // may have been written out, record the change for when it is
+                // read back; find_spilled_duplicates() reports it if not
+                char *name = strdup(bam_get_qname(b));
+                int put = -1;
+
+                if (name)
+                    d = kh_put(duplicates, dup_hash, name, &put);
+
+                if (put < 0) {
+                    print_error("markdup", "error, unable to store supplementary duplicates.\n");
+                    free(name);
+                    ret = -1;
+                } else {
+                    kh_value(dup_hash, d).name = NULL;
+                    kh_value(dup_hash, d).type = 'O';
+                    kh_value(dup_hash, d).retag_only = 1;
+                    kh_value(dup_hash, d).read_group = 0;
+
+                    if (dup_spill_check(param, dup_hash, name, NULL))
+                        ret = -1;
+                }
+            } else if (d == kh_end(dup_hash)) {
+                // error, name should already be in dup hash
+                print_error("markdup", "error, duplicate name %s not found in hash.\n",
+                    bam_get_qname(b));
+                ret = -1;
+            } else {
+                kh_value(dup_hash, d).type = 'O';
+            }
+        }
+    }
+
+    return ret;
+}
+
+
+/* This is based on the fixmate actions for when only one of a pair is present */
+static inline int has_mate(bam1_t *b) {
+    int ret = 0;
+
+    if ((b->core.flag & BAM_FPAIRED) && !(b->core.flag & BAM_FMUNMAP) &&
+       !((b->core.mtid == -1) && (b->core.mpos == -1))) {
+        ret = 1;
+    }
+
+    return ret;
+}
+
+
+/* Mate score found by prepare_read(), reporting the missing tag as
+   get_mate_score() does. */
+static inline int64_t queued_mate_score(read_queue_t *r) {
+    if (r->mate_score == -1)
+        return get_mate_score(r->b);
+
+    return r->mate_score;
+}
+
+
+/* Do the work on a read that does not need the other reads: find its read
+   group, clear old duplicate marks, build its hash keys and score it.
+   Only reads param and rg_hash so it is safe to run in worker threads.
+   Errors are left in key_err for the caller to report in input order. */
+
+static void prepare_read(md_param_t *param, khash_t(read_groups) *rg_hash, md_read_t *r, long *warnings) {
+    bam1_t *b = r->b;
+    int exclude = BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FUNMAP;
+    uint8_t *data;
+
+    if (!param->include_fails)
+        exclude |= BAM_FQCFAIL;
+
+    r->read_group = 0;
+    r->examine = 0;
+    r->paired = 0;
+    r->key_err = 0;
+    r->score = 0;
+    r->mate_score = -1;
+
+    if (param->read_groups) {
+        char *rg;
+
+        if ((data = bam_aux_get(b, "RG"))) {
+            if ((rg = bam_aux2Z(data))) {
+                khiter_t k = kh_get(read_groups, rg_hash, rg);
+
+                if (k != kh_end(rg_hash)) {
+                    r->read_group = kh_value(rg_hash, k);
+                }
+            }
+        }
+    }
+
+    if (param->clear && (b->core.flag & BAM_FDUP)) {
+        b->core.flag ^= BAM_FDUP;
+
+        if ((data = bam_aux_get(b, "dt")) != NULL) {
+            bam_aux_del(b, data);
+        }
+
+        if ((data = bam_aux_get(b, "do")) != NULL) {
+            bam_aux_del(b, data);
+        }
+    }
+
+    // read must not be secondary, supplementary, unmapped or (possibly) failed QC
+    if (b->core.flag & exclude)
+        return;
+
+    r->examine = 1;
+    r->score = calc_score(b);
+
+    // with --mate-window, pairs whose tags could not be filled in (the mate
+    // being out of reach or missing) count as single
+    if (has_mate(b) && (!param->mate_window ||
+                        (bam_aux_get(b, "MC") && bam_aux_get(b, "ms")))) {
+        r->paired = 1;
+
+        if ((r->key_err = make_pair_key(param, &r->pair_key, b, r->read_group, warnings)))
+            return;
+
+        if ((data = bam_aux_get(b, "ms")))
+            r->mate_score = bam_aux2i(data);
+    }
+
+    make_single_key(param, &r->single_key, b, r->read_group, warnings);
+}
+
+
+static void *prepare_batch(void *arg) {
+    md_batch_t *bt = (md_batch_t *)arg;
+    int i;
+
+    for (i = 0; i < bt->n; i++)
+        prepare_read(bt->param, bt->rg_hash, &bt->reads[i], &bt->warnings);
+
+    return bt;
+}
+
+
+static int md_reader_init(md_reader_t *rd, md_param_t *param, sam_hdr_t *header,
+                          khash_t(read_groups) *rg_hash, long *warnings) {
+    int i;
+
+    memset(rd, 0, sizeof(*rd));
+    rd->param = param;
+    rd->header = header;
+    rd->rg_hash = rg_hash;
+    rd->warnings = warnings;
+
+    if (param->mate_window && (rd->mates = mate_stage_init(param->mate_window)) == NULL)
+        return -1;
+
+    if (!param->pool)
+        return 0;
+
+    // enough batches to keep every worker busy while the main thread
+    // resolves duplicates on the finished ones
+    rd->n_batch = 2 * hts_tpool_size(param->pool);
+
+    if ((rd->batch = calloc(rd->n_batch, sizeof(md_batch_t))) == NULL)
+        return -1;
+
+    for (i = 0; i < rd->n_batch; i++) {
+        rd->batch[i].param = param;
+        rd->batch[i].rg_hash = rg_hash;
+
+        if ((rd->batch[i].reads = calloc(MD_BATCH_SIZE, sizeof(md_read_t))) == NULL)
+            return -1;
+    }
+
+    if ((rd->q = hts_tpool_process_init(param->pool, rd->n_batch, 0)) == NULL)
+        return -1;
+    sam_prof_queue("markdup.prepare", rd->q);
+
+    return 0;
+}
+
+
+static void md_reader_destroy(md_reader_t *rd) {
+    int i, j;
+
+    // waits for any batches still being worked on
+    if (rd->q) {
+        sam_prof_queue_done(rd->q);
+        hts_tpool_process_destroy(rd->q);
+    }
+
+    if (rd->batch) {
+        for (i = 0; i < rd->n_batch; i++) {
+            if (!rd->batch[i].reads)
+                continue;
+
+            for (j = 0; j < MD_BATCH_SIZE; j++) {
+                if (rd->batch[i].reads[j].b)
+                    bam_destroy1(rd->batch[i].reads[j].b);
+            }
+
+            free(rd->batch[i].reads);
+        }
+
+        free(rd->batch);
+    }
+
+    mate_stage_destroy(rd->mates);
 
-            if (param->tag) {
-                original = bam_get_qname(ori);
-            }
+    rd->q = NULL;
+    rd->batch = NULL;
+    rd->mates = NULL;
+}
 
-            if (add_duplicate(dup_hash, dup, original, dup_type, read_group))
-                return -1;
+
+static void md_fill_batch(md_reader_t *rd, md_batch_t *bt) {
+    int ret;
+
+    bt->n = 0;
+
+    while (bt->n < MD_BATCH_SIZE) {
+        md_read_t *r = &bt->reads[bt->n];
+
+        if (!r->b && (r->b = bam_init1()) == NULL) {
+            print_error("markdup", "error, unable to allocate memory for alignment.\n");
+            rd->failed = 1;
+            rd->end = -2;
+            break;
+        }
+
+        if ((ret = md_read_record(rd, &r->b)) < 0) {
+            rd->end = ret;
+            break;
         }
+
+        bt->n++;
     }
 
-    return 0;
+    // barcode warnings from earlier batches, so the reporting limit
+    // still roughly applies
+    bt->warnings = bt->warn_start = *rd->warnings;
 }
 
 
-/* If the duplicate type has changed to optical then retag and duplicate hash. */
-static inline int optical_retag(md_param_t *param, khash_t(duplicates) *dup_hash, bam1_t *b, int paired, stats_block_t *stats) {
-    int ret = 0;
+/* Read the next alignment into *b, swapping it with a prepared one when
+   threaded, and point *r at its prepare_read() results.  Returns as
+   sam_read1(); on errors other than reading rd->failed is set. */
 
-    if (bam_aux_update_str(b, "dt", 3, "SQ")) {
-        print_error("markdup", "error, unable to update 'dt' tag.\n");
-        ret = -1;
+static int md_next_read(md_reader_t *rd, bam1_t **b, md_read_t **r) {
+    md_read_t *next;
+    bam1_t *tmp;
+
+    if (!rd->q) {
+        int ret = md_read_record(rd, b);
+
+        if (ret >= 0) {
+            rd->one.b = *b;
+            prepare_read(rd->param, rd->rg_hash, &rd->one, rd->warnings);
+            *r = &rd->one;
+        }
+
+        return ret;
     }
 
-    if (paired) {
-        stats->optical++;
-    } else {
-        stats->single_optical++;
+    if (rd->curr && rd->curr_idx == rd->curr->n) {
+        *rd->warnings += rd->curr->warnings - rd->curr->warn_start;
+        rd->curr = NULL;
+        rd->in_flight--;
     }
 
-    if (param->supp) {
-        // Change the duplicate type
+    if (!rd->curr) {
+        hts_tpool_result *res;
 
-        if (bam_aux_get(b, "SA") || (b->core.flag & BAM_FMUNMAP)
-            || bam_aux_get(b, "XA")) {
-            khiter_t d;
+        // the ring of batches is kept no larger than the queue, so
+        // dispatching never blocks on results we have yet to collect
+        while (!rd->end && rd->in_flight < rd->n_batch) {
+            md_batch_t *bt = &rd->batch[rd->next_fill];
 
-            d = kh_get(duplicates, dup_hash, bam_get_qname(b));
+            md_fill_batch(rd, bt);
 
-            if (d == kh_end(dup_hash)) {
-                // error, name should already be in dup hash
-                print_error("markdup", "error, duplicate name %s not found in hash.\n",
-                    bam_get_qname(b));
-                ret = -1;
-            } else {
-                kh_value(dup_hash, d).type = 'O';
+            if (bt->n == 0)
+                break;
+
+            if (hts_tpool_dispatch(rd->param->pool, rd->q, prepare_batch, bt) < 0) {
+                print_error("markdup", "error, unable to queue reads for processing.\n");
+                rd->failed = 1;
+                return rd->end = -2;
             }
-        }
-    }
 
-    return ret;
-}
+            rd->next_fill = (rd->next_fill + 1) % rd->n_batch;
+            rd->in_flight++;
+        }
 
+        if (!rd->in_flight)
+            return rd->end;
 
-/* This is based on the fixmate actions for when only one of a pair is present */
-static inline int has_mate(bam1_t *b) {
-    int ret = 0;
+        if ((res = hts_tpool_next_result_wait(rd->q)) == NULL) {
+            print_error("markdup", "error, unable to get processed reads.\n");
+            rd->failed = 1;
+            return rd->end = -2;
+        }
 
-    if ((b->core.flag & BAM_FPAIRED) && !(b->core.flag & BAM_FMUNMAP) &&
-       !((b->core.mtid == -1) && (b->core.mpos == -1))) {
-        ret = 1;
+        rd->curr = (md_batch_t *)hts_tpool_result_data(res);
+        rd->curr_idx = 0;
+        hts_tpool_delete_result(res, 0);
     }
 
-    return ret;
+    next = &rd->curr->reads[rd->curr_idx++];
+    tmp = *b;
+    *b = next->b;
+    next->b = tmp;
+    *r = next;
+
+    return 0;
 }
 
 
@@ -1068,11 +2131,9 @@ static int check_chain_against_original(md_param_t *param, khash_t(duplicates) *
     int ret = 0, coord_fail = 0;
     char *ori_name = bam_get_qname(ori->b);
     read_queue_t *current = ori->duplicate;
-    int t_beg = 0, t_end = 0;
-    long x, y;
 
     if (param->opt_dist) {
-        coord_fail = get_coordinates(param, ori_name, &t_beg, &t_end, &x, &y, warn);
+        coord_fail = read_coordinates(param, ori, warn);
     }
 
     list->length = 0;
@@ -1096,8 +2157,10 @@ static int check_chain_against_original(md_param_t *param, khash_t(duplicates) *
         c = &list->c[list->length];
 
         c->b = current->b;
+        c->paired = current->paired;
         c->x = -1;
         c->y = -1;
+        c->coords = 0;
         c->opt = 0;
         c->score = 0;
         c->mate_score = 0;
@@ -1131,7 +2194,7 @@ static int check_chain_against_original(md_param_t *param, khash_t(duplicates) *
             uint8_t *data;
             char *dup_type;
             int is_opt = 0;
-            int current_paired = has_mate(current->b);
+            int current_paired = current->paired;
 
             if ((data = bam_aux_get(current->b, "dt"))) {
                 if ((dup_type = bam_aux2Z(data))) {
@@ -1142,7 +2205,7 @@ static int check_chain_against_original(md_param_t *param, khash_t(duplicates) *
             }
 
             // need to run this to get the duplicates x and y scores
-            is_opt = optical_duplicate_partial(param, ori_name, t_beg, t_end, x, y, current->b, c, param->opt_dist, warn);
+            is_opt = optical_duplicate_partial(param, ori, current, c, param->opt_dist, warn);
 
             if (!c->opt && is_opt) {
                 if (optical_retag(param, dup_hash, current->b, current_paired, stats)) {
@@ -1187,127 +2250,184 @@ static int chain_sort(const void *a, const void *b) {
     else if ((ret = memcmp(bam_get_qname(ac->b) + ac->beg, bam_get_qname(bc->b) + bc->beg, ac->len)))
         return ret;
 
-    return (ac->x - bc->x);
+    if (ac->cx != bc->cx)
+        return ac->cx < bc->cx ? -1 : 1;
+
+    if (ac->cy != bc->cy)
+        return ac->cy < bc->cy ? -1 : 1;
+
+    return 0;
 }
 
 
-/* Check all the duplicates against each other to see if they are optical duplicates. */
-static int check_duplicate_chain(md_param_t *param, khash_t(duplicates) *dup_hash, check_list_t *list,
-             long *warn, stats_block_t *stats) {
-    int ret = 0;
-    size_t curr = 0;
+/* Grid cell of a coordinate, rounding down for the -1 of unknown coordinates. */
+static inline long grid_cell(long v, long size) {
+    return v >= 0 ? v / size : -((-v - 1) / size) - 1;
+}
 
-    qsort(list->c, list->length, sizeof(list->c[0]), chain_sort);
 
-    while (curr < list->length - 1) {
-        check_t *base = &list->c[curr];
-        char *base_name = bam_get_qname(base->b);
-        int end_name_match = curr;
+/* First entry in c[lo, hi) at or after grid cell (cx, cy). */
+static size_t first_in_cell(check_t *c, size_t lo, size_t hi, long cx, long cy) {
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
 
-        // find the end of the matching name parts
-        while (++end_name_match < list->length) {
-            check_t *chk = &list->c[end_name_match];
+        if (c[mid].cx < cx || (c[mid].cx == cx && c[mid].cy < cy)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
 
-            if ((base->len == chk->len) && memcmp(base_name + base->beg, bam_get_qname(chk->b) + chk->beg, base->len) != 0)
-                break;
+    return lo;
+}
+
+
+/* If two duplicates are close enough to be optical duplicates of each other,
+   mark the lower scoring one as optical. */
+static int check_optical_pair(md_param_t *param, khash_t(duplicates) *dup_hash, check_t *current, check_t *chk,
+             stats_block_t *stats) {
+    long xdiff, ydiff;
+    int current_paired, chk_paired;
+    int chk_dup = 0;
+
+    if ((current->opt && chk->opt) || !current->coords || !chk->coords)
+        return 0;
+
+    if (current->x > chk->x) {
+        xdiff = current->x - chk->x;
+    } else {
+        xdiff = chk->x - current->x;
+    }
+
+    if (current->y > chk->y) {
+        ydiff = current->y - chk->y;
+    } else {
+        ydiff = chk->y - current->y;
+    }
+
+    if (xdiff > param->opt_dist || ydiff > param->opt_dist)
+        return 0;
+
+    // optical duplicates
+    current_paired = current->paired;
+    chk_paired = chk->paired;
+
+    if (current_paired != chk_paired) {
+        if (!chk_paired) {
+            // chk is single vs pair, this is a dup.
+            chk_dup = 1;
         }
+    } else {
+        // do it by scores
+        int64_t cur_score, chk_score;
 
-        while (curr < end_name_match) {
-            size_t count = curr;
-            check_t *current = &list->c[curr];
-            int current_paired = has_mate(current->b);
+        if ((current->b->core.flag & BAM_FQCFAIL) != (chk->b->core.flag & BAM_FQCFAIL)) {
+            if (current->b->core.flag & BAM_FQCFAIL) {
+                cur_score = 0;
+                chk_score = 1;
+            } else {
+                cur_score = 1;
+                chk_score = 0;
+            }
+        } else {
+            cur_score = current->score;
+            chk_score = chk->score;
 
-            while (++count < end_name_match && (list->c[count].x - current->x <= param->opt_dist)) {
-                // while close enough along the x coordinate
-                check_t *chk = &list->c[count];
+            if (current_paired) {
+                // they are pairs so add mate scores.
+                chk_score += chk->mate_score;
+                cur_score += current->mate_score;
+            }
+        }
 
-                if (current->opt && chk->opt)
-                    continue;
+        if (cur_score == chk_score) {
+            if (strcmp(bam_get_qname(chk->b), bam_get_qname(current->b)) < 0) {
+                chk_score++;
+            } else {
+                chk_score--;
+            }
+        }
 
-                long ydiff;
+        if (cur_score > chk_score) {
+            chk_dup = 1;
+        }
+    }
 
-                if (current->y > chk->y) {
-                    ydiff = current->y - chk->y;
-                } else {
-                    ydiff = chk->y - current->y;
-                }
+    if (chk_dup) {
+        // the duplicate is the optical duplicate
+        if (!chk->opt) { // only change if not already an optical duplicate
+            if (optical_retag(param, dup_hash, chk->b, chk_paired, stats))
+                return -1;
 
-                if (ydiff > param->opt_dist)
-                    continue;
+            chk->opt = 1;
+        }
+    } else {
+        if (!current->opt) {
+            if (optical_retag(param, dup_hash, current->b, current_paired, stats))
+                return -1;
 
-                // optical duplicates
-                int chk_dup = 0;
-                int chk_paired = has_mate(chk->b);
+            current->opt = 1;
+        }
+    }
 
-                if (current_paired != chk_paired) {
-                    if (!chk_paired) {
-                        // chk is single vs pair, this is a dup.
-                        chk_dup = 1;
-                    }
-                } else {
-                    // do it by scores
-                    int64_t cur_score, chk_score;
+    return 0;
+}
 
-                    if ((current->b->core.flag & BAM_FQCFAIL) != (chk->b->core.flag & BAM_FQCFAIL)) {
-                        if (current->b->core.flag & BAM_FQCFAIL) {
-                            cur_score = 0;
-                            chk_score = 1;
-                        } else {
-                            cur_score = 1;
-                            chk_score = 0;
-                        }
-                    } else {
-                        cur_score = current->score;
-                        chk_score = chk->score;
 
-                        if (current_paired) {
-                            // they are pairs so add mate scores.
-                            chk_score += chk->mate_score;
-                            cur_score += current->mate_score;
-                        }
-                    }
+/* Check all the duplicates against each other to see if they are optical duplicates.
 
-                    if (cur_score == chk_score) {
-                        if (strcmp(bam_get_qname(chk->b), bam_get_qname(current->b)) < 0) {
-                            chk_score++;
-                        } else {
-                            chk_score--;
-                        }
-                    }
+   The duplicates are put on a grid of cells opt_dist wide within each tile
+   (or other matching name part), so reads close enough to be optical
+   duplicates are always in the same or a neighbouring cell.  Sorted by
+   cell, each read is checked against the rest of its own cell and the
+   following cells (cx, cy + 1) and (cx + 1, cy - 1 to cy + 1), which takes
+   in every close pair once without comparing whole duplicate sets. */
+static int check_duplicate_chain(md_param_t *param, khash_t(duplicates) *dup_hash, check_list_t *list,
+             long *warn, stats_block_t *stats) {
+    size_t curr = 0, i;
 
-                    if (cur_score > chk_score) {
-                        chk_dup = 1;
-                    }
-                }
+    for (i = 0; i < list->length; i++) {
+        list->c[i].cx = grid_cell(list->c[i].x, param->opt_dist);
+        list->c[i].cy = grid_cell(list->c[i].y, param->opt_dist);
+    }
 
-                if (chk_dup) {
-                    // the duplicate is the optical duplicate
-                    if (!chk->opt) { // only change if not already an optical duplicate
-                        if (optical_retag(param, dup_hash, chk->b, chk_paired, stats)) {
-                            ret = -1;
-                            goto fail;
-                        }
+    qsort(list->c, list->length, sizeof(list->c[0]), chain_sort);
 
-                        chk->opt = 1;
-                    }
-                } else {
-                    if (!current->opt) {
-                        if (optical_retag(param, dup_hash, current->b, current_paired, stats)) {
-                            ret = -1;
-                            goto fail;
-                        }
+    while (curr < list->length - 1) {
+        check_t *base = &list->c[curr];
+        char *base_name = bam_get_qname(base->b);
+        size_t end_name_match = curr;
 
-                        current->opt = 1;
-                    }
-                }
+        // find the end of the matching name parts
+        while (++end_name_match < list->length) {
+            check_t *chk = &list->c[end_name_match];
+
+            if ((base->len != chk->len) || memcmp(base_name + base->beg, bam_get_qname(chk->b) + chk->beg, base->len) != 0)
+                break;
+        }
+
+        while (curr < end_name_match) {
+            check_t *current = &list->c[curr];
+            size_t count;
+
+            for (count = curr + 1; count < end_name_match && list->c[count].cx == current->cx
+                     && list->c[count].cy <= current->cy + 1; count++) {
+                if (check_optical_pair(param, dup_hash, current, &list->c[count], stats))
+                    return -1;
+            }
+
+            for (count = first_in_cell(list->c, count, end_name_match, current->cx + 1, current->cy - 1);
+                 count < end_name_match && list->c[count].cx == current->cx + 1
+                     && list->c[count].cy <= current->cy + 1; count++) {
+                if (check_optical_pair(param, dup_hash, current, &list->c[count], stats))
+                    return -1;
             }
 
             curr++;
         }
     }
 
- fail:
-    return ret;
+    return 0;
 }
 
 
@@ -1365,7 +2485,7 @@ static inline double coverage_equation(double x, double c, double n) {
 
 
 /* estimate the library size, based on the Picard code in DuplicationMetrics.java*/
-static unsigned long estimate_library_size(unsigned long paired_reads, unsigned long paired_duplicate_reads, unsigned long optical) {
+static unsigned long estimate_library_size(unsigned long paired_reads, unsigned long paired_duplicate_reads, unsigned long optical, int warn) {
     unsigned long estimated_size = 0;
     unsigned long non_optical_pairs = (paired_reads - optical) / 2;
     unsigned long unique_pairs = (paired_reads - paired_duplicate_reads) / 2;
@@ -1377,7 +2497,8 @@ static unsigned long estimate_library_size(unsigned long paired_reads, unsigned
         int i;
 
         if (coverage_equation(m * (double)unique_pairs, (double)unique_pairs, (double)non_optical_pairs) < 0) {
-            print_error("markdup", "warning, unable to calculate estimated library size.\n");
+            if (warn)
+                print_error("markdup", "warning, unable to calculate estimated library size.\n");
             return  estimated_size;
         }
 
@@ -1399,7 +2520,7 @@ static unsigned long estimate_library_size(unsigned long paired_reads, unsigned
         }
 
         estimated_size = (unsigned long)(unique_pairs * (m + M) / 2);
-    } else {
+    } else if (warn) {
         print_error("markdup", "warning, unable to calculate estimated library size."
                         " Read pairs %ld should be greater than duplicate pairs %ld,"
                         " which should both be non zero.\n",
@@ -1413,7 +2534,7 @@ static unsigned long estimate_library_size(unsigned long paired_reads, unsigned
 static void write_stats(FILE *fp, const char *title,  const char *title_con, stats_block_t *stats) {
     unsigned long els;
 
-    els = estimate_library_size(stats->pair, stats->duplicate, stats->optical);
+    els = estimate_library_size(stats->pair, stats->duplicate, stats->optical, 1);
 
     if (title) {
         fprintf(fp, "%s%s\n", title, title_con);
@@ -1443,7 +2564,7 @@ static void write_stats(FILE *fp, const char *title,  const char *title_con, sta
 static void write_json_stats(FILE *fp, const char *offset, const char *group_name, stats_block_t *stats, const char *end) {
     unsigned long  els;
 
-    els = estimate_library_size(stats->pair, stats->duplicate, stats->optical);
+    els = estimate_library_size(stats->pair, stats->duplicate, stats->optical, 1);
 
     if (group_name) {
         fprintf(fp, "%s\"READ GROUP\": \"%s\",\n", offset, group_name);
@@ -1471,6 +2592,56 @@ static void write_json_stats(FILE *fp, const char *offset, const char *group_nam
 }
 
 
+/* Add up the stats of all the read groups. */
+
+static void total_stats(stats_block_t *total, stats_block_t *stat_array, int num_groups) {
+    int i;
+
+    *total = stat_array[0];
+
+    for (i = 1; i <= num_groups; i++) {
+        total->reading += stat_array[i].reading;
+        total->writing += stat_array[i].writing;
+        total->excluded += stat_array[i].excluded;
+        total->duplicate += stat_array[i].duplicate;
+        total->single += stat_array[i].single;
+        total->pair += stat_array[i].pair;
+        total->single_dup += stat_array[i].single_dup;
+        total->examined += stat_array[i].examined;
+        total->optical += stat_array[i].optical;
+        total->single_optical += stat_array[i].single_optical;
+        total->np_duplicate += stat_array[i].np_duplicate;
+        total->np_opt_duplicate += stat_array[i].np_opt_duplicate;
+    }
+}
+
+
+/* Write the counts so far as one line of JSON for --progress.  Reads still
+   in the window have not all been settled, so the duplicate counts lag a
+   little behind READ. */
+
+static void write_progress(FILE *fp, stats_block_t *stats, const char *ref, hts_pos_t pos,
+                           time_t start, int finished) {
+    unsigned long els = estimate_library_size(stats->pair, stats->duplicate, stats->optical, 0);
+    long dups = stats->single_dup + stats->duplicate;
+
+    fprintf(fp, "{\"ELAPSED\": %ld, \"FINISHED\": %s, \"REFERENCE\": \"%s\", \"POSITION\": %"PRIhts_pos", ",
+            (long)(time(NULL) - start), finished ? "true" : "false", ref, pos);
+    fprintf(fp, "\"READ\": %ld, \"WRITTEN\": %ld, \"EXCLUDED\": %ld, \"EXAMINED\": %ld, "
+            "\"PAIRED\": %ld, \"SINGLE\": %ld, \"DUPLICATE PAIR\": %ld, \"DUPLICATE SINGLE\": %ld, "
+            "\"DUPLICATE PAIR OPTICAL\": %ld, \"DUPLICATE SINGLE OPTICAL\": %ld, "
+            "\"DUPLICATE NON PRIMARY\": %ld, \"DUPLICATE PRIMARY TOTAL\": %ld, "
+            "\"PERCENT DUPLICATION\": %.4f, \"ESTIMATED_LIBRARY_SIZE\": %lu}\n",
+            stats->reading, stats->writing, stats->excluded, stats->examined,
+            stats->pair, stats->single, stats->duplicate, stats->single_dup,
+            stats->optical, stats->single_optical, stats->np_duplicate, dups,
+            stats->examined ? (double)dups / stats->examined : 0.0, els);
+
+    // readers will be watching the file while we run
+    fflush(fp);
+}
+
+
 /* Compare the reads near each other (coordinate sorted) and try to spot the duplicates.
    Generally the highest quality scoring is chosen as the original and all others the duplicates.
    The score is based on the sum of the quality values (<= 15) of the read and its mate (if any).
@@ -1498,15 +2669,25 @@ static int bam_mark_duplicates(md_param_t *param) {
     long opt_warnings = 0, bc_warnings = 0;
     tmp_file_t temp;
     char *idx_fn = NULL;
-    int exclude = 0;
     check_list_t dup_list = {NULL, 0, 0};
+    md_reader_t reader = {NULL};
+    md_read_t *prep;
+    bam_pool_t spare = {NULL, 0, 0};
+    FILE *progress_fp = NULL;
+    long since_progress = 0;
+    time_t start = time(NULL);
+    int st_mark = sam_prof_stage("mark"), st_supp = sam_prof_stage("supplementary");
 
     if (!pair_hash || !single_hash || !read_buffer || !dup_hash || !rg_hash) {
         print_error("markdup", "error, unable to allocate memory to initialise structures.\n");
         goto fail;
     }
 
-    if ((header = sam_hdr_read(param->in)) == NULL) {
+    if (param->pipe_in)
+        header = sam_pipe_read_header(param->pipe_in);
+    else
+        header = sam_hdr_read(param->in);
+    if (header == NULL) {
         print_error("markdup", "error reading header\n");
         goto fail;
     }
@@ -1528,7 +2709,8 @@ static int bam_mark_duplicates(md_param_t *param) {
         print_error("markdup", "warning, unable to add @PG line to header.\n");
     }
 
-    if (sam_hdr_write(param->out, header) < 0) {
+    if ((param->pipe_out ? sam_pipe_write_header(param->pipe_out, header)
+                         : sam_hdr_write(param->out, header)) < 0) {
         print_error("markdup", "error writing header.\n");
         goto fail;
     }
@@ -1597,6 +2779,14 @@ static int bam_mark_duplicates(md_param_t *param) {
         goto fail;
     }
 
+    if (param->progress_file) {
+        if (strcmp(param->progress_file, "-") == 0) {
+            progress_fp = stderr;
+        } else if ((progress_fp = fopen(param->progress_file, "w")) == NULL) {
+            print_error_errno("markdup", "warning, cannot write progress to %s", param->progress_file);
+        }
+    }
+
     // used for coordinate order checks
     prev_tid = prev_coord = 0;
 
@@ -1613,6 +2803,22 @@ static int bam_mark_duplicates(md_param_t *param) {
             print_error("markdup", "error, unable to open tmp file %s.\n", param->prefix);
             goto fail;
         }
+
+        if (tmp_file_set_thread_pool(&temp, param->pool)) {
+            print_error("markdup", "error, unable to use threads for tmp file %s.\n", param->prefix);
+            goto fail;
+        }
+
+        if (param->tmp_codec != TMP_SAM_CODEC_LZ4
+            && tmp_file_set_codec(&temp, param->tmp_codec)) {
+            print_error("markdup", "error, unable to set codec for tmp file %s.\n", param->prefix);
+            goto fail;
+        }
+
+        if (param->dup_mem && (param->dup_spill = calloc(1, sizeof(dup_spill_t))) == NULL) {
+            print_error("markdup", "error, unable to allocate memory for duplicate names.\n");
+            goto fail;
+        }
     }
 
     if ((in_read->b = bam_init1()) == NULL) {
@@ -1633,7 +2839,13 @@ static int bam_mark_duplicates(md_param_t *param) {
         }
     }
 
-    while ((ret = sam_read1(param->in, header, in_read->b)) >= 0) {
+    if (md_reader_init(&reader, param, header, rg_hash, &bc_warnings)) {
+        print_error("markdup", "error, unable to allocate memory for read batches.\n");
+        goto fail;
+    }
+
+    sam_prof_begin(st_mark);
+    while ((ret = md_next_read(&reader, &in_read->b, &prep)) >= 0) {
 
         // do some basic coordinate order checks
         if (in_read->b->core.tid >= 0) { // -1 for unmapped reads
@@ -1651,68 +2863,52 @@ static int bam_mark_duplicates(md_param_t *param) {
         in_read->duplicate = NULL;
         in_read->original = NULL;
         in_read->dup_checked = 0;
-        in_read->read_group = 0;
+        in_read->coords_parsed = 0;
+        in_read->read_group = prep->read_group;
+        in_read->score = prep->score;
+        in_read->mate_score = prep->mate_score;
+        in_read->paired = prep->paired;
         in_read->dc = 1;
 
-        if (param->read_groups) {
-            uint8_t *data;
-            char *rg;
-
-            if ((data = bam_aux_get(in_read->b, "RG"))) {
-                if ((rg = bam_aux2Z(data))) {
-                    khiter_t r;
-
-                    r = kh_get(read_groups, rg_hash, rg);
-
-                    if (r != kh_end(rg_hash)) {
-                        in_read->read_group = kh_value(rg_hash, r);
-                    }
-                }
-            }
-        }
-
         stats = stat_array + in_read->read_group;
 
         stats->reading++;
 
-        if (param->clear && (in_read->b->core.flag & BAM_FDUP)) {
-            uint8_t *data;
-
-            in_read->b->core.flag ^= BAM_FDUP;
-
-            if ((data = bam_aux_get(in_read->b, "dt")) != NULL) {
-                bam_aux_del(in_read->b, data);
-            }
-
-            if ((data = bam_aux_get(in_read->b, "do")) != NULL) {
-                bam_aux_del(in_read->b, data);
-            }
-        }
+        if (progress_fp && ++since_progress >= param->progress_interval) {
+            stats_block_t total;
 
-        if (param->include_fails) {
-            exclude |= (BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FUNMAP);
-        } else {
-            exclude |= (BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FUNMAP | BAM_FQCFAIL);
+            total_stats(&total, stat_array, num_groups);
+            write_progress(progress_fp, &total, in_read->b->core.tid >= 0 ?
+                           sam_hdr_tid2name(header, in_read->b->core.tid) : "*",
+                           in_read->b->core.pos + 1, start, 0);
+            since_progress = 0;
         }
 
         // read must not be secondary, supplementary, unmapped or (possibly) failed QC
-        if (!(in_read->b->core.flag & exclude)) {
+        if (prep->examine) {
             stats->examined++;
 
 
             // look at the pairs first
-            if (has_mate(in_read->b)) {
+            if (prep->paired) {
                 int ret, mate_tmp;
                 key_data_t pair_key;
                 key_data_t single_key;
                 in_hash_t *bp;
 
-                if (make_pair_key(param, &pair_key, in_read->b, in_read->read_group, &bc_warnings)) {
+                if (prep->key_err) {
+                    if (prep->key_err == MD_KEY_MC_TYPE) {
+                        print_error("markdup", "error, MC tag wrong type. Please use the MC tag provided by samtools fixmate.\n");
+                    } else {
+                        print_error("markdup", "error, no MC tag. Please run samtools fixmate on file first.\n");
+                    }
+
                     print_error("markdup", "error, unable to assign pair hash key.\n");
                     goto fail;
                 }
 
-                make_single_key(param, &single_key, in_read->b, in_read->read_group, &bc_warnings);
+                pair_key = prep->pair_key;
+                single_key = prep->single_key;
 
                 stats->pair++;
                 in_read->pos = single_key.this_coord; // cigar/orientation modified pos
@@ -1729,10 +2925,10 @@ static int bam_mark_duplicates(md_param_t *param) {
                     // look at singles only for duplication marking
                     bp = &kh_val(single_hash, k);
 
-                    if (!has_mate(bp->p->b)) {
+                    if (!bp->p->paired) {
                        // singleton will always be marked duplicate even if
                        // scores more than one read of the pair
-                        bam1_t *dup = bp->p->b;
+                        read_queue_t *dup = bp->p;
 
                         if (param->check_chain) {
                             in_read->duplicate = bp->p;
@@ -1742,7 +2938,7 @@ static int bam_mark_duplicates(md_param_t *param) {
                         bp->p = in_read;
                         bp->p->dc += 1;
 
-                        if (mark_duplicates(param, dup_hash, bp->p->b, dup, in_read->read_group, &stats->single_optical, &opt_warnings))
+                        if (mark_duplicates(param, dup_hash, bp->p, dup, in_read->read_group, &stats->single_optical, &opt_warnings))
                             goto fail;
 
                         stats->single_dup++;
@@ -1762,7 +2958,7 @@ static int bam_mark_duplicates(md_param_t *param) {
                     in_read->pair_key = pair_key;
                 } else if (ret == 0) {
                     int64_t old_score, new_score, tie_add = 0;
-                    bam1_t *dup = NULL;
+                    read_queue_t *dup = NULL;
 
                     bp = &kh_val(pair_hash, k);
 
@@ -1775,18 +2971,18 @@ static int bam_mark_duplicates(md_param_t *param) {
                             new_score = 0;
                         }
                     } else {
-                        if ((mate_tmp = get_mate_score(bp->p->b)) == -1) {
+                        if ((mate_tmp = queued_mate_score(bp->p)) == -1) {
                             print_error("markdup", "error, no ms score tag. Please run samtools fixmate on file first.\n");
                             goto fail;
                         } else {
-                            old_score = calc_score(bp->p->b) + mate_tmp;
+                            old_score = bp->p->score + mate_tmp;
                         }
 
-                        if ((mate_tmp = get_mate_score(in_read->b)) == -1) {
+                        if ((mate_tmp = queued_mate_score(in_read)) == -1) {
                             print_error("markdup", "error, no ms score tag. Please run samtools fixmate on file first.\n");
                             goto fail;
                         } else {
-                            new_score = calc_score(in_read->b) + mate_tmp;
+                            new_score = in_read->score + mate_tmp;
                         }
                     }
 
@@ -1802,7 +2998,7 @@ static int bam_mark_duplicates(md_param_t *param) {
                     }
 
                     if (new_score + tie_add > old_score) { // swap reads
-                        dup = bp->p->b;
+                        dup = bp->p;
                         in_read->dc += bp->p->dc;
 
                         if (param->check_chain) {
@@ -1843,11 +3039,11 @@ static int bam_mark_duplicates(md_param_t *param) {
                             in_read->original = bp->p;
                         }
 
-                        dup = in_read->b;
+                        dup = in_read;
                         bp->p->dc += 1;
                     }
 
-                    if (mark_duplicates(param, dup_hash, bp->p->b, dup, in_read->read_group, &stats->optical, &opt_warnings))
+                    if (mark_duplicates(param, dup_hash, bp->p, dup, in_read->read_group, &stats->optical, &opt_warnings))
                         goto fail;
 
                     stats->duplicate++;
@@ -1857,11 +3053,9 @@ static int bam_mark_duplicates(md_param_t *param) {
                 }
             } else { // do the single (or effectively single) reads
                 int ret;
-                key_data_t single_key;
+                key_data_t single_key = prep->single_key;
                 in_hash_t *bp;
 
-                make_single_key(param, &single_key, in_read->b, in_read->read_group, &bc_warnings);
-
                 stats->single++;
                 in_read->pos = single_key.this_coord; // cigar/orientation modified pos
 
@@ -1874,7 +3068,7 @@ static int bam_mark_duplicates(md_param_t *param) {
                 } else if (ret == 0) { // exists
                     bp = &kh_val(single_hash, k);
 
-                    if (has_mate(bp->p->b)) {
+                    if (bp->p->paired) {
                         // if matched against one of a pair just mark as duplicate
 
                         if (param->check_chain) {
@@ -1888,20 +3082,20 @@ static int bam_mark_duplicates(md_param_t *param) {
 
                         bp->p->dc += 1;
 
-                        if (mark_duplicates(param, dup_hash, bp->p->b, in_read->b, in_read->read_group, &stats->single_optical, &opt_warnings))
+                        if (mark_duplicates(param, dup_hash, bp->p, in_read, in_read->read_group, &stats->single_optical, &opt_warnings))
                             goto fail;
 
                     } else {
                         int64_t old_score, new_score;
-                        bam1_t *dup = NULL;
+                        read_queue_t *dup = NULL;
 
-                        old_score = calc_score(bp->p->b);
-                        new_score = calc_score(in_read->b);
+                        old_score = bp->p->score;
+                        new_score = in_read->score;
 
                         // choose the highest score as the original, add it
                         // to the single hash and mark the other as duplicate
                         if (new_score > old_score) { // swap reads
-                            dup = bp->p->b;
+                            dup = bp->p;
                             in_read->dc += bp->p->dc;
 
                             if (param->check_chain) {
@@ -1921,10 +3115,10 @@ static int bam_mark_duplicates(md_param_t *param) {
                             }
 
                             bp->p->dc += 1;
-                            dup = in_read->b;
+                            dup = in_read;
                         }
 
-                        if (mark_duplicates(param, dup_hash, bp->p->b, dup, in_read->read_group, &stats->single_optical, &opt_warnings))
+                        if (mark_duplicates(param, dup_hash, bp->p, dup, in_read->read_group, &stats->single_optical, &opt_warnings))
                             goto fail;
                     }
 
@@ -1967,7 +3161,7 @@ static int bam_mark_duplicates(md_param_t *param) {
                         goto fail;
                     }
                 } else {
-                    if (sam_write1(param->out, header, in_read->b) < 0) {
+                    if (md_write1(param, header, in_read->b) < 0) {
                         print_error("markdup", "error, writing output failed.\n");
                         goto fail;
                     }
@@ -1988,10 +3182,13 @@ static int bam_mark_duplicates(md_param_t *param) {
             }
 
             kl_shift(read_queue, read_buffer, NULL);
-            bam_destroy1(in_read->b);
+            bam_pool_put(&spare, in_read->b);
             rq = kl_begin(read_buffer);
         }
 
+        shrink_read_hash(pair_hash);
+        shrink_read_hash(single_hash);
+
         // set the next one up for reading
         in_read = kl_pushp(read_queue, read_buffer);
         if (!in_read) {
@@ -1999,23 +3196,27 @@ static int bam_mark_duplicates(md_param_t *param) {
             goto fail;
         }
 
-        if ((in_read->b = bam_init1()) == NULL) {
+        if ((in_read->b = bam_pool_get(&spare)) == NULL) {
             print_error("markdup", "error, unable to allocate memory for alignment.\n");
             goto fail;
         }
     }
 
     if (ret < -1) {
-        print_error("markdup", "error, truncated input file.\n");
+        if (!reader.failed)
+            print_error("markdup", "error, truncated input file.\n");
         goto fail;
     }
 
+    md_reader_destroy(&reader);
+    bam_pool_destroy(&spare);
+
     // write out the end of the list
     rq = kl_begin(read_buffer);
     while (rq != kl_end(read_buffer)) {
         in_read = &kl_val(rq);
 
-        if (bam_get_qname(in_read->b)) { // last entry will be blank
+        if (in_read->b->l_data) { // last entry will be blank
             if (param->check_chain && !in_read->dup_checked && (in_read->original || in_read->duplicate)) {
                 if (find_duplicate_chains(param, in_read, dup_hash, &dup_list, &opt_warnings, stat_array)) {
                     print_error("markdup", "error, duplicate checking failed.\n");
@@ -2038,7 +3239,7 @@ static int bam_mark_duplicates(md_param_t *param) {
                         bam_aux_update_int(in_read->b, "dc", in_read->dc);
                     }
 
-                    if (sam_write1(param->out, header, in_read->b) < 0) {
+                    if (md_write1(param, header, in_read->b) < 0) {
                         print_error("markdup", "error, writing output failed on final write.\n");
                         goto fail;
                     }
@@ -2052,45 +3253,68 @@ static int bam_mark_duplicates(md_param_t *param) {
         bam_destroy1(in_read->b);
         rq = kl_begin(read_buffer);
     }
+    sam_prof_end(st_mark);
 
     if (param->supp) {
         bam1_t *b;
 
+        sam_prof_begin(st_supp);
+
         if (tmp_file_end_write(&temp)) {
             print_error("markdup", "error, unable to end tmp writing.\n");
             goto fail;
         }
 
+        if ((b = bam_init1()) == NULL) {
+            print_error("markdup", "error, unable to allocate memory for alignment.\n");
+            goto fail;
+        }
+
+        if (param->dup_spill && param->dup_spill->spilled) {
+            // everything goes to disk so the names can be read back in parts
+            if (dup_spill_write(param, dup_hash) || find_spilled_duplicates(param, &temp, b, dup_hash))
+                goto fail;
+        }
+
         // read data from temp file and mark duplicate supplementary alignments
 
         if (tmp_file_begin_read(&temp)) {
             goto fail;
         }
 
-        b = bam_init1();
+        int64_t idx = 0;
 
         while ((ret = tmp_file_read(&temp, b)) > 0) {
 
-            if ((b->core.flag & BAM_FSUPPLEMENTARY) || (b->core.flag & BAM_FUNMAP) || (b->core.flag & BAM_FSECONDARY)) {
+            if (supp_dup_candidate(b)) {
+                dup_map_t *dup = NULL;
 
-                k = kh_get(duplicates, dup_hash, bam_get_qname(b));
+                if (param->dup_spill && param->dup_spill->spilled) {
+                    if (next_spilled_hit(param->dup_spill, bam_get_qname(b), idx, &dup) < 0)
+                        goto fail;
+                } else {
+                    k = kh_get(duplicates, dup_hash, bam_get_qname(b));
+
+                    if (k != kh_end(dup_hash))
+                        dup = &kh_val(dup_hash, k);
+                }
 
-                if (k != kh_end(dup_hash)) {
+                if (dup) {
 
                     b->core.flag  |= BAM_FDUP;
-                    stat_array[kh_val(dup_hash, k).read_group].np_duplicate++;
+                    stat_array[dup->read_group].np_duplicate++;
 
-                    if (param->tag && kh_val(dup_hash, k).name) {
-                        if (bam_aux_update_str(b, "do", strlen(kh_val(dup_hash, k).name) + 1, (char*)kh_val(dup_hash, k).name)) {
+                    if (param->tag && dup->name) {
+                        if (bam_aux_update_str(b, "do", strlen(dup->name) + 1, (char*)dup->name)) {
                             print_error("markdup", "error, unable to append supplementary 'do' tag.\n");
                             goto fail;
                         }
                     }
 
                     if (param->opt_dist) {
-                        if (kh_val(dup_hash, k).type) {
+                        if (dup->type) {
                             bam_aux_update_str(b, "dt", 3, "SQ");
-                            stat_array[kh_val(dup_hash, k).read_group].np_opt_duplicate++;
+                            stat_array[dup->read_group].np_opt_duplicate++;
                         } else {
                             bam_aux_update_str(b, "dt", 3, "LB");
                         }
@@ -2098,12 +3322,14 @@ static int bam_mark_duplicates(md_param_t *param) {
                 }
             }
 
+            idx++;
+
             if (!param->remove_dups || !(b->core.flag & BAM_FDUP)) {
                 if (param->dc && (b->core.flag & BAM_FDUP)) {
                     uint8_t* data = bam_aux_get(b, "dc");
                     if(data) bam_aux_del(b, data);
                 }
-                if (sam_write1(param->out, header, b) < 0) {
+                if (md_write1(param, header, b) < 0) {
                     print_error("markdup", "error, writing final output failed.\n");
                     goto fail;
                 }
@@ -2125,6 +3351,9 @@ static int bam_mark_duplicates(md_param_t *param) {
 
         tmp_file_destroy(&temp);
         bam_destroy1(b);
+        dup_spill_destroy(param->dup_spill);
+        param->dup_spill = NULL;
+        sam_prof_end(st_supp);
     }
 
     if (opt_warnings) {
@@ -2136,6 +3365,18 @@ static int bam_mark_duplicates(md_param_t *param) {
         print_error("markdup", "warning, number of failed attempts to get barcodes = %ld\n", bc_warnings);
     }
 
+    if (progress_fp) {
+        stats_block_t total;
+
+        total_stats(&total, stat_array, num_groups);
+        write_progress(progress_fp, &total, "*", 0, start, 1);
+
+        if (progress_fp != stderr)
+            fclose(progress_fp);
+
+        progress_fp = NULL;
+    }
+
     if (param->do_stats) {
         FILE *fp;
         int file_open = 0;
@@ -2153,24 +3394,7 @@ static int bam_mark_duplicates(md_param_t *param) {
             fp = stderr;
         }
 
-        total = stat_array[0];
-
-        if (param->read_groups) {
-            for (i = 1; i <= num_groups; i++) {
-                total.reading += stat_array[i].reading;
-                total.writing += stat_array[i].writing;
-                total.excluded += stat_array[i].excluded;
-                total.duplicate += stat_array[i].duplicate;
-                total.single += stat_array[i].single;
-                total.pair += stat_array[i].pair;
-                total.single_dup += stat_array[i].single_dup;
-                total.examined += stat_array[i].examined;
-                total.optical += stat_array[i].optical;
-                total.single_optical += stat_array[i].single_optical;
-                total.np_duplicate += stat_array[i].np_duplicate;
-                total.np_opt_duplicate += stat_array[i].np_opt_duplicate;
-            }
-        }
+        total_stats(&total, stat_array, num_groups);
 
         if (!param->json) {
             write_stats(fp, "COMMAND: ", param->arg_list, &total);
@@ -2235,6 +3459,17 @@ static int bam_mark_duplicates(md_param_t *param) {
         }
     }
 
+    {
+        stats_block_t total;
+
+        total_stats(&total, stat_array, num_groups);
+        sam_prof_add("records_in", total.reading);
+        sam_prof_add("records_written", total.writing);
+        sam_prof_add("duplicates", total.duplicate);
+        sam_prof_file("bytes_in", param->in);
+        sam_prof_output("bytes_out", param->out);
+    }
+
     if (param->check_chain && (param->tag || param->opt_dist))
         free(dup_list.c);
 
@@ -2265,6 +3500,14 @@ static int bam_mark_duplicates(md_param_t *param) {
     if (param->check_chain && (param->tag || param->opt_dist))
         free(dup_list.c);
 
+    md_reader_destroy(&reader);
+    bam_pool_destroy(&spare);
+    dup_spill_destroy(param->dup_spill);
+    param->dup_spill = NULL;
+
+    if (progress_fp && progress_fp != stderr)
+        fclose(progress_fp);
+
     free(idx_fn);
     free(stat_array);
     kh_destroy(reads, pair_hash);
@@ -2304,11 +3547,20 @@ static int markdup_usage(void) {
     fprintf(stderr, "  -t                 Mark primary duplicates with the name of the original in a \'do\' tag."
                                         " Mainly for information and debugging.\n");
     fprintf(stderr, "  --duplicate-count  Record the original primary read duplication count(include itself) in a \'dc\' tag.\n");
+    fprintf(stderr, "  --max-dup-mem INT  Memory for names of duplicates kept for -S before writing\n"
+                    "                     them to temporary files (e.g. 2G) [no limit]\n");
+    fprintf(stderr, "  --progress FILE    Write JSON lines snapshots of the stats to FILE (- for stderr)\n");
+    fprintf(stderr, "  --progress-interval INT\n"
+                    "                     Reads between --progress snapshots [10000000]\n");
+    fprintf(stderr, "  --mate-window INT  Add MC and ms tags from mates up to INT bases downstream,\n"
+                    "                     so fixmate -m is not needed [off]\n");
+    fprintf(stderr, "  --tmp-codec STR    Temporary file compression: lz4, lz4-dict or deflate [lz4]\n");
 
-    sam_global_opt_help(stderr, "-.O..@..");
+    sam_global_opt_help(stderr, "-.O..@....");
 
     fprintf(stderr, "\nThe input file must be coordinate sorted and must have gone"
-                     " through fixmates with the mate scoring option on.\n");
+                     " through fixmates with the mate scoring option on\n"
+                     "(or use --mate-window).\n");
 
     return 1;
 }
@@ -2325,10 +3577,11 @@ int bam_markdup(int argc, char **argv) {
     char *regex = NULL, *bc_regex = NULL;
     char *regex_order = "txy";
     md_param_t param = {NULL, NULL, NULL, 0, 300, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                        1, NULL, NULL, NULL, NULL, 0, 0, 0, NULL, NULL, 0, 0, 0};
+                        1, NULL, NULL, NULL, NULL, 0, 0, 0, NULL, NULL, 0, 0, 0, NULL, 0, NULL, 0, NULL,
+                        10000000, TMP_SAM_CODEC_LZ4};
 
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@', 0, 0),
         {"include-fails", no_argument, NULL, 1001},
         {"no-PG", no_argument, NULL, 1002},
         {"mode", required_argument, NULL, 'm'},
@@ -2341,6 +3594,11 @@ int bam_markdup(int argc, char **argv) {
         {"use-read-groups", no_argument, NULL, 1009},
         {"json", no_argument, NULL, 1010},
         {"duplicate-count", no_argument, NULL, 1011},
+        {"max-dup-mem", required_argument, NULL, 1012},
+        {"mate-window", required_argument, NULL, 1013},
+        {"progress", required_argument, NULL, 1014},
+        {"progress-interval", required_argument, NULL, 1015},
+        {"tmp-codec", required_argument, NULL, 1016},
         {NULL, 0, NULL, 0}
     };
 
@@ -2378,6 +3636,52 @@ int bam_markdup(int argc, char **argv) {
             case 1009: param.read_groups = 1; break;
             case 1010: param.json = 1; param.do_stats = 1; break;
             case 1011: param.dc = 1; break;
+            case 1012: {
+                    char *q;
+                    int shift = 0;
+                    long long mem;
+                    errno = 0;
+                    mem = strtoll(optarg, &q, 0);
+                    if (*q == 'k' || *q == 'K') shift = 10, q++;
+                    else if (*q == 'm' || *q == 'M') shift = 20, q++;
+                    else if (*q == 'g' || *q == 'G') shift = 30, q++;
+                    if (q == optarg || *q || errno == ERANGE || mem < 0
+                        || mem > (LLONG_MAX >> shift)) {
+                        print_error("markdup", "error, invalid --max-dup-mem \"%s\".\n", optarg);
+                        return 1;
+                    }
+                    param.dup_mem = mem << shift;
+                    break;
+                }
+            case 1013: {
+                    char *end;
+                    long window;
+                    errno = 0;
+                    window = strtol(optarg, &end, 10);
+                    if (end == optarg || *end || errno == ERANGE || window < 0 || window > INT_MAX) {
+                        print_error("markdup", "error, invalid --mate-window \"%s\".\n", optarg);
+                        return 1;
+                    }
+                    param.mate_window = window;
+                    break;
+                }
+            case 1014: param.progress_file = optarg; break;
+            case 1015: {
+                    char *end;
+                    errno = 0;
+                    param.progress_interval = strtol(optarg, &end, 10);
+                    if (end == optarg || *end || errno == ERANGE || param.progress_interval < 1) {
+                        print_error("markdup", "error, invalid --progress-interval \"%s\".\n", optarg);
+                        return 1;
+                    }
+                    break;
+                }
+            case 1016:
+                if ((param.tmp_codec = tmp_file_codec(optarg)) < 0) {
+                    print_error("markdup", "error, unknown --tmp-codec \"%s\".\n", optarg);
+                    return 1;
+                }
+                break;
             default: if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
             /* else fall-through */
             case '?': return markdup_usage();
@@ -2394,6 +3698,7 @@ int bam_markdup(int argc, char **argv) {
     }
 
     if (param.opt_dist < 0) param.opt_dist = 0;
+    if (param.progress_interval < 1) param.progress_interval = 10000000;
     if (param.max_length < 0) param.max_length = 300;
 
     if (regex) {
@@ -2466,30 +3771,39 @@ int bam_markdup(int argc, char **argv) {
         }
     }
 
-    param.in = sam_open_format(argv[optind], "r", &ga.in);
+    if (sam_prof_init(&ga, "markdup") < 0)
+        return 1;
+
+    param.pipe_in = sam_stage_input(argv[optind]);
+    param.pipe_out = sam_stage_output(argv[optind + 1]);
+
+    if (param.pipe_out && ga.write_index) {
+        print_error("markdup", "error, can't index the output of a pipeline stage.\n");
+        return 1;
+    }
 
-    if (!param.in) {
+    if (!param.pipe_in && !(param.in = sam_open_format(argv[optind], "r", &ga.in))) {
         print_error_errno("markdup", "error, failed to open \"%s\" for input", argv[optind]);
         return 1;
     }
 
     strcat(wmode, "b"); // default if unknown suffix
     sam_open_mode(wmode + strlen(wmode)-1, argv[optind + 1], NULL);
-    param.out = sam_open_format(argv[optind + 1], wmode, &ga.out);
 
-    if (!param.out) {
+    if (!param.pipe_out && !(param.out = sam_open_format(argv[optind + 1], wmode, &ga.out))) {
         print_error_errno("markdup", "error, failed to open \"%s\" for output", argv[optind + 1]);
         return 1;
     }
 
     if (ga.nthreads > 0)  {
-        if (!(p.pool = hts_tpool_init(ga.nthreads))) {
+        if (!(p.pool = sam_stage_tpool_init(ga.nthreads))) {
             print_error("markdup", "error creating thread pool.\n");
             return 1;
         }
 
-        hts_set_opt(param.in,  HTS_OPT_THREAD_POOL, &p);
-        hts_set_opt(param.out, HTS_OPT_THREAD_POOL, &p);
+        if (param.in)  hts_set_opt(param.in,  HTS_OPT_THREAD_POOL, &p);
+        if (param.out) hts_set_opt(param.out, HTS_OPT_THREAD_POOL, &p);
+        param.pool = p.pool;
     }
 
     // actual stuff happens here
@@ -2514,17 +3828,18 @@ int bam_markdup(int argc, char **argv) {
     param.arg_list = stringify_argv(argc + 1, argv - 1);
     param.write_index = ga.write_index;
     param.out_fn = argv[optind + 1];
+    sam_stage_ready();
 
     ret = bam_mark_duplicates(&param);
 
-    sam_close(param.in);
+    if (param.in) sam_close(param.in);
 
-    if (sam_close(param.out) < 0) {
+    if (param.out && sam_close(param.out) < 0) {
         print_error("markdup", "error closing output file.\n");
         ret = 1;
     }
 
-    if (p.pool) hts_tpool_destroy(p.pool);
+    sam_stage_tpool_destroy(p.pool);
 
     if (param.rgx) {
         regfree(param.rgx);
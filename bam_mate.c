@@ -32,6 +32,9 @@ DEALINGS IN THE SOFTWARE.  */
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
 #include "htslib/thread_pool.h"
 #include "sam_opts.h"
 #include "htslib/kstring.h"
@@ -41,19 +44,153 @@ DEALINGS IN THE SOFTWARE.  */
 
 #define MD_MIN_QUALITY 15
 
+/*
+ * Aux tag changes for one record, queued up and then made together by
+ * aux_edit_apply().  Each queued tag replaces any existing copy and is
+ * added to the end of the record in the order queued, as a series of
+ * bam_aux_del() and bam_aux_append() calls would do.  However the aux
+ * data is moved at most once, and reallocated at most once.
+ */
+#define AUX_EDIT_MAX 8
+
+typedef struct {
+    int n;
+    struct {
+        char tag[2];
+        int off, len;   // type and value in buf, or len 0 to delete
+    } e[AUX_EDIT_MAX];
+    kstring_t buf;
+} aux_edit_t;
+
+// Working space for fix_template(), kept from one template to the next
+typedef struct {
+    kstring_t str;
+    aux_edit_t ae[2];   // for the current pair of primary reads
+} fix_buf_t;
+
+static void fix_buf_free(fix_buf_t *fb) {
+    ks_free(&fb->str);
+    ks_free(&fb->ae[0].buf);
+    ks_free(&fb->ae[1].buf);
+}
+
+static inline void aux_edit_clear(aux_edit_t *ae) {
+    ae->n = 0;
+    ae->buf.l = 0;
+}
+
+// Queues tag to be set to type and data, or deleted if data is NULL.
+// Returns 0 on success,
+//        -1 on failure
+static int aux_edit_put(aux_edit_t *ae, const char tag[2], char type,
+                        int len, const uint8_t *data) {
+    int i;
+
+    // A later change to a tag replaces an earlier one
+    for (i = 0; i < ae->n; i++) {
+        if (ae->e[i].tag[0] == tag[0] && ae->e[i].tag[1] == tag[1]) {
+            memmove(&ae->e[i], &ae->e[i+1], (ae->n-i-1) * sizeof(ae->e[0]));
+            ae->n--;
+            break;
+        }
+    }
+    if (ae->n == AUX_EDIT_MAX)
+        return -1;
+
+    ae->e[ae->n].tag[0] = tag[0];
+    ae->e[ae->n].tag[1] = tag[1];
+    ae->e[ae->n].off = ae->buf.l;
+    ae->e[ae->n].len = data ? len + 1 : 0;
+    if (data && (kputc_(type, &ae->buf) < 0
+                 || kputsn_(data, len, &ae->buf) < 0))
+        return -1;
+    ae->n++;
+
+    return 0;
+}
+
+static inline int aux_edit_del(aux_edit_t *ae, const char tag[2]) {
+    return aux_edit_put(ae, tag, 0, 0, NULL);
+}
+
+static inline int aux_edit_put_i(aux_edit_t *ae, const char tag[2],
+                                 uint32_t val) {
+    uint8_t v[4];
+    u32_to_le(val, v);
+    return aux_edit_put(ae, tag, 'i', 4, v);
+}
+
+// Makes the queued changes to b, and clears ae.
+// Returns 0 on success,
+//        -1 on failure
+static int aux_edit_apply(bam1_t *b, aux_edit_t *ae) {
+    uint8_t *tag, *next, *end = b->data + b->l_data;
+    uint8_t *to = bam_get_aux(b);
+    size_t add = 0;
+    int i;
+
+    if (!ae->n)
+        return 0;
+
+    // Take out the old copies of the tags, moving the rest down
+    for (tag = bam_aux_first(b); tag; tag = next) {
+        // Corrupt aux data is left alone, as bam_aux_get() would
+        next = bam_aux_next(b, tag);
+        uint8_t *tag_end = next ? next-2 : end;
+        for (i = 0; i < ae->n; i++)
+            if (tag[-2] == ae->e[i].tag[0] && tag[-1] == ae->e[i].tag[1])
+                break;
+        if (i == ae->n) {
+            if (to != tag-2)
+                memmove(to, tag-2, tag_end - (tag-2));
+            to += tag_end - (tag-2);
+        }
+    }
+    b->l_data = to - b->data;
+
+    // Then add the new ones on the end
+    for (i = 0; i < ae->n; i++)
+        if (ae->e[i].len)
+            add += 2 + ae->e[i].len;
+    if (b->l_data + add > b->m_data) {
+        // FIXME: make htslib's sam_realloc_bam_data public
+        uint8_t *new_data = realloc(b->data, b->l_data + add);
+        if (!new_data)
+            return -1;
+        b->data = new_data;
+        b->m_data = b->l_data + add;
+    }
+    to = b->data + b->l_data;
+    for (i = 0; i < ae->n; i++) {
+        if (!ae->e[i].len)
+            continue;
+        *to++ = ae->e[i].tag[0];
+        *to++ = ae->e[i].tag[1];
+        memcpy(to, ae->buf.s + ae->e[i].off, ae->e[i].len);
+        to += ae->e[i].len;
+    }
+    b->l_data += add;
+    aux_edit_clear(ae);
+
+    return 0;
+}
+
 /*
  * This function calculates ct tag for two bams, it assumes they are from the same template and
- * writes the tag to the first read in position terms.
+ * writes the tag to the first read in position terms.  The tag changes are
+ * queued in ae1 and ae2.
  */
-static void bam_template_cigar(bam1_t *b1, bam1_t *b2, kstring_t *str)
+static int bam_template_cigar(bam1_t *b1, bam1_t *b2, kstring_t *str,
+                              aux_edit_t *ae1, aux_edit_t *ae2)
 {
+    aux_edit_t *ae_swap;
     bam1_t *swap;
     int i;
     hts_pos_t end;
     uint32_t *cigar;
     str->l = 0;
-    if (b1->core.tid != b2->core.tid || b1->core.tid < 0 || b1->core.pos < 0 || b2->core.pos < 0 || b1->core.flag&BAM_FUNMAP || b2->core.flag&BAM_FUNMAP) return; // coordinateless or not on the same chr; skip
-    if (b1->core.pos > b2->core.pos) swap = b1, b1 = b2, b2 = swap; // make sure b1 has a smaller coordinate
+    if (b1->core.tid != b2->core.tid || b1->core.tid < 0 || b1->core.pos < 0 || b2->core.pos < 0 || b1->core.flag&BAM_FUNMAP || b2->core.flag&BAM_FUNMAP) return 0; // coordinateless or not on the same chr; skip
+    if (b1->core.pos > b2->core.pos) swap = b1, b1 = b2, b2 = swap, ae_swap = ae1, ae1 = ae2, ae2 = ae_swap; // make sure b1 has a smaller coordinate
     kputc((b1->core.flag & BAM_FREAD1)? '1' : '2', str); // segment index
     kputc((b1->core.flag & BAM_FREVERSE)? 'R' : 'F', str); // strand
     for (i = 0, cigar = bam_get_cigar(b1); i < b1->core.n_cigar; ++i) {
@@ -70,11 +207,8 @@ static void bam_template_cigar(bam1_t *b1, bam1_t *b2, kstring_t *str)
         kputc(bam_cigar_opchr(cigar[i]), str);
     }
 
-    uint8_t* data;
-    if ((data = bam_aux_get(b1,"ct")) != NULL) bam_aux_del(b1, data);
-    if ((data = bam_aux_get(b2,"ct")) != NULL) bam_aux_del(b2, data);
-
-    bam_aux_append(b1, "ct", 'Z', str->l+1, (uint8_t*)str->s);
+    if (aux_edit_del(ae2, "ct") < 0) return -1;
+    return aux_edit_put(ae1, "ct", 'Z', str->l+1, (uint8_t*)str->s);
 }
 
 /*
@@ -180,46 +314,38 @@ static int bam_format_cigar(const bam1_t* b, kstring_t* str)
     return 0;
 }
 
+// Queues the MQ and MC tag changes for dest in ae, using str for the cigar.
 // Returns 0 on success, -1 on failure.
-static int sync_mq_mc(bam1_t* src, bam1_t* dest)
+static int sync_mq_mc(bam1_t* src, bam1_t* dest, aux_edit_t *ae,
+                      kstring_t *str)
 {
     if ( (src->core.flag & BAM_FUNMAP) == 0 ) { // If mapped
         // Copy Mate Mapping Quality
-        uint32_t mq = src->core.qual;
-        uint8_t* data;
-        if ((data = bam_aux_get(dest,"MQ")) != NULL) {
-            bam_aux_del(dest, data);
-        }
-
-        bam_aux_append(dest, "MQ", 'i', sizeof(uint32_t), (uint8_t*)&mq);
+        if (aux_edit_put_i(ae, "MQ", src->core.qual) < 0) return -1;
     }
     // Copy mate cigar if either read is mapped
     if ( (src->core.flag & BAM_FUNMAP) == 0 || (dest->core.flag & BAM_FUNMAP) == 0 ) {
-        uint8_t* data_mc;
-        if ((data_mc = bam_aux_get(dest,"MC")) != NULL) {
-            bam_aux_del(dest, data_mc);
-        }
-
         // Convert cigar to string
-        kstring_t mc = { 0, 0, NULL };
-        if (bam_format_cigar(src, &mc) < 0) return -1;
+        str->l = 0;
+        if (bam_format_cigar(src, str) < 0) return -1;
 
-        bam_aux_append(dest, "MC", 'Z', ks_len(&mc)+1, (uint8_t*)ks_str(&mc));
-        free(mc.s);
+        if (aux_edit_put(ae, "MC", 'Z', ks_len(str)+1,
+                         (uint8_t*)ks_str(str)) < 0) return -1;
     }
     return 0;
 }
 
-// Copy flags.
+// Copy flags.  Tag changes are queued in ae_a and ae_b.
 // Returns 0 on success, -1 on failure.
-static int sync_mate(bam1_t* a, bam1_t* b)
+static int sync_mate(bam1_t* a, bam1_t* b, aux_edit_t *ae_a, aux_edit_t *ae_b,
+                     kstring_t *str)
 {
     sync_unmapped_pos_inner(a,b);
     sync_unmapped_pos_inner(b,a);
     sync_mate_inner(a,b);
     sync_mate_inner(b,a);
-    if (sync_mq_mc(a,b) < 0) return -1;
-    if (sync_mq_mc(b,a) < 0) return -1;
+    if (sync_mq_mc(a,b,ae_b,str) < 0) return -1;
+    if (sync_mq_mc(b,a,ae_a,str) < 0) return -1;
     return 0;
 }
 
@@ -238,20 +364,10 @@ static uint32_t calc_mate_score(bam1_t *b)
 }
 
 
-static int add_mate_score(bam1_t *src, bam1_t *dest)
+// Queues the ms tag for dest in ae
+static int add_mate_score(bam1_t *src, aux_edit_t *ae)
 {
-    uint8_t *data_ms;
-    uint32_t mate_score = calc_mate_score(src);
-
-    if ((data_ms = bam_aux_get(dest, "ms")) != NULL) {
-        bam_aux_del(dest, data_ms);
-    }
-
-    if (bam_aux_append(dest, "ms", 'i', sizeof(uint32_t), (uint8_t*)&mate_score) == -1) {
-        return -1;
-    }
-
-    return 0;
+    return aux_edit_put_i(ae, "ms", calc_mate_score(src));
 }
 
 // Completely delete the CIGAR field
@@ -565,11 +681,27 @@ uint8_t *MN_enc(uint8_t *tag, uint32_t n) {
 }
 
 // Trim 5'/3' bases off MM and ML tags, using a previous sequence as a guide.
+// MN is set to the new sequence length in the same pass over the tags.
+// Returns 0 on success,
+//        -1 on failure
 int trim_MM(bam1_t *pre, bam1_t *cur, int end5, int end3,
-            uint8_t *MM, uint8_t *ML, uint8_t *MN) {
+            uint8_t *MM, uint8_t *ML) {
     // Count number of bases
     int counts5[16] = {0}, counts3[16] = {0};
 
+    // Trimming only shrinks MM and ML, but the new MN may be larger than
+    // any old one, so make room for it up front.
+    if (cur->l_data + 7 > cur->m_data) {
+        ptrdiff_t MM_off = MM - cur->data, ML_off = ML ? ML - cur->data : 0;
+        uint8_t *new_data = realloc(cur->data, cur->l_data + 7);
+        if (!new_data)
+            return -1;
+        cur->data = new_data;
+        cur->m_data = cur->l_data + 7;
+        MM = cur->data + MM_off;
+        if (ML) ML = cur->data + ML_off;
+    }
+
     uint8_t *seq = bam_get_seq(pre);
     int i;
     for (i = 0; i < end5; i++)
@@ -598,7 +730,7 @@ int trim_MM(bam1_t *pre, bam1_t *cur, int end5, int end3,
 
         // Now on comma separated list for MM and BC array for ML. Skip
         int n = 0;
-        while (*MMp != ';' && n < counts5[fundamental]) {
+        while (*MMp && *MMp != ';' && n < counts5[fundamental]) {
             char *endptr;
             long delta = strtol((char *)MMp, &endptr, 10);
             if (counts5[fundamental] - n > delta) {
@@ -631,7 +763,7 @@ int trim_MM(bam1_t *pre, bam1_t *cur, int end5, int end3,
         }
 
         // Copy
-        while (*MMp != ';' && n < counts3[fundamental]) {
+        while (*MMp && *MMp != ';' && n < counts3[fundamental]) {
             char *endptr;
             long delta = strtol((char *)MMp, &endptr, 10);
             if (counts3[fundamental] - n > delta) {
@@ -701,12 +833,10 @@ int trim_MM(bam1_t *pre, bam1_t *cur, int end5, int end3,
             tag = MLp;
         } else if (tag[0] == 'M' && tag[1] == 'N') {
             tag = bam_aux_next(cur, tag+2);
-            // Skip it as we'll overwrite this later, although this
-            // does change the tag order.  Instead we could do:
-            //
-            // *to++ = 'M';
-            // *to++ = 'N';
-            // to = MN_enc(to, cur->core.l_qseq);
+            tag = tag ? tag-2 : tag_end;
+            // Skip it as it's added at the end below.  This changes the
+            // tag order, but matches bam_aux_update_int() on a record
+            // without MN.
         } else {
             // Want aux_skip, but it's private.
             // So we use bam_aux_next with work-arounds. :(
@@ -717,6 +847,11 @@ int trim_MM(bam1_t *pre, bam1_t *cur, int end5, int end3,
             to += tag-from;
         }
     }
+    if (cur->core.l_qseq) {
+        *to++ = 'M';
+        *to++ = 'N';
+        to = MN_enc(to, cur->core.l_qseq);
+    }
     cur->l_data = to - cur->data;
 
     return 0;
@@ -729,6 +864,8 @@ int trim_MM(bam1_t *pre, bam1_t *cur, int end5, int end3,
 void delete_mod_tags(bam1_t *b) {
     uint8_t *tag = bam_aux_first(b), *next;
     uint8_t *to = tag;
+    if (!tag)
+        return; // no aux data; don't rewrite l_data from a NULL pointer
     while (tag) {
         next = bam_aux_next(b, tag);
         if (tag[-2] == 'M' &&
@@ -750,6 +887,29 @@ void delete_mod_tags(bam1_t *b) {
     b->l_data = (to-2) - b->data;
 }
 
+// Quietens htslib logging while any thread is validating base
+// modifications, restoring it when the last one finishes.  The log level
+// is global, so threads can't each save and restore it.  Single threaded
+// nothing else can be logging, so it is turned off.  With a thread pool
+// other threads may be reading or writing at the same time, so only
+// messages below error level are dropped and their errors still show.
+static pthread_mutex_t quiet_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum htsLogLevel quiet_level = HTS_LOG_OFF;
+static void quiet_logs(int inc) {
+    static int nquiet = 0;
+    static enum htsLogLevel lvl;
+
+    pthread_mutex_lock(&quiet_lock);
+    if (inc > 0 && nquiet++ == 0) {
+        lvl = hts_get_log_level();
+        if (lvl > quiet_level)
+            hts_set_log_level(quiet_level);
+    } else if (inc < 0 && --nquiet == 0) {
+        hts_set_log_level(lvl);
+    }
+    pthread_mutex_unlock(&quiet_lock);
+}
+
 int validate_MM(bam1_t *b, hts_base_mod_state *state) {
     hts_base_mod mods[10];
     int n, pos;
@@ -775,9 +935,12 @@ int validate_MM(bam1_t *b, hts_base_mod_state *state) {
 // TODO: add sanity check on counts of base types and MM tag to ensure it's
 // possible. We can do this post-trimming, so we sanitize everything.
 //
+// A new MN tag for a primary read is queued in ae, if given, to be added
+// along with the mate tags.
+//
 // Returns 0 on success,
 //        -1 on failure
-int fix_MM(bam1_t *pre, bam1_t *cur, MM_state *state) {
+int fix_MM(bam1_t *pre, bam1_t *cur, MM_state *state, aux_edit_t *ae) {
     int end5, end3;
     int MNi = 0; // MN of -1 is used as indicator for no valid mods
 
@@ -793,9 +956,17 @@ int fix_MM(bam1_t *pre, bam1_t *cur, MM_state *state) {
 
         if (!end5 && !end3 && MNi <= 0) {
             // No MN tag, but also no clipping.  Assume MM is valid
-            if (cur->core.l_qseq)
-                if (bam_aux_update_int(cur, "MN", cur->core.l_qseq) < 0)
+            if (cur->core.l_qseq) {
+                if (!state->MN && ae) {
+                    uint8_t MN[5], *MN_end = MN_enc(MN, cur->core.l_qseq);
+                    if (aux_edit_put(ae, "MN", MN[0], MN_end - (MN+1),
+                                     MN+1) < 0)
+                        return -1;
+                } else if (bam_aux_update_int(cur, "MN",
+                                              cur->core.l_qseq) < 0) {
                     return -1;
+                }
+            }
         } else if ((end3 || end5) && cur->core.l_qseq != MNi) {
             // We have hard clips and MN tag, but the MN tag doesn't match
             // observed sequence length so it appears the hard-clipping
@@ -824,9 +995,11 @@ int fix_MM(bam1_t *pre, bam1_t *cur, MM_state *state) {
         if (pre->core.l_qseq != cur->core.l_qseq + end3 + end5) {
             delete_mod_tags(cur);
             return 0;
-        } else if (end5 || end3) {
-             if (MNi < 0 || MNi == pre->core.l_qseq)
-                 trim_MM(pre, cur, end5, end3, cur_MM, cur_ML, cur_MN);
+        } else if ((end5 || end3) && (MNi < 0 || MNi == pre->core.l_qseq)) {
+            // This sets MN too
+            if (trim_MM(pre, cur, end5, end3, cur_MM, cur_ML) < 0)
+                return -1;
+            goto validate;
         } // else no hard clips so MM is already valid
 
         // Set MN so we've validated it, provided seq isn't "*".
@@ -847,16 +1020,19 @@ int fix_MM(bam1_t *pre, bam1_t *cur, MM_state *state) {
     if (!mst)
         return -1;
 
-    enum htsLogLevel lvl = hts_get_log_level();
-    hts_set_log_level(HTS_LOG_OFF);
-    if (bam_parse_basemod(cur, mst) < 0)
-        // Maybe we want hts_log_warning still though?
-        delete_mod_tags(cur);
-    if (validate_MM(cur, mst) < 0)
-        delete_mod_tags(cur);
-    hts_set_log_level(lvl);
+    quiet_logs(1);
+    // Maybe we want hts_log_warning still though?
+    int bad = bam_parse_basemod(cur, mst) < 0 || validate_MM(cur, mst) < 0;
+    quiet_logs(-1);
     hts_base_mod_state_free(mst);
 
+    if (bad) {
+        delete_mod_tags(cur);
+        // Including any MN still to be added
+        if (ae && aux_edit_del(ae, "MN") < 0)
+            return -1;
+    }
+
     return 0;
 }
 
@@ -883,6 +1059,10 @@ static int grow_b_array(bam1_t **b, int *ba, int n) {
     return 0;
 }
 
+static int file_read(void *fp, sam_hdr_t *h, bam1_t *b) {
+    return sam_read1((samFile *)fp, h, b);
+}
+
 // We have b[0]..b[bn-1] entries all from the same template (qname)
 typedef struct {
     bam1_t *b;
@@ -896,8 +1076,8 @@ typedef struct {
 // start the next batch.
 // Returns the number of records on success,
 //         <0 on failure or EOF (sam_read1 return vals)
-static int next_template(samFile *in, sam_hdr_t *header, bam_set *bs,
-                         int sanitize_flags) {
+static int next_template(const sam_rec_src *in, sam_hdr_t *header,
+                         bam_set *bs, int sanitize_flags) {
     int result;
 
     if (bs->eof)
@@ -907,7 +1087,7 @@ static int next_template(samFile *in, sam_hdr_t *header, bam_set *bs,
     if (bs->b_next < 0) {
         if (grow_b_array(&bs->b, &bs->ba, 1) < 0)
             return -2;
-        result = sam_read1(in, header, &bs->b[0]);
+        result = in->read(in->data, header, &bs->b[0]);
         if (result < 0)
             return result;
         if (bam_sanitize(header, &bs->b[0], sanitize_flags) < 0)
@@ -926,7 +1106,7 @@ static int next_template(samFile *in, sam_hdr_t *header, bam_set *bs,
         if (grow_b_array(&bs->b, &bs->ba, bs->n+1) < 0)
             return -2;
 
-        result = sam_read1(in, header, &bs->b[bs->n]);
+        result = in->read(in->data, header, &bs->b[bs->n]);
         if (result < -1)
             return result;
 
@@ -949,18 +1129,346 @@ static int next_template(samFile *in, sam_hdr_t *header, bam_set *bs,
     return bs->n;
 }
 
+typedef struct {
+    int remove_reads, proper_pair_check, add_ct, do_mate_scoring, base_mods;
+} fixmate_opts_t;
+
+// Fixes up the nb records in b[], which all belong to the same template.
+// Returns 0 on success,
+//        -1 on failure
+static int fix_template(bam1_t *b, int nb, const fixmate_opts_t *opt,
+                        fix_buf_t *fb)
+{
+    int n;
+    bam1_t *cur = NULL, *pre = NULL, *rnum[2] = {NULL, NULL};
+    int prev = -1, curr = -1;
+    hts_pos_t pre_end = 0, cur_end = 0;
+    // Tag changes for pre and cur, made once per pair
+    aux_edit_t *ae_pre = &fb->ae[0], *ae_cur = &fb->ae[1];
+
+    aux_edit_clear(ae_pre);
+    aux_edit_clear(ae_cur);
+
+    // Find and fix up primary alignments
+    MM_state state[2];
+    for (n = 0; n < nb; n++) {
+        int is_r2 = (b[n].core.flag & BAM_FREAD2) != 0;
+        if (b[n].core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))
+            continue;
+
+        if (opt->base_mods)
+            if (fix_MM(NULL, &b[n], &state[is_r2], pre ? ae_cur : ae_pre) < 0)
+                return -1;
+
+        if (!pre) {
+            pre = &b[prev = n];
+            rnum[(pre->core.flag & BAM_FREAD2) != 0] = pre;
+
+            pre_end = (pre->core.flag & BAM_FUNMAP) == 0
+                ? bam_endpos(pre) : 0;
+            continue;
+        }
+
+        // Note, more than 2 primary alignments will use 'curr' as last
+        cur = &b[curr = n];
+        rnum[(cur->core.flag & BAM_FREAD2) != 0] = cur;
+        cur_end = (cur->core.flag & BAM_FUNMAP) == 0
+            ? bam_endpos(cur) : 0;
+
+        pre->core.flag |= BAM_FPAIRED;
+        cur->core.flag |= BAM_FPAIRED;
+        if (sync_mate(pre, cur, ae_pre, ae_cur, &fb->str))
+            return -1;
+
+        // If safe set TLEN/ISIZE
+        if (pre->core.tid == cur->core.tid
+            && !(cur->core.flag & (BAM_FUNMAP | BAM_FMUNMAP))
+            && !(pre->core.flag & (BAM_FUNMAP | BAM_FMUNMAP))) {
+            hts_pos_t cur5, pre5;
+            cur5 = (cur->core.flag & BAM_FREVERSE)
+                ? cur_end
+                : cur->core.pos;
+            pre5 = (pre->core.flag & BAM_FREVERSE)
+                ? pre_end
+                : pre->core.pos;
+            cur->core.isize = pre5 - cur5;
+            pre->core.isize = cur5 - pre5;
+        } else {
+            cur->core.isize = pre->core.isize = 0;
+        }
+
+        if (opt->add_ct && bam_template_cigar(pre, cur, &fb->str,
+                                              ae_pre, ae_cur) < 0)
+            return -1;
+
+        // TODO: Add code to properly check if read is in a proper
+        // pair based on ISIZE distribution
+        if (opt->proper_pair_check && !plausibly_properly_paired(pre,cur)) {
+            pre->core.flag &= ~BAM_FPROPER_PAIR;
+            cur->core.flag &= ~BAM_FPROPER_PAIR;
+        }
+
+        if (opt->do_mate_scoring) {
+            if ((add_mate_score(pre, ae_cur) == -1) ||
+                (add_mate_score(cur, ae_pre) == -1)) {
+                fprintf(stderr, "[bam_mating_core] ERROR: "
+                        "unable to add mate score.\n");
+                return -1;
+            }
+        }
+
+        // If we have to remove reads make sure we do it in a way that
+        // doesn't create orphans with bad flags
+        if (opt->remove_reads) {
+            if (pre->core.flag&BAM_FUNMAP)
+                cur->core.flag &=
+                    ~(BAM_FMREVERSE|BAM_FPROPER_PAIR);
+            if (cur->core.flag&BAM_FUNMAP)
+                pre->core.flag &=
+                    ~(BAM_FMREVERSE|BAM_FPROPER_PAIR);
+        }
+
+        if (aux_edit_apply(pre, ae_pre) < 0 || aux_edit_apply(cur, ae_cur) < 0)
+            return -1;
+    }
+
+    // Handle unpaired primary data
+    if (pre && aux_edit_apply(pre, ae_pre) < 0)
+        return -1;
+    if (!cur && pre) {
+        pre->core.mtid = -1;
+        pre->core.mpos = -1;
+        pre->core.isize = 0;
+        pre->core.flag &= ~(BAM_FMREVERSE|BAM_FPROPER_PAIR);
+    }
+
+    // Now process secondary and supplementary alignments
+    for (n = 0; n < nb; n++) {
+        if (!(b[n].core.flag & (BAM_FSECONDARY|BAM_FSUPPLEMENTARY))) {
+            // primary
+            continue;
+        }
+
+        // Secondary or supplementary
+        int is_r2 = (b[n].core.flag & BAM_FREAD2) != 0;
+        bam1_t *primary = rnum[is_r2];
+        if (primary) {
+            if (opt->base_mods)
+                fix_MM(primary, &b[n], &state[is_r2], NULL);
+        } else {
+            // Record with base modifications but no known primary
+            //fprintf(stderr, "Unpaired secondary or supplementary\n");
+            if (opt->base_mods)
+                fix_MM(NULL, &b[n], NULL, NULL);
+        }
+    }
+
+    return 0;
+}
+
+// Writes out the nb records of a template in their original order, less
+// any we're removing.
+// Returns 0 on success,
+//        -1 on failure
+static int write_template(samFile *out, sam_hdr_t *header, bam1_t *b, int nb,
+                          const fixmate_opts_t *opt)
+{
+    int n;
+    for (n = 0; n < nb; n++) {
+        bam1_t *cur = &b[n];
+        // We may remove unmapped and secondary alignments
+        if (opt->remove_reads && (cur->core.flag & (BAM_FSECONDARY|BAM_FUNMAP)))
+            continue;
+
+        if (sam_write1(out, header, cur) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Fixing templates on several threads.  Whole templates are read into
+// batches, which the thread pool sanitizes and fixes, and the results are
+// written out in dispatch order so the output order is unchanged.
+#define FIXMATE_BATCH_SIZE 1024
+
+typedef struct {
+    bam1_t *b;          // records, templates stored consecutively
+    int nb, ba;
+    int *tmpl;          // start of each template in b[], plus an end marker
+    int ntmpl, mtmpl;
+    sam_hdr_t *header;
+    const fixmate_opts_t *opt;
+    int sanitize_flags;
+    fix_buf_t fb;
+    int ret;            // 0 on success, -1 fix failure, -2 sanitize failure
+} fixmate_batch_t;
+
+static void *fix_batch(void *arg) {
+    fixmate_batch_t *bt = (fixmate_batch_t *)arg;
+    int i;
+
+    bt->ret = 0;
+    for (i = 0; i < bt->nb; i++)
+        if (bam_sanitize(bt->header, &bt->b[i], bt->sanitize_flags) < 0) {
+            bt->ret = -2;
+            return bt;
+        }
+    for (i = 0; i < bt->ntmpl; i++)
+        if (fix_template(&bt->b[bt->tmpl[i]], bt->tmpl[i+1] - bt->tmpl[i],
+                         bt->opt, &bt->fb) < 0) {
+            bt->ret = -1;
+            break;
+        }
+
+    return bt;
+}
+
+// Fills bt with at least FIXMATE_BATCH_SIZE records, ending on a template
+// boundary.  The first record of the following template is kept in *next.
+// Returns the number of records read (0 at EOF), or <0 on failure.
+static int read_batch(samFile *in, sam_hdr_t *header, fixmate_batch_t *bt,
+                      bam1_t *next, int *have_next) {
+    int r;
+
+    bt->nb = bt->ntmpl = 0;
+    for (;;) {
+        if (grow_b_array(&bt->b, &bt->ba, bt->nb + 1) < 0)
+            return -2;
+        bam1_t *b = &bt->b[bt->nb], tmp;
+        if (*have_next) {
+            tmp = *b; *b = *next; *next = tmp;
+            *have_next = 0;
+        } else if ((r = sam_read1(in, header, b)) < 0) {
+            if (r < -1)
+                return r;
+            break;
+        }
+
+        // Templates are found by read name, which sanitizing doesn't
+        // change, so that is left to the threads.
+        if (bt->nb == 0
+            || strcmp(bam_get_qname(b), bam_get_qname(b - 1)) != 0) {
+            if (bt->nb >= FIXMATE_BATCH_SIZE) {
+                tmp = *b; *b = *next; *next = tmp;
+                *have_next = 1;
+                break;
+            }
+            if (bt->ntmpl + 2 > bt->mtmpl) {
+                int m = bt->mtmpl ? bt->mtmpl * 2 : 256;
+                int *t = realloc(bt->tmpl, m * sizeof(*t));
+                if (!t)
+                    return -2;
+                bt->tmpl = t;
+                bt->mtmpl = m;
+            }
+            bt->tmpl[bt->ntmpl++] = bt->nb;
+        }
+        bt->nb++;
+    }
+    if (bt->ntmpl)
+        bt->tmpl[bt->ntmpl] = bt->nb;
+
+    return bt->nb;
+}
+
+// Returns 0 on success,
+//        -1 on failure,
+//        -2 on read failure,
+//        -3 on write failure
+static int fixmate_threaded(samFile *in, samFile *out, sam_hdr_t *header,
+                            const fixmate_opts_t *opt, int sanitize_flags,
+                            hts_tpool *pool) {
+    int nbatch = 2 * hts_tpool_size(pool), next = 0, in_flight = 0;
+    int r = 1, ret = 0, have_next = 0, i, j;
+    fixmate_batch_t *batch = calloc(nbatch, sizeof(*batch));
+    hts_tpool_process *q = NULL;
+    bam1_t next_b;
+
+    memset(&next_b, 0, sizeof(next_b));
+    if (!batch)
+        goto nomem;
+    for (i = 0; i < nbatch; i++) {
+        batch[i].header = header;
+        batch[i].opt = opt;
+        batch[i].sanitize_flags = sanitize_flags;
+    }
+
+    // The ring of batches is no larger than the queue, so dispatching
+    // never waits on results we have yet to collect.
+    if (!(q = hts_tpool_process_init(pool, nbatch, 0)))
+        goto nomem;
+
+    for (;;) {
+        while (r > 0 && ret == 0 && in_flight < nbatch) {
+            fixmate_batch_t *bt = &batch[next];
+            if ((r = read_batch(in, header, bt, &next_b, &have_next)) < 0) {
+                ret = -2;
+                break;
+            }
+            if (!r)
+                break;
+            if (hts_tpool_dispatch(pool, q, fix_batch, bt) < 0) {
+                ret = -1;
+                break;
+            }
+            next = (next + 1) % nbatch;
+            in_flight++;
+        }
+        if (!in_flight)
+            break;
+
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        if (!res) {
+            ret = -1;
+            break;
+        }
+        fixmate_batch_t *bt = (fixmate_batch_t *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+
+        // After an error the remaining batches are only collected
+        if (ret == 0 && bt->ret < 0)
+            ret = bt->ret;
+        for (i = 0; i < bt->ntmpl && ret == 0; i++)
+            if (write_template(out, header, &bt->b[bt->tmpl[i]],
+                               bt->tmpl[i+1] - bt->tmpl[i], opt) < 0)
+                ret = -3;
+    }
+
+ out:
+    if (q)
+        hts_tpool_process_destroy(q);
+    if (batch) {
+        for (i = 0; i < nbatch; i++) {
+            for (j = 0; j < batch[i].ba; j++)
+                free(batch[i].b[j].data);
+            free(batch[i].b);
+            free(batch[i].tmpl);
+            fix_buf_free(&batch[i].fb);
+        }
+        free(batch);
+    }
+    free(next_b.data);
+    return ret;
+
+ nomem:
+    print_error_errno("fixmate", "could not set up the fixing threads");
+    ret = -1;
+    goto out;
+}
+
 // currently, this function ONLY works if each read has one hit
 //
 // Returns 0 on success,
 //        >0 on failure
-static int bam_mating_core(samFile *in, samFile *out, int remove_reads,
-                           int proper_pair_check, int add_ct,
-                           int do_mate_scoring, char *arg_list, int no_pg,
-                           int sanitize_flags, int base_mods)
+static int bam_mating_core(samFile *in, samFile *out,
+                           const fixmate_opts_t *opt, char *arg_list, int no_pg,
+                           int sanitize_flags, hts_tpool *pool)
 {
     sam_hdr_t *header;
     int result, n;
     kstring_t str = KS_INITIALIZE;
+    fix_buf_t fb = { KS_INITIALIZE };
     bam_set bs = {NULL, 0, 0, -1, 0};
 
     header = sam_hdr_read(in);
@@ -985,129 +1493,25 @@ static int bam_mating_core(samFile *in, samFile *out, int remove_reads,
 
     if (sam_hdr_write(out, header) < 0) goto write_fail;
 
-    // Iterate template by template fetching bs->n records at a time
-    while ((result = next_template(in, header, &bs, sanitize_flags)) >= 0) {
-        bam1_t *cur = NULL, *pre = NULL, *rnum[2] = {NULL, NULL};
-        int prev = -1, curr = -1;
-        hts_pos_t pre_end = 0, cur_end = 0;
-
-        // Find and fix up primary alignments
-        MM_state state[2];
-        for (n = 0; n < bs.n; n++) {
-            int is_r2 = (bs.b[n].core.flag & BAM_FREAD2) != 0;
-            if (bs.b[n].core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))
-                continue;
-
-            if (base_mods)
-                if (fix_MM(NULL, &bs.b[n], &state[is_r2]) < 0)
-                    goto fail;
-
-            if (!pre) {
-                pre = &bs.b[prev = n];
-                rnum[(pre->core.flag & BAM_FREAD2) != 0] = pre;
-
-                pre_end = (pre->core.flag & BAM_FUNMAP) == 0
-                    ? bam_endpos(pre) : 0;
-                continue;
-            }
-
-            // Note, more than 2 primary alignments will use 'curr' as last
-            cur = &bs.b[curr = n];
-            rnum[(cur->core.flag & BAM_FREAD2) != 0] = cur;
-            cur_end = (cur->core.flag & BAM_FUNMAP) == 0
-                ? bam_endpos(cur) : 0;
+    if (pool) {
+        result = fixmate_threaded(in, out, header, opt, sanitize_flags, pool);
+        if (result == -2)
+            goto read_fail;
+        if (result == -3)
+            goto write_fail;
+        if (result < 0)
+            goto fail;
+    } else {
+        sam_rec_src src = { file_read, in };
 
-            pre->core.flag |= BAM_FPAIRED;
-            cur->core.flag |= BAM_FPAIRED;
-            if (sync_mate(pre, cur))
+        // Iterate template by template fetching bs->n records at a time
+        while ((result = next_template(&src, header, &bs, sanitize_flags)) >= 0) {
+            if (fix_template(bs.b, bs.n, opt, &fb) < 0)
                 goto fail;
 
-            // If safe set TLEN/ISIZE
-            if (pre->core.tid == cur->core.tid
-                && !(cur->core.flag & (BAM_FUNMAP | BAM_FMUNMAP))
-                && !(pre->core.flag & (BAM_FUNMAP | BAM_FMUNMAP))) {
-                hts_pos_t cur5, pre5;
-                cur5 = (cur->core.flag & BAM_FREVERSE)
-                    ? cur_end
-                    : cur->core.pos;
-                pre5 = (pre->core.flag & BAM_FREVERSE)
-                    ? pre_end
-                    : pre->core.pos;
-                cur->core.isize = pre5 - cur5;
-                pre->core.isize = cur5 - pre5;
-            } else {
-                cur->core.isize = pre->core.isize = 0;
-            }
-
-            if (add_ct)
-                bam_template_cigar(pre, cur, &str);
-
-            // TODO: Add code to properly check if read is in a proper
-            // pair based on ISIZE distribution
-            if (proper_pair_check && !plausibly_properly_paired(pre,cur)) {
-                pre->core.flag &= ~BAM_FPROPER_PAIR;
-                cur->core.flag &= ~BAM_FPROPER_PAIR;
-            }
-
-            if (do_mate_scoring) {
-                if ((add_mate_score(pre, cur) == -1) ||
-                    (add_mate_score(cur, pre) == -1)) {
-                    fprintf(stderr, "[bam_mating_core] ERROR: "
-                            "unable to add mate score.\n");
-                    goto fail;
-                }
-            }
-
-            // If we have to remove reads make sure we do it in a way that
-            // doesn't create orphans with bad flags
-            if (remove_reads) {
-                if (pre->core.flag&BAM_FUNMAP)
-                    cur->core.flag &=
-                        ~(BAM_FMREVERSE|BAM_FPROPER_PAIR);
-                if (cur->core.flag&BAM_FUNMAP)
-                    pre->core.flag &=
-                        ~(BAM_FMREVERSE|BAM_FPROPER_PAIR);
-            }
-        }
-
-        // Handle unpaired primary data
-        if (!cur && pre) {
-            pre->core.mtid = -1;
-            pre->core.mpos = -1;
-            pre->core.isize = 0;
-            pre->core.flag &= ~(BAM_FMREVERSE|BAM_FPROPER_PAIR);
-        }
-
-        // Now process secondary and supplementary alignments
-        for (n = 0; n < bs.n; n++) {
-            if (!(bs.b[n].core.flag & (BAM_FSECONDARY|BAM_FSUPPLEMENTARY))) {
-                // primary
-                continue;
-            }
-
-            // Secondary or supplementary
-            int is_r2 = (bs.b[n].core.flag & BAM_FREAD2) != 0;
-            bam1_t *primary = rnum[is_r2];
-            if (primary) {
-                if (base_mods)
-                    fix_MM(primary, &bs.b[n], &state[is_r2]);
-            } else {
-                // Record with base modifications but no known primary
-                //fprintf(stderr, "Unpaired secondary or supplementary\n");
-                if (base_mods)
-                    fix_MM(NULL, &bs.b[n], NULL);
-            }
-        }
-
-        // Finally having curated everything, write out all records in their
-        // original ordering
-        for (n = 0; n < bs.n; n++) {
-            bam1_t *cur = &bs.b[n];
-            // We may remove unmapped and secondary alignments
-            if (remove_reads && (cur->core.flag & (BAM_FSECONDARY|BAM_FUNMAP)))
-                continue;
-
-            if (sam_write1(out, header, cur) < 0)
+            // Finally having curated everything, write out all records in
+            // their original ordering
+            if (write_template(out, header, bs.b, bs.n, opt) < 0)
                 goto write_fail;
         }
     }
@@ -1119,7 +1523,7 @@ static int bam_mating_core(samFile *in, samFile *out, int remove_reads,
     for (n = 0; n < bs.ba; n++)
         free(bs.b[n].data);
     free(bs.b);
-    ks_free(&str);
+    fix_buf_free(&fb);
     return 0;
 
  read_fail:
@@ -1134,9 +1538,116 @@ static int bam_mating_core(samFile *in, samFile *out, int remove_reads,
         free(bs.b[n].data);
     free(bs.b);
     ks_free(&str);
+    fix_buf_free(&fb);
     return 1;
 }
 
+/*
+ * "fixmate --collate-sort" runs collate, fixmate and a coordinate sort in
+ * one process.  Each template from collate is fixed here and handed on to
+ * the sort one record at a time, so the records are never encoded between
+ * the stages.
+ */
+typedef struct {
+    sam_rec_src in;     // collated records
+    const fixmate_opts_t *opt;
+    int sanitize_flags;
+    bam_set bs;
+    int i;              // next record of bs to hand on
+    fix_buf_t fb;
+} fixmate_src_t;
+
+static int fixmate_src_read(void *data, sam_hdr_t *h, bam1_t *b) {
+    fixmate_src_t *fs = (fixmate_src_t *)data;
+    bam1_t tmp;
+    int r;
+
+    for (;;) {
+        while (fs->i < fs->bs.n) {
+            bam1_t *cur = &fs->bs.b[fs->i++];
+            // We may remove unmapped and secondary alignments
+            if (fs->opt->remove_reads
+                && (cur->core.flag & (BAM_FSECONDARY|BAM_FUNMAP)))
+                continue;
+
+            // Swap rather than copy; cur is overwritten by the next read
+            tmp = *b;
+            *b = *cur;
+            *cur = tmp;
+            return b->l_data;
+        }
+
+        fs->i = fs->bs.n = 0;
+        if ((r = next_template(&fs->in, h, &fs->bs, fs->sanitize_flags)) < 0) {
+            if (r < -1)
+                print_error("fixmate", "Couldn't read from input file");
+            return r;
+        }
+        if (fix_template(fs->bs.b, fs->bs.n, fs->opt, &fs->fb) < 0)
+            return -2;
+    }
+}
+
+static int fixmate_collate_sort(const char *fn, const char *fnout,
+                                const char *modeout,
+                                const fixmate_opts_t *opt, int sanitize_flags,
+                                const char *tmp_prefix, size_t max_mem,
+                                sam_global_args *ga, htsThreadPool *p,
+                                char *arg_list, int no_pg)
+{
+    kstring_t prefix = KS_INITIALIZE, collate_prefix = KS_INITIALIZE;
+    collate_reader *cr = NULL;
+    fixmate_src_t fs;
+    sam_rec_src src = { fixmate_src_read, &fs };
+    struct stat st;
+    int ret = 1, n;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.opt = opt;
+    fs.sanitize_flags = sanitize_flags;
+    fs.bs.b_next = -1;
+
+    // Temporary files are named as by "samtools sort"
+    if (tmp_prefix) {
+        kputs(tmp_prefix, &prefix);
+    } else if (strcmp(fnout, "-") != 0) {
+        char *idx = strstr(fnout, HTS_IDX_DELIM);
+        kputsn(fnout, idx ? idx - fnout : strlen(fnout), &prefix);
+        kputs(".tmp", &prefix);
+    } else {
+        kputc('.', &prefix);
+    }
+    if (stat(prefix.s, &st) == 0 && S_ISDIR(st.st_mode)) {
+        unsigned t = ((unsigned) time(NULL)) ^ ((unsigned) clock());
+        if (prefix.s[prefix.l-1] != '/') kputc('/', &prefix);
+        ksprintf(&prefix, "samtools.%d.%u.tmp", (int) getpid(), t % 10000);
+    }
+    if (ksprintf(&collate_prefix, "%s.collate", prefix.s) < 0) {
+        print_error_errno("fixmate", "Out of memory");
+        goto out;
+    }
+
+    if (!(cr = collate_reader_open(fn, &ga->in, collate_prefix.s, max_mem, p)))
+        goto out;
+    fs.in.read = collate_reader_read;
+    fs.in.data = cr;
+
+    if (bam_sort_records(&src, collate_reader_header(cr), prefix.s, fnout,
+                         modeout, max_mem, ga->nthreads, &ga->in, &ga->out,
+                         arg_list, no_pg, ga->write_index) == 0)
+        ret = 0;
+
+ out:
+    collate_reader_close(cr);
+    for (n = 0; n < fs.bs.ba; n++)
+        free(fs.bs.b[n].data);
+    free(fs.bs.b);
+    fix_buf_free(&fs.fb);
+    ks_free(&prefix);
+    ks_free(&collate_prefix);
+    return ret;
+}
+
 void usage(FILE* where)
 {
     fprintf(where,
@@ -1150,7 +1661,13 @@ void usage(FILE* where)
 "  -z, --sanitize FLAG[,FLAG]\n"
 "               Sanitize alignment fields [defaults to all types]\n"
 "  -M           Fix base modification tags (MM/ML/MN)\n"
-"  --no-PG      do not add a PG line\n");
+"  --no-PG      do not add a PG line\n"
+"  --collate-sort\n"
+"               Collate the input first, and sort the output by coordinate\n"
+"  --sort-mem INT\n"
+"               Memory for each of the collate and sort stages [768M]\n"
+"  --tmp-prefix STR\n"
+"               Write temporary files to STR.nnnn.bam\n");
 
     sam_global_opt_help(where, "-.O..@-.");
 
@@ -1158,7 +1675,7 @@ void usage(FILE* where)
 "\n"
 "As elsewhere in samtools, use '-' as the filename for stdin/stdout. The input\n"
 "file must be grouped by read name (e.g. sorted by name). Coordinated sorted\n"
-"input is not accepted.\n");
+"input is not accepted, unless --collate-sort is used.\n");
 }
 
 int bam_mating(int argc, char *argv[])
@@ -1166,12 +1683,18 @@ int bam_mating(int argc, char *argv[])
     htsThreadPool p = {NULL, 0};
     samFile *in = NULL, *out = NULL;
     int c, remove_reads = 0, proper_pair_check = 1, add_ct = 0, res = 1,
-        mate_score = 0, no_pg = 0, sanitize_flags = FIX_ALL, base_mods = 0;
+        mate_score = 0, no_pg = 0, sanitize_flags = FIX_ALL, base_mods = 0,
+        collate_sort = 0;
+    size_t max_mem = 768 << 20;
+    const char *tmp_prefix = NULL;
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     char wmode[4] = {'w', 'b', 0, 0};
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@', '-', '-'),
         {"no-PG", no_argument, NULL, 1},
+        {"collate-sort", no_argument, NULL, 2},
+        {"sort-mem", required_argument, NULL, 3},
+        {"tmp-prefix", required_argument, NULL, 4},
         { NULL, 0, NULL, 0 }
     };
     char *arg_list = NULL;
@@ -1187,6 +1710,18 @@ int bam_mating(int argc, char *argv[])
         case 'M': base_mods = 1; break;
         case 'u': wmode[2] = '0'; break;
         case 1: no_pg = 1; break;
+        case 2: collate_sort = 1; break;
+        case 3:
+            if (parse_mem_size(optarg, &max_mem) < 0) {
+                print_error("fixmate", "invalid --sort-mem value \"%s\"", optarg);
+                goto fail;
+            }
+            if (max_mem < (1 << 20)) {
+                print_error("fixmate", "--sort-mem must be at least 1M");
+                goto fail;
+            }
+            break;
+        case 4: tmp_prefix = optarg; break;
         default:  if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
             /* else fall-through */
         case '?': usage(stderr); goto fail;
@@ -1201,6 +1736,25 @@ int bam_mating(int argc, char *argv[])
     if (!no_pg && !(arg_list =  stringify_argv(argc+1, argv-1)))
         goto fail;
 
+    fixmate_opts_t opt = { remove_reads, proper_pair_check, add_ct,
+                           mate_score, base_mods };
+    if (ga.nthreads > 0)
+        quiet_level = HTS_LOG_ERROR;
+    if (collate_sort) {
+        sam_open_mode(wmode+1, argv[optind+1], NULL);
+        if (ga.nthreads > 0 && !(p.pool = hts_tpool_init(ga.nthreads))) {
+            fprintf(stderr, "Error creating thread pool\n");
+            goto fail;
+        }
+        res = fixmate_collate_sort(argv[optind], argv[optind+1], wmode, &opt,
+                                   sanitize_flags, tmp_prefix, max_mem, &ga,
+                                   &p, arg_list, no_pg);
+        if (p.pool) hts_tpool_destroy(p.pool);
+        free(arg_list);
+        sam_global_args_free(&ga);
+        return res;
+    }
+
     // init
     if ((in = sam_open_format(argv[optind], "rb", &ga.in)) == NULL) {
         print_error_errno("fixmate", "cannot open input file");
@@ -1222,9 +1776,8 @@ int bam_mating(int argc, char *argv[])
     }
 
     // run
-    res = bam_mating_core(in, out, remove_reads, proper_pair_check, add_ct,
-                          mate_score, arg_list, no_pg, sanitize_flags,
-                          base_mods);
+    res = bam_mating_core(in, out, &opt, arg_list, no_pg, sanitize_flags,
+                          p.pool);
 
     // cleanup
     sam_close(in);
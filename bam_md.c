@@ -30,6 +30,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stdint.h>
 #include <errno.h>
 #include <assert.h>
 #include "htslib/faidx.h"
@@ -38,6 +39,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/thread_pool.h"
 #include "sam_opts.h"
 #include "samtools.h"
+#include "ref_cache.h"
 
 #define USE_EQUAL 1
 #define DROP_TAG  2
@@ -46,18 +48,17 @@ DEALINGS IN THE SOFTWARE.  */
 #define UPDATE_MD 16
 #define HASH_QNM  32
 
-typedef struct cached_ref_entry {
-    char *ref;
-    hts_pos_t len;
-} cached_ref_entry;
+#define CALMD_BATCH_SIZE 1024 // records per batch when using threads
 
-typedef struct ref_cache {
-    cached_ref_entry *refs;
-    char *last_ref;
-    hts_pos_t last_len;
-    int nref;
+typedef struct md_refs {
+    ref_cache_t *rc;
+    const char *last_name;  // held from rc, if set
     int last_tid;
-} ref_cache;
+} md_refs;
+
+typedef struct md_conf {
+    int flt_flag, max_nm, is_realn, capQ, baq_flag, quiet_mode;
+} md_conf;
 
 int bam_aux_drop_other(bam1_t *b, uint8_t *s);
 
@@ -231,10 +232,10 @@ int bam_fillmd1(bam1_t *b, char *ref, int flag, int quiet_mode)
 // Get a new reference sequence.
 // For position-sorted inputs, the previous reference should never be
 // needed again and can be discarded to save memory.  For other orderings,
-// references are stored in a cache in case they're required in the future.
+// references are kept in the cache in case they're required in the future.
 // The caching mode is turned on if the requested  tid is less than the last
 // one used, indicating the file ordering doesn't match the sequence dictionary.
-static int get_ref(faidx_t *fai, sam_hdr_t *header, ref_cache *cache,
+static int get_ref(md_refs *cache, sam_hdr_t *header,
                    int tid, char **ref_out, const char **ref_name_out,
                    hts_pos_t *len_out)
 {
@@ -249,19 +250,9 @@ static int get_ref(faidx_t *fai, sam_hdr_t *header, ref_cache *cache,
     ref_name = sam_hdr_tid2name(header, tid);
     *ref_name_out = ref_name;
 
-    // Return a cached entry, if available
-    if (cache->refs && tid >= 0 && tid < cache->nref
-        && cache->refs[tid].ref) {
-        assert(cache->last_ref == NULL);
-        *ref_out = cache->refs[tid].ref;
-        *len_out = cache->refs[tid].len;
-        cache->last_tid = tid;
-        return 0;
-    }
-
-    // Try to get the reference
+    // Try to get the reference, cached if seen before in caching mode
     if (ref_name)
-        ref = fai_fetch64(fai, ref_name, &len);
+        ref = ref_cache_get(cache->rc, ref_name, &len);
 
     if (!ref) {
         // Historically, calmd doesn't worry too much about missing refs
@@ -270,62 +261,230 @@ static int get_ref(faidx_t *fai, sam_hdr_t *header, ref_cache *cache,
         return 0;
     }
 
-    if (!cache->refs && cache->last_tid > tid) {
-        // Going backwards throught the list of tids implies
-        // a non-position-ordered file, so turn on caching mode
-        cache->nref = sam_hdr_nref(header);
-        if (cache->nref < 0) {
-            print_error("calmd", "couldn't get number of refs from header");
+    // Going backwards throught the list of tids implies
+    // a non-position-ordered file, so turn on caching mode
+    if (cache->last_tid > tid)
+        ref_cache_set_limit(cache->rc, SIZE_MAX);
+
+    // Streaming mode frees the last ref here, caching mode keeps it
+    if (cache->last_name)
+        ref_cache_release(cache->rc, cache->last_name);
+    cache->last_name = ref_name;
+
+    *ref_out = ref;
+    *len_out = len;
+    cache->last_tid = tid;
+    return 0;
+}
+
+// Switch to the reference for tid, complaining if it can't be found
+static int calmd_switch_ref(md_refs *refs, sam_hdr_t *header, int tid,
+                            const md_conf *conf, char **ref,
+                            const char **ref_name, hts_pos_t *len)
+{
+    if (get_ref(refs, header, tid, ref, ref_name, len) < 0)
+        return -1;
+    if (*ref == 0) { // FIXME: Should this always be fatal?
+        fprintf(stderr, "[bam_fillmd] fail to find sequence '%s' in the reference.\n",
+                *ref_name ? *ref_name : "(unknown)");
+        if (conf->is_realn || conf->capQ > 10) return -1; // Would otherwise crash
+    }
+    return 0;
+}
+
+// BAQ, mapping quality capping and MD/NM for one placed record
+static int calmd_record(const md_conf *conf, const char *ref_name, char *ref,
+                        hts_pos_t len, bam1_t *b, uint32_t *skipped)
+{
+    if (conf->is_realn) {
+        if (sam_prob_realn(b, ref, len, conf->baq_flag) < -3) {
+            print_error_errno("calmd", "BAQ alignment failed");
             return -1;
         }
-        if (cache->nref > 0) {
-            cache->refs = calloc(cache->nref, sizeof(cache->refs[0]));
-            if (!cache->refs) {
-                print_error_errno("calmd",
-                                  "couldn't allocate reference cache");
-                return -1;
-            }
-            // Add the reference we already have as the first entry
-            if (cache->last_tid >= 0 && cache->last_tid < cache->nref) {
-                cache->refs[cache->last_tid].ref = cache->last_ref;
-                cache->refs[cache->last_tid].len = cache->last_len;
-            } else {
-                free(cache->last_ref);
-            }
-            cache->last_ref = NULL;
-        }
     }
+    if (conf->capQ > 10) {
+        int q = sam_cap_mapq(b, ref, len, conf->capQ);
+        if (b->core.qual > q) b->core.qual = q;
+    }
+    if (ref) {
+        if (bam_fillmd1_core(ref_name, b, ref, len, conf->flt_flag,
+                             conf->max_nm, conf->quiet_mode, skipped) < 0)
+            return -1;
+    }
+    return 0;
+}
 
-    if (cache->refs) {
-        assert(cache->last_ref == NULL);  // Shouldn't be set when caching
-        // Add the new reference to the cache
-        if (tid >= 0 && tid < cache->nref) {
-            cache->refs[tid].ref = ref;
-            cache->refs[tid].len = len;
+typedef struct md_ref {
+    int tid;
+    const char *name;
+    char *seq;          // held from the cache for the batch, or NULL
+    hts_pos_t len;
+} md_ref;
+
+typedef struct md_batch {
+    const md_conf *conf;
+    bam1_t *b[CALMD_BATCH_SIZE];
+    int ref[CALMD_BATCH_SIZE];      // index into refs, -1 if unplaced
+    md_ref refs[CALMD_BATCH_SIZE];  // one per run of records on a reference
+    int n, n_ref, ret;
+    uint32_t skipped;
+} md_batch;
+
+static void *calmd_batch_func(void *arg)
+{
+    md_batch *bt = (md_batch *) arg;
+    int i;
+
+    bt->ret = 0;
+    bt->skipped = 0;
+    for (i = 0; i < bt->n; i++) {
+        const md_ref *r;
+        if (bt->ref[i] < 0) continue;
+        r = &bt->refs[bt->ref[i]];
+        if (calmd_record(bt->conf, r->name, r->seq, r->len, bt->b[i],
+                         &bt->skipped) < 0) {
+            bt->ret = -1;
+            break;
         }
-    } else {
-        // Streaming mode - free the last ref and replace it with this one
-        free(cache->last_ref);
-        cache->last_ref = ref;
-        cache->last_len = len;
     }
+    return bt;
+}
 
-    *ref_out = ref;
-    *len_out = len;
-    cache->last_tid = tid;
-    return 0;
+static void calmd_batch_release(md_batch *bt, ref_cache_t *rc)
+{
+    int i;
+    for (i = 0; i < bt->n_ref; i++)
+        if (bt->refs[i].seq) ref_cache_release(rc, bt->refs[i].name);
+    bt->n_ref = 0;
 }
 
-static void refs_destroy(ref_cache *cache) {
-    if (cache->refs) {
-        int i;
-        assert(cache->last_ref == NULL);
-        for (i = 0; i < cache->nref; i++)
-            free(cache->refs[i].ref);
-        free(cache->refs);
-    } else {
-        free(cache->last_ref);
+/*
+ * Records are read in batches, and each batch holds the references its
+ * records are on.  While held, the cache keeps one shared copy of each
+ * sequence, which the threads only read.  Results are written in order as
+ * they come back.
+ */
+static int calmd_threaded(samFile *fp, sam_hdr_t *header, samFile *fpout,
+                          md_refs *refs, const md_conf *conf, hts_tpool *pool,
+                          uint32_t *skipped)
+{
+    int nbatch = 2 * hts_tpool_size(pool), next = 0, in_flight = 0;
+    int i, j, ret = 0, res_r = 0;
+    md_batch *batch = calloc(nbatch, sizeof(*batch));
+    hts_tpool_process *queue = NULL;
+    char *ref = NULL;
+    const char *ref_name = NULL;
+    hts_pos_t len = 0;
+
+    if (!batch) {
+        print_error_errno("calmd", "couldn't allocate batches");
+        return -1;
+    }
+    for (i = 0; i < nbatch; i++) {
+        batch[i].conf = conf;
+        for (j = 0; j < CALMD_BATCH_SIZE; j++) {
+            if (!(batch[i].b[j] = bam_init1())) {
+                print_error_errno("calmd", "couldn't allocate batches");
+                ret = -1;
+                goto end;
+            }
+        }
+    }
+
+    // The ring of batches is no larger than the queue, so dispatching
+    // never waits on results yet to be collected
+    if (!(queue = hts_tpool_process_init(pool, nbatch, 0))) {
+        print_error("calmd", "couldn't set up the thread pool queue");
+        ret = -1;
+        goto end;
+    }
+
+    for (;;) {
+        while (res_r >= 0 && ret == 0 && in_flight < nbatch) {
+            md_batch *bt = &batch[next];
+            for (bt->n = 0; bt->n < CALMD_BATCH_SIZE; bt->n++) {
+                bam1_t *b = bt->b[bt->n];
+                md_ref *r;
+                if ((res_r = sam_read1(fp, header, b)) < 0) break;
+                bt->ref[bt->n] = -1;
+                if (b->core.tid < 0) continue;
+                if (refs->last_tid != b->core.tid
+                    && calmd_switch_ref(refs, header, b->core.tid, conf,
+                                        &ref, &ref_name, &len) < 0) {
+                    ret = -1;
+                    break;
+                }
+                if (!bt->n_ref || bt->refs[bt->n_ref - 1].tid != b->core.tid) {
+                    hts_pos_t held_len;
+                    r = &bt->refs[bt->n_ref++];
+                    r->tid = b->core.tid;
+                    r->name = ref_name;
+                    r->len = len;
+                    // Hold it until the batch is written, as the main
+                    // thread may move on to the next reference before then
+                    r->seq = ref ? ref_cache_get(refs->rc, ref_name, &held_len) : NULL;
+                    if (ref && !r->seq) {
+                        print_error_errno("calmd", "couldn't load reference '%s'",
+                                          ref_name);
+                        bt->n_ref--;
+                        ret = -1;
+                        break;
+                    }
+                }
+                bt->ref[bt->n] = bt->n_ref - 1;
+            }
+            if (ret < 0 || !bt->n) {
+                calmd_batch_release(bt, refs->rc);
+                break;
+            }
+            if (hts_tpool_dispatch(pool, queue, calmd_batch_func, bt) < 0) {
+                print_error("calmd", "couldn't queue a batch");
+                calmd_batch_release(bt, refs->rc);
+                ret = -1;
+                break;
+            }
+            next = (next + 1) % nbatch;
+            in_flight++;
+        }
+        if (!in_flight)
+            break;
+
+        hts_tpool_result *res = hts_tpool_next_result_wait(queue);
+        if (!res) {
+            print_error("calmd", "couldn't get results from the thread pool");
+            ret = -1;
+            break;
+        }
+        md_batch *bt = (md_batch *) hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+
+        // After an error the remaining batches are only collected
+        if (bt->ret < 0) ret = -1;
+        *skipped += bt->skipped;
+        for (i = 0; i < bt->n && ret == 0; i++) {
+            if (sam_write1(fpout, header, bt->b[i]) < 0) {
+                print_error_errno("calmd", "failed to write to output file");
+                ret = -1;
+            }
+        }
+        calmd_batch_release(bt, refs->rc);
+    }
+    if (res_r < -1) {
+        fprintf(stderr, "[bam_fillmd] Error reading input.\n");
+        ret = -1;
     }
+
+ end:
+    if (queue)
+        hts_tpool_process_destroy(queue);
+    for (i = 0; i < nbatch; i++) {
+        calmd_batch_release(&batch[i], refs->rc);
+        for (j = 0; j < CALMD_BATCH_SIZE; j++)
+            if (batch[i].b[j]) bam_destroy1(batch[i].b[j]);
+    }
+    free(batch);
+    return ret;
 }
 
 int calmd_usage(void) {
@@ -348,44 +507,44 @@ int calmd_usage(void) {
 
 int bam_fillmd(int argc, char *argv[])
 {
-    int c, flt_flag, ret, is_bam_out, is_uncompressed, max_nm, is_realn, capQ, baq_flag, quiet_mode, no_pg = 0;
+    int c, ret, is_bam_out, is_uncompressed, no_pg = 0;
     hts_pos_t len = 0;
     htsThreadPool p = {NULL, 0};
     samFile *fp = NULL, *fpout = NULL;
     sam_hdr_t *header = NULL;
     faidx_t *fai = NULL;
     char *ref = NULL, mode_w[8], *ref_file, *arg_list = NULL;
-    ref_cache refs = { NULL, NULL, 0, 0, -2 };
+    md_refs refs = { NULL, NULL, -2 };
     const char *ref_name = NULL;
     bam1_t *b = NULL;
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     uint32_t skipped = 0;
+    md_conf conf = { UPDATE_NM | UPDATE_MD, 0, 0, 0, 0, 0 };
 
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 0, 0, 0,'@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 0, 0, 0,'@', '-', '-'),
         {"no-PG", no_argument, NULL, 1},
         { NULL, 0, NULL, 0 }
     };
 
-    flt_flag = UPDATE_NM | UPDATE_MD;
-    is_bam_out = is_uncompressed = is_realn = max_nm = capQ = baq_flag = quiet_mode = 0;
+    is_bam_out = is_uncompressed = 0;
     strcpy(mode_w, "w");
     while ((c = getopt_long(argc, argv, "EqQreuNhbSC:n:Ad@:", lopts, NULL)) >= 0) {
         switch (c) {
-        case 'r': is_realn = 1; break;
-        case 'e': flt_flag |= USE_EQUAL; break;
-        case 'd': flt_flag |= DROP_TAG; break;
-        case 'q': flt_flag |= BIN_QUAL; break;
-        case 'h': flt_flag |= HASH_QNM; break;
-        case 'N': flt_flag &= ~(UPDATE_MD|UPDATE_NM); break;
+        case 'r': conf.is_realn = 1; break;
+        case 'e': conf.flt_flag |= USE_EQUAL; break;
+        case 'd': conf.flt_flag |= DROP_TAG; break;
+        case 'q': conf.flt_flag |= BIN_QUAL; break;
+        case 'h': conf.flt_flag |= HASH_QNM; break;
+        case 'N': conf.flt_flag &= ~(UPDATE_MD|UPDATE_NM); break;
         case 'b': is_bam_out = 1; break;
         case 'u': is_uncompressed = is_bam_out = 1; break;
         case 'S': break;
-        case 'n': max_nm = atoi(optarg); break;
-        case 'C': capQ = atoi(optarg); break;
-        case 'A': baq_flag |= 1; break;
-        case 'E': baq_flag |= 2; break;
-        case 'Q': quiet_mode = 1; break;
+        case 'n': conf.max_nm = atoi(optarg); break;
+        case 'C': conf.capQ = atoi(optarg); break;
+        case 'A': conf.baq_flag |= 1; break;
+        case 'E': conf.baq_flag |= 2; break;
+        case 'Q': conf.quiet_mode = 1; break;
         case 1: no_pg = 1; break;
         default:  if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
             fprintf(stderr, "[bam_fillmd] unrecognized option '-%c'\n\n", c);
@@ -452,50 +611,41 @@ int bam_fillmd(int argc, char *argv[])
         print_error_errno("calmd", "Failed to open reference file '%s'", ref_file);
         goto fail;
     }
-
-    b = bam_init1();
-    if (!b) {
-        fprintf(stderr, "[bam_fillmd] Failed to allocate bam struct\n");
+    if (!(refs.rc = ref_cache_init(fai, 0))) {
+        print_error_errno("calmd", "couldn't allocate reference cache");
         goto fail;
     }
-    while ((ret = sam_read1(fp, header, b)) >= 0) {
-        if (b->core.tid >= 0) {
-            if (refs.last_tid != b->core.tid) {
-                if (get_ref(fai, header, &refs, b->core.tid,
-                            &ref, &ref_name, &len) < 0) {
-                    goto fail;
-                }
-                if (ref == 0) { // FIXME: Should this always be fatal?
-                    fprintf(stderr, "[bam_fillmd] fail to find sequence '%s' in the reference.\n",
-                            ref_name ? ref_name : "(unknown)");
-                    if (is_realn || capQ > 10) goto fail; // Would otherwise crash
+
+    if (p.pool) {
+        if (calmd_threaded(fp, header, fpout, &refs, &conf, p.pool,
+                           &skipped) < 0)
+            goto fail;
+    } else {
+        b = bam_init1();
+        if (!b) {
+            fprintf(stderr, "[bam_fillmd] Failed to allocate bam struct\n");
+            goto fail;
+        }
+        while ((ret = sam_read1(fp, header, b)) >= 0) {
+            if (b->core.tid >= 0) {
+                if (refs.last_tid != b->core.tid) {
+                    if (calmd_switch_ref(&refs, header, b->core.tid, &conf,
+                                         &ref, &ref_name, &len) < 0)
+                        goto fail;
                 }
-            }
-            if (is_realn) {
-                if (sam_prob_realn(b, ref, len, baq_flag) < -3) {
-                    print_error_errno("calmd", "BAQ alignment failed");
+                if (calmd_record(&conf, ref_name, ref, len, b, &skipped) < 0)
                     goto fail;
-                }
             }
-            if (capQ > 10) {
-                int q = sam_cap_mapq(b, ref, len, capQ);
-                if (b->core.qual > q) b->core.qual = q;
-            }
-            if (ref) {
-                if (bam_fillmd1_core(ref_name, b, ref, len, flt_flag, max_nm,
-                                     quiet_mode, &skipped) < 0)
-                    goto fail;
+            if (sam_write1(fpout, header, b) < 0) {
+                print_error_errno("calmd", "failed to write to output file");
+                goto fail;
             }
         }
-        if (sam_write1(fpout, header, b) < 0) {
-            print_error_errno("calmd", "failed to write to output file");
+        if (ret < -1) {
+            fprintf(stderr, "[bam_fillmd] Error reading input.\n");
             goto fail;
         }
     }
-    if (ret < -1) {
-        fprintf(stderr, "[bam_fillmd] Error reading input.\n");
-        goto fail;
-    }
 
     if (skipped) {
         fprintf(stderr, "[calmd] Warning: %"PRIu32" records skipped due "
@@ -503,11 +653,11 @@ int bam_fillmd(int argc, char *argv[])
                 skipped);
     }
 
-    bam_destroy1(b);
-    sam_hdr_destroy(header);
+    if (b) bam_destroy1(b);
 
     free(arg_list);
-    refs_destroy(&refs);
+    ref_cache_destroy(refs.rc);
+    sam_hdr_destroy(header);
     fai_destroy(fai);
     sam_close(fp);
     if (sam_close(fpout) < 0) {
@@ -520,7 +670,7 @@ int bam_fillmd(int argc, char *argv[])
 
  fail:
     free(arg_list);
-    refs_destroy(&refs);
+    ref_cache_destroy(refs.rc);
     if (b) bam_destroy1(b);
     if (header) sam_hdr_destroy(header);
     if (fai) fai_destroy(fai);
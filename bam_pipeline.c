@@ -0,0 +1,239 @@
+/*  bam_pipeline.c -- run several subcommands as one process.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * "samtools pipeline view -u in.bam :: sort :: markdup - out.bam" does the
+ * same as the equivalent shell pipeline, but runs each command on its own
+ * thread and hands records between them in memory, so they are never
+ * encoded, compressed or copied through the kernel on the way.
+ *
+ * Each stage is started only once the one before has finished parsing its
+ * options, as getopt() keeps its state in globals.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "htslib/thread_pool.h"
+#include "sam_numa.h"
+#include "sam_pipe.h"
+#include "samtools.h"
+
+#define PIPELINE_SEP "::"
+
+int main_samview(int argc, char *argv[]);
+int bam_sort(int argc, char *argv[]);
+int bam_markdup(int argc, char *argv[]);
+
+// The commands that can be stages.  sort keeps its settings in globals,
+// so may only be used once.
+static const struct {
+    const char *name;
+    int (*func)(int argc, char *argv[]);
+    int once;
+} stage_cmds[] = {
+    { "view",    main_samview, 0 },
+    { "sort",    bam_sort,     1 },
+    { "markdup", bam_markdup,  0 },
+};
+
+#define N_STAGE_CMDS (sizeof(stage_cmds) / sizeof(stage_cmds[0]))
+
+typedef struct {
+    int cmd;            // index into stage_cmds
+    int argc;
+    char **argv;        // preceded by the program name, for @PG lines
+    sam_stage st;
+    pthread_t tid;
+    int started, ret;
+} pipeline_stage_t;
+
+static void *stage_thread(void *arg) {
+    pipeline_stage_t *s = (pipeline_stage_t *) arg;
+
+    sam_stage_set(&s->st);
+    optind = 0;     // a full reset, or the "+" from our own options sticks
+    s->ret = stage_cmds[s->cmd].func(s->argc, s->argv);
+    sam_stage_done(&s->st, s->ret != 0);
+    return NULL;
+}
+
+static int pipeline_usage(FILE *fp, int status) {
+    fprintf(fp,
+"Usage: samtools pipeline [options] COMMAND [ARGS] :: COMMAND [ARGS] ...\n"
+"\n"
+"Runs the commands as one process, each taking the records output by the\n"
+"one before.  Within a stage, \"-\" as the input or output file means the\n"
+"neighbouring stage.  Commands: view, sort, markdup.\n"
+"\n"
+"Options:\n"
+"  -@, --threads INT   Threads shared by all the stages [0]\n"
+"  -q, --queue INT     Batches of records queued between stages [8]\n"
+"      --affinity MODE Place the shared threads on NUMA nodes:\n"
+"                      none, node[=N] or spread [none]\n"
+"\n"
+"The thread pool is only used by stages given their own -@ option.\n");
+    return status;
+}
+
+int main_pipeline(int argc, char *argv[]) {
+    static const struct option lopts[] = {
+        {"threads", required_argument, NULL, '@'},
+        {"queue", required_argument, NULL, 'q'},
+        {"affinity", required_argument, NULL, 1},
+        {NULL, 0, NULL, 0}
+    };
+    pipeline_stage_t *stages = NULL;
+    sam_pipe **pipes = NULL;
+    hts_tpool *pool = NULL;
+    int c, i, j, n = 0, n_init = 0, n_threads = 0, depth = 8;
+    int ret = EXIT_FAILURE;
+    int used[N_STAGE_CMDS] = { 0 };
+
+    // "+" stops at the first command, leaving its options alone
+    while ((c = getopt_long(argc, argv, "+@:q:", lopts, NULL)) >= 0) {
+        switch (c) {
+        case '@': n_threads = atoi(optarg); break;
+        case 'q': depth = atoi(optarg); break;
+        case 1:
+            if (sam_numa_set(optarg) < 0)
+                return EXIT_FAILURE;
+            break;
+        default:  return pipeline_usage(stderr, EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc)
+        return pipeline_usage(stdout, EXIT_SUCCESS);
+    if (depth < 1) depth = 1;
+
+    if (!(stages = calloc(argc - optind, sizeof(*stages))))
+        goto nomem;
+
+    // Split the arguments into stages at each "::"
+    for (i = optind; i < argc; i = j + 1) {
+        pipeline_stage_t *s = &stages[n];
+        for (j = i; j < argc && strcmp(argv[j], PIPELINE_SEP) != 0; j++) {
+            if (strncmp(argv[j], "--profile", 9) == 0) {
+                print_error("pipeline", "--profile can't be used within a pipeline");
+                goto out;
+            }
+            // The stages share one thread pool, made before they start
+            if (strncmp(argv[j], "--affinity", 10) == 0) {
+                print_error("pipeline", "--affinity must be given to pipeline, not a stage");
+                goto out;
+            }
+        }
+        if (j == i) {
+            print_error("pipeline", "empty stage %d", n + 1);
+            goto out;
+        }
+        for (s->cmd = 0; s->cmd < N_STAGE_CMDS; s->cmd++)
+            if (strcmp(argv[i], stage_cmds[s->cmd].name) == 0)
+                break;
+        if (s->cmd == N_STAGE_CMDS) {
+            print_error("pipeline", "\"%s\" can't be a pipeline stage", argv[i]);
+            goto out;
+        }
+        if (used[s->cmd]++ && stage_cmds[s->cmd].once) {
+            print_error("pipeline", "\"%s\" can only be used once", argv[i]);
+            goto out;
+        }
+        s->argc = j - i;
+        if (!(s->argv = malloc((s->argc + 2) * sizeof(*s->argv))))
+            goto nomem;
+        s->argv[0] = argv[-1];
+        memcpy(&s->argv[1], &argv[i], s->argc * sizeof(*s->argv));
+        s->argv[s->argc + 1] = NULL;
+        s->argv++;
+        n++;
+        if (j == argc - 1) {
+            print_error("pipeline", "empty stage %d", n + 1);
+            goto out;
+        }
+    }
+
+    if (n_threads > 0 && !(pool = sam_numa_tpool_init(n_threads))) {
+        print_error_errno("pipeline", "failed to set up thread pool");
+        goto out;
+    }
+    if (!(pipes = calloc(n, sizeof(*pipes))))
+        goto nomem;
+    for (i = 0; i < n - 1; i++)
+        if (!(pipes[i] = sam_pipe_init(depth)))
+            goto nomem;
+    for (n_init = 0; n_init < n; n_init++)
+        if (sam_stage_init(&stages[n_init].st,
+                           n_init > 0 ? pipes[n_init-1] : NULL,
+                           pipes[n_init], pool) < 0)
+            goto nomem;
+
+    // Start the stages in order.  If one fails early, the rest are not
+    // started, and their pipes closed so the ones already running stop.
+    ret = EXIT_SUCCESS;
+    for (i = 0; i < n; i++) {
+        if (ret == EXIT_SUCCESS) {
+            if (pthread_create(&stages[i].tid, NULL, stage_thread,
+                               &stages[i]) != 0) {
+                print_error_errno("pipeline", "failed to start \"%s\"",
+                                  stage_cmds[stages[i].cmd].name);
+                ret = EXIT_FAILURE;
+            } else {
+                stages[i].started = 1;
+                if (sam_stage_wait_ready(&stages[i].st) < 0)
+                    ret = EXIT_FAILURE;
+            }
+        }
+        if (!stages[i].started)
+            sam_stage_done(&stages[i].st, 1);
+    }
+    for (i = 0; i < n; i++) {
+        if (!stages[i].started)
+            continue;
+        pthread_join(stages[i].tid, NULL);
+        if (stages[i].ret != 0)
+            ret = EXIT_FAILURE;
+    }
+
+ out:
+    for (i = 0; i < n_init; i++)
+        sam_stage_destroy(&stages[i].st);
+    for (i = 0; i < n; i++)
+        free(stages[i].argv - 1);
+    if (pipes) {
+        for (i = 0; i < n - 1; i++)
+            sam_pipe_destroy(pipes[i]);
+        free(pipes);
+    }
+    if (pool) hts_tpool_destroy(pool);
+    free(stages);
+    return ret;
+
+ nomem:
+    print_error("pipeline", "out of memory");
+    ret = EXIT_FAILURE;
+    goto out;
+}
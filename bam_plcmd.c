@@ -37,16 +37,28 @@ DEALINGS IN THE SOFTWARE.  */
 #include <sys/stat.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <htslib/sam.h>
 #include <htslib/faidx.h>
 #include <htslib/kstring.h>
+#include <htslib/bgzf.h>
 #include <htslib/klist.h>
 #include <htslib/khash_str2int.h>
 #include <htslib/cram.h>
+#include <htslib/thread_pool.h>
+#include <htslib/hts_endian.h>
 #include "samtools.h"
 #include "bedidx.h"
 #include "sam_opts.h"
 #include "bam_plbuf.h"
+#include "ref_cache.h"
+
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
 
 #define dummy_free(p)
 KLIST_INIT(auxlist, char *, dummy_free)
@@ -126,7 +138,30 @@ int pileup_seq(kstring_t *ks_seq, const bam_pileup1_t *p, hts_pos_t pos,
             err |= kputc_('+', ks_seq) < 0;
             err |= kputuw(len, ks_seq) < 0;
         }
-        if (!no_ins) {
+        if (!no_ins && ks_mod->l && !memchr(ks_mod->s, '[', ks_mod->l)) {
+            // No base modifications, so a plain case change of the
+            // whole insertion which the compiler can vectorise
+            size_t l = ks_mod->l;
+            const uint8_t *in = (const uint8_t *)ks_mod->s;
+            uint8_t *out;
+            if (ks_resize(ks_seq, ks_seq->l + l + 1) < 0)
+                return -1;
+            out = (uint8_t *)ks_seq->s + ks_seq->l;
+            if (bam_is_rev(p->b)) {
+                uint8_t pad = rev_del ? '#' : '*';
+                for (j = 0; j < l; j++) {
+                    uint8_t c = in[j];
+                    c |= (c >= 'A' && c <= 'Z') << 5;
+                    out[j] = c == '*' ? pad : c;
+                }
+            } else {
+                for (j = 0; j < l; j++) {
+                    uint8_t c = in[j];
+                    out[j] = c & ~((c >= 'a' && c <= 'z') << 5);
+                }
+            }
+            ks_seq->l += l;
+        } else if (!no_ins) {
             kstring_t *ks = ks_mod;
             if (bam_is_rev(p->b)) {
                 char pad = rev_del ? '#' : '*';
@@ -154,11 +189,15 @@ int pileup_seq(kstring_t *ks_seq, const bam_pileup1_t *p, hts_pos_t pos,
         if (no_del < 2)
             err |= kputw(-del_len, ks_seq) < 0;
         if (!no_del) {
+            uint8_t *out;
+            if (ks_resize(ks_seq, ks_seq->l + del_len + 1) < 0)
+                return -1;
+            out = (uint8_t *)ks_seq->s + ks_seq->l;
             for (j = 1; j <= del_len; ++j) {
                 int c = (ref && (int)pos+j < ref_len)? ref[pos+j] : 'N';
-                err |= kputc_(bam_is_rev(p->b)? tolower(c) : toupper(c),
-                              ks_seq) < 0;
+                *out++ = bam_is_rev(p->b)? tolower(c) : toupper(c);
             }
+            ks_seq->l += del_len;
         }
     }
 
@@ -212,16 +251,20 @@ typedef struct {
     int argc;
     char **argv;
     char sep, empty, no_ins, no_ins_mods, no_del, no_ends;
+    int binary; // 1 for --binary, 2 for --binary-qual
+    hts_pos_t chunk_size; // -@ chunk length, 0 for automatic
     sam_global_args ga;
 } mplp_conf_t;
 
+// The last two references used, held from a cache that may be shared
 typedef struct {
     char *ref[2];
     int ref_id[2];
     hts_pos_t ref_len[2];
+    ref_cache_t *rc;
 } mplp_ref_t;
 
-#define MPLP_REF_INIT {{NULL,NULL},{-1,-1},{0,0}}
+#define MPLP_REF_INIT {{NULL,NULL},{-1,-1},{0,0},NULL}
 
 typedef struct {
     samFile *fp;
@@ -229,6 +272,7 @@ typedef struct {
     sam_hdr_t *h;
     mplp_ref_t *ref;
     const mplp_conf_t *conf;
+    bed_cursor_t bed_cur;   // each reader has its own, as they may be threaded
 } mplp_aux_t;
 
 typedef struct {
@@ -291,7 +335,7 @@ static int mplp_get_ref(mplp_aux_t *ma, int tid, char **ref, hts_pos_t *ref_len)
 
     //printf("get ref %d {%d/%p, %d/%p}\n", tid, r->ref_id[0], r->ref[0], r->ref_id[1], r->ref[1]);
 
-    if (!r || !ma->conf->fai) {
+    if (!r || !r->rc || !ma->conf->fai) {
         *ref = NULL;
         return 0;
     }
@@ -319,17 +363,15 @@ static int mplp_get_ref(mplp_aux_t *ma, int tid, char **ref, hts_pos_t *ref_len)
     }
 
     // New, so migrate to old and load new
-    free(r->ref[1]);
+    if (r->ref[1])
+        ref_cache_release(r->rc, sam_hdr_tid2name(ma->h, r->ref_id[1]));
     r->ref[1]     = r->ref[0];
     r->ref_id[1]  = r->ref_id[0];
     r->ref_len[1] = r->ref_len[0];
 
     r->ref_id[0] = tid;
-    r->ref[0] = faidx_fetch_seq64(ma->conf->fai,
-                                sam_hdr_tid2name(ma->h, r->ref_id[0]),
-                                0,
-                                HTS_POS_MAX,
-                                &r->ref_len[0]);
+    r->ref[0] = ref_cache_get(r->rc, sam_hdr_tid2name(ma->h, r->ref_id[0]),
+                              &r->ref_len[0]);
 
     if (!r->ref[0]) {
         r->ref[0] = NULL;
@@ -344,6 +386,17 @@ static int mplp_get_ref(mplp_aux_t *ma, int tid, char **ref, hts_pos_t *ref_len)
     return 1;
 }
 
+// Releases the references held by r
+static void mplp_ref_release(mplp_ref_t *r, sam_hdr_t *h) {
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (r->ref[i])
+            ref_cache_release(r->rc, sam_hdr_tid2name(h, r->ref_id[i]));
+        r->ref[i] = NULL;
+        r->ref_id[i] = -1;
+    }
+}
+
 // Initialise and destroy the base modifier state data. This is called
 // as each new read is added or removed from the pileups.
 static
@@ -361,27 +414,305 @@ int pileup_cd_destroy(void *data, const bam1_t *b, bam_pileup_cd *cd) {
     return 0;
 }
 
-static void
-print_empty_pileup(FILE *fp, const mplp_conf_t *conf, const char *tname,
+static int
+print_empty_pileup(kstring_t *ks, const mplp_conf_t *conf, const char *tname,
                    hts_pos_t pos, int n, const char *ref, hts_pos_t ref_len)
 {
-    int i;
-    fprintf(fp, "%s\t%"PRIhts_pos"\t%c", tname, pos+1, (ref && pos < ref_len)? ref[pos] : 'N');
+    int i, err = 0;
+    err |= ksprintf(ks, "%s\t%"PRIhts_pos"\t%c", tname, pos+1, (ref && pos < ref_len)? ref[pos] : 'N') < 0;
     for (i = 0; i < n; ++i) {
-        fputs("\t0\t*\t*", fp);
+        err |= kputsn("\t0\t*\t*", 6, ks) < 0;
         int flag_value = MPLP_PRINT_MAPQ_CHAR;
         while(flag_value < MPLP_PRINT_LAST) {
             if (flag_value != MPLP_PRINT_MODS && (conf->flag & flag_value))
-                fputs("\t*", fp);
+                err |= kputsn("\t*", 2, ks) < 0;
             flag_value <<= 1;
         }
         if (conf->auxlist) {
             int t = 0;
             while(t++ < ((klist_t(auxlist) *)conf->auxlist)->size)
-                fputs("\t*", fp);
+                err |= kputsn("\t*", 2, ks) < 0;
+        }
+    }
+    err |= kputc('\n', ks) < 0;
+    return err ? -1 : 0;
+}
+
+// Pileup text is gathered in a buffer and written once this much is ready
+#define MPLP_OUT_BATCH (1<<20)
+
+// Writes out ks if it is over MPLP_OUT_BATCH, or has anything in it and
+// force is set.  Returns 0 on success, -1 on failure.
+static int mplp_write(BGZF *fp, kstring_t *ks, int force) {
+    if (ks->l < (force ? 1 : MPLP_OUT_BATCH))
+        return 0;
+    if (bgzf_write(fp, ks->s, ks->l) < 0) {
+        print_error_errno("mpileup", "failed to write output");
+        return -1;
+    }
+    ks->l = 0;
+    return 0;
+}
+
+// Opens the output, BGZF compressed for --binary or when the name ends in
+// .gz or .bgz.  Standard output is only compressed for --binary.
+static BGZF *mplp_open_output(const mplp_conf_t *conf) {
+    const char *fn = conf->output_fname;
+    size_t l = fn ? strlen(fn) : 0;
+    int gz = conf->binary
+        || (l > 3 && strcmp(fn + l - 3, ".gz") == 0)
+        || (l > 4 && strcmp(fn + l - 4, ".bgz") == 0);
+    BGZF *fp = fn && strcmp(fn, "-")
+        ? bgzf_open(fn, gz ? "w" : "wu")
+        : bgzf_fdopen(fileno(stdout), gz ? "w" : "wu");
+    if (fp && gz && conf->ga.nthreads > 0)
+        bgzf_mt(fp, conf->ga.nthreads, 256);
+    return fp;
+}
+
+// Binary pileup output.  This is a BGZF stream holding a header followed
+// by chunks of up to MPLP_BIN_CHUNK columns on a single reference.
+//
+// Header:  "MPLP" magic, uint8 version (1), uint8 flags (1 if quality
+//          sums are present), uint32 nfiles, then per file a uint32 name
+//          length and the name.
+// Chunk:   uint32 ref name length and name, int64 first 0-based position,
+//          uint32 number of columns N, N LEB128 varint position deltas
+//          (the first relative to the chunk start, so 0), N reference
+//          bases, then per file MPLP_BIN_NCOUNT columns of N uint32
+//          counts, then per file MPLP_BIN_NALLELE columns of N uint32
+//          base quality sums if present.  All integers are little-endian.
+// The stream ends with a chunk with a zero length reference name.
+//
+// The counts are of bases A, C, G, T, N and deletions on the forward
+// strand, then the same on the reverse strand, then insertions forward
+// and reverse, then deletions starting after the column forward and
+// reverse.  Bases below --min-BQ and reference skips are not counted.
+//
+// Each chunk starts a new BGZF block.  When writing to a file, FILE.idx
+// lists one chunk per line as ref, 1-based first and last position and
+// the virtual offset of the chunk, for random access.
+#define MPLP_BIN_CHUNK   4096
+#define MPLP_BIN_NALLELE 12
+#define MPLP_BIN_NCOUNT  (MPLP_BIN_NALLELE + 4)
+
+typedef struct {
+    BGZF *fp;
+    FILE *idx;          // region index, or NULL
+    const char *ref;    // reference of the current chunk
+    hts_pos_t *pos;     // pos[MPLP_BIN_CHUNK]
+    char *base;         // base[MPLP_BIN_CHUNK], the reference bases
+    uint32_t *cnt;      // cnt[nfiles][MPLP_BIN_NCOUNT][MPLP_BIN_CHUNK]
+    uint32_t *qsum;     // qsum[nfiles][MPLP_BIN_NALLELE][MPLP_BIN_CHUNK]
+    int n, nfiles;
+    kstring_t ks;
+} mplp_bin_t;
+
+static inline void mplp_kput_le(kstring_t *ks, uint64_t v, int len) {
+    int i;
+    for (i = 0; i < len; i++, v >>= 8)
+        kputc_(v & 0xff, ks);
+}
+
+static int mplp_bin_open(mplp_bin_t *bd, BGZF *fp, const char *fn,
+                         int nfiles, char **names, int qual) {
+    size_t ncol = (size_t)nfiles * MPLP_BIN_CHUNK;
+    int i;
+
+    memset(bd, 0, sizeof(*bd));
+    bd->fp = fp;
+    bd->nfiles = nfiles;
+    bd->pos  = malloc(MPLP_BIN_CHUNK * sizeof(*bd->pos));
+    bd->base = malloc(MPLP_BIN_CHUNK);
+    bd->cnt  = malloc(ncol * MPLP_BIN_NCOUNT * sizeof(*bd->cnt));
+    if (qual)
+        bd->qsum = malloc(ncol * MPLP_BIN_NALLELE * sizeof(*bd->qsum));
+    if (!bd->pos || !bd->base || !bd->cnt || (qual && !bd->qsum)) {
+        print_error_errno("mpileup", "Out of memory");
+        return -1;
+    }
+
+    if (fn && strcmp(fn, "-")) {
+        kstring_t idx_fn = KS_INITIALIZE;
+        if (ksprintf(&idx_fn, "%s.idx", fn) < 0)
+            return -1;
+        bd->idx = fopen(idx_fn.s, "w");
+        if (!bd->idx) {
+            print_error_errno("mpileup", "Cannot open \"%s\" for writing",
+                              idx_fn.s);
+            ks_free(&idx_fn);
+            return -1;
         }
+        ks_free(&idx_fn);
+    }
+
+    kputsn("MPLP", 4, ks_clear(&bd->ks));
+    kputc_(1, &bd->ks);
+    kputc_(qual ? 1 : 0, &bd->ks);
+    mplp_kput_le(&bd->ks, nfiles, 4);
+    for (i = 0; i < nfiles; i++) {
+        size_t len = strlen(names[i]);
+        mplp_kput_le(&bd->ks, len, 4);
+        kputsn(names[i], len, &bd->ks);
+    }
+    if (bgzf_write(bd->fp, bd->ks.s, bd->ks.l) < 0) {
+        print_error("mpileup", "Failed to write binary header");
+        return -1;
     }
-    putc('\n', fp);
+
+    return 0;
+}
+
+// Write out ncol columns of n uint32 values, MPLP_BIN_CHUNK apart in v
+static int mplp_bin_put32(kstring_t *ks, const uint32_t *v, int ncol, int n) {
+    int i, j;
+    if (ks_resize(ks, ks->l + (size_t)ncol * n * 4 + 1) < 0)
+        return -1;
+    uint8_t *out = (uint8_t *)ks->s + ks->l;
+    for (j = 0; j < ncol; j++, v += MPLP_BIN_CHUNK)
+        for (i = 0; i < n; i++, out += 4)
+            u32_to_le(v[i], out);
+    ks->l += (size_t)ncol * n * 4;
+    return 0;
+}
+
+// Write the pending chunk, starting a new BGZF block for it.
+static int mplp_bin_flush(mplp_bin_t *bd) {
+    int i, err = 0;
+    size_t ref_len;
+    kstring_t *ks = &bd->ks;
+
+    if (!bd->n)
+        return 0;
+
+    if (bgzf_flush(bd->fp) < 0)
+        return -1;
+    int64_t voff = bgzf_tell(bd->fp);
+
+    ref_len = strlen(bd->ref);
+    ks_clear(ks);
+    mplp_kput_le(ks, ref_len, 4);
+    kputsn(bd->ref, ref_len, ks);
+    mplp_kput_le(ks, bd->pos[0], 8);
+    mplp_kput_le(ks, bd->n, 4);
+    for (i = 0; i < bd->n; i++) {
+        uint64_t delta = i ? bd->pos[i] - bd->pos[i-1] : 0;
+        do {
+            kputc_((delta & 0x7f) | (delta > 0x7f ? 0x80 : 0), ks);
+            delta >>= 7;
+        } while (delta);
+    }
+    kputsn(bd->base, bd->n, ks);
+    err |= mplp_bin_put32(ks, bd->cnt, bd->nfiles * MPLP_BIN_NCOUNT, bd->n);
+    if (bd->qsum)
+        err |= mplp_bin_put32(ks, bd->qsum, bd->nfiles * MPLP_BIN_NALLELE,
+                              bd->n);
+    if (err || bgzf_write(bd->fp, ks->s, ks->l) < 0)
+        return -1;
+
+    if (bd->idx &&
+        fprintf(bd->idx, "%s\t%"PRIhts_pos"\t%"PRIhts_pos"\t%"PRId64"\n",
+                bd->ref, bd->pos[0]+1, bd->pos[bd->n-1]+1, voff) < 0)
+        return -1;
+
+    bd->n = 0;
+    return 0;
+}
+
+// Add a column for pos on ref.  If n_plp is NULL it has no reads.
+static int mplp_bin_add(mplp_bin_t *bd, const mplp_conf_t *conf,
+                        const char *ref_name, hts_pos_t pos,
+                        const int *n_plp, const bam_pileup1_t **plp,
+                        const char *ref, hts_pos_t ref_len) {
+    int i, j, k, row;
+
+    if (bd->n && (bd->n == MPLP_BIN_CHUNK ||
+                  (bd->ref != ref_name && strcmp(bd->ref, ref_name) != 0))) {
+        if (mplp_bin_flush(bd) < 0) {
+            print_error("mpileup", "Failed to write binary output");
+            return -1;
+        }
+    }
+    bd->ref = ref_name;
+    row = bd->n++;
+    bd->pos[row] = pos;
+    bd->base[row] = (ref && pos < ref_len) ? ref[pos] : 'N';
+
+    for (i = 0; i < bd->nfiles; i++) {
+        uint32_t *cnt = &bd->cnt[(size_t)i * MPLP_BIN_NCOUNT * MPLP_BIN_CHUNK];
+        uint32_t *qsum = bd->qsum
+            ? &bd->qsum[(size_t)i * MPLP_BIN_NALLELE * MPLP_BIN_CHUNK]
+            : NULL;
+        uint32_t c[MPLP_BIN_NCOUNT] = {0}, q[MPLP_BIN_NALLELE] = {0};
+
+        for (j = 0; n_plp && j < n_plp[i]; j++) {
+            const bam_pileup1_t *p = plp[i] + j;
+            int bq = p->qpos < p->b->core.l_qseq
+                ? bam_get_qual(p->b)[p->qpos]
+                : 0;
+            int rev = bam_is_rev(p->b) ? 1 : 0, a;
+            if (bq < conf->min_baseQ || p->is_refskip)
+                continue;
+            if (p->is_del)
+                a = 5;
+            else if (p->qpos < p->b->core.l_qseq)
+                a = seq_nt16_int[bam_seqi(bam_get_seq(p->b), p->qpos)];
+            else
+                a = 4; // N
+            a += rev * 6;
+            c[a]++;
+            q[a] += bq;
+            if (p->indel > 0)
+                c[MPLP_BIN_NALLELE + rev]++;
+            else if (p->indel < 0)
+                c[MPLP_BIN_NALLELE + 2 + rev]++;
+        }
+        for (k = 0; k < MPLP_BIN_NCOUNT; k++)
+            cnt[k * MPLP_BIN_CHUNK + row] = c[k];
+        if (qsum)
+            for (k = 0; k < MPLP_BIN_NALLELE; k++)
+                qsum[k * MPLP_BIN_CHUNK + row] = q[k];
+    }
+
+    return 0;
+}
+
+// Adds a column with no reads, as text or binary
+static int mplp_empty_column(kstring_t *ks, mplp_bin_t *bin,
+                             const mplp_conf_t *conf, const char *tname,
+                             hts_pos_t pos, int n, const char *ref,
+                             hts_pos_t ref_len) {
+    return bin->fp
+        ? mplp_bin_add(bin, conf, tname, pos, NULL, NULL, ref, ref_len)
+        : print_empty_pileup(ks, conf, tname, pos, n, ref, ref_len);
+}
+
+// Writes the remaining columns and the terminating chunk.  The BGZF
+// handle belongs to the caller.
+static int mplp_bin_close(mplp_bin_t *bd) {
+    int ret = 0;
+
+    if (bd->fp) {
+        if (mplp_bin_flush(bd) < 0)
+            ret = -1;
+        mplp_kput_le(ks_clear(&bd->ks), 0, 4);
+        if (bgzf_write(bd->fp, bd->ks.s, bd->ks.l) < 0)
+            ret = -1;
+        if (ret < 0)
+            print_error("mpileup", "Failed to write binary output");
+    }
+    if (bd->idx && fclose(bd->idx) != 0) {
+        print_error_errno("mpileup", "Failed to write binary output index");
+        ret = -1;
+    }
+    free(bd->pos);
+    free(bd->base);
+    free(bd->cnt);
+    free(bd->qsum);
+    ks_free(&bd->ks);
+    memset(bd, 0, sizeof(*bd));
+
+    return ret;
 }
 
 static int mplp_func(void *data, bam1_t *b)
@@ -404,7 +735,7 @@ static int mplp_func(void *data, bam1_t *b)
         if (ma->conf->rflag_require && !(ma->conf->rflag_require&b->core.flag)) { skip = 1; continue; }
         if (ma->conf->rflag_filter && ma->conf->rflag_filter&b->core.flag) { skip = 1; continue; }
         if (ma->conf->bed && ma->conf->all == 0) { // test overlap
-            skip = !bed_overlap(ma->conf->bed, sam_hdr_tid2name(ma->h, b->core.tid), b->core.pos, bam_endpos(b));
+            skip = !bed_overlap_sorted(ma->conf->bed, &ma->bed_cur, sam_hdr_tid2name(ma->h, b->core.tid), b->core.pos, bam_endpos(b));
             if (skip) continue;
         }
         if (ma->conf->rghash) { // exclude read groups
@@ -444,6 +775,569 @@ static int mplp_func(void *data, bam1_t *b)
     return ret;
 }
 
+// Scratch strings reused between columns while formatting them
+typedef struct {
+    kstring_t seq, qual, mod;
+} mplp_fmt_t;
+
+/*
+ * Appends the text pileup line for one column to ks.
+ * Returns 0 on success, -1 on failure.
+ */
+static int mplp_format_column(kstring_t *ks, const mplp_conf_t *conf,
+                              sam_hdr_t *h, mplp_fmt_t *f, int tid,
+                              hts_pos_t pos, int nfn, const int *n_plp,
+                              const bam_pileup1_t **plp,
+                              const char *ref, hts_pos_t ref_len)
+{
+    int i, err = 0;
+
+    err |= ksprintf(ks, "%s\t%"PRIhts_pos"\t%c", sam_hdr_tid2name(h, tid),
+                    pos + 1, (ref && pos < ref_len)? ref[pos] : 'N') < 0;
+    for (i = 0; i < nfn; ++i) {
+        int j, cnt;
+        ks_clear(&f->seq);
+        ks_clear(&f->qual);
+        ks_clear(&f->mod);
+        if (ks_resize(&f->qual, n_plp[i] + 1) < 0)
+            return -1;
+        for (j = cnt = 0; j < n_plp[i]; ++j) {
+            const bam_pileup1_t *p = plp[i] + j;
+            int c = p->qpos < p->b->core.l_qseq
+                ? bam_get_qual(p->b)[p->qpos]
+                : 0;
+            if (c >= conf->min_baseQ) {
+                // Build up seq
+                err |= pileup_seq(&f->seq, plp[i] + j, pos, ref_len,
+                                  ref, &f->mod, conf->rev_del,
+                                  conf->no_ins, conf->no_ins_mods,
+                                  conf->no_del, conf->no_ends) < 0;
+
+                // Build up qual, which has room for a char per read
+                f->qual.s[f->qual.l++] = c+33 < 126 ? c+33 : 126;
+                cnt++;
+            }
+        }
+        if (err)
+            return -1;
+        err |= kputc_('\t', ks) < 0;
+        err |= kputw(cnt, ks) < 0;
+        err |= kputc_('\t', ks) < 0;
+
+        if (n_plp[i] == 0) {
+            err |= kputs("*\t*", ks) < 0;
+            int flag_value = MPLP_PRINT_MAPQ_CHAR;
+            while(flag_value < MPLP_PRINT_LAST) {
+                if (flag_value != MPLP_PRINT_MODS
+                    && (conf->flag & flag_value))
+                    err |= kputs("\t*", ks) < 0;
+                flag_value <<= 1;
+            }
+            if (conf->auxlist) {
+                int t = 0;
+                while(t++ < ((klist_t(auxlist) *)conf->auxlist)->size)
+                    err |= kputs("\t*", ks) < 0;
+            }
+        } else {
+            if (f->seq.l) {
+                err |= kputsn(f->seq.s, f->seq.l, ks) < 0;
+            } else {
+                err |= kputc_('*', ks) < 0;
+            }
+            err |= kputc_('\t', ks) < 0;
+
+            if (f->qual.l) {
+                err |= kputsn(f->qual.s, f->qual.l, ks) < 0;
+            } else {
+                err |= kputc_('*', ks) < 0;
+            }
+
+            /* Print selected columns */
+            int flag_value = MPLP_PRINT_MAPQ_CHAR;
+            while(flag_value < MPLP_PRINT_LAST) {
+                if (flag_value != MPLP_PRINT_MODS
+                    && (conf->flag & flag_value)) {
+                    int n = 0;
+                    err |= kputc_('\t', ks) < 0;
+                    for (j = 0; j < n_plp[i]; ++j) {
+                        const bam_pileup1_t *p = &plp[i][j];
+                        int c = p->qpos < p->b->core.l_qseq
+                            ? bam_get_qual(p->b)[p->qpos]
+                            : 0;
+                        if ( c < conf->min_baseQ ) continue;
+                        if (n > 0 && flag_value != MPLP_PRINT_MAPQ_CHAR) err |= kputc_(',', ks) < 0;
+                        n++;
+
+                        switch (flag_value) {
+                        case MPLP_PRINT_MAPQ_CHAR:
+                            c = p->b->core.qual + 33;
+                            if (c > 126) c = 126;
+                            err |= kputc_(c, ks) < 0;
+                            break;
+                        case MPLP_PRINT_QPOS:
+                            // query position in current orientation
+                            err |= kputw(p->qpos + 1, ks) < 0;
+                            break;
+                        case MPLP_PRINT_QPOS5: {
+                            // query position in 5' to 3' orientation
+                            int pos5 = bam_is_rev(p->b)
+                                ? p->b->core.l_qseq-p->qpos + p->is_del
+                                : p->qpos + 1;
+                            err |= kputw(pos5, ks) < 0;
+                            break;
+                        }
+                        case MPLP_PRINT_QNAME:
+                            err |= kputs(bam_get_qname(p->b), ks) < 0;
+                            break;
+                        case MPLP_PRINT_FLAG:
+                            err |= kputw(p->b->core.flag, ks) < 0;
+                            break;
+                        case MPLP_PRINT_RNAME:
+                            if (p->b->core.tid >= 0)
+                                err |= kputs(sam_hdr_tid2name(h, p->b->core.tid), ks) < 0;
+                            else
+                                err |= kputc_('*', ks) < 0;
+                            break;
+                        case MPLP_PRINT_POS:
+                            err |= kputll((int64_t) p->b->core.pos + 1, ks) < 0;
+                            break;
+                        case MPLP_PRINT_MAPQ:
+                            err |= kputw(p->b->core.qual, ks) < 0;
+                            break;
+                        case MPLP_PRINT_RNEXT:
+                            if (p->b->core.mtid >= 0)
+                                err |= kputs(sam_hdr_tid2name(h, p->b->core.mtid), ks) < 0;
+                            else
+                                err |= kputc_('*', ks) < 0;
+                            break;
+                        case MPLP_PRINT_PNEXT:
+                            err |= kputll((int64_t) p->b->core.mpos + 1, ks) < 0;
+                            break;
+                        case MPLP_PRINT_RLEN:
+                            err |= kputw(p->b->core.l_qseq, ks) < 0;
+                            break;
+                        }
+                    }
+                    if (!n) err |= kputc_('*', ks) < 0;
+                }
+                flag_value <<= 1;
+            }
+
+            /* Print selected tags */
+            klist_t(auxlist) *auxlist_p = ((klist_t(auxlist) *)conf->auxlist);
+            if (auxlist_p && auxlist_p->size) {
+                kliter_t(auxlist) *aux;
+                for (aux = kl_begin(auxlist_p); aux != kl_end(auxlist_p); aux = kl_next(aux)) {
+                    int n = 0; // NB shadows outer loop
+                    err |= kputc_('\t', ks) < 0;
+                    for (j = 0; j < n_plp[i]; ++j) {
+                        const bam_pileup1_t *p = &plp[i][j];
+                        int c = p->qpos < p->b->core.l_qseq
+                            ? bam_get_qual(p->b)[p->qpos]
+                            : 0;
+                        if ( c < conf->min_baseQ ) continue;
+
+                        if (n > 0) err |= kputc_(conf->sep, ks) < 0;
+                        n++;
+                        uint8_t* tag_u = bam_aux_get(p->b, kl_val(aux));
+                        if (!tag_u) {
+                            err |= kputc_(conf->empty, ks) < 0;
+                            continue;
+                        }
+
+                        int tag_supported = 0;
+
+                        /* Tag value is string */
+                        if (*tag_u == 'Z' || *tag_u == 'H') {
+                            char *tag_s = bam_aux2Z(tag_u);
+                            if (!tag_s) continue;
+                            err |= kputs(tag_s, ks) < 0;
+                            tag_supported = 1;
+                        }
+
+                        /* Tag value is integer */
+                        if (*tag_u == 'I' || *tag_u == 'i' || *tag_u == 'C' || *tag_u == 'c' || *tag_u == 'S' || *tag_u == 's') {
+                            int64_t tag_i = bam_aux2i(tag_u);
+                            err |= kputll(tag_i, ks) < 0;
+                            tag_supported = 1;
+                        }
+
+                        /* Tag value is float */
+                        if (*tag_u == 'd' || *tag_u == 'f') {
+                            double tag_f = bam_aux2f(tag_u);
+                            err |= ksprintf(ks, "%lf", tag_f) < 0;
+                            tag_supported = 1;
+                        }
+
+                        /* Tag value is character */
+                        if (*tag_u == 'A') {
+                            char tag_c = bam_aux2A(tag_u);
+                            err |= kputc_(tag_c, ks) < 0;
+                            tag_supported = 1;
+                        }
+
+                        if (!tag_supported) err |= kputc_('*', ks) < 0;
+                    }
+                    if (!n) err |= kputc_('*', ks) < 0;
+                }
+            }
+        }
+    }
+    err |= kputc('\n', ks) < 0;
+
+    return err ? -1 : 0;
+}
+
+/*
+ * Threaded pileup.  The requested region, or every reference, is split
+ * into chunks that are piled up on the thread pool.  Each chunk gets a
+ * reader holding its own file handles, indices, reference and pileup
+ * iterator.  The text for a chunk is built in memory and written out in
+ * chunk order, so the output matches the single threaded one.
+ *
+ * Reads are fetched from a margin before the chunk start so the pileup
+ * has the same read depth history (and so --max-depth choices) as it
+ * would have had running through from the left.  This is only exact when
+ * no read that was dropped or kept at the depth limit within a read span
+ * of the chunk start was itself decided by reads starting before the
+ * margin, so with reads much longer than the margin and the depth limit
+ * reached near a chunk boundary the kept reads can differ from a single
+ * threaded run.  The margin is fixed as the read lengths are not known
+ * before the chunks are fetched.  BAQ, MQ capping and overlap removal
+ * only depend on each read and its mate, which are fetched too if they
+ * cover a column in the chunk.
+ *
+ * The chunk length is picked from the total length and thread count, but
+ * an undocumented --chunk-size option overrides it so the tests can split
+ * small files into many chunks.
+ */
+#define MPLP_CHUNK_MIN    10000
+#define MPLP_CHUNK_MAX    (1<<20)
+#define MPLP_CHUNK_MARGIN 1000
+
+typedef struct {
+    mplp_conf_t conf;
+    mplp_aux_t **data;
+    sam_hdr_t **h;      // header of each file, for the tids
+    hts_idx_t **idx;
+    mplp_ref_t ref;
+    mplp_fmt_t fmt;
+    int *n_plp;
+    const bam_pileup1_t **plp;
+} mplp_reader_t;
+
+typedef struct {
+    const mplp_conf_t *conf;
+    int nfn;
+    char **fn, **fn_idx;
+    sam_hdr_t *h;       // header of the first file
+    ref_cache_t *rc;    // shared by all readers
+    mplp_reader_t *r;
+    int *avail, navail;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} mplp_readers_t;
+
+typedef struct {
+    mplp_readers_t *readers;
+    int tid;
+    hts_pos_t beg, end;
+    kstring_t out;
+    int ret;
+} mplp_chunk_t;
+
+static void mplp_reader_close(mplp_readers_t *rd, mplp_reader_t *r) {
+    int i;
+    for (i = 0; r->data && r->h && r->idx && i < rd->nfn; i++) {
+        if (r->data[i]) {
+            if (r->data[i]->fp)
+                sam_close(r->data[i]->fp);
+            free(r->data[i]);
+        }
+        if (r->h[i])
+            sam_hdr_destroy(r->h[i]);
+        if (r->idx[i])
+            hts_idx_destroy(r->idx[i]);
+    }
+    mplp_ref_release(&r->ref, rd->h);
+    ks_free(&r->fmt.seq);
+    ks_free(&r->fmt.qual);
+    ks_free(&r->fmt.mod);
+    free(r->data);
+    free(r->h);
+    free(r->idx);
+    free(r->n_plp);
+    free(r->plp);
+    memset(r, 0, sizeof(*r));
+}
+
+// Opens the input files as mpileup() does, plus their indices
+static int mplp_reader_open(mplp_readers_t *rd, mplp_reader_t *r) {
+    const mplp_conf_t *conf = rd->conf;
+    mplp_ref_t ref_init = MPLP_REF_INIT;
+    refs_t *refs = NULL;
+    int i, nfn = rd->nfn;
+
+    r->conf = *conf;
+    r->ref = ref_init;
+    r->ref.rc = rd->rc;
+    if (!(r->data  = calloc(nfn, sizeof(*r->data)))
+        || !(r->h     = calloc(nfn, sizeof(*r->h)))
+        || !(r->idx   = calloc(nfn, sizeof(*r->idx)))
+        || !(r->n_plp = calloc(nfn, sizeof(*r->n_plp)))
+        || !(r->plp   = calloc(nfn, sizeof(*r->plp))))
+        goto err;
+
+    for (i = 0; i < nfn; i++) {
+        mplp_aux_t *ma = r->data[i] = calloc(1, sizeof(*ma));
+        if (!ma || !(ma->fp = sam_open_format(rd->fn[i], "rb",
+                                              &conf->ga.in))) {
+            print_error_errno("mpileup", "failed to open %s", rd->fn[i]);
+            goto err;
+        }
+        if (hts_set_opt(ma->fp, CRAM_OPT_DECODE_MD, 0))
+            goto err;
+        if (!refs && conf->fai_fname) {
+            if (hts_set_fai_filename(ma->fp, conf->fai_fname) != 0)
+                goto err;
+            refs = cram_get_refs(ma->fp);
+        } else if (conf->fai_fname) {
+            if (hts_set_opt(ma->fp, CRAM_OPT_SHARED_REF, refs) != 0)
+                goto err;
+        }
+        if (!(r->h[i] = sam_hdr_read(ma->fp)))
+            goto err;
+        r->idx[i] = rd->fn_idx
+            ? sam_index_load2(ma->fp, rd->fn[i], rd->fn_idx[i])
+            : sam_index_load(ma->fp, rd->fn[i]);
+        if (!r->idx[i]) {
+            print_error("mpileup", "fail to load index for %s", rd->fn[i]);
+            goto err;
+        }
+        ma->conf = &r->conf;
+        ma->ref = &r->ref;
+        ma->h = rd->h;
+    }
+    return 0;
+
+ err:
+    mplp_reader_close(rd, r);
+    return -1;
+}
+
+static mplp_reader_t *mplp_reader_get(mplp_readers_t *rd) {
+    mplp_reader_t *r;
+    pthread_mutex_lock(&rd->lock);
+    while (!rd->navail)
+        pthread_cond_wait(&rd->cond, &rd->lock);
+    r = &rd->r[rd->avail[--rd->navail]];
+    pthread_mutex_unlock(&rd->lock);
+    return r;
+}
+
+static void mplp_reader_put(mplp_readers_t *rd, mplp_reader_t *r) {
+    pthread_mutex_lock(&rd->lock);
+    rd->avail[rd->navail++] = r - rd->r;
+    pthread_cond_signal(&rd->cond);
+    pthread_mutex_unlock(&rd->lock);
+}
+
+static void *mplp_chunk(void *arg) {
+    mplp_chunk_t *c = (mplp_chunk_t *)arg;
+    mplp_readers_t *rd = c->readers;
+    const mplp_conf_t *conf = rd->conf;
+    mplp_reader_t *r = mplp_reader_get(rd);
+    const char *tname = sam_hdr_tid2name(rd->h, c->tid);
+    bam_mplp_t iter = NULL;
+    int i, tid, ret = -1;
+    hts_pos_t pos, ref_len = 0;
+    char *ref = NULL;
+
+    ks_clear(&c->out);
+    if (!r->data && mplp_reader_open(rd, r) < 0)
+        goto out;
+
+    for (i = 0; i < rd->nfn; i++) {
+        int ftid = i ? sam_hdr_name2tid(r->h[i], tname) : c->tid;
+        r->data[i]->iter = ftid >= 0
+            ? sam_itr_queryi(r->idx[i], ftid,
+                             MAX(c->beg - MPLP_CHUNK_MARGIN, 0), c->end)
+            : sam_itr_queryi(r->idx[i], HTS_IDX_NONE, 0, 0);
+        if (!r->data[i]->iter)
+            goto out;
+    }
+
+    if (!(iter = bam_mplp_init(rd->nfn, mplp_func, (void **)r->data)))
+        goto out;
+    if (conf->flag & MPLP_PRINT_MODS) {
+        bam_mplp_constructor(iter, pileup_cd_create);
+        bam_mplp_destructor(iter, pileup_cd_destroy);
+    }
+    if (conf->flag & MPLP_SMART_OVERLAPS)
+        bam_mplp_init_overlaps(iter);
+    bam_mplp_set_maxcnt(iter, conf->max_depth ? conf->max_depth : INT_MAX);
+
+    while ((ret = bam_mplp64_auto(iter, &tid, &pos, r->n_plp, r->plp)) > 0) {
+        if (pos < c->beg || pos >= c->end)
+            continue;
+        if (conf->bed && !bed_overlap(conf->bed, tname, pos, pos+1))
+            continue;
+        mplp_get_ref(r->data[0], tid, &ref, &ref_len);
+        if (mplp_format_column(&c->out, &r->conf, rd->h, &r->fmt, tid, pos,
+                               rd->nfn, r->n_plp, r->plp,
+                               ref, ref_len) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+ out:
+    if (iter)
+        bam_mplp_destroy(iter);
+    if (r->data) {
+        for (i = 0; i < rd->nfn; i++) {
+            if (r->data[i]->iter)
+                hts_itr_destroy(r->data[i]->iter);
+            r->data[i]->iter = NULL;
+        }
+    }
+    mplp_reader_put(rd, r);
+    c->ret = ret;
+    return c;
+}
+
+/*
+ * Checks whether every input has an index, for threading.
+ * Returns 1 if so, 0 if not.
+ */
+static int mplp_indexed(mplp_aux_t **data, int nfn, char **fn, char **fn_idx) {
+    int i;
+    for (i = 0; i < nfn; i++) {
+        hts_idx_t *idx;
+        if (strcmp(fn[i], "-") == 0)
+            return 0;
+        idx = sam_index_load3(data[i]->fp, fn[i], fn_idx ? fn_idx[i] : NULL,
+                              HTS_IDX_SILENT_FAIL);
+        if (!idx)
+            return 0;
+        hts_idx_destroy(idx);
+    }
+    return 1;
+}
+
+/*
+ * Runs the pileup of tid0:beg0-end0 (or of every reference if there
+ * is no region) on a pool of nthreads threads, writing to fp.
+ * Returns 0 on success, EXIT_FAILURE on failure.
+ */
+static int mpileup_threaded(const mplp_conf_t *conf, int nfn, char **fn,
+                            char **fn_idx, sam_hdr_t *h, ref_cache_t *rc,
+                            int tid0, hts_pos_t beg0, hts_pos_t end0,
+                            BGZF *fp) {
+    int nthreads = conf->ga.nthreads, nslot = 2 * nthreads;
+    int next = 0, in_flight = 0, ret = EXIT_FAILURE, i;
+    int tid = conf->reg ? tid0 : 0;
+    int tid_end = conf->reg ? tid0 + 1 : sam_hdr_nref(h);
+    hts_pos_t cbeg = -1, chunk, total = 0;
+    mplp_readers_t rd = { conf, nfn, fn, fn_idx, h, rc };
+    mplp_chunk_t *chunks = NULL;
+    hts_tpool *pool = NULL;
+    hts_tpool_process *q = NULL;
+
+    for (i = tid; i < tid_end; i++)
+        total += conf->reg
+            ? MIN(end0, sam_hdr_tid2len(h, i)) - beg0
+            : sam_hdr_tid2len(h, i);
+    chunk = total / (8 * nthreads);
+    chunk = MAX(MPLP_CHUNK_MIN, MIN(MPLP_CHUNK_MAX, chunk));
+    if (conf->chunk_size)
+        chunk = conf->chunk_size;
+
+    pthread_mutex_init(&rd.lock, NULL);
+    pthread_cond_init(&rd.cond, NULL);
+    if (!(rd.r = calloc(nthreads, sizeof(*rd.r)))
+        || !(rd.avail = malloc(nthreads * sizeof(*rd.avail)))
+        || !(chunks = calloc(nslot, sizeof(*chunks))))
+        goto err;
+    for (rd.navail = 0; rd.navail < nthreads; rd.navail++)
+        rd.avail[rd.navail] = rd.navail;
+    for (i = 0; i < nslot; i++)
+        chunks[i].readers = &rd;
+
+    if (!(pool = hts_tpool_init(nthreads))
+        || !(q = hts_tpool_process_init(pool, nslot, 0)))
+        goto err;
+
+    for (;;) {
+        // Queue chunks, one reference after another
+        while (tid < tid_end && in_flight < nslot) {
+            hts_pos_t len = sam_hdr_tid2len(h, tid);
+            hts_pos_t beg = conf->reg ? beg0 : 0;
+            hts_pos_t end = conf->reg ? MIN(end0, len) : len;
+            if (cbeg < 0) {
+                if (beg >= end || (conf->bed
+                                   && !bed_overlap(conf->bed,
+                                                   sam_hdr_tid2name(h, tid),
+                                                   beg, end))) {
+                    tid++; // nothing to pile up
+                    continue;
+                }
+                cbeg = beg;
+            }
+            mplp_chunk_t *c = &chunks[next];
+            c->tid = tid;
+            c->beg = cbeg;
+            c->end = MIN(cbeg + chunk, end);
+            if (c->end >= end) {
+                tid++;
+                cbeg = -1;
+            } else {
+                cbeg = c->end;
+            }
+            if (hts_tpool_dispatch(pool, q, mplp_chunk, c) < 0)
+                goto err;
+            next = (next + 1) % nslot;
+            in_flight++;
+        }
+        if (!in_flight)
+            break;
+
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        if (!res)
+            goto err;
+        mplp_chunk_t *c = (mplp_chunk_t *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+        if (c->ret < 0) {
+            print_error("mpileup", "error reading from input file");
+            goto err;
+        }
+        if (mplp_write(fp, &c->out, 1) < 0)
+            goto err;
+    }
+
+    ret = 0;
+ err:
+    if (q)
+        hts_tpool_process_destroy(q);
+    if (pool)
+        hts_tpool_destroy(pool);
+    if (chunks) {
+        for (i = 0; i < nslot; i++)
+            ks_free(&chunks[i].out);
+        free(chunks);
+    }
+    if (rd.r) {
+        for (i = 0; i < nthreads; i++)
+            mplp_reader_close(&rd, &rd.r[i]);
+        free(rd.r);
+    }
+    free(rd.avail);
+    pthread_mutex_destroy(&rd.lock);
+    pthread_cond_destroy(&rd.cond);
+    return ret;
+}
+
 /*
  * Performs pileup
  * @param conf configuration for this pileup
@@ -458,16 +1352,21 @@ static int mpileup(mplp_conf_t *conf, int nfn, char **fn, char **fn_idx)
     hts_pos_t pos, beg0 = 0, end0 = HTS_POS_MAX, ref_len;
     const bam_pileup1_t **plp;
     mplp_ref_t mp_ref = MPLP_REF_INIT;
-    bam_mplp_t iter;
+    bam_mplp_t iter = NULL;
     sam_hdr_t *h = NULL; /* header of first file in input list */
     char *ref;
-    FILE *pileup_fp = NULL;
+    BGZF *pileup_fp = NULL;
 
     bam_sample_t *sm = NULL;
     kstring_t buf;
     mplp_pileup_t gplp;
+    kstring_t line = KS_INITIALIZE;
+    mplp_fmt_t fmt = { KS_INITIALIZE, KS_INITIALIZE, KS_INITIALIZE };
+    mplp_bin_t bin;
+    int ret;
 
     memset(&gplp, 0, sizeof(mplp_pileup_t));
+    memset(&bin, 0, sizeof(bin));
     memset(&buf, 0, sizeof(kstring_t));
     data = calloc(nfn, sizeof(mplp_aux_t*));
     plp = calloc(nfn, sizeof(bam_pileup1_t*));
@@ -554,20 +1453,24 @@ static int mpileup(mplp_conf_t *conf, int nfn, char **fn, char **fn_idx)
     fprintf(stderr, "[%s] %d samples in %d input files\n",
             __func__, sm->n, nfn);
 
-    pileup_fp = conf->output_fname? fopen(conf->output_fname, "w") : stdout;
+    if (conf->fai && !(mp_ref.rc = ref_cache_init(conf->fai, 0))) {
+        fprintf(stderr, "[%s] failed to set up the reference cache\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+
+    pileup_fp = mplp_open_output(conf);
 
     if (pileup_fp == NULL) {
         fprintf(stderr, "[%s] failed to write to %s: %s\n", __func__, conf->output_fname, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    // init pileup
-    iter = bam_mplp_init(nfn, mplp_func, (void**)data);
-    if (conf->flag & MPLP_PRINT_MODS) {
-        bam_mplp_constructor(iter, pileup_cd_create);
-        bam_mplp_destructor(iter, pileup_cd_destroy);
+    if (conf->binary && mplp_bin_open(&bin, pileup_fp, conf->output_fname,
+                                      nfn, fn, conf->binary > 1) < 0) {
+        ret = EXIT_FAILURE;
+        goto fail;
     }
-    if ( conf->flag & MPLP_SMART_OVERLAPS ) bam_mplp_init_overlaps(iter);
+
     if ( !conf->max_depth ) {
         max_depth = INT_MAX;
         fprintf(stderr, "[%s] Max depth set to maximum value (%d)\n", __func__, INT_MAX);
@@ -577,17 +1480,28 @@ static int mpileup(mplp_conf_t *conf, int nfn, char **fn, char **fn_idx)
             fprintf(stderr, "[%s] Combined max depth is above 1M. Potential memory hog!\n", __func__);
     }
 
+    if (conf->ga.nthreads > 0 && !conf->all && !conf->binary
+        && mplp_indexed(data, nfn, fn, fn_idx)) {
+        ret = mpileup_threaded(conf, nfn, fn, fn_idx, h, mp_ref.rc,
+                               tid0, beg0, end0, pileup_fp);
+        goto fail;
+    }
+
+    // init pileup
+    iter = bam_mplp_init(nfn, mplp_func, (void**)data);
+    if (conf->flag & MPLP_PRINT_MODS) {
+        bam_mplp_constructor(iter, pileup_cd_create);
+        bam_mplp_destructor(iter, pileup_cd_destroy);
+    }
+    if ( conf->flag & MPLP_SMART_OVERLAPS ) bam_mplp_init_overlaps(iter);
+
 
     bam_mplp_set_maxcnt(iter, max_depth);
-    int ret;
     int last_tid = -1;
     hts_pos_t last_pos = -1;
     int one_seq = 0;
 
     // begin pileup
-    kstring_t ks_seq = KS_INITIALIZE;
-    kstring_t ks_mod = KS_INITIALIZE;
-    kstring_t ks_qual = KS_INITIALIZE;
     while ( (ret=bam_mplp64_auto(iter, &tid, &pos, n_plp, plp)) > 0) {
         one_seq = 1; // at least 1 output
         if (conf->reg && (pos < beg0 || pos >= end0)) continue; // out of the region requested
@@ -598,7 +1512,11 @@ static int mpileup(mplp_conf_t *conf, int nfn, char **fn, char **fn_idx)
                     while (++last_pos < sam_hdr_tid2len(h, last_tid)) {
                         if (conf->bed && bed_overlap(conf->bed, sam_hdr_tid2name(h, last_tid), last_pos, last_pos + 1) == 0)
                             continue;
-                        print_empty_pileup(pileup_fp, conf, sam_hdr_tid2name(h, last_tid), last_pos, nfn, ref, ref_len);
+                        if (mplp_empty_column(&line, &bin, conf, sam_hdr_tid2name(h, last_tid), last_pos, nfn, ref, ref_len) < 0
+                            || mplp_write(pileup_fp, &line, 0) < 0) {
+                            ret = EXIT_FAILURE;
+                            goto fail;
+                        }
                     }
                 }
                 last_tid++;
@@ -618,208 +1536,36 @@ static int mpileup(mplp_conf_t *conf, int nfn, char **fn, char **fn_idx)
                 if (conf->reg && last_pos < beg0) continue; // out of range; skip
                 if (conf->bed && bed_overlap(conf->bed, sam_hdr_tid2name(h, tid), last_pos, last_pos + 1) == 0)
                     continue;
-                print_empty_pileup(pileup_fp, conf, sam_hdr_tid2name(h, tid), last_pos, nfn, ref, ref_len);
+                if (mplp_empty_column(&line, &bin, conf, sam_hdr_tid2name(h, tid), last_pos, nfn, ref, ref_len) < 0
+                    || mplp_write(pileup_fp, &line, 0) < 0) {
+                    ret = EXIT_FAILURE;
+                    goto fail;
+                }
             }
             last_tid = tid;
             last_pos = pos;
         }
         if (conf->bed && tid >= 0 && !bed_overlap(conf->bed, sam_hdr_tid2name(h, tid), pos, pos+1)) continue;
 
-        fprintf(pileup_fp, "%s\t%"PRIhts_pos"\t%c", sam_hdr_tid2name(h, tid), pos + 1, (ref && pos < ref_len)? ref[pos] : 'N');
-        for (i = 0; i < nfn; ++i) {
-            int j, cnt, err = 0;
-            ks_clear(&ks_seq);
-            ks_clear(&ks_qual);
-            ks_clear(&ks_mod);
-            for (j = cnt = 0; j < n_plp[i]; ++j) {
-                const bam_pileup1_t *p = plp[i] + j;
-                int c = p->qpos < p->b->core.l_qseq
-                    ? bam_get_qual(p->b)[p->qpos]
-                    : 0;
-                if (c >= conf->min_baseQ) {
-                    // Build up seq
-                    err |= pileup_seq(&ks_seq, plp[i] + j, pos, ref_len,
-                                      ref, &ks_mod, conf->rev_del,
-                                      conf->no_ins, conf->no_ins_mods,
-                                      conf->no_del, conf->no_ends) < 0;
-
-                    // Build up qual
-                    err |= kputc_(c+33 < 126 ? c+33 : 126, &ks_qual) < 0;
-                    cnt++;
-                }
-            }
-            if (err) {
-                ret = 1;
+        if (bin.fp) {
+            if (mplp_bin_add(&bin, conf, sam_hdr_tid2name(h, tid), pos,
+                             n_plp, plp, ref, ref_len) < 0) {
+                ret = EXIT_FAILURE;
                 goto fail;
             }
-            fprintf(pileup_fp, "\t%d\t", cnt);
-
-            if (n_plp[i] == 0) {
-                fputs("*\t*", pileup_fp);
-                int flag_value = MPLP_PRINT_MAPQ_CHAR;
-                while(flag_value < MPLP_PRINT_LAST) {
-                    if (flag_value != MPLP_PRINT_MODS
-                        && (conf->flag & flag_value))
-                        fputs("\t*", pileup_fp);
-                    flag_value <<= 1;
-                }
-                if (conf->auxlist) {
-                    int t = 0;
-                    while(t++ < ((klist_t(auxlist) *)conf->auxlist)->size)
-                        fputs("\t*", pileup_fp);
-                }
-            } else {
-                if (ks_seq.l) {
-                    fwrite(ks_seq.s, 1, ks_seq.l, pileup_fp);
-                } else {
-                    putc('*', pileup_fp);
-                }
-                putc('\t', pileup_fp);
-
-                if (ks_qual.l) {
-                    fwrite(ks_qual.s, 1, ks_qual.l, pileup_fp);
-                } else {
-                    putc('*', pileup_fp);
-                }
-
-                /* Print selected columns */
-                int flag_value = MPLP_PRINT_MAPQ_CHAR;
-                while(flag_value < MPLP_PRINT_LAST) {
-                    if (flag_value != MPLP_PRINT_MODS
-                        && (conf->flag & flag_value)) {
-                        int n = 0;
-                        putc('\t', pileup_fp);
-                        for (j = 0; j < n_plp[i]; ++j) {
-                            const bam_pileup1_t *p = &plp[i][j];
-                            int c = p->qpos < p->b->core.l_qseq
-                                ? bam_get_qual(p->b)[p->qpos]
-                                : 0;
-                            if ( c < conf->min_baseQ ) continue;
-                            if (n > 0 && flag_value != MPLP_PRINT_MAPQ_CHAR) putc(',', pileup_fp);
-                            n++;
-
-                            switch (flag_value) {
-                            case MPLP_PRINT_MAPQ_CHAR:
-                                c = p->b->core.qual + 33;
-                                if (c > 126) c = 126;
-                                putc(c, pileup_fp);
-                                break;
-                            case MPLP_PRINT_QPOS:
-                                // query position in current orientation
-                                fprintf(pileup_fp, "%d", p->qpos + 1);
-                                break;
-                            case MPLP_PRINT_QPOS5: {
-                                // query position in 5' to 3' orientation
-                                int pos5 = bam_is_rev(p->b)
-                                    ? p->b->core.l_qseq-p->qpos + p->is_del
-                                    : p->qpos + 1;
-                                fprintf(pileup_fp, "%d", pos5);
-                                break;
-                            }
-                            case MPLP_PRINT_QNAME:
-                                fputs(bam_get_qname(p->b), pileup_fp);
-                                break;
-                            case MPLP_PRINT_FLAG:
-                                fprintf(pileup_fp, "%d", p->b->core.flag);
-                                break;
-                            case MPLP_PRINT_RNAME:
-                                if (p->b->core.tid >= 0)
-                                    fputs(sam_hdr_tid2name(h, p->b->core.tid), pileup_fp);
-                                else
-                                    putc('*', pileup_fp);
-                                break;
-                            case MPLP_PRINT_POS:
-                                fprintf(pileup_fp, "%"PRId64, (int64_t) p->b->core.pos + 1);
-                                break;
-                            case MPLP_PRINT_MAPQ:
-                                fprintf(pileup_fp, "%d", p->b->core.qual);
-                                break;
-                            case MPLP_PRINT_RNEXT:
-                                if (p->b->core.mtid >= 0)
-                                    fputs(sam_hdr_tid2name(h, p->b->core.mtid), pileup_fp);
-                                else
-                                    putc('*', pileup_fp);
-                                break;
-                            case MPLP_PRINT_PNEXT:
-                                fprintf(pileup_fp, "%"PRId64, (int64_t) p->b->core.mpos + 1);
-                                break;
-                            case MPLP_PRINT_RLEN:
-                                fprintf(pileup_fp, "%d", p->b->core.l_qseq);
-                                break;
-                            }
-                        }
-                        if (!n) putc('*', pileup_fp);
-                    }
-                    flag_value <<= 1;
-                }
-
-                /* Print selected tags */
-                klist_t(auxlist) *auxlist_p = ((klist_t(auxlist) *)conf->auxlist);
-                if (auxlist_p && auxlist_p->size) {
-                    kliter_t(auxlist) *aux;
-                    for (aux = kl_begin(auxlist_p); aux != kl_end(auxlist_p); aux = kl_next(aux)) {
-                        int n = 0; // NB shadows outer loop
-                        putc('\t', pileup_fp);
-                        for (j = 0; j < n_plp[i]; ++j) {
-                            const bam_pileup1_t *p = &plp[i][j];
-                            int c = p->qpos < p->b->core.l_qseq
-                                ? bam_get_qual(p->b)[p->qpos]
-                                : 0;
-                            if ( c < conf->min_baseQ ) continue;
-
-                            if (n > 0) putc(conf->sep, pileup_fp);
-                            n++;
-                            uint8_t* tag_u = bam_aux_get(p->b, kl_val(aux));
-                            if (!tag_u) {
-                                putc(conf->empty , pileup_fp);
-                                continue;
-                            }
-
-                            int tag_supported = 0;
-
-                            /* Tag value is string */
-                            if (*tag_u == 'Z' || *tag_u == 'H') {
-                                char *tag_s = bam_aux2Z(tag_u);
-                                if (!tag_s) continue;
-                                fputs(tag_s, pileup_fp);
-                                tag_supported = 1;
-                            }
-
-                            /* Tag value is integer */
-                            if (*tag_u == 'I' || *tag_u == 'i' || *tag_u == 'C' || *tag_u == 'c' || *tag_u == 'S' || *tag_u == 's') {
-                                int64_t tag_i = bam_aux2i(tag_u);
-                                fprintf(pileup_fp, "%" PRId64 "", tag_i);
-                                tag_supported = 1;
-                            }
-
-                            /* Tag value is float */
-                            if (*tag_u == 'd' || *tag_u == 'f') {
-                                double tag_f = bam_aux2f(tag_u);
-                                fprintf(pileup_fp, "%lf", tag_f);
-                                tag_supported = 1;
-                            }
-
-                            /* Tag value is character */
-                            if (*tag_u == 'A') {
-                                char tag_c = bam_aux2A(tag_u);
-                                putc(tag_c, pileup_fp);
-                                tag_supported = 1;
-                            }
-
-                            if (!tag_supported) putc('*', pileup_fp);
-                        }
-                        if (!n) putc('*', pileup_fp);
-                    }
-                }
-            }
+            continue;
+        }
+        if (mplp_format_column(&line, conf, h, &fmt, tid, pos, nfn, n_plp,
+                               plp, ref, ref_len) < 0) {
+            ret = 1;
+            goto fail;
+        }
+        if (mplp_write(pileup_fp, &line, 0) < 0) {
+            ret = EXIT_FAILURE;
+            goto fail;
         }
-        putc('\n', pileup_fp);
     }
 
-    ks_free(&ks_seq);
-    ks_free(&ks_mod);
-    ks_free(&ks_qual);
-
     if (ret < 0) {
         print_error("mpileup", "error reading from input file");
         ret = EXIT_FAILURE;
@@ -841,7 +1587,11 @@ static int mpileup(mplp_conf_t *conf, int nfn, char **fn, char **fn_idx)
                 if (last_pos >= end0) break;
                 if (conf->bed && bed_overlap(conf->bed, sam_hdr_tid2name(h, last_tid), last_pos, last_pos + 1) == 0)
                     continue;
-                print_empty_pileup(pileup_fp, conf, sam_hdr_tid2name(h, last_tid), last_pos, nfn, ref, ref_len);
+                if (mplp_empty_column(&line, &bin, conf, sam_hdr_tid2name(h, last_tid), last_pos, nfn, ref, ref_len) < 0
+                    || mplp_write(pileup_fp, &line, 0) < 0) {
+                    ret = EXIT_FAILURE;
+                    goto fail;
+                }
             }
             last_tid++;
             last_pos = -1;
@@ -849,14 +1599,27 @@ static int mpileup(mplp_conf_t *conf, int nfn, char **fn, char **fn_idx)
                 break;
         }
     }
+    if (mplp_write(pileup_fp, &line, 1) < 0)
+        ret = EXIT_FAILURE;
 
 fail:
     // clean up
-    if (pileup_fp && conf->output_fname) fclose(pileup_fp);
+    if (mplp_bin_close(&bin) < 0)
+        ret = EXIT_FAILURE;
+    if (pileup_fp && bgzf_close(pileup_fp) < 0 && ret == 0) {
+        print_error_errno("mpileup", "error closing output");
+        ret = EXIT_FAILURE;
+    }
     bam_smpl_destroy(sm); free(buf.s);
     for (i = 0; i < gplp.n; ++i) free(gplp.plp[i]);
     free(gplp.plp); free(gplp.n_plp); free(gplp.m_plp);
-    bam_mplp_destroy(iter);
+    ks_free(&line);
+    ks_free(&fmt.seq);
+    ks_free(&fmt.qual);
+    ks_free(&fmt.mod);
+    if (iter) bam_mplp_destroy(iter);
+    mplp_ref_release(&mp_ref, h);
+    ref_cache_destroy(mp_ref.rc);
     sam_hdr_destroy(h);
     for (i = 0; i < nfn; ++i) {
         sam_close(data[i]->fp);
@@ -864,8 +1627,6 @@ fail:
         free(data[i]);
     }
     free(data); free(plp); free(n_plp);
-    free(mp_ref.ref[0]);
-    free(mp_ref.ref[1]);
     return ret;
 }
 
@@ -994,11 +1755,13 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 "                           Use twice for complete deletion removal\n"
 "      --no-output-ends     remove ^MQUAL and $ markup in sequence column\n"
 "      --reverse-del        use '#' character for deletions on the reverse strand\n"
+"      --binary             write BGZF compressed binary allele counts per column\n"
+"      --binary-qual        as --binary, adding base quality sums\n"
 "  -a                       output all positions (including zero depth)\n"
 "  -a -a (or -aa)           output absolutely all positions, including unused ref. sequences\n"
 "\n"
 "Generic options:\n");
-    sam_global_opt_help(fp, "-.--.--.");
+    sam_global_opt_help(fp, "-.--.@-.");
 
     fprintf(fp, "\n"
 "Note that using \"samtools mpileup\" to generate BCF or VCF files has been\n"
@@ -1031,7 +1794,7 @@ int bam_mpileup(int argc, char *argv[])
 
     static const struct option lopts[] =
     {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '-'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '@', '-', '-'),
         {"rf", required_argument, NULL, 1},   // require flag
         {"ff", required_argument, NULL, 2},   // filter flag
         {"incl-flags", required_argument, NULL, 1},
@@ -1088,10 +1851,13 @@ int bam_mpileup(int argc, char *argv[])
         {"no-output-ins-mods", no_argument, NULL, 11},
         {"no-output-del", no_argument, NULL, 12},
         {"no-output-ends", no_argument, NULL, 13},
+        {"binary", no_argument, NULL, 15},
+        {"binary-qual", no_argument, NULL, 16},
+        {"chunk-size", required_argument, NULL, 17}, // for testing
         {NULL, 0, NULL, 0}
     };
 
-    while ((c = getopt_long(argc, argv, "Af:r:l:q:Q:RC:Bd:b:o:EG:6OsxXaM",lopts,NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "Af:r:l:q:Q:RC:Bd:b:o:EG:6OsxXaM@:",lopts,NULL)) >= 0) {
         switch (c) {
         case 'x': mplp.flag &= ~MPLP_SMART_OVERLAPS; break;
         case  1 :
@@ -1117,6 +1883,18 @@ int bam_mpileup(int argc, char *argv[])
         case 11: mplp.no_ins_mods = 1; break;
         case 12: mplp.no_del++; break;
         case 13: mplp.no_ends = 1; break;
+        case 15: if (!mplp.binary) mplp.binary = 1; break;
+        case 16: mplp.binary = 2; break;
+        case 17: {
+            char *end;
+            errno = 0;
+            mplp.chunk_size = strtoll(optarg, &end, 10);
+            if (end == optarg || *end || errno == ERANGE || mplp.chunk_size < 1) {
+                print_error("mpileup", "invalid --chunk-size \"%s\"", optarg);
+                return 1;
+            }
+            break;
+        }
         case 'f':
             mplp.fai = fai_load(optarg);
             if (mplp.fai == NULL) return 1;
@@ -26,9 +26,16 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <htslib/hts.h>
 #include <htslib/sam.h>
+#include <htslib/hfile.h>
+#include <htslib/cram.h>
+#include <htslib/thread_pool.h>
+#include <htslib/hts_endian.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
 #include <unistd.h>
+#include <zlib.h>
 
 /* File status flags (zero means OK). It's possible for more than one to be
  * set on a single file.   The final exit status is the bitwise-or of the
@@ -38,6 +45,7 @@ DEALINGS IN THE SOFTWARE.  */
 #define QC_BAD_HEADER    8
 #define QC_NO_EOF_BLOCK 16
 #define QC_FAIL_CLOSE   32
+#define QC_BAD_BLOCK    64
 
 static void usage_quickcheck(FILE *write_to)
 {
@@ -47,6 +55,9 @@ static void usage_quickcheck(FILE *write_to)
 "  -v              verbose output (repeat for more verbosity)\n"
 "  -q              suppress warning messages\n"
 "  -u              unmapped input (do not require targets in header)\n"
+"  -d              deep check: verify the CRC32 of every BGZF block or\n"
+"                  CRAM container and block\n"
+"  -@ INT          number of additional threads for the deep check [0]\n"
 "\n"
 "Notes:\n"
 "\n"
@@ -72,16 +83,264 @@ static void usage_quickcheck(FILE *write_to)
     );
 }
 
+/*
+ * Deep checking of BGZF files.  The main thread reads whole blocks from
+ * the file into chunks, using only the BSIZE field of each header to find
+ * the next one.  Each chunk is inflated, and its blocks' CRC32 and ISIZE
+ * checked, on the thread pool.  Chunks are collected in file order, so
+ * the first bad block reported is the first in the file.
+ */
+#define QC_CHUNK_SIZE (1 << 20)
+#define BGZF_MAX_BLOCK 65536
+
+typedef struct {
+    uint8_t *data;
+    size_t len, size;
+    int64_t offset;    // file offset of data
+    int64_t bad;       // offset of the first bad block, or -1
+} qc_chunk_t;
+
+// Returns the size of the BGZF block starting with the len bytes at hdr
+// (the fixed header and the extra field), or -1 if it is not one.
+static int64_t bgzf_block_size(const uint8_t *hdr, size_t len) {
+    size_t xlen, i;
+
+    if (len < 12 || hdr[0] != 31 || hdr[1] != 139 || hdr[2] != 8
+        || !(hdr[3] & 4))
+        return -1;
+    xlen = le_to_u16(hdr + 10);
+    if (len < 12 + xlen)
+        return -1;
+    for (i = 12; i + 4 <= 12 + xlen; i += 4 + le_to_u16(hdr + i + 2)) {
+        if (hdr[i] == 'B' && hdr[i+1] == 'C' && le_to_u16(hdr + i + 2) == 2
+            && i + 6 <= 12 + xlen)
+            return (int64_t) le_to_u16(hdr + i + 4) + 1;
+    }
+    return -1;
+}
+
+static void *check_bgzf_chunk(void *arg) {
+    qc_chunk_t *ck = (qc_chunk_t *)arg;
+    uint8_t out[BGZF_MAX_BLOCK];
+    size_t off = 0;
+    z_stream zs;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK) {
+        ck->bad = ck->offset;
+        return ck;
+    }
+
+    ck->bad = -1;
+    while (off < ck->len) {
+        const uint8_t *blk = ck->data + off;
+        size_t hlen = 12 + le_to_u16(blk + 10);
+        size_t bsize = bgzf_block_size(blk, hlen);
+        uint32_t crc = le_to_u32(blk + bsize - 8);
+        uint32_t isize = le_to_u32(blk + bsize - 4);
+
+        // Block sizes were checked when the chunk was read
+        zs.next_in = (Bytef *) blk + hlen;
+        zs.avail_in = bsize - hlen - 8;
+        zs.next_out = out;
+        zs.avail_out = sizeof(out);
+        if (isize > sizeof(out)
+            || inflate(&zs, Z_FINISH) != Z_STREAM_END
+            || zs.avail_in != 0
+            || sizeof(out) - zs.avail_out != isize
+            || crc32(crc32(0L, NULL, 0), out, isize) != crc
+            || inflateReset(&zs) != Z_OK) {
+            ck->bad = ck->offset + off;
+            break;
+        }
+        off += bsize;
+    }
+    inflateEnd(&zs);
+    return ck;
+}
+
+// Reads whole blocks into ck until it holds at least QC_CHUNK_SIZE bytes
+// or the file ends.
+// Returns 0 on success,
+//         1 at the end of the file,
+//        -1 if the file could not be read or a block header is bad, with
+//           the offset of the block in ck->bad.
+static int read_bgzf_chunk(hFILE *fp, int64_t *offset, qc_chunk_t *ck) {
+    ck->len = 0;
+    ck->offset = *offset;
+    ck->bad = -1;
+    while (ck->len < QC_CHUNK_SIZE) {
+        uint8_t *hdr;
+        int64_t bsize;
+        ssize_t n;
+
+        if (ck->size - ck->len < BGZF_MAX_BLOCK) {
+            uint8_t *tmp = realloc(ck->data, ck->len + BGZF_MAX_BLOCK);
+            if (!tmp) {
+                ck->bad = *offset;
+                return -1;
+            }
+            ck->data = tmp;
+            ck->size = ck->len + BGZF_MAX_BLOCK;
+        }
+        hdr = ck->data + ck->len;
+
+        if ((n = hread(fp, hdr, 12)) == 0)
+            return ck->len ? 0 : 1;
+        if (n != 12
+            || hread(fp, hdr + 12, le_to_u16(hdr + 10)) != le_to_u16(hdr + 10)
+            || (bsize = bgzf_block_size(hdr, 12 + le_to_u16(hdr + 10))) < 0
+            || bsize < 12 + le_to_u16(hdr + 10) + 8
+            || hread(fp, hdr + 12 + le_to_u16(hdr + 10),
+                     bsize - 12 - le_to_u16(hdr + 10))
+               != bsize - 12 - le_to_u16(hdr + 10)) {
+            ck->bad = *offset;
+            return -1;
+        }
+        ck->len += bsize;
+        *offset += bsize;
+    }
+    return 0;
+}
+
+// Returns the offset of the first bad block, or -1 if all are good.
+static int64_t check_bgzf_blocks(const char *fn, int nthreads) {
+    int njob = nthreads > 0 ? 2 * nthreads : 1, next = 0, in_flight = 0;
+    int64_t offset = 0, bad = -1;
+    qc_chunk_t *ck = calloc(njob, sizeof(*ck));
+    hts_tpool *pool = NULL;
+    hts_tpool_process *q = NULL;
+    hFILE *fp = NULL;
+    int i, r = 0;
+
+    if (!ck || !(fp = hopen(fn, "r"))
+        || (nthreads > 0 && (!(pool = hts_tpool_init(nthreads))
+                             || !(q = hts_tpool_process_init(pool, njob, 0)))))
+    {
+        bad = 0;
+        goto out;
+    }
+
+    if (!pool) {
+        while (bad < 0 && (r = read_bgzf_chunk(fp, &offset, ck)) == 0) {
+            check_bgzf_chunk(ck);
+            bad = ck->bad;
+        }
+        if (bad < 0 && r < 0)
+            bad = ck->bad;
+        goto out;
+    }
+
+    for (;;) {
+        // After a bad block the remaining chunks are only collected
+        while (bad < 0 && r == 0 && in_flight < njob) {
+            qc_chunk_t *c = &ck[next];
+            if ((r = read_bgzf_chunk(fp, &offset, c)) < 0) {
+                bad = c->bad;
+                break;
+            }
+            if (r > 0)
+                break;
+            if (hts_tpool_dispatch(pool, q, check_bgzf_chunk, c) < 0) {
+                bad = c->offset;
+                break;
+            }
+            next = (next + 1) % njob;
+            in_flight++;
+        }
+        if (!in_flight)
+            break;
+
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        if (!res) {
+            bad = offset;
+            break;
+        }
+        qc_chunk_t *c = (qc_chunk_t *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+        // A failed read may already have set a later offset
+        if (c->bad >= 0 && (bad < 0 || c->bad < bad))
+            bad = c->bad;
+    }
+
+ out:
+    if (q)
+        hts_tpool_process_destroy(q);
+    if (pool)
+        hts_tpool_destroy(pool);
+    if (fp && hclose(fp) < 0 && bad < 0)
+        bad = offset;
+    if (ck) {
+        for (i = 0; i < njob; i++)
+            free(ck[i].data);
+        free(ck);
+    }
+    return bad;
+}
+
+/*
+ * Deep checking of CRAM files.  Every container and block is read with
+ * its CRC32 checked (CRAM 3.0 onwards), but not decoded.  The file must
+ * end with the EOF container.
+ *
+ * Returns the offset of the first bad container, or -1 if all are good.
+ */
+static int64_t check_cram_blocks(const char *fn) {
+    htsFile *fp = hts_open(fn, "r");
+    sam_hdr_t *h = NULL;
+    cram_fd *fd;
+    int64_t bad = 0, pos = 0;
+    int eof = 0;
+
+    if (!fp || hts_get_format(fp)->format != cram
+        || hts_set_opt(fp, CRAM_OPT_IGNORE_CHKSUM, 0)
+        || !(h = sam_hdr_read(fp)))
+        goto out;
+    fd = fp->fp.cram;
+
+    for (;;) {
+        cram_container *c;
+        int32_t len, used = 0;
+
+        pos = htell(cram_fd_get_fp(fd));
+        if (!(c = cram_read_container(fd)))
+            break;
+        eof = cram_container_is_empty(fd);
+        len = cram_container_get_length(c);
+        while (used < len) {
+            cram_block *b = cram_read_block(fd);
+            if (!b)
+                break;
+            used += cram_block_size(b);
+            cram_free_block(b);
+        }
+        cram_free_container(c);
+        if (used != len) {
+            bad = pos;
+            goto out;
+        }
+    }
+    bad = eof ? -1 : pos;
+
+ out:
+    if (h)
+        sam_hdr_destroy(h);
+    if (fp && hts_close(fp) < 0 && bad < 0)
+        bad = pos;
+    return bad;
+}
+
 #define QC_ERR(state, v, msg, arg1)                                     \
     file_state |= (state);                                              \
     if (!quiet || verbose >= (v)) fprintf(stderr, (msg), (arg1))
 
 int main_quickcheck(int argc, char** argv)
 {
-    int verbose = 0, quiet = 0, unmapped = 0;
+    int verbose = 0, quiet = 0, unmapped = 0, deep = 0, nthreads = 0;
     hts_verbose = 0;
 
-    const char* optstring = "vqu";
+    const char* optstring = "vqud@:";
     int opt;
     while ((opt = getopt(argc, argv, optstring)) != -1) {
         switch (opt) {
@@ -94,6 +353,12 @@ int main_quickcheck(int argc, char** argv)
         case 'q':
             quiet = 1;
             break;
+        case 'd':
+            deep = 1;
+            break;
+        case '@':
+            nthreads = atoi(optarg);
+            break;
         default:
             usage_quickcheck(stderr);
             return 1;
@@ -175,6 +440,26 @@ int main_quickcheck(int argc, char** argv)
                 }
             }
 
+            // check the CRC32 of every block, without decoding records
+            if (deep && !(file_state & (QC_NOT_SEQUENCE | QC_BAD_HEADER))) {
+                int64_t bad = -1;
+                if (strcmp(fn, "-") == 0) {
+                    if (verbose >= 3) fprintf(stderr, "%s cannot be deep checked as it is read from stdin.\n", fn);
+                } else if (fmt->format == cram) {
+                    bad = check_cram_blocks(fn);
+                } else if (fmt->compression == bgzf) {
+                    bad = check_bgzf_blocks(fn, nthreads);
+                } else if (verbose >= 3) {
+                    fprintf(stderr, "%s cannot be deep checked as it is not BGZF or CRAM.\n", fn);
+                }
+                if (bad >= 0) {
+                    QC_ERR(QC_BAD_BLOCK, 2, "%s failed the deep check", fn);
+                    if (!quiet || verbose >= 2) fprintf(stderr, " at offset %"PRId64".\n", bad);
+                } else if (verbose >= 3 && (fmt->format == cram || fmt->compression == bgzf)) {
+                    fprintf(stderr, "%s has good blocks.\n", fn);
+                }
+            }
+
             if (hts_close(hts_fp) < 0) {
                 QC_ERR(QC_FAIL_CLOSE, 2, "%s did not close cleanly.\n", fn);
             }
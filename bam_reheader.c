@@ -25,20 +25,35 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <config.h>
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for copy_file_range()
+#endif
 #include <stdio.h>
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
 #include <getopt.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "htslib/bgzf.h"
 #include "htslib/sam.h"
 #include "htslib/hfile.h"
 #include "htslib/cram.h"
+#include "htslib/kstring.h"
+#include "htslib/hts_endian.h"
 #include "samtools.h"
 
 #define BUF_SIZE 0x10000
 
+// The size of a BGZF block holding n bytes uncompressed is n plus this:
+// the 18 byte block header, a 5 byte stored deflate block header and the
+// 8 byte footer.
+#define BGZF_STORED_OVERHEAD 31
+
 /*
  * Reads a file and outputs a new BAM file to fd with 'h' replaced as
  * the header.    No checks are made to the validity.
@@ -112,6 +127,287 @@ int bam_reheader(BGZF *in, sam_hdr_t *h, int fd,
     return -1;
 }
 
+/*
+ * Returns the file offset of the first BGZF block after the header just
+ * read from fp, or -1 if the header doesn't end on a block boundary.
+ * samtools and htslib always flush after writing a BAM header.
+ */
+static int64_t bam_hdr_end(BGZF *fp)
+{
+    if (!fp->is_compressed || fp->block_offset < fp->block_length)
+        return -1;
+    return fp->block_length ? fp->block_address + fp->block_clength
+                            : fp->block_address;
+}
+
+// Compresses len bytes at data into BGZF blocks appended to out
+static int append_blocks(kstring_t *out, const void *data, size_t len,
+                         int level)
+{
+    const char *p = (const char *) data;
+    while (len > 0) {
+        size_t n = len < BGZF_BLOCK_SIZE ? len : BGZF_BLOCK_SIZE;
+        size_t clen = BGZF_MAX_BLOCK_SIZE;
+        if (ks_resize(out, out->l + clen) < 0
+            || bgzf_compress(out->s + out->l, &clen, p, n, level) < 0)
+            return -1;
+        // bam_hdr_blocks() relies on stored blocks having this size
+        if (level == 0 && clen != n + BGZF_STORED_OVERHEAD)
+            return -1;
+        out->l += clen;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Serialises h as the binary BAM header and compresses it into BGZF blocks
+ * in out.  If size is non-zero, the text is padded with NULs, stored
+ * uncompressed in blocks of its own, so the whole takes exactly size bytes.
+ * The length of the text is also stored uncompressed, so the padding
+ * doesn't change the size of anything else.
+ *
+ * Returns 0 on success;
+ *        -1 on general failure;
+ *        -2 if the header can't be made to take size bytes
+ */
+static int bam_hdr_blocks(sam_hdr_t *h, int64_t size, kstring_t *out)
+{
+    kstring_t refs = KS_INITIALIZE, ctext = KS_INITIALIZE;
+    kstring_t crefs = KS_INITIALIZE;
+    const char *text = sam_hdr_str(h);
+    size_t l_text = sam_hdr_length(h);
+    int i, nref = sam_hdr_nref(h), ret = -1;
+    int64_t gap, n_blk, pad, full = BGZF_BLOCK_SIZE + BGZF_STORED_OVERHEAD;
+    uint8_t head[8] = { 'B', 'A', 'M', 1 }, buf[4];
+    char *zeros = NULL;
+
+    if (!text || l_text > INT32_MAX)
+        goto out;
+
+    i32_to_le(nref, buf);
+    if (kputsn((char *) buf, 4, &refs) < 0)
+        goto out;
+    for (i = 0; i < nref; i++) {
+        const char *name = sam_hdr_tid2name(h, i);
+        hts_pos_t len = sam_hdr_tid2len(h, i);
+        // As in bam_hdr_write(), longer lengths are only in the @SQ text
+        u32_to_le(strlen(name) + 1, buf);
+        if (kputsn((char *) buf, 4, &refs) < 0
+            || kputsn(name, strlen(name) + 1, &refs) < 0)
+            goto out;
+        u32_to_le(len <= UINT32_MAX ? (uint32_t) len : 0, buf);
+        if (kputsn((char *) buf, 4, &refs) < 0)
+            goto out;
+    }
+
+    if (size == 0) {
+        kstring_t raw = KS_INITIALIZE;
+        i32_to_le(l_text, head + 4);
+        if (kputsn((char *) head, 8, &raw) >= 0
+            && kputsn(text, l_text, &raw) >= 0
+            && kputsn(refs.s, refs.l, &raw) >= 0
+            && append_blocks(out, raw.s, raw.l, -1) >= 0)
+            ret = 0;
+        ks_free(&raw);
+        goto out;
+    }
+
+    // magic + l_text (stored) | text | NUL padding (stored) | references
+    if (append_blocks(&ctext, text, l_text, -1) < 0
+        || append_blocks(&crefs, refs.s, refs.l, -1) < 0)
+        goto out;
+    gap = size - (8 + BGZF_STORED_OVERHEAD) - ctext.l - crefs.l;
+    if (gap < 0) {
+        ret = -2;
+        goto out;
+    }
+    n_blk = (gap + full - 1) / full;
+    pad = gap - n_blk * BGZF_STORED_OVERHEAD;
+    if (pad < n_blk || (int64_t) l_text + pad > INT32_MAX) {
+        ret = -2;
+        goto out;
+    }
+    if (!(zeros = calloc(1, BGZF_BLOCK_SIZE)))
+        goto out;
+
+    i32_to_le(l_text + pad, head + 4);
+    if (append_blocks(out, head, 8, 0) < 0
+        || kputsn(ctext.s, ctext.l, out) < 0)
+        goto out;
+    for (i = 0; i < n_blk; i++) {
+        // Spread the padding evenly, so every block has at least one byte
+        int64_t n = pad / (n_blk - i);
+        if (append_blocks(out, zeros, n, 0) < 0)
+            goto out;
+        pad -= n;
+    }
+    if (kputsn(crefs.s, crefs.l, out) < 0)
+        goto out;
+    ret = (int64_t) out->l == size ? 0 : -1;
+
+ out:
+    ks_free(&refs);
+    ks_free(&ctext);
+    ks_free(&crefs);
+    free(zeros);
+    return ret;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copies in_fd from offset off to its end onto out_fd
+static int copy_rest(int in_fd, int64_t off, int out_fd)
+{
+    char *buf;
+    ssize_t n;
+    off_t pos = off;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    // Lets the kernel copy, or share the extents on filesystems with reflinks
+    while ((n = copy_file_range(in_fd, &pos, out_fd, NULL, 1 << 30, 0)) > 0)
+        ;
+    if (n == 0)
+        return 0;
+    if (pos != off || (errno != EXDEV && errno != EINVAL && errno != ENOSYS
+                       && errno != EOPNOTSUPP && errno != EBADF))
+        return -1;
+    // Otherwise not supported for these files, eg. out_fd is a pipe
+#endif
+
+    if (!(buf = malloc(BUF_SIZE)))
+        return -1;
+    while ((n = pread(in_fd, buf, BUF_SIZE, pos)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (write_all(out_fd, buf, n) < 0)
+            break;
+        pos += n;
+    }
+    free(buf);
+    return n == 0 ? 0 : -1;
+}
+
+/*
+ * Outputs a new BAM file to fd with 'h' replaced as the header, copying
+ * the compressed records of fn unchanged from file offset hdr_end, which
+ * must be the end of the old header as returned by bam_hdr_end().
+ *
+ * Returns 0 on success;
+ *        -1 on general failure;
+ *        -2 if fn can't be copied this way, and nothing has been written
+ */
+int bam_reheader_copy(const char *fn, int64_t hdr_end, sam_hdr_t *h, int fd,
+                      const char *arg_list, int no_pg)
+{
+    kstring_t blocks = KS_INITIALIZE;
+    struct stat st;
+    int in_fd = -1, ret = -1;
+
+    if (!h || hdr_end < 0 || strcmp(fn, "-") == 0)
+        return -2;
+    if ((in_fd = open(fn, O_RDONLY)) < 0 || fstat(in_fd, &st) < 0
+        || !S_ISREG(st.st_mode)) {
+        ret = -2;
+        goto out;
+    }
+
+    if (!no_pg && sam_hdr_add_pg(h, "samtools",
+                           "VN", samtools_version(),
+                           arg_list ? "CL": NULL,
+                           arg_list ? arg_list : NULL,
+                           NULL) != 0)
+        goto out;
+
+    if (bam_hdr_blocks(h, 0, &blocks) < 0) {
+        print_error("reheader", "Couldn't compress the header");
+        goto out;
+    }
+    if (write_all(fd, blocks.s, blocks.l) < 0
+        || copy_rest(in_fd, hdr_end, fd) < 0) {
+        print_error_errno("reheader", "Error copying '%s' to output file", fn);
+        goto out;
+    }
+    ret = 0;
+
+ out:
+    if (in_fd >= 0) close(in_fd);
+    ks_free(&blocks);
+    return ret;
+}
+
+/*
+ * Replaces the header of the BAM file fn in place, by rewriting only the
+ * BGZF blocks before file offset hdr_end as returned by bam_hdr_end().
+ * The new header is padded to take exactly the same space, so the
+ * records, and any index, are left untouched.
+ *
+ * Returns 0 on success;
+ *        -1 on general failure;
+ *        -2 on failure due to insufficient size
+ */
+int bam_reheader_inplace(const char *fn, int64_t hdr_end, sam_hdr_t *h,
+                         const char *arg_list, int no_pg)
+{
+    kstring_t blocks = KS_INITIALIZE;
+    int fd = -1, ret = -1;
+
+    if (!h)
+        return -1;
+    if (hdr_end < 0) {
+        print_error("reheader", "the header of '%s' doesn't end on a BGZF "
+                    "block boundary; use the non-inplace version", fn);
+        return -1;
+    }
+
+    if (!no_pg && sam_hdr_add_pg(h, "samtools",
+                           "VN", samtools_version(),
+                           arg_list ? "CL": NULL,
+                           arg_list ? arg_list : NULL,
+                           NULL) != 0)
+        goto out;
+
+    if ((ret = bam_hdr_blocks(h, hdr_end, &blocks)) < 0) {
+        if (ret == -2)
+            fprintf(stderr, "New header will not fit. Use non-inplace "
+                    "version (%"PRId64" bytes available)\n", hdr_end);
+        else
+            print_error("reheader", "Couldn't compress the header");
+        goto out;
+    }
+
+    ret = -1;
+    if ((fd = open(fn, O_WRONLY)) < 0
+        || pwrite(fd, blocks.s, blocks.l, 0) != (ssize_t) blocks.l) {
+        print_error_errno("reheader", "Error writing to '%s'", fn);
+        goto out;
+    }
+    ret = 0;
+
+ out:
+    if (fd >= 0 && close(fd) < 0) {
+        print_error_errno("reheader", "Error closing '%s'", fn);
+        ret = -1;
+    }
+    ks_free(&blocks);
+    return ret;
+}
+
 /*
  * Reads a file and outputs a new CRAM file to stdout with 'h'
  * replaced as the header.  No checks are made to the validity.
@@ -438,13 +734,13 @@ int cram_reheader_inplace(cram_fd *fd, sam_hdr_t *h, const char *arg_list,
 static void usage(FILE *fp, int ret) {
     fprintf(fp,
            "Usage: samtools reheader [-P] in.header.sam in.bam > out.bam\n"
-           "   or  samtools reheader [-P] -i in.header.sam file.cram\n"
+           "   or  samtools reheader [-P] -i in.header.sam file.{bam,cram}\n"
            "   or  samtools reheader -c CMD in.bam\n"
            "   or  samtools reheader -c CMD in.cram\n"
            "\n"
            "Options:\n"
            "    -P, --no-PG         Do not generate a @PG header line.\n"
-           "    -i, --in-place      Modify the CRAM file directly, if possible.\n"
+           "    -i, --in-place      Modify the BAM or CRAM file directly, if possible.\n"
            "                        (Defaults to outputting to stdout.)\n"
            "    -c, --command CMD   Pass the header in SAM format to external program CMD.\n");
     exit(ret);
@@ -606,11 +902,26 @@ int main_reheader(int argc, char *argv[])
     }
 
     if (hts_get_format(in)->format == bam) {
-        if (inplace) {
-            print_error("reheader", "cannot reheader BAM '%s' in-place", argv[optind+1]);
+        const char *fn = external ? argv[optind] : argv[optind+1];
+        int64_t hdr_end = -1;
+        sam_hdr_t *old_h = NULL;
+        if (!skip_header && (old_h = bam_hdr_read(in->fp.bgzf)) == NULL) {
+            fprintf(stderr, "Couldn't read header\n");
             r = -1;
         } else {
-            r = bam_reheader(in->fp.bgzf, h, fileno(stdout), arg_list, no_pg, skip_header);
+            // Where possible, keep the compressed records and only
+            // replace the blocks holding the header
+            sam_hdr_destroy(old_h);
+            hdr_end = bam_hdr_end(in->fp.bgzf);
+            if (inplace) {
+                r = bam_reheader_inplace(fn, hdr_end, h, arg_list, no_pg);
+            } else {
+                r = bam_reheader_copy(fn, hdr_end, h, fileno(stdout),
+                                      arg_list, no_pg);
+                if (r == -2)
+                    r = bam_reheader(in->fp.bgzf, h, fileno(stdout),
+                                     arg_list, no_pg, 1);
+            }
         }
     } else if (hts_get_format(in)->format == cram) {
         if (inplace)
@@ -31,15 +31,16 @@ DEALINGS IN THE SOFTWARE.  */
 #include <zlib.h>
 #include <unistd.h>
 #include "htslib/sam.h"
+#include "htslib/thread_pool.h"
+#include "htslib/kstring.h"
 #include "sam_opts.h"
 #include "samtools.h"
-#include "bam.h" // for bam_get_library
-
-typedef bam1_t *bam1_p;
+#include "bam_rmdup.h"
 
 #include "htslib/khash.h"
 KHASH_SET_INIT_STR(name)
-KHASH_MAP_INIT_INT64(pos, bam1_p)
+KHASH_MAP_INIT_INT64(pos, int)
+KHASH_MAP_INIT_STR(rg2lib, char *)
 
 #define BUFFER_SIZE 0x40000
 
@@ -49,38 +50,290 @@ typedef struct {
 } lib_aux_t;
 KHASH_MAP_INIT_STR(lib, lib_aux_t)
 
+/*
+ * Reading.  Each read's library, end position and quality score are worked
+ * out as it is read, or with a thread pool by the workers on batches of
+ * reads.  The main thread takes the batches back in input order, so the
+ * results do not depend on the thread count.
+ */
+#define RMDUP_BATCH_SIZE 1024
+
 typedef struct {
-    int n, max;
-    bam1_t **a;
-} tmp_stack_t;
+    khash_t(rg2lib) *libs;
+    rmdup_read_t reads[RMDUP_BATCH_SIZE];
+    int n;
+} rmdup_batch_t;
+
+struct rmdup_reader {
+    samFile *in;
+    sam_hdr_t *hdr;
+    khash_t(rg2lib) *libs;  // read group ID to library, for those with one
+    hts_tpool *pool;
+    hts_tpool_process *q;
+    rmdup_batch_t *batch;
+    int n_batch;
+    int next_fill;
+    int in_flight;
+    rmdup_batch_t *curr;
+    int curr_idx;
+    int end;
+    rmdup_read_t one;
+};
+
+static inline int sum_qual(const bam1_t *b)
+{
+    int i, q;
+    uint8_t *qual = bam_get_qual(b);
+    for (i = q = 0; i < b->core.l_qseq; ++i) q += qual[i];
+    return q;
+}
+
+/* Looks up the library as bam_get_library() does, but in a table made
+   from the header beforehand, so it is safe to run in worker threads. */
+static void prepare_read(khash_t(rg2lib) *libs, rmdup_read_t *r)
+{
+    uint8_t *rg = bam_aux_get(r->b, "RG");
+    const char *id = rg ? bam_aux2Z(rg) : NULL;
+    khint_t k;
+
+    r->lib = "\t";
+    if (id && (k = kh_get(rg2lib, libs, id)) != kh_end(libs))
+        r->lib = kh_val(libs, k);
+    r->endpos = bam_endpos(r->b);
+    r->score = sum_qual(r->b);
+}
+
+static void *prepare_batch(void *arg)
+{
+    rmdup_batch_t *bt = (rmdup_batch_t *)arg;
+    int i;
+    for (i = 0; i < bt->n; i++)
+        prepare_read(bt->libs, &bt->reads[i]);
+    return bt;
+}
+
+static void destroy_libs(khash_t(rg2lib) *libs)
+{
+    khint_t k;
+    if (!libs) return;
+    for (k = kh_begin(libs); k < kh_end(libs); ++k) {
+        if (kh_exist(libs, k)) {
+            free((char *)kh_key(libs, k));
+            free(kh_val(libs, k));
+        }
+    }
+    kh_destroy(rg2lib, libs);
+}
 
-static inline void stack_insert(tmp_stack_t *stack, bam1_t *b)
+static khash_t(rg2lib) *read_libs(sam_hdr_t *hdr)
 {
-    if (stack->n == stack->max) {
-        stack->max = stack->max? stack->max<<1 : 0x10000;
-        stack->a = (bam1_t**)realloc(stack->a, sizeof(bam1_t*) * stack->max);
+    khash_t(rg2lib) *libs = kh_init(rg2lib);
+    kstring_t lb = KS_INITIALIZE;
+    int i, n = sam_hdr_count_lines(hdr, "RG"), ret;
+    khint_t k;
+
+    if (!libs) return NULL;
+    for (i = 0; i < n; ++i) {
+        const char *id = sam_hdr_line_name(hdr, "RG", i);
+        char *key;
+        if (!id || sam_hdr_find_tag_pos(hdr, "RG", i, "LB", &lb) < 0)
+            continue;
+        if (!(key = strdup(id))) goto fail;
+        k = kh_put(rg2lib, libs, key, &ret);
+        if (ret <= 0) { // duplicate ID; the first is used
+            free(key);
+            if (ret < 0) goto fail;
+            continue;
+        }
+        if (!(kh_val(libs, k) = strdup(lb.s))) goto fail;
     }
-    stack->a[stack->n++] = b;
+    ks_free(&lb);
+    return libs;
+
+ fail:
+    ks_free(&lb);
+    destroy_libs(libs);
+    return NULL;
 }
 
-static inline int dump_best(tmp_stack_t *stack, samFile *out, sam_hdr_t *hdr)
+rmdup_reader_t *rmdup_reader_init(samFile *in, sam_hdr_t *hdr, hts_tpool *pool)
 {
+    rmdup_reader_t *rd = calloc(1, sizeof(*rd));
     int i;
-    for (i = 0; i != stack->n; ++i) {
-        if (sam_write1(out, hdr, stack->a[i]) < 0) return -1;
-        bam_destroy1(stack->a[i]);
-        stack->a[i] = NULL;
+
+    if (!rd) return NULL;
+    rd->in = in;
+    rd->hdr = hdr;
+    rd->pool = pool;
+    if (!(rd->libs = read_libs(hdr)))
+        goto fail;
+    if (!pool)
+        return rd;
+
+    // enough batches to keep every worker busy while the main thread
+    // removes duplicates from the finished ones
+    rd->n_batch = 2 * hts_tpool_size(pool);
+    if (!(rd->batch = calloc(rd->n_batch, sizeof(*rd->batch))))
+        goto fail;
+    for (i = 0; i < rd->n_batch; ++i)
+        rd->batch[i].libs = rd->libs;
+    if (!(rd->q = hts_tpool_process_init(pool, rd->n_batch, 0)))
+        goto fail;
+    return rd;
+
+ fail:
+    rmdup_reader_destroy(rd);
+    return NULL;
+}
+
+void rmdup_reader_destroy(rmdup_reader_t *rd)
+{
+    int i, j;
+    if (!rd) return;
+    // waits for any batches still being worked on
+    if (rd->q)
+        hts_tpool_process_destroy(rd->q);
+    if (rd->batch) {
+        for (i = 0; i < rd->n_batch; ++i)
+            for (j = 0; j < RMDUP_BATCH_SIZE; ++j)
+                if (rd->batch[i].reads[j].b)
+                    bam_destroy1(rd->batch[i].reads[j].b);
+        free(rd->batch);
+    }
+    destroy_libs(rd->libs);
+    free(rd);
+}
+
+static void fill_batch(rmdup_reader_t *rd, rmdup_batch_t *bt)
+{
+    int ret;
+    bt->n = 0;
+    while (bt->n < RMDUP_BATCH_SIZE) {
+        rmdup_read_t *r = &bt->reads[bt->n];
+        if (!r->b && !(r->b = bam_init1())) {
+            perror(__func__);
+            rd->end = -2;
+            break;
+        }
+        if ((ret = sam_read1(rd->in, rd->hdr, r->b)) < 0) {
+            rd->end = ret;
+            break;
+        }
+        bt->n++;
     }
-    stack->n = 0;
+}
+
+int rmdup_next_read(rmdup_reader_t *rd, bam1_t **b, rmdup_read_t **r)
+{
+    rmdup_read_t *next;
+    bam1_t *tmp;
+
+    if (!rd->q) {
+        int ret = sam_read1(rd->in, rd->hdr, *b);
+        if (ret >= 0) {
+            rd->one.b = *b;
+            prepare_read(rd->libs, &rd->one);
+            *r = &rd->one;
+        }
+        return ret;
+    }
+
+    if (rd->curr && rd->curr_idx == rd->curr->n) {
+        rd->curr = NULL;
+        rd->in_flight--;
+    }
+
+    if (!rd->curr) {
+        hts_tpool_result *res;
+
+        // the ring of batches is kept no larger than the queue, so
+        // dispatching never blocks on results we have yet to collect
+        while (!rd->end && rd->in_flight < rd->n_batch) {
+            rmdup_batch_t *bt = &rd->batch[rd->next_fill];
+            fill_batch(rd, bt);
+            if (bt->n == 0)
+                break;
+            if (hts_tpool_dispatch(rd->pool, rd->q, prepare_batch, bt) < 0) {
+                print_error_errno("rmdup", "unable to queue reads for processing");
+                return rd->end = -2;
+            }
+            rd->next_fill = (rd->next_fill + 1) % rd->n_batch;
+            rd->in_flight++;
+        }
+
+        if (!rd->in_flight)
+            return rd->end;
+
+        if (!(res = hts_tpool_next_result_wait(rd->q))) {
+            print_error_errno("rmdup", "unable to get processed reads");
+            return rd->end = -2;
+        }
+        rd->curr = (rmdup_batch_t *)hts_tpool_result_data(res);
+        rd->curr_idx = 0;
+        hts_tpool_delete_result(res, 0);
+    }
+
+    next = &rd->curr->reads[rd->curr_idx++];
+    tmp = *b;
+    *b = next->b;
+    next->b = tmp;
+    *r = next;
     return 0;
 }
 
-static inline void clear_stack(tmp_stack_t *stack) {
-    int i;
-    if (!stack->a) return;
-    for (i = 0; i != stack->n; ++i) {
-        bam_destroy1(stack->a[i]);
+/*
+ * The best read pairs starting at the current position, in input order.
+ * best_hash values index this.  Emptying the bucket keeps its records for
+ * reuse, so records are only allocated when a position has more pairs
+ * than any before it.
+ */
+typedef struct {
+    bam1_t *b;
+    int score;
+} best_t;
+
+typedef struct {
+    int n, max;
+    best_t *a;
+} pos_bucket_t;
+
+// Moves *b into the bucket, leaving a spare record in *b.
+// Returns the index of the new entry, or -1 on failure.
+static inline int bucket_insert(pos_bucket_t *bucket, bam1_t **b, int score)
+{
+    bam1_t *tmp;
+    if (bucket->n == bucket->max) {
+        int max = bucket->max ? bucket->max << 1 : 64;
+        best_t *a = realloc(bucket->a, sizeof(*a) * max);
+        if (!a) return -1;
+        memset(a + bucket->max, 0, sizeof(*a) * (max - bucket->max));
+        bucket->a = a;
+        bucket->max = max;
     }
+    if (!bucket->a[bucket->n].b && !(bucket->a[bucket->n].b = bam_init1()))
+        return -1;
+    tmp = bucket->a[bucket->n].b;
+    bucket->a[bucket->n].b = *b;
+    bucket->a[bucket->n].score = score;
+    *b = tmp;
+    return bucket->n++;
+}
+
+static inline int dump_best(pos_bucket_t *bucket, samFile *out, sam_hdr_t *hdr)
+{
+    int i;
+    for (i = 0; i != bucket->n; ++i)
+        if (sam_write1(out, hdr, bucket->a[i].b) < 0) return -1;
+    bucket->n = 0;
+    return 0;
+}
+
+static void free_bucket(pos_bucket_t *bucket)
+{
+    int i;
+    for (i = 0; i != bucket->max; ++i)
+        if (bucket->a[i].b) bam_destroy1(bucket->a[i].b);
+    free(bucket->a);
 }
 
 static void clear_del_set(khash_t(name) *del_set)
@@ -119,24 +372,17 @@ static void clear_best(khash_t(lib) *aux, int max)
     }
 }
 
-static inline int sum_qual(const bam1_t *b)
-{
-    int i, q;
-    uint8_t *qual = bam_get_qual(b);
-    for (i = q = 0; i < b->core.l_qseq; ++i) q += qual[i];
-    return q;
-}
-
-int bam_rmdup_core(samFile *in, sam_hdr_t *hdr, samFile *out)
+int bam_rmdup_core(rmdup_reader_t *rd, sam_hdr_t *hdr, samFile *out)
 {
     bam1_t *b = NULL;
+    rmdup_read_t *prep;
     int last_tid = -1, last_pos = -1, r;
-    tmp_stack_t stack;
+    pos_bucket_t bucket;
     khint_t k;
     khash_t(lib) *aux = NULL;
     khash_t(name) *del_set = NULL;
 
-    memset(&stack, 0, sizeof(tmp_stack_t));
+    memset(&bucket, 0, sizeof(pos_bucket_t));
     aux = kh_init(lib);
     del_set = kh_init(name);
     b = bam_init1();
@@ -146,10 +392,12 @@ int bam_rmdup_core(samFile *in, sam_hdr_t *hdr, samFile *out)
     }
 
     kh_resize(name, del_set, 4 * BUFFER_SIZE);
-    while ((r = sam_read1(in, hdr, b)) >= 0) {
+    while ((r = rmdup_next_read(rd, &b, &prep)) >= 0) {
         bam1_core_t *c = &b->core;
+        bam1_t *cur = b; // stays the current read if b is swapped below
+        int this_pos = c->pos;
         if (c->tid != last_tid || last_pos != c->pos) {
-            if (dump_best(&stack, out, hdr) < 0) goto write_fail; // write the result
+            if (dump_best(&bucket, out, hdr) < 0) goto write_fail; // write the result
             clear_best(aux, BUFFER_SIZE);
             if (c->tid != last_tid) {
                 clear_best(aux, 0);
@@ -159,7 +407,7 @@ int bam_rmdup_core(samFile *in, sam_hdr_t *hdr, samFile *out)
                 }
                 if ((int)c->tid == -1) { // append unmapped reads
                     if (sam_write1(out, hdr, b) < 0) goto write_fail;
-                    while ((r = sam_read1(in, hdr, b)) >= 0) {
+                    while ((r = rmdup_next_read(rd, &b, &prep)) >= 0) {
                         if (sam_write1(out, hdr, b) < 0) goto write_fail;
                     }
                     break;
@@ -172,28 +420,30 @@ int bam_rmdup_core(samFile *in, sam_hdr_t *hdr, samFile *out)
             if (sam_write1(out, hdr, b) < 0) goto write_fail;
         } else if (c->isize > 0) { // paired, head
             uint64_t key = (uint64_t)c->pos<<32 | c->isize;
-            const char *lib;
             lib_aux_t *q;
             int ret;
-            lib = bam_get_library(hdr, b);
-            q = lib? get_aux(aux, lib) : get_aux(aux, "\t");
+            q = get_aux(aux, prep->lib);
             ++q->n_checked;
             k = kh_put(pos, q->best_hash, key, &ret);
             if (ret < 0) goto fail;
             if (ret == 0) { // found in best_hash
-                bam1_t *p = kh_val(q->best_hash, k);
+                best_t *p = &bucket.a[kh_val(q->best_hash, k)];
                 ++q->n_removed;
-                if (sum_qual(p) < sum_qual(b)) { // the current alignment is better; this can be accelerated in principle
-                    kh_put(name, del_set, strdup(bam_get_qname(p)), &ret); // p will be removed
+                if (p->score < prep->score) { // the current alignment is better
+                    bam1_t *tmp = p->b;
+                    kh_put(name, del_set, strdup(bam_get_qname(p->b)), &ret); // p will be removed
                     if (ret < 0) goto fail;
-                    if (bam_copy1(p, b) == NULL) goto fail; // replaced as b
+                    p->b = b; // replaced as b
+                    p->score = prep->score;
+                    b = tmp;
                 } else kh_put(name, del_set, strdup(bam_get_qname(b)), &ret); // b will be removed
                 if (ret < 0) goto fail;
                 if (ret == 0)
-                    fprintf(stderr, "[bam_rmdup_core] inconsistent BAM file for pair '%s'. Continue anyway.\n", bam_get_qname(b));
+                    fprintf(stderr, "[bam_rmdup_core] inconsistent BAM file for pair '%s'. Continue anyway.\n", bam_get_qname(cur));
             } else { // not found in best_hash
-                kh_val(q->best_hash, k) = bam_dup1(b);
-                stack_insert(&stack, kh_val(q->best_hash, k));
+                int i = bucket_insert(&bucket, &b, prep->score);
+                if (i < 0) goto fail;
+                kh_val(q->best_hash, k) = i;
             }
         } else { // paired, tail
             k = kh_get(name, del_set, bam_get_qname(b));
@@ -204,17 +454,17 @@ int bam_rmdup_core(samFile *in, sam_hdr_t *hdr, samFile *out)
                 if (sam_write1(out, hdr, b) < 0) goto write_fail;
             }
         }
-        last_pos = c->pos;
+        last_pos = this_pos;
     }
     if (r < -1) {
         fprintf(stderr, "[%s] failed to read input file\n", __func__);
         goto fail;
     }
 
+    if (dump_best(&bucket, out, hdr) < 0) goto write_fail;
     for (k = kh_begin(aux); k != kh_end(aux); ++k) {
         if (kh_exist(aux, k)) {
             lib_aux_t *q = &kh_val(aux, k);
-            if (dump_best(&stack, out, hdr) < 0) goto write_fail;
             fprintf(stderr, "[bam_rmdup_core] %lld / %lld = %.4lf in library '%s'\n", (long long)q->n_removed,
                     (long long)q->n_checked, (double)q->n_removed/q->n_checked, kh_key(aux, k));
             kh_destroy(pos, q->best_hash);
@@ -226,15 +476,14 @@ int bam_rmdup_core(samFile *in, sam_hdr_t *hdr, samFile *out)
 
     clear_del_set(del_set);
     kh_destroy(name, del_set);
-    free(stack.a);
+    free_bucket(&bucket);
     bam_destroy1(b);
     return 0;
 
  write_fail:
     print_error_errno("rmdup", "failed to write record");
  fail:
-    clear_stack(&stack);
-    free(stack.a);
+    free_bucket(&bucket);
     if (aux) {
         for (k = kh_begin(aux); k != kh_end(aux); ++k) {
             if (kh_exist(aux, k)) {
@@ -253,15 +502,13 @@ int bam_rmdup_core(samFile *in, sam_hdr_t *hdr, samFile *out)
     return 1;
 }
 
-int bam_rmdupse_core(samFile *in, sam_hdr_t *hdr, samFile *out, int force_se);
-
 static int rmdup_usage(void) {
     fprintf(stderr, "\n");
     fprintf(stderr, "Usage:  samtools rmdup [-sS] <input.srt.bam> <output.bam>\n\n");
     fprintf(stderr, "Option: -s    rmdup for SE reads\n");
     fprintf(stderr, "        -S    treat PE reads as SE in rmdup (force -s)\n");
 
-    sam_global_opt_help(stderr, "-....--.");
+    sam_global_opt_help(stderr, "-....--@");
     return 1;
 }
 
@@ -270,15 +517,17 @@ int bam_rmdup(int argc, char *argv[])
     int c, ret, is_se = 0, force_se = 0;
     samFile *in, *out;
     sam_hdr_t *header;
+    rmdup_reader_t *rd;
+    htsThreadPool p = {NULL, 0};
     char wmode[3] = {'w', 'b', 0};
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
 
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 0, 0, 0, '-'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 0, 0, 0, '@', '-', '-'),
         { NULL, 0, NULL, 0 }
     };
 
-    while ((c = getopt_long(argc, argv, "sS", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "sS@:", lopts, NULL)) >= 0) {
         switch (c) {
         case 's': is_se = 1; break;
         case 'S': force_se = is_se = 1; break;
@@ -307,19 +556,37 @@ int bam_rmdup(int argc, char *argv[])
         print_error_errno("rmdup", "failed to open \"%s\" for output", argv[optind+1]);
         return 1;
     }
+
+    if (ga.nthreads > 0) {
+        if (!(p.pool = hts_tpool_init(ga.nthreads))) {
+            print_error("rmdup", "error creating thread pool");
+            return 1;
+        }
+        hts_set_opt(in,  HTS_OPT_THREAD_POOL, &p);
+        hts_set_opt(out, HTS_OPT_THREAD_POOL, &p);
+    }
+
     if (sam_hdr_write(out, header) < 0) {
         print_error_errno("rmdup", "failed to write header");
         return 1;
     }
 
-    if (is_se) ret = bam_rmdupse_core(in, header, out, force_se);
-    else ret = bam_rmdup_core(in, header, out);
+    if (!(rd = rmdup_reader_init(in, header, p.pool))) {
+        print_error_errno("rmdup", "failed to set up reading");
+        return 1;
+    }
+
+    if (is_se) ret = bam_rmdupse_core(rd, header, out, force_se);
+    else ret = bam_rmdup_core(rd, header, out);
 
+    rmdup_reader_destroy(rd);
     sam_hdr_destroy(header);
     sam_close(in);
     if (sam_close(out) < 0) {
         fprintf(stderr, "[bam_rmdup] error closing output file\n");
         ret = 1;
     }
+    if (p.pool) hts_tpool_destroy(p.pool);
+    sam_global_args_free(&ga);
     return ret;
 }
@@ -0,0 +1,53 @@
+/*  bam_rmdup.h -- shared functions between paired and single-end rmdup
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef BAM_RMDUP_H
+#define BAM_RMDUP_H
+
+#include "htslib/sam.h"
+#include "htslib/thread_pool.h"
+
+// A read with the values both rmdup modes need, worked out as it is read
+// (or by the thread pool).
+typedef struct {
+    bam1_t *b;
+    const char *lib;    // library name, or "\t" if it has none
+    hts_pos_t endpos;
+    int score;          // sum of base qualities
+} rmdup_read_t;
+
+typedef struct rmdup_reader rmdup_reader_t;
+
+/// Start reading from in, in batches prepared by pool if it is not NULL
+rmdup_reader_t *rmdup_reader_init(samFile *in, sam_hdr_t *hdr,
+                                  hts_tpool *pool);
+
+/// Read the next alignment into *b, swapping it with a prepared one when
+/// threaded, and point *r at its values.  Returns as sam_read1().
+int rmdup_next_read(rmdup_reader_t *rd, bam1_t **b, rmdup_read_t **r);
+
+void rmdup_reader_destroy(rmdup_reader_t *rd);
+
+int bam_rmdupse_core(rmdup_reader_t *rd, sam_hdr_t *hdr, samFile *out,
+                     int force_se);
+
+#endif
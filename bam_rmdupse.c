@@ -27,11 +27,11 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <math.h>
 #include <stdio.h>
-#include "bam.h" // for bam_get_library
 #include "htslib/sam.h"
 #include "htslib/khash.h"
 #include "htslib/klist.h"
 #include "samtools.h"
+#include "bam_rmdup.h"
 
 #define QUEUE_CLEAR_SIZE 0x100000
 #define MAX_POS 0x7fffffff
@@ -70,22 +70,17 @@ static lib_aux_t *get_aux(khash_t(lib) *aux, const char *lib)
     } else return &kh_val(aux, k);
 }
 
-static inline int sum_qual(const bam1_t *b)
-{
-    int i, q;
-    uint8_t *qual = bam_get_qual(b);
-    for (i = q = 0; i < b->core.l_qseq; ++i) q += qual[i];
-    return q;
-}
-
-static inline elem_t *push_queue(queue_t *queue, const bam1_t *b, int endpos, int score)
+/* Moves *b into the queue, leaving in *b the record the queue entry held
+   when it was last used, so records are reused rather than copied. */
+static inline elem_t *push_queue(queue_t *queue, bam1_t **b, int endpos, int score)
 {
+    bam1_t *tmp;
     elem_t *p = kl_pushp(q, queue);
     p->discarded = 0;
     p->endpos = endpos; p->score = score;
     if (p->b == 0) p->b = bam_init1();
     if (!p->b) { perror(NULL); exit(EXIT_FAILURE); }
-    if (bam_copy1(p->b, b) == NULL) { perror(NULL); exit(EXIT_FAILURE); }
+    tmp = p->b; p->b = *b; *b = tmp;
     return p;
 }
 
@@ -126,9 +121,10 @@ static int dump_alignment(samFile *out, sam_hdr_t *hdr,
     return 0;
 }
 
-int bam_rmdupse_core(samFile *in, sam_hdr_t *hdr, samFile *out, int force_se)
+int bam_rmdupse_core(rmdup_reader_t *rd, sam_hdr_t *hdr, samFile *out, int force_se)
 {
     bam1_t *b = NULL;
+    rmdup_read_t *prep;
     queue_t *queue = NULL;
     khint_t k;
     int last_tid = -2, r;
@@ -142,10 +138,10 @@ int bam_rmdupse_core(samFile *in, sam_hdr_t *hdr, samFile *out, int force_se)
         goto fail;
     }
 
-    while ((r = sam_read1(in, hdr, b)) >= 0) {
+    while ((r = rmdup_next_read(rd, &b, &prep)) >= 0) {
         bam1_core_t *c = &b->core;
-        int endpos = bam_endpos(b);
-        int score = sum_qual(b);
+        int endpos = prep->endpos;
+        int score = prep->score;
 
         if (last_tid != c->tid) {
             if (last_tid >= 0) {
@@ -158,15 +154,13 @@ int bam_rmdupse_core(samFile *in, sam_hdr_t *hdr, samFile *out, int force_se)
                 goto write_fail;
         }
         if ((c->flag&BAM_FUNMAP) || ((c->flag&BAM_FPAIRED) && !force_se)) {
-            push_queue(queue, b, endpos, score);
+            push_queue(queue, &b, endpos, score);
         } else {
-            const char *lib;
             lib_aux_t *q;
             besthash_t *h;
             uint32_t key;
             int ret;
-            lib = bam_get_library(hdr, b);
-            q = lib? get_aux(aux, lib) : get_aux(aux, "\t");
+            q = get_aux(aux, prep->lib);
             ++q->n_checked;
             h = (c->flag&BAM_FREVERSE)? q->rght : q->left;
             key = (c->flag&BAM_FREVERSE)? endpos : c->pos;
@@ -177,15 +171,14 @@ int bam_rmdupse_core(samFile *in, sam_hdr_t *hdr, samFile *out, int force_se)
                 if (p->score < score) {
                     if (c->flag&BAM_FREVERSE) { // mark "discarded" and push the queue
                         p->discarded = 1;
-                        kh_val(h, k) = push_queue(queue, b, endpos, score);
+                        kh_val(h, k) = push_queue(queue, &b, endpos, score);
                     } else { // replace
+                        bam1_t *tmp = p->b;
                         p->score = score; p->endpos = endpos;
-                        if (bam_copy1(p->b, b) == NULL) {
-                            perror(NULL); exit(EXIT_FAILURE);
-                        }
+                        p->b = b; b = tmp;
                     }
                 } // otherwise, discard the alignment
-            } else kh_val(h, k) = push_queue(queue, b, endpos, score);
+            } else kh_val(h, k) = push_queue(queue, &b, endpos, score);
         }
     }
     if (r < -1) {
@@ -28,9 +28,11 @@ DEALINGS IN THE SOFTWARE.  */
 #include <htslib/faidx.h>
 #include <htslib/khash.h>
 #include <htslib/kseq.h>
+#include <htslib/thread_pool.h>
 #include <samtools.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <getopt.h>
 
@@ -44,6 +46,10 @@ typedef struct FaidxPath {
     char* filename;
     /** fasta index  */
     faidx_t* faidx;
+    /** sequence lengths, in the order of the index */
+    hts_pos_t* lengths;
+    /** hash of the names and lengths, see dict_signature() */
+    uint64_t signature;
     struct FaidxPath* next;
 } FaidxPath;
 
@@ -59,6 +65,27 @@ typedef struct Params {
     int test_index;
 } Params;
 
+/** the list of files to scan, from the command line or stdin */
+typedef struct Inputs {
+    /** stdin, when reading the paths from there */
+    htsFile* fp;
+    kstring_t line;
+    char** argv;
+    int argc, next;
+    /** paths are followed by the path to their index */
+    int has_index_file;
+} Inputs;
+
+/** one file, scanned by a worker thread */
+typedef struct SampleJob {
+    const Params* params;
+    char* fname;
+    char* baifname;
+    /** the lines to print for this file */
+    kstring_t out;
+    int status;
+} SampleJob;
+
 /** print usage */
 static void usage_samples(FILE *write_to) {
     fprintf(write_to,
@@ -76,17 +103,34 @@ static void usage_samples(FILE *write_to) {
             "  -f <file.fa>    load an indexed fasta file in the collection of references. Can be used multiple times.\n"
             "  -F <file.txt>   read a file containing the paths to indexed fasta files. One path per line.\n"
             "  -X              use a custom index file.\n"
+            "  -@ <int>        number of files to read at once [1]; 1 reads them one by one.\n"
+            "                  Worth setting high on network storage.\n"
             "\n"
             " Using -f or -F will add a column containing the path to the reference or \".\" if the reference was not found.\n"
             "\n"
     );
 }
 
+/** hash of the names and lengths of a list of sequences, in order */
+static inline uint64_t dict_signature_add(uint64_t sig, const char* name,
+                                          hts_pos_t len) {
+    sig = (sig ^ kh_str_hash_func(name)) * 0x100000001b3ULL;
+    return (sig ^ (uint64_t) len) * 0x100000001b3ULL;
+}
+
+static uint64_t header_signature(const sam_hdr_t* header) {
+    uint64_t sig = 0xcbf29ce484222325ULL;
+    int i;
+    for (i = 0; i < header->n_targets; i++)
+        sig = dict_signature_add(sig, header->target_name[i], header->target_len[i]);
+    return sig;
+}
 
 /** loads fasta fai file into FaidxPath, add it to params->faidx */
 static int load_dictionary(struct Params* params, const char* filename) {
     FaidxPath* head = params->faidx;
-    FaidxPath* ptr = (FaidxPath*)malloc(sizeof(FaidxPath));
+    FaidxPath* ptr = (FaidxPath*)calloc(1, sizeof(FaidxPath));
+    int i, n;
     if (ptr == NULL) {
         print_error_errno("samples", "Out of memory");
         return EXIT_FAILURE;
@@ -104,6 +148,22 @@ static int load_dictionary(struct Params* params, const char* filename) {
         print_error_errno("samples", "Cannot load index from \"%s\"", filename);
         return EXIT_FAILURE;
     }
+    /* keep the lengths and a signature, so each file is matched cheaply */
+    n = faidx_nseq(ptr->faidx);
+    ptr->lengths = malloc((n > 0 ? n : 1) * sizeof(*ptr->lengths));
+    if (ptr->lengths == NULL) {
+        fai_destroy(ptr->faidx);
+        free(ptr->filename);
+        free(ptr);
+        print_error_errno("samples", "Out of memory");
+        return EXIT_FAILURE;
+    }
+    ptr->signature = 0xcbf29ce484222325ULL;
+    for (i = 0; i < n; i++) {
+        const char* name = faidx_iseq(ptr->faidx, i);
+        ptr->lengths[i] = faidx_seq_len(ptr->faidx, name);
+        ptr->signature = dict_signature_add(ptr->signature, name, ptr->lengths[i]);
+    }
     /* insert at the beginning of the linked list */
     params->faidx = ptr;
     ptr->next = head;
@@ -134,55 +194,57 @@ static int load_dictionaries(Params* params, const char* filename) {
     return status;
 }
 
-/** print the sample information, search for a reference */
+/** search for a reference with the same names and lengths, in the same order */
+static const FaidxPath* find_reference(const Params* params, const sam_hdr_t *header) {
+    uint64_t sig = header_signature(header);
+    const FaidxPath* curr;
+    for (curr = params->faidx; curr != NULL; curr = curr->next) {
+        int i;
+        if (curr->signature != sig || faidx_nseq(curr->faidx) != header->n_targets)
+            continue;
+        /* rule out hash collisions */
+        for (i = 0; i < header->n_targets; i++) {
+            if (strcmp(faidx_iseq(curr->faidx, i), header->target_name[i]) != 0) break;
+            if (curr->lengths[i] != header->target_len[i]) break;
+        }
+        if (i == header->n_targets)
+            return curr;
+    }
+    return NULL;
+}
+
+/** print the sample information, with the reference found for the file */
 static int print_sample(
-        Params* params,
-        sam_hdr_t *header,
+        const Params* params,
+        const FaidxPath* ref,
         int has_index,
         const char* sample,
-        const char* fname) {
-    fputs(sample, params->out);
-    fputc('\t', params->out);
-    fputs(fname, params->out);
+        const char* fname,
+        kstring_t* out) {
+    int r = 0;
+    r |= kputs(sample, out) < 0;
+    r |= kputc('\t', out) < 0;
+    r |= kputs(fname, out) < 0;
     if (params->test_index) {
-        fprintf(params->out, "\t%c", has_index ? 'Y' : 'N');
+        r |= ksprintf(out, "\t%c", has_index ? 'Y' : 'N') < 0;
     }
     if (params->faidx != NULL) {
-        FaidxPath* ref = NULL;
-        FaidxPath* curr = params->faidx;
-        while (curr != NULL) {
-            /** check names and length are the same in the same order */
-            if (faidx_nseq(curr->faidx) == header->n_targets) {
-                int i;
-                for (i = 0; i < faidx_nseq(curr->faidx); i++) {
-                    /** check name is the same */
-                    if (strcmp(faidx_iseq(curr->faidx, i), header->target_name[i]) != 0) break;
-                    /** check length is the same */
-                    if (faidx_seq_len(curr->faidx, faidx_iseq(curr->faidx, i)) != header->target_len[i]) break;
-                }
-                /* the ref was found */
-                if (i == faidx_nseq(curr->faidx)) {
-                    ref = curr;
-                    break;
-                }
-            }
-            curr = curr->next;
-        }
-        fputc('\t', params->out);
-        if (ref == NULL) {
-            fputc('.', params->out);
-        } else {
-            fputs(curr->filename, params->out);
-        }
+        r |= kputc('\t', out) < 0;
+        r |= kputs(ref == NULL ? "." : ref->filename, out) < 0;
+    }
+    r |= kputc('\n', out) < 0;
+    if (r) {
+        print_error_errno("samples", "Out of memory");
+        return -1;
     }
-    fputc('\n', params->out);
     return 0;
 }
 
 /** open a sam file. Search for all samples in the @RG lines */
-static int print_samples(Params* params, const char* fname, const char* baifname) {
+static int print_samples(const Params* params, const char* fname, const char* baifname, kstring_t* out) {
     samFile *in = 0;
     sam_hdr_t *header = NULL;
+    const FaidxPath* ref = NULL;
     int n_rg;
     int status = EXIT_SUCCESS;
     khash_t(sm) *sample_set = NULL;
@@ -222,6 +284,10 @@ static int print_samples(Params* params, const char* fname, const char* baifname
         if (bam_idx != NULL) hts_idx_destroy(bam_idx);
         /* and we continue... we have tested the index file but we always test for the samples and the references */
     }
+    /* the reference is the same for every sample in the file */
+    if (params->faidx != NULL) {
+        ref = find_reference(params, header);
+    }
 
     /* get the RG lines */
     n_rg = sam_hdr_count_lines(header, "RG");
@@ -252,12 +318,16 @@ static int print_samples(Params* params, const char* fname, const char* baifname
         ks_free(&sm_val);
     }
     if (count_samples == 0) {
-        print_sample(params, header, has_index, ".", fname);
+        if (print_sample(params, ref, has_index, ".", fname, out) < 0)
+            status = EXIT_FAILURE;
     } else {
         for (k = kh_begin(sample_set); k != kh_end(sample_set); ++k) {
             if (kh_exist(sample_set, k)) {
                 char* sample = (char*)kh_key(sample_set, k);
-                print_sample(params, header, has_index, sample, fname);
+                if (print_sample(params, ref, has_index, sample, fname, out) < 0) {
+                    status = EXIT_FAILURE;
+                    break;
+                }
             }
         }
     }
@@ -278,12 +348,143 @@ end_print:
     return status;
 }
 
+/** get the next file to scan, and its index if -X was used.
+    Returns 1 on success, 0 at the end of the list, -1 on error */
+static int next_input(Inputs* inputs, const char** fname, const char** baifname) {
+    *baifname = NULL;
+    /* no file was provided, input is stdin, each line contains the path to a bam file */
+    if (inputs->fp != NULL) {
+        char* tab;
+        if (hts_getline(inputs->fp, KS_SEP_LINE, &inputs->line) < 0)
+            return 0;
+        *fname = ks_str(&inputs->line);
+        if (!inputs->has_index_file)
+            return 1;
+        /* bam path and bam index file are separated by a tab */
+        tab = strchr(ks_str(&inputs->line), '\t');
+        if (tab == NULL || *(tab+1) == '\0') {
+            print_error_errno("samples", "Expected path-to-bam(tab)path-to-index but got \"%s\"", ks_str(&inputs->line));
+            return -1;
+        }
+        *tab=0;
+        *baifname = (tab + 1);
+        return 1;
+    }
+    /* bam files are followed by the same number of index files */
+    if (inputs->has_index_file) {
+        int n = inputs->argc / 2;
+        if (inputs->next >= n)
+            return 0;
+        *fname = inputs->argv[inputs->next];
+        *baifname = inputs->argv[inputs->next + n];
+        inputs->next++;
+        return 1;
+    }
+    if (inputs->next >= inputs->argc)
+        return 0;
+    *fname = inputs->argv[inputs->next++];
+    return 1;
+}
+
+static void *sample_job_func(void* arg) {
+    SampleJob* job = (SampleJob*) arg;
+    job->status = print_samples(job->params, job->fname, job->baifname, &job->out);
+    return job;
+}
+
+/** scan the files on the thread pool, many at once, printing them in order */
+static int print_samples_mt(Params* params, Inputs* inputs, hts_tpool* pool, int njobs) {
+    hts_tpool_process* q = NULL;
+    SampleJob* jobs = NULL;
+    int next = 0, in_flight = 0, i, r = 1, bad_input = 0;
+    int status = EXIT_FAILURE;
+
+    if ((jobs = calloc(njobs, sizeof(*jobs))) == NULL
+        || (q = hts_tpool_process_init(pool, njobs, 0)) == NULL) {
+        print_error_errno("samples", "Failed to set up thread pool queue");
+        goto end_mt;
+    }
+
+    while (r > 0 || in_flight) {
+        const char *fname, *baifname;
+        /* the ring is no larger than the queue, so this never blocks */
+        while (r > 0 && in_flight < njobs
+               && (r = next_input(inputs, &fname, &baifname)) > 0) {
+            SampleJob* job = &jobs[next];
+            job->params = params;
+            job->out.l = 0;
+            job->fname = strdup(fname);
+            job->baifname = baifname != NULL ? strdup(baifname) : NULL;
+            if (job->fname == NULL || (job->baifname == NULL && baifname != NULL)) {
+                print_error_errno("samples", "Out of memory");
+                goto end_mt;
+            }
+            if (hts_tpool_dispatch(pool, q, sample_job_func, job) < 0) {
+                print_error_errno("samples", "Failed to dispatch job");
+                goto end_mt;
+            }
+            next = (next + 1) % njobs;
+            in_flight++;
+        }
+        if (r < 0) {
+            /* as when run one at a time, print the files before the bad
+               line and then fail */
+            bad_input = 1;
+            r = 0;
+        }
+        if (!in_flight)
+            break;
+
+        hts_tpool_result* res = hts_tpool_next_result_wait(q);
+        if (res == NULL) {
+            print_error("samples", "Failed to get result from thread pool");
+            goto end_mt;
+        }
+        SampleJob* job = (SampleJob*) hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+        free(job->fname);
+        free(job->baifname);
+        job->fname = job->baifname = NULL;
+        /* as when run one at a time, stop at the first failure */
+        if (job->status != EXIT_SUCCESS)
+            goto end_mt;
+        if (fwrite(job->out.s, 1, job->out.l, params->out) != job->out.l) {
+            print_error_errno("samples", "Failed to write output");
+            goto end_mt;
+        }
+    }
+    status = bad_input ? EXIT_FAILURE : EXIT_SUCCESS;
+
+end_mt:
+    if (q != NULL) {
+        while (in_flight-- > 0) {
+            hts_tpool_result* res = hts_tpool_next_result_wait(q);
+            if (res == NULL)
+                break;
+            hts_tpool_delete_result(res, 0);
+        }
+        hts_tpool_process_destroy(q);
+    }
+    if (jobs != NULL) {
+        for (i = 0; i < njobs; i++) {
+            free(jobs[i].fname);
+            free(jobs[i].baifname);
+            ks_free(&jobs[i].out);
+        }
+        free(jobs);
+    }
+    return status;
+}
+
 
 int main_samples(int argc, char** argv) {
     int status = EXIT_SUCCESS;
     int print_header = 0;
     int has_index_file = 0;
+    int n_threads = 0;
     Params params;
+    Inputs inputs = { 0 };
     char* out_filename = NULL;
     FaidxPath* fai;
 
@@ -292,7 +493,7 @@ int main_samples(int argc, char** argv) {
     params.test_index =0;
 
     int opt;
-    while ((opt = getopt_long(argc, argv,  "?hiXo:f:F:T:", NULL, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv,  "?hiXo:f:F:T:@:", NULL, NULL)) != -1) {
         switch (opt) {
         case 'h':
             print_header = 1;
@@ -326,6 +527,9 @@ int main_samples(int argc, char** argv) {
         case 'X':
             has_index_file = 1;
             break;
+        case '@':
+            n_threads = atoi(optarg);
+            break;
         default:
             usage_samples(stderr);
             return EXIT_FAILURE;
@@ -355,35 +559,15 @@ int main_samples(int argc, char** argv) {
         fprintf(params.out, "\n");
     }
 
+    inputs.has_index_file = has_index_file;
+    inputs.argv = argv + optind;
+    inputs.argc = argc - optind;
     /* no file was provided, input is stdin, each line contains the path to a bam file */
     if (argc == optind) {
-        htsFile* fp = hts_open("-", "r");
-        if (fp == NULL) {
+        inputs.fp = hts_open("-", "r");
+        if (inputs.fp == NULL) {
             print_error_errno("samples", "Cannot read from stdin");
             status = EXIT_FAILURE;
-        } else {
-            kstring_t ks = KS_INITIALIZE;
-            int ret;
-            while ((ret = hts_getline(fp, KS_SEP_LINE, &ks)) >= 0) {
-                char* bai_path = NULL;
-                if (has_index_file) {
-                    /* bam path and bam index file are separated by a tab */
-                    char* tab = strchr(ks_str(&ks), '\t');
-                    if (tab == NULL || *(tab+1) == '\0') {
-                        print_error_errno("samples", "Expected path-to-bam(tab)path-to-index but got \"%s\"", ks_str(&ks));
-                        status = EXIT_FAILURE;
-                        break;
-                    }
-                    *tab=0;
-                    bai_path = (tab + 1);
-                }
-                if (print_samples(&params, ks_str(&ks), bai_path) != EXIT_SUCCESS) {
-                    status = EXIT_FAILURE;
-                    break;
-                }
-            }
-            ks_free(&ks);
-            hts_close(fp);
         }
     }
     /* loop over each file in argc/argv bam index provided */
@@ -392,30 +576,48 @@ int main_samples(int argc, char** argv) {
         if ((argc - optind) % 2 != 0) {
             print_error("samples","Odd number of filenames detected! Each BAM file should have an index file");
             status = EXIT_FAILURE;
+        }
+    }
+
+    if (status == EXIT_SUCCESS && n_threads > 1) {
+        /* most of the time is spent waiting for the storage, so keep
+           plenty of files in flight */
+        hts_tpool* pool = hts_tpool_init(n_threads);
+        if (pool == NULL) {
+            print_error_errno("samples", "Failed to set up thread pool");
+            status = EXIT_FAILURE;
         } else {
-            int i;
-            int n = (argc - optind ) / 2;
-            for (i = 0; i < n; i++) {
-                if (print_samples(&params, argv[optind+i], argv[optind+i+n]) != EXIT_SUCCESS) {
-                    status = EXIT_FAILURE;
-                    break;
-                }
-            }
+            status = print_samples_mt(&params, &inputs, pool, 2 * n_threads);
+            hts_tpool_destroy(pool);
         }
-    } else {
-        int i;
-        for (i = optind; i < argc; i++) {
-            if (print_samples(&params, argv[i], NULL) != EXIT_SUCCESS) {
+    } else if (status == EXIT_SUCCESS) {
+        const char *fname, *baifname;
+        kstring_t out = KS_INITIALIZE;
+        int r;
+        while ((r = next_input(&inputs, &fname, &baifname)) > 0) {
+            out.l = 0;
+            if (print_samples(&params, fname, baifname, &out) != EXIT_SUCCESS) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            if (fwrite(out.s, 1, out.l, params.out) != out.l) {
+                print_error_errno("samples", "Failed to write output");
                 status = EXIT_FAILURE;
                 break;
             }
         }
+        if (r < 0)
+            status = EXIT_FAILURE;
+        ks_free(&out);
     }
+    if (inputs.fp != NULL) hts_close(inputs.fp);
+    ks_free(&inputs.line);
 
     fai = params.faidx;
     while (fai != NULL) {
         FaidxPath* next = fai -> next;
         free(fai->filename);
+        free(fai->lengths);
         fai_destroy(fai->faidx);
         free(fai);
         fai = next;
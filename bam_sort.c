@@ -47,12 +47,17 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/kstring.h"
 #include "htslib/sam.h"
 #include "htslib/hts_endian.h"
+#include "htslib/hfile.h"
 #include "htslib/cram.h"
 #include "htslib/thread_pool.h"
 #include "sam_opts.h"
 #include "samtools.h"
+#include "sam_prof.h"
+#include "sam_pipe.h"
+#include "sam_numa.h"
 #include "bedidx.h"
 #include "bam.h"
+#include "seq_utils.h"
 
 //#define DEBUG_MINHASH
 
@@ -166,6 +171,7 @@ typedef enum {Coordinate, QueryName, TagCoordinate, TagQueryName, MinHash, Templ
 static SamOrder g_sam_order = Coordinate;
 static int natural_sort = 1; // not ASCII, but alphanumeric: a12b > a7b
 static char g_sort_tag[2] = {0,0};
+static int g_tmp_level = 1; // compression level for temporary files
 
 #define is_digit(c) ((c)<='9' && (c)>='0')
 static int strnum_cmp(const char *_a, const char *_b)
@@ -272,6 +278,7 @@ static inline int heap_lt(const heap1_t a, const heap1_t b)
 }
 
 KSORT_INIT(heap, heap1_t, heap_lt)
+KSORT_INIT_STATIC(sort_key, uint64_t, ks_lt_generic)
 
 typedef struct merged_header {
     sam_hdr_t    *hdr;
@@ -294,6 +301,9 @@ typedef struct trans_tbl {
     kh_c2c_t* rg_trans;
     kh_c2c_t* pg_trans;
     bool lost_coord_sort;
+    bool tid_identity;  // tid_trans[i] == i for all targets
+    bool tag_identity;  // RG and PG ids in the header are kept as they are
+    const char *last_rg, *last_pg; // Last known ids seen, if tag_identity
 } trans_tbl_t;
 
 static void trans_tbl_destroy(trans_tbl_t *tbl) {
@@ -309,12 +319,12 @@ static void trans_tbl_destroy(trans_tbl_t *tbl) {
      * The keys are unique to each hash entry, so they do have to go.
      */
 
-    for (iter = kh_begin(tbl->rg_trans); iter != kh_end(tbl->rg_trans); ++iter) {
+    for (iter = kh_begin(tbl->rg_trans); tbl->rg_trans && iter != kh_end(tbl->rg_trans); ++iter) {
         if (kh_exist(tbl->rg_trans, iter)) {
             free(kh_key(tbl->rg_trans, iter));
         }
     }
-    for (iter = kh_begin(tbl->pg_trans); iter != kh_end(tbl->pg_trans); ++iter) {
+    for (iter = kh_begin(tbl->pg_trans); tbl->pg_trans && iter != kh_end(tbl->pg_trans); ++iter) {
         if (kh_exist(tbl->pg_trans, iter)) {
             free(kh_key(tbl->pg_trans, iter));
         }
@@ -324,6 +334,43 @@ static void trans_tbl_destroy(trans_tbl_t *tbl) {
     kh_destroy(c2c,tbl->pg_trans);
 }
 
+// Copies src into dst so another thread can translate records with it.
+// bam_translate() adds unknown RG and PG ids to the tables and caches the
+// last ids seen, so the tables cannot be shared.  Returns 0 on success or
+// -1 if out of memory; dst must be destroyed either way.
+static int trans_tbl_copy(trans_tbl_t *dst, const trans_tbl_t *src) {
+    kh_c2c_t *from[2] = { src->rg_trans, src->pg_trans }, *to[2];
+    khiter_t iter, k;
+    int i, ret;
+
+    *dst = *src;
+    dst->rg_trans = dst->pg_trans = NULL;
+    dst->last_rg = dst->last_pg = NULL;
+    dst->tid_trans = malloc((src->n_targets ? src->n_targets : 1)
+                            * sizeof(int));
+    if (!dst->tid_trans) return -1;
+    memcpy(dst->tid_trans, src->tid_trans, src->n_targets * sizeof(int));
+    to[0] = dst->rg_trans = kh_init(c2c);
+    to[1] = dst->pg_trans = kh_init(c2c);
+    if (!dst->rg_trans || !dst->pg_trans) return -1;
+
+    // The values point into the merged header, so only the keys are copied
+    for (i = 0; i < 2; i++) {
+        for (iter = kh_begin(from[i]); iter != kh_end(from[i]); ++iter) {
+            if (!kh_exist(from[i], iter)) continue;
+            char *key = strdup(kh_key(from[i], iter));
+            if (!key) return -1;
+            k = kh_put(c2c, to[i], key, &ret);
+            if (ret < 0) {
+                free(key);
+                return -1;
+            }
+            kh_value(to[i], k) = kh_value(from[i], iter);
+        }
+    }
+    return 0;
+}
+
 /*
  *  Create a merged_header_t struct.
  */
@@ -765,6 +812,37 @@ static int finish_rg_pg(bool is_rg, klist_t(hdrln) *hdr_lines,
     return -1;
 }
 
+// Returns true if every id in the map translates to itself
+static bool c2c_is_identity(kh_c2c_t *map)
+{
+    khiter_t k;
+    for (k = kh_begin(map); k != kh_end(map); k++) {
+        if (!kh_exist(map, k))
+            continue;
+        if (!kh_value(map, k) || strcmp(kh_key(map, k), kh_value(map, k)) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Finds out which parts of the translation do nothing, so bam_translate()
+// can skip them.  This is the usual case when merging files that were
+// split from the same original.
+static void trans_tbl_check_identity(trans_tbl_t *tbl)
+{
+    int i;
+    tbl->tid_identity = true;
+    for (i = 0; i < tbl->n_targets; i++) {
+        if (tbl->tid_trans[i] != i) {
+            tbl->tid_identity = false;
+            break;
+        }
+    }
+    tbl->tag_identity = c2c_is_identity(tbl->rg_trans)
+        && c2c_is_identity(tbl->pg_trans);
+    tbl->last_rg = tbl->last_pg = NULL;
+}
+
 /*
  * Build the translation table for an input *am file.  This stores mappings
  * which allow IDs to be converted from those used in the input file
@@ -808,6 +886,8 @@ static int trans_tbl_init(merged_header_t* merged_hdr, sam_hdr_t* translate,
     if (tbl->pg_trans == NULL) goto memfail;
 
     tbl->lost_coord_sort = false;
+    tbl->tid_identity = tbl->tag_identity = false;
+    tbl->last_rg = tbl->last_pg = NULL;
 
     // Get the @HD record (if not there already).
     if (trans_tbl_add_hd(merged_hdr, translate)) goto fail;
@@ -855,6 +935,8 @@ static int trans_tbl_init(merged_header_t* merged_hdr, sam_hdr_t* translate,
 
     free(lines.s);
 
+    trans_tbl_check_identity(tbl);
+
     return 0;
 
  memfail:
@@ -926,11 +1008,55 @@ static void free_merged_header(merged_header_t *merged_hdr) {
     free(merged_hdr);
 }
 
+// Checks if id is in the map with an unchanged translation
+static inline int rg_pg_id_known(kh_c2c_t *map, const char *id,
+                                 const char **last)
+{
+    khiter_t k;
+    if (*last && strcmp(id, *last) == 0)
+        return 1;
+    k = kh_get(c2c, map, id);
+    if (k == kh_end(map) || !kh_value(map, k))
+        return 0;
+    *last = kh_key(map, k);
+    return 1;
+}
+
+// Used by bam_translate() when RG and PG ids are not changed.  Returns 1
+// if translating would leave the record's tags as they are, which is the
+// case when its ids are in the header and the RG and PG tags are already
+// the last ones, in that order.
+static int bam_rg_pg_unchanged(bam1_t *b, trans_tbl_t *tbl)
+{
+    uint8_t *aux, *rg = NULL, *pg = NULL, *last = NULL, *prev = NULL;
+
+    for (aux = bam_aux_first(b); aux; aux = bam_aux_next(b, aux)) {
+        if (aux[-2] == 'R' && aux[-1] == 'G' && !rg)
+            rg = aux;
+        else if (aux[-2] == 'P' && aux[-1] == 'G' && !pg)
+            pg = aux;
+        prev = last;
+        last = aux;
+    }
+    if (rg && (*rg != 'Z' || (pg ? prev : last) != rg
+               || !rg_pg_id_known(tbl->rg_trans, bam_aux2Z(rg), &tbl->last_rg)))
+        return 0;
+    if (pg && (*pg != 'Z' || last != pg
+               || !rg_pg_id_known(tbl->pg_trans, bam_aux2Z(pg), &tbl->last_pg)))
+        return 0;
+    return 1;
+}
+
 static void bam_translate(bam1_t* b, trans_tbl_t* tbl)
 {
     // Update target id if not unmapped tid
-    if ( b->core.tid >= 0 ) { b->core.tid = tbl->tid_trans[b->core.tid]; }
-    if ( b->core.mtid >= 0 ) { b->core.mtid = tbl->tid_trans[b->core.mtid]; }
+    if (!tbl->tid_identity) {
+        if ( b->core.tid >= 0 ) { b->core.tid = tbl->tid_trans[b->core.tid]; }
+        if ( b->core.mtid >= 0 ) { b->core.mtid = tbl->tid_trans[b->core.mtid]; }
+    }
+
+    if (tbl->tag_identity && bam_rg_pg_unchanged(b, tbl))
+        return;
 
     // If we have a RG update it
     uint8_t *rg = bam_aux_get(b, "RG");
@@ -1020,6 +1146,7 @@ int* rtrans_build(int n, int n_targets, trans_tbl_t* translation_tbl)
 #define MERGE_COMBINE_RG 16 // Combine RG tags frather than redefining them
 #define MERGE_COMBINE_PG 32 // Combine PG tags frather than redefining them
 #define MERGE_FIRST_CO   64 // Use only first file's @CO headers (sort cmd only)
+#define MERGE_PARALLEL  128 // Merge regions in parallel (coordinate order only)
 
 
 static hts_reglist_t *duplicate_reglist(const hts_reglist_t *rl, int rn) {
@@ -1070,6 +1197,266 @@ static hts_reglist_t *duplicate_reglist(const hts_reglist_t *rl, int rn) {
  * file. Finally we write our chosen read it to the output file.
  */
 
+/*
+ * Loser tree used to pick the next record in bam_merge_core2().
+ *
+ * The entries are kept in input order in a heap1_t array (using heap_lt()
+ * for comparisons), with tree[0] holding the index of the current winner
+ * and tree[1..n-1] the losers of each match.  Replacing the winner needs
+ * only one comparison per level, where a binary heap needs two.
+ */
+static int loser_tree_init(int n, const heap1_t *entries, int *tree)
+{
+    int j, *win;
+    if (n == 1) {
+        tree[0] = 0;
+        return 0;
+    }
+    win = malloc(2 * n * sizeof(*win));
+    if (!win) return -1;
+    for (j = 0; j < n; j++)
+        win[n + j] = j;
+    for (j = n - 1; j >= 1; j--) {
+        int a = win[2 * j], b = win[2 * j + 1];
+        if (heap_lt(entries[a], entries[b])) { // a > b, so b wins
+            win[j] = b;
+            tree[j] = a;
+        } else {
+            win[j] = a;
+            tree[j] = b;
+        }
+    }
+    tree[0] = win[1];
+    free(win);
+    return 0;
+}
+
+// Replays the matches on the path from entry i (the last winner) to the root
+static inline void loser_tree_replay(int n, const heap1_t *entries, int *tree,
+                                     int i)
+{
+    int node, cur = i;
+    for (node = (i + n) / 2; node >= 1; node /= 2) {
+        if (heap_lt(entries[cur], entries[tree[node]])) {
+            int tmp = tree[node];
+            tree[node] = cur;
+            cur = tmp;
+        }
+    }
+    tree[0] = cur;
+}
+
+/*
+ * Read-ahead for bam_merge_core2() inputs.  Each input has two batches of
+ * records; while one is consumed by the merge the other is filled by a
+ * job on the thread pool, so decompression of each input overlaps with
+ * the merge and a slow input doesn't hold up the others.  The records
+ * are translated to the output header as they are read.
+ */
+#define MERGE_BATCH_SIZE 128
+
+typedef struct merge_input merge_input_t;
+
+typedef struct {
+    merge_input_t *in;
+    bam1_t *recs[MERGE_BATCH_SIZE];
+    int n, next;
+    int res; // 0 if more data may follow, -1 on EOF, -2 on error
+} merge_batch_t;
+
+struct merge_input {
+    samFile *fp;
+    sam_hdr_t *hdr;
+    hts_itr_t *iter;
+    trans_tbl_t *tbl;
+    hts_tpool *pool;
+    hts_tpool_process *q;
+    merge_batch_t batch[2];
+    int cur;      // batch being consumed
+    int pending;  // set if the other batch is being filled
+};
+
+static void *merge_batch_fill(void *arg)
+{
+    merge_batch_t *mb = (merge_batch_t *) arg;
+    merge_input_t *in = mb->in;
+
+    mb->n = mb->next = mb->res = 0;
+    while (mb->n < MERGE_BATCH_SIZE) {
+        bam1_t *b = mb->recs[mb->n];
+        int r = in->iter
+            ? sam_itr_next(in->fp, in->iter, b)
+            : sam_read1(in->fp, in->hdr, b);
+        if (r < 0) {
+            mb->res = (r == -1 && (!in->iter || in->iter->finished)) ? -1 : -2;
+            break;
+        }
+        bam_translate(b, in->tbl);
+        mb->n++;
+    }
+    return mb;
+}
+
+// Starts filling batch bi, on the thread pool if there is one
+static int merge_input_fill(merge_input_t *in, int bi)
+{
+    if (!in->q) {
+        merge_batch_fill(&in->batch[bi]);
+        return 0;
+    }
+    if (hts_tpool_dispatch(in->pool, in->q, merge_batch_fill,
+                           &in->batch[bi]) < 0)
+        return -1;
+    in->pending = 1;
+    return 0;
+}
+
+// Waits for an outstanding fill to complete
+static void merge_input_wait(merge_input_t *in)
+{
+    if (in->pending) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(in->q);
+        hts_tpool_delete_result(r, 0);
+        in->pending = 0;
+    }
+}
+
+static int merge_input_init(merge_input_t *in, samFile *fp, sam_hdr_t *hdr,
+                            hts_itr_t *iter, trans_tbl_t *tbl, hts_tpool *pool)
+{
+    int i, j;
+    memset(in, 0, sizeof(*in));
+    in->fp = fp;
+    in->hdr = hdr;
+    in->iter = iter;
+    in->tbl = tbl;
+    for (i = 0; i < 2; i++) {
+        in->batch[i].in = in;
+        for (j = 0; j < MERGE_BATCH_SIZE; j++)
+            if (!(in->batch[i].recs[j] = bam_init1()))
+                return -1;
+    }
+    if (pool) {
+        in->pool = pool;
+        if (!(in->q = hts_tpool_process_init(pool, 2, 0)))
+            return -1;
+    }
+    return 0;
+}
+
+static void merge_input_destroy(merge_input_t *in)
+{
+    int i, j;
+    if (in->q) {
+        merge_input_wait(in);
+        hts_tpool_process_destroy(in->q);
+        in->q = NULL;
+    }
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < MERGE_BATCH_SIZE; j++) {
+            if (in->batch[i].recs[j]) bam_destroy1(in->batch[i].recs[j]);
+            in->batch[i].recs[j] = NULL;
+        }
+    }
+}
+
+// Starts the first fill of an input.  Batch 1 is left empty and marked
+// as consumed, so the first merge_input_next() call switches to batch 0.
+static int merge_input_start(merge_input_t *in)
+{
+    in->cur = 1;
+    return merge_input_fill(in, 0);
+}
+
+/*
+ * Gets the next record from an input.  The record remains valid until the
+ * following call.
+ * Returns 0 on success, -1 at the end of the input and -2 on error.
+ */
+static int merge_input_next(merge_input_t *in, bam1_t **b)
+{
+    merge_batch_t *mb = &in->batch[in->cur];
+
+    while (mb->next >= mb->n) {
+        if (mb->res != 0)
+            return mb->res;
+
+        // Switch to the other batch, and start refilling this one
+        merge_input_wait(in);
+        in->cur ^= 1;
+        mb = &in->batch[in->cur];
+        if (mb->res == 0 && merge_input_fill(in, in->cur ^ 1) < 0)
+            return -2;
+    }
+    *b = mb->recs[mb->next++];
+    return 0;
+}
+
+// Fills out the merge entry for record b, just read from input h->i.
+// Returns 0 on success, -1 if the template coordinate key can't be made.
+static inline int merge_entry_set(heap1_t *h, bam1_t *b, uint64_t *idx,
+                                  template_coordinate_keys_t *keys,
+                                  sam_hdr_t *hout,
+                                  khash_t(const_c2c) *lib_lookup)
+{
+    h->entry.bam_record = b;
+    h->tid = b->core.tid;
+    h->pos = (uint64_t)(b->core.pos + 1);
+    h->rev = bam_is_rev(b);
+    h->idx = (*idx)++;
+    if (g_sam_order == TagQueryName || g_sam_order == TagCoordinate) {
+        h->entry.u.tag = bam_aux_get(b, g_sort_tag);
+    } else if (g_sam_order == TemplateCoordinate) {
+        template_coordinate_key_t *key = template_coordinate_keys_get(keys, h->i); // get the next key to use
+        h->entry.u.key = template_coordinate_key(b, key, hout, lib_lookup); // update the key
+        if (h->entry.u.key == NULL) return -1; // key could not be created, error out
+    } else {
+        h->entry.u.tag = NULL;
+    }
+    return 0;
+}
+
+static inline void merge_entry_clear(heap1_t *h)
+{
+    h->pos = HEAP_EMPTY;
+    h->entry.bam_record = NULL;
+    h->entry.u.tag = NULL;
+    h->entry.u.key = NULL;
+}
+
+static int sort_bgzf_mode(const char *modeout, const htsFormat *out_fmt,
+                          char *bgzf_mode);
+static int bam_merge_regions(const char *out, const char *bgzf_mode,
+                             sam_hdr_t *hout, int n, char * const *fn,
+                             char * const *fn_idx, trans_tbl_t *tbl,
+                             int n_parts, htsThreadPool *htspool,
+                             char *arg_list, int no_pg, const char *cmd);
+
+// Checks if the inputs can be merged by bam_merge_regions().  They must
+// be BAM files with headers that don't change the target ids, and the
+// output must be BAM.
+static int can_merge_regions(int n, samFile **fp, trans_tbl_t *tbl,
+                             sam_hdr_t *hout, const char *mode,
+                             const htsFormat *out_fmt, char *bgzf_mode)
+{
+    int i, j, nref = sam_hdr_nref(hout);
+    if (sort_bgzf_mode(mode, out_fmt, bgzf_mode) < 0)
+        return 0;
+    for (i = 0; i < nref; i++) {
+        if (sam_hdr_tid2len(hout, i) > INT32_MAX)
+            return 0;
+    }
+    for (i = 0; i < n; i++) {
+        if (hts_get_format(fp[i])->format != bam || tbl[i].lost_coord_sort)
+            return 0;
+        for (j = 0; j < tbl[i].n_targets; j++) {
+            if (tbl[i].tid_trans[j] != j)
+                return 0;
+        }
+    }
+    return 1;
+}
+
 /*!
   @abstract    Merge multiple sorted BAM.
   @param  sam_order   the order in which the data was sorted
@@ -1083,7 +1470,8 @@ static hts_reglist_t *duplicate_reglist(const hts_reglist_t *rl, int rn) {
   @param  fn          names of files to be merged
   @param  flag        flags that control how the merge is undertaken
   @param  reg         region to merge
-  @param  n_threads   number of threads to use (passed to htslib)
+  @param  n_threads   number of threads to use for output compression
+                      and input read-ahead
   @param  cmd         command name (used in print_error() etc)
   @param  in_fmt      format options for input files
   @param  out_fmt     output file format and options
@@ -1099,8 +1487,11 @@ int bam_merge_core2(SamOrder sam_order, char* sort_tag, const char *out, const c
                     const char *cmd, const htsFormat *in_fmt, const htsFormat *out_fmt,
                     int write_index, char *arg_list, int no_pg)
 {
-    samFile *fpout, **fp = NULL;
+    samFile *fpout = NULL, **fp = NULL;
     heap1_t *heap = NULL;
+    int *tree = NULL;
+    merge_input_t *inputs = NULL;
+    htsThreadPool p = { NULL, 0 };
     sam_hdr_t *hout = NULL;
     sam_hdr_t *hin  = NULL;
     int i, j, *RG_len = NULL;
@@ -1118,6 +1509,7 @@ int bam_merge_core2(SamOrder sam_order, char* sort_tag, const char *out, const c
     refs_t *refs = NULL;
     template_coordinate_keys_t *keys = NULL;
     khash_t(const_c2c) *lib_lookup = NULL;
+    int ret = -1;
 
     // Is there a specified pre-prepared header to use for output?
     if (headers) {
@@ -1144,6 +1536,10 @@ int bam_merge_core2(SamOrder sam_order, char* sort_tag, const char *out, const c
     if (!fp) goto mem_fail;
     heap = (heap1_t*)calloc(n, sizeof(heap1_t));
     if (!heap) goto mem_fail;
+    tree = (int*)calloc(n, sizeof(int));
+    if (!tree) goto mem_fail;
+    inputs = (merge_input_t*)calloc(n, sizeof(merge_input_t));
+    if (!inputs) goto mem_fail;
     iter = (hts_itr_t**)calloc(n, sizeof(hts_itr_t*));
     if (!iter) goto mem_fail;
     hdr = (sam_hdr_t**)calloc(n, sizeof(sam_hdr_t*));
@@ -1345,37 +1741,58 @@ int bam_merge_core2(SamOrder sam_order, char* sort_tag, const char *out, const c
         }
     }
 
-    // Load the first read from each file into the heap
+    // The thread pool is shared by output compression and input read-ahead
+    if (n_threads > 0) {
+        if (!(p.pool = hts_tpool_init(n_threads))) {
+            print_error_errno(cmd, "failed to set up thread pool");
+            goto fail;
+        }
+    }
+
+    if (flag & MERGE_PARALLEL) {
+        char bgzf_mode[3];
+        int res = 1;
+        if (sam_order == Coordinate && n_threads > 1 && !reg && !fn_bed
+            && !(flag & MERGE_RG) && !write_index
+            && can_merge_regions(n, fp, translation_tbl, hout, mode, out_fmt,
+                                 bgzf_mode)) {
+            res = bam_merge_regions(out, bgzf_mode, hout, n, fn, fn_idx,
+                                    translation_tbl, n_threads, &p, arg_list,
+                                    no_pg, cmd);
+            if (res < 0)
+                goto fail;
+        }
+        if (res == 0) {
+            ret = 0;
+            goto cleanup;
+        }
+        fprintf(stderr, "[W::%s] Unable to merge regions in parallel, "
+                "merging serially\n", cmd);
+    }
+
+    // Start reading ahead on each input
+    for (i = 0; i < n; ++i) {
+        if (merge_input_init(&inputs[i], fp[i], hdr[i], iter[i],
+                             translation_tbl + i, p.pool) < 0)
+            goto mem_fail;
+        if (merge_input_start(&inputs[i]) < 0) {
+            print_error_errno(cmd, "failed to start reading \"%s\"", fn[i]);
+            goto fail;
+        }
+    }
+
+    // Load the first read from each file into the tree
     for (i = 0; i < n; ++i) {
         heap1_t *h = heap + i;
+        bam1_t *b = NULL;
         int res;
         h->i = i;
-        h->entry.bam_record = bam_init1();
-        h->entry.u.tag = NULL;
-        if (!h->entry.bam_record) goto mem_fail;
-        res = iter[i] ? sam_itr_next(fp[i], iter[i], h->entry.bam_record) : sam_read1(fp[i], hdr[i], h->entry.bam_record);
+        res = merge_input_next(&inputs[i], &b);
         if (res >= 0) {
-            bam_translate(h->entry.bam_record, translation_tbl + i);
-            h->tid = h->entry.bam_record->core.tid;
-            h->pos = (uint64_t)(h->entry.bam_record->core.pos + 1);
-            h->rev = bam_is_rev(h->entry.bam_record);
-            h->idx = idx++;
-            if (g_sam_order == TagQueryName || g_sam_order == TagCoordinate) {
-                h->entry.u.tag = bam_aux_get(h->entry.bam_record, g_sort_tag);
-            } else if (g_sam_order == TemplateCoordinate) {
-                template_coordinate_key_t *key = template_coordinate_keys_get(keys, i); // get the next key to use
-                h->entry.u.key = template_coordinate_key(h->entry.bam_record, key, hout, lib_lookup); // update the key
-                if (h->entry.u.key == NULL) goto fail; // key could not be created, error out
-            } else {
-                h->entry.u.tag = NULL;
-            }
-        }
-        else if (res == -1 && (!iter[i] || iter[i]->finished)) {
-            h->pos = HEAP_EMPTY;
-            bam_destroy1(h->entry.bam_record);
-            h->entry.bam_record = NULL;
-            h->entry.u.tag = NULL;
-            h->entry.u.key = NULL;
+            if (merge_entry_set(h, b, &idx, keys, hout, lib_lookup) < 0)
+                goto fail;
+        } else if (res == -1) {
+            merge_entry_clear(h);
         } else {
             print_error(cmd, "failed to read first record from \"%s\"", fn[i]);
             goto fail;
@@ -1385,7 +1802,7 @@ int bam_merge_core2(SamOrder sam_order, char* sort_tag, const char *out, const c
     // Open output file and write header
     if ((fpout = sam_open_format(out, mode, out_fmt)) == 0) {
         print_error_errno(cmd, "failed to create \"%s\"", out);
-        return -1;
+        goto fail;
     }
     hts_set_opt(fpout, HTS_OPT_BLOCK_SIZE, BAM_BLOCK_SIZE);
     if (!no_pg && sam_hdr_add_pg(hout, "samtools",
@@ -1394,65 +1811,47 @@ int bam_merge_core2(SamOrder sam_order, char* sort_tag, const char *out, const c
                                  arg_list ? arg_list : NULL,
                                  NULL)) {
         print_error(cmd, "failed to add PG line to the header of \"%s\"", out);
-        sam_close(fpout);
-        return -1;
+        goto fail;
     }
     if (sam_hdr_write(fpout, hout) != 0) {
         print_error_errno(cmd, "failed to write header to \"%s\"", out);
-        sam_close(fpout);
-        return -1;
+        goto fail;
     }
     if (write_index) {
-        if (!(out_idx_fn = auto_index(fpout, out, hout))){
-            sam_close(fpout);
-            return -1;
-        }
+        if (!(out_idx_fn = auto_index(fpout, out, hout)))
+            goto fail;
     }
-    if (!(flag & MERGE_UNCOMP)) hts_set_threads(fpout, n_threads);
+    if (p.pool && !(flag & MERGE_UNCOMP))
+        hts_set_opt(fpout, HTS_OPT_THREAD_POOL, &p);
 
     if (refs && hts_set_opt(fpout, CRAM_OPT_SHARED_REF, refs))
         goto fail;
 
     // Begin the actual merge
-    ks_heapmake(heap, n, heap);
-    while (heap->pos != HEAP_EMPTY) {
-        bam1_t *b = heap->entry.bam_record;
+    if (loser_tree_init(n, heap, tree) < 0)
+        goto mem_fail;
+    while (heap[tree[0]].pos != HEAP_EMPTY) {
+        heap1_t *h = &heap[tree[0]];
+        bam1_t *b = h->entry.bam_record;
         if (flag & MERGE_RG) {
             uint8_t *rg = bam_aux_get(b, "RG");
             if (rg) bam_aux_del(b, rg);
-            bam_aux_append(b, "RG", 'Z', RG_len[heap->i] + 1, (uint8_t*)RG[heap->i]);
+            bam_aux_append(b, "RG", 'Z', RG_len[h->i] + 1, (uint8_t*)RG[h->i]);
         }
         if (sam_write1(fpout, hout, b) < 0) {
             print_error_errno(cmd, "failed writing to \"%s\"", out);
-            sam_close(fpout);
-            free(out_idx_fn);
-            return -1;
+            goto fail;
         }
-        if ((j = (iter[heap->i]? sam_itr_next(fp[heap->i], iter[heap->i], b) : sam_read1(fp[heap->i], hdr[heap->i], b))) >= 0) {
-            bam_translate(b, translation_tbl + heap->i);
-            heap->tid = b->core.tid;
-            heap->pos = (uint64_t)(b->core.pos + 1);
-            heap->rev = bam_is_rev(b);
-            heap->idx = idx++;
-            if (g_sam_order == TagQueryName || g_sam_order == TagCoordinate) {
-                heap->entry.u.tag = bam_aux_get(heap->entry.bam_record, g_sort_tag);
-            } else if (g_sam_order == TemplateCoordinate) {
-                template_coordinate_key_t *key = template_coordinate_keys_get(keys, heap->i); // get the next key to use
-                heap->entry.u.key = template_coordinate_key(heap->entry.bam_record, key, hout, lib_lookup); // update the key
-                if (heap->entry.u.key == NULL) goto fail; // key could not be created, error out
-            } else {
-                heap->entry.u.tag = NULL;
-            }
-        } else if (j == -1 && (!iter[heap->i] || iter[heap->i]->finished)) {
-            heap->pos = HEAP_EMPTY;
-            bam_destroy1(heap->entry.bam_record);
-            heap->entry.bam_record = NULL;
-            heap->entry.u.tag = NULL;
+        if ((j = merge_input_next(&inputs[h->i], &b)) >= 0) {
+            if (merge_entry_set(h, b, &idx, keys, hout, lib_lookup) < 0)
+                goto fail;
+        } else if (j == -1) {
+            merge_entry_clear(h);
         } else {
-            print_error(cmd, "\"%s\" is truncated", fn[heap->i]);
+            print_error(cmd, "\"%s\" is truncated", fn[h->i]);
             goto fail;
         }
-        ks_heapadjust(heap, 0, n, heap);
+        loser_tree_replay(n, heap, tree, h->i);
     }
 
     if (write_index) {
@@ -1461,43 +1860,23 @@ int bam_merge_core2(SamOrder sam_order, char* sort_tag, const char *out, const c
             goto fail;
         }
     }
-    free(out_idx_fn);
 
-    // Clean up and close
-    if (flag & MERGE_RG) {
-        for (i = 0; i != n; ++i) free(RG[i]);
-        free(RG_len);
-    }
-    for (i = 0; i < n; ++i) {
-        trans_tbl_destroy(translation_tbl + i);
-        hts_itr_destroy(iter[i]);
-        sam_hdr_destroy(hdr[i]);
-        sam_close(fp[i]);
-    }
-    sam_hdr_destroy(hin);
-    sam_hdr_destroy(hout);
-    free_merged_header(merged_hdr);
-    hts_reglist_free(lreg, nreg);
-    bed_destroy(hreg);
-    free(RG); free(translation_tbl); free(fp); free(heap); free(iter); free(hdr);
-    if (sam_close(fpout) < 0) {
+    // Close the inputs first, to stop any read-ahead
+    for (i = 0; i < n; ++i)
+        merge_input_destroy(&inputs[i]);
+    ret = sam_close(fpout);
+    fpout = NULL;
+    if (ret < 0)
         print_error_errno(cmd, "error closing output file \"%s\"", out);
-        return -1;
-    }
-    if (keys != NULL) {
-        for (i = 0; i < keys->m; ++i) {
-            free(keys->buffers[i]);
-        }
-        free(keys->buffers);
-        free(keys);
-    }
-    lib_lookup_destroy(lib_lookup);
-    return 0;
+    goto cleanup;
 
  mem_fail:
     print_error(cmd, "Out of memory");
 
  fail:
+    ret = -1;
+
+ cleanup:
     if (flag & MERGE_RG) {
         if (RG) {
             for (i = 0; i != n; ++i) free(RG[i]);
@@ -1505,12 +1884,14 @@ int bam_merge_core2(SamOrder sam_order, char* sort_tag, const char *out, const c
         free(RG_len);
     }
     for (i = 0; i < n; ++i) {
+        if (inputs) merge_input_destroy(&inputs[i]);
         if (translation_tbl && translation_tbl[i].tid_trans) trans_tbl_destroy(translation_tbl + i);
         if (iter && iter[i]) hts_itr_destroy(iter[i]);
         if (hdr && hdr[i]) sam_hdr_destroy(hdr[i]);
         if (fp && fp[i]) sam_close(fp[i]);
-        if (heap && heap[i].entry.bam_record) bam_destroy1(heap[i].entry.bam_record);
     }
+    if (fpout) sam_close(fpout);
+    if (p.pool) hts_tpool_destroy(p.pool);
     if (hout) sam_hdr_destroy(hout);
     free(RG);
     free(translation_tbl);
@@ -1519,6 +1900,8 @@ int bam_merge_core2(SamOrder sam_order, char* sort_tag, const char *out, const c
     bed_destroy(hreg);
     free(iter);
     free(heap);
+    free(tree);
+    free(inputs);
     free(fp);
     free(rtrans);
     free(out_idx_fn);
@@ -1530,7 +1913,9 @@ int bam_merge_core2(SamOrder sam_order, char* sort_tag, const char *out, const c
         free(keys);
     }
     lib_lookup_destroy(lib_lookup);
-    return -1;
+    sam_hdr_destroy(hin);
+    free_merged_header(merged_hdr);
+    return ret;
 }
 
 // Unused here but may be used by legacy samtools-using third-party code
@@ -1569,7 +1954,8 @@ static void merge_usage(FILE *to)
 "  -X         Use customized index files\n"
 "  -L FILE    Specify a BED file for multiple region filtering [null]\n"
 "  --no-PG    do not add a PG line\n"
-"  --template-coordinate Input files are sorted by template-coordinate\n");
+"  --template-coordinate Input files are sorted by template-coordinate\n"
+"  --parallel-regions Merge regions of indexed BAM files in parallel (needs -@)\n");
     sam_global_opt_help(to, "-.O..@..");
 }
 
@@ -1586,10 +1972,11 @@ int bam_merge(int argc, char *argv[])
 
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@', '-', '-'),
         { "threads", required_argument, NULL, '@' },
         {"no-PG", no_argument, NULL, 1},
         { "template-coordinate", no_argument, NULL, 2},
+        { "parallel-regions", no_argument, NULL, 3},
         { NULL, 0, NULL, 0 }
     };
 
@@ -1640,6 +2027,7 @@ int bam_merge(int argc, char *argv[])
         }
         case 1: no_pg = 1; break;
         case 2: sam_order = TemplateCoordinate; break;
+        case 3: flag |= MERGE_PARALLEL; break;
         default:  if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
                   /* else fall-through */
         case '?': merge_usage(stderr); return 1;
@@ -1805,6 +2193,7 @@ static int bam_merge_simple(SamOrder sam_order, char *sort_tag, const char *out,
                             const htsFormat *out_fmt, char *arg_list, int no_pg,
                             int write_index, int final_out) {
     samFile *fpout = NULL, **fp = NULL;
+    sam_pipe *pipe = final_out ? sam_stage_output(out) : NULL;
     heap1_t *heap = NULL;
     uint64_t idx = 0;
     int i, heap_size = n + num_in_mem;
@@ -1867,12 +2256,15 @@ static int bam_merge_simple(SamOrder sam_order, char *sort_tag, const char *out,
         }
     }
 
-    // Open output file and write header
-    if ((fpout = sam_open_format(out, mode, out_fmt)) == 0) {
-        print_error_errno(cmd, "failed to create \"%s\"", out);
-        return -1;
+    // Open output file and write header, unless passing the records on to
+    // the next stage of a pipeline
+    if (!pipe) {
+        if ((fpout = sam_open_format(out, mode, out_fmt)) == 0) {
+            print_error_errno(cmd, "failed to create \"%s\"", out);
+            return -1;
+        }
+        hts_set_opt(fpout, HTS_OPT_BLOCK_SIZE, BAM_BLOCK_SIZE);
     }
-    hts_set_opt(fpout, HTS_OPT_BLOCK_SIZE, BAM_BLOCK_SIZE);
 
     if (!no_pg && sam_hdr_add_pg(hout, "samtools",
                                  "VN", samtools_version(),
@@ -1880,16 +2272,17 @@ static int bam_merge_simple(SamOrder sam_order, char *sort_tag, const char *out,
                                  arg_list ? arg_list : NULL,
                                  NULL)) {
         print_error(cmd, "failed to add PG line to the header of \"%s\"", out);
-        sam_close(fpout);
+        if (fpout) sam_close(fpout);
         return -1;
     }
 
-    if (htspool->pool)
+    if (htspool->pool && fpout)
         hts_set_opt(fpout, HTS_OPT_THREAD_POOL, htspool);
 
-    if (sam_hdr_write(fpout, hout) != 0) {
+    if ((pipe ? sam_pipe_write_header(pipe, hout)
+              : sam_hdr_write(fpout, hout)) != 0) {
         print_error_errno(cmd, "failed to write header to \"%s\"", out);
-        sam_close(fpout);
+        if (fpout) sam_close(fpout);
         return -1;
     }
 
@@ -1910,7 +2303,7 @@ static int bam_merge_simple(SamOrder sam_order, char *sort_tag, const char *out,
             b->core.mpos = -1;
             b->core.isize = 0;
         }
-        if (sam_write1(fpout, hout, b) < 0) {
+        if ((pipe ? sam_pipe_write(pipe, b) : sam_write1(fpout, hout, b)) < 0) {
             print_error_errno(cmd, "failed writing to \"%s\"", out);
             goto fail;
         }
@@ -1941,7 +2334,7 @@ static int bam_merge_simple(SamOrder sam_order, char *sort_tag, const char *out,
         free(out_idx_fn);
     }
 
-    if (sam_close(fpout) < 0) {
+    if (fpout && sam_close(fpout) < 0) {
         print_error_errno(cmd, "error closing output file \"%s\"", out);
         return -1;
     }
@@ -1964,53 +2357,602 @@ static int bam_merge_simple(SamOrder sam_order, char *sort_tag, const char *out,
     return -1;
 }
 
-// Function to compare reads and determine which one is < or > the other
-// Handle sort-by-pos and sort-by-name. Used as the secondary sort in bam1_lt_by_tag, if reads are equivalent by tag.
-// Returns a value less than, equal to or greater than zero if a is less than,
-// equal to or greater than b, respectively.
-static inline int bam1_cmp_core(const bam1_tag a, const bam1_tag b)
-{
-    uint64_t pa, pb;
-    if (!a.bam_record) return 1;
-    if (!b.bam_record) return 0;
-
-    if (g_sam_order == QueryName || g_sam_order == TagQueryName) {
-        int t = strnum_cmp(bam_get_qname(a.bam_record), bam_get_qname(b.bam_record));
-        if (t != 0) return t;
-        int af = a.bam_record->core.flag;
-        int bf = b.bam_record->core.flag;
-        // Sort order is READ1, READ2, (PRIMARY), SUPPLEMENTARY, SECONDARY
-        // Get the bits in this order so sort is a natural a-b
-        af = ((af&0xc0)<<8)|((af&0x100)<<3)|((af&0x800)>>3);
-        bf = ((bf&0xc0)<<8)|((bf&0x100)<<3)|((bf&0x800)>>3);
-        return af - bf;
-    } else {
-        pa = a.bam_record->core.tid;
-        pb = b.bam_record->core.tid;
+/*
+ * Partitioned merge for coordinate sorted output.
+ *
+ * The key space is split into ranges using (tid, pos) samples taken while
+ * reading the input.  Each range is merged by its own thread, reading the
+ * temporary files through their indexes and the in-memory blocks by
+ * binary search, and written to a headerless BGZF part file.  The part
+ * files are then concatenated onto the output header without being
+ * decompressed, so the result is identical to that of bam_merge_simple().
+ */
 
-        if (pa == pb) {
-            pa = (uint64_t)(a.bam_record->core.pos+1);
-            pb = (uint64_t)(b.bam_record->core.pos+1);
-        }
+#define MERGE_PART_MAX_OPEN 512  // Limit on part threads * temporary files
+#define BGZF_EMPTY_BLOCK_SIZE 28
+
+static const uint8_t bgzf_empty_block[BGZF_EMPTY_BLOCK_SIZE] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+    0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00
+};
+
+// Packs tid and pos into a single key with the same ordering as
+// ks_radixsort.  Unmapped (tid -1) reads are mapped to nref so they
+// come last.  Only used when positions fit in 32 bits.
+static inline uint64_t coord_key(const bam1_t *b, uint32_t nref) {
+    uint32_t tid = b->core.tid < 0 ? nref : (uint32_t) b->core.tid;
+    return ((uint64_t) tid << 32) | (uint32_t) (b->core.pos + 1);
+}
 
-        if (pa == pb) {
-            pa = bam_is_rev(a.bam_record);
-            pb = bam_is_rev(b.bam_record);
-        }
+typedef struct {
+    samFile *fp;
+    hts_itr_t *itr;
+    uint32_t tid;   // Reference currently being iterated
+} merge_part_src_t;
 
-        return pa < pb ? -1 : (pa > pb ? 1 : 0);
-    }
+typedef struct {
+    uint64_t lo, hi;           // Key range [lo, hi) to merge
+    uint32_t nref;
+    int n_files;
+    char * const *fn;
+    hts_idx_t **idx;
+    int num_in_mem;
+    const buf_region *in_mem;
+    bam1_tag *buf;
+    htsThreadPool *htspool;
+    trans_tbl_t *tbl;          // Per-file header translation, if needed,
+                               // private to this part
+    char *out_fn;
+    const char *bgzf_mode;
+    int error;
+} merge_part_t;
+
+// Finds the first record in buf[from, to) with a key >= key
+static size_t in_mem_lower_bound(const bam1_tag *buf, size_t from, size_t to,
+                                 uint64_t key, uint32_t nref) {
+    while (from < to) {
+        size_t mid = from + (to - from) / 2;
+        if (coord_key(buf[mid].bam_record, nref) < key)
+            from = mid + 1;
+        else
+            to = mid;
+    }
+    return from;
 }
 
-uint8_t normalize_type(const uint8_t* aux) {
-    if (*aux == 'c' || *aux == 'C' || *aux == 's' || *aux == 'S' || *aux == 'i' || *aux == 'I') {
-        return 'c';
-    } else if (*aux == 'f' || *aux == 'd') {
-        return 'f';
-    } else if (*aux == 'H' || *aux == 'Z') {
-         return 'H';
-    } else {
-        return *aux;
+// Reads the next record in the partition range from temporary file i.
+// Returns 0 on success, -1 when there are no more records and -2 on error.
+static int merge_part_src_next(merge_part_t *m, merge_part_src_t *s, int i,
+                               bam1_t *b) {
+    uint32_t t_hi = m->hi == UINT64_MAX ? m->nref : (uint32_t) (m->hi >> 32);
+
+    for (;;) {
+        if (s->itr) {
+            int r = sam_itr_next(s->fp, s->itr, b);
+            if (r >= 0) {
+                uint64_t key = coord_key(b, m->nref);
+                if (key < m->lo)
+                    continue; // Overlaps the start, belongs to an earlier part
+                if (key < m->hi) {
+                    if (m->tbl)
+                        bam_translate(b, &m->tbl[i]);
+                    return 0;
+                }
+                r = -1;       // Past the end of the range
+                s->tid = t_hi;
+            }
+            if (r < -1)
+                return -2;
+            hts_itr_destroy(s->itr);
+            s->itr = NULL;
+            s->tid++;
+        }
+        if (s->tid > t_hi)
+            return -1;
+
+        if (s->tid == m->nref) {
+            if (hts_idx_get_n_no_coor(m->idx[i]) == 0) {
+                s->tid++;
+                continue;
+            }
+            s->itr = sam_itr_queryi(m->idx[i], HTS_IDX_NOCOOR, 0, 0);
+        } else {
+            uint64_t mapped = 0, unmapped = 0;
+            hts_pos_t beg = 0, end = HTS_POS_MAX;
+            if (hts_idx_get_stat(m->idx[i], s->tid, &mapped, &unmapped) == 0
+                && mapped + unmapped == 0) {
+                s->tid++;
+                continue;
+            }
+            if (s->tid == (uint32_t) (m->lo >> 32) && (m->lo & 0xffffffff) > 0)
+                beg = (hts_pos_t) (m->lo & 0xffffffff) - 1;
+            if (s->tid == t_hi && m->hi != UINT64_MAX)
+                end = (hts_pos_t) (m->hi & 0xffffffff);
+            if (end <= beg) {
+                s->tid++;
+                continue;
+            }
+            s->itr = sam_itr_queryi(m->idx[i], s->tid, beg, end);
+        }
+        if (!s->itr)
+            return -2;
+    }
+}
+
+static void *merge_part_worker(void *data) {
+    merge_part_t *m = (merge_part_t *) data;
+    merge_part_src_t *src = NULL;
+    buf_region *in_mem = NULL;
+    heap1_t *heap = NULL;
+    hFILE *hfp = NULL;
+    BGZF *out = NULL;
+    uint64_t idx = 0;
+    int i, heap_size = m->n_files + m->num_in_mem;
+
+    m->error = 0;
+    src = calloc(m->n_files ? m->n_files : 1, sizeof(*src));
+    in_mem = calloc(m->num_in_mem ? m->num_in_mem : 1, sizeof(*in_mem));
+    heap = calloc(heap_size ? heap_size : 1, sizeof(*heap));
+    if (!src || !in_mem || !heap) goto fail;
+
+    for (i = 0; i < m->num_in_mem; i++) {
+        size_t from = m->in_mem[i].from, to = m->in_mem[i].to;
+        in_mem[i].from = in_mem_lower_bound(m->buf, from, to, m->lo, m->nref);
+        in_mem[i].to = m->hi == UINT64_MAX
+            ? to : in_mem_lower_bound(m->buf, in_mem[i].from, to, m->hi, m->nref);
+    }
+
+    for (i = 0; i < heap_size; i++) {
+        heap1_t *h = &heap[i];
+        int res;
+        h->i = i;
+        h->entry.u.tag = NULL;
+        if (i < m->n_files) {
+            merge_part_src_t *s = &src[i];
+            s->fp = sam_open(m->fn[i], "r");
+            if (!s->fp) goto fail;
+            if (m->htspool->pool)
+                hts_set_opt(s->fp, HTS_OPT_THREAD_POOL, m->htspool);
+            sam_hdr_t *hin = sam_hdr_read(s->fp);
+            if (!hin) goto fail;
+            sam_hdr_destroy(hin);
+            s->tid = (uint32_t) (m->lo >> 32);
+
+            if (!(h->entry.bam_record = bam_init1())) goto fail;
+            res = merge_part_src_next(m, s, i, h->entry.bam_record);
+            if (res < -1) goto fail;
+        } else {
+            buf_region *r = &in_mem[i - m->n_files];
+            if (r->from < r->to) {
+                h->entry.bam_record = m->buf[r->from++].bam_record;
+                res = 0;
+            } else {
+                res = -1;
+            }
+        }
+        if (res == 0) {
+            h->tid = h->entry.bam_record->core.tid;
+            h->pos = (uint64_t) (h->entry.bam_record->core.pos + 1);
+            h->rev = bam_is_rev(h->entry.bam_record);
+            h->idx = idx++;
+        } else {
+            if (i < m->n_files) bam_destroy1(h->entry.bam_record);
+            h->entry.bam_record = NULL;
+            h->pos = HEAP_EMPTY;
+        }
+    }
+
+    if (!(hfp = hopen(m->out_fn, "wx"))) goto fail;
+    if (!(out = bgzf_hopen(hfp, m->bgzf_mode))) {
+        hclose_abruptly(hfp);
+        goto fail;
+    }
+    if (m->htspool->pool)
+        bgzf_thread_pool(out, m->htspool->pool, 0);
+
+    ks_heapmake(heap, heap_size, heap);
+    while (heap_size && heap->pos != HEAP_EMPTY) {
+        int res;
+        if (bam_write1(out, heap->entry.bam_record) < 0) goto fail;
+
+        i = heap->i;
+        if (i < m->n_files) {
+            res = merge_part_src_next(m, &src[i], i, heap->entry.bam_record);
+            if (res < -1) goto fail;
+        } else {
+            buf_region *r = &in_mem[i - m->n_files];
+            if (r->from < r->to) {
+                heap->entry.bam_record = m->buf[r->from++].bam_record;
+                res = 0;
+            } else {
+                res = -1;
+            }
+        }
+        if (res == 0) {
+            heap->tid = heap->entry.bam_record->core.tid;
+            heap->pos = (uint64_t) (heap->entry.bam_record->core.pos + 1);
+            heap->rev = bam_is_rev(heap->entry.bam_record);
+            heap->idx = idx++;
+        } else {
+            if (i < m->n_files) bam_destroy1(heap->entry.bam_record);
+            heap->entry.bam_record = NULL;
+            heap->pos = HEAP_EMPTY;
+        }
+        ks_heapadjust(heap, 0, heap_size, heap);
+    }
+
+    if (bgzf_close(out) < 0) {
+        out = NULL;
+        goto fail;
+    }
+    out = NULL;
+
+ cleanup:
+    for (i = 0; src && i < m->n_files; i++) {
+        if (src[i].itr) hts_itr_destroy(src[i].itr);
+        if (src[i].fp) sam_close(src[i].fp);
+    }
+    for (i = 0; heap && i < heap_size; i++) {
+        if (heap[i].i < m->n_files && heap[i].entry.bam_record)
+            bam_destroy1(heap[i].entry.bam_record);
+    }
+    free(src);
+    free(in_mem);
+    free(heap);
+    return NULL;
+
+ fail:
+    m->error = errno ? errno : EIO;
+    if (out) bgzf_close(out);
+    goto cleanup;
+}
+
+// Copies a BGZF part file onto the output, dropping its EOF marker block.
+static int append_part_file(BGZF *out, const char *fn, uint8_t *buf,
+                            size_t buf_size) {
+    struct stat st;
+    size_t left;
+    FILE *fp = fopen(fn, "rb");
+    if (!fp) return -1;
+    if (fstat(fileno(fp), &st) < 0) goto fail;
+    left = st.st_size;
+    while (left > 0) {
+        size_t len = left < buf_size ? left : buf_size;
+        if (fread(buf, 1, len, fp) != len) goto fail;
+        left -= len;
+        if (left == 0 && len >= BGZF_EMPTY_BLOCK_SIZE
+            && memcmp(buf + len - BGZF_EMPTY_BLOCK_SIZE, bgzf_empty_block,
+                      BGZF_EMPTY_BLOCK_SIZE) == 0)
+            len -= BGZF_EMPTY_BLOCK_SIZE;
+        if (len > 0 && bgzf_raw_write(out, buf, len) < 0) goto fail;
+    }
+    fclose(fp);
+    return 0;
+ fail:
+    fclose(fp);
+    return -1;
+}
+
+// Makes about 'want' coord_key() samples spread over the reads counted
+// in the indexes, assuming reads are evenly spread along each reference.
+// Returns 0 on success, -1 on failure.
+static int index_samples(hts_idx_t **idx, int n, const sam_hdr_t *h,
+                         size_t want, uint64_t **samples, size_t *n_samples)
+{
+    uint32_t nref = sam_hdr_nref(h), tid;
+    uint64_t *counts, total = 0, j;
+    int i;
+
+    *samples = NULL;
+    *n_samples = 0;
+    if (!(counts = calloc(nref + 1, sizeof(*counts))))
+        return -1;
+    for (i = 0; i < n; i++) {
+        for (tid = 0; tid < nref; tid++) {
+            uint64_t mapped = 0, unmapped = 0;
+            if (hts_idx_get_stat(idx[i], tid, &mapped, &unmapped) == 0)
+                counts[tid] += mapped + unmapped;
+        }
+        counts[nref] += hts_idx_get_n_no_coor(idx[i]);
+    }
+    for (tid = 0; tid <= nref; tid++)
+        total += counts[tid];
+    if (total == 0) {
+        free(counts);
+        return 0;
+    }
+
+    if (!(*samples = malloc((want + 1) * sizeof(**samples)))) {
+        free(counts);
+        return -1;
+    }
+    for (tid = 0; tid <= nref; tid++) {
+        uint64_t m = counts[tid] * want / total;
+        uint64_t len = tid < nref ? sam_hdr_tid2len(h, tid) : 0;
+        for (j = 0; j < m && *n_samples < want; j++) {
+            uint64_t pos = tid < nref ? len * (2 * j + 1) / (2 * m) + 1 : 0;
+            (*samples)[(*n_samples)++] = ((uint64_t) tid << 32) | pos;
+        }
+    }
+    free(counts);
+    return 0;
+}
+
+/*
+ * Merges indexed files and in-memory blocks in coordinate order using
+ * up to n_parts threads.  The files are either sort's temporary files or
+ * merge inputs with index names in fn_idx (NULL to look them up), and
+ * tbl, if not NULL, gives header translations that leave the target ids
+ * unchanged.  Samples is an array of n_samples coord_key() values taken
+ * from the input, used to choose the partition boundaries; if NULL the
+ * boundaries are estimated from the index statistics.  The output is
+ * always BAM, compressed according to bgzf_mode.
+ *
+ * Returns 0 on success
+ *         1 if the data could not be partitioned (nothing is written)
+ *        -1 on failure
+ */
+static int bam_merge_partitioned(const char *out, const char *bgzf_mode,
+                                 sam_hdr_t *hout, int n, char * const *fn,
+                                 char * const *fn_idx, trans_tbl_t *tbl,
+                                 int num_in_mem, buf_region *in_mem,
+                                 bam1_tag *buf, uint64_t *samples,
+                                 size_t n_samples, int n_parts,
+                                 htsThreadPool *htspool, const char *prefix,
+                                 char *arg_list, int no_pg, const char *cmd) {
+    merge_part_t *parts = NULL;
+    pthread_t *tids = NULL;
+    hts_idx_t **idx = NULL;
+    BGZF *fpout = NULL;
+    uint8_t *copy_buf = NULL;
+    uint64_t *bounds = NULL, *idx_samples = NULL;
+    uint32_t nref = sam_hdr_nref(hout);
+    size_t name_len = strlen(prefix) + 30;
+    int i, j, n_started = 0, n_bounds = 0, ret = -1;
+
+    if (n_parts * (n + 1) > MERGE_PART_MAX_OPEN)
+        n_parts = MERGE_PART_MAX_OPEN / (n + 1);
+    if (n_parts < 2)
+        return 1;
+
+    if (n > 0) {
+        idx = calloc(n, sizeof(*idx));
+        if (!idx) goto mem_fail;
+        for (i = 0; i < n; i++) {
+            idx[i] = fn_idx ? hts_idx_load2(fn[i], fn_idx[i])
+                : hts_idx_load(fn[i], HTS_FMT_BAI);
+            if (!idx[i]) {
+                ret = 1; // Fall back to a serial merge
+                goto cleanup;
+            }
+        }
+    }
+
+    if (!samples) {
+        if (index_samples(idx, n, hout, (size_t) n_parts * 64,
+                          &idx_samples, &n_samples) < 0)
+            goto mem_fail;
+        samples = idx_samples;
+    }
+    if (n_parts > n_samples / 16) n_parts = n_samples / 16;
+    if (n_parts < 2) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    // Choose boundaries at evenly spaced sample quantiles
+    bounds = malloc((n_parts + 1) * sizeof(*bounds));
+    if (!bounds) goto mem_fail;
+    ks_introsort(sort_key, n_samples, samples);
+    bounds[n_bounds++] = 0;
+    for (i = 1; i < n_parts; i++) {
+        uint64_t b = samples[(size_t) i * n_samples / n_parts];
+        if (b > bounds[n_bounds - 1])
+            bounds[n_bounds++] = b;
+    }
+    bounds[n_bounds] = UINT64_MAX;
+    n_parts = n_bounds;
+    if (n_parts < 2) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    parts = calloc(n_parts, sizeof(*parts));
+    tids = calloc(n_parts, sizeof(*tids));
+    if (!parts || !tids) goto mem_fail;
+
+    for (i = 0; i < n_parts; i++) {
+        merge_part_t *m = &parts[i];
+        m->lo = bounds[i];
+        m->hi = bounds[i + 1];
+        m->nref = nref;
+        m->n_files = n;
+        m->fn = fn;
+        m->idx = idx;
+        m->num_in_mem = num_in_mem;
+        m->in_mem = in_mem;
+        m->buf = buf;
+        m->htspool = htspool;
+        if (tbl) {
+            if (!(m->tbl = calloc(n, sizeof(*m->tbl)))) goto mem_fail;
+            for (j = 0; j < n; j++)
+                if (trans_tbl_copy(&m->tbl[j], &tbl[j]) < 0) goto mem_fail;
+        }
+        m->bgzf_mode = bgzf_mode;
+        if (!(m->out_fn = calloc(name_len, 1))) goto mem_fail;
+        snprintf(m->out_fn, name_len, "%s.part%.4d.bam", prefix, i);
+    }
+
+    for (i = 0; i < n_parts; i++) {
+        if (pthread_create(&tids[i], NULL, merge_part_worker, &parts[i]) != 0) {
+            print_error_errno(cmd, "failed to start merge thread");
+            break;
+        }
+        n_started++;
+    }
+    for (i = 0; i < n_started; i++)
+        pthread_join(tids[i], NULL);
+    if (n_started < n_parts) goto cleanup;
+
+    for (i = 0; i < n_parts; i++) {
+        if (parts[i].error) {
+            errno = parts[i].error;
+            print_error_errno(cmd, "failed to merge part \"%s\"",
+                              parts[i].out_fn);
+            goto cleanup;
+        }
+    }
+
+    // Write the header, then bolt on the already-compressed parts
+    fpout = strcmp(out, "-") ? bgzf_open(out, bgzf_mode)
+        : bgzf_fdopen(fileno(stdout), bgzf_mode);
+    if (!fpout) {
+        print_error_errno(cmd, "failed to create \"%s\"", out);
+        goto cleanup;
+    }
+    if (!no_pg && sam_hdr_add_pg(hout, "samtools",
+                                 "VN", samtools_version(),
+                                 arg_list ? "CL": NULL,
+                                 arg_list ? arg_list : NULL,
+                                 NULL)) {
+        print_error(cmd, "failed to add PG line to the header of \"%s\"", out);
+        goto cleanup;
+    }
+    if (bam_hdr_write(fpout, hout) < 0 || bgzf_flush(fpout) < 0) {
+        print_error_errno(cmd, "failed to write header to \"%s\"", out);
+        goto cleanup;
+    }
+
+    if (!(copy_buf = malloc(BAM_BLOCK_SIZE))) goto mem_fail;
+    for (i = 0; i < n_parts; i++) {
+        if (append_part_file(fpout, parts[i].out_fn, copy_buf,
+                             BAM_BLOCK_SIZE) < 0) {
+            print_error_errno(cmd, "failed to copy \"%s\" to \"%s\"",
+                              parts[i].out_fn, out);
+            goto cleanup;
+        }
+        unlink(parts[i].out_fn);
+    }
+
+    ret = bgzf_close(fpout);
+    fpout = NULL;
+    if (ret < 0)
+        print_error_errno(cmd, "error closing output file \"%s\"", out);
+    goto cleanup;
+
+ mem_fail:
+    print_error(cmd, "Out of memory");
+
+ cleanup:
+    if (fpout) bgzf_close(fpout);
+    if (parts) {
+        for (i = 0; i < n_parts; i++) {
+            if (parts[i].out_fn) {
+                if (i < n_started) unlink(parts[i].out_fn);
+                free(parts[i].out_fn);
+            }
+            if (parts[i].tbl) {
+                for (j = 0; j < n; j++)
+                    if (parts[i].tbl[j].tid_trans)
+                        trans_tbl_destroy(&parts[i].tbl[j]);
+                free(parts[i].tbl);
+            }
+        }
+    }
+    if (idx) {
+        for (i = 0; i < n; i++)
+            if (idx[i]) hts_idx_destroy(idx[i]);
+    }
+    free(idx);
+    free(parts);
+    free(tids);
+    free(bounds);
+    free(idx_samples);
+    free(copy_buf);
+    return ret;
+}
+
+// Merges coordinate sorted, indexed BAM files by splitting them into
+// n_parts regions that are merged in parallel, for samtools merge
+// --parallel-regions.  Part files are written next to the output, or
+// in the current directory when writing to stdout.
+// Returns 0 on success, 1 if the files could not be merged this way
+// (nothing is written) or -1 on failure.
+static int bam_merge_regions(const char *out, const char *bgzf_mode,
+                             sam_hdr_t *hout, int n, char * const *fn,
+                             char * const *fn_idx, trans_tbl_t *tbl,
+                             int n_parts, htsThreadPool *htspool,
+                             char *arg_list, int no_pg, const char *cmd)
+{
+    kstring_t prefix = KS_INITIALIZE;
+    int ret;
+
+    if (strcmp(out, "-") != 0) {
+        ret = ksprintf(&prefix, "%s.tmp", out);
+    } else {
+        unsigned t = ((unsigned) time(NULL)) ^ ((unsigned) clock());
+        ret = ksprintf(&prefix, "samtools.%d.%u.tmp", (int) getpid(),
+                       t % 10000);
+    }
+    if (ret < 0) {
+        print_error(cmd, "Out of memory");
+        return -1;
+    }
+    ret = bam_merge_partitioned(out, bgzf_mode, hout, n, fn, fn_idx, tbl,
+                                0, NULL, NULL, NULL, 0, n_parts, htspool,
+                                prefix.s, arg_list, no_pg, cmd);
+    ks_free(&prefix);
+    return ret;
+}
+
+// Function to compare reads and determine which one is < or > the other
+// Handle sort-by-pos and sort-by-name. Used as the secondary sort in bam1_lt_by_tag, if reads are equivalent by tag.
+// Returns a value less than, equal to or greater than zero if a is less than,
+// equal to or greater than b, respectively.
+static inline int bam1_cmp_core(const bam1_tag a, const bam1_tag b)
+{
+    uint64_t pa, pb;
+    if (!a.bam_record) return 1;
+    if (!b.bam_record) return 0;
+
+    if (g_sam_order == QueryName || g_sam_order == TagQueryName) {
+        int t = strnum_cmp(bam_get_qname(a.bam_record), bam_get_qname(b.bam_record));
+        if (t != 0) return t;
+        int af = a.bam_record->core.flag;
+        int bf = b.bam_record->core.flag;
+        // Sort order is READ1, READ2, (PRIMARY), SUPPLEMENTARY, SECONDARY
+        // Get the bits in this order so sort is a natural a-b
+        af = ((af&0xc0)<<8)|((af&0x100)<<3)|((af&0x800)>>3);
+        bf = ((bf&0xc0)<<8)|((bf&0x100)<<3)|((bf&0x800)>>3);
+        return af - bf;
+    } else {
+        pa = a.bam_record->core.tid;
+        pb = b.bam_record->core.tid;
+
+        if (pa == pb) {
+            pa = (uint64_t)(a.bam_record->core.pos+1);
+            pb = (uint64_t)(b.bam_record->core.pos+1);
+        }
+
+        if (pa == pb) {
+            pa = bam_is_rev(a.bam_record);
+            pb = bam_is_rev(b.bam_record);
+        }
+
+        return pa < pb ? -1 : (pa > pb ? 1 : 0);
+    }
+}
+
+uint8_t normalize_type(const uint8_t* aux) {
+    if (*aux == 'c' || *aux == 'C' || *aux == 's' || *aux == 'S' || *aux == 'i' || *aux == 'I') {
+        return 'c';
+    } else if (*aux == 'f' || *aux == 'd') {
+        return 'f';
+    } else if (*aux == 'H' || *aux == 'Z') {
+         return 'H';
+    } else {
+        return *aux;
     }
 }
 
@@ -2287,18 +3229,35 @@ static int write_buffer(const char *fn, const char *mode, size_t l, bam1_tag *bu
                         int clear_minhash, char *arg_list, int no_pg, int write_index)
 {
     size_t i;
-    samFile* fp;
+    samFile* fp = NULL;
+    sam_pipe *pipe = sam_stage_output(fn);
     char *out_idx_fn = NULL;
 
-    fp = sam_open_format(fn, mode, fmt);
-    if (fp == NULL) return -1;
-    hts_set_opt(fp, HTS_OPT_BLOCK_SIZE, BAM_BLOCK_SIZE);
+    if (!pipe) {
+        fp = sam_open_format(fn, mode, fmt);
+        if (fp == NULL) return -1;
+        hts_set_opt(fp, HTS_OPT_BLOCK_SIZE, BAM_BLOCK_SIZE);
+    }
     if (!no_pg && sam_hdr_add_pg((sam_hdr_t *)h, "samtools", "VN", samtools_version(),
                                  arg_list ? "CL": NULL,
                                  arg_list ? arg_list : NULL,
                                  NULL)) {
         goto fail;
     }
+    if (pipe) {
+        // Hand the records on to the next stage of a pipeline
+        if (sam_pipe_write_header(pipe, h) < 0) goto fail;
+        for (i = 0; i < l; ++i) {
+            bam1_t *b = buf[i].bam_record;
+            if (clear_minhash && b->core.tid == -1) {
+                b->core.pos = -1;
+                b->core.mpos = -1;
+                b->core.isize = 0;
+            }
+            if (sam_pipe_write(pipe, b) < 0) goto fail;
+        }
+        return 0;
+    }
     if (sam_hdr_write(fp, h) != 0) goto fail;
 
     if (write_index)
@@ -2330,7 +3289,7 @@ static int write_buffer(const char *fn, const char *mode, size_t l, bam1_tag *bu
     if (sam_close(fp) < 0) return -1;
     return 0;
  fail:
-    sam_close(fp);
+    if (fp) sam_close(fp);
     free(out_idx_fn);
     return -1;
 }
@@ -2412,9 +3371,290 @@ static int ks_radixsort(size_t n, bam1_tag *buf, const sam_hdr_t *h)
         while (bam_a < end) *bam_a++ = *bam_b++;
     }
 
-    ret = 0;
-err:
-    free(buf_ar2[1]);
+    ret = 0;
+err:
+    free(buf_ar2[1]);
+    return ret;
+}
+
+/*
+ * Radix sort on a packed 64-bit key held in a separate array of key,
+ * index pairs.  These are much smaller than bam1_tag, so the passes move
+ * less data, and passes where every record has the same digit are skipped.
+ * The bam1_tag array is permuted once at the end.
+ */
+typedef struct {
+    uint64_t key;
+    size_t idx;
+} radix_key_t;
+
+static inline int bits_needed(uint64_t v) {
+    int bits = 0;
+    while (v) { bits++; v >>= 1; }
+    return bits;
+}
+
+// Sorts records in buf[0, n) within runs of equal key using bam1_lt()
+static void sort_key_runs(size_t n, bam1_tag *buf, const radix_key_t *keys)
+{
+    size_t start, end, i, j;
+    for (start = 0; start < n; start = end) {
+        for (end = start + 1; end < n && keys[end].key == keys[start].key; end++)
+            ;
+        if (end - start < 2)
+            continue;
+        if (end - start > 16) {
+            ks_mergesort(sort, end - start, buf + start, 0);
+            continue;
+        }
+        // Short run, so use a (stable) insertion sort
+        for (i = start + 1; i < end; i++) {
+            bam1_tag tmp = buf[i];
+            for (j = i; j > start && bam1_lt(tmp, buf[j - 1]); j--)
+                buf[j] = buf[j - 1];
+            buf[j] = tmp;
+        }
+    }
+}
+
+// Sorts keys[0, n) by key using LSD radix sort on the lowest key_bytes
+// bytes, then puts buf into the same order.  If fix_runs is set, the key
+// is only a prefix of the sort order and records with equal keys are
+// then sorted with bam1_lt().
+// Returns 0 on success, -1 on failure.
+static int radix_sort_keys(size_t n, bam1_tag *buf, radix_key_t *keys,
+                           int key_bytes, int fix_runs)
+{
+    size_t (*counts)[NUMBASE] = NULL;
+    radix_key_t *tmp = NULL, *from = keys, *to;
+    bam1_tag *sorted = NULL;
+    size_t i;
+    int byte, ret = -1;
+
+    if (n < 2)
+        return 0;
+
+    counts = calloc(key_bytes > 0 ? key_bytes : 1, sizeof(*counts));
+    tmp = malloc(n * sizeof(*tmp));
+    if (!counts || !tmp) {
+        print_error("sort", "couldn't allocate memory for radix sort");
+        goto err;
+    }
+    to = tmp;
+
+    // Gather the histograms for every digit in one pass
+    for (i = 0; i < n; i++) {
+        uint64_t k = keys[i].key;
+        for (byte = 0; byte < key_bytes; byte++, k >>= 8)
+            counts[byte][k & 0xff]++;
+    }
+
+    for (byte = 0; byte < key_bytes; byte++) {
+        size_t *count = counts[byte], sum = 0, c;
+        int shift = byte * 8, d;
+        if (count[(from[0].key >> shift) & 0xff] == n)
+            continue; // all the same, so nothing to do
+        for (d = 0; d < NUMBASE; d++) {
+            c = count[d];
+            count[d] = sum;
+            sum += c;
+        }
+        for (i = 0; i < n; i++)
+            to[count[(from[i].key >> shift) & 0xff]++] = from[i];
+        radix_key_t *swap = from; from = to; to = swap;
+    }
+
+    // Reorder the records to match
+    if (!(sorted = malloc(n * sizeof(*sorted)))) {
+        print_error("sort", "couldn't allocate memory for radix sort");
+        goto err;
+    }
+    for (i = 0; i < n; i++)
+        sorted[i] = buf[from[i].idx];
+    memcpy(buf, sorted, n * sizeof(*buf));
+
+    if (fix_runs)
+        sort_key_runs(n, buf, from);
+
+    ret = 0;
+ err:
+    free(sorted);
+    free(tmp);
+    free(counts);
+    return ret;
+}
+
+// Radix sort for coordinate order on a packed (tid, pos, strand) key.
+// Returns 0 on success, -1 on failure or 1 if the key doesn't fit in
+// 64 bits, in which case ks_radixsort() should be used.
+static int radix_sort_coordinate(size_t n, bam1_tag *buf, const sam_hdr_t *h)
+{
+    uint32_t nref = sam_hdr_nref(h), max_tid = 0;
+    uint64_t max_pos = 0;
+    radix_key_t *keys;
+    int pos_bits, tid_bits, ret;
+    size_t i;
+
+    // Notes: Add 1 to core.pos so always positive.
+    //        Convert unmapped tid (-1) to number of references so unmapped
+    //        sort to the end.
+    for (i = 0; i < n; i++) {
+        bam1_t *b = buf[i].bam_record;
+        uint32_t tid = b->core.tid == -1 ? nref : b->core.tid;
+        uint64_t pos = ((uint64_t)(b->core.pos + 1) << 1) | bam_is_rev(b);
+        if (max_tid < tid)
+            max_tid = tid;
+        if (max_pos < pos)
+            max_pos = pos;
+    }
+    pos_bits = bits_needed(max_pos);
+    tid_bits = bits_needed(max_tid);
+    if (pos_bits + tid_bits > 64)
+        return 1;
+
+    if (!(keys = malloc(n * sizeof(*keys)))) {
+        print_error("sort", "couldn't allocate memory for sort keys");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        bam1_t *b = buf[i].bam_record;
+        uint64_t tid = b->core.tid == -1 ? nref : b->core.tid;
+        uint64_t pos = ((uint64_t)(b->core.pos + 1) << 1) | bam_is_rev(b);
+        keys[i].key = (tid_bits ? tid << pos_bits : 0) | pos;
+        keys[i].idx = i;
+    }
+    ret = radix_sort_keys(n, buf, keys, (pos_bits + tid_bits + 7) / 8, 0);
+    free(keys);
+    return ret;
+}
+
+// Radix sort for template-coordinate order.  The key holds the leading
+// (tid1, tid2, pos1) fields of template_coordinate_key_t, or just the
+// tids if the positions span too wide a range; the remaining fields are
+// resolved by sorting runs of equal keys.
+// Returns 0 on success, -1 on failure.
+static int radix_sort_template_coordinate(size_t n, bam1_tag *buf,
+                                          const sam_hdr_t *h)
+{
+    uint32_t nref = sam_hdr_nref(h);
+    hts_pos_t min_pos = HTS_POS_MAX, max_pos = 0;
+    uint64_t pos_range;
+    radix_key_t *keys;
+    int pos_bits, tid_bits, ret;
+    size_t i;
+
+    if (n == 0)
+        return 0;
+    for (i = 0; i < n; i++) {
+        hts_pos_t pos = buf[i].u.key->pos1;
+        if (pos == HTS_POS_MAX)
+            continue; // unmapped
+        if (min_pos > pos) min_pos = pos;
+        if (max_pos < pos) max_pos = pos;
+    }
+    // Unmapped reads go after the largest real position
+    pos_range = min_pos <= max_pos ? (uint64_t) (max_pos - min_pos) + 1 : 0;
+    pos_bits = bits_needed(pos_range);
+    tid_bits = bits_needed(nref);
+    if (2 * tid_bits + pos_bits > 64)
+        pos_bits = 0;
+
+    if (!(keys = malloc(n * sizeof(*keys)))) {
+        print_error("sort", "couldn't allocate memory for sort keys");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        const template_coordinate_key_t *key = buf[i].u.key;
+        uint64_t tid1 = key->tid1 == INT32_MAX ? nref : key->tid1;
+        uint64_t tid2 = key->tid2 == INT32_MAX ? nref : key->tid2;
+        uint64_t k = (tid1 << tid_bits) | tid2;
+        if (pos_bits) {
+            uint64_t pos = key->pos1 == HTS_POS_MAX
+                ? pos_range : (uint64_t) (key->pos1 - min_pos);
+            k = (k << pos_bits) | pos;
+        }
+        keys[i].key = k;
+        keys[i].idx = i;
+    }
+    ret = radix_sort_keys(n, buf, keys, (2 * tid_bits + pos_bits + 7) / 8, 1);
+    free(keys);
+    return ret;
+}
+
+// Leading bytes of a read name as a big-endian key, padded with zeros.
+// For natural order the key stops at the first digit, as strnum_cmp()
+// compares numbers by value.  That digit is stored as '0', which orders
+// against other bytes as any digit does, while names that differ only
+// from there on get the same key and are left to bam1_lt().
+static inline uint64_t name_prefix_key(const char *name)
+{
+    uint64_t k = 0;
+    int i;
+    for (i = 0; i < 8 && name[i]; i++) {
+        if (natural_sort && is_digit(name[i])) {
+            k |= (uint64_t) '0' << (56 - 8 * i);
+            break;
+        }
+        k |= (uint64_t) (unsigned char) name[i] << (56 - 8 * i);
+    }
+    return k;
+}
+
+// Key for the tag value used by bam1_cmp_by_tag().  The top byte orders
+// the tag types as that function does (missing tags first), and the rest
+// holds a prefix of the value.  Numbers of either type are compared as
+// doubles.
+static inline uint64_t tag_prefix_key(const uint8_t *aux)
+{
+    uint64_t k = 0, v = 0;
+    int i;
+    if (!aux)
+        return 0;
+
+    uint8_t type = normalize_type(aux);
+    if (type == 'f')
+        type = 'c';
+    if (type == 'c') {
+        double d = bam_aux2f(aux);
+        if (d == 0)
+            d = 0; // so -0.0 == 0.0 as in the comparison
+        memcpy(&v, &d, sizeof(v));
+        // Flip so the bits order as the values do
+        v = (v >> 63) ? ~v : v | ((uint64_t) 1 << 63);
+        k = v >> 8;
+    } else if (type == 'A') {
+        k = (uint64_t) (unsigned char) bam_aux2A(aux) << 48;
+    } else if (type == 'H') {
+        const char *s = bam_aux2Z(aux);
+        for (i = 0; i < 7 && s && s[i]; i++)
+            k |= (uint64_t) (unsigned char) s[i] << (48 - 8 * i);
+    }
+    return ((uint64_t) type << 56) | k;
+}
+
+// Radix sort for name and tag orders, on a 64-bit prefix of the name or
+// tag value.  Records with the same prefix are then sorted with bam1_lt(),
+// which is still needed for long names and the secondary sort keys, but
+// now only has to be called within these runs.
+// Returns 0 on success, -1 on failure.
+static int radix_sort_prefix(size_t n, bam1_tag *buf)
+{
+    radix_key_t *keys;
+    size_t i;
+    int ret;
+
+    if (!(keys = malloc(n * sizeof(*keys)))) {
+        print_error("sort", "couldn't allocate memory for sort keys");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        keys[i].key = g_sam_order == QueryName
+            ? name_prefix_key(bam_get_qname(buf[i].bam_record))
+            : tag_prefix_key(buf[i].u.tag);
+        keys[i].idx = i;
+    }
+    ret = radix_sort_keys(n, buf, keys, 8, 1);
+    free(keys);
     return ret;
 }
 
@@ -2922,107 +4162,27 @@ static uint64_t minhash_with_idx_squash(bam1_t *b, int kmer, int *pos,
     return minhashf != UINT64_MAX ? minhashf : 0;
 }
 
-//--- Start of candidates to punt to htslib
-/*!
- * @abstract
- * Extracts the sequence (in current alignment orientation) from
- * a bam record and places it in buf, which is nul terminated.
- *
- * @param b     The bam structure
- * @param buf   A buffer at least b->core.l_qseq+1 bytes long
- */
-static void bam_to_seq(bam1_t *b, char *buf) {
-    int i;
-    uint8_t *seq = bam_get_seq(b);
-    for (i = 0; i < b->core.l_qseq; i++)
-        buf[i] = seq_nt16_str[bam_seqi(seq, i)];
-    buf[i] = 0;
-}
-
-/*!
- * @abstract
- * Writes a new sequence, of length b->core.l_qseq, to a BAM record.
- *
- * If a sequence of a new length is required the caller must first make
- * room for it by updating the bam1_t struct.
- *
- * @param b     The bam structure
- * @param buf   A buffer at least b->core.l_qseq bytes long
- */
-static void seq_to_bam(bam1_t *b, char *buf) {
-    int i;
-    uint8_t *seq = bam_get_seq(b);
-    for (i = 0; i < b->core.l_qseq; i++)
-        bam_set_seqi(seq, i, seq_nt16_table[(unsigned char)buf[i]]);
-}
-
 /*!
  * @abstract Reverse complements a BAM record.
  *
- * It's possible to do this inline, but complex due to the 4-bit sequence
- * encoding.  For now I take the dumb approach.
+ * This works directly on the 4-bit sequence encoding, so needs no
+ * temporary copy of the sequence.  See seq_nt16_revcomp() and
+ * qual_reverse().
  *
  * @param b  Pointer to a BAM alignment
  *
- * @return   0 on success, -1 on failure (ENOMEM)
+ * @return   0 on success
  */
 static int reverse_complement(bam1_t *b) {
-    static char comp[256] = {
-        'N','N','N','N', 'N','N','N','N', 'N','N','N','N', 'N','N','N','N',//00
-        'N','N','N','N', 'N','N','N','N', 'N','N','N','N', 'N','N','N','N',//10
-        'N','N','N','N', 'N','N','N','N', 'N','N','N','N', 'N','N','N','N',//20
-        'N','N','N','N', 'N','N','N','N', 'N','N','N','N', 'N','N','N','N',//30
-
-       //    *   *   *    *   E   F   *    *   I   J   *    L   *   *   O
-        '@','T','V','G', 'H','E','F','C', 'D','I','H','M', 'L','K','N','O',//40
-       //P   Q   *   *    *   *   *   *    X   Y   Z   [    \   ]   ^   _
-        'P','Q','Y','S', 'A','A','B','W', 'X','Y','Z','[','\\','[','^','_',//50
-       //`   *   *   *    *   E   F   *    *   I   J   *    L   *   *   O
-        '`','t','v','g', 'h','e','f','c', 'd','i','j','m', 'l','k','n','o',//60
-       //P   Q   *   *    *   *   *   *    X   Y   Z   {    |   }   ~   DEL
-        'p','q','y','s', 'a','a','b','w', 'x','y','z','{', '|','}','~',127,//70
-
-        'N','N','N','N', 'N','N','N','N', 'N','N','N','N', 'N','N','N','N',//80
-        'N','N','N','N', 'N','N','N','N', 'N','N','N','N', 'N','N','N','N',//90
-        'N','N','N','N', 'N','N','N','N', 'N','N','N','N', 'N','N','N','N',//A0
-        'N','N','N','N', 'N','N','N','N', 'N','N','N','N', 'N','N','N','N',//B0
-
-        'N','N','N','N', 'N','N','N','N', 'N','N','N','N', 'N','N','N','N',//C0
-        'N','N','N','N', 'N','N','N','N', 'N','N','N','N', 'N','N','N','N',//D0
-        'N','N','N','N', 'N','N','N','N', 'N','N','N','N', 'N','N','N','N',//E0
-        'N','N','N','N', 'N','N','N','N', 'N','N','N','N', 'N','N','N','N',//F0
-    };
-    char seq_[10000], *seq = seq_;
-    uint8_t *qual = bam_get_qual(b);
-    int i, j;
-
-    if (b->core.l_qseq >= 10000)
-        if (!(seq = malloc(b->core.l_qseq+1)))
-            return -1;
-
-    bam_to_seq(b, seq);
-
-    for (i = 0, j = b->core.l_qseq-1; i < j; i++, j--) {
-        unsigned char tmp = seq[i];
-        seq[i] = comp[(unsigned char)seq[j]];
-        seq[j] = comp[tmp];
-        tmp = qual[i];
-        qual[i] = qual[j];
-        qual[j] = tmp;
-    }
-    if (i ==j)
-        seq[i] = comp[(unsigned char)seq[i]];
-
-    seq_to_bam(b, seq);
+    int len = b->core.l_qseq;
 
-    if (seq != seq_)
-        free(seq);
+    seq_nt16_revcomp(bam_get_seq(b), len);
+    qual_reverse(bam_get_qual(b), len);
 
     b->core.flag ^= 0x10;
 
     return 0;
 }
-//--- End of candidates to punt to htslib
 
 
 static inline void worker_minhash(worker_t *w) {
@@ -3071,8 +4231,26 @@ static void *worker(void *data)
     w->error = 0;
 
     switch (g_sam_order) {
-        case Coordinate:
-            if (ks_radixsort(w->buf_len, w->buf, w->h) < 0) {
+        case Coordinate: {
+            int res = radix_sort_coordinate(w->buf_len, w->buf, w->h);
+            if (res > 0)
+                res = ks_radixsort(w->buf_len, w->buf, w->h);
+            if (res < 0) {
+                w->error = errno;
+                return NULL;
+            }
+            break;
+        }
+        case TemplateCoordinate:
+            if (radix_sort_template_coordinate(w->buf_len, w->buf, w->h) < 0) {
+                w->error = errno;
+                return NULL;
+            }
+            break;
+        case QueryName:
+        case TagQueryName:
+        case TagCoordinate:
+            if (radix_sort_prefix(w->buf_len, w->buf) < 0) {
                 w->error = errno;
                 return NULL;
             }
@@ -3087,26 +4265,36 @@ static void *worker(void *data)
     return 0;
 }
 
+// Sorts buf in n_threads parts.  These run as jobs on pool when there is
+// one, so they share its threads with the file decoding and encoding.
 static int sort_blocks(size_t k, bam1_tag *buf, const sam_hdr_t *h,
-                       int n_threads, buf_region *in_mem,
+                       int n_threads, hts_tpool *pool, buf_region *in_mem,
                        int large_pos, int minimiser_kmer, bool try_rev,
                        bool no_squash)
 {
     int i;
     size_t pos, rest;
-    pthread_t *tid;
+    pthread_t *tid = NULL;
     pthread_attr_t attr;
+    hts_tpool_process *q = NULL;
     worker_t *w;
     int n_failed = 0;
 
     if (n_threads < 1) n_threads = 1;
     if (k < n_threads * 64) n_threads = 1; // use a single thread if we only sort a small batch of records
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
     w = (worker_t*)calloc(n_threads, sizeof(worker_t));
     if (!w) return -1;
-    tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
-    if (!tid) { free(w); return -1; }
+    if (pool && n_threads > 1) {
+        if (!(q = hts_tpool_process_init(pool, n_threads, 1))) {
+            free(w);
+            return -1;
+        }
+    } else {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+        tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+        if (!tid) { free(w); return -1; }
+    }
     pos = 0; rest = k;
     for (i = 0; i < n_threads; ++i) {
         w[i].buf_len = rest / (n_threads - i);
@@ -3119,10 +4307,20 @@ static int sort_blocks(size_t k, bam1_tag *buf, const sam_hdr_t *h,
         in_mem[i].from = pos;
         in_mem[i].to = pos + w[i].buf_len;
         pos += w[i].buf_len; rest -= w[i].buf_len;
-        pthread_create(&tid[i], &attr, worker, &w[i]);
+        if (q) {
+            if (hts_tpool_dispatch(pool, q, worker, &w[i]) < 0)
+                w[i].error = errno ? errno : ENOMEM;
+        } else {
+            pthread_create(&tid[i], &attr, worker, &w[i]);
+        }
+    }
+    if (q) {
+        if (hts_tpool_process_flush(q) < 0)
+            n_failed++;
+        hts_tpool_process_destroy(q);
     }
     for (i = 0; i < n_threads; ++i) {
-        pthread_join(tid[i], 0);
+        if (tid) pthread_join(tid[i], 0);
         if (w[i].error != 0) {
             errno = w[i].error;
             print_error_errno("sort", "failed to sort block %d", i);
@@ -3289,51 +4487,276 @@ static int set_sort_order(sam_hdr_t *h, int mapped) {
 }
 
 
-/*!
-  @abstract Sort an unsorted BAM file based on the provided sort order
+// Memory needed for each record in a block on top of its bam1_t and data,
+// apart from its bam1_tag entry.  As well as any sort key, this includes
+// the working space used by sort_blocks(): the radix sort uses two
+// radix_key_t arrays and a bam1_tag array, merge sort one bam1_tag array.
+static size_t sort_mem_per_record(SamOrder sam_order) {
+    switch (sam_order) {
+    case Coordinate:
+    case QueryName:
+    case TagQueryName:
+    case TagCoordinate:
+        return 2 * sizeof(radix_key_t) + sizeof(bam1_tag);
+    case TemplateCoordinate:
+        return 2 * sizeof(radix_key_t) + sizeof(bam1_tag)
+            + sizeof(template_coordinate_key_t);
+    default:
+        return sizeof(bam1_tag);
+    }
+}
 
-  @param  sam_order the order in which the sort should occur
-  @param  sort_tag  the tag to use if sorting by Tag
-  @param  minimiser_kmer the kmer size when sorting by MinHash
-  @param  try_rev  try reverse strand when sorting by MinHash
-  @param  fn       name of the file to be sorted
-  @param  prefix   prefix of the temporary files (prefix.NNNN.bam are written)
-  @param  fnout    name of the final output file to be written
-  @param  modeout  sam_open() mode to be used to create the final output file
-  @param  max_mem  approxiate maximum memory (very inaccurate)
-  @param  in_fmt   input file format options
-  @param  out_fmt  output file format and options
-  @param  arg_list    command string for PG line
-  @param  no_pg       if 1, do not add a new PG line
-  @paran  write_index create index for the output file
-  @return 0 for successful sorting, negative on errors
+// Total memory used by sort for a block of k records holding rec_bytes of
+// record data, with space for max_k entries in the bam1_tag array.
+static inline size_t sort_mem_used(size_t rec_bytes, size_t k, size_t max_k,
+                                   size_t rec_overhead, size_t n_samples) {
+    return rec_bytes + max_k * sizeof(bam1_tag) + k * rec_overhead
+        + n_samples * sizeof(uint64_t);
+}
 
-  @discussion It may create multiple temporary subalignment files
-  and then merge them by calling bam_merge_simple(). This function is
-  NOT thread safe.
- */
-int bam_sort_core_ext(SamOrder sam_order, char* sort_tag, int minimiser_kmer,
-                      bool try_rev, bool no_squash, const char *fn,
-                      const char *prefix, const char *fnout,
-                      const char *modeout, size_t _max_mem, int n_threads,
-                      const htsFormat *in_fmt, const htsFormat *out_fmt,
-                      char *arg_list, int no_pg, int write_index)
+// Removes a temporary file, and its index if one was made
+static void unlink_tmp_file(const char *fn, int indexed) {
+    unlink(fn);
+    if (indexed) {
+        kstring_t idx_fn = KS_INITIALIZE;
+        if (ksprintf(&idx_fn, "%s.csi", fn) >= 0)
+            unlink(idx_fn.s);
+        ks_free(&idx_fn);
+    }
+}
+
+// Works out the bgzf_open() mode for writing the final output directly,
+// which is only possible for BAM without extra format options.
+// Returns 0 if the output is BAM, -1 otherwise.
+static int sort_bgzf_mode(const char *modeout, const htsFormat *out_fmt,
+                          char *bgzf_mode) {
+    const char *level;
+    if (out_fmt && out_fmt->format != unknown_format) {
+        if (out_fmt->format != bam || out_fmt->specific)
+            return -1;
+    } else if (modeout[1] != 'b') {
+        return -1;
+    }
+    level = strpbrk(modeout + 1, "0123456789u");
+    bgzf_mode[0] = 'w';
+    bgzf_mode[1] = level ? *level : '\0';
+    bgzf_mode[2] = '\0';
+    return 0;
+}
+
+// A block of records collected in memory to be sorted together
+typedef struct {
+    uint8_t *bam_mem;
+    size_t bam_mem_offset;
+    bam1_tag *buf;
+    size_t k, max_k;
+    template_coordinate_keys_t *keys;
+    buf_region *in_mem;
+    bam1_t *spare;  // replaces the reader's record if it ends up in buf
+} sort_block_t;
+
+// Writes full blocks to temporary files.  When reading into two blocks,
+// this is done on a separate thread so the next block can be filled
+// while the last one is sorted and written out.
+typedef struct {
+    sort_block_t *blk;
+    sam_hdr_t *header;
+    khash_t(const_c2c) *lib_lookup;
+    htsThreadPool *htspool;
+    const char *prefix;
+    char *sort_tag;
+    char **fns;
+    size_t fns_size;
+    int n_files, n_big_files, fn_counter;
+    int n_threads, large_pos, minimiser_kmer, index_tmp;
+    bool try_rev, no_squash;
+    pthread_t tid;
+    int running, res;
+} sort_spill_t;
+
+static int sort_block_init(sort_block_t *blk, SamOrder sam_order,
+                           size_t mem, int n_threads, int need_spare) {
+    memset(blk, 0, sizeof(*blk));
+    if ((blk->bam_mem = sam_numa_alloc(mem)) == NULL) {
+        print_error("sort", "couldn't allocate memory for bam_mem");
+        return -1;
+    }
+    blk->in_mem = calloc(n_threads > 0 ? n_threads : 1, sizeof(blk->in_mem[0]));
+    if (!blk->in_mem) return -1;
+    if (sam_order == TemplateCoordinate) {
+        if ((blk->keys = malloc(sizeof(template_coordinate_keys_t))) == NULL) {
+            print_error("sort", "could not allocate memory for the top-level keys");
+            return -1;
+        }
+        blk->keys->n = 0;
+        blk->keys->m = 0;
+        blk->keys->buffer_size = 0x10000;
+        blk->keys->buffers = NULL;
+    }
+    if (need_spare && (blk->spare = bam_init1()) == NULL) {
+        print_error("sort", "couldn't allocate memory for bam record");
+        return -1;
+    }
+    return 0;
+}
+
+static void sort_block_destroy(sort_block_t *blk) {
+    int i;
+    free(blk->buf);
+    if (blk->keys != NULL) {
+        for (i = 0; i < blk->keys->m; ++i) {
+            free(blk->keys->buffers[i]);
+        }
+        free(blk->keys->buffers);
+        free(blk->keys);
+    }
+    free(blk->bam_mem);
+    free(blk->in_mem);
+    if (blk->spare) bam_destroy1(blk->spare);
+}
+
+// Sorts s->blk and writes it to a new temporary file, merging in
+// earlier temporary files if there are too many of them.
+// Returns 0 on success, -1 on failure.
+static int spill_block(sort_spill_t *s) {
+    sort_block_t *blk = s->blk;
+    size_t name_len = strlen(s->prefix) + 30;
+    const int MAX_TRIES = 1000;
+    int i, tries = 0, merge_res = -1, consolidate_from;
+    char mode[8];
+
+    snprintf(mode, sizeof(mode), "w%cx%d", s->large_pos ? 'z' : 'b',
+             g_tmp_level);
+
+    if (hts_resize(char *, s->n_files + 1, &s->fns_size, &s->fns, 0) < 0)
+        return -1;
+
+    if (sort_blocks(blk->k, blk->buf, s->header, s->n_threads,
+                    s->htspool->pool, blk->in_mem,
+                    s->large_pos, s->minimiser_kmer, s->try_rev,
+                    s->no_squash) < 0)
+        return -1;
+
+    s->fns[s->n_files] = calloc(name_len, 1);
+    if (!s->fns[s->n_files])
+        return -1;
+    consolidate_from = s->n_files;
+    if (s->n_files - s->n_big_files >= MAX_TMP_FILES/2)
+        consolidate_from = s->n_big_files;
+    else if (s->n_files >= MAX_TMP_FILES)
+        consolidate_from = 0;
+
+    for (;;) {
+        if (tries) {
+            snprintf(s->fns[s->n_files], name_len, "%s.%.4d-%.3d.bam",
+                     s->prefix, s->fn_counter, tries);
+        } else {
+            snprintf(s->fns[s->n_files], name_len, "%s.%.4d.bam", s->prefix,
+                     s->fn_counter);
+        }
+        if (bam_merge_simple(g_sam_order, s->sort_tag, s->fns[s->n_files],
+                             mode, s->header,
+                             s->n_files - consolidate_from,
+                             &s->fns[consolidate_from], s->n_threads,
+                             blk->in_mem, blk->buf, blk->keys,
+                             s->lib_lookup, s->htspool, "sort", NULL, NULL,
+                             NULL, 1, s->index_tmp, 0) >= 0) {
+            merge_res = 0;
+            break;
+        }
+        if (errno == EEXIST && tries < MAX_TRIES) {
+            tries++;
+        } else {
+            break;
+        }
+    }
+    s->fn_counter++;
+    if (merge_res < 0) {
+        if (errno != EEXIST)
+            unlink(s->fns[s->n_files]);
+        free(s->fns[s->n_files]);
+        s->fns[s->n_files] = NULL;
+        return -1;
+    }
+
+    if (consolidate_from < s->n_files) {
+        for (i = consolidate_from; i < s->n_files; i++) {
+            unlink_tmp_file(s->fns[i], s->index_tmp);
+            free(s->fns[i]);
+        }
+        s->fns[consolidate_from] = s->fns[s->n_files];
+        s->n_files = consolidate_from;
+        s->n_big_files = consolidate_from + 1;
+    }
+
+    s->n_files++;
+    blk->k = 0;
+    if (blk->keys != NULL) blk->keys->n = 0;
+    blk->bam_mem_offset = 0;
+    return 0;
+}
+
+static void *spill_thread(void *arg) {
+    sort_spill_t *s = (sort_spill_t *) arg;
+    s->res = spill_block(s);
+    return NULL;
+}
+
+// Waits for any running spill.  Returns its result.
+static int spill_wait(sort_spill_t *s) {
+    if (!s->running)
+        return 0;
+    pthread_join(s->tid, NULL);
+    s->running = 0;
+    return s->res;
+}
+
+// Starts writing blk to a temporary file, in the background if requested.
+// Returns 0 on success (or if started), -1 on failure.
+static int spill_start(sort_spill_t *s, sort_block_t *blk, int background) {
+    s->blk = blk;
+    if (background && pthread_create(&s->tid, NULL, spill_thread, s) == 0) {
+        s->running = 1;
+        return 0;
+    }
+    return spill_block(s);
+}
+
+// Sorts the file fn, or if src is given the records from it, with a copy
+// of its header src_hdr.  See bam_sort_core_ext() for the other arguments.
+static int sort_core(SamOrder sam_order, char* sort_tag, int minimiser_kmer,
+                     bool try_rev, bool no_squash, const char *fn,
+                     const sam_rec_src *src, const sam_hdr_t *src_hdr,
+                     const char *prefix, const char *fnout,
+                     const char *modeout, size_t _max_mem, int n_threads,
+                     const htsFormat *in_fmt, const htsFormat *out_fmt,
+                     char *arg_list, int no_pg, int write_index)
 {
-    int ret = -1, res, i, nref, n_files = 0, n_big_files = 0, fn_counter = 0;
-    size_t max_k, k, max_mem, bam_mem_offset;
+    int ret = -1, res, i, nref;
+    size_t max_mem, blk_mem, rec_overhead;
     sam_hdr_t *header = NULL;
     samFile *fp = NULL;
-    bam1_tag *buf = NULL;
-    template_coordinate_keys_t *keys = NULL;
+    sam_rec_src pipe_src;
+    sam_pipe *pipe_in = src ? NULL : sam_stage_input(fn);
+    int pipe_out = sam_stage_output(fnout) != NULL;
+    sort_block_t blocks[2], *blk;
+    int n_blocks, cur = 0;
+    sort_spill_t spill;
     bam1_t *b = bam_init1();
-    uint8_t *bam_mem = NULL;
-    char **fns = NULL;
-    size_t fns_size = 0;
-    buf_region *in_mem = NULL;
     khash_t(const_c2c) *lib_lookup = NULL;
     htsThreadPool htspool = { NULL, 0 };
     int num_in_mem = 0;
     int large_pos = 0;
+    int part_merge = 0, index_tmp = 0;
+    char bgzf_mode[3];
+    uint64_t *samples = NULL;
+    size_t n_samples = 0, samples_size = 0, n_read = 0;
+    uint64_t n_records = 0;
+    int st_read = sam_prof_stage("read"), st_sort = sam_prof_stage("sort");
+    int st_write = sam_prof_stage("write");
+
+    memset(blocks, 0, sizeof(blocks));
+    memset(&spill, 0, sizeof(spill));
 
     if (!b) {
         print_error("sort", "couldn't allocate memory for bam record");
@@ -3347,29 +4770,39 @@ int bam_sort_core_ext(SamOrder sam_order, char* sort_tag, int minimiser_kmer,
         g_sort_tag[1] = sort_tag[0] ? sort_tag[1] : '\0';
     }
 
-    if (sam_order == TemplateCoordinate) {
-        if ((keys = malloc(sizeof(template_coordinate_keys_t))) == NULL) {
-            print_error("sort", "could not allocate memory for the top-level keys");
+    // With more than one thread, read into one block while the other is
+    // being sorted and written to a temporary file.
+    n_blocks = n_threads > 1 ? 2 : 1;
+    max_mem = _max_mem * n_threads;
+    blk_mem = max_mem / n_blocks;
+    if (src) {
+        header = sam_hdr_dup(src_hdr);
+        if (header == NULL) {
+            print_error("sort", "couldn't duplicate header");
+            goto err;
+        }
+    } else if (pipe_in) {
+        // The previous stage of a pipeline
+        header = sam_pipe_read_header(pipe_in);
+        if (header == NULL) {
+            print_error("sort", "no header from the previous pipeline stage");
+            goto err;
+        }
+        pipe_src.read = sam_pipe_read;
+        pipe_src.data = pipe_in;
+        src = &pipe_src;
+    } else {
+        fp = sam_open_format(fn, "r", in_fmt);
+        if (fp == NULL) {
+            print_error_errno("sort", "can't open \"%s\"", fn);
+            goto err;
+        }
+        hts_set_opt(fp, HTS_OPT_BLOCK_SIZE, BAM_BLOCK_SIZE);
+        header = sam_hdr_read(fp);
+        if (header == NULL) {
+            print_error("sort", "failed to read header from \"%s\"", fn);
             goto err;
         }
-        keys->n = 0;
-        keys->m = 0;
-        keys->buffer_size = 0x10000;
-        keys->buffers = NULL;
-    }
-
-    max_mem = _max_mem * n_threads;
-    buf = NULL;
-    fp = sam_open_format(fn, "r", in_fmt);
-    if (fp == NULL) {
-        print_error_errno("sort", "can't open \"%s\"", fn);
-        goto err;
-    }
-    hts_set_opt(fp, HTS_OPT_BLOCK_SIZE, BAM_BLOCK_SIZE);
-    header = sam_hdr_read(fp);
-    if (header == NULL) {
-        print_error("sort", "failed to read header from \"%s\"", fn);
-        goto err;
     }
 
     // Inspect the header looking for long chromosomes
@@ -3381,7 +4814,7 @@ int bam_sort_core_ext(SamOrder sam_order, char* sort_tag, int minimiser_kmer,
     }
 
     // Also check the output format is large position compatible
-    if (large_pos) {
+    if (large_pos && !pipe_out) {
         int compatible = (out_fmt->format == sam
                           || (out_fmt->format == cram
                               && out_fmt->version.major >= 4)
@@ -3400,60 +4833,130 @@ int bam_sort_core_ext(SamOrder sam_order, char* sort_tag, int minimiser_kmer,
             goto err;
     }
 
+    // The final merge can be split across threads if the output is BAM.
+    // This needs the temporary files to be indexed.
+    if (sam_order == Coordinate && n_threads > 1 && !large_pos && !pipe_out
+        && !write_index && sort_bgzf_mode(modeout, out_fmt, bgzf_mode) == 0)
+        part_merge = index_tmp = 1;
+
     if (n_threads > 1) {
-        htspool.pool = hts_tpool_init(n_threads);
+        htspool.pool = sam_stage_tpool_init(n_threads);
         if (!htspool.pool) {
             print_error_errno("sort", "failed to set up thread pool");
             goto err;
         }
-        hts_set_opt(fp, HTS_OPT_THREAD_POOL, &htspool);
+        if (fp) hts_set_opt(fp, HTS_OPT_THREAD_POOL, &htspool);
     }
 
-    if ((bam_mem = malloc(max_mem)) == NULL) {
-        print_error("sort", "couldn't allocate memory for bam_mem");
-        goto err;
+    for (i = 0; i < n_blocks; i++) {
+        if (sort_block_init(&blocks[i], sam_order, blk_mem, n_threads,
+                            n_blocks > 1) < 0)
+            goto err;
     }
 
-    in_mem = calloc(n_threads > 0 ? n_threads : 1, sizeof(in_mem[0]));
-    if (!in_mem) goto err;
+    // Background spills get their own copy of the header, as writing it
+    // out may update its text.
+    spill.header = n_blocks > 1 ? sam_hdr_dup(header) : header;
+    if (!spill.header) {
+        print_error("sort", "couldn't duplicate header");
+        goto err;
+    }
+    spill.lib_lookup = lib_lookup;
+    spill.htspool = &htspool;
+    spill.prefix = prefix;
+    spill.sort_tag = (g_sam_order == TagQueryName || g_sam_order == TagCoordinate) ? sort_tag : NULL;
+    spill.n_threads = n_threads;
+    spill.large_pos = large_pos;
+    spill.minimiser_kmer = minimiser_kmer;
+    spill.index_tmp = index_tmp;
+    spill.try_rev = try_rev;
+    spill.no_squash = no_squash;
 
     // write sub files
-    k = max_k = bam_mem_offset = 0;
-    size_t name_len = strlen(prefix) + 30;
+    rec_overhead = sort_mem_per_record(sam_order);
     int placed = 0;
-    while ((res = sam_read1(fp, header, b)) >= 0) {
+    sam_prof_begin(st_read);
+    while ((res = src ? src->read(src->data, header, b)
+                      : sam_read1(fp, header, b)) >= 0) {
         int mem_full = 0;
+        size_t k;
 
+        blk = &blocks[cur];
+        k = blk->k;
         placed |= b->core.tid >= 0;
+        n_records++;
+
+        if (part_merge) {
+            if (b->core.tid >= 0 && b->core.pos < 0) {
+                // Can't be found by an index query, so don't partition
+                part_merge = 0;
+            } else if ((n_read++ & 0x3ff) == 0) {
+                if (hts_resize(uint64_t, n_samples + 1, &samples_size,
+                               &samples, 0) < 0) {
+                    print_error("sort", "couldn't allocate memory for samples");
+                    goto err;
+                }
+                samples[n_samples++] = coord_key(b, nref);
+            }
+        }
 
-        if (k == max_k) {
+        if (k == blk->max_k) {
             bam1_tag *new_buf;
-            max_k = max_k? max_k<<1 : 0x10000;
-            if ((new_buf = realloc(buf, max_k * sizeof(bam1_tag))) == NULL) {
+            size_t new_max_k = blk->max_k? blk->max_k<<1 : 0x10000;
+            if (k == 0) {
+                // Keep the initial array small compared to the limit
+                size_t limit = blk_mem / (4 * (sizeof(bam1_tag) + rec_overhead));
+                if (new_max_k > limit)
+                    new_max_k = limit > 0 ? limit : 1;
+            } else {
+                // Don't grow much beyond the number of records that
+                // are likely to fit in the remaining memory
+                size_t used = sort_mem_used(blk->bam_mem_offset, k,
+                                            blk->max_k, rec_overhead,
+                                            samples_size);
+                size_t avail = used < blk_mem ? blk_mem - used : 0;
+                size_t per_rec = blk->bam_mem_offset / k + rec_overhead
+                    + sizeof(bam1_tag);
+                size_t want = k + avail / per_rec + 0x1000;
+                if (new_max_k > want)
+                    new_max_k = want;
+            }
+            if ((new_buf = realloc(blk->buf, new_max_k * sizeof(bam1_tag))) == NULL) {
                 print_error("sort", "couldn't allocate memory for buf");
                 goto err;
             }
-            buf = new_buf;
+            blk->buf = new_buf;
+            blk->max_k = new_max_k;
         }
-        if (sam_order == TemplateCoordinate && k >= keys->m * keys->buffer_size) {
-            if (template_coordinate_keys_realloc(keys, k + 1) == -1) {
+        if (sam_order == TemplateCoordinate
+            && k >= blk->keys->m * blk->keys->buffer_size) {
+            if (template_coordinate_keys_realloc(blk->keys, k + 1) == -1) {
                 goto err;
             }
         }
 
-        // Check if the BAM record will fit in the memory limit
-        if (bam_mem_offset + sizeof(*b) + b->l_data < max_mem) {
+        // Check if the BAM record, and the memory needed to sort it, will
+        // fit in the memory limit
+        bam1_tag *t = &blk->buf[k];
+        if (sort_mem_used(blk->bam_mem_offset + sizeof(*b) + b->l_data, k + 1,
+                          blk->max_k, rec_overhead, samples_size) < blk_mem) {
             // Copy record into the memory block
-            buf[k].bam_record = (bam1_t *)(bam_mem + bam_mem_offset);
-            *buf[k].bam_record = *b;
-            buf[k].bam_record->data = (uint8_t *)((char *)buf[k].bam_record + sizeof(bam1_t));
-            memcpy(buf[k].bam_record->data, b->data, b->l_data);
+            t->bam_record = (bam1_t *)(blk->bam_mem + blk->bam_mem_offset);
+            *t->bam_record = *b;
+            t->bam_record->data = (uint8_t *)((char *)t->bam_record + sizeof(bam1_t));
+            memcpy(t->bam_record->data, b->data, b->l_data);
             // store next BAM record in next 8-byte-aligned address after
             // current one
-            bam_mem_offset = (bam_mem_offset + sizeof(*b) + b->l_data + 8 - 1) & ~((size_t)(8 - 1));
+            blk->bam_mem_offset = (blk->bam_mem_offset + sizeof(*b) + b->l_data + 8 - 1) & ~((size_t)(8 - 1));
         } else {
-            // Add a pointer to the remaining record
-            buf[k].bam_record = b;
+            // Add a pointer to the remaining record.  If the block is
+            // going to be written out in the background, carry on
+            // reading into the block's spare record instead.
+            t->bam_record = b;
+            if (blk->spare) {
+                b = blk->spare;
+                blk->spare = t->bam_record;
+            }
             mem_full = 1;
         }
 
@@ -3461,173 +4964,183 @@ int bam_sort_core_ext(SamOrder sam_order, char* sort_tag, int minimiser_kmer,
         switch (g_sam_order) {
             case TagQueryName:
             case TagCoordinate:
-                buf[k].u.tag = bam_aux_get(buf[k].bam_record, g_sort_tag);
+                t->u.tag = bam_aux_get(t->bam_record, g_sort_tag);
                 break;
             case TemplateCoordinate:
-                ++keys->n;
-                template_coordinate_key_t *key = template_coordinate_keys_get(keys, k);
-                buf[k].u.key = template_coordinate_key(buf[k].bam_record, key, header, lib_lookup);
-                if (buf[k].u.key == NULL) goto err;
+                ++blk->keys->n;
+                template_coordinate_key_t *key = template_coordinate_keys_get(blk->keys, k);
+                t->u.key = template_coordinate_key(t->bam_record, key, header, lib_lookup);
+                if (t->u.key == NULL) goto err;
                 break;
             default:
-                buf[k].u.tag = NULL;
-                buf[k].u.key = NULL;
+                t->u.tag = NULL;
+                t->u.key = NULL;
         }
-        ++k;
+        blk->k = k + 1;
 
         if (mem_full) {
-            if (hts_resize(char *, n_files + 1, &fns_size, &fns, 0) < 0)
-                goto err;
-
-            int sort_res = sort_blocks(k, buf, header, n_threads,
-                                       in_mem, large_pos, minimiser_kmer,
-                                       try_rev, no_squash);
-            if (sort_res < 0)
-                goto err;
-
-            fns[n_files] = calloc(name_len, 1);
-            if (!fns[n_files])
+            // Only one block can be written out at a time
+            if (spill_wait(&spill) < 0)
                 goto err;
-            const int MAX_TRIES = 1000;
-            int tries = 0, merge_res = -1;
-            char *sort_by_tag = (g_sam_order == TagQueryName || g_sam_order == TagCoordinate) ? sort_tag : NULL;
-            int consolidate_from = n_files;
-            if (n_files - n_big_files >= MAX_TMP_FILES/2)
-                consolidate_from = n_big_files;
-            else if (n_files >= MAX_TMP_FILES)
-                consolidate_from = 0;
-
-            for (;;) {
-                if (tries) {
-                    snprintf(fns[n_files], name_len, "%s.%.4d-%.3d.bam",
-                             prefix, fn_counter, tries);
-                } else {
-                    snprintf(fns[n_files], name_len, "%s.%.4d.bam", prefix,
-                             fn_counter);
-                }
-                if (bam_merge_simple(g_sam_order, sort_by_tag, fns[n_files],
-                                     large_pos ? "wzx1" : "wbx1", header,
-                                     n_files - consolidate_from,
-                                     &fns[consolidate_from], n_threads,
-                                     in_mem, buf, keys,
-                                     lib_lookup, &htspool, "sort", NULL, NULL,
-                                     NULL, 1, 0, 0) >= 0) {
-                    merge_res = 0;
-                    break;
-                }
-                if (errno == EEXIST && tries < MAX_TRIES) {
-                    tries++;
-                } else {
-                    break;
-                }
-            }
-            fn_counter++;
-            if (merge_res < 0) {
-                if (errno != EEXIST)
-                    unlink(fns[n_files]);
-                free(fns[n_files]);
+            if (spill_start(&spill, blk, n_blocks > 1) < 0)
                 goto err;
-            }
-
-            if (consolidate_from < n_files) {
-                for (i = consolidate_from; i < n_files; i++) {
-                    unlink(fns[i]);
-                    free(fns[i]);
-                }
-                fns[consolidate_from] = fns[n_files];
-                n_files = consolidate_from;
-                n_big_files = consolidate_from + 1;
-            }
-
-            n_files++;
-            k = 0;
-            if (keys != NULL) keys->n = 0;
-            bam_mem_offset = 0;
-
+            cur = (cur + 1) % n_blocks;
         }
     }
     if (res != -1) {
-        print_error("sort", "truncated file. Aborting");
+        // A record source reports its own errors
+        if (!src) print_error("sort", "truncated file. Aborting");
         goto err;
     }
+    if (spill_wait(&spill) < 0)
+        goto err;
+    sam_prof_end(st_read);
 
     // Sort last records
-    if (k > 0) {
-        num_in_mem = sort_blocks(k, buf, header, n_threads,
-                                 in_mem, large_pos, minimiser_kmer, try_rev,
-                                 no_squash);
+    sam_prof_begin(st_sort);
+    blk = &blocks[cur];
+    if (blk->k > 0) {
+        num_in_mem = sort_blocks(blk->k, blk->buf, header, n_threads,
+                                 htspool.pool, blk->in_mem, large_pos,
+                                 minimiser_kmer, try_rev, no_squash);
         if (num_in_mem < 0) goto err;
     } else {
         num_in_mem = 0;
     }
+    sam_prof_end(st_sort);
 
     // Set the order here as we need to know if entirely unmapped.
     if (set_sort_order(header, placed) < 0)
         goto err;
 
     // write the final output
-    if (n_files == 0 && num_in_mem < 2) { // a single block
-        if (write_buffer(fnout, modeout, k, buf, header, n_threads, out_fmt,
-                         minimiser_kmer, arg_list, no_pg, write_index) != 0) {
+    sam_prof_begin(st_write);
+    if (spill.n_files == 0 && num_in_mem < 2) { // a single block
+        if (write_buffer(fnout, modeout, blk->k, blk->buf, header, n_threads,
+                         out_fmt, minimiser_kmer, arg_list, no_pg,
+                         write_index) != 0) {
             print_error_errno("sort", "failed to create \"%s\"", fnout);
             goto err;
         }
     } else { // then merge
         fprintf(stderr,
                 "[bam_sort_core] merging from %d files and %d in-memory blocks...\n",
-                n_files, num_in_mem);
+                spill.n_files, num_in_mem);
         // Paranoia check - all temporary files should have a name
-        for (i = 0; i < n_files; ++i) {
-            if (!fns[i]) {
+        for (i = 0; i < spill.n_files; ++i) {
+            if (!spill.fns[i]) {
                 print_error("sort",
                             "BUG: no name stored for temporary file %d", i);
                 abort();
             }
         }
-        char *sort_by_tag = (sam_order == TagQueryName || sam_order == TagCoordinate) ? sort_tag : NULL;
-        if (bam_merge_simple(sam_order, sort_by_tag, fnout, modeout, header,
-                             n_files, fns, num_in_mem, in_mem, buf, keys,
-                             lib_lookup, &htspool, "sort", in_fmt, out_fmt,
-                             arg_list, no_pg, write_index, 1) < 0) {
+        int merge_res = 1;
+        if (part_merge) {
+            merge_res = bam_merge_partitioned(fnout, bgzf_mode, header,
+                                              spill.n_files, spill.fns,
+                                              NULL, NULL, num_in_mem,
+                                              blk->in_mem, blk->buf,
+                                              samples, n_samples,
+                                              n_threads, &htspool, prefix,
+                                              arg_list, no_pg, "sort");
+            if (merge_res < 0)
+                goto err;
+        }
+        if (merge_res > 0
+            && bam_merge_simple(sam_order, spill.sort_tag, fnout, modeout,
+                                header, spill.n_files, spill.fns, num_in_mem,
+                                blk->in_mem, blk->buf, blk->keys, lib_lookup,
+                                &htspool, "sort", in_fmt, out_fmt, arg_list,
+                                no_pg, write_index, 1) < 0) {
             // Propagate bam_merge_simple() failure; it has already emitted a
             // message explaining the failure, so no further message is needed.
             goto err;
         }
     }
+    sam_prof_end(st_write);
+    sam_prof_add("records_in", n_records);
+    sam_prof_add("tmp_files", spill.n_files);
+    if (fp) sam_prof_file("bytes_in", fp);
 
     ret = 0;
 
  err:
     // free
-    if (fns) {
-        for (i = 0; i < n_files; ++i) {
-            if (fns[i]) {
-                unlink(fns[i]);
-                free(fns[i]);
+    spill_wait(&spill);
+    if (spill.fns) {
+        for (i = 0; i < spill.n_files; ++i) {
+            if (spill.fns[i]) {
+                unlink_tmp_file(spill.fns[i], index_tmp);
+                free(spill.fns[i]);
             }
         }
-        free(fns);
+        free(spill.fns);
     }
+    free(samples);
     bam_destroy1(b);
-    free(buf);
-    if (keys != NULL) {
-        for (i = 0; i < keys->m; ++i) {
-            free(keys->buffers[i]);
-        }
-        free(keys->buffers);
-        free(keys);
-    }
-    free(bam_mem);
-    free(in_mem);
+    for (i = 0; i < 2; i++)
+        sort_block_destroy(&blocks[i]);
     lib_lookup_destroy(lib_lookup);
+    if (spill.header && spill.header != header)
+        sam_hdr_destroy(spill.header);
     sam_hdr_destroy(header);
     if (fp) sam_close(fp);
-    if (htspool.pool)
-        hts_tpool_destroy(htspool.pool);
+    sam_stage_tpool_destroy(htspool.pool);
 
     return ret;
 }
 
+/*!
+  @abstract Sort an unsorted BAM file based on the provided sort order
+
+  @param  sam_order the order in which the sort should occur
+  @param  sort_tag  the tag to use if sorting by Tag
+  @param  minimiser_kmer the kmer size when sorting by MinHash
+  @param  try_rev  try reverse strand when sorting by MinHash
+  @param  fn       name of the file to be sorted
+  @param  prefix   prefix of the temporary files (prefix.NNNN.bam are written)
+  @param  fnout    name of the final output file to be written
+  @param  modeout  sam_open() mode to be used to create the final output file
+  @param  max_mem  maximum memory per thread.  Record data, the bam1_tag
+                   array, sort keys and sort working space are all counted
+                   against a total budget of max_mem * n_threads
+  @param  in_fmt   input file format options
+  @param  out_fmt  output file format and options
+  @param  arg_list    command string for PG line
+  @param  no_pg       if 1, do not add a new PG line
+  @paran  write_index create index for the output file
+  @return 0 for successful sorting, negative on errors
+
+  @discussion It may create multiple temporary subalignment files
+  and then merge them by calling bam_merge_simple(). This function is
+  NOT thread safe.
+ */
+int bam_sort_core_ext(SamOrder sam_order, char* sort_tag, int minimiser_kmer,
+                      bool try_rev, bool no_squash, const char *fn,
+                      const char *prefix, const char *fnout,
+                      const char *modeout, size_t _max_mem, int n_threads,
+                      const htsFormat *in_fmt, const htsFormat *out_fmt,
+                      char *arg_list, int no_pg, int write_index)
+{
+    return sort_core(sam_order, sort_tag, minimiser_kmer, try_rev, no_squash,
+                     fn, NULL, NULL, prefix, fnout, modeout, _max_mem,
+                     n_threads, in_fmt, out_fmt, arg_list, no_pg,
+                     write_index);
+}
+
+// Sorts records handed over by an earlier stage in the same process, such
+// as "fixmate --collate-sort", instead of reading them from a file
+int bam_sort_records(const sam_rec_src *src, const sam_hdr_t *h,
+                     const char *prefix, const char *fnout,
+                     const char *modeout, size_t max_mem, int n_threads,
+                     const htsFormat *in_fmt, const htsFormat *out_fmt,
+                     char *arg_list, int no_pg, int write_index)
+{
+    return sort_core(Coordinate, NULL, 0, false, true, NULL, src, h, prefix,
+                     fnout, modeout, max_mem, n_threads, in_fmt, out_fmt,
+                     arg_list, no_pg, write_index);
+}
+
 // Unused here but may be used by legacy samtools-using third-party code
 int bam_sort_core(int is_by_qname, const char *fn, const char *prefix, size_t max_mem)
 {
@@ -3662,11 +5175,13 @@ static void sort_usage(FILE *fp)
 "  -t TAG     Sort by value of TAG. Uses position as secondary index (or read name if -n is set)\n"
 "  -o FILE    Write final output to FILE rather than standard output\n"
 "  -T PREFIX  Write temporary files to PREFIX.nnnn.bam\n"
+"      --tmp-level INT\n"
+"               Compression level for temporary files, 0 to 9 [1]\n"
 "      --no-PG\n"
 "               Do not add a PG line\n"
 "      --template-coordinate\n"
 "               Sort by template-coordinate\n");
-    sam_global_opt_help(fp, "-.O..@..");
+    sam_global_opt_help(fp, "-.O..@....");
 }
 
 static void complain_about_memory_setting(size_t max_mem) {
@@ -3695,7 +5210,7 @@ int bam_sort(int argc, char *argv[])
     int minimiser_kmer = 20;
     bool try_rev = true;
     char* sort_tag = NULL, *arg_list = NULL;
-    char *fnout = "-", modeout[12];
+    char *fnin, *fnout = "-", modeout[12];
     kstring_t tmpprefix = { 0, 0, NULL };
     struct stat st;
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
@@ -3704,10 +5219,11 @@ int bam_sort(int argc, char *argv[])
     int no_squash = 1;
 
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@', 0, 0),
         { "threads", required_argument, NULL, '@' },
         {"no-PG", no_argument, NULL, 1},
         { "template-coordinate", no_argument, NULL, 2},
+        { "tmp-level", required_argument, NULL, 3},
         { NULL, 0, NULL, 0 }
     };
 
@@ -3730,6 +5246,17 @@ int bam_sort(int argc, char *argv[])
         case 'u': level = 0; break;
         case   1: no_pg = 1; break;
         case   2: sam_order = TemplateCoordinate; break;
+        case   3: {
+            char *end;
+            long v = strtol(optarg, &end, 10);
+            if (end == optarg || *end || v < 0 || v > 9) {
+                print_error("sort", "invalid --tmp-level \"%s\", expected 0 to 9", optarg);
+                ret = EXIT_FAILURE;
+                goto sort_end;
+            }
+            g_tmp_level = v;
+            break;
+        }
         case 'M': sam_order = MinHash; break;
         case 'I':
             sam_order = MinHash; // implicit option
@@ -3771,7 +5298,7 @@ int bam_sort(int argc, char *argv[])
     }
 
     nargs = argc - optind;
-    if (nargs == 0 && isatty(STDIN_FILENO)) {
+    if (nargs == 0 && isatty(STDIN_FILENO) && !sam_stage_input("-")) {
         sort_usage(stdout);
         ret = EXIT_SUCCESS;
         goto sort_end;
@@ -3790,6 +5317,12 @@ int bam_sort(int argc, char *argv[])
         fprintf(stderr, "[W::bam_sort] Ignoring --write-index as it only works for position sorted files.\n");
         ga.write_index = 0;
     }
+    if (ga.write_index && sam_stage_output(fnout)) {
+        print_error("sort", "can't index the output of a pipeline stage");
+        ret = EXIT_FAILURE;
+        goto sort_end;
+    }
+    fnin = nargs > 0 ? argv[optind] : "-";
 
     if (!no_pg && !(arg_list = stringify_argv(argc+1, argv-1))) {
         print_error("sort", "failed to create arg_list");
@@ -3802,6 +5335,11 @@ int bam_sort(int argc, char *argv[])
         goto sort_end;
     }
 
+    if (sam_prof_init(&ga, "sort") < 0) {
+        ret = EXIT_FAILURE;
+        goto sort_end;
+    }
+
     strcpy(modeout, "wb");
     sam_open_mode(modeout+1, fnout, NULL);
     if (level >= 0) sprintf(strchr(modeout, '\0'), "%d", level < 9? level : 9);
@@ -3821,10 +5359,10 @@ int bam_sort(int argc, char *argv[])
         ksprintf(&tmpprefix, "samtools.%d.%u.tmp", (int) getpid(), t % 10000);
     }
 
+    sam_stage_ready();
     ret = bam_sort_core_ext(sam_order, sort_tag,
                             (sam_order == MinHash) ? minimiser_kmer : 0,
-                            try_rev, no_squash,
-                            (nargs > 0) ? argv[optind] : "-",
+                            try_rev, no_squash, fnin,
                             tmpprefix.s, fnout, modeout, max_mem, ga.nthreads,
                             &ga.in, &ga.out, arg_list, no_pg, ga.write_index);
     if (ret >= 0)
@@ -3833,7 +5371,7 @@ int bam_sort(int argc, char *argv[])
         char dummy[4];
         // If we failed on opening the input file & it has no .bam/.cram/etc
         // extension, the user probably tried legacy -o <infile> <out.prefix>
-        if (ret == -2 && o_seen && nargs > 0 && sam_open_mode(dummy, argv[optind], NULL) < 0)
+        if (ret == -2 && o_seen && nargs > 0 && sam_open_mode(dummy, fnin, NULL) < 0)
             fprintf(stderr, "[bam_sort] Note the <out.prefix> argument has been replaced by -T/-o options\n");
 
         ret = EXIT_FAILURE;
@@ -60,6 +60,29 @@ struct parsed_opts {
 
 typedef struct parsed_opts parsed_opts_t;
 
+// Records are handed to the thread pool in batches of this many per output
+#define SPLIT_BATCH_SIZE 256
+
+struct split_queue;
+
+typedef struct {
+    struct split_queue *q;
+    samFile *fp;
+    sam_hdr_t *hdr;
+    const char *name;   // output file name, or NULL for unaccounted reads
+    bam1_t **recs;
+    int n;
+    int ret;
+} split_batch_t;
+
+// One output's records.  batch[fill] is being filled by the main thread
+// while the other one may be being written by the thread pool.
+typedef struct split_queue {
+    split_batch_t batch[2];
+    int fill;
+    int busy;
+} split_queue_t;
+
 struct state {
     samFile* merged_input_file;
     sam_hdr_t* merged_input_header;
@@ -75,6 +98,10 @@ struct state {
     kh_c2i_t* tag_val_hash;
     htsThreadPool p;
     int write_index;
+    split_queue_t **queue;
+    split_queue_t *unaccounted_queue;
+    hts_tpool_process *wq;  // Writes to the outputs, NULL if unthreaded
+    int nbusy, max_busy;
 };
 
 typedef struct state state_t;
@@ -118,7 +145,7 @@ static parsed_opts_t* parse_args(int argc, char** argv)
     char *default_format_string = "%*_%#.%.";
 
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 0, 0, 0, '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 0, 0, 0, '@', '-', '-'),
         {"no-PG", no_argument, NULL, 1},
         {"max-split", required_argument, NULL, 'M'},
         {"zero-pad", required_argument, NULL, 'p'},
@@ -348,6 +375,12 @@ static int grow_output_lists(state_t *state, size_t count) {
     if (!new_hdr)
         return -1;
     state->output_header = new_hdr;
+    split_queue_t **new_queue = realloc(state->queue,
+                                        count * sizeof(split_queue_t *));
+    if (!new_queue)
+        return -1;
+    state->queue = new_queue;
+    state->queue[count - 1] = NULL;
     return 0;
 }
 
@@ -476,6 +509,138 @@ static khiter_t prep_sam_file(parsed_opts_t *opts, state_t *state,
     return kh_end(state->tag_val_hash);
 }
 
+static split_queue_t *split_queue_init(samFile *fp, sam_hdr_t *hdr,
+                                       const char *name) {
+    split_queue_t *q = calloc(1, sizeof(*q));
+    int i;
+    if (!q)
+        return NULL;
+    for (i = 0; i < 2; i++) {
+        q->batch[i].q = q;
+        q->batch[i].fp = fp;
+        q->batch[i].hdr = hdr;
+        q->batch[i].name = name;
+        q->batch[i].recs = calloc(SPLIT_BATCH_SIZE, sizeof(bam1_t *));
+        if (!q->batch[i].recs) {
+            free(q->batch[0].recs);
+            free(q);
+            return NULL;
+        }
+    }
+    return q;
+}
+
+static void split_queue_destroy(split_queue_t *q) {
+    int i, j;
+    if (!q)
+        return;
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < SPLIT_BATCH_SIZE; j++)
+            bam_destroy1(q->batch[i].recs[j]);
+        free(q->batch[i].recs);
+    }
+    free(q);
+}
+
+static void *split_write_job(void *arg) {
+    split_batch_t *sb = (split_batch_t *)arg;
+    int i;
+
+    sb->ret = 0;
+    for (i = 0; i < sb->n; i++) {
+        if (sam_write1(sb->fp, sb->hdr, sb->recs[i]) < 0) {
+            sb->ret = -1;
+            break;
+        }
+    }
+    return sb;
+}
+
+// Waits for the oldest batch handed to the thread pool.
+// Returns 0 if it was written, -1 on failure
+static int split_collect(state_t *state) {
+    hts_tpool_result *r = hts_tpool_next_result_wait(state->wq);
+    if (!r) {
+        state->nbusy = 0;
+        return -1;
+    }
+    split_batch_t *sb = (split_batch_t *)hts_tpool_result_data(r);
+    hts_tpool_delete_result(r, 0);
+
+    state->nbusy--;
+    sb->q->busy = 0;
+    sb->n = 0;
+    if (sb->ret < 0) {
+        if (sb->name)
+            print_error_errno("split", "Could not write to \"%s\"", sb->name);
+        else
+            print_error_errno("split", "Could not write to unaccounted output file");
+        return -1;
+    }
+    return 0;
+}
+
+// Hands the batch being filled to the thread pool
+static int split_flush(state_t *state, split_queue_t *q) {
+    if (!q || !q->batch[q->fill].n)
+        return 0;
+    split_batch_t *sb = &q->batch[q->fill];
+
+    // The previous batch for this output has to be written first.  We
+    // also leave a thread free so compression jobs queued by the writes
+    // can always run.
+    while (q->busy || state->nbusy >= state->max_busy)
+        if (split_collect(state) < 0)
+            return -1;
+
+    if (hts_tpool_dispatch(state->p.pool, state->wq, split_write_job, sb) < 0)
+        return -1;
+    state->nbusy++;
+    q->busy = 1;
+    q->fill ^= 1;
+    return 0;
+}
+
+// Waits for all outstanding writes, returns -1 if any failed
+static int split_drain(state_t *state) {
+    int ret = 0;
+    while (state->nbusy)
+        if (split_collect(state) < 0)
+            ret = -1;
+    return ret;
+}
+
+// Writes *bp to an output.  When threaded the record is swapped into the
+// output's batch, and *bp is replaced with an unused record.
+static int split_write(state_t *state, split_queue_t **qp, samFile *fp,
+                       sam_hdr_t *hdr, const char *name, bam1_t **bp) {
+    if (!state->wq) {
+        if (sam_write1(fp, hdr, *bp) >= 0)
+            return 0;
+        if (name)
+            print_error_errno("split", "Could not write to \"%s\"", name);
+        else
+            print_error_errno("split", "Could not write to unaccounted output file");
+        return -1;
+    }
+
+    if (!*qp && !(*qp = split_queue_init(fp, hdr, name))) {
+        print_error_errno("split", "Could not allocate output queue");
+        return -1;
+    }
+    split_queue_t *q = *qp;
+    split_batch_t *sb = &q->batch[q->fill];
+    if (!sb->recs[sb->n] && !(sb->recs[sb->n] = bam_init1())) {
+        print_error_errno("split", "Could not allocate output queue");
+        return -1;
+    }
+    bam1_t *tmp = sb->recs[sb->n];
+    sb->recs[sb->n++] = *bp;
+    *bp = tmp;
+
+    return sb->n == SPLIT_BATCH_SIZE ? split_flush(state, q) : 0;
+}
+
 // Set the initial state
 static state_t* init(parsed_opts_t* opts, const char *arg_list)
 {
@@ -493,6 +658,18 @@ static state_t* init(parsed_opts_t* opts, const char *arg_list)
         }
     }
 
+    // With more than one thread, records are written to the outputs by
+    // the pool too.  This uses at most nthreads-1 threads for writing.
+    if (opts->ga.nthreads > 1) {
+        if (!(retval->wq = hts_tpool_process_init(retval->p.pool,
+                                                  opts->ga.nthreads, 0))) {
+            fprintf(stderr, "Error creating thread pool queue\n");
+            cleanup_state(retval, false);
+            return NULL;
+        }
+        retval->max_busy = opts->ga.nthreads - 1;
+    }
+
     retval->merged_input_file = sam_open_format(opts->merged_input_name, "r", &opts->ga.in);
     if (!retval->merged_input_file) {
         print_error_errno("split", "Could not open \"%s\"", opts->merged_input_name);
@@ -575,9 +752,10 @@ static state_t* init(parsed_opts_t* opts, const char *arg_list)
     retval->output_file_name = (char **)calloc(num, sizeof(char *));
     retval->output_file = (samFile**)calloc(num, sizeof(samFile*));
     retval->output_header = (sam_hdr_t**)calloc(num, sizeof(sam_hdr_t*));
+    retval->queue = (split_queue_t**)calloc(num, sizeof(split_queue_t*));
     retval->tag_val_hash = kh_init_c2i();
     if (!retval->output_file_name || !retval->output_file || !retval->output_header ||
-        !retval->tag_val_hash || !retval->index_file_name) {
+        !retval->queue || !retval->tag_val_hash || !retval->index_file_name) {
         print_error_errno("split", "Could not initialise output file array");
         cleanup_state(retval, false);
         return NULL;
@@ -764,10 +942,10 @@ static bool split(state_t* state, parsed_opts_t *opts, char *arg_list)
         if (iter != kh_end(state->tag_val_hash)) {
             // if found write to the appropriate untangled bam
             int i = kh_val(state->tag_val_hash,iter);
-            if (sam_write1(state->output_file[i], state->output_header[i], file_read) < 0) {
-                print_error_errno("split", "Could not write to \"%s\"", state->output_file_name[i]);
+            if (split_write(state, &state->queue[i], state->output_file[i],
+                            state->output_header[i],
+                            state->output_file_name[i], &file_read) < 0)
                 goto error;
-            }
         } else {
             // otherwise write to the unaccounted bam if there is one or fail
             if (state->unaccounted_file == NULL) {
@@ -779,10 +957,11 @@ static bool split(state_t* state, parsed_opts_t *opts, char *arg_list)
                 }
                 goto error;
             } else {
-                if (sam_write1(state->unaccounted_file, state->unaccounted_header, file_read) < 0) {
-                    print_error_errno("split", "Could not write to unaccounted output file");
+                if (split_write(state, &state->unaccounted_queue,
+                                state->unaccounted_file,
+                                state->unaccounted_header, NULL,
+                                &file_read) < 0)
                     goto error;
-                }
             }
         }
 
@@ -793,11 +972,22 @@ static bool split(state_t* state, parsed_opts_t *opts, char *arg_list)
             file_read = NULL;
             if (r < -1) {
                 print_error("split", "Could not read input record");
-                return false;
+                goto error;
             }
         }
     }
 
+    if (state->wq) {
+        size_t i;
+        for (i = 0; i < state->output_count; i++)
+            if (split_flush(state, state->queue[i]) < 0)
+                goto error;
+        if (split_flush(state, state->unaccounted_queue) < 0)
+            goto error;
+        if (split_drain(state) < 0)
+            return false;
+    }
+
     if (state->write_index) {
         size_t i;
         for (i = 0; i < state->output_count; i++) {
@@ -818,6 +1008,8 @@ static bool split(state_t* state, parsed_opts_t *opts, char *arg_list)
 
     return true;
 error:
+    if (state->wq)
+        split_drain(state);
     bam_destroy1(file_read);
     return false;
 }
@@ -837,6 +1029,8 @@ static int cleanup_state(state_t* status, bool check_close)
     sam_close(status->merged_input_file);
     size_t i;
     for (i = 0; i < status->output_count; i++) {
+        if (status->queue)
+            split_queue_destroy(status->queue[i]);
         if (status->output_header && status->output_header[i])
             sam_hdr_destroy(status->output_header[i]);
         if (status->output_file && status->output_file[i]) {
@@ -851,6 +1045,8 @@ static int cleanup_state(state_t* status, bool check_close)
     }
     if (status->merged_input_header)
         sam_hdr_destroy(status->merged_input_header);
+    split_queue_destroy(status->unaccounted_queue);
+    free(status->queue);
     free(status->output_header);
     free(status->output_file);
     free(status->output_file_name);
@@ -859,6 +1055,8 @@ static int cleanup_state(state_t* status, bool check_close)
     kh_destroy_c2i(status->tag_val_hash);
 
     free(status->tag_vals);
+    if (status->wq)
+        hts_tpool_process_destroy(status->wq);
     if (status->p.pool)
         hts_tpool_destroy(status->p.pool);
     free(status);
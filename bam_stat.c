@@ -33,6 +33,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <getopt.h>
 
 #include "htslib/sam.h"
+#include "htslib/thread_pool.h"
 #include "samtools.h"
 #include "sam_opts.h"
 
@@ -97,6 +98,46 @@ bam_flagstat_t *bam_flagstat_core(samFile *fp, sam_hdr_t *h)
     return s;
 }
 
+// BAM records read as their fixed-length fields only.  The flags,
+// reference ids and MAPQ are all there, so the name, CIGAR, sequence,
+// qualities and aux data are skipped without filling in a bam1_t.  The
+// reference id checks match those made by sam_read1.
+static bam_flagstat_t *bam_flagstat_core_fast(samFile *fp, sam_hdr_t *h)
+{
+    bam_flagstat_t *s;
+    bam1_core_t c;
+    uint8_t *skip = NULL;
+    size_t mskip = 0;
+    int32_t nref = sam_hdr_nref(h);
+    int ret;
+
+    if (!(s = calloc(1, sizeof(*s))))
+        return NULL;
+    while ((ret = read_bam_core(fp->fp.bgzf, &c, &skip, &mskip)) >= 0) {
+        if (c.tid  < -1 || c.tid  >= nref || c.mtid < -1 || c.mtid >= nref) {
+            ret = -2;
+            break;
+        }
+        flagstat_loop(s, &c);
+    }
+    free(skip);
+    if (ret != -1) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+static void flagstat_add(bam_flagstat_t *dst, const bam_flagstat_t *src)
+{
+    // Every member is an array of long long counters
+    long long *d = (long long *)dst;
+    const long long *a = (const long long *)src;
+    size_t i;
+    for (i = 0; i < sizeof(*dst) / sizeof(long long); i++)
+        d[i] += a[i];
+}
+
 static const char *percent(char *buffer, long long n, long long total)
 {
     if (total != 0) sprintf(buffer, "%.2f%%", (float)n / total * 100.0);
@@ -113,7 +154,7 @@ static const char *percent_json(char *buffer, long long n, long long total)
 
 static void usage_exit(FILE *fp, int exit_status)
 {
-    fprintf(fp, "Usage: samtools flagstat [options] <in.bam>\n");
+    fprintf(fp, "Usage: samtools flagstat [options] <in.bam> [...]\n");
     sam_global_opt_help(fp, "-.---@-.");
     fprintf(fp, "  -O, --");
     fprintf(fp, "output-fmt FORMAT[,OPT[=VAL]]...\n"
@@ -270,10 +311,138 @@ static void output_fmt(bam_flagstat_t *s, const char *out_fmt)
   }
 }
 
-int bam_flagstat(int argc, char *argv[])
+// Counts one input file, decoding with nthreads extra threads.
+// Returns the counts on success,
+//         NULL on failure, having reported the error.
+static bam_flagstat_t *flagstat_file(const char *fn, sam_global_args *ga,
+                                     int nthreads)
 {
     samFile *fp;
-    sam_hdr_t *header;
+    sam_hdr_t *header = NULL;
+    bam_flagstat_t *s = NULL;
+
+    fp = sam_open_format(fn, "r", &ga->in);
+    if (fp == NULL) {
+        print_error_errno("flagstat", "Cannot open input file \"%s\"", fn);
+        return NULL;
+    }
+    if (nthreads > 0)
+        hts_set_threads(fp, nthreads);
+
+    if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS,
+                    SAM_FLAG | SAM_RNAME | SAM_MAPQ | SAM_RNEXT)) {
+        fprintf(stderr, "Failed to set CRAM_OPT_REQUIRED_FIELDS value\n");
+        goto out;
+    }
+
+    if (hts_set_opt(fp, CRAM_OPT_DECODE_MD, 0)) {
+        fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
+        goto out;
+    }
+
+    header = sam_hdr_read(fp);
+    if (header == NULL) {
+        fprintf(stderr, "Failed to read header for \"%s\"\n", fn);
+        goto out;
+    }
+
+    if (hts_get_format(fp)->format == bam)
+        s = bam_flagstat_core_fast(fp, header);
+    else
+        s = bam_flagstat_core(fp, header);
+    if (!s)
+        print_error("flagstat", "error reading from \"%s\"", fn);
+
+ out:
+    if (header)
+        sam_hdr_destroy(header);
+    if (sam_close(fp) < 0 && s) {
+        print_error("flagstat", "error closing \"%s\"", fn);
+        free(s);
+        s = NULL;
+    }
+    return s;
+}
+
+// Counting several files at once, a file per job.  Each file is decoded
+// without extra threads as the pool is busy reading the others.
+typedef struct {
+    const char *fn;
+    sam_global_args *ga;
+    bam_flagstat_t *s;
+} flagstat_job_t;
+
+static void *flagstat_job(void *arg)
+{
+    flagstat_job_t *job = (flagstat_job_t *)arg;
+    job->s = flagstat_file(job->fn, job->ga, 0);
+    return job;
+}
+
+// Adds the counts for all of filev to total.
+// Returns 0 on success,
+//        -1 on failure
+static int flagstat_threaded(char **filev, int filec, sam_global_args *ga,
+                             bam_flagstat_t *total)
+{
+    int njob = filec < 2 * ga->nthreads ? filec : 2 * ga->nthreads;
+    int nfile = 0, next = 0, in_flight = 0, ret = 0;
+    flagstat_job_t *job = calloc(njob, sizeof(*job));
+    hts_tpool *pool = NULL;
+    hts_tpool_process *q = NULL;
+
+    if (!job || !(pool = hts_tpool_init(ga->nthreads))
+        || !(q = hts_tpool_process_init(pool, njob, 0))) {
+        print_error_errno("flagstat", "could not set up the reading threads");
+        ret = -1;
+        goto out;
+    }
+
+    for (;;) {
+        while (nfile < filec && ret == 0 && in_flight < njob) {
+            flagstat_job_t *jb = &job[next];
+            jb->fn = filev[nfile++];
+            jb->ga = ga;
+            jb->s = NULL;
+            if (hts_tpool_dispatch(pool, q, flagstat_job, jb) < 0) {
+                ret = -1;
+                break;
+            }
+            next = (next + 1) % njob;
+            in_flight++;
+        }
+        if (!in_flight)
+            break;
+
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        if (!res) {
+            ret = -1;
+            break;
+        }
+        flagstat_job_t *jb = (flagstat_job_t *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+
+        // After an error the remaining jobs are only collected
+        if (!jb->s)
+            ret = -1;
+        else
+            flagstat_add(total, jb->s);
+        free(jb->s);
+        jb->s = NULL;
+    }
+
+ out:
+    if (q)
+        hts_tpool_process_destroy(q);
+    if (pool)
+        hts_tpool_destroy(pool);
+    free(job);
+    return ret;
+}
+
+int bam_flagstat(int argc, char *argv[])
+{
     bam_flagstat_t *s;
     const char *out_fmt = "default";
     int c, status = EXIT_SUCCESS;
@@ -284,7 +453,7 @@ int bam_flagstat(int argc, char *argv[])
 
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', '-', '-', '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', '-', '-', '@', '-', '-'),
         {NULL, 0, NULL, 0}
     };
 
@@ -300,47 +469,32 @@ int bam_flagstat(int argc, char *argv[])
         }
     }
 
-    if (argc != optind+1) {
-        if (argc == optind) usage_exit(stdout, EXIT_SUCCESS);
-        else usage_exit(stderr, EXIT_FAILURE);
-    }
-    fp = sam_open_format(argv[optind], "r", &ga.in);
-    if (fp == NULL) {
-        print_error_errno("flagstat", "Cannot open input file \"%s\"", argv[optind]);
-        return 1;
-    }
-    if (ga.nthreads > 0)
-        hts_set_threads(fp, ga.nthreads);
-
-    if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS,
-                    SAM_FLAG | SAM_MAPQ | SAM_RNEXT)) {
-        fprintf(stderr, "Failed to set CRAM_OPT_REQUIRED_FIELDS value\n");
-        return 1;
-    }
+    if (argc == optind) usage_exit(stdout, EXIT_SUCCESS);
 
-    if (hts_set_opt(fp, CRAM_OPT_DECODE_MD, 0)) {
-        fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
-        return 1;
-    }
-
-    header = sam_hdr_read(fp);
-    if (header == NULL) {
-        fprintf(stderr, "Failed to read header for \"%s\"\n", argv[optind]);
-        return 1;
-    }
-
-    s = bam_flagstat_core(fp, header);
-    if (s) {
-        output_fmt(s, out_fmt);
-        free(s);
-    }
-    else {
-        print_error("flagstat", "error reading from \"%s\"", argv[optind]);
+    // Several files with threads are read a file per thread; otherwise
+    // the threads decompress each file in turn.
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+        print_error_errno("flagstat", "could not allocate counts");
         status = EXIT_FAILURE;
+    } else if (ga.nthreads > 0 && argc - optind > 1) {
+        if (flagstat_threaded(argv + optind, argc - optind, &ga, s) < 0)
+            status = EXIT_FAILURE;
+    } else {
+        for (; optind < argc; optind++) {
+            bam_flagstat_t *fs = flagstat_file(argv[optind], &ga, ga.nthreads);
+            if (!fs) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            flagstat_add(s, fs);
+            free(fs);
+        }
     }
 
-    sam_hdr_destroy(header);
-    sam_close(fp);
+    if (status == EXIT_SUCCESS)
+        output_fmt(s, out_fmt);
+    free(s);
     sam_global_args_free(&ga);
     return status;
 }
@@ -38,6 +38,21 @@ DEALINGS IN THE SOFTWARE.  */
 // to stop them running into each other.
 #define TEN_DIGITS 1000000000
 
+// Viewport mode lays out this many rows beyond the bottom of the screen, and
+// caches records for one screen width either side of it.
+#define TV_ROW_MARGIN 16
+
+struct tv_rows {
+    int tid, max_level, no_skip;
+    hts_pos_t beg, end;     // region the records were fetched for
+    int n, m;
+    bam1_t **b;             // records kept, in file order
+    int *level;             // and the row each was given
+    int n_row, m_row;
+    hts_pos_t *row_end;     // end of the last record in each row
+    int cur_level;          // level of the record being pushed
+};
+
 static void destroy_rg_hash(khash_t(kh_rg)* rg_hash)
 {
     khiter_t k;
@@ -157,9 +172,22 @@ int base_tv_init(tview_t* tv, const char *fn, const char *fn_fa, const char *fn_
 }
 
 
+static void tv_rows_destroy(struct tv_rows *r)
+{
+    int i;
+    if (!r) return;
+    for (i = 0; i < r->m; i++) bam_destroy1(r->b[i]);
+    free(r->b);
+    free(r->level);
+    free(r->row_end);
+    free(r);
+}
+
 void base_tv_destroy(tview_t* tv)
 {
     bam_lplbuf_destroy(tv->lplbuf);
+    if (tv->vplp) bam_plp_destroy(tv->vplp);
+    tv_rows_destroy(tv->rows);
     bcf_call_destroy(tv->bca);
     hts_idx_destroy(tv->idx);
     if (tv->fai) fai_destroy(tv->fai);
@@ -331,7 +359,7 @@ int tv_pl_func(uint32_t tid, hts_pos_t pos, int n, const bam_pileup1_t *pl, void
 
 
 
-static int tv_push_aln(const bam1_t *b, tview_t *tv)
+static int tv_keep_aln(const bam1_t *b, const tview_t *tv)
 {
     /* If we are restricted to specific readgroups check RG is in the list */
     if ( tv->rg_hash )
@@ -341,18 +369,158 @@ static int tv_push_aln(const bam1_t *b, tview_t *tv)
         khiter_t k = kh_get(kh_rg, tv->rg_hash, (const char*)(rg + 1));
         if ( k == kh_end(tv->rg_hash) ) return 0; // if RG tag is not in list of allowed tags exclude read
     }
-    if (tv->no_skip) {
-        uint32_t *cigar = bam_get_cigar(b); // this is cheating...
-        int i;
-        for (i = 0; i <b->core.n_cigar; ++i) {
-            if ((cigar[i]&0xf) == BAM_CREF_SKIP)
-                cigar[i] = cigar[i]>>4<<4 | BAM_CDEL;
-        }
+    return 1;
+}
+
+static void tv_fix_skip(bam1_t *b)
+{
+    uint32_t *cigar = bam_get_cigar(b); // this is cheating...
+    int i;
+    for (i = 0; i <b->core.n_cigar; ++i) {
+        if ((cigar[i]&0xf) == BAM_CREF_SKIP)
+            cigar[i] = cigar[i]>>4<<4 | BAM_CDEL;
     }
+}
+
+static int tv_push_aln(bam1_t *b, tview_t *tv)
+{
+    if (!tv_keep_aln(b, tv)) return 0;
+    if (tv->no_skip) tv_fix_skip(b);
     bam_lplbuf_push(b, tv->lplbuf);
     return 0;
 }
 
+/*
+ * Viewport mode.  Piling up a deep region through bam_lplbuf costs time in
+ * proportion to its full depth, although only a screenful of rows is ever
+ * drawn.  Instead each record is put in the first row that is free at its
+ * start as it is read, and records that would land more than TV_ROW_MARGIN
+ * rows below the screen are dropped.  The kept records are cached with their
+ * rows, so panning and scrolling within the cached region only piles up the
+ * records in view.
+ */
+
+// Returns the level (1-based row) for b, or 0 if it is below max_level
+static int tv_rows_place(struct tv_rows *r, const bam1_t *b, int max_level)
+{
+    int i;
+    for (i = 0; i < r->n_row; i++)
+        if (r->row_end[i] < b->core.pos) break; // as TV_GAP in bam_lpileup.c
+    if (i == r->n_row) {
+        if (i >= max_level) return 0;
+        if (r->n_row == r->m_row) {
+            int m = r->m_row ? r->m_row * 2 : 64;
+            hts_pos_t *row_end = realloc(r->row_end, m * sizeof(*row_end));
+            if (!row_end) return -1;
+            r->row_end = row_end;
+            r->m_row = m;
+        }
+        r->n_row++;
+    }
+    r->row_end[i] = bam_endpos(b);
+    return i + 1;
+}
+
+static int tv_rows_fetch(tview_t *tv, int max_level)
+{
+    struct tv_rows *r = tv->rows;
+    hts_itr_t *iter;
+    int ret, level;
+
+    r->tid = tv->curr_tid;
+    r->beg = tv->left_pos > tv->mcol ? tv->left_pos - tv->mcol : 0;
+    r->end = tv->left_pos + 2 * (hts_pos_t) tv->mcol;
+    r->max_level = max_level;
+    r->no_skip = tv->no_skip;
+    r->n = r->n_row = 0;
+
+    iter = sam_itr_queryi(tv->idx, r->tid, r->beg, r->end);
+    if (!iter) return -1;
+    for (;;) {
+        bam1_t *b;
+        if (r->n == r->m) {
+            int m = r->m ? r->m * 2 : 256;
+            bam1_t **bs = realloc(r->b, m * sizeof(*bs));
+            int *lv;
+            if (!bs) goto fail;
+            r->b = bs;
+            if (!(lv = realloc(r->level, m * sizeof(*lv)))) goto fail;
+            r->level = lv;
+            for (; r->m < m; r->m++)
+                if (!(r->b[r->m] = bam_init1())) goto fail;
+        }
+        b = r->b[r->n];
+        if ((ret = sam_itr_next(tv->fp, iter, b)) < 0) break;
+        // bam_plp_push() drops these too
+        if (b->core.tid < 0 || (b->core.flag & BAM_FUNMAP)) continue;
+        if (!tv_keep_aln(b, tv)) continue;
+        if ((level = tv_rows_place(r, b, max_level)) < 0) goto fail;
+        if (level == 0) continue;
+        if (tv->no_skip) tv_fix_skip(b);
+        r->level[r->n++] = level;
+    }
+    hts_itr_destroy(iter);
+    if (ret < -1) {
+        r->tid = -1;
+        return -1;
+    }
+    return 0;
+
+ fail:
+    hts_itr_destroy(iter);
+    r->tid = -1;
+    return -1;
+}
+
+static int tv_rows_construct(void *data, const bam1_t *b, bam_pileup_cd *cd)
+{
+    cd->i = ((tview_t *) data)->rows->cur_level;
+    return 0;
+}
+
+static int tv_rows_push(tview_t *tv, const bam1_t *b)
+{
+    const bam_pileup1_t *plp;
+    int tid, n, i;
+    hts_pos_t pos;
+    if (bam_plp_push(tv->vplp, b) < 0) return -1;
+    while ((plp = bam_plp64_next(tv->vplp, &tid, &pos, &n)) != 0) {
+        for (i = 0; i < n; i++)
+            ((bam_pileup1_t *) plp)[i].level = plp[i].cd.i;
+        tv_pl_func(tid, pos, n, plp, tv);
+    }
+    return 0;
+}
+
+static int tv_draw_rows(tview_t *tv)
+{
+    struct tv_rows *r;
+    int i, max_level = tv->row_shift + tv->mrow - TV_MIN_ALNROW - 1;
+
+    if (!tv->rows) {
+        if (!(tv->rows = calloc(1, sizeof(*tv->rows)))) return -1;
+        tv->rows->tid = -1;
+        if (!(tv->vplp = bam_plp_init(NULL, tv))) return -1;
+        bam_plp_constructor(tv->vplp, tv_rows_construct);
+    }
+    r = tv->rows;
+    if (r->tid != tv->curr_tid || tv->left_pos < r->beg
+        || tv->left_pos + tv->mcol > r->end || max_level > r->max_level
+        || tv->no_skip != r->no_skip) {
+        if (tv_rows_fetch(tv, max_level + TV_ROW_MARGIN) < 0) return -1;
+    }
+
+    bam_plp_reset(tv->vplp);
+    for (i = 0; i < r->n; i++) {
+        const bam1_t *b = r->b[i];
+        if (b->core.pos >= tv->left_pos + tv->mcol) break;
+        if (bam_endpos(b) <= tv->left_pos) continue;
+        r->cur_level = r->level[i];
+        if (tv_rows_push(tv, b) < 0) return -1;
+    }
+    return tv_rows_push(tv, NULL);
+}
+
 int base_draw_aln(tview_t *tv, int tid, hts_pos_t pos)
 {
     int ret;
@@ -376,18 +544,25 @@ int base_draw_aln(tview_t *tv, int tid, hts_pos_t pos)
         }
     }
     // draw aln
-    bam_lplbuf_reset(tv->lplbuf);
-    hts_itr_t *iter = sam_itr_queryi(tv->idx, tv->curr_tid, tv->left_pos, tv->left_pos + tv->mcol);
-    bam1_t *b = bam_init1();
-    while ((ret = sam_itr_next(tv->fp, iter, b)) >= 0) tv_push_aln(b, tv);
-    bam_destroy1(b);
-    hts_itr_destroy(iter);
-    if (ret < -1) {
-        print_error("tview", "could not read from input file");
-        exit(1);
-    }
+    if (tv->viewport) {
+        if (tv_draw_rows(tv) < 0) {
+            print_error("tview", "could not read from input file");
+            exit(1);
+        }
+    } else {
+        bam_lplbuf_reset(tv->lplbuf);
+        hts_itr_t *iter = sam_itr_queryi(tv->idx, tv->curr_tid, tv->left_pos, tv->left_pos + tv->mcol);
+        bam1_t *b = bam_init1();
+        while ((ret = sam_itr_next(tv->fp, iter, b)) >= 0) tv_push_aln(b, tv);
+        bam_destroy1(b);
+        hts_itr_destroy(iter);
+        if (ret < -1) {
+            print_error("tview", "could not read from input file");
+            exit(1);
+        }
 
-    bam_lplbuf_push(0, tv->lplbuf);
+        bam_lplbuf_push(0, tv->lplbuf);
+    }
 
     while (tv->ccol < tv->mcol) {
         hts_pos_t pos = tv->last_pos + 1;
@@ -413,6 +588,7 @@ static void HTS_FORMAT(HTS_PRINTF_FMT, 1, 2) error(const char *format, ...)
 "   -X              include customized index file\n"
 "   -p chr:pos      go directly to this position\n"
 "   -s STR          display only reads from this sample or group\n"
+"   -V              lay out only the rows on screen, for very deep regions\n"
 "   -w INT          display width (with -d T only)\n");
         sam_global_opt_help(stderr, "-.--.--.");
     }
@@ -439,16 +615,16 @@ int bam_tview_main(int argc, char *argv[])
     int view_mode=display_ncurses, display_width = 0;
     tview_t* tv=NULL;
     char *samples=NULL, *position=NULL, *ref, *fn_idx=NULL;
-    int c, has_index_file = 0, ref_index = 0;
+    int c, has_index_file = 0, ref_index = 0, viewport = 0;
 
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '-'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '-', '-', '-'),
         { NULL, 0, NULL, 0 }
     };
 
     char *tmp;
-    while ((c = getopt_long(argc, argv, "s:p:d:Xw:", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "s:p:d:Xw:V", lopts, NULL)) >= 0) {
         switch (c) {
             case 'w':
                 display_width = strtol(optarg,&tmp,10);
@@ -457,6 +633,7 @@ int bam_tview_main(int argc, char *argv[])
             case 's': samples=optarg; break;
             case 'p': position=optarg; break;
             case 'X': has_index_file=1; break; // -X flag for index filename
+            case 'V': viewport=1; break;
             case 'd':
             {
                 switch(optarg[0])
@@ -513,6 +690,7 @@ int bam_tview_main(int argc, char *argv[])
         error("cannot create view");
         return EXIT_FAILURE;
     }
+    tv->viewport = viewport;
 
     if ( position )
     {
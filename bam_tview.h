@@ -41,6 +41,8 @@ DEALINGS IN THE SOFTWARE.  */
 
 KHASH_MAP_INIT_STR(kh_rg, const char *)
 
+struct tv_rows;
+
 /* Holds state of Tview */
 typedef struct AbstractTview {
     int mrow, mcol;
@@ -55,6 +57,11 @@ typedef struct AbstractTview {
     hts_pos_t left_pos, last_pos, l_ref;
     int curr_tid, ccol, row_shift, base_for, color_for, is_dot, ins;
     int no_skip, show_name, inverse;
+    /* viewport mode: records are given rows as they are read and only those
+       on screen (plus a margin) are piled up, see struct tv_rows */
+    int viewport;
+    bam_plp_t vplp;
+    struct tv_rows *rows;
     char *ref;
     /* maps @RG ID => SM (sample), in practice only used to determine whether a particular RG is in the list of allowed ones */
     khash_t(kh_rg) *rg_hash;
@@ -41,9 +41,10 @@ DEALINGS IN THE SOFTWARE.  */
 #include "samtools.h"
 #include "htslib/thread_pool.h"
 #include "sam_opts.h"
-#include "htslib/khash.h"
+#include "tmp_file.h"
 
 #define DEF_CLEVEL 1
+#define DEF_MAX_MEM (768 << 20)
 
 static inline unsigned hash_Wang(unsigned key)
 {
@@ -96,11 +97,71 @@ typedef struct {
     size_t index;
 } bam_list_t;
 
+/*
+ * Open addressed table from read name to its slot in the bam_list_t.
+ * The hash of the name is stored alongside the slot, so most mismatches
+ * are found without a string compare.  Linear probing with
+ * backward-shift deletion keeps lookups short without tombstones, and
+ * the table is sized to be at most half full.
+ */
 typedef struct {
-    bam_item_t *bi;
-} store_item_t;
+    uint32_t hash;
+    int32_t slot;       // -1 if empty
+} name_slot_t;
 
-KHASH_MAP_INIT_STR(bam_store, store_item_t)
+typedef struct {
+    name_slot_t *t;
+    uint32_t mask;
+} name_index_t;
+
+static int name_index_init(name_index_t *ni, size_t n) {
+    size_t i, m = 16;
+    while (m < 2 * n)
+        m *= 2;
+    if (m > UINT32_MAX || !(ni->t = malloc(m * sizeof(*ni->t))))
+        return -1;
+    for (i = 0; i < m; i++)
+        ni->t[i].slot = -1;
+    ni->mask = m - 1;
+    return 0;
+}
+
+// Returns the table position for name, or -1 if it is not present
+static int64_t name_index_get(const name_index_t *ni, const bam_list_t *list,
+                              const char *name, uint32_t hash) {
+    uint32_t i;
+    for (i = hash & ni->mask; ni->t[i].slot >= 0; i = (i + 1) & ni->mask) {
+        if (ni->t[i].hash == hash
+            && strcmp(bam_get_qname(list->items[ni->t[i].slot].b), name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Adds a name which is known not to be present
+static void name_index_put(name_index_t *ni, uint32_t hash, int32_t slot) {
+    uint32_t i;
+    for (i = hash & ni->mask; ni->t[i].slot >= 0; i = (i + 1) & ni->mask)
+        ;
+    ni->t[i].hash = hash;
+    ni->t[i].slot = slot;
+}
+
+static void name_index_del(name_index_t *ni, uint32_t i) {
+    uint32_t j = i;
+    for (;;) {
+        j = (j + 1) & ni->mask;
+        if (ni->t[j].slot < 0)
+            break;
+        // Move j back into the hole at i if its home is not in (i, j]
+        uint32_t home = ni->t[j].hash & ni->mask;
+        if (((j - home) & ni->mask) >= ((j - i) & ni->mask)) {
+            ni->t[i] = ni->t[j];
+            i = j;
+        }
+    }
+    ni->t[i].slot = -1;
+}
 
 
 static bam_item_t *store_bam(bam_list_t *list) {
@@ -164,32 +225,358 @@ static void destroy_bam_list(bam_list_t *list) {
 }
 
 
-static inline int write_to_bin_file(bam1_t *bam, int64_t *count, samFile **bin_files, char **names, sam_hdr_t *header, int files) {
-    uint32_t x;
+/*
+ * Reads are spread over n bins by a hash of their name.  Each bin is kept
+ * in memory as a run of records (the bam1_core_t, a uint32_t data length
+ * and the data), until the total goes over max_mem.  The largest bin is
+ * then moved out to an LZ4 temporary file, which later reads of the bin
+ * are added to as well.  The buffers of each temporary file count towards
+ * max_mem too, so more bins spill sooner as files are opened.
+ */
+typedef struct {
+    uint8_t *buf;       // in memory records
+    size_t l, m;
+    tmp_file_t *spill;  // earlier reads of the bin, or NULL
+    size_t spill_mem;   // buffers held by spill
+    int64_t count;
+} collate_bin_t;
 
-    x = hash_X31_Wang(bam_get_qname(bam)) % files;
+typedef struct {
+    collate_bin_t *bin;
+    int n;
+    size_t mem, max_mem;
+    const char *prefix;
+    int codec;
+} collate_bins_t;
+
+#define BIN_REC_HDR (sizeof(bam1_core_t) + sizeof(uint32_t))
+
+static int init_bins(collate_bins_t *cb, int n, size_t max_mem,
+                     const char *prefix, int codec) {
+    cb->bin = calloc(n, sizeof(*cb->bin));
+    cb->n = n;
+    cb->mem = 0;
+    cb->max_mem = max_mem;
+    cb->prefix = prefix;
+    cb->codec = codec;
+    return cb->bin ? 0 : -1;
+}
 
-    if (sam_write1(bin_files[x], header, bam) < 0) {
-        print_error_errno("collate", "Couldn't write to intermediate file \"%s\"", names[x]);
-        return 1;
+static void free_bin(collate_bin_t *bin) {
+    if (bin->spill) {
+        tmp_file_destroy(bin->spill);
+        free(bin->spill);
+    }
+    free(bin->buf);
+    memset(bin, 0, sizeof(*bin));
+}
+
+static void destroy_bins(collate_bins_t *cb) {
+    int i;
+    for (i = 0; cb->bin && i < cb->n; i++)
+        free_bin(&cb->bin[i]);
+    free(cb->bin);
+    cb->bin = NULL;
+}
+
+// Gets the record at *off in buf into b, moving *off on to the next one
+static int read_bin_rec(const uint8_t *buf, size_t *off, bam1_t *b) {
+    uint32_t l_data;
+    memcpy(&b->core, buf + *off, sizeof(b->core));
+    memcpy(&l_data, buf + *off + sizeof(b->core), sizeof(l_data));
+    if (b->m_data < l_data) {
+        uint8_t *data = realloc(b->data, l_data);
+        if (!data)
+            return -1;
+        b->data = data;
+        b->m_data = l_data;
+    }
+    memcpy(b->data, buf + *off + BIN_REC_HDR, l_data);
+    b->l_data = l_data;
+    *off += BIN_REC_HDR + l_data;
+    return 0;
+}
+
+// Moves the in memory records of bin x to its temporary file
+static int spill_bin(collate_bins_t *cb, int x) {
+    collate_bin_t *bin = &cb->bin[x];
+    size_t off = 0, spill_mem;
+    bam1_t b;
+
+    if (!bin->spill) {
+        kstring_t name = KS_INITIALIZE;
+        if (ksprintf(&name, "%s.%04d", cb->prefix, x) < 0
+            || !(bin->spill = calloc(1, sizeof(*bin->spill)))) {
+            ks_free(&name);
+            print_error_errno("collate", "Out of memory");
+            return -1;
+        }
+        // Not threaded, as the bins are read back inside thread pool jobs
+        if (tmp_file_open_write(bin->spill, name.s, 1) != TMP_SAM_OK) {
+            print_error("collate", "Couldn't open temporary file \"%s\"",
+                        name.s);
+            ks_free(&name);
+            free(bin->spill);
+            bin->spill = NULL;
+            return -1;
+        }
+        if (cb->codec != TMP_SAM_CODEC_LZ4
+            && tmp_file_set_codec(bin->spill, cb->codec) != TMP_SAM_OK) {
+            print_error("collate", "Couldn't set codec for temporary file \"%s\"",
+                        name.s);
+            ks_free(&name);
+            return -1;
+        }
+        ks_free(&name);
+    }
+
+    // Records are written straight from the buffer
+    memset(&b, 0, sizeof(b));
+    while (off < bin->l) {
+        uint32_t l_data;
+        memcpy(&b.core, bin->buf + off, sizeof(b.core));
+        memcpy(&l_data, bin->buf + off + sizeof(b.core), sizeof(l_data));
+        b.data = bin->buf + off + BIN_REC_HDR;
+        b.l_data = b.m_data = l_data;
+        if (tmp_file_write(bin->spill, &b) != TMP_SAM_OK) {
+            print_error("collate", "Couldn't write to temporary file \"%s\"",
+                        bin->spill->name);
+            return -1;
+        }
+        off += BIN_REC_HDR + l_data;
+    }
+
+    // The ring buffer can grow while writing
+    spill_mem = bin->spill->ring_buffer_size + bin->spill->comp_buffer_size;
+    cb->mem += spill_mem - bin->spill_mem;
+    bin->spill_mem = spill_mem;
+
+    cb->mem -= bin->m;
+    free(bin->buf);
+    bin->buf = NULL;
+    bin->l = bin->m = 0;
+    return 0;
+}
+
+static int add_to_bin(collate_bins_t *cb, bam1_t *bam) {
+    uint32_t x = hash_X31_Wang(bam_get_qname(bam)) % cb->n;
+    collate_bin_t *bin = &cb->bin[x];
+    size_t need = BIN_REC_HDR + bam->l_data;
+    uint32_t l_data = bam->l_data;
+
+    if (bin->l + need > bin->m) {
+        size_t m = bin->m ? bin->m : 4096;
+        uint8_t *buf;
+        while (m < bin->l + need)
+            m *= 2;
+        if (!(buf = realloc(bin->buf, m))) {
+            print_error_errno("collate", "Out of memory");
+            return -1;
+        }
+        cb->mem += m - bin->m;
+        bin->buf = buf;
+        bin->m = m;
+    }
+    memcpy(bin->buf + bin->l, &bam->core, sizeof(bam->core));
+    memcpy(bin->buf + bin->l + sizeof(bam->core), &l_data, sizeof(l_data));
+    memcpy(bin->buf + bin->l + BIN_REC_HDR, bam->data, l_data);
+    bin->l += need;
+    bin->count++;
+
+    // Over the limit, so move the biggest bins out of memory.  Stop once
+    // only the temporary file buffers are left, as they can't be spilled.
+    while (cb->mem > cb->max_mem) {
+        int i, big = 0;
+        for (i = 1; i < cb->n; i++)
+            if (cb->bin[i].m > cb->bin[big].m)
+                big = i;
+        if (!cb->bin[big].m)
+            break;
+        if (spill_bin(cb, big) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads bin x into a[], spilled records first so they stay in input order.
+ * Returns the number of records, or -1 on failure.
+ */
+static int64_t read_bin(collate_bins_t *cb, int x, elem_t *a) {
+    collate_bin_t *bin = &cb->bin[x];
+    int64_t j = 0;
+    size_t off = 0;
+
+    if (bin->spill) {
+        int r = 0;
+        if (tmp_file_end_write(bin->spill) != TMP_SAM_OK
+            || tmp_file_begin_read(bin->spill) != TMP_SAM_OK) {
+            print_error("collate", "Couldn't read temporary file \"%s\"",
+                        bin->spill->name);
+            return -1;
+        }
+        while (j < bin->count && (r = tmp_file_read(bin->spill, a[j].b)) > 0) {
+            a[j].key = hash_X31_Wang(bam_get_qname(a[j].b));
+            j++;
+        }
+        if (r < 0) {
+            print_error("collate", "Error reading temporary file \"%s\"",
+                        bin->spill->name);
+            return -1;
+        }
+    }
+    while (off < bin->l && j < bin->count) {
+        if (read_bin_rec(bin->buf, &off, a[j].b) < 0) {
+            print_error_errno("collate", "Out of memory");
+            return -1;
+        }
+        a[j].key = hash_X31_Wang(bam_get_qname(a[j].b));
+        j++;
+    }
+    if (j != bin->count) {
+        print_error("collate", "Wrong number of reads in bin %d", x);
+        return -1;
     }
 
-    ++count[x];
+    return j;
+}
+
+// A bin being read back and sorted on the thread pool
+typedef struct {
+    collate_bins_t *bins;
+    int x;              // bin number
+    elem_t *a;          // a[max_cnt]
+    int64_t n;          // reads in a[], or -1 on failure
+} collate_job_t;
+
+static void *sort_bin(void *arg) {
+    collate_job_t *job = (collate_job_t *)arg;
+
+    job->n = read_bin(job->bins, job->x, job->a);
+    if (job->n >= 0) {
+        free_bin(&job->bins->bin[job->x]);
+        ks_introsort(bamshuf, job->n, job->a); // Shuffle all the reads
+    }
+
+    return job;
+}
 
+static void free_jobs(collate_job_t *jobs, int njobs, int64_t max_cnt) {
+    int i;
+    int64_t j;
+    for (i = 0; jobs && i < njobs; i++) {
+        if (!jobs[i].a)
+            continue;
+        for (j = 0; j < max_cnt; j++)
+            bam_destroy1(jobs[i].a[j].b);
+        free(jobs[i].a);
+    }
+    free(jobs);
+}
+
+/*
+ * Reads the bins back in order.  With a thread pool, several are read and
+ * sorted at once, but a job is only reused once its bin has been handed
+ * out completely.
+ */
+typedef struct {
+    collate_bins_t *bins;
+    collate_job_t *jobs;
+    int njobs, next, in_flight, x;
+    int64_t max_cnt;
+    hts_tpool *pool;
+    hts_tpool_process *q;
+} collate_merge_t;
+
+static int merge_init(collate_merge_t *m, collate_bins_t *bins,
+                      hts_tpool *pool, int nthreads) {
+    int i;
+    int64_t j;
+
+    memset(m, 0, sizeof(*m));
+    m->bins = bins;
+    m->pool = pool;
+    for (i = 0; i < bins->n; ++i) {
+        // Find biggest count
+        if (m->max_cnt < bins->bin[i].count) m->max_cnt = bins->bin[i].count;
+    }
+
+    m->njobs = pool ? nthreads : 1;
+    m->jobs = calloc(m->njobs, sizeof(*m->jobs));
+    if (!m->jobs) goto mem_fail;
+    for (i = 0; i < m->njobs; ++i) {
+        m->jobs[i].bins = bins;
+        m->jobs[i].a = calloc(m->max_cnt ? m->max_cnt : 1, sizeof(elem_t));
+        if (!m->jobs[i].a) goto mem_fail;
+        for (j = 0; j < m->max_cnt; ++j) {
+            m->jobs[i].a[j].b = bam_init1();
+            if (!m->jobs[i].a[j].b) goto mem_fail;
+        }
+    }
+    if (pool && !(m->q = hts_tpool_process_init(pool, m->njobs, 0))) {
+        print_error_errno("collate", "Error creating thread pool queue");
+        return -1;
+    }
     return 0;
+
+ mem_fail:
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+}
+
+static void merge_destroy(collate_merge_t *m) {
+    if (m->q) hts_tpool_process_destroy(m->q);
+    free_jobs(m->jobs, m->njobs, m->max_cnt);
+    memset(m, 0, sizeof(*m));
+}
+
+// Gets the next bin, sorted, in *job.
+// Returns 1 on success,
+//         0 when all bins have been read,
+//        -1 on failure.
+static int merge_next_bin(collate_merge_t *m, collate_job_t **job) {
+    if (m->x >= m->bins->n)
+        return 0;
+
+    // Slurp in and shuffle the next bins
+    while (m->next < m->bins->n && m->in_flight < m->njobs) {
+        collate_job_t *nj = &m->jobs[m->next % m->njobs];
+        nj->x = m->next++;
+        if (!m->q)
+            sort_bin(nj);
+        else if (hts_tpool_dispatch(m->pool, m->q, sort_bin, nj) < 0)
+            return -1;
+        m->in_flight++;
+    }
+
+    if (m->q) {
+        hts_tpool_result *res = hts_tpool_next_result_wait(m->q);
+        if (!res) return -1;
+        *job = (collate_job_t *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+    } else {
+        *job = &m->jobs[m->x % m->njobs];
+    }
+    m->in_flight--;
+    m->x++;
+
+    return (*job)->n < 0 ? -1 : 1;
 }
 
 
 static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
-                   int is_stdout, const char *output_file, int fast, int store_max, sam_global_args *ga, char *arg_list, int no_pg)
+                   int is_stdout, const char *output_file, int fast, int store_max, size_t max_mem, int tmp_codec, sam_global_args *ga, char *arg_list, int no_pg)
 {
-    samFile *fp, *fpw = NULL, **fpt = NULL;
-    char **fnt = NULL, modew[8];
+    samFile *fp, *fpw = NULL;
+    char modew[8];
     bam1_t *b = NULL;
-    int i, counter, l, r;
+    int l, r;
     sam_hdr_t *h = NULL;
-    int64_t j, max_cnt = 0, *cnt = NULL;
-    elem_t *a = NULL;
+    int64_t j;
+    collate_bins_t bins = { NULL };
+    collate_merge_t merge = { NULL };
+    collate_job_t *job;
     htsThreadPool p = {NULL, 0};
 
     if (ga->nthreads > 0) {
@@ -199,8 +586,8 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
         }
     }
 
-    // Read input, distribute reads pseudo-randomly into n_files temporary
-    // files.
+    // Read input, distribute reads pseudo-randomly into n_files bins,
+    // held in memory or temporary files.
     fp = sam_open_format(fn ? fn : "-", "r", &ga->in);
     if (fp == NULL) {
         print_error_errno("collate", "Cannot open input file \"%s\"", fn);
@@ -264,37 +651,13 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
         goto fail;
     }
 
-    fnt = (char**)calloc(n_files, sizeof(char*));
-    if (!fnt) goto mem_fail;
-    fpt = (samFile**)calloc(n_files, sizeof(samFile*));
-    if (!fpt) goto mem_fail;
-    cnt = (int64_t*)calloc(n_files, 8);
-    if (!cnt) goto mem_fail;
-
-    for (i = counter = 0; i < n_files; ++i) {
-        fnt[i] = (char*)calloc(l + 20, 1);
-        if (!fnt[i]) goto mem_fail;
-        do {
-            sprintf(fnt[i], "%s.%04d.bam", pre, counter++);
-            fpt[i] = sam_open(fnt[i], "wxb1");
-        } while (!fpt[i] && errno == EEXIST);
-        if (fpt[i] == NULL) {
-            print_error_errno("collate", "Cannot open intermediate file \"%s\"", fnt[i]);
-            goto fail;
-        }
-        if (p.pool) hts_set_opt(fpt[i], HTS_OPT_THREAD_POOL, &p);
-        if (sam_hdr_write(fpt[i], h) < 0) {
-            print_error_errno("collate", "Couldn't write header to intermediate file \"%s\"", fnt[i]);
-            goto fail;
-        }
-    }
+    if (init_bins(&bins, n_files, max_mem, pre, tmp_codec) < 0) goto mem_fail;
 
     if (fast) {
-        khash_t(bam_store) *stored = kh_init(bam_store);
-        khiter_t itr;
+        name_index_t stored = { NULL, 0 };
+        int64_t pos;
         bam_list_t list;
         int err = 0;
-        if (!stored) goto mem_fail;
 
         if (store_max < 2) store_max = 2;
 
@@ -303,62 +666,57 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
             err = 1;
             goto fast_fail;
         }
+        if (store_max > INT32_MAX || name_index_init(&stored, store_max) < 0) {
+            fprintf(stderr, "[collate] ERROR: unable to create read name index.\n");
+            err = 1;
+            goto fast_fail;
+        }
 
         while ((r = sam_read1(fp, h, list.items[list.index].b)) >= 0) {
-            int ret;
             bam1_t *b = list.items[list.index].b;
             int readflag = b->core.flag & (BAM_FREAD1 | BAM_FREAD2);
 
             // strictly paired reads only
             if (!(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) && (readflag == BAM_FREAD1 || readflag == BAM_FREAD2)) {
-
-                itr = kh_get(bam_store, stored, bam_get_qname(b));
-
-                if (itr == kh_end(stored)) {
-                    // new read
-                    itr = kh_put(bam_store, stored, bam_get_qname(b), &ret);
-
-                    if (ret > 0) { // okay to go ahead store it
-                        kh_value(stored, itr).bi = store_bam(&list);
-
-                        // see if the next one on the list needs to be written out
-                        if (write_bam_needed(&list)) {
-                            if (write_to_bin_file(list.items[list.index].b, cnt, fpt, fnt, h, n_files) < 0) {
-                                fprintf(stderr, "[collate] ERROR: could not write line.\n");
-                                err = 1;
-                                goto fast_fail;
-                            } else {
-                                mark_bam_as_written(&list);
-
-                                itr = kh_get(bam_store, stored, bam_get_qname(list.items[list.index].b));
-
-                                if (itr != kh_end(stored)) {
-                                    kh_del(bam_store, stored, itr);
-                                } else {
-                                    fprintf(stderr, "[collate] ERROR: stored value not in hash.\n");
-                                    err = 1;
-                                    goto fast_fail;
-                                }
-                            }
+                uint32_t hash = hash_X31_Wang(bam_get_qname(b));
+
+                pos = name_index_get(&stored, &list, bam_get_qname(b), hash);
+
+                if (pos < 0) {
+                    // new read, so store it
+                    name_index_put(&stored, hash, list.index);
+                    store_bam(&list);
+
+                    // see if the next one on the list needs to be written out
+                    if (write_bam_needed(&list)) {
+                        bam1_t *old = list.items[list.index].b;
+                        if (add_to_bin(&bins, old) < 0) {
+                            fprintf(stderr, "[collate] ERROR: could not write line.\n");
+                            err = 1;
+                            goto fast_fail;
+                        }
+                        mark_bam_as_written(&list);
+
+                        pos = name_index_get(&stored, &list, bam_get_qname(old),
+                                             hash_X31_Wang(bam_get_qname(old)));
+                        if (pos >= 0) {
+                            name_index_del(&stored, pos);
+                        } else {
+                            fprintf(stderr, "[collate] ERROR: stored value not in hash.\n");
+                            err = 1;
+                            goto fast_fail;
                         }
-                    } else if (ret == 0) {
-                        fprintf(stderr, "[collate] ERROR: value already in hash.\n");
-                        err = 1;
-                        goto fast_fail;
-                    } else {
-                        fprintf(stderr, "[collate] ERROR: unable to store in hash.\n");
-                        err = 1;
-                        goto fast_fail;
                     }
                 } else { // we have a match
                     // write out the reads in R1 R2 order
+                    bam_item_t *bi = &list.items[stored.t[pos].slot];
                     bam1_t *r1, *r2;
 
                     if (b->core.flag & BAM_FREAD1) {
                         r1 = b;
-                        r2 = kh_value(stored, itr).bi->b;
+                        r2 = bi->b;
                     } else {
-                        r1 = kh_value(stored, itr).bi->b;
+                        r1 = bi->b;
                         r2 = b;
                     }
 
@@ -377,8 +735,8 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
                     mark_bam_as_written(&list);
 
                     // remove stored read
-                    kh_value(stored, itr).bi->written = 1;
-                    kh_del(bam_store, stored, itr);
+                    bi->written = 1;
+                    name_index_del(&stored, pos);
                 }
             }
         }
@@ -387,38 +745,25 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
             if (write_bam_needed(&list)) {
                 bam1_t *b = list.items[list.index].b;
 
-                if (write_to_bin_file(b, cnt, fpt, fnt, h, n_files)) {
+                if (add_to_bin(&bins, b) < 0) {
                     err = 1;
                     goto fast_fail;
-                } else {
-                    itr = kh_get(bam_store, stored, bam_get_qname(b));
-                    kh_del(bam_store, stored, itr);
                 }
             }
         }
 
  fast_fail:
-        if (err) {
-            for (itr = kh_begin(stored); itr != kh_end(stored); ++itr) {
-                if (kh_exist(stored, itr)) {
-                    kh_del(bam_store, stored, itr);
-                }
-            }
-
-            kh_destroy(bam_store, stored);
-            destroy_bam_list(&list);
+        free(stored.t);
+        destroy_bam_list(&list);
+        if (err)
             goto fail;
-        } else {
-            kh_destroy(bam_store, stored);
-            destroy_bam_list(&list);
-        }
 
     } else {
         b = bam_init1();
         if (!b) goto mem_fail;
 
         while ((r = sam_read1(fp, h, b)) >= 0) {
-            if (write_to_bin_file(b, cnt, fpt, fnt, h, n_files)) {
+            if (add_to_bin(&bins, b) < 0) {
                 bam_destroy1(b);
                 goto fail;
             }
@@ -431,68 +776,28 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
         fprintf(stderr, "Error reading input file\n");
         goto fail;
     }
-    for (i = 0; i < n_files; ++i) {
-        // Close split output
-        r = sam_close(fpt[i]);
-        fpt[i] = NULL;
-        if (r < 0) {
-            fprintf(stderr, "Error on closing '%s'\n", fnt[i]);
-            return 1;
-        }
-
-        // Find biggest count
-        if (max_cnt < cnt[i]) max_cnt = cnt[i];
-    }
-    free(fpt);
-    fpt = NULL;
     sam_close(fp);
     fp = NULL;
 
-    // merge
-    a = malloc(max_cnt * sizeof(elem_t));
-    if (!a) goto mem_fail;
-    for (j = 0; j < max_cnt; ++j) {
-        a[j].b = bam_init1();
-        if (!a[j].b) { max_cnt = j; goto mem_fail; }
-    }
-
-    for (i = 0; i < n_files; ++i) {
-        int64_t c = cnt[i];
-        fp = sam_open_format(fnt[i], "r", &ga->in);
-        if (NULL == fp) {
-            print_error_errno("collate", "Couldn't open \"%s\"", fnt[i]);
-            goto fail;
-        }
-        if (p.pool) hts_set_opt(fp, HTS_OPT_THREAD_POOL, &p);
-        sam_hdr_destroy(sam_hdr_read(fp)); // Skip over header
-
-        // Slurp in one of the split files
-        for (j = 0; j < c; ++j) {
-            if (sam_read1(fp, h, a[j].b) < 0) {
-                fprintf(stderr, "Error reading '%s'\n", fnt[i]);
-                goto fail;
-            }
-            a[j].key = hash_X31_Wang(bam_get_qname(a[j].b));
-        }
-        sam_close(fp);
-        unlink(fnt[i]);
-        free(fnt[i]);
-        fnt[i] = NULL;
-
-        ks_introsort(bamshuf, c, a); // Shuffle all the reads
-
+    // merge.  The bins are independent, so with threads several are read
+    // back and sorted at once, and written out in bin order.
+    if (merge_init(&merge, &bins, p.pool, ga->nthreads) < 0)
+        goto fail;
+    while ((r = merge_next_bin(&merge, &job)) > 0) {
         // Write them out again
-        for (j = 0; j < c; ++j) {
-            if (sam_write1(fpw, h, a[j].b) < 0) {
+        for (j = 0; j < job->n; ++j) {
+            if (sam_write1(fpw, h, job->a[j].b) < 0) {
                 print_error_errno("collate", "Error writing to output");
                 goto fail;
             }
         }
     }
+    if (r < 0)
+        goto fail;
 
+    merge_destroy(&merge);
     sam_hdr_destroy(h);
-    for (j = 0; j < max_cnt; ++j) bam_destroy1(a[j].b);
-    free(a); free(fnt); free(cnt);
+    destroy_bins(&bins);
     sam_global_args_free(ga);
     if (sam_close(fpw) < 0) {
         fprintf(stderr, "Error on closing output\n");
@@ -509,22 +814,118 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
     if (fp) sam_close(fp);
     if (fpw) sam_close(fpw);
     if (h) sam_hdr_destroy(h);
-    for (i = 0; i < n_files; ++i) {
-        if (fnt) free(fnt[i]);
-        if (fpt && fpt[i]) sam_close(fpt[i]);
-    }
-    if (a) {
-        for (j = 0; j < max_cnt; ++j) bam_destroy1(a[j].b);
-        free(a);
-    }
-    free(fnt);
-    free(fpt);
-    free(cnt);
+    merge_destroy(&merge);
+    destroy_bins(&bins);
     if (p.pool) hts_tpool_destroy(p.pool);
     sam_global_args_free(ga);
     return 1;
 }
 
+/*
+ * Collation for a later stage in the same process.  The whole input is
+ * distributed into the bins when opened, and the bins are handed out
+ * again by collate_reader_read() one record at a time.
+ */
+struct collate_reader {
+    sam_hdr_t *h;
+    collate_bins_t bins;
+    collate_merge_t merge;
+    collate_job_t *job;     // bin being handed out
+    int64_t j;              // next record in job
+};
+
+collate_reader *collate_reader_open(const char *fn, const htsFormat *in_fmt,
+                                    const char *prefix, size_t max_mem,
+                                    htsThreadPool *p) {
+    collate_reader *cr = calloc(1, sizeof(*cr));
+    samFile *fp = NULL;
+    bam1_t *b = NULL;
+    int r;
+
+    if (!cr) {
+        print_error_errno("collate", "Out of memory");
+        return NULL;
+    }
+
+    fp = sam_open_format(fn, "r", in_fmt);
+    if (fp == NULL) {
+        print_error_errno("collate", "Cannot open input file \"%s\"", fn);
+        goto fail;
+    }
+    if (p && p->pool) hts_set_opt(fp, HTS_OPT_THREAD_POOL, p);
+
+    cr->h = sam_hdr_read(fp);
+    if (cr->h == NULL) {
+        print_error("collate", "Couldn't read header for \"%s\"", fn);
+        goto fail;
+    }
+
+    if (init_bins(&cr->bins, 64, max_mem, prefix, TMP_SAM_CODEC_LZ4) < 0
+        || !(b = bam_init1())) {
+        print_error_errno("collate", "Out of memory");
+        goto fail;
+    }
+    while ((r = sam_read1(fp, cr->h, b)) >= 0) {
+        if (add_to_bin(&cr->bins, b) < 0)
+            goto fail;
+    }
+    if (r < -1) {
+        print_error("collate", "Error reading input file \"%s\"", fn);
+        goto fail;
+    }
+    bam_destroy1(b);
+    b = NULL;
+    sam_close(fp);
+    fp = NULL;
+
+    if (merge_init(&cr->merge, &cr->bins, p ? p->pool : NULL,
+                   p && p->pool ? hts_tpool_size(p->pool) : 1) < 0)
+        goto fail;
+
+    return cr;
+
+ fail:
+    bam_destroy1(b);
+    if (fp) sam_close(fp);
+    collate_reader_close(cr);
+    return NULL;
+}
+
+sam_hdr_t *collate_reader_header(collate_reader *cr) {
+    return cr->h;
+}
+
+int collate_reader_read(void *data, sam_hdr_t *h, bam1_t *b) {
+    collate_reader *cr = (collate_reader *)data;
+    bam1_t *a, tmp;
+    int r;
+
+    while (!cr->job || cr->j >= cr->job->n) {
+        if ((r = merge_next_bin(&cr->merge, &cr->job)) <= 0) {
+            cr->job = NULL;
+            return r < 0 ? -2 : -1;
+        }
+        cr->j = 0;
+    }
+
+    // Hand the record over by swapping it with b, so it isn't copied
+    a = cr->job->a[cr->j++].b;
+    tmp = *b;
+    *b = *a;
+    *a = tmp;
+
+    return b->l_data;
+}
+
+void collate_reader_close(collate_reader *cr) {
+    if (!cr)
+        return;
+    merge_destroy(&cr->merge);
+    destroy_bins(&cr->bins);
+    sam_hdr_destroy(cr->h);
+    free(cr);
+}
+
 static int usage(FILE *fp, int n_files, int reads_store) {
     fprintf(fp,
             "Usage: samtools collate [options...] <in.bam> [<prefix>]\n\n"
@@ -536,8 +937,12 @@ static int usage(FILE *fp, int n_files, int reads_store) {
             "      -r       Working reads stored (with -f) [%d]\n" // reads_store
             "      -l INT   Compression level [%d]\n" // DEF_CLEVEL
             "      -n INT   Number of temporary files [%d]\n" // n_files
+            "      -m INT   Memory for holding reads, suffix K/M/G recognized\n"
+            "               before using temporary files [768M]\n"
             "      -T PREFIX\n"
-            "               Write temporary files to PREFIX.nnnn.bam\n"
+            "               Write temporary files to PREFIX.nnnn.*\n"
+            "      --tmp-codec STR\n"
+            "               Temporary file compression: lz4, lz4-dict or deflate [lz4]\n"
             "      --no-PG  do not add a PG line\n",
             reads_store, DEF_CLEVEL, n_files);
 
@@ -600,16 +1005,19 @@ char *generate_prefix(const char *out_fn) {
 int main_bamshuf(int argc, char *argv[])
 {
     int c, n_files = 64, clevel = DEF_CLEVEL, is_stdout = 0, is_un = 0, fast_coll = 0, reads_store = 10000, ret, pre_mem = 0, no_pg = 0;
+    int tmp_codec = TMP_SAM_CODEC_LZ4;
+    size_t max_mem = DEF_MAX_MEM;
     const char *output_file = NULL;
     char *prefix = NULL, *arg_list = NULL;
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 0, 0, 0, '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 0, 0, 0, '@', '-', '-'),
         {"no-PG", no_argument, NULL, 1},
+        {"tmp-codec", required_argument, NULL, 2},
         { NULL, 0, NULL, 0 }
     };
 
-    while ((c = getopt_long(argc, argv, "n:l:uOo:@:fr:T:", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "n:l:uOo:@:fr:T:m:", lopts, NULL)) >= 0) {
         switch (c) {
         case 'n': n_files = atoi(optarg); break;
         case 'l': clevel = atoi(optarg); break;
@@ -619,7 +1027,19 @@ int main_bamshuf(int argc, char *argv[])
         case 'f': fast_coll = 1; break;
         case 'r': reads_store = atoi(optarg); break;
         case 'T': prefix = optarg; break;
+        case 'm':
+            if (parse_mem_size(optarg, &max_mem) < 0) {
+                print_error("collate", "invalid -m value \"%s\"", optarg);
+                return 1;
+            }
+            break;
         case 1: no_pg = 1; break;
+        case 2:
+            if ((tmp_codec = tmp_file_codec(optarg)) < 0) {
+                print_error("collate", "unknown --tmp-codec \"%s\"", optarg);
+                return 1;
+            }
+            break;
         default:  if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
                   /* else fall-through */
         case '?': return usage(stderr, n_files, reads_store);
@@ -652,7 +1072,7 @@ int main_bamshuf(int argc, char *argv[])
     }
 
     ret = bamshuf(argv[optind], n_files, prefix, clevel, is_stdout,
-                   output_file, fast_coll, reads_store, &ga, arg_list, no_pg);
+                   output_file, fast_coll, reads_store, max_mem, tmp_codec, &ga, arg_list, no_pg);
 
     if (pre_mem) free(prefix);
     free(arg_list);
@@ -74,6 +74,7 @@ int main_consensus(int argc, char *argv[]);
 int main_reference(int argc, char *argv[]);
 int main_reset(int argc, char *argv[]);
 int main_cram_size(int argc, char *argv[]);
+int main_pipeline(int argc, char *argv[]);
 
 const char *samtools_version(void)
 {
@@ -184,6 +185,7 @@ static void usage(FILE *fp)
 "     import         Converts FASTA or FASTQ files to SAM/BAM/CRAM\n"
 "     reference      Generates a reference from aligned data\n"
 "     reset          Reverts aligner changes in reads\n"
+"     pipeline       run view, sort and markdup as one process\n"
 "\n"
 "  -- Statistics\n"
 "     bedcov         read depth per BED region\n"
@@ -299,6 +301,7 @@ int main(int argc, char *argv[])
         printf("%s+htslib-%s\n", samtools_version(), hts_version());
     }
     else if (strcmp(argv[1], "reset") == 0) ret = main_reset(argc-1, argv+1);
+    else if (strcmp(argv[1], "pipeline") == 0) ret = main_pipeline(argc-1, argv+1);
     else {
         fprintf(stderr, "[main] unrecognized command '%s'\n", argv[1]);
         return 1;
@@ -31,6 +31,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "htslib/kstring.h"
 #include "htslib/sam.h"
 #include "htslib/thread_pool.h"
@@ -72,6 +73,389 @@ static int incr_rcnt(void *data, const bam1_t *b, bam_pileup_cd *cd) {
     return 0;
 }
 
+/* Parses a BED line in str, returning 0 and setting *tid, *beg and *end,
+ * 1 if the line is to be skipped or -1 if it is invalid. */
+static int parse_bed_line(kstring_t *str, sam_hdr_t *h, int *tid,
+                          int64_t *beg, int64_t *end)
+{
+    char *p, *q;
+    int num;
+
+    if (str->l == 0 || *str->s == '#') return 1; /* empty or comment line */
+    /* Track and browser lines.  Also look for a trailing *space* in
+       case someone has badly-chosen a chromosome name (it would
+       be followed by a tab in that case). */
+    if (strncmp(str->s, "track ", 6) == 0) return 1;
+    if (strncmp(str->s, "browser ", 8) == 0) return 1;
+    for (p = q = str->s; *p && !isspace(*p); ++p);
+    if (*p == 0) return -1;
+    char c = *p;
+    *p = 0; *tid = bam_name2id(h, q); *p = c;
+    if (*tid < 0) return -1;
+    num = sscanf(p + 1, "%"SCNd64" %"SCNd64, beg, end);
+    if (num < 2 || *end < *beg) return -1;
+    return 0;
+}
+
+/*
+ * Single pass mode, used when only base and read counts are needed.
+ *
+ * All the BED targets are read first.  For each input the targets are
+ * merged into one multi-region iterator, so every contig is streamed once
+ * and reads are not fetched again for overlapping targets.  Targets on a
+ * contig are sorted by start and swept forward with the reads, keeping
+ * only those still open at the current read in an active list, so a
+ * single long target does not make every read rescan the ones after it.
+ * Each read credits its aligned bases directly to every overlapping
+ * target, without building a pileup.
+ */
+typedef struct {
+    size_t line;        // offset of the line in the BED text
+    int tid;
+    int64_t beg, end;
+} bed_target_t;
+
+typedef struct {
+    bed_target_t *t;
+    int n, m;
+    kstring_t text;     // all the valid lines, NUL separated
+    int *order;         // targets sorted by tid and start
+    int *tid_start;     // order[tid_start[tid]..tid_start[tid+1]) are on tid
+    int n_tid;
+} bed_targets_t;
+
+static bed_targets_t *bed_targets_cmp_data;
+static int bed_target_cmp(const void *av, const void *bv)
+{
+    const bed_target_t *a = &bed_targets_cmp_data->t[*(const int *)av];
+    const bed_target_t *b = &bed_targets_cmp_data->t[*(const int *)bv];
+    if (a->tid != b->tid) return a->tid < b->tid ? -1 : 1;
+    if (a->beg != b->beg) return a->beg < b->beg ? -1 : 1;
+    return *(const int *)av - *(const int *)bv;
+}
+
+static int bed_targets_index(bed_targets_t *bt)
+{
+    int k, tid;
+    bt->order = malloc((bt->n ? bt->n : 1) * sizeof(*bt->order));
+    bt->tid_start = calloc(bt->n_tid + 1, sizeof(*bt->tid_start));
+    if (!bt->order || !bt->tid_start)
+        return -1;
+
+    for (k = 0; k < bt->n; k++)
+        bt->order[k] = k;
+    bed_targets_cmp_data = bt;
+    qsort(bt->order, bt->n, sizeof(*bt->order), bed_target_cmp);
+
+    for (k = 0, tid = 0; tid <= bt->n_tid; tid++) {
+        bt->tid_start[tid] = k;
+        while (k < bt->n && bt->t[bt->order[k]].tid == tid)
+            k++;
+    }
+    return 0;
+}
+
+// Merged non-empty targets of each contig as a multi-region list
+static hts_reglist_t *bed_targets_reglist(bed_targets_t *bt, sam_hdr_t *h,
+                                          int *n_reg)
+{
+    int tid, k, n = 0;
+    hts_reglist_t *reg = calloc(bt->n_tid ? bt->n_tid : 1, sizeof(*reg));
+    if (!reg)
+        return NULL;
+
+    for (tid = 0; tid < bt->n_tid && tid < sam_hdr_nref(h); tid++) {
+        int first = bt->tid_start[tid], last = bt->tid_start[tid+1], m = 0;
+        hts_pair_pos_t *iv;
+        if (first == last)
+            continue;
+        if (!(iv = malloc((last - first) * sizeof(*iv)))) {
+            hts_reglist_free(reg, n);
+            return NULL;
+        }
+        for (k = first; k < last; k++) {
+            bed_target_t *t = &bt->t[bt->order[k]];
+            if (t->beg >= t->end)
+                continue;
+            if (m && t->beg <= iv[m-1].end) {
+                if (iv[m-1].end < t->end)
+                    iv[m-1].end = t->end;
+            } else {
+                iv[m].beg = t->beg;
+                iv[m].end = t->end;
+                m++;
+            }
+        }
+        if (!m) {
+            free(iv);
+            continue;
+        }
+        reg[n].reg = sam_hdr_tid2name(h, tid);
+        reg[n].tid = tid;
+        reg[n].intervals = iv;
+        reg[n].count = m;
+        reg[n].min_beg = iv[0].beg;
+        reg[n].max_end = iv[m-1].end;
+        n++;
+    }
+
+    *n_reg = n;
+    return reg;
+}
+
+// Number of bases of b aligned within [beg,end)
+static int64_t bases_in_target(const bam1_t *b, int64_t beg, int64_t end,
+                               int count_DN)
+{
+    const uint32_t *cig = bam_get_cigar(b);
+    int64_t p = b->core.pos, n = 0;
+    int j;
+
+    for (j = 0; j < b->core.n_cigar && p < end; j++) {
+        int op = bam_cigar_op(cig[j]);
+        int64_t len = bam_cigar_oplen(cig[j]);
+        if (!(bam_cigar_type(op) & 2))
+            continue;   // doesn't consume the reference
+        if ((op != BAM_CDEL && op != BAM_CREF_SKIP) || count_DN) {
+            int64_t s = p > beg ? p : beg, e = p + len < end ? p + len : end;
+            if (e > s)
+                n += e - s;
+        }
+        p += len;
+    }
+    return n;
+}
+
+// Credits the reads from aux->iter to the targets they overlap
+static int bed_targets_sweep(bed_targets_t *bt, aux_t *aux, bam1_t *b,
+                             int count_DN, int64_t *cnt, int64_t *rcnt)
+{
+    int ret, i, j, next = 0, last = 0, cur_tid = -1, n_active = 0;
+    int *active = malloc((bt->n ? bt->n : 1) * sizeof(*active));
+    if (!active)
+        return -1;
+
+    while ((ret = read_bam(aux, b)) >= 0) {
+        int64_t pos = b->core.pos, endpos;
+        if (b->core.flag & BAM_FUNMAP) continue; // as the pileup would
+        if (b->core.tid < 0 || b->core.tid >= bt->n_tid) continue;
+        if (b->core.tid != cur_tid) {
+            cur_tid = b->core.tid;
+            next = bt->tid_start[cur_tid];
+            last = bt->tid_start[cur_tid+1];
+            n_active = 0;
+        }
+        // Targets which end before this read also end before all later ones
+        for (i = j = 0; i < n_active; i++)
+            if (bt->t[active[i]].end > pos)
+                active[j++] = active[i];
+        n_active = j;
+        endpos = bam_endpos(b);
+        for (; next < last && bt->t[bt->order[next]].beg < endpos; next++) {
+            int t = bt->order[next];
+            if (bt->t[t].end > pos && bt->t[t].beg < bt->t[t].end)
+                active[n_active++] = t;
+        }
+        for (i = 0; i < n_active; i++) {
+            int t = active[i];
+            if (bt->t[t].beg >= endpos)
+                continue;   // added for an earlier, longer read
+            rcnt[t]++;
+            cnt[t] += bases_in_target(b, bt->t[t].beg,
+                                                   bt->t[t].end, count_DN);
+        }
+    }
+    free(active);
+    return ret < -1 ? -1 : 0;
+}
+
+/* Counts for one input into cnt[target] and rcnt[target].
+ * Returns 0 on success, -1 on error. */
+static int bed_targets_count(bed_targets_t *bt, aux_t *aux, hts_idx_t *idx,
+                             int count_DN, int64_t *cnt, int64_t *rcnt)
+{
+    int n_reg = 0, tid, k, ret = 0;
+    hts_reglist_t *reg = bed_targets_reglist(bt, aux->header, &n_reg);
+    bam1_t *b = bam_init1();
+    if (!reg || !b) {
+        free(reg);
+        bam_destroy1(b);
+        return -1;
+    }
+    if (!n_reg) {
+        free(reg);
+        bam_destroy1(b);
+        return 0;
+    }
+
+    // The iterator takes ownership of reg
+    if ((aux->iter = sam_itr_regions(idx, aux->header, reg, n_reg)) != NULL) {
+        ret = bed_targets_sweep(bt, aux, b, count_DN, cnt, rcnt);
+    } else {
+        // No multi-region support for this format; query each contig
+        for (tid = 0; tid < bt->n_tid && ret == 0; tid++) {
+            int64_t beg = INT64_MAX, end = 0;
+            for (k = bt->tid_start[tid]; k < bt->tid_start[tid+1]; k++) {
+                bed_target_t *t = &bt->t[bt->order[k]];
+                if (t->beg >= t->end) continue;
+                if (beg > t->beg) beg = t->beg;
+                if (end < t->end) end = t->end;
+            }
+            if (beg >= end)
+                continue;
+            if (aux->iter) hts_itr_destroy(aux->iter);
+            if (!(aux->iter = sam_itr_queryi(idx, tid, beg, end)))
+                ret = -1;
+            else
+                ret = bed_targets_sweep(bt, aux, b, count_DN, cnt, rcnt);
+        }
+    }
+
+    bam_destroy1(b);
+    return ret;
+}
+
+/*
+ * With several threads, each worker takes whole input files from a shared
+ * counter.  The targets are read-only by then and each file has its own
+ * column of the results matrix, so nothing else needs locking.
+ */
+typedef struct {
+    bed_targets_t *bt;
+    aux_t **aux;
+    hts_idx_t **idx;
+    int n, count_DN;
+    int64_t *cnt, *rcnt;    // n columns of bt->n targets
+    int next, failed;
+    pthread_mutex_t lock;
+} bedcov_work_t;
+
+static void *bedcov_worker(void *data)
+{
+    bedcov_work_t *w = (bedcov_work_t *)data;
+    size_t nt = w->bt->n;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        i = w->failed ? w->n : w->next++;
+        pthread_mutex_unlock(&w->lock);
+        if (i >= w->n)
+            break;
+        if (bed_targets_count(w->bt, w->aux[i], w->idx[i], w->count_DN,
+                              w->cnt + i*nt, w->rcnt + i*nt) < 0) {
+            pthread_mutex_lock(&w->lock);
+            w->failed = 1;
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    return NULL;
+}
+
+static int bedcov_count_all(bedcov_work_t *w, int nthreads)
+{
+    pthread_t *tid;
+    int i, n_started = 0;
+
+    if (nthreads > w->n)
+        nthreads = w->n;
+    if (!(tid = malloc((nthreads > 0 ? nthreads : 1) * sizeof(*tid))))
+        return -1;
+    if (pthread_mutex_init(&w->lock, NULL) != 0) {
+        free(tid);
+        return -1;
+    }
+    for (i = 0; i < nthreads && nthreads > 1; i++) {
+        if (pthread_create(&tid[i], NULL, bedcov_worker, w) != 0)
+            break;
+        n_started++;
+    }
+    if (n_started == 0)
+        bedcov_worker(w);
+    for (i = 0; i < n_started; i++)
+        pthread_join(tid[i], NULL);
+    pthread_mutex_destroy(&w->lock);
+    free(tid);
+    return w->failed ? -1 : 0;
+}
+
+static int bedcov_single_pass(kstream_t *ks, aux_t **aux, hts_idx_t **idx,
+                              int n, int skip_DN, int do_rcount, int nthreads)
+{
+    bed_targets_t bt = {0};
+    kstring_t str = KS_INITIALIZE;
+    int64_t *cnt = NULL, *rcnt = NULL;
+    int dret, i, k, status = 0;
+    bedcov_work_t w;
+
+    bt.n_tid = sam_hdr_nref(aux[0]->header);
+    while (ks_getuntil(ks, KS_SEP_LINE, &str, &dret) >= 0) {
+        bed_target_t t;
+        int r = parse_bed_line(&str, aux[0]->header, &t.tid, &t.beg, &t.end);
+        if (r > 0) continue;
+        if (r < 0) {
+            fprintf(stderr, "Errors in BED line '%s'\n", str.s);
+            status = 2;
+            continue;
+        }
+        if (bt.n == bt.m) {
+            int m = bt.m ? 2*bt.m : 1024;
+            bed_target_t *tmp = realloc(bt.t, m * sizeof(*tmp));
+            if (!tmp) goto nomem;
+            bt.t = tmp;
+            bt.m = m;
+        }
+        t.line = bt.text.l;
+        if (kputsn(str.s, str.l, &bt.text) < 0 || kputc('\0', &bt.text) < 0)
+            goto nomem;
+        bt.t[bt.n++] = t;
+    }
+
+    if (bed_targets_index(&bt) < 0)
+        goto nomem;
+    cnt = calloc((size_t)bt.n * n + 1, sizeof(*cnt));
+    rcnt = calloc((size_t)bt.n * n + 1, sizeof(*rcnt));
+    if (!cnt || !rcnt)
+        goto nomem;
+
+    w = (bedcov_work_t) { &bt, aux, idx, n, !skip_DN, cnt, rcnt, 0, 0 };
+    if (bedcov_count_all(&w, nthreads) < 0) {
+        print_error("bedcov", "error reading from input file");
+        status = 2;
+        goto out;
+    }
+
+    for (k = 0; k < bt.n; k++) {
+        kputs(bt.text.s + bt.t[k].line, ks_clear(&str));
+        for (i = 0; i < n; ++i) {
+            kputc('\t', &str);
+            kputl(cnt[(size_t)i*bt.n+k], &str);
+        }
+        if (do_rcount) {
+            for (i = 0; i < n; ++i) {
+                kputc('\t', &str);
+                kputl(rcnt[(size_t)i*bt.n+k], &str);
+            }
+        }
+        puts(str.s);
+    }
+
+ out:
+    free(cnt);
+    free(rcnt);
+    free(bt.t);
+    free(bt.order);
+    free(bt.tid_start);
+    ks_free(&bt.text);
+    ks_free(&str);
+    return status;
+
+ nomem:
+    print_error_errno("bedcov", "failed to allocate memory");
+    status = 2;
+    goto out;
+}
+
 int main_bedcov(int argc, char *argv[])
 {
     gzFile fp;
@@ -92,11 +476,11 @@ int main_bedcov(int argc, char *argv[])
         {"min-MQ", required_argument, NULL, 'Q'},
         {"min-mq", required_argument, NULL, 'Q'},
         {"max-depth", required_argument, NULL, 'd'+1000},
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '-'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '@', '-', '-'),
         { NULL, 0, NULL, 0 }
     };
 
-    while ((c = getopt_long(argc, argv, "Q:Xg:G:jd:Hc", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "Q:Xg:G:jd:Hc@:", lopts, NULL)) >= 0) {
         switch (c) {
         case 'Q': min_mapQ = atoi(optarg); break;
         case 'X': has_index_file = 1; break;
@@ -141,7 +525,7 @@ int main_bedcov(int argc, char *argv[])
                         "                          including this value will be displayed in a separate column\n");
         fprintf(stderr, "      -c                  add an additional column showing read count\n");
         fprintf(stderr, "      -H                  print a comment/header line with column information.\n");
-        sam_global_opt_help(stderr, "-.--.--.");
+        sam_global_opt_help(stderr, "-.--.@-.");
         return 1;
     }
     if (has_index_file) {
@@ -173,6 +557,15 @@ int main_bedcov(int argc, char *argv[])
             fprintf(stderr, "ERROR: fail to open index BAM file '%s'\n", argv[i+optind+1]);
             return 2;
         }
+        // Only the alignment itself is used, never the bases or qualities
+        if (hts_set_opt(aux[i]->fp, CRAM_OPT_REQUIRED_FIELDS,
+                        SAM_FLAG | SAM_RNAME | SAM_POS | SAM_CIGAR
+                        | (min_mapQ ? SAM_MAPQ : 0))
+            || hts_set_opt(aux[i]->fp, CRAM_OPT_DECODE_MD, 0)) {
+            fprintf(stderr, "ERROR: failed to set CRAM options for '%s'\n",
+                    argv[i+optind+1]);
+            return 2;
+        }
         // TODO bgzf_set_cache_size(aux[i]->fp, 20);
         aux[i]->header = sam_hdr_read(aux[i]->fp);
         if (aux[i]->header == NULL) {
@@ -215,25 +608,18 @@ int main_bedcov(int argc, char *argv[])
     ks = ks_init(fp);
     n_plp = calloc(n, sizeof(int));
     plp = calloc(n, sizeof(bam_pileup1_t*));
-    while (ks_getuntil(ks, KS_SEP_LINE, &str, &dret) >= 0) {
-        char *p, *q;
-        int tid, pos, num = 0;
+    // The pileup is only needed for per-base depths or a depth limit
+    if (min_depth < 0 && max_depth == DEFAULT_DEPTH)
+        status = bedcov_single_pass(ks, aux, idx, n, skip_DN, do_rcount,
+                                    ga.nthreads);
+    else while (ks_getuntil(ks, KS_SEP_LINE, &str, &dret) >= 0) {
+        int tid, pos;
         int64_t beg = 0, end = 0;
         bam_mplp_t mplp;
 
-        if (str.l == 0 || *str.s == '#') continue; /* empty or comment line */
-        /* Track and browser lines.  Also look for a trailing *space* in
-           case someone has badly-chosen a chromosome name (it would
-           be followed by a tab in that case). */
-        if (strncmp(str.s, "track ", 6) == 0) continue;
-        if (strncmp(str.s, "browser ", 8) == 0) continue;
-        for (p = q = str.s; *p && !isspace(*p); ++p);
-        if (*p == 0) goto bed_error;
-        char c = *p;
-        *p = 0; tid = bam_name2id(aux[0]->header, q); *p = c;
-        if (tid < 0) goto bed_error;
-        num = sscanf(p + 1, "%"SCNd64" %"SCNd64, &beg, &end);
-        if (num < 2 || end < beg) goto bed_error;
+        ret = parse_bed_line(&str, aux[0]->header, &tid, &beg, &end);
+        if (ret > 0) continue;
+        if (ret < 0) goto bed_error;
 
         for (i = 0; i < n; ++i) {
             if (aux[i]->iter) hts_itr_destroy(aux[i]->iter);
@@ -30,6 +30,13 @@ DEALINGS IN THE SOFTWARE.  */
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include <zlib.h>
 #include "bedidx.h"
 
@@ -52,6 +59,9 @@ KSORT_INIT_STATIC(hts_pair_pos_t, hts_pair_pos_t, lt_pair_pos)
  * @field n            actual number of elements contained by a
  * @field m            number of allocated elements to a (n <= m)
  * @field *idx         index array for computing the minimum offset
+ * @field *tree        largest end in each subtree of the implicit interval
+ *                     tree over a, or NULL if the intervals do not overlap
+ * @field tree_level   level of the tree root
  */
 typedef struct {
     int n, m;
@@ -59,6 +69,8 @@ typedef struct {
     int *idx;
     int filter;
     hts_pos_t max_idx;
+    hts_pos_t *tree;
+    int tree_level;
 } bed_reglist_t;
 
 #include "htslib/khash.h"
@@ -97,11 +109,51 @@ static void bed_print(void *reg_hash) {
 }
 #endif
 
+/* Builds an implicit augmented interval tree over the sorted intervals, as
+ * used by cgranges.  The intervals stay as they are in a, in order, and the
+ * tree is laid over their indices: index i is a node at level k when its
+ * lowest k bits are set, with children i - 2^(k-1) and i + 2^(k-1).  tree[i]
+ * holds the largest end in the subtree under i, so whole subtrees ending
+ * before a query can be skipped.
+ */
+static int bed_index_tree(bed_reglist_t *regions)
+{
+    hts_pair_pos_t *a = regions->a;
+    int64_t n = regions->n, i, last_i = 0;
+    hts_pos_t last = 0, *tree;
+    int k;
+
+    if (n == 0)
+        return 0;
+    if ((tree = malloc(n * sizeof(*tree))) == NULL)
+        return -1;
+
+    for (i = 0; i < n; i += 2)
+        last_i = i, last = tree[i] = a[i].end;
+    for (k = 1; 1LL << k <= n; ++k) {
+        int64_t x = 1LL << (k - 1), i0 = (x << 1) - 1, step = x << 2;
+        for (i = i0; i < n; i += step) {
+            hts_pos_t el = tree[i - x];
+            hts_pos_t er = i + x < n ? tree[i + x] : last;
+            hts_pos_t e = a[i].end;
+            e = MAX(e, el);
+            tree[i] = MAX(e, er);
+        }
+        last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+        if (last_i < n && tree[last_i] > last)
+            last = tree[last_i];
+    }
+
+    regions->tree = tree;
+    regions->tree_level = k - 1;
+    return 0;
+}
+
 static int bed_index_core(bed_reglist_t *regions)
 {
-    int i, *idx = NULL;
+    int i, *idx = NULL, overlaps = 0;
     size_t idx_size = 0;
-    hts_pos_t last_end = 0;
+    hts_pos_t last_end = 0, max_end = -1;
     hts_pair_pos_t *a = regions->a;
 
     // Construct a linear index on regions, to allow rapid lookup of
@@ -110,6 +162,10 @@ static int bed_index_core(bed_reglist_t *regions)
         hts_pos_t beg = a[i].beg >= 0 ? a[i].beg >> LIDX_SHIFT : 0;
         hts_pos_t end = a[i].end >= 0 ? a[i].end >> LIDX_SHIFT : 0;
         hts_pos_t j;
+        if (a[i].beg < max_end)
+            overlaps = 1;
+        if (a[i].end > max_end)
+            max_end = a[i].end;
         if (end < last_end)
             continue;  // Can happen for a containment
         if (end + 1 >= SIZE_MAX / sizeof(*idx)) { // Ensure no overflow
@@ -132,6 +188,12 @@ static int bed_index_core(bed_reglist_t *regions)
     }
     regions->idx = idx;
     regions->max_idx = last_end;
+
+    // Overlapping intervals can leave the linear scan from the index wading
+    // through many that end too early, so search those with a tree instead.
+    if (overlaps)
+        return bed_index_tree(regions);
+
     return 0;
 }
 
@@ -141,10 +203,10 @@ static int bed_index(reghash_t *h)
     for (k = 0; k < kh_end(h); ++k) {
         if (kh_exist(h, k)) {
             bed_reglist_t *p = &kh_val(h, k);
-            if (p->idx) {
-                free(p->idx);
-                p->idx = NULL;
-            }
+            free(p->idx);
+            p->idx = NULL;
+            free(p->tree);
+            p->tree = NULL;
             ks_introsort(hts_pair_pos_t, p->n, p->a);
             if (bed_index_core(p) != 0) {
                 return -1;
@@ -164,10 +226,47 @@ static int bed_minoff(const bed_reglist_t *p, hts_pos_t beg) {
     return min_off;
 }
 
+// Searches the implicit interval tree, see bed_index_tree
+static int bed_overlap_tree(const bed_reglist_t *p, hts_pos_t beg, hts_pos_t end)
+{
+    struct { int64_t x; int k, w; } stack[64], z;
+    int64_t n = p->n;
+    int t = 0;
+
+    stack[t].k = p->tree_level;
+    stack[t].x = (1LL << p->tree_level) - 1;
+    stack[t++].w = 0;
+    while (t) {
+        z = stack[--t];
+        if (z.k <= 3) {
+            // Small subtree, so scan it
+            int64_t i, i0 = z.x >> z.k << z.k, i1 = i0 + (1LL << (z.k + 1)) - 1;
+            if (i1 >= n) i1 = n;
+            for (i = i0; i < i1 && p->a[i].beg < end; ++i)
+                if (p->a[i].end > beg)
+                    return 1;
+        } else if (z.w == 0) {
+            // Revisit this node after its left child, which may not exist
+            int64_t y = z.x - (1LL << (z.k - 1));
+            stack[t].k = z.k, stack[t].x = z.x, stack[t++].w = 1;
+            if (y >= n || p->tree[y] > beg)
+                stack[t].k = z.k - 1, stack[t].x = y, stack[t++].w = 0;
+        } else if (z.x < n && p->a[z.x].beg < end) {
+            if (p->a[z.x].end > beg)
+                return 1;
+            stack[t].k = z.k - 1;
+            stack[t].x = z.x + (1LL << (z.k - 1));
+            stack[t++].w = 0;
+        }
+    }
+    return 0;
+}
+
 static int bed_overlap_core(const bed_reglist_t *p, hts_pos_t beg, hts_pos_t end)
 {
     int i, min_off;
     if (p->n == 0) return 0;
+    if (p->tree) return bed_overlap_tree(p, beg, end);
     min_off = bed_minoff(p, beg);
 
     for (i = min_off; i < p->n; ++i) {
@@ -188,6 +287,55 @@ int bed_overlap(const void *_h, const char *chr, hts_pos_t beg, hts_pos_t end)
     return bed_overlap_core(&kh_val(h, k), beg, end);
 }
 
+/* As bed_overlap, for a run of queries sorted by chromosome and start.
+ * Intervals starting before the query start only matter through the largest
+ * of their ends, so the cursor keeps that and moves on through the list
+ * with the queries, making each one amortised O(1).  Queries out of order
+ * fall back to bed_overlap.
+ */
+int bed_overlap_sorted(const void *_h, bed_cursor_t *c, const char *chr,
+                       hts_pos_t beg, hts_pos_t end)
+{
+    const reghash_t *h = (const reghash_t*)_h;
+    const bed_reglist_t *p;
+    int i;
+
+    if (!h) return 0;
+    if (!c->chr || strcmp(c->chr, chr) != 0) {
+        khint_t k = kh_get(reg, h, chr);
+        if (k == kh_end(h)) {
+            c->reg = NULL;
+            c->chr = NULL;
+            return 0;
+        }
+        c->reg = &kh_val(h, k);
+        c->chr = kh_key(h, k);
+        c->beg = HTS_POS_MIN;
+        c->max_end = HTS_POS_MIN;
+        c->i = 0;
+    }
+    p = (const bed_reglist_t *)c->reg;
+
+    if (beg < c->beg || end < beg)
+        return bed_overlap_core(p, beg, end);
+
+    for (i = c->i; i < p->n && p->a[i].beg < beg; i++)
+        if (p->a[i].end > c->max_end)
+            c->max_end = p->a[i].end;
+    c->i = i;
+    c->beg = beg;
+
+    if (c->max_end > beg)
+        return 1;
+
+    // Anything starting from beg to end overlaps, bar empty intervals at beg
+    for (; i < p->n && p->a[i].beg < end; i++)
+        if (p->a[i].end > beg)
+            return 1;
+
+    return 0;
+}
+
 /** @brief Trim a sorted interval list, inside a region hash table,
  *   by removing completely contained intervals and merging adjacent or
  *   overlapping intervals.
@@ -219,6 +367,14 @@ void bed_unify(void *reg_hash) {
         }
 
         p->n = ++new_n;
+
+        // The intervals no longer overlap, and the old index is out of date.
+        // Should it fail, bed_minoff goes back to searching from the start.
+        free(p->idx);
+        p->idx = NULL;
+        free(p->tree);
+        p->tree = NULL;
+        bed_index_core(p);
     }
 }
 
@@ -253,7 +409,7 @@ void bed_unify(void *reg_hash) {
    The VCF specification is at https://github.com/samtools/hts-specs
  */
 
-void *bed_read(const char *fn)
+static reghash_t *bed_read_text(const char *fn)
 {
     reghash_t *h = kh_init(reg);
     gzFile fp;
@@ -361,6 +517,290 @@ void *bed_read(const char *fn)
     return NULL;
 }
 
+/* Binary form of a BED file as read by bed_read, written alongside it as
+   FILE.bin by bed_write_index so later reads can skip parsing, sorting and
+   indexing.  It is only used while the size and modification time of the
+   BED file match those recorded in it.  All fields are in the byte order
+   of the machine that wrote it, which is checked on loading, and are
+   aligned to 8 bytes.
+
+     0  magic         "SBEDIX1\n"
+     8  u32 0x01020304, u32 LIDX_SHIFT
+    16  u64 BED file size
+    24  i64 BED file modification time
+    32  u64 number of references
+    40  references, each:
+          u32 name length including its NUL, i32 n, i64 max_idx,
+          i32 tree_level, u32 flags (1 if there is a tree)
+          name, padded
+          n hts_pair_pos_t intervals
+          max_idx int idx entries, padded
+          n hts_pos_t tree entries, if there is a tree
+ */
+#define BED_BIN_MAGIC "SBEDIX1\n"
+#define BED_BIN_ORDER 0x01020304
+#define BED_BIN_HDR_LEN 40
+#define BED_BIN_REG_LEN 24
+#define BED_BIN_PAD(x) (((x) + 7) & ~(size_t)7)
+
+typedef struct {
+    char magic[8];
+    uint32_t order, shift;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t nregs;
+} bed_bin_hdr_t;
+
+typedef struct {
+    uint32_t name_len;
+    int32_t n;
+    int64_t max_idx;
+    int32_t tree_level;
+    uint32_t flags;
+} bed_bin_reg_t;
+
+static char *bed_bin_name(const char *fn) {
+    char *bin_fn = malloc(strlen(fn) + 5);
+    if (bin_fn)
+        sprintf(bin_fn, "%s.bin", fn);
+    return bin_fn;
+}
+
+static int bed_bin_write_padded(FILE *fp, const void *data, size_t len) {
+    static const char zeros[8] = { 0 };
+    size_t pad = BED_BIN_PAD(len) - len;
+    if (len && fwrite(data, 1, len, fp) != len)
+        return -1;
+    if (pad && fwrite(zeros, 1, pad, fp) != pad)
+        return -1;
+    return 0;
+}
+
+/* Loads FILE.bin if it is present and matches the BED file.
+   Returns the region hash, or NULL if there is no usable cache.
+ */
+static reghash_t *bed_read_bin(const char *fn) {
+    char *bin_fn = NULL;
+    reghash_t *h = NULL;
+    struct stat st, bst;
+    const uint8_t *data = NULL;
+    size_t size = 0, off;
+    bed_bin_hdr_t hdr;
+    uint64_t r;
+    int64_t i;
+    int fd = -1, mapped = 0;
+
+    if (strcmp(fn, "-") == 0 || stat(fn, &st) < 0 || !S_ISREG(st.st_mode))
+        return NULL;
+    if (!(bin_fn = bed_bin_name(fn)))
+        return NULL;
+    if ((fd = open(bin_fn, O_RDONLY)) < 0 || fstat(fd, &bst) < 0
+        || bst.st_size < BED_BIN_HDR_LEN)
+        goto out;
+    size = bst.st_size;
+
+#ifndef _WIN32
+    void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        goto out;
+    data = p;
+    mapped = 1;
+#else
+    {
+        uint8_t *d = malloc(size);
+        size_t got = 0;
+        ssize_t rd = 0;
+        if (!d)
+            goto out;
+        data = d;
+        while (got < size && (rd = read(fd, d + got, size - got)) > 0)
+            got += rd;
+        if (got < size)
+            goto out;
+    }
+#endif
+
+    memcpy(&hdr, data, sizeof(hdr));
+    if (memcmp(hdr.magic, BED_BIN_MAGIC, 8) != 0 || hdr.order != BED_BIN_ORDER
+        || hdr.shift != LIDX_SHIFT || hdr.size != (uint64_t) st.st_size
+        || hdr.mtime != (int64_t) st.st_mtime)
+        goto out;  // not ours, or out of date
+
+    if (!(h = kh_init(reg)))
+        goto out;
+
+    off = BED_BIN_HDR_LEN;
+    for (r = 0; r < hdr.nregs; r++) {
+        bed_bin_reg_t br;
+        bed_reglist_t *q;
+        size_t a_len, idx_len, tree_len;
+        khint_t k;
+        int ret;
+        char *s;
+
+        if (size - off < BED_BIN_REG_LEN)
+            goto corrupt;
+        memcpy(&br, data + off, sizeof(br));
+        off += BED_BIN_REG_LEN;
+        if (br.n < 0 || br.max_idx < 0 || br.name_len == 0
+            || br.max_idx > (int64_t) (SIZE_MAX / sizeof(int)))
+            goto corrupt;
+
+        a_len = (size_t) br.n * sizeof(hts_pair_pos_t);
+        idx_len = (size_t) br.max_idx * sizeof(int);
+        tree_len = (br.flags & 1) ? (size_t) br.n * sizeof(hts_pos_t) : 0;
+        if (size - off < BED_BIN_PAD(br.name_len)
+            || size - off - BED_BIN_PAD(br.name_len) < a_len + BED_BIN_PAD(idx_len) + tree_len
+            || data[off + br.name_len - 1] != '\0')
+            goto corrupt;
+
+        if (!(s = strdup((const char *) data + off)))
+            goto fail;
+        off += BED_BIN_PAD(br.name_len);
+        k = kh_put(reg, h, s, &ret);
+        if (ret <= 0) {
+            free(s);
+            if (ret < 0)
+                goto fail;
+            goto corrupt;  // duplicate name
+        }
+        q = &kh_val(h, k);
+        memset(q, 0, sizeof(*q));
+        q->n = q->m = br.n;
+        q->max_idx = br.max_idx;
+        if ((a_len && !(q->a = malloc(a_len)))
+            || (idx_len && !(q->idx = malloc(idx_len)))
+            || (tree_len && !(q->tree = malloc(tree_len))))
+            goto fail;
+        if (a_len)
+            memcpy(q->a, data + off, a_len);
+        off += a_len;
+        if (idx_len)
+            memcpy(q->idx, data + off, idx_len);
+        off += BED_BIN_PAD(idx_len);
+        if (tree_len)
+            memcpy(q->tree, data + off, tree_len);
+        off += tree_len;
+
+        // The searches trust these, so they must be what bed_index made
+        for (i = 0; i < br.max_idx; i++)
+            if (q->idx[i] < 0 || q->idx[i] >= br.n)
+                goto corrupt;
+        if (tree_len) {
+            int level = 0;
+            while (level < 62 && 2LL << level <= br.n)
+                level++;
+            if (br.tree_level != level)
+                goto corrupt;
+        }
+        q->tree_level = br.tree_level;
+    }
+    goto out;
+
+ corrupt:
+    fprintf(stderr, "[bed_read] Ignoring corrupt index \"%s\"\n", bin_fn);
+ fail:
+    bed_destroy(h);
+    h = NULL;
+ out:
+#ifndef _WIN32
+    if (mapped)
+        munmap((void *) data, size);
+#else
+    free((void *) data);
+#endif
+    if (fd >= 0)
+        close(fd);
+    free(bin_fn);
+    return h;
+}
+
+void *bed_read(const char *fn)
+{
+    reghash_t *h = bed_read_bin(fn);
+    return h ? h : bed_read_text(fn);
+}
+
+int bed_write_index(const char *fn)
+{
+    reghash_t *h = NULL;
+    char *bin_fn = NULL, *tmp_fn = NULL;
+    FILE *fp = NULL;
+    struct stat st;
+    bed_bin_hdr_t hdr;
+    khint_t k;
+    int ret = -1;
+
+    if (stat(fn, &st) < 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "[bed_write_index] \"%s\" is not a regular file\n", fn);
+        return -1;
+    }
+    if (!(h = bed_read_text(fn)))
+        return -1;
+    if (!(bin_fn = bed_bin_name(fn)) || !(tmp_fn = malloc(strlen(bin_fn) + 24)))
+        goto out;
+
+    // Written under a temporary name, so readers never see part of one
+    sprintf(tmp_fn, "%s.tmp%u", bin_fn, (unsigned) getpid());
+    if (!(fp = fopen(tmp_fn, "wb")))
+        goto out;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BED_BIN_MAGIC, 8);
+    hdr.order = BED_BIN_ORDER;
+    hdr.shift = LIDX_SHIFT;
+    hdr.size = st.st_size;
+    hdr.mtime = st.st_mtime;
+    hdr.nregs = kh_size(h);
+    if (fwrite(&hdr, 1, BED_BIN_HDR_LEN, fp) != BED_BIN_HDR_LEN)
+        goto out;
+
+    for (k = kh_begin(h); k < kh_end(h); k++) {
+        const bed_reglist_t *q;
+        bed_bin_reg_t br;
+        const char *name;
+
+        if (!kh_exist(h, k))
+            continue;
+        q = &kh_val(h, k);
+        name = kh_key(h, k);
+        br.name_len = strlen(name) + 1;
+        br.n = q->n;
+        br.max_idx = q->idx ? q->max_idx : 0;
+        br.tree_level = q->tree_level;
+        br.flags = q->tree ? 1 : 0;
+        if (fwrite(&br, 1, BED_BIN_REG_LEN, fp) != BED_BIN_REG_LEN
+            || bed_bin_write_padded(fp, name, br.name_len) < 0
+            || bed_bin_write_padded(fp, q->a, (size_t) q->n * sizeof(*q->a)) < 0
+            || bed_bin_write_padded(fp, q->idx, (size_t) br.max_idx * sizeof(int)) < 0
+            || (q->tree && bed_bin_write_padded(fp, q->tree, (size_t) q->n * sizeof(*q->tree)) < 0))
+            goto out;
+    }
+
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        goto out;
+    }
+    fp = NULL;
+    if (rename(tmp_fn, bin_fn) < 0)
+        goto out;
+    ret = 0;
+
+ out:
+    if (ret < 0) {
+        fprintf(stderr, "[bed_write_index] Failed to write \"%s\" : %s\n",
+                bin_fn ? bin_fn : fn, strerror(errno));
+        if (fp)
+            fclose(fp);
+        if (tmp_fn)
+            unlink(tmp_fn);
+    }
+    free(tmp_fn);
+    free(bin_fn);
+    bed_destroy(h);
+    return ret;
+}
+
 void bed_destroy(void *_h)
 {
     reghash_t *h;
@@ -374,6 +814,7 @@ void bed_destroy(void *_h)
         if (kh_exist(h, k)) {
             free(kh_val(h, k).a);
             free(kh_val(h, k).idx);
+            free(kh_val(h, k).tree);
             free((char*)kh_key(h, k));
         }
     }
@@ -580,15 +1021,15 @@ void *bed_hash_regions(void *reg_hash, char **regs, int first, int last, int *op
     return NULL;
 }
 
-const char* bed_get(void *reg_hash, int i, int filter) {
+const char* bed_get(const void *reg_hash, int i, int filter) {
 
-    reghash_t *h;
-    bed_reglist_t *p;
+    const reghash_t *h;
+    const bed_reglist_t *p;
 
     if (!reg_hash)
         return NULL;
 
-    h = (reghash_t *)reg_hash;
+    h = (const reghash_t *)reg_hash;
     if (!kh_exist(h,i) || !(p = &kh_val(h,i)) || (p->filter < filter))
         return NULL;
 
@@ -603,10 +1044,10 @@ const char* bed_get(void *reg_hash, int i, int filter) {
  * @return           The regions list as a hts_reglist_t
  */
 
-hts_reglist_t *bed_reglist(void *reg_hash, int filter, int *n_reg) {
+hts_reglist_t *bed_reglist(const void *reg_hash, int filter, int *n_reg) {
 
-    reghash_t *h;
-    bed_reglist_t *p;
+    const reghash_t *h;
+    const bed_reglist_t *p;
     khint_t i;
     hts_reglist_t *reglist = NULL;
     int count = 0;
@@ -615,7 +1056,7 @@ hts_reglist_t *bed_reglist(void *reg_hash, int filter, int *n_reg) {
     if (!reg_hash)
         return NULL;
 
-    h = (reghash_t *)reg_hash;
+    h = (const reghash_t *)reg_hash;
 
     for (i = kh_begin(h); i < kh_end(h); i++) {
         if (!kh_exist(h,i) || !(p = &kh_val(h,i)) || (p->filter < filter))
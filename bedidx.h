@@ -34,12 +34,35 @@ DEALINGS IN THE SOFTWARE.  */
 #define MIN(A,B) ( ( (A) < (B) ) ? (A) : (B) )
 #define MAX(A,B) ( ( (A) > (B) ) ? (A) : (B) )
 
+/* A region hash is built by bed_read or bed_hash_regions, and may then be
+ * changed by bed_unify or bed_hash_regions.  Once built it is not altered
+ * by bed_overlap, bed_overlap_sorted, bed_get or bed_reglist, so any number
+ * of threads can share one without locking, provided nothing else changes
+ * it meanwhile.
+ *
+ * State for a sweep of queries in order of start position, so each can
+ * carry on from where the last one finished.  Zero it (or use
+ * BED_CURSOR_INIT) before the first query.  Threads sharing a region hash
+ * each need their own cursor.
+ */
+typedef struct {
+    const void *reg;    // interval list for chr, or NULL
+    const char *chr;
+    hts_pos_t beg;      // start of the last query
+    hts_pos_t max_end;  // largest end of the intervals starting before beg
+    int i;              // first interval starting at or after beg
+} bed_cursor_t;
+
+#define BED_CURSOR_INIT { NULL, NULL, 0, 0, 0 }
+
 void *bed_read(const char *fn);
+int bed_write_index(const char *fn);
 void bed_destroy(void *_h);
 int bed_overlap(const void *_h, const char *chr, hts_pos_t beg, hts_pos_t end);
+int bed_overlap_sorted(const void *_h, bed_cursor_t *c, const char *chr, hts_pos_t beg, hts_pos_t end);
 void *bed_hash_regions(void *reg_hash, char **regs, int first, int last, int *op);
-const char* bed_get(void *reg_hash, int index, int filter);
-hts_reglist_t *bed_reglist(void *reg_hash, int filter, int *count_regs);
+const char* bed_get(const void *reg_hash, int index, int filter);
+hts_reglist_t *bed_reglist(const void *reg_hash, int filter, int *count_regs);
 void bed_unify(void *_h);
 
 #endif
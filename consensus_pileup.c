@@ -290,6 +290,36 @@ static int get_next_base(pileup_t *p, hts_pos_t pos, int nth, int *is_insert) {
     return 1;
 }
 
+/*
+ * Pileup records are carved out of blocks rather than allocated one at a
+ * time.  Reads arrive in position order, so the active list mostly walks
+ * forward through memory, and records freed at the end of a read are
+ * reused by the next read to start while they are still in cache.
+ */
+#define PILEUP_BLOCK 256
+
+typedef struct pileup_block {
+    struct pileup_block *next;
+    int used;
+    pileup_t p[PILEUP_BLOCK];
+} pileup_block_t;
+
+static pileup_t *pileup_alloc(pileup_block_t **blocks, pileup_t **pfree) {
+    pileup_t *p;
+    if ((p = *pfree)) {
+        *pfree = p->next;
+        return p;
+    }
+    if (!*blocks || (*blocks)->used == PILEUP_BLOCK) {
+        pileup_block_t *blk = calloc(1, sizeof(*blk));
+        if (!blk)
+            return NULL;
+        blk->next = *blocks;
+        *blocks = blk;
+    }
+    return &(*blocks)->p[(*blocks)->used++];
+}
+
 /*
  * Loops through a set of supplied ranges producing columns of data.
  * When found, it calls func with clientdata as a callback. Func should
@@ -326,15 +356,16 @@ int pileup_loop(samFile *fp,
                                  pileup_t *p),
                 void *client_data) {
     int ret = -1;
-    pileup_t *phead = NULL, *p, *pfree = NULL, *last, *next, *ptail = NULL;
+    pileup_t *phead = NULL, *p, *pfree = NULL, *last, *ptail = NULL;
     pileup_t *pnew = NULL;
-    int is_insert, nth = 0, r;
+    pileup_block_t *blocks = NULL, *blk, *next_blk;
+    int is_insert, nth = 0, r, i;
     hts_pos_t col = 0;
     int last_ref = -1;
 
     /* FIXME: allow for start/stop boundaries rather than consuming all data */
 
-    if (NULL == (pnew = calloc(1, sizeof(*p))))
+    if (NULL == (pnew = pileup_alloc(&blocks, &pfree)))
         return -1;
 
     do {
@@ -573,31 +604,26 @@ int pileup_loop(samFile *fp,
             }
 
             /* Allocate the next pileup rec */
-            if (pfree) {
-                pnew = pfree;
-                pfree = pfree->next;
-            } else {
-                if (NULL == (pnew = calloc(1, sizeof(*pnew))))
-                    goto error;
-            }
+            if (NULL == (pnew = pileup_alloc(&blocks, &pfree)))
+                goto error;
         }
     } while (r >= 0);
 
     ret = 0;
  error:
 
-    if (pnew) {
-        free(pnew->b.data);
-        free(pnew);
-    }
-
-    /* Tidy up */
-    for (p = pfree; p; p = next) {
-        next = p->next;
-        if (seq_free)
+    /* Tidy up, including seqs still active after an early abort */
+    if (seq_free) {
+        for (p = phead; p; p = p->next)
+            seq_free(client_data, fp, h, p);
+        for (p = pfree; p; p = p->next)
             seq_free(client_data, fp, h, p);
-        free(p->b.data);
-        free(p);
+    }
+    for (blk = blocks; blk; blk = next_blk) {
+        next_blk = blk->next;
+        for (i = 0; i < blk->used; i++)
+            free(blk->p[i].b.data);
+        free(blk);
     }
 
     return ret;
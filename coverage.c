@@ -43,6 +43,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -130,7 +131,7 @@ static int usage(void) {
             "  -h, --help              help (this page)\n");
 
     fprintf(stdout, "\nGeneric options:\n");
-    sam_global_opt_help(stdout, "-.--.--.");
+    sam_global_opt_help(stdout, "-.--.@-.");
 
     fprintf(stdout,
             "\nSee manpage for additional details.\n"
@@ -195,6 +196,288 @@ static int read_bam(void *data, bam1_t *b) {
     return ret;
 }
 
+// Coverage accumulation without a pileup.  Records from all the inputs are
+// merged in coordinate order and the aligned blocks of each one are added
+// as a pair of +1/-1 depth changes to a ring buffer of differences.  When
+// the next record starts, all positions before it are final and are
+// accounted for in runs of equal depth.
+typedef struct {
+    int nfiles;
+    bam1_t **b;         // next record per input
+    int *state;         // 0 = needs reading, 1 = b[i] valid, 2 = finished
+    int *diff;          // ring buffer of depth changes
+    hts_pos_t size;     // ring buffer size, a power of 2
+    hts_pos_t done;     // positions before this are accounted for
+    hts_pos_t end;      // no depth changes at or after this
+    int64_t depth;      // depth at done
+    // Limit on the number of reads overlapping a read start, as applied by
+    // the pileup.  The read ends of each input are kept in a min-heap to
+    // count them; the first read at each position is always kept.
+    int max_reads;
+    hts_pos_t **ends;
+    int *n_ends, *m_ends;
+    hts_pos_t *last;
+    // Current contig
+    stats_aux_t *s;
+    uint32_t *hist;
+    int64_t n_bins;
+    bool plot_coverage;
+} cov_sweep_t;
+
+static int cov_sweep_init(cov_sweep_t *sw, int nfiles, int max_reads) {
+    int i;
+    memset(sw, 0, sizeof(*sw));
+    sw->nfiles = nfiles;
+    sw->max_reads = max_reads;
+    sw->b = calloc(nfiles, sizeof(*sw->b));
+    sw->state = calloc(nfiles, sizeof(*sw->state));
+    sw->ends = calloc(nfiles, sizeof(*sw->ends));
+    sw->n_ends = calloc(nfiles, sizeof(*sw->n_ends));
+    sw->m_ends = calloc(nfiles, sizeof(*sw->m_ends));
+    sw->last = calloc(nfiles, sizeof(*sw->last));
+    if (!sw->b || !sw->state || !sw->ends || !sw->n_ends || !sw->m_ends
+        || !sw->last)
+        return -1;
+    for (i = 0; i < nfiles; i++)
+        if (!(sw->b[i] = bam_init1()))
+            return -1;
+    return 0;
+}
+
+static void cov_sweep_destroy(cov_sweep_t *sw) {
+    int i;
+    for (i = 0; i < sw->nfiles; i++) {
+        if (sw->b && sw->b[i])
+            bam_destroy1(sw->b[i]);
+        if (sw->ends)
+            free(sw->ends[i]);
+    }
+    free(sw->b);
+    free(sw->state);
+    free(sw->ends);
+    free(sw->n_ends);
+    free(sw->m_ends);
+    free(sw->last);
+    free(sw->diff);
+}
+
+// Returns 1 and sets *file to the input holding the next record in
+// coordinate order, 0 when all inputs are finished, or -1 on error.
+static int cov_sweep_next(cov_sweep_t *sw, bam_aux_t **data, int *file) {
+    int i, best = -1;
+    for (i = 0; i < sw->nfiles; i++) {
+        if (sw->state[i] == 0) {
+            int ret = read_bam(data[i], sw->b[i]);
+            if (ret < -1)
+                return -1;
+            sw->state[i] = ret < 0 ? 2 : 1;
+        }
+        if (sw->state[i] != 1)
+            continue;
+        if (best < 0
+            || (uint32_t) sw->b[i]->core.tid < (uint32_t) sw->b[best]->core.tid
+            || (sw->b[i]->core.tid == sw->b[best]->core.tid
+                && sw->b[i]->core.pos < sw->b[best]->core.pos))
+            best = i;
+    }
+    if (best < 0)
+        return 0;
+    sw->state[best] = 0;
+    *file = best;
+    return 1;
+}
+
+// Account for positions [beg,end) at the given depth
+static void cov_sweep_run(cov_sweep_t *sw, hts_pos_t beg, hts_pos_t end,
+                          int64_t depth) {
+    stats_aux_t *s = sw->s;
+    if (depth <= 0 || beg >= end)
+        return;
+
+    s->n_covered_bases += end - beg;
+    s->summed_coverage += depth * (end - beg);
+    if (!sw->hist)
+        return;
+
+    while (beg < end) {
+        int64_t bin = (beg - s->beg) / s->bin_width;
+        if (bin >= sw->n_bins)
+            break;
+        hts_pos_t bin_end = s->beg + (bin + 1) * s->bin_width;
+        if (bin_end > end)
+            bin_end = end;
+        sw->hist[bin] += sw->plot_coverage
+            ? depth * (bin_end - beg)
+            : bin_end - beg;
+        beg = bin_end;
+    }
+}
+
+// Account for all positions before pos
+static void cov_sweep_flush(cov_sweep_t *sw, hts_pos_t pos) {
+    hts_pos_t i, run = sw->done, stop = pos < sw->end ? pos : sw->end;
+    hts_pos_t mask = sw->size - 1;
+
+    for (i = sw->done; i < stop; i++) {
+        int d = sw->diff[i & mask];
+        if (!d)
+            continue;
+        cov_sweep_run(sw, run, i, sw->depth);
+        sw->depth += d;
+        sw->diff[i & mask] = 0;
+        run = i;
+    }
+    cov_sweep_run(sw, run, pos < sw->end ? pos : sw->end, sw->depth);
+    if (pos > sw->done)
+        sw->done = pos;
+}
+
+// Make room for depth changes up to and including pos
+static int cov_sweep_grow(cov_sweep_t *sw, hts_pos_t pos) {
+    hts_pos_t need = (pos > sw->end ? pos : sw->end) - sw->done + 1, i;
+    hts_pos_t size = sw->size ? sw->size : 1024, old_mask = sw->size - 1;
+    if (need <= sw->size)
+        return 0;
+    while (size < need)
+        size *= 2;
+    int *diff = calloc(size, sizeof(*diff));
+    if (!diff)
+        return -1;
+    for (i = sw->done; i < sw->end; i++)
+        diff[i & (size-1)] = sw->diff[i & old_mask];
+    free(sw->diff);
+    sw->diff = diff;
+    sw->size = size;
+    return 0;
+}
+
+static inline void cov_sweep_change(cov_sweep_t *sw, hts_pos_t beg,
+                                    hts_pos_t end) {
+    sw->diff[beg & (sw->size-1)]++;
+    sw->diff[end & (sw->size-1)]--;
+    if (sw->end < end + 1)
+        sw->end = end + 1;
+}
+
+// Count the reads of input file overlapping pos, and add one ending at end
+// unless there are too many.  Returns 0 if the read should be skipped.
+static int cov_sweep_limit(cov_sweep_t *sw, int file, hts_pos_t pos,
+                           hts_pos_t end) {
+    hts_pos_t *h = sw->ends[file], v;
+    int n = sw->n_ends[file], i, c;
+
+    // Drop the reads which ended before pos-1, smallest end first.  The
+    // pileup only retires a read after moving past its last base, so one
+    // ending at pos still counts.
+    while (n > 0 && h[0] < pos) {
+        v = h[--n];
+        for (i = 0; (c = 2*i+1) < n; i = c) {
+            if (c+1 < n && h[c+1] < h[c])
+                c++;
+            if (v <= h[c])
+                break;
+            h[i] = h[c];
+        }
+        h[i] = v;
+    }
+    sw->n_ends[file] = n;
+    if (pos == sw->last[file] && n >= sw->max_reads)
+        return 0;
+    sw->last[file] = pos;
+
+    if (n == sw->m_ends[file]) {
+        int m = n ? 2*n : 64;
+        if (!(h = realloc(h, m * sizeof(*h))))
+            return -1;
+        sw->ends[file] = h;
+        sw->m_ends[file] = m;
+    }
+    for (i = n; i > 0 && h[(i-1)/2] > end; i = (i-1)/2)
+        h[i] = h[(i-1)/2];
+    h[i] = end;
+    sw->n_ends[file]++;
+    return 1;
+}
+
+// Start a new contig
+static void cov_sweep_reset(cov_sweep_t *sw, stats_aux_t *s, uint32_t *hist,
+                            int64_t n_bins, hts_pos_t pos) {
+    int i;
+    sw->s = s;
+    sw->hist = hist;
+    sw->n_bins = n_bins;
+    sw->done = sw->end = pos;
+    sw->depth = 0;
+    for (i = 0; i < sw->nfiles; i++) {
+        sw->n_ends[i] = 0;
+        sw->last[i] = -1;
+    }
+}
+
+// Add the aligned blocks of b from input file to the current contig
+static int cov_sweep_add(cov_sweep_t *sw, bam1_t *b, int file, int min_baseQ,
+                         int *no_qual) {
+    stats_aux_t *s = sw->s;
+    hts_pos_t pos = b->core.pos, end = bam_endpos(b);
+    uint32_t *cig = bam_get_cigar(b);
+    uint8_t *qual = bam_get_qual(b);
+    int j, qpos = 0;
+
+    if (pos < sw->done) {
+        print_error("coverage", "the input is not sorted");
+        return -1;
+    }
+    cov_sweep_flush(sw, pos);
+
+    if (sw->max_reads < INT_MAX) {
+        int r = cov_sweep_limit(sw, file, pos, end);
+        if (r <= 0)
+            return r;
+    }
+    if (cov_sweep_grow(sw, end) < 0)
+        return -1;
+
+    for (j = 0; j < b->core.n_cigar; j++) {
+        int op = bam_cigar_op(cig[j]);
+        hts_pos_t len = bam_cigar_oplen(cig[j]);
+        int type = bam_cigar_type(op);
+
+        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+            // Clip the block to the region, filter on base quality and
+            // add the runs of counted bases
+            hts_pos_t k = pos < s->beg ? s->beg - pos : 0;
+            hts_pos_t kend = pos + len > s->end ? s->end - pos : len;
+            hts_pos_t run = -1;
+            for (; k < kend; k++) {
+                int q = qpos + k;
+                bool counted = true;
+                if (q >= b->core.l_qseq) {
+                    *no_qual = 1;
+                } else if (qual[q] < min_baseQ) {
+                    counted = false;
+                } else {
+                    s->summed_baseQ += qual[q];
+                    s->quality_bases++;
+                }
+                if (counted && run < 0) {
+                    run = k;
+                } else if (!counted && run >= 0) {
+                    cov_sweep_change(sw, pos + run, pos + k);
+                    run = -1;
+                }
+            }
+            if (run >= 0)
+                cov_sweep_change(sw, pos + run, pos + kend);
+        }
+        if (type & 1)
+            qpos += len;
+        if (type & 2)
+            pos += len;
+    }
+
+    return 0;
+}
+
 void print_tabular_line(FILE *file_out, const sam_hdr_t *h, const stats_aux_t *stats, int tid) {
     fputs(sam_hdr_tid2name(h, tid), file_out);
     double region_len = (double) stats[tid].end - stats[tid].beg;
@@ -293,10 +576,274 @@ void print_hist(FILE *file_out, const sam_hdr_t *h, const stats_aux_t *stats, in
     fprintf(file_out, "\n");
 }
 
+// Threaded per-contig mode.  Each worker has its own handles and indices
+// for all the inputs and repeatedly takes the next contig from a shared
+// queue, largest first by the number of mapped reads in the indices, so
+// idle threads pick up the remaining work.  Each contig's results go to
+// its own stats (and histogram) entry, and are printed afterwards in the
+// same order as the single threaded output.
+typedef struct {
+    pthread_mutex_t lock;
+    int next, n_tasks, *tasks;
+    stats_aux_t *stats;
+    uint32_t **hist;    // per contig histograms, or NULL
+    const sam_hdr_t *h;
+    int64_t opt_n_bins;
+    int min_baseQ;
+} cov_work_t;
+
+typedef struct {
+    cov_work_t *work;
+    int nfiles;
+    bam_aux_t *data;    // data[nfiles]
+    bam_aux_t **datap;
+    hts_idx_t **idx;
+    cov_sweep_t sweep;
+    int no_qual, failed;
+    pthread_t thread;
+} cov_worker_t;
+
+typedef struct {
+    int tid;
+    uint64_t mapped;
+} cov_task_t;
+
+static int cov_task_cmp(const void *av, const void *bv) {
+    const cov_task_t *a = av, *b = bv;
+    if (a->mapped != b->mapped)
+        return a->mapped < b->mapped ? 1 : -1;
+    return a->tid - b->tid;
+}
+
+static int cov_contig(cov_worker_t *w, int tid) {
+    cov_work_t *work = w->work;
+    stats_aux_t *s = &work->stats[tid];
+    int i, ret, file, started = 0;
+    int64_t n_bins = 0;
+
+    for (i = 0; i < w->nfiles; i++) {
+        hts_itr_destroy(w->data[i].iter);
+        w->data[i].iter = sam_itr_queryi(w->idx[i], tid, 0, HTS_POS_MAX);
+        if (!w->data[i].iter) {
+            print_error("coverage", "Failed to query \"%s\"",
+                        sam_hdr_tid2name(work->h, tid));
+            return -1;
+        }
+        w->sweep.state[i] = 0;
+    }
+
+    while ((ret = cov_sweep_next(&w->sweep, w->datap, &file)) > 0) {
+        bam1_t *b = w->sweep.b[file];
+        if (b->core.tid != tid || (b->core.flag & BAM_FUNMAP))
+            continue;
+
+        if (!started) {
+            uint32_t *hist = NULL;
+            s->covered = true;
+            s->end = sam_hdr_tid2len(work->h, tid);
+            if (work->hist) {
+                n_bins = work->opt_n_bins > s->end - s->beg
+                    ? s->end - s->beg : work->opt_n_bins;
+                s->bin_width = (s->end - s->beg) / n_bins;
+                if (!(hist = work->hist[tid] = calloc(n_bins, sizeof(*hist)))) {
+                    print_error_errno("coverage", "Failed to allocate memory");
+                    return -1;
+                }
+            }
+            cov_sweep_reset(&w->sweep, s, hist, n_bins, b->core.pos);
+            started = 1;
+        }
+
+        if (cov_sweep_add(&w->sweep, b, file, work->min_baseQ,
+                          &w->no_qual) < 0)
+            return -1;
+    }
+    if (ret < 0) {
+        print_error("coverage", "Failed to read \"%s\"",
+                    sam_hdr_tid2name(work->h, tid));
+        return -1;
+    }
+    if (started)
+        cov_sweep_flush(&w->sweep, HTS_POS_MAX);
+
+    return 0;
+}
+
+static void *cov_worker(void *arg) {
+    cov_worker_t *w = (cov_worker_t *) arg;
+    cov_work_t *work = w->work;
+
+    for (;;) {
+        int tid = -1;
+        pthread_mutex_lock(&work->lock);
+        if (work->next < work->n_tasks)
+            tid = work->tasks[work->next++];
+        pthread_mutex_unlock(&work->lock);
+        if (tid < 0)
+            break;
+
+        if (cov_contig(w, tid) < 0) {
+            w->failed = 1;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void cov_worker_destroy(cov_worker_t *w) {
+    int i;
+    for (i = 0; i < w->nfiles; i++) {
+        if (w->data[i].iter) hts_itr_destroy(w->data[i].iter);
+        if (w->data[i].hdr) sam_hdr_destroy(w->data[i].hdr);
+        if (w->data[i].fp) sam_close(w->data[i].fp);
+        if (w->idx[i]) hts_idx_destroy(w->idx[i]);
+    }
+    cov_sweep_destroy(&w->sweep);
+    free(w->data);
+    free(w->datap);
+    free(w->idx);
+}
+
+// Opens the inputs again for a worker, with the same settings as data.
+static int cov_worker_init(cov_worker_t *w, cov_work_t *work,
+                           bam_aux_t **data, int nfiles, char **fn,
+                           sam_global_args *ga, int rf, int max_reads) {
+    int i;
+
+    memset(w, 0, sizeof(*w));
+    w->work = work;
+    w->data = calloc(nfiles, sizeof(*w->data));
+    w->datap = calloc(nfiles, sizeof(*w->datap));
+    w->idx = calloc(nfiles, sizeof(*w->idx));
+    if (!w->data || !w->datap || !w->idx) {
+        print_error_errno("coverage", "Failed to allocate memory");
+        return -1;
+    }
+    w->nfiles = nfiles;
+    if (cov_sweep_init(&w->sweep, nfiles, max_reads) < 0) {
+        print_error_errno("coverage", "Failed to allocate memory");
+        return -1;
+    }
+
+    for (i = 0; i < nfiles; i++) {
+        bam_aux_t *aux = &w->data[i];
+        *aux = *data[i];
+        aux->iter = NULL;
+        aux->hdr = NULL;
+        w->datap[i] = aux;
+        if (!(aux->fp = sam_open_format(fn[i], "r", &ga->in))) {
+            print_error_errno("coverage", "Could not open \"%s\"", fn[i]);
+            return -1;
+        }
+        if (hts_set_opt(aux->fp, CRAM_OPT_REQUIRED_FIELDS, rf)
+            || hts_set_opt(aux->fp, CRAM_OPT_DECODE_MD, 0)) {
+            print_error("coverage", "Failed to set CRAM options");
+            return -1;
+        }
+        if (!(aux->hdr = sam_hdr_read(aux->fp))) {
+            print_error_errno("coverage", "Could not read header for \"%s\"", fn[i]);
+            return -1;
+        }
+        if (!(w->idx[i] = sam_index_load(aux->fp, fn[i]))) {
+            print_error_errno("coverage", "Failed to load index for \"%s\"", fn[i]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Computes the stats (and histograms, when hist is not NULL) of all
+// contigs with nthreads workers.  Returns 0 on success, 1 if the inputs
+// are not all indexed so the threaded mode cannot be used, or -1 on error.
+static int cov_threaded(bam_aux_t **data, int nfiles, char **fn,
+                        sam_global_args *ga, int rf, int nthreads,
+                        stats_aux_t *stats, const sam_hdr_t *h,
+                        uint32_t **hist, int64_t opt_n_bins, int min_baseQ,
+                        int max_reads, bool plot_coverage, int *no_qual) {
+    int n_targets = sam_hdr_nref(h), i, tid, ret = -1, n_workers = 0;
+    cov_task_t *tasks = calloc(n_targets > 0 ? n_targets : 1, sizeof(*tasks));
+    cov_worker_t *workers = calloc(nthreads, sizeof(*workers));
+    cov_work_t work = { .stats = stats, .hist = hist, .h = h,
+                        .opt_n_bins = opt_n_bins, .min_baseQ = min_baseQ };
+    int *order = calloc(n_targets > 0 ? n_targets : 1, sizeof(*order));
+
+    if (!tasks || !workers || !order) {
+        print_error_errno("coverage", "Failed to allocate memory");
+        goto out;
+    }
+    for (tid = 0; tid < n_targets; tid++)
+        tasks[tid].tid = tid;
+
+    // Weight the contigs by the reads placed on them.  Contigs which the
+    // indices say hold no reads at all need no work.
+    for (i = 0; i < nfiles; i++) {
+        hts_idx_t *idx = sam_index_load(data[i]->fp, fn[i]);
+        if (!idx) {
+            ret = 1;
+            goto out;
+        }
+        for (tid = 0; tid < n_targets; tid++) {
+            uint64_t mapped, unmapped;
+            if (hts_idx_get_stat(idx, tid, &mapped, &unmapped) == 0)
+                tasks[tid].mapped += mapped + unmapped;
+            else
+                tasks[tid].mapped = UINT64_MAX/2; // unknown, do it early
+        }
+        hts_idx_destroy(idx);
+    }
+    qsort(tasks, n_targets, sizeof(*tasks), cov_task_cmp);
+    for (i = 0; i < n_targets && tasks[i].mapped; i++)
+        order[i] = tasks[i].tid;
+    work.tasks = order;
+    work.n_tasks = i;
+
+    if (nthreads > work.n_tasks)
+        nthreads = work.n_tasks > 0 ? work.n_tasks : 1;
+    while (n_workers < nthreads) {
+        // Counted before checking, so a partly set up worker is freed too
+        cov_worker_t *w = &workers[n_workers++];
+        if (cov_worker_init(w, &work, data, nfiles, fn, ga, rf, max_reads) < 0)
+            goto out;
+        w->sweep.plot_coverage = plot_coverage;
+    }
+
+    if (pthread_mutex_init(&work.lock, NULL) != 0) {
+        print_error_errno("coverage", "Failed to initialise mutex");
+        goto out;
+    }
+
+    ret = 0;
+    for (i = 0; i < n_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, cov_worker, &workers[i]) != 0) {
+            print_error_errno("coverage", "Failed to create thread");
+            ret = -1;
+            break;
+        }
+    }
+    while (i-- > 0) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].failed)
+            ret = -1;
+        if (workers[i].no_qual)
+            *no_qual = 1;
+    }
+    pthread_mutex_destroy(&work.lock);
+
+ out:
+    for (i = 0; i < n_workers; i++)
+        cov_worker_destroy(&workers[i]);
+    free(tasks);
+    free(order);
+    free(workers);
+    return ret;
+}
+
 int main_coverage(int argc, char *argv[]) {
     int status = EXIT_SUCCESS;
 
-    int ret, tid = -1, old_tid = -1, pos, i, j;
+    int ret, tid = -1, old_tid = -1, i, file;
 
     int max_depth = 1000000;
     int opt_min_baseQ = 0;
@@ -306,9 +853,8 @@ int main_coverage(int argc, char *argv[]) {
     bool opt_full_width = true;
     char *opt_output_file = NULL;
     bam_aux_t **data = NULL;
-    bam_mplp_t mplp = NULL;
-    const bam_pileup1_t **plp = NULL;
-    uint32_t *hist = NULL;
+    cov_sweep_t sweep = {0};
+    uint32_t *hist = NULL, **hists = NULL;
     stats_aux_t *stats = NULL;
     char *opt_reg = 0; // specified region
     char *opt_file_list = NULL;
@@ -318,7 +864,6 @@ int main_coverage(int argc, char *argv[]) {
     int required_flags = 0;
     int print_value_warning = 0;
 
-    int *n_plp = NULL;
     sam_hdr_t *h = NULL; // BAM header of the 1st input
 
     bool opt_print_header = true;
@@ -331,7 +876,7 @@ int main_coverage(int argc, char *argv[]) {
 
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '-'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '@', '-', '-'),
         {"rf", required_argument, NULL, 1}, // require flag
         {"ff", required_argument, NULL, 2}, // filter flag
         {"incl-flags", required_argument, NULL, 1}, // require flag
@@ -357,7 +902,7 @@ int main_coverage(int argc, char *argv[]) {
     // parse the command line
     int c;
     opterr = 0;
-    while ((c = getopt_long(argc, argv, "Ao:l:q:Q:hHw:r:b:md:D", lopts, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "Ao:l:q:Q:hHw:r:b:md:D@:", lopts, NULL)) != -1) {
         switch (c) {
             case 1:
                 if ((required_flags = bam_str2flag(optarg)) < 0) {
@@ -466,8 +1011,13 @@ int main_coverage(int argc, char *argv[]) {
         goto coverage_end;
     }
 
+    // The sequence is not needed, only its length which CRAM always
+    // provides.  MAPQ is reported as meanmapq so is always decoded.
+    // The threaded code below reads the same fields.
+    int rf = SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR;
+    if (opt_min_baseQ) rf |= SAM_QUAL;
+
     for (i = 0; i < n_bam_files; ++i) {
-        int rf;
         data[i] = (bam_aux_t *) calloc(1, sizeof(bam_aux_t));
         if (!data[i]) {
             print_error_errno("coverage", "Failed to allocate memory");
@@ -481,9 +1031,6 @@ int main_coverage(int argc, char *argv[]) {
             status = EXIT_FAILURE;
             goto coverage_end;
         }
-        rf = SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_SEQ;
-        if (opt_min_baseQ) rf |= SAM_QUAL;
-
         // Set CRAM options on file handle - returns 0 on success
         if (hts_set_opt(data[i]->fp, CRAM_OPT_REQUIRED_FIELDS, rf)) {
             print_error("coverage", "Failed to set CRAM_OPT_REQUIRED_FIELDS value");
@@ -553,104 +1100,120 @@ int main_coverage(int argc, char *argv[]) {
     for (i=0; i<n_bam_files; i++)
         data[i]->stats = stats;
 
-    int64_t current_bin = 0;
-
-    // the core multi-pileup loop
-    mplp = bam_mplp_init(n_bam_files, read_bam, (void**)data); // initialization
-    if (max_depth > 0)
-        bam_mplp_set_maxcnt(mplp, max_depth);  // set maximum coverage depth
-    else if (!max_depth)
-        bam_mplp_set_maxcnt(mplp, INT_MAX);
-
-
-    // Extra info for histogram and coverage counting
-    hist = (uint32_t*) calloc(opt_n_bins, sizeof(uint32_t));
-    n_plp = (int*) calloc(n_bam_files, sizeof(int*)); // n_plp[i] is the number of covering reads from the i-th BAM
-    plp = (const bam_pileup1_t**) calloc(n_bam_files, sizeof(bam_pileup1_t*)); // plp[i] points to the array of covering reads (internal in mplp)
-    if (!hist || !n_plp || !plp) {
-        print_error_errno("coverage", "Failed to allocate memory");
-        status = EXIT_FAILURE;
-        goto coverage_end;
+    int max_reads = max_depth > 0 ? max_depth
+        : max_depth == 0 ? INT_MAX : 8000; // 8000 is the pileup default
+    int serial = 1;
+    if (ga.nthreads > 0 && !opt_reg) {
+        if (opt_print_histogram &&
+            !(hists = calloc(n_targets > 0 ? n_targets : 1, sizeof(*hists)))) {
+            print_error_errno("coverage", "Failed to allocate memory");
+            status = EXIT_FAILURE;
+            goto coverage_end;
+        }
+        serial = cov_threaded(data, n_bam_files, &argv[optind], &ga, rf,
+                              ga.nthreads, stats, h, hists, opt_n_bins,
+                              opt_min_baseQ, max_reads, opt_plot_coverage,
+                              &print_value_warning);
+        if (serial < 0) {
+            status = EXIT_FAILURE;
+            goto coverage_end;
+        }
     }
 
-    while ((ret=bam_mplp_auto(mplp, &tid, &pos, n_plp, plp)) > 0) { // come to the next covered position
-
-        if (tid != old_tid) { // Next target sequence
-            if (old_tid >= 0) {
-                if (opt_print_histogram) {
-                    print_hist(file_out, h, stats, old_tid, hist, n_bins, opt_full_utf, opt_plot_coverage);
-                    fputc('\n', file_out);
-                } else if (opt_print_tabular) {
-                    print_tabular_line(file_out, h, stats, old_tid);
-                }
-
-                if (opt_print_histogram)
-                    memset(hist, 0, n_bins*sizeof(uint32_t));
-            }
-
-            stats[tid].covered = true;
-            if (!opt_reg)
-                stats[tid].end = sam_hdr_tid2len(h, tid);
-
+    if (!serial) {
+        // Print the contigs with data in order, as the serial loop would
+        int first = 1;
+        for (i = 0; i < n_targets; ++i) {
+            if (!stats[i].covered)
+                continue;
             if (opt_print_histogram) {
-                n_bins = opt_n_bins > stats[tid].end-stats[tid].beg? stats[tid].end-stats[tid].beg : opt_n_bins;
-                stats[tid].bin_width = (stats[tid].end-stats[tid].beg) / n_bins;
+                if (!first)
+                    fputc('\n', file_out);
+                n_bins = opt_n_bins > stats[i].end-stats[i].beg? stats[i].end-stats[i].beg : opt_n_bins;
+                print_hist(file_out, h, stats, i, hists[i], n_bins, opt_full_utf, opt_plot_coverage);
+            } else if (opt_print_tabular) {
+                print_tabular_line(file_out, h, stats, i);
             }
-
-            old_tid = tid;
+            first = 0;
         }
-        if (pos < stats[tid].beg || pos >= stats[tid].end) continue; // out of range; skip
-        if (tid >= n_targets) continue;     // diff number of @SQ lines per file?
+        ret = 0;
+    } else {
+        if (ga.nthreads > 0)
+            for (i = 0; i < n_bam_files; i++)
+                hts_set_threads(data[i]->fp, ga.nthreads);
 
-        if (opt_print_histogram) {
-            current_bin = (pos - stats[tid].beg) / stats[tid].bin_width;
+        // the core loop, merging the records of all inputs
+        if (cov_sweep_init(&sweep, n_bam_files, max_reads) < 0) {
+            print_error_errno("coverage", "Failed to allocate memory");
+            status = EXIT_FAILURE;
+            goto coverage_end;
         }
+        sweep.plot_coverage = opt_plot_coverage;
 
-        bool count_base = false;
-        for (i = 0; i < n_bam_files; ++i) { // base level filters have to go here
-            int depth_at_pos = n_plp[i];
-            for (j = 0; j < n_plp[i]; ++j) {
-                const bam_pileup1_t *p = plp[i] + j; // DON'T modify plp[][] unless you really know
+        // Extra info for histogram
+        hist = (uint32_t*) calloc(opt_n_bins, sizeof(uint32_t));
+        if (!hist) {
+            print_error_errno("coverage", "Failed to allocate memory");
+            status = EXIT_FAILURE;
+            goto coverage_end;
+        }
 
-                if (p->is_del || p->is_refskip) {
-                    --depth_at_pos; // having dels or refskips at tid:pos
-                } else if (p->qpos < p->b->core.l_qseq) {
-                    if (bam_get_qual(p->b)[p->qpos] < opt_min_baseQ) {
-                        --depth_at_pos; // low base quality
-                    } else {
-                        stats[tid].summed_baseQ += bam_get_qual(p->b)[p->qpos];
-                        stats[tid].quality_bases++;
+        while ((ret = cov_sweep_next(&sweep, data, &file)) > 0) {
+            bam1_t *b = sweep.b[file];
+            if (b->core.tid < 0 || b->core.tid >= n_targets)
+                continue; // unplaced, or diff number of @SQ lines per file?
+            if (b->core.flag & BAM_FUNMAP)
+                continue; // as skipped by the pileup interface
+            tid = b->core.tid;
+
+            if (tid != old_tid) { // Next target sequence
+                if (old_tid >= 0) {
+                    cov_sweep_flush(&sweep, HTS_POS_MAX);
+                    if (opt_print_histogram) {
+                        print_hist(file_out, h, stats, old_tid, hist, n_bins, opt_full_utf, opt_plot_coverage);
+                        fputc('\n', file_out);
+                    } else if (opt_print_tabular) {
+                        print_tabular_line(file_out, h, stats, old_tid);
                     }
-                } else {
-                    print_value_warning = 1; // no quality at position
+
+                    if (opt_print_histogram)
+                        memset(hist, 0, n_bins*sizeof(uint32_t));
                 }
-            }
 
-            if (depth_at_pos > 0) {
-                count_base = true;
-                stats[tid].summed_coverage += depth_at_pos;
+                stats[tid].covered = true;
+                if (!opt_reg)
+                    stats[tid].end = sam_hdr_tid2len(h, tid);
+
+                if (opt_print_histogram) {
+                    n_bins = opt_n_bins > stats[tid].end-stats[tid].beg? stats[tid].end-stats[tid].beg : opt_n_bins;
+                    stats[tid].bin_width = (stats[tid].end-stats[tid].beg) / n_bins;
+                }
+
+                cov_sweep_reset(&sweep, &stats[tid],
+                                opt_print_histogram ? hist : NULL, n_bins,
+                                b->core.pos);
+                old_tid = tid;
             }
 
-            if(current_bin < n_bins && opt_plot_coverage) {
-                hist[current_bin] += depth_at_pos;
+            if (cov_sweep_add(&sweep, b, file, opt_min_baseQ,
+                              &print_value_warning) < 0) {
+                ret = -1;
+                break;
             }
         }
-        if (count_base) {
-            stats[tid].n_covered_bases++;
-            if (opt_print_histogram && current_bin < n_bins && !opt_plot_coverage)
-                ++(hist[current_bin]); // Histogram based on breadth of coverage
-        }
-    }
+        if (old_tid >= 0)
+            cov_sweep_flush(&sweep, HTS_POS_MAX);
 
-    if (tid == -1 && opt_reg && *opt_reg != '*')
-        // Region specified but no data covering it.
-        tid = data[0]->iter->tid;
+        if (tid == -1 && opt_reg && *opt_reg != '*')
+            // Region specified but no data covering it.
+            tid = data[0]->iter->tid;
 
-    if (tid < n_targets && tid >=0) {
-        if (opt_print_histogram) {
-            print_hist(file_out, h, stats, tid, hist, n_bins, opt_full_utf, opt_plot_coverage);
-        } else if (opt_print_tabular) {
-            print_tabular_line(file_out, h, stats, tid);
+        if (tid < n_targets && tid >=0) {
+            if (opt_print_histogram) {
+                print_hist(file_out, h, stats, tid, hist, n_bins, opt_full_utf, opt_plot_coverage);
+            } else if (opt_print_tabular) {
+                print_tabular_line(file_out, h, stats, tid);
+            }
         }
     }
 
@@ -671,11 +1234,14 @@ int main_coverage(int argc, char *argv[]) {
     if (ret < 0) status = EXIT_FAILURE;
 
 coverage_end:
-    if (n_plp) free(n_plp);
-    if (plp) free(plp);
-    if (mplp) bam_mplp_destroy(mplp);
+    cov_sweep_destroy(&sweep);
 
     if (hist) free(hist);
+    if (hists) {
+        for (i = 0; stats && i < sam_hdr_nref(h); i++)
+            free(hists[i]);
+        free(hists);
+    }
     if (stats) free(stats);
 
     // Close files and free data structures
@@ -32,12 +32,14 @@ DEALINGS IN THE SOFTWARE.  */
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 
 #include "htslib/bgzf.h"
 #include "htslib/sam.h"
 #include "htslib/cram.h"
 #include "htslib/kstring.h"
 #include "htslib/khash.h"
+#include "htslib/thread_pool.h"
 #include "samtools.h"
 #include "sam_opts.h"
 #include "htslib/hfile.h"
@@ -244,6 +246,8 @@ static char *comp_method2str[COMP_MAX] = {
 typedef struct {
     int64_t csize[COMP_MAX];
     int64_t usize[COMP_MAX];
+    int64_t nblk[COMP_MAX];
+    double  dtime[COMP_MAX]; // seconds spent uncompressing, if profiling
 } cusize_t;
 
 static int64_t total_csize(cusize_t *cu) {
@@ -262,6 +266,14 @@ static int64_t total_usize(cusize_t *cu) {
     return tot;
 }
 
+static double total_dtime(cusize_t *cu) {
+    int i;
+    double tot = 0;
+    for (i = 0; i < COMP_MAX; i++)
+        tot += cu->dtime[i];
+    return tot;
+}
+
 // cusize_t array and sorting by compressed size
 static cusize_t *sort_cusize_global; // avoids a messy extra data type
 static int sort_cusize_compar(const void *i1, const void *i2) {
@@ -296,11 +308,56 @@ static int cu_compar(const void *i1, const void *i2) {
 /*----------------------------------------------------------------------
  * Main cram_size reporting and aggregation
  */
+
+// Queries the data series stored in Content ID cid in any of the nmaps
+// maps.  When there are several, as from a threaded run, the union is
+// returned in *ds, which is grown as needed.
+static int *cid2ds_query(cram_cid2ds_t **cid2ds, int nmaps, int cid, int *n,
+                         int **ds, int *mds) {
+    int i, j, k, nd, *d;
+
+    if (nmaps == 1)
+        return cram_cid2ds_query(cid2ds[0], cid, n);
+
+    *n = 0;
+    for (i = 0; i < nmaps; i++) {
+        d = cram_cid2ds_query(cid2ds[i], cid, &nd);
+        for (j = 0; j < nd; j++) {
+            for (k = 0; k < *n; k++)
+                if ((*ds)[k] == d[j])
+                    break;
+            if (k < *n)
+                continue;
+            if (*n >= *mds) {
+                int m = *mds ? *mds * 2 : 16;
+                int *tmp = realloc(*ds, m * sizeof(**ds));
+                if (!tmp)
+                    return *ds;
+                *ds = tmp;
+                *mds = m;
+            }
+            (*ds)[(*n)++] = d[j];
+        }
+    }
+
+    return *ds;
+}
+
+static void report_ds(FILE *outfp, int d) {
+    if (d > 65535)
+        fprintf(outfp, " %c%c%c", d>>16, (d>>8)&0xff, d&0xff);
+    else
+        fprintf(outfp, " %c%c", (d>>8)&0xff, d&0xff);
+}
+
 static off_t report_size(FILE *outfp, int verbose, int ref_seq_blk,
-                         khash_t(cu) *cu_size, cram_cid2ds_t *cid2ds) {
-    if (!cu_size || !cid2ds)
+                         khash_t(cu) *cu_size, cram_cid2ds_t **cid2ds,
+                         int nmaps) {
+    if (!cu_size || !nmaps)
         return -1;
 
+    int *ds = NULL, mds = 0;
+
     khiter_t k;
     off_t tot_size = 0;
 
@@ -349,14 +406,10 @@ static off_t report_size(FILE *outfp, int verbose, int ref_seq_blk,
                 else
                     fprintf(outfp, " %6.2f%% %-11s",f, comp_method2str[comp]);
 
-                int n, *dsa = cram_cid2ds_query(cid2ds, kh_key(cu_size, k), &n);
-                for (j = 0; j < n; j++) {
-                    int d = dsa[j];
-                    if (d > 65535)
-                        fprintf(outfp, " %c%c%c", d>>16, (d>>8)&0xff, d&0xff);
-                    else
-                        fprintf(outfp, " %c%c", (d>>8)&0xff, d&0xff);
-                }
+                int n, *dsa = cid2ds_query(cid2ds, nmaps, kh_key(cu_size, k),
+                                           &n, &ds, &mds);
+                for (j = 0; j < n; j++)
+                    report_ds(outfp, dsa[j]);
             }
         } else {
             // aggregate by compression type.
@@ -384,14 +437,10 @@ static off_t report_size(FILE *outfp, int verbose, int ref_seq_blk,
             else
                 fprintf(outfp, " %6.2f%% %-7s", f, cstr);
 
-            int n, j, *dsa = cram_cid2ds_query(cid2ds, kh_key(cu_size, k), &n);
-            for (j = 0; j < n; j++) {
-                int d = dsa[j];
-                if (d > 65535)
-                    fprintf(outfp, " %c%c%c", d>>16, (d>>8)&0xff, d&0xff);
-                else
-                    fprintf(outfp, " %c%c", (d>>8)&0xff, d&0xff);
-            }
+            int n, j, *dsa = cid2ds_query(cid2ds, nmaps, kh_key(cu_size, k),
+                                          &n, &ds, &mds);
+            for (j = 0; j < n; j++)
+                report_ds(outfp, dsa[j]);
         }
 
         if ((int)kh_key(cu_size, k) >= 0 &&
@@ -403,187 +452,519 @@ static off_t report_size(FILE *outfp, int verbose, int ref_seq_blk,
         tot_size += total_csize(&kh_value(cu_size, k));
     }
 
+    free(ds);
     free(sorted_blocks);
 
     return tot_size;
 }
 
-/* Main processing loop */
-static int cram_size(hFILE *hf_in, samFile *in, sam_hdr_t *h, FILE *outfp,
-                     int verbose, int encodings) {
-    cram_fd *in_c;
-    cram_container *c = NULL;
-    cram_block *blk = NULL;
-    cram_block_slice_hdr *shdr = NULL;
+/*----------------------------------------------------------------------
+ * Decode cost profiling
+ */
+
+static double cs_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report_rate(FILE *outfp, int64_t usize, double t) {
+    fprintf(outfp, " %11.4f", t);
+    if (t > 0)
+        fprintf(outfp, " %9.1f", usize / t / 1e6);
+    else
+        fprintf(outfp, " %9s", "-");
+}
+
+// Reports the time spent uncompressing blocks, first per compression
+// method and then per Content ID with its associated data series.
+static int report_profile(FILE *outfp, khash_t(cu) *cu_size,
+                          cram_cid2ds_t **cid2ds, int nmaps) {
+    int64_t nblk[COMP_MAX] = {0}, csize[COMP_MAX] = {0}, usize[COMP_MAX] = {0};
+    double dtime[COMP_MAX] = {0};
+    int *sorted_blocks, nblocks = 0, i, c, *ds = NULL, mds = 0;
     khiter_t k;
-    int ret;
-    cram_cid2ds_t *cid2ds = NULL;
-    khash_t(cu) *cu_size = kh_init(cu);
-    int ref_seq_blk_used = -1;
-    int64_t nseqs = 0, nbases = 0, ncont = 0, nslice = 0;
 
-    if (!in->is_cram) {
-        print_error("cram_size", "Input is not a CRAM file");
-        goto err;
+    if (!(sorted_blocks = malloc(kh_end(cu_size)*sizeof(int))))
+        return -1;
+    for (k = kh_begin(cu_size); k != kh_end(cu_size); k++) {
+        if (!kh_exist(cu_size, k))
+            continue;
+        sorted_blocks[nblocks++] = k;
+        for (c = 0; c < COMP_MAX; c++) {
+            nblk[c]  += kh_value(cu_size, k).nblk[c];
+            csize[c] += kh_value(cu_size, k).csize[c];
+            usize[c] += kh_value(cu_size, k).usize[c];
+            dtime[c] += kh_value(cu_size, k).dtime[c];
+        }
     }
-    in_c = in->fp.cram; // low level htslib abuse?
-    while ((c = cram_read_container(in_c))) {
-        if (cram_container_is_empty(in_c)) {
-            cram_block *blk;
-            // Container compression header
-            if (!(blk = cram_read_block(in_c)))
-                goto err;
-            cram_free_block(blk);
-            cram_free_container(c);
-            c = NULL; blk = NULL;
+    global_cu_hash = cu_size;
+    qsort(sorted_blocks, nblocks, sizeof(int), cu_compar);
+
+    fprintf(outfp, "\n%-18s %9s %12s %12s %11s %9s\n", "#   Method",
+            "Blocks", "Uncomp.size", "Comp.size", "Time(s)", "MB/s");
+    for (c = 0; c < COMP_MAX; c++) {
+        if (!nblk[c])
+            continue;
+        fprintf(outfp, "CODEC %-12s %9"PRId64" %12"PRId64" %12"PRId64,
+                comp_method2str[c], nblk[c], usize[c], csize[c]);
+        report_rate(outfp, usize[c], dtime[c]);
+        fprintf(outfp, "\n");
+    }
+
+    fprintf(outfp, "\n%-14s %12s %11s %9s  Data_series\n", "#   Content_ID",
+            "Uncomp.size", "Time(s)", "MB/s");
+    for (i = 0; i < nblocks; i++) {
+        cusize_t *cu;
+        k = sorted_blocks[i];
+        cu = &kh_value(cu_size, k);
+
+        if ((int)kh_key(cu_size, k) < 0)
+            fprintf(outfp, "DTIME %8s", "CORE");
+        else
+            fprintf(outfp, "DTIME %8d", kh_key(cu_size, k));
+        fprintf(outfp, " %12"PRId64, total_usize(cu));
+        report_rate(outfp, total_usize(cu), total_dtime(cu));
+        fprintf(outfp, " ");
+
+        int n, j, *dsa = cid2ds_query(cid2ds, nmaps, kh_key(cu_size, k),
+                                      &n, &ds, &mds);
+        for (j = 0; j < n; j++)
+            report_ds(outfp, dsa[j]);
+        fprintf(outfp, "\n");
+    }
+
+    free(ds);
+    free(sorted_blocks);
+    return 0;
+}
+
+/*----------------------------------------------------------------------
+ * Per container accumulation of statistics
+ */
+
+typedef struct {
+    khash_t(cu) *cu_size;
+    cram_cid2ds_t *cid2ds;
+    int ref_seq_blk_used;
+    int64_t nseqs, nbases, ncont, nslice;
+} size_stats_t;
+
+static int size_stats_init(size_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    st->ref_seq_blk_used = -1;
+    return (st->cu_size = kh_init(cu)) ? 0 : -1;
+}
+
+static void size_stats_free(size_stats_t *st) {
+    if (st->cu_size)
+        kh_destroy(cu, st->cu_size);
+    if (st->cid2ds)
+        cram_cid2ds_free(st->cid2ds);
+    st->cu_size = NULL;
+    st->cid2ds = NULL;
+}
+
+// Records use of an embedded reference block in ref_seq_blk.
+static void size_stats_ref(size_stats_t *st, int ref_seq_blk) {
+    // Check it's consistent (if used this is an almost guaranteed
+    // certainty, so we take the easy route).
+    if (ref_seq_blk < 0)
+        return;
+    if (st->ref_seq_blk_used == -1)
+        st->ref_seq_blk_used = ref_seq_blk;
+    else if (st->ref_seq_blk_used != ref_seq_blk)
+        fprintf(stderr, "Embedded reference is not consistently using the same Content-Id.\n"
+                "Reported figures for reference will be invalid.\n");
+}
+
+// Adds the statistics in from to those in to, apart from cid2ds.
+// Returns 0 on success, -1 on failure.
+static int size_stats_merge(size_stats_t *to, size_stats_t *from) {
+    khiter_t k, k2;
+    int ret, c;
+
+    for (k = kh_begin(from->cu_size); k != kh_end(from->cu_size); k++) {
+        if (!kh_exist(from->cu_size, k))
             continue;
+        k2 = kh_put(cu, to->cu_size, kh_key(from->cu_size, k), &ret);
+        if (ret < 0)
+            return -1;
+        if (ret != 0) {
+            kh_value(to->cu_size, k2) = kh_value(from->cu_size, k);
+            continue;
+        }
+        cusize_t *a = &kh_value(to->cu_size, k2);
+        cusize_t *b = &kh_value(from->cu_size, k);
+        for (c = 0; c < COMP_MAX; c++) {
+            a->csize[c] += b->csize[c];
+            a->usize[c] += b->usize[c];
+            a->nblk[c]  += b->nblk[c];
+            a->dtime[c] += b->dtime[c];
         }
+    }
 
-        nseqs  += cram_container_get_num_records(c);
-        nbases += cram_container_get_num_bases(c);
+    size_stats_ref(to, from->ref_seq_blk_used);
+    to->nseqs  += from->nseqs;
+    to->nbases += from->nbases;
+    to->ncont  += from->ncont;
+    to->nslice += from->nslice;
 
-        // Container compression header
-        int32_t num_slices;
-        if (!(blk = cram_read_block(in_c)))
-            goto err;
+    return 0;
+}
 
-        // Decode compression header...
-        cram_block_compression_hdr *chdr;
-        chdr = cram_decode_compression_header(in_c, blk);
+// Accumulates the sizes of the blocks in container c, which has just been
+// read from in_c.  If encodings_fp is set, the encodings are described
+// there.  If profile is set, each block is also uncompressed and timed.
+// Returns 0 on success, -1 on failure.
+static int size_container(cram_fd *in_c, cram_container *c, size_stats_t *st,
+                          FILE *encodings_fp, int profile) {
+    cram_block *blk = NULL;
+    cram_block_slice_hdr *shdr = NULL;
+    cram_block_compression_hdr *chdr;
+    int32_t num_slices;
+    khiter_t k;
+    int i, j, ret;
 
-        if (encodings) {
-            kstring_t ks = KS_INITIALIZE;
-            if (cram_describe_encodings(chdr, &ks) < 0)
-                goto err;
+    st->nseqs  += cram_container_get_num_records(c);
+    st->nbases += cram_container_get_num_bases(c);
 
-            fprintf(outfp, "Container encodings\n%s\n", ks_str(&ks));
+    // Container compression header
+    if (!(blk = cram_read_block(in_c)))
+        goto err;
+
+    // Decode compression header...
+    if (!(chdr = cram_decode_compression_header(in_c, blk)))
+        goto err;
 
-            ks_free(&ks);
+    if (encodings_fp) {
+        kstring_t ks = KS_INITIALIZE;
+        if (cram_describe_encodings(chdr, &ks) < 0) {
+            cram_free_compression_header(chdr);
+            goto err;
         }
 
-        cid2ds = cram_update_cid2ds_map(chdr, cid2ds);
+        fprintf(encodings_fp, "Container encodings\n%s\n", ks_str(&ks));
 
+        ks_free(&ks);
+    }
+
+    st->cid2ds = cram_update_cid2ds_map(chdr, st->cid2ds);
+
+    cram_free_block(blk);
+    blk = NULL;
+
+    cram_free_compression_header(chdr);
+
+    // Container num_blocks can be invalid, due to a bug.
+    // Instead we iterate in slice context instead.
+    (void)cram_container_get_landmarks(c, &num_slices);
+    st->ncont++;
+    st->nslice += num_slices;
+
+    for (i = 0; i < num_slices; i++) {
+        // Slice header
+        if (!(blk = cram_read_block(in_c)))
+            goto err;
+        if (!(shdr = cram_decode_slice_header(in_c, blk)))
+            goto err;
         cram_free_block(blk);
         blk = NULL;
 
-        cram_free_compression_header(chdr);
+        int num_blocks = cram_slice_hdr_get_num_blocks(shdr);
 
-        // Container num_blocks can be invalid, due to a bug.
-        // Instead we iterate in slice context instead.
-        (void)cram_container_get_landmarks(c, &num_slices);
-        ncont++;
-        nslice += num_slices;
+        // Embedded reference.
+        size_stats_ref(st, cram_slice_hdr_get_embed_ref_id(shdr));
 
-        int i, j;
-        for (i = 0; i < num_slices; i++) {
-            // Slice header
+        // Slice data blocks
+        for (j = 0; j < num_blocks; j++) {
+            // read and discard, unless it's the ref-ID block
             if (!(blk = cram_read_block(in_c)))
                 goto err;
-            if (!(shdr = cram_decode_slice_header(in_c, blk)))
+
+            int32_t csize = cram_block_get_comp_size(blk);
+            int32_t usize = cram_block_get_uncomp_size(blk);
+            int cid = cram_block_get_content_id(blk);
+            enum cram_block_method method = cram_block_get_method(blk);
+
+            // Expand comp to the internal sub-formats, eg
+            // rANS order-0/1, PACK+RLE, etc.
+            cram_method_details *cm;
+            cm = cram_expand_method(cram_block_get_data(blk),
+                                    cram_block_get_comp_size(blk),
+                                    method);
+            if (!cm)
+                goto err;
+            enum comp_expanded comp
+                = comp_method2expanded(cm);
+            free(cm);
+
+            double dtime = 0;
+            if (profile) {
+                double t = cs_now();
+                if (cram_uncompress_block(blk) != 0)
+                    goto err;
+                dtime = cs_now() - t;
+            }
+
+            k = kh_put(cu, st->cu_size, cid, &ret);
+            if (ret < 0)
                 goto err;
+            if (ret != 0)
+                memset(&kh_value(st->cu_size, k), 0, sizeof(cusize_t));
+            kh_value(st->cu_size, k).csize[comp] += csize;
+            kh_value(st->cu_size, k).usize[comp] += usize;
+            kh_value(st->cu_size, k).nblk[comp]++;
+            kh_value(st->cu_size, k).dtime[comp] += dtime;
+
             cram_free_block(blk);
             blk = NULL;
+        }
+        cram_free_slice_header(shdr);
+        shdr = NULL;
+    }
 
-            int ref_seq_blk = cram_slice_hdr_get_embed_ref_id(shdr);
-            int num_blocks = cram_slice_hdr_get_num_blocks(shdr);
-
-            // Embedded reference.  Check it's consistent (if used this is
-            // an almost guaranteed certainty, so we take the easy route).
-            if (ref_seq_blk >= 0) {
-                if (ref_seq_blk_used == -1)
-                    ref_seq_blk_used = ref_seq_blk;
-                else if (ref_seq_blk_used != ref_seq_blk)
-                    fprintf(stderr, "Embedded reference is not consistently using the same Content-Id.\n"
-                            "Reported figures for reference will be invalid.\n");
-            }
-
-            // Slice data blocks
-            for (j = 0; j < num_blocks; j++) {
-                // read and discard, unless it's the ref-ID block
-                if (!(blk = cram_read_block(in_c)))
-                    goto err;
+    return 0;
 
-                int32_t csize = cram_block_get_comp_size(blk);
-                int32_t usize = cram_block_get_uncomp_size(blk);
-                int cid = cram_block_get_content_id(blk);
-                enum cram_block_method method = cram_block_get_method(blk);
-
-                // Expand comp to the internal sub-formats, eg
-                // rANS order-0/1, PACK+RLE, etc.
-                cram_method_details *cm;
-                cm = cram_expand_method(cram_block_get_data(blk),
-                                        cram_block_get_comp_size(blk),
-                                        method);
-                if (!cm)
-                    goto err;
-                enum comp_expanded comp
-                    = comp_method2expanded(cm);
-                free(cm);
+ err:
+    if (blk)
+        cram_free_block(blk);
+    if (shdr)
+        cram_free_slice_header(shdr);
+    return -1;
+}
 
-                k = kh_put(cu, cu_size, cid, &ret);
-                if (ret < 0)
-                    goto err;
-                if (ret == 0) {
-                    kh_value(cu_size, k).csize[comp] += csize;
-                    kh_value(cu_size, k).usize[comp] += usize;
-                } else {
-                    memset(&kh_value(cu_size, k), 0, sizeof(cusize_t));
-                    kh_value(cu_size, k).csize[comp]  = csize;
-                    kh_value(cu_size, k).usize[comp]  = usize;
-                }
+// Reads containers from in_c up to offset end, or to EOF if end is
+// negative.
+// Returns 0 on success, -1 on failure.
+static int size_containers(cram_fd *in_c, off_t end, size_stats_t *st,
+                           FILE *encodings_fp, int profile) {
+    cram_container *c;
 
+    while ((end < 0 || htell(cram_fd_get_fp(in_c)) < end)
+           && (c = cram_read_container(in_c))) {
+        int r = 0;
+        if (cram_container_is_empty(in_c)) {
+            cram_block *blk;
+            // Container compression header
+            if ((blk = cram_read_block(in_c)))
                 cram_free_block(blk);
-                blk = NULL;
-            }
-            cram_free_slice_header(shdr);
-            shdr = NULL;
+            else
+                r = -1;
+        } else {
+            r = size_container(in_c, c, st, encodings_fp, profile);
         }
-
         cram_free_container(c);
-        c = NULL;
+        if (r < 0)
+            return -1;
     }
 
-    off_t tot_size = report_size(outfp, verbose, ref_seq_blk_used,
-                                 cu_size, cid2ds);
-    if (tot_size < 0)
+    return 0;
+}
+
+/*----------------------------------------------------------------------
+ * Threaded processing, using the index to divide the file up
+ */
+
+// A run of containers, from offset start up to end (or EOF if negative).
+typedef struct {
+    const char *fn;
+    off_t start, end;
+    int profile;
+    size_stats_t st;
+    int ret;
+} size_job_t;
+
+static void *size_job(void *arg) {
+    size_job_t *j = (size_job_t *)arg;
+    hFILE *hf;
+    cram_fd *fd;
+
+    j->ret = -1;
+    if (!(hf = hopen(j->fn, "r")))
+        return j;
+    if (!(fd = cram_dopen(hf, j->fn, "r"))) {
+        hclose_abruptly(hf);
+        return j;
+    }
+
+    if (cram_seek(fd, j->start, SEEK_SET) == 0
+        && size_containers(fd, j->end, &j->st, NULL, j->profile) == 0)
+        j->ret = 0;
+
+    if (cram_close(fd) != 0)
+        j->ret = -1;
+    return j;
+}
+
+// Divides the file into runs of containers, as listed in its index, and
+// gathers their statistics in parallel into st.  Each job opens the file
+// itself, so nothing is shared between them.
+// Returns 0 on success, -1 on failure, or 1 if the file has no index.
+static int size_containers_mt(samFile *in, const char *fn, int nthreads,
+                              int profile, size_stats_t *st,
+                              cram_cid2ds_t ***maps, int *nmaps) {
+    cram_fd *in_c = in->fp.cram;
+    hts_tpool *pool = NULL;
+    hts_tpool_process *q = NULL;
+    hts_idx_t *idx;
+    size_job_t *jobs = NULL;
+    int64_t nc;
+    int njobs, i, nsent = 0, ndone = 0, ret = -1;
+
+    if (strcmp(fn, "-") == 0
+        || !(idx = sam_index_load3(in, fn, NULL, HTS_IDX_SILENT_FAIL)))
+        return 1;
+    if ((nc = cram_num_containers(in_c)) <= 0) {
+        hts_idx_destroy(idx);
+        return 1;
+    }
+
+    // Several runs per thread so uneven containers even out
+    njobs = nc < 4 * nthreads ? nc : 4 * nthreads;
+    if (!(jobs = calloc(njobs, sizeof(*jobs))))
+        goto out;
+    for (i = 0; i < njobs; i++) {
+        int64_t a = i * nc / njobs, b = (i+1) * nc / njobs;
+        jobs[i].fn = fn;
+        jobs[i].profile = profile;
+        jobs[i].start = cram_container_num2offset(in_c, a);
+        jobs[i].end = b < nc ? cram_container_num2offset(in_c, b) : -1;
+        if (jobs[i].start < 0 || (b < nc && jobs[i].end < 0)
+            || size_stats_init(&jobs[i].st) < 0)
+            goto out;
+    }
+
+    if (!(pool = hts_tpool_init(nthreads))
+        || !(q = hts_tpool_process_init(pool, njobs, 0)))
+        goto out;
+    for (nsent = 0; nsent < njobs; nsent++)
+        if (hts_tpool_dispatch(pool, q, size_job, &jobs[nsent]) < 0)
+            goto out;
+
+    // Collect in file order, so merges match the serial code
+    while (ndone < njobs) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(q);
+        if (!r)
+            goto out;
+        ndone++;
+        size_job_t *j = (size_job_t *)hts_tpool_result_data(r);
+        hts_tpool_delete_result(r, 0);
+        if (j->ret < 0 || size_stats_merge(st, &j->st) < 0)
+            goto out;
+    }
+
+    if (!(*maps = calloc(njobs, sizeof(**maps))))
+        goto out;
+    for (i = 0; i < njobs; i++) {
+        if (jobs[i].st.cid2ds)
+            (*maps)[(*nmaps)++] = jobs[i].st.cid2ds;
+        jobs[i].st.cid2ds = NULL;
+    }
+    ret = 0;
+
+ out:
+    if (q) {
+        for (; ndone < nsent; ndone++) {
+            hts_tpool_result *r = hts_tpool_next_result_wait(q);
+            if (!r)
+                break;
+            hts_tpool_delete_result(r, 0);
+        }
+        hts_tpool_process_destroy(q);
+    }
+    if (pool)
+        hts_tpool_destroy(pool);
+    if (jobs)
+        for (i = 0; i < njobs; i++)
+            size_stats_free(&jobs[i].st);
+    free(jobs);
+    hts_idx_destroy(idx);
+    return ret;
+}
+
+/* Main processing loop */
+static int cram_size(hFILE *hf_in, samFile *in, const char *fn, sam_hdr_t *h,
+                     FILE *outfp, int verbose, int encodings, int profile,
+                     int nthreads) {
+    size_stats_t st;
+    cram_cid2ds_t **maps = NULL;
+    int nmaps = 0, i, r = 1;
+    off_t end, tot_size;
+
+    if (size_stats_init(&st) < 0)
+        return -1;
+
+    if (!in->is_cram) {
+        print_error("cram_size", "Input is not a CRAM file");
         goto err;
+    }
 
-    kh_destroy(cu, cu_size);
-    cram_cid2ds_free(cid2ds);
+    // The encodings are listed per container, so need them in order
+    if (nthreads > 0 && !encodings
+        && (r = size_containers_mt(in, fn, nthreads, profile, &st,
+                                   &maps, &nmaps)) < 0)
+        goto err;
 
-    off_t end = htell(hf_in);
+    if (r > 0) {
+        // Serially, either by request or for want of an index
+        if (size_containers(in->fp.cram, -1, &st,
+                            encodings ? outfp : NULL, profile) < 0)
+            goto err;
+        end = htell(hf_in);
+    } else {
+        end = hseek(hf_in, 0, SEEK_END);
+    }
+
+    if (!maps) {
+        maps = &st.cid2ds;
+        nmaps = st.cid2ds != NULL;
+    }
+    tot_size = report_size(outfp, verbose, st.ref_seq_blk_used,
+                           st.cu_size, maps, nmaps);
+    if (tot_size < 0)
+        goto err;
+    if (profile && report_profile(outfp, st.cu_size, maps, nmaps) < 0)
+        goto err;
 
     fprintf(outfp, "\n");
-    fprintf(outfp, "Number of containers  %18"PRId64"\n", ncont);
-    fprintf(outfp, "Number of slices      %18"PRId64"\n", nslice);
-    fprintf(outfp, "Number of sequences   %18"PRId64"\n", nseqs);
-    fprintf(outfp, "Number of bases       %18"PRId64"\n", nbases);
+    fprintf(outfp, "Number of containers  %18"PRId64"\n", st.ncont);
+    fprintf(outfp, "Number of slices      %18"PRId64"\n", st.nslice);
+    fprintf(outfp, "Number of sequences   %18"PRId64"\n", st.nseqs);
+    fprintf(outfp, "Number of bases       %18"PRId64"\n", st.nbases);
     fprintf(outfp, "Total file size       %18"PRId64"\n", (int64_t) end);
     fprintf(outfp, "Format overhead size  %18"PRId64"\n", (int64_t) (end - tot_size));
 
+    if (maps != &st.cid2ds) {
+        for (i = 0; i < nmaps; i++)
+            cram_cid2ds_free(maps[i]);
+        free(maps);
+    }
+    size_stats_free(&st);
+
     return 0;
 
  err:
     // Report anyway so we can get stats on partial files, but be
     // sure to error too.
-    report_size(outfp, verbose, ref_seq_blk_used, cu_size, cid2ds);
+    if (!maps)
+        report_size(outfp, verbose, st.ref_seq_blk_used, st.cu_size,
+                    &st.cid2ds, st.cid2ds != NULL);
 
     print_error("cram_size", "Failed in decoding CRAM file");
-    if (blk)
-        cram_free_block(blk);
-    if (shdr)
-        cram_free_slice_header(shdr);
-    if (c)
-        cram_free_container(c);
-    if (cid2ds)
-        cram_cid2ds_free(cid2ds);
+    if (maps && maps != &st.cid2ds) {
+        for (i = 0; i < nmaps; i++)
+            cram_cid2ds_free(maps[i]);
+        free(maps);
+    }
+    size_stats_free(&st);
 
     return -1;
 }
 
 /* main() for cram_size */
 int main_cram_size(int argc, char *argv[]) {
-    int c, usage = 0, verbose = 0, encodings = 0;
+    int c, usage = 0, verbose = 0, encodings = 0, profile = 0;
     sam_hdr_t *h = 0;
     hFILE *hf_in = NULL;
     samFile *in = NULL;
@@ -594,13 +975,14 @@ int main_cram_size(int argc, char *argv[]) {
         {"output", required_argument, NULL, 'o'},
         {"verbose",  no_argument, NULL, 'v'},
         {"encodings", no_argument, NULL, 'e'},
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', '-', '-'),
+        {"decode-profile", no_argument, NULL, 'd'},
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', '-', '@', '-', '-'),
         { NULL, 0, NULL, 0 }
     };
 
     sam_global_args_init(&ga);
 
-    while ((c = getopt_long(argc, argv, "vo:e", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "vo:ed@:", lopts, NULL)) >= 0) {
         switch (c) {
         case 'o':
             if (!(outfp = fopen(optarg, "w"))) {
@@ -617,6 +999,10 @@ int main_cram_size(int argc, char *argv[]) {
             encodings++;
             break;
 
+        case 'd':
+            profile = 1;
+            break;
+
         default:
             if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
             /* else fall-through */
@@ -625,7 +1011,7 @@ int main_cram_size(int argc, char *argv[]) {
     }
 
     if ((optind == argc && isatty(0)) || usage) {
-        printf("Usage: samtools cram_size [-ve] [-o out.size] [in.cram]\n");
+        printf("Usage: samtools cram_size [-ved] [-@ threads] [-o out.size] [in.cram]\n");
         return 0;
     }
 
@@ -647,7 +1033,8 @@ int main_cram_size(int argc, char *argv[]) {
     if (!(h = sam_hdr_read(in)))
         goto err;
 
-    int ret = cram_size(hf_in, in, h, outfp, verbose, encodings);
+    int ret = cram_size(hf_in, in, fn, h, outfp, verbose, encodings, profile,
+                        ga.nthreads);
     sam_hdr_destroy(h);
     sam_close(in);
     if (outfp != stdout)
@@ -179,7 +179,7 @@ int main_cut_target(int argc, char *argv[])
 
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 'f', '-'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 'f', '-', '-', '-'),
         { NULL, 0, NULL, 0 }
     };
 
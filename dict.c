@@ -32,8 +32,13 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/khash.h"
 #include "htslib/kseq.h"
 #include "htslib/hts.h"
+#include "htslib/kstring.h"
+#include "htslib/thread_pool.h"
 #include "samtools.h"
 
+// Read buffer size for the input
+#define DICT_BUFFER (1 << 20)
+
 KHASH_SET_INIT_STR(str)
 KSEQ_INIT(gzFile, gzread)
 
@@ -41,25 +46,110 @@ typedef struct _args_t
 {
     char *output_fname, *alt_fname;
     char *assembly, *species, *uri;
-    int  alias, header;
+    int  alias, header, nthreads;
     khash_t(str) *is_alt;
 }
 args_t;
 
-static void write_dict(const char *fn, args_t *args)
+// One sequence to checksum.  The sequence is taken over from kseq, so
+// hashing (on a thread if there are any) needn't copy it.
+typedef struct {
+    kstring_t name, seq;
+    int len;
+    char hex[33];
+}
+dict_job_t;
+
+static void *dict_hash(void *arg)
 {
+    dict_job_t *job = (dict_job_t *) arg;
     hts_md5_context *md5;
-    int l, i, k;
+    unsigned char digest[16];
+    size_t i, k;
+
+    for (i = k = 0; i < job->seq.l; ++i) {
+        if (job->seq.s[i] >= '!' && job->seq.s[i] <= '~')
+            job->seq.s[k++] = toupper(job->seq.s[i]);
+    }
+    job->len = k;
+    if (!(md5 = hts_md5_init())) {
+        job->len = -1;
+        return job;
+    }
+    hts_md5_update(md5, (unsigned char*)job->seq.s, k);
+    hts_md5_final(digest, md5);
+    hts_md5_hex(job->hex, digest);
+    hts_md5_destroy(md5);
+
+    return job;
+}
+
+static void write_sq(FILE *out, args_t *args, const char *real_path,
+                     dict_job_t *job)
+{
+    const char *sname = job->name.s;
+
+    fprintf(out, "@SQ\tSN:%s\tLN:%d\tM5:%s", sname, job->len, job->hex);
+    if (args->is_alt && kh_get(str, args->is_alt, sname) != kh_end(args->is_alt))
+        fprintf(out, "\tAH:*");
+    if (args->alias) {
+        const char *name = sname;
+        if (strncmp(name, "chr", 3) == 0) {
+            name += 3;
+            fprintf(out, "\tAN:%s", name);
+        }
+        else
+            fprintf(out, "\tAN:chr%s", name);
+
+        if (strcmp(name, "M") == 0)
+            fprintf(out, ",chrMT,MT");
+        else if (strcmp(name, "MT") == 0)
+            fprintf(out, ",chrM,M");
+    }
+    if (args->uri)
+        fprintf(out, "\tUR:%s", args->uri);
+    else if (real_path)
+        fprintf(out, "\tUR:file://%s", real_path);
+    if (args->assembly) fprintf(out, "\tAS:%s", args->assembly);
+    if (args->species) fprintf(out, "\tSP:%s", args->species);
+    fprintf(out, "\n");
+}
+
+// Writes out the oldest job in the ring, once hashed.
+static void write_next(FILE *out, args_t *args, const char *real_path,
+                       hts_tpool_process *q, dict_job_t *job)
+{
+    if (q) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(q);
+        if (!r) {
+            print_error("dict", "Failed to hash sequence");
+            exit(1);
+        }
+        hts_tpool_delete_result(r, 0);
+    }
+    if (job->len < 0) {
+        print_error("dict", "Failed to hash sequence");
+        exit(1);
+    }
+    write_sq(out, args, real_path, job);
+}
+
+static void write_dict(const char *fn, args_t *args)
+{
+    int l, njobs, next = 0, in_flight = 0, i;
     gzFile fp;
     kseq_t *seq;
-    unsigned char digest[16];
-    char hex[33];
+    hts_tpool *pool = NULL;
+    hts_tpool_process *q = NULL;
+    dict_job_t *jobs;
+    char *real_path = NULL;
 
     fp = strcmp(fn, "-") ? gzopen(fn, "r") : gzdopen(fileno(stdin), "r");
     if (fp == 0) {
         print_error_errno("dict", "Cannot open %s", fn);
         exit(1);
     }
+    gzbuffer(fp, DICT_BUFFER);
     FILE *out = stdout;
     if (args->output_fname) {
         out = fopen(args->output_fname, "w");
@@ -69,54 +159,66 @@ static void write_dict(const char *fn, args_t *args)
         }
     }
 
-    if (!(md5 = hts_md5_init()))
+    // Sequences are read in order and hashed by the pool, with the
+    // results written out in the same order.
+    if (args->nthreads > 0) {
+        if (!(pool = hts_tpool_init(args->nthreads))
+            || !(q = hts_tpool_process_init(pool, 2 * args->nthreads, 0))) {
+            print_error("dict", "Failed to create thread pool");
+            exit(1);
+        }
+    }
+    njobs = q ? 2 * args->nthreads : 1;
+    if (!(jobs = calloc(njobs, sizeof(*jobs)))) {
+        print_error_errno("dict", "Out of memory");
         exit(1);
+    }
+
+    if (!args->uri && strcmp(fn, "-") != 0) {
+#ifdef _WIN32
+        real_path = _fullpath(NULL, fn, PATH_MAX);
+#else
+        real_path = realpath(fn, NULL);
+#endif
+    }
 
     seq = kseq_init(fp);
     if (args->header) fprintf(out, "@HD\tVN:1.0\tSO:unsorted\n");
     while ((l = kseq_read(seq)) >= 0) {
-        for (i = k = 0; i < seq->seq.l; ++i) {
-            if (seq->seq.s[i] >= '!' && seq->seq.s[i] <= '~')
-                seq->seq.s[k++] = toupper(seq->seq.s[i]);
+        if (in_flight == njobs) {
+            write_next(out, args, real_path, q, &jobs[(next + njobs - in_flight) % njobs]);
+            in_flight--;
         }
-        hts_md5_reset(md5);
-        hts_md5_update(md5, (unsigned char*)seq->seq.s, k);
-        hts_md5_final(digest, md5);
-        hts_md5_hex(hex, digest);
-        fprintf(out, "@SQ\tSN:%s\tLN:%d\tM5:%s", seq->name.s, k, hex);
-        if (args->is_alt && kh_get(str, args->is_alt, seq->name.s) != kh_end(args->is_alt))
-            fprintf(out, "\tAH:*");
-        if (args->alias) {
-            const char *name = seq->name.s;
-            if (strncmp(name, "chr", 3) == 0) {
-                name += 3;
-                fprintf(out, "\tAN:%s", name);
-            }
-            else
-                fprintf(out, "\tAN:chr%s", name);
 
-            if (strcmp(name, "M") == 0)
-                fprintf(out, ",chrMT,MT");
-            else if (strcmp(name, "MT") == 0)
-                fprintf(out, ",chrM,M");
-        }
-        if (args->uri)
-            fprintf(out, "\tUR:%s", args->uri);
-        else if (strcmp(fn, "-") != 0) {
-#ifdef _WIN32
-            char *real_path = _fullpath(NULL, fn, PATH_MAX);
-#else
-            char *real_path = realpath(fn, NULL);
-#endif
-            fprintf(out, "\tUR:file://%s", real_path);
-            free(real_path);
+        dict_job_t *job = &jobs[next];
+        kstring_t tmp;
+        tmp = job->name; job->name = seq->name; seq->name = tmp;
+        tmp = job->seq;  job->seq  = seq->seq;  seq->seq  = tmp;
+        if (q) {
+            if (hts_tpool_dispatch(pool, q, dict_hash, job) < 0) {
+                print_error("dict", "Failed to hash sequence");
+                exit(1);
+            }
+        } else {
+            dict_hash(job);
         }
-        if (args->assembly) fprintf(out, "\tAS:%s", args->assembly);
-        if (args->species) fprintf(out, "\tSP:%s", args->species);
-        fprintf(out, "\n");
+        next = (next + 1) % njobs;
+        in_flight++;
+    }
+    while (in_flight > 0) {
+        write_next(out, args, real_path, q, &jobs[(next + njobs - in_flight) % njobs]);
+        in_flight--;
     }
     kseq_destroy(seq);
-    hts_md5_destroy(md5);
+
+    if (q) hts_tpool_process_destroy(q);
+    if (pool) hts_tpool_destroy(pool);
+    for (i = 0; i < njobs; i++) {
+        ks_free(&jobs[i].name);
+        ks_free(&jobs[i].seq);
+    }
+    free(jobs);
+    free(real_path);
 
     if (args->output_fname) fclose(out);
     gzclose(fp);
@@ -163,6 +265,7 @@ static int dict_usage(void)
     fprintf(stderr, "         -o, --output FILE     file to write out dict file [stdout]\n");
     fprintf(stderr, "         -s, --species STR     species\n");
     fprintf(stderr, "         -u, --uri STR         URI [file:///abs/path/to/file.fa]\n");
+    fprintf(stderr, "         -@, --threads INT     number of additional threads for hashing [0]\n");
     fprintf(stderr, "\n");
     return 1;
 }
@@ -183,10 +286,11 @@ int dict_main(int argc, char *argv[])
         {"species", required_argument, NULL, 's'},
         {"uri", required_argument, NULL, 'u'},
         {"output", required_argument, NULL, 'o'},
+        {"threads", required_argument, NULL, '@'},
         {NULL, 0, NULL, 0}
     };
     int c;
-    while ( (c=getopt_long(argc,argv,"?AhHa:l:s:u:o:",loptions,NULL))>0 )
+    while ( (c=getopt_long(argc,argv,"?AhHa:l:s:u:o:@:",loptions,NULL))>0 )
     {
         switch (c)
         {
@@ -197,6 +301,7 @@ int dict_main(int argc, char *argv[])
             case 'u': args->uri = optarg; break;
             case 'o': args->output_fname = optarg; break;
             case 'H': args->header = 0; break;
+            case '@': args->nthreads = atoi(optarg); break;
             case 'h': return dict_usage();
             default: return dict_usage();
         }
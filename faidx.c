@@ -40,6 +40,12 @@ History:
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include <htslib/faidx.h>
 #include <htslib/hts.h>
 #include <htslib/hfile.h>
@@ -217,7 +223,397 @@ exit:
 }
 
 
-static int read_regions_from_file(faidx_t *faid, hFILE *in_file, output *out, const int ignore,
+/*
+ * Batch fetching.  Regions are gathered up, looked up against a memory
+ * mapped copy of an uncompressed FASTA file, and formatted (on the thread
+ * pool if there is one) in order of file offset.  They are then written
+ * out in the order they were given, so the output is the same as from
+ * write_output() above.
+ */
+
+#define BATCH_REGIONS 65536 // regions per batch
+#define BATCH_JOB 256       // regions formatted per pool job
+
+typedef struct {
+    const char *name;
+    hts_pos_t len, line_blen, line_len;
+    int64_t offset;
+} batch_seq_t;
+
+typedef struct {
+    char *name;       // region as given
+    int id;           // index into batch_t::seq, or -1 for write_output()
+    hts_pos_t beg, end, req_end;
+    int64_t key;      // file offset of beg, for sorting
+    kstring_t out;    // formatted record
+} batch_region_t;
+
+typedef struct {
+    const char *data;
+    size_t size;
+    batch_seq_t *seq;
+    int nseq;
+    char *fai_text;   // backing store for batch_seq_t::name
+    batch_region_t *reg;
+    int nreg;
+    int *order;
+    hts_pos_t length;
+    int rev;
+    const char *pos_strand_name, *neg_strand_name;
+    hts_tpool *pool;
+} batch_t;
+
+typedef struct {
+    batch_t *b;
+    int *order;
+    int n;
+    int ret;
+} batch_job_t;
+
+// Loads the .fai for fn into b->seq, checking it matches that in fai.
+// Returns 0 on success, -1 on failure.
+static int batch_load_fai(batch_t *b, faidx_t *fai, const char *fn,
+                          const char *fai_name) {
+    kstring_t path = KS_INITIALIZE, text = KS_INITIALIZE;
+    hFILE *fp = NULL;
+    char buf[65536], *line, *next;
+    ssize_t n;
+    int i, nseq = faidx_nseq(fai), ret = -1;
+
+    if (fai_name)
+        kputs(fai_name, &path);
+    else
+        ksprintf(&path, "%s.fai", fn);
+    if (!path.s || !(fp = hopen(path.s, "r")))
+        goto out;
+    while ((n = hread(fp, buf, sizeof(buf))) > 0)
+        if (kputsn(buf, n, &text) < 0)
+            goto out;
+    if (n < 0 || !text.s || !(b->seq = calloc(nseq, sizeof(*b->seq))))
+        goto out;
+
+    for (i = 0, line = text.s; i < nseq && *line; i++, line = next) {
+        char *tab = strchr(line, '\t'), *end;
+        if (!tab)
+            goto out;
+        next = strchr(line, '\n');
+        next = next ? next + 1 : line + strlen(line);
+        *tab = '\0';
+        b->seq[i].name = line;
+        b->seq[i].len = strtoll(tab + 1, &end, 10);
+        b->seq[i].offset = strtoll(end, &end, 10);
+        b->seq[i].line_blen = strtoll(end, &end, 10);
+        b->seq[i].line_len = strtoll(end, &end, 10);
+        if (strcmp(line, faidx_iseq(fai, i)) != 0
+            || b->seq[i].line_blen <= 0
+            || b->seq[i].line_len < b->seq[i].line_blen)
+            goto out;
+    }
+    if (i != nseq)
+        goto out;
+
+    b->nseq = nseq;
+    b->fai_text = ks_release(&text);
+    ret = 0;
+
+ out:
+    if (fp && hclose(fp) != 0)
+        ret = -1;
+    ks_free(&path);
+    ks_free(&text);
+    return ret;
+}
+
+// Sets b up to batch fetch from the FASTA file fn.
+// Returns 0 on success, or -1 if fn cannot be batched (being compressed,
+// say), in which case the caller should use write_output() as usual.
+static int batch_init(batch_t *b, faidx_t *fai, const char *fn,
+                      const char *fai_name) {
+#ifndef _WIN32
+    struct stat st;
+    void *p;
+    int fd;
+
+    if ((fd = open(fn, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < 2) {
+        close(fd);
+        return -1;
+    }
+    b->size = st.st_size;
+    p = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+    b->data = p;
+
+    // Gzip or bgzf compressed files go through htslib
+    if ((unsigned char)b->data[0] == 0x1f && (unsigned char)b->data[1] == 0x8b)
+        goto fail;
+    if (batch_load_fai(b, fai, fn, fai_name) < 0)
+        goto fail;
+    if (!(b->reg = calloc(BATCH_REGIONS, sizeof(*b->reg)))
+        || !(b->order = malloc(BATCH_REGIONS * sizeof(*b->order))))
+        goto fail;
+
+    return 0;
+
+ fail:
+    munmap((void *)b->data, b->size);
+    b->data = NULL;
+    free(b->seq);
+    b->seq = NULL;
+    free(b->fai_text);
+    b->fai_text = NULL;
+    free(b->reg);
+    b->reg = NULL;
+#endif
+    return -1;
+}
+
+static void batch_destroy(batch_t *b) {
+    int i;
+
+#ifndef _WIN32
+    if (b->data)
+        munmap((void *)b->data, b->size);
+#endif
+    if (b->reg)
+        for (i = 0; i < BATCH_REGIONS; i++) {
+            free(b->reg[i].name);
+            ks_free(&b->reg[i].out);
+        }
+    free(b->reg);
+    free(b->order);
+    free(b->seq);
+    free(b->fai_text);
+}
+
+// Finds the sequence for region r, as fai_fetch64 would.  Regions that
+// don't resolve are left with id -1, and are fetched by write_output() so
+// that they fail, or are reported, in exactly the same way.
+static void batch_lookup(batch_t *b, faidx_t *fai, batch_region_t *r) {
+    hts_pos_t beg, end;
+    int id;
+
+    r->id = -1;
+    r->key = INT64_MAX;
+    if (!fai_parse_region(fai, r->name, &id, &beg, &end, 0)
+        || id < 0 || id >= b->nseq)
+        return;
+
+    batch_seq_t *s = &b->seq[id];
+    r->req_end = end;
+    if (beg < 0)
+        beg = 0;
+    else if (beg > s->len)
+        beg = s->len;
+    if (end > s->len)
+        end = s->len;
+    if (beg > end)
+        beg = end;
+
+    // Check the sequence lies within the file
+    if (s->len > 0
+        && s->offset + ((s->len - 1) / s->line_blen) * s->line_len
+           + (s->len - 1) % s->line_blen >= (int64_t)b->size)
+        return;
+
+    r->id = id;
+    r->beg = beg;
+    r->end = end;
+    r->key = s->offset + (beg / s->line_blen) * s->line_len
+        + beg % s->line_blen;
+}
+
+// Formats region r, header and wrapped bases, into r->out.
+// Returns 0 on success, -1 on failure.
+static int batch_format(batch_t *b, batch_region_t *r, kstring_t *seq) {
+    batch_seq_t *s = &b->seq[r->id];
+    hts_pos_t wrap_len = b->length, pos, i;
+
+    if (wrap_len < 0)
+        wrap_len = s->line_blen;
+    if (wrap_len <= 0)
+        wrap_len = HTS_POS_MAX;
+
+    // Copy the bases out a line at a time
+    ks_clear(seq);
+    for (pos = r->beg; pos < r->end; ) {
+        hts_pos_t col = pos % s->line_blen;
+        hts_pos_t n = s->line_blen - col;
+        if (n > r->end - pos)
+            n = r->end - pos;
+        if (kputsn(b->data + s->offset + (pos / s->line_blen) * s->line_len
+                   + col, n, seq) < 0)
+            return -1;
+        pos += n;
+    }
+    if (b->rev && seq->l > 0)
+        reverse_complement(seq->s, seq->l);
+
+    ks_clear(&r->out);
+    if (ksprintf(&r->out, ">%s%s\n", r->name,
+                 b->rev ? b->neg_strand_name : b->pos_strand_name) < 0)
+        return -1;
+    for (i = 0; i < (hts_pos_t)seq->l; i += wrap_len) {
+        hts_pos_t len = i + wrap_len < (hts_pos_t)seq->l
+            ? wrap_len : (hts_pos_t)seq->l - i;
+        if (kputsn(seq->s + i, len, &r->out) < 0
+            || kputc('\n', &r->out) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void *batch_job(void *arg) {
+    batch_job_t *j = (batch_job_t *)arg;
+    kstring_t seq = KS_INITIALIZE;
+    int i;
+
+    j->ret = 0;
+    for (i = 0; i < j->n; i++) {
+        batch_region_t *r = &j->b->reg[j->order[i]];
+        if (r->id >= 0 && batch_format(j->b, r, &seq) < 0) {
+            j->ret = -1;
+            break;
+        }
+    }
+    ks_free(&seq);
+
+    return j;
+}
+
+static batch_region_t *batch_key_regs; // for qsort
+static int batch_key_cmp(const void *av, const void *bv) {
+    int64_t a = batch_key_regs[*(const int *)av].key;
+    int64_t b = batch_key_regs[*(const int *)bv].key;
+    return a < b ? -1 : (a > b);
+}
+
+// Formats all regions in the batch, in order of file offset.
+// Returns 0 on success, -1 on failure.
+static int batch_format_all(batch_t *b) {
+    int njobs = (b->nreg + BATCH_JOB - 1) / BATCH_JOB, i, nsent = 0, ret = 0;
+    batch_job_t *jobs;
+    hts_tpool_process *q = NULL;
+
+    for (i = 0; i < b->nreg; i++)
+        b->order[i] = i;
+    batch_key_regs = b->reg;
+    qsort(b->order, b->nreg, sizeof(*b->order), batch_key_cmp);
+
+    if (!(jobs = calloc(njobs, sizeof(*jobs))))
+        return -1;
+    for (i = 0; i < njobs; i++) {
+        jobs[i].b = b;
+        jobs[i].order = b->order + i * BATCH_JOB;
+        jobs[i].n = i < njobs - 1 ? BATCH_JOB : b->nreg - i * BATCH_JOB;
+    }
+
+    if (!b->pool || !(q = hts_tpool_process_init(b->pool, njobs, 0))) {
+        for (i = 0; i < njobs; i++)
+            if (batch_job(&jobs[i]) && jobs[i].ret < 0)
+                ret = -1;
+        free(jobs);
+        return ret;
+    }
+
+    for (nsent = 0; nsent < njobs; nsent++)
+        if (hts_tpool_dispatch(b->pool, q, batch_job, &jobs[nsent]) < 0) {
+            ret = -1;
+            break;
+        }
+    for (i = 0; i < nsent; i++) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(q);
+        if (!r) {
+            ret = -1;
+            break;
+        }
+        if (((batch_job_t *)hts_tpool_result_data(r))->ret < 0)
+            ret = -1;
+        hts_tpool_delete_result(r, 0);
+    }
+    hts_tpool_process_destroy(q);
+    free(jobs);
+
+    return ret;
+}
+
+// Fetches and writes out the regions gathered in b, in their given order.
+// Returns EXIT_SUCCESS or EXIT_FAILURE as write_output() does.
+static int batch_flush(batch_t *b, faidx_t *fai, output *out,
+                       const int ignore) {
+    int i, ret = EXIT_SUCCESS;
+
+    if (!b->nreg)
+        return EXIT_SUCCESS;
+
+    for (i = 0; i < b->nreg; i++)
+        batch_lookup(b, fai, &b->reg[i]);
+    if (batch_format_all(b) < 0) {
+        fprintf(stderr, "[faidx] Failed to format sequences\n");
+        ret = EXIT_FAILURE;
+    }
+
+    for (i = 0; i < b->nreg && ret == EXIT_SUCCESS; i++) {
+        batch_region_t *r = &b->reg[i];
+        if (r->id < 0) {
+            ret = write_output(fai, out, r->name, ignore, b->length, b->rev,
+                               b->pos_strand_name, b->neg_strand_name,
+                               FAI_FASTA);
+            continue;
+        }
+
+        // The same warnings as write_line()
+        hts_pos_t seq_len = r->end - r->beg;
+        if (seq_len == 0)
+            fprintf(stderr, "[faidx] Zero length sequence: %s\n", r->name);
+        else if (r->req_end < HTS_POS_MAX && seq_len != r->req_end - r->beg)
+            fprintf(stderr, "[faidx] Truncated sequence: %s\n", r->name);
+
+        if (wrappedwrite(out, r->out.s, r->out.l) < r->out.l) {
+            print_error_errno("faidx", "failed to write output");
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < b->nreg; i++) {
+        free(b->reg[i].name);
+        b->reg[i].name = NULL;
+    }
+    b->nreg = 0;
+
+    return ret;
+}
+
+// Adds region name to the batch, writing the batch out once it is full.
+static int batch_add(batch_t *b, faidx_t *fai, output *out, const int ignore,
+                     const char *name) {
+    if (!(b->reg[b->nreg].name = strdup(name))) {
+        fprintf(stderr, "[faidx] Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if (++b->nreg == BATCH_REGIONS)
+        return batch_flush(b, fai, out, ignore);
+    return EXIT_SUCCESS;
+}
+
+// Fetches region name, either directly or through the batch if there is one.
+static int fetch_region(batch_t *b, faidx_t *faid, output *out,
+                        const char *name, const int ignore,
+                        const hts_pos_t length, const int rev,
+                        const char *pos_strand_name,
+                        const char *neg_strand_name,
+                        enum fai_format_options format) {
+    if (b && b->data)
+        return batch_add(b, faid, out, ignore, name);
+    return write_output(faid, out, name, ignore, length, rev,
+                        pos_strand_name, neg_strand_name, format);
+}
+
+static int read_regions_from_file(faidx_t *faid, batch_t *b, hFILE *in_file, output *out, const int ignore,
                                   const hts_pos_t length, const int rev,
                                   const char *pos_strand_name,
                                   const char *neg_strand_name,
@@ -226,7 +622,7 @@ static int read_regions_from_file(faidx_t *faid, hFILE *in_file, output *out, co
     int ret = EXIT_FAILURE;
 
     while (line.l = 0, kgetline(&line, (kgets_func *)hgets, in_file) >= 0) {
-        if ((ret = write_output(faid, out, line.s, ignore, length, rev, pos_strand_name, neg_strand_name, format)) == EXIT_FAILURE) {
+        if ((ret = fetch_region(b, faid, out, line.s, ignore, length, rev, pos_strand_name, neg_strand_name, format)) == EXIT_FAILURE) {
             break;
         }
     }
@@ -236,6 +632,7 @@ static int read_regions_from_file(faidx_t *faid, hFILE *in_file, output *out, co
     return ret;
 }
 
+
 static int usage(FILE *fp, enum fai_format_options format, int exit_status)
 {
     char *tool, *file_type, *index_name;
@@ -263,7 +660,9 @@ static int usage(FILE *fp, enum fai_format_options format, int exit_status)
                 "                                  sign for (+) / (-)\n"
                 "                                  custom,<pos>,<neg> for custom indicator\n"
                 "      --fai-idx      FILE  name of the index file (default %s.fai).\n"
-                "      --gzi-idx      FILE  name of compressed file index (default %s.gz.gzi).\n",
+                "      --gzi-idx      FILE  name of compressed file index (default %s.gz.gzi).\n"
+                "      --batch              Fetch regions in batches, sorted by position,\n"
+                "                           from an uncompressed file.\n",
                 file_type, file_type, index_name, index_name);
 
 
@@ -279,7 +678,7 @@ static int usage(FILE *fp, enum fai_format_options format, int exit_status)
 
 int faidx_core(int argc, char *argv[], enum fai_format_options format)
 {
-    int c, ignore_error = 0, rev = 0;
+    int c, ignore_error = 0, rev = 0, batch = 0;
     hts_pos_t line_len = DEFAULT_FASTA_LINE_LEN ;/* fasta line len */
     char* output_file = NULL; /* output file (default is stdout ) */
     char *region_file = NULL; // list of regions from file, one per line
@@ -293,9 +692,10 @@ int faidx_core(int argc, char *argv[], enum fai_format_options format)
     struct output out = { 0, stdout, NULL, &ga, KS_INITIALIZE}; //data required for output writing
     faidx_t *fai = NULL;
     hts_tpool *pool = NULL;
+    batch_t fb = { 0 };
 
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', '-', '-', 0, '-', '@'),     //output format opt and thread count - long options
+        SAM_OPT_GLOBAL_OPTIONS('-', '-', '-', 0, '-', '@', '-', '-'),     //output format opt and thread count - long options
         { "output", required_argument,       NULL, 'o' },
         { "help",   no_argument,             NULL, 'h' },
         { "length", required_argument,       NULL, 'n' },
@@ -306,6 +706,7 @@ int faidx_core(int argc, char *argv[], enum fai_format_options format)
         { "mark-strand", required_argument, NULL, 1000 },
         { "fai-idx", required_argument,     NULL, 1001 },
         { "gzi-idx", required_argument,     NULL, 1002 },
+        { "batch", no_argument,             NULL, 1003 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -374,6 +775,7 @@ int faidx_core(int argc, char *argv[], enum fai_format_options format)
                 break;
             case 1001: fai_name = optarg; break;
             case 1002: gzi_name = optarg; break;
+            case 1003: batch = 1; break;
             // handle standard samtools options like thread count, compression level...
             default:
                 if (parse_sam_global_opt(c, optarg, lopts, &ga)) {
@@ -474,11 +876,20 @@ int faidx_core(int argc, char *argv[], enum fai_format_options format)
         }
     }
 
+    if (batch && format == FAI_FASTA
+        && batch_init(&fb, fai, argv[optind], fai_name) == 0) {
+        fb.length = line_len;
+        fb.rev = rev;
+        fb.pos_strand_name = pos_strand_name;
+        fb.neg_strand_name = neg_strand_name;
+        fb.pool = pool;
+    }
+
     if (region_file) {
         hFILE *rf;
 
         if ((rf = hopen(region_file, "r"))) {
-            exit_status = read_regions_from_file(fai, rf, &out, ignore_error, line_len, rev, pos_strand_name, neg_strand_name, format);
+            exit_status = read_regions_from_file(fai, &fb, rf, &out, ignore_error, line_len, rev, pos_strand_name, neg_strand_name, format);
 
             if (hclose(rf) != 0) {
                 fprintf(stderr, "[faidx] Warning: failed to close %s", region_file);
@@ -494,8 +905,10 @@ int faidx_core(int argc, char *argv[], enum fai_format_options format)
 
     exit_status = EXIT_SUCCESS;
     while ( ++optind<argc && exit_status == EXIT_SUCCESS) {
-        exit_status = write_output(fai, &out, argv[optind], ignore_error, line_len, rev, pos_strand_name, neg_strand_name, format);
+        exit_status = fetch_region(&fb, fai, &out, argv[optind], ignore_error, line_len, rev, pos_strand_name, neg_strand_name, format);
     }
+    if (exit_status == EXIT_SUCCESS && fb.data)
+        exit_status = batch_flush(&fb, fai, &out, ignore_error);
 
     flushed = out.isbgzip ? bgzf_flush(out.bgzf_fp) : fflush(out.fp);
     if (flushed == EOF) {
@@ -517,6 +930,7 @@ exit2:
     if (strand_names) {
         free(strand_names);
     }
+    batch_destroy(&fb);
     if (fai) {
         fai_destroy(fai);
     }
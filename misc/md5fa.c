@@ -25,16 +25,80 @@ DEALINGS IN THE SOFTWARE.  */
 #include <config.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
 #include <zlib.h>
 #include "htslib/kseq.h"
 #include "htslib/hts.h"
+#include "htslib/thread_pool.h"
 
 KSEQ_INIT(gzFile, gzread)
 
-static void md5_one(const char *fn)
+#define MD5FA_BUFFER (1 << 20)
+
+// One sequence, hashed on a thread if there are any
+typedef struct {
+    kstring_t name, seq;
+    int len;
+    unsigned char digest[16];
+} md5_job_t;
+
+static void *md5_seq(void *arg)
+{
+    md5_job_t *job = (md5_job_t *)arg;
+    hts_md5_context *md5;
+    size_t i, k;
+
+    for (i = k = 0; i < job->seq.l; ++i) {
+        if (job->seq.s[i] >= '!' && job->seq.s[i] <= '~')
+            job->seq.s[k++] = toupper(job->seq.s[i]);
+    }
+    job->len = k;
+    if (!(md5 = hts_md5_init())) {
+        job->len = -1;
+        return job;
+    }
+    hts_md5_update(md5, (unsigned char*)job->seq.s, k);
+    hts_md5_final(job->digest, md5);
+    hts_md5_destroy(md5);
+    return job;
+}
+
+// Reports the oldest job, once hashed, and adds it to the file checksums.
+// The ordered checksum has to be made in sequence order, so is done here.
+static void md5_next(const char *fn, hts_tpool_process *q, md5_job_t *job,
+                     hts_md5_context *md5_all, unsigned char *unordered)
+{
+    char hex[33];
+    int l;
+
+    if (q) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(q);
+        if (!r) {
+            fprintf(stderr, "md5fa: failed to hash sequence\n");
+            exit(1);
+        }
+        hts_tpool_delete_result(r, 0);
+    }
+    if (job->len < 0) {
+        fprintf(stderr, "md5fa: failed to hash sequence\n");
+        exit(1);
+    }
+    hts_md5_hex(hex, job->digest);
+    for (l = 0; l < 16; ++l)
+        unordered[l] ^= job->digest[l];
+    printf("%s  %s  %s\n", hex, fn, job->name.s);
+    hts_md5_update(md5_all, (unsigned char*)job->seq.s, job->len);
+}
+
+static void md5_one(const char *fn, hts_tpool *pool, int nthreads)
 {
-    hts_md5_context *md5_one, *md5_all;
-    int l, i, k;
+    hts_md5_context *md5_all;
+    hts_tpool_process *q = NULL;
+    md5_job_t *jobs;
+    int l, njobs, next = 0, in_flight = 0;
     gzFile fp;
     kseq_t *seq;
     unsigned char unordered[16], digest[16];
@@ -46,46 +110,83 @@ static void md5_one(const char *fn)
         fprintf(stderr, "md5fa: %s: No such file or directory\n", fn);
         exit(1);
     }
+    gzbuffer(fp, MD5FA_BUFFER);
 
     if (!(md5_all = hts_md5_init()))
         exit(1);
 
-    if (!(md5_one = hts_md5_init())) {
-        hts_md5_destroy(md5_all);
+    if (pool && !(q = hts_tpool_process_init(pool, 2 * nthreads, 0)))
+        exit(1);
+    njobs = q ? 2 * nthreads : 1;
+    if (!(jobs = calloc(njobs, sizeof(*jobs))))
         exit(1);
-    }
 
     seq = kseq_init(fp);
     while ((l = kseq_read(seq)) >= 0) {
-        for (i = k = 0; i < seq->seq.l; ++i) {
-            if (seq->seq.s[i] >= '!' && seq->seq.s[i] <= '~')
-                seq->seq.s[k++] = toupper(seq->seq.s[i]);
+        if (in_flight == njobs) {
+            md5_next(fn, q, &jobs[next], md5_all, unordered);
+            in_flight--;
+        }
+
+        md5_job_t *job = &jobs[next];
+        kstring_t tmp;
+        tmp = job->name; job->name = seq->name; seq->name = tmp;
+        tmp = job->seq;  job->seq  = seq->seq;  seq->seq  = tmp;
+        if (q) {
+            if (hts_tpool_dispatch(pool, q, md5_seq, job) < 0)
+                exit(1);
+        } else {
+            md5_seq(job);
         }
-        hts_md5_reset(md5_one);
-        hts_md5_update(md5_one, (unsigned char*)seq->seq.s, k);
-        hts_md5_final(digest, md5_one);
-        hts_md5_hex(hex, digest);
-        for (l = 0; l < 16; ++l)
-            unordered[l] ^= digest[l];
-        printf("%s  %s  %s\n", hex, fn, seq->name.s);
-        hts_md5_update(md5_all, (unsigned char*)seq->seq.s, k);
+        next = (next + 1) % njobs;
+        in_flight++;
+    }
+    while (in_flight > 0) {
+        md5_next(fn, q, &jobs[(next + njobs - in_flight) % njobs],
+                 md5_all, unordered);
+        in_flight--;
     }
     hts_md5_final(digest, md5_all);
     kseq_destroy(seq);
+    gzclose(fp);
 
     hts_md5_hex(hex, digest);
     printf("%s  %s  >ordered\n", hex, fn);
     hts_md5_hex(hex, unordered);
     printf("%s  %s  >unordered\n", hex, fn);
 
+    if (q)
+        hts_tpool_process_destroy(q);
+    for (l = 0; l < njobs; l++) {
+        free(jobs[l].name.s);
+        free(jobs[l].seq.s);
+    }
+    free(jobs);
     hts_md5_destroy(md5_all);
-    hts_md5_destroy(md5_one);
 }
 
 int main(int argc, char *argv[])
 {
-    int i;
-    if (argc == 1) md5_one("-");
-    else for (i = 1; i < argc; ++i) md5_one(argv[i]);
+    hts_tpool *pool = NULL;
+    int c, nthreads = 0;
+
+    while ((c = getopt(argc, argv, "@:")) >= 0) {
+        switch (c) {
+        case '@': nthreads = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: md5fa [-@ threads] [file.fa ...]\n");
+            return 1;
+        }
+    }
+    if (nthreads > 0 && !(pool = hts_tpool_init(nthreads))) {
+        fprintf(stderr, "md5fa: failed to create thread pool\n");
+        return 1;
+    }
+
+    if (optind == argc) md5_one("-", pool, nthreads);
+    else for (; optind < argc; ++optind) md5_one(argv[optind], pool, nthreads);
+
+    if (pool)
+        hts_tpool_destroy(pool);
     return 0;
 }
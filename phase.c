@@ -41,7 +41,6 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/kseq.h"
 KSTREAM_INIT(gzFile, gzread, 16384)
 
-#define MAX_VARS 256
 #define FLIP_PENALTY 2
 #define FLIP_THRES 4
 #define MASK_THRES 3
@@ -64,13 +63,20 @@ typedef struct {
     // alignment queue
     int n, m;
     bam1_t **b;
+    // buffers reused by each phase() call
+    int *cnt;           // [vpos << k] local haplotype counts
+    size_t cnt_size;
+    uint64_t *bt;       // backtrack bits, [vpos][1 << (k-2)]
+    size_t bt_size;
+    int *dp;            // two rows of 1 << (k-1) scores
 } phaseg_t;
 
 typedef struct {
-    int8_t seq[MAX_VARS]; // TODO: change to dynamic memory allocation!
+    int8_t *seq;        // [max], zero past vlen until clean_seqs() trims it
     int vpos, beg, end;
-    uint32_t vlen:16, single:1, flip:1, phase:1, phased:1, ambig:1;
-    uint32_t in:16, out:16; // in-phase and out-phase
+    int vlen, max;
+    uint32_t single:1, flip:1, phase:1, phased:1, ambig:1;
+    uint32_t in, out; // in-phase and out-phase
 } frag_t, *frag_p;
 
 #define rseq_lt(a,b) ((a)->vpos < (b)->vpos)
@@ -113,24 +119,27 @@ static void count1(int l, const uint8_t *seq, int *cnt)
     }
 }
 
-static int **count_all(int l, int vpos, nseq_t *hash)
+// Counts are returned in g->cnt, 1 << l for each variant
+static int *count_all(phaseg_t *g, int l, int vpos, nseq_t *hash)
 {
     khint_t k;
-    int i, j, **cnt = NULL;
+    int i, j, *cnt;
     uint8_t *seq = NULL;
     size_t cnt_sz = ((size_t)1) << l;
     if (cnt_sz > SSIZE_MAX / sizeof(int) / vpos) {
         errno = ENOMEM;
         goto fail;
     }
+    if (cnt_sz * vpos > g->cnt_size) {
+        free(g->cnt);
+        g->cnt_size = 0;
+        if (!(g->cnt = malloc(cnt_sz * vpos * sizeof(int)))) goto fail;
+        g->cnt_size = cnt_sz * vpos;
+    }
+    cnt = g->cnt;
+    memset(cnt, 0, cnt_sz * vpos * sizeof(int));
     seq = calloc(l, 1);
     if (!seq) goto fail;
-    cnt = calloc(vpos, sizeof(int*));
-    if (!cnt) goto fail;
-    for (i = 0; i < vpos; ++i) {
-        cnt[i] = calloc(cnt_sz, sizeof(int));
-        if (!cnt[i]) goto fail;
-    }
     for (k = 0; k < kh_end(hash); ++k) {
         if (kh_exist(hash, k)) {
             frag_t *f = &kh_val(hash, k);
@@ -142,7 +151,7 @@ static int **count_all(int l, int vpos, nseq_t *hash)
             for (j = 1; j < f->vlen; ++j) {
                 for (i = 0; i < l; ++i)
                     seq[i] = j < l - 1 - i? 0 : f->seq[j - (l - 1 - i)];
-                count1(l, seq, cnt[f->vpos + j]);
+                count1(l, seq, cnt + ((size_t)(f->vpos + j) << l));
             }
         }
     }
@@ -150,60 +159,63 @@ static int **count_all(int l, int vpos, nseq_t *hash)
     return cnt;
  fail:
     free(seq);
-    if (cnt) {
-        for (i = 0; i < vpos; i++)
-            free(cnt[i]);
-        free(cnt);
-    }
     print_error_errno("phase", "Couldn't allocate memory for counts");
     return NULL;
 }
 
 // phasing
-static int8_t *dynaprog(int l, int vpos, int **w)
+static int8_t *dynaprog(phaseg_t *g, int l, int vpos, const int *w)
 {
-    int *f[2], *curr, *prev, max, i;
-    int8_t **b, *h = 0;
-    uint32_t x, z = 1u<<(l-1), mask = (1u<<l) - 1;
-    f[0] = calloc(z, sizeof(int));
-    f[1] = calloc(z, sizeof(int));
-    b = calloc(vpos, sizeof(int8_t*));
-    prev = f[0]; curr = f[1];
+    int *curr, *prev, *tmp, max, i;
+    uint64_t *bt;
+    int8_t *h;
+    uint32_t x, j, z = 1u<<(l-1), hz = z>>1, mask = (1u<<l) - 1;
+    size_t nw = (hz + 63) >> 6; // backtrack words per variant
+    if (!g->dp && !(g->dp = malloc(2 * z * sizeof(int)))) return NULL;
+    if ((size_t)vpos * nw > g->bt_size) {
+        free(g->bt);
+        g->bt_size = 0;
+        if (!(g->bt = malloc((size_t)vpos * nw * 8))) return NULL;
+        g->bt_size = (size_t)vpos * nw;
+    }
+    if (!(h = calloc(vpos, 1))) return NULL;
+    bt = g->bt;
+    prev = g->dp; curr = g->dp + z;
+    memset(prev, 0, z * sizeof(int));
     // fill the backtrack matrix
     for (i = 0; i < vpos; ++i) {
-        int *wi = w[i], *tmp;
-        int8_t *bi;
-        bi = b[i] = calloc(z, 1);
+        const int *wi = w + ((size_t)i << l);
+        uint64_t *bi = bt + i * nw;
         /* In the following, x is the current state, which is the
          * lexicographically smaller local haplotype. xc is the complement of
          * x, or the larger local haplotype; y0 and y1 are the two predecessors
-         * of x. */
-        for (x = 0; x < z; ++x) { // x0 is the smaller
-            uint32_t y0, y1, xc;
-            int c0, c1;
-            xc = ~x&mask; y0 = x>>1; y1 = xc>>1;
-            c0 = prev[y0] + wi[x] + wi[xc];
-            c1 = prev[y1] + wi[x] + wi[xc];
-            if (c0 > c1) bi[x] = 0, curr[x] = c0;
-            else bi[x] = 1, curr[x] = c1;
+         * of x.  States 2j and 2j+1 share y0 = j and y1 = z-1-j, and the
+         * weights add the same to both, so the choice between them is made
+         * once per j and kept as one bit. */
+        memset(bi, 0, nw * 8);
+        for (j = 0; j < hz; ++j) {
+            int p0 = prev[j], p1 = prev[z-1-j];
+            int c = p0 > p1? p0 : p1;
+            uint32_t x0 = j<<1, x1 = x0|1;
+            bi[j>>6] |= (uint64_t)(p0 <= p1) << (j&63);
+            curr[x0] = c + wi[x0] + wi[~x0&mask];
+            curr[x1] = c + wi[x1] + wi[~x1&mask];
         }
         tmp = prev; prev = curr; curr = tmp; // swap
     }
     { // backtrack
         uint32_t max_x = 0;
         int which = 0;
-        h = calloc(vpos, 1);
         for (x = 0, max = 0, max_x = 0; x < z; ++x)
             if (prev[x] > max) max = prev[x], max_x = x;
         for (i = vpos - 1, x = max_x; i >= 0; --i) {
+            uint64_t *bi = bt + i * nw;
+            int flip = bi[x>>7] >> (x>>1&63) & 1;
             h[i] = which? (~x&1) : (x&1);
-            which = b[i][x]? !which : which;
-            x = b[i][x]? (~x&mask)>>1 : x>>1;
+            which = flip? !which : which;
+            x = flip? (~x&mask)>>1 : x>>1;
         }
     }
-    // free
-    for (i = 0; i < vpos; ++i) free(b[i]);
-    free(f[0]); free(f[1]); free(b);
     return h;
 }
 
@@ -347,8 +359,12 @@ static int clean_seqs(int vpos, nseq_t *hash)
             for (i = f->vlen - 1; i >= 0; --i)
                 if (f->seq[i] != 0) break;
             end = i + 1;
-            if (end - beg <= 0) kh_del(64, hash, k);
+            if (end - beg <= 0) {
+                free(f->seq);
+                kh_del(64, hash, k);
+            }
             else {
+                // leaves a stale tail, but update_vpos() drops f after phasing
                 if (beg != 0) memmove(f->seq, f->seq + beg, end - beg);
                 f->vpos += beg; f->vlen = end - beg;
                 f->single = f->vlen == 1? 1 : 0;
@@ -427,15 +443,17 @@ static int phase(phaseg_t *g, const char *chr, int vpos, uint64_t *cns, nseq_t *
         return 1;
     }
     { // phase
-        int **cnt;
+        int *cnt;
         uint64_t *mask;
         printf("PS\t%s\t%d\t%d\n", chr, (int)(cns[0]>>32) + 1, (int)(cns[vpos-1]>>32) + 1);
         sitemask = calloc(vpos, 1);
-        cnt = count_all(g->k, vpos, hash);
+        cnt = count_all(g, g->k, vpos, hash);
         if (!cnt) return -1;
-        path = dynaprog(g->k, vpos, cnt);
-        for (i = 0; i < vpos; ++i) free(cnt[i]);
-        free(cnt);
+        path = dynaprog(g, g->k, vpos, cnt);
+        if (!path) {
+            print_error_errno("phase", "Couldn't allocate memory for phasing");
+            return -1;
+        }
         pcnt = fragphase(vpos, path, hash, 0); // do not fix chimeras when masking
         mask = genmask(vpos, pcnt, &n_masked);
         regmask = calloc(n_masked, 8);
@@ -491,12 +509,27 @@ static void update_vpos(int vpos, nseq_t *hash)
     for (k = 0; k < kh_end(hash); ++k) {
         if (kh_exist(hash, k)) {
             frag_t *f = &kh_val(hash, k);
-            if (f->vpos < vpos) kh_del(64, hash, k); // TODO: if frag_t::seq is allocated dynamically, free it
-            else f->vpos -= vpos;
+            if (f->vpos < vpos) {
+                free(f->seq);
+                kh_del(64, hash, k);
+            } else f->vpos -= vpos;
         }
     }
 }
 
+// Makes room for at least n variants in f, zeroing the new entries
+static int frag_grow(frag_t *f, int n)
+{
+    int max = n;
+    int8_t *seq;
+    kroundup32(max);
+    if (!(seq = realloc(f->seq, max))) return -1;
+    memset(seq + f->max, 0, max - f->max);
+    f->seq = seq;
+    f->max = max;
+    return 0;
+}
+
 static nseq_t *shrink_hash(nseq_t *hash) // TODO: to implement
 {
     return hash;
@@ -616,7 +649,7 @@ int main_phase(int argc, char *argv[])
 
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 0, 0, 0, '-'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 0, 0, 0, '-', '-', '-'),
         {"min-BQ", required_argument, NULL, 'Q'},
         {"min-bq", required_argument, NULL, 'Q'},
         {"no-PG", no_argument, NULL, 1},
@@ -666,6 +699,10 @@ int main_phase(int argc, char *argv[])
 
         return 1;
     }
+    if (g.k < 2 || g.k > 30) {
+        print_error("phase", "block length must be between 2 and 30");
+        return 1;
+    }
     g.fp = sam_open_format(argv[optind], "r", &ga.in);
     if (!g.fp) {
         print_error_errno("phase", "Couldn't open '%s'", argv[optind]);
@@ -780,14 +817,23 @@ int main_phase(int argc, char *argv[])
             k = kh_put(64, seqs, key, &tmp);
             f = &kh_val(seqs, k);
             if (tmp == 0) { // present in the hash table
-                if (vpos - f->vpos + 1 < MAX_VARS) {
-                    f->vlen = vpos - f->vpos + 1;
-                    f->seq[f->vlen-1] = c;
-                    f->end = bam_endpos(p->b);
+                int vlen = vpos - f->vpos + 1;
+                if (vlen > f->max && frag_grow(f, vlen) < 0) {
+                    print_error_errno("phase", "Couldn't allocate memory for fragments");
+                    return 1;
                 }
+                f->vlen = vlen;
+                f->seq[f->vlen-1] = c;
+                f->end = bam_endpos(p->b);
                 dophase = 0;
             } else { // absent
-                memset(f->seq, 0, MAX_VARS);
+                f->seq = NULL;
+                f->max = 0;
+                if (frag_grow(f, 16) < 0) {
+                    kh_del(64, seqs, k);
+                    print_error_errno("phase", "Couldn't allocate memory for fragments");
+                    return 1;
+                }
                 f->beg = p->b->core.pos;
                 f->end = bam_endpos(p->b);
                 f->vpos = vpos, f->vlen = 1, f->seq[0] = c, f->single = f->phased = f->flip = f->ambig = 0;
@@ -818,7 +864,9 @@ int main_phase(int argc, char *argv[])
     sam_hdr_destroy(g.fp_hdr);
     bam_plp_destroy(iter);
     sam_close(g.fp);
+    update_vpos(0x7fffffff, seqs); // frees the fragments
     kh_destroy(64, seqs);
+    free(g.cnt); free(g.bt); free(g.dp);
     kh_destroy(set64, set);
     free(cns);
     errmod_destroy(em);
@@ -0,0 +1,397 @@
+/*  qname_index.c -- compact read name lists for samtools view -N.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "htslib/hts_endian.h"
+#include "qname_index.h"
+#include "samtools.h"
+
+/*
+ * File layout, all integers little-endian:
+ *
+ *   0  magic         "SQNIDX1\n"
+ *   8  u64 nnames
+ *  16  u64 nblocks
+ *  24  u64 bloom_bits     (a power of two)
+ *  32  u32 bloom_k, u32 block_size
+ *  40  bloom_bits / 8 bytes of Bloom filter
+ *      u64 block offsets, from the start of the file
+ *      blocks
+ *
+ * Each block holds up to block_size names in sorted order.  The first
+ * is stored in full, the others as one byte giving the length of the
+ * prefix shared with the previous name followed by the rest of the
+ * name.  All names are NUL terminated.
+ */
+#define QNI_MAGIC "SQNIDX1\n"
+#define QNI_HDR_LEN 40
+#define QNI_BLOCK 16
+#define QNI_BLOOM_K 7
+#define QNI_BITS_PER_NAME 10
+#define QNI_MAX_NAME 254   // the longest possible QNAME
+
+struct qname_index {
+    const uint8_t *data;
+    size_t size;
+    uint64_t nnames, nblocks, bloom_mask;
+    uint32_t bloom_k, block_size;
+    const uint8_t *bloom, *offsets;
+    int mapped;
+};
+
+static uint64_t qni_hash(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a, then a final mix
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static void qni_bloom_add(uint8_t *bloom, uint64_t mask, uint32_t k,
+                          const char *name) {
+    uint64_t h = qni_hash(name), h2 = (h >> 32) | 1;
+    uint32_t i;
+    for (i = 0; i < k; i++, h += h2)
+        bloom[(h & mask) >> 3] |= 1 << (h & 7);
+}
+
+static int qni_bloom_test(const uint8_t *bloom, uint64_t mask, uint32_t k,
+                          const char *name) {
+    uint64_t h = qni_hash(name), h2 = (h >> 32) | 1;
+    uint32_t i;
+    for (i = 0; i < k; i++, h += h2)
+        if (!(bloom[(h & mask) >> 3] & (1 << (h & 7))))
+            return 0;
+    return 1;
+}
+
+int qname_index_is_index(const char *fn) {
+    char magic[8];
+    FILE *fp = fopen(fn, "rb");
+    size_t n;
+    if (!fp)
+        return -1;
+    n = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+    return n == sizeof(magic) && memcmp(magic, QNI_MAGIC, 8) == 0;
+}
+
+static int cmp_names(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static size_t shared_prefix(const char *a, const char *b) {
+    size_t i = 0;
+    while (a[i] && a[i] == b[i])
+        i++;
+    return i;
+}
+
+int qname_index_build(const char *out_fn, char **fns, int nfns) {
+    char *buf = NULL, **names = NULL, name[1024];
+    size_t len = 0, cap = 0, n = 0, m = 0, i, j;
+    uint64_t nblocks, bits = 64, pos, *offsets = NULL;
+    uint8_t *bloom = NULL, hdr[QNI_HDR_LEN];
+    FILE *fp = NULL;
+    int f, ret = -1;
+
+    // Names are packed into one buffer, as a hash table
+    // of hundreds of millions of strings would not fit in memory.
+    for (f = 0; f < nfns; f++) {
+        const char *fn = fns[f] + (*fns[f] == '^');
+        if (!(fp = fopen(fn, "r"))) {
+            print_error_errno("view", "failed to open \"%s\" for reading", fn);
+            goto out;
+        }
+        while (fscanf(fp, "%1023s", name) > 0) {
+            size_t l = strlen(name);
+            if (l > QNI_MAX_NAME)
+                continue; // can never match a read
+            if (len + l + 1 > cap) {
+                size_t c = cap ? cap * 2 : 1 << 20;
+                char *tmp;
+                while (c < len + l + 1)
+                    c *= 2;
+                if (!(tmp = realloc(buf, c)))
+                    goto nomem;
+                buf = tmp;
+                cap = c;
+            }
+            if (n == m) {
+                size_t c = m ? m * 2 : 1 << 16;
+                char **tmp = realloc(names, c * sizeof(*tmp));
+                if (!tmp)
+                    goto nomem;
+                names = tmp;
+                m = c;
+            }
+            // Offset for now, as buf may move
+            names[n++] = (char *)(uintptr_t)len;
+            memcpy(buf + len, name, l + 1);
+            len += l + 1;
+        }
+        if (ferror(fp)) {
+            print_error_errno("view", "failed to read \"%s\"", fn);
+            goto out;
+        }
+        fclose(fp);
+        fp = NULL;
+    }
+
+    for (i = 0; i < n; i++)
+        names[i] = buf + (uintptr_t)names[i];
+    qsort(names, n, sizeof(*names), cmp_names);
+    for (i = j = 0; i < n; i++)
+        if (!j || strcmp(names[j-1], names[i]) != 0)
+            names[j++] = names[i];
+    n = j;
+
+    while (bits < n * QNI_BITS_PER_NAME)
+        bits *= 2;
+    nblocks = (n + QNI_BLOCK - 1) / QNI_BLOCK;
+    if (!(bloom = calloc(bits / 8, 1))
+        || !(offsets = malloc((nblocks ? nblocks : 1) * sizeof(*offsets))))
+        goto nomem;
+
+    pos = QNI_HDR_LEN + bits / 8 + nblocks * 8;
+    for (i = 0; i < n; i++) {
+        qni_bloom_add(bloom, bits - 1, QNI_BLOOM_K, names[i]);
+        if (i % QNI_BLOCK == 0) {
+            offsets[i / QNI_BLOCK] = pos;
+            pos += strlen(names[i]) + 1;
+        } else {
+            pos += strlen(names[i]) - shared_prefix(names[i-1], names[i]) + 2;
+        }
+    }
+
+    if (!(fp = fopen(out_fn, "wb"))) {
+        print_error_errno("view", "failed to open \"%s\" for writing", out_fn);
+        goto out;
+    }
+    memcpy(hdr, QNI_MAGIC, 8);
+    u64_to_le(n, hdr + 8);
+    u64_to_le(nblocks, hdr + 16);
+    u64_to_le(bits, hdr + 24);
+    u32_to_le(QNI_BLOOM_K, hdr + 32);
+    u32_to_le(QNI_BLOCK, hdr + 36);
+    if (fwrite(hdr, 1, QNI_HDR_LEN, fp) != QNI_HDR_LEN
+        || fwrite(bloom, 1, bits / 8, fp) != bits / 8)
+        goto write_fail;
+    for (i = 0; i < nblocks; i++) {
+        uint8_t le[8];
+        u64_to_le(offsets[i], le);
+        if (fwrite(le, 1, 8, fp) != 8)
+            goto write_fail;
+    }
+    for (i = 0; i < n; i++) {
+        const char *s = names[i];
+        if (i % QNI_BLOCK) {
+            size_t pre = shared_prefix(names[i-1], s);
+            if (putc(pre, fp) == EOF)
+                goto write_fail;
+            s += pre;
+        }
+        if (fwrite(s, 1, strlen(s) + 1, fp) != strlen(s) + 1)
+            goto write_fail;
+    }
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        goto write_fail;
+    }
+    fp = NULL;
+    ret = 0;
+
+ out:
+    if (fp)
+        fclose(fp);
+    free(buf);
+    free(names);
+    free(bloom);
+    free(offsets);
+    return ret;
+
+ nomem:
+    print_error_errno("view", "out of memory while building \"%s\"", out_fn);
+    goto out;
+
+ write_fail:
+    print_error_errno("view", "failed to write \"%s\"", out_fn);
+    goto out;
+}
+
+qname_index_t *qname_index_load(const char *fn) {
+    qname_index_t *qi = calloc(1, sizeof(*qi));
+    struct stat st;
+    uint64_t bits;
+    int fd = -1;
+
+    if (!qi) {
+        print_error_errno("view", "could not allocate read name index");
+        return NULL;
+    }
+    if ((fd = open(fn, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        print_error_errno("view", "failed to open \"%s\" for reading", fn);
+        goto fail;
+    }
+    qi->size = st.st_size;
+    if (qi->size < QNI_HDR_LEN)
+        goto corrupt;
+#ifndef _WIN32
+    void *p = mmap(NULL, qi->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        print_error_errno("view", "failed to map \"%s\"", fn);
+        goto fail;
+    }
+    qi->data = p;
+    qi->mapped = 1;
+#else
+    {
+        uint8_t *d = malloc(qi->size);
+        size_t got = 0;
+        ssize_t r = 0;
+        if (!d) {
+            print_error_errno("view", "could not allocate read name index");
+            goto fail;
+        }
+        qi->data = d;
+        while (got < qi->size && (r = read(fd, d + got, qi->size - got)) > 0)
+            got += r;
+        if (got < qi->size) {
+            print_error_errno("view", "failed to read \"%s\"", fn);
+            goto fail;
+        }
+    }
+#endif
+    close(fd);
+    fd = -1;
+
+    if (memcmp(qi->data, QNI_MAGIC, 8) != 0)
+        goto corrupt;
+    qi->nnames = le_to_u64(qi->data + 8);
+    qi->nblocks = le_to_u64(qi->data + 16);
+    bits = le_to_u64(qi->data + 24);
+    qi->bloom_k = le_to_u32(qi->data + 32);
+    qi->block_size = le_to_u32(qi->data + 36);
+    if (bits < 64 || (bits & (bits - 1)) || qi->bloom_k < 1 || qi->bloom_k > 64
+        || bits / 8 > qi->size - QNI_HDR_LEN
+        || qi->nblocks > (qi->size - QNI_HDR_LEN - bits / 8) / 8
+        || (qi->nblocks && qi->data[qi->size - 1] != 0))
+        goto corrupt;
+    qi->bloom_mask = bits - 1;
+    qi->bloom = qi->data + QNI_HDR_LEN;
+    qi->offsets = qi->bloom + bits / 8;
+    return qi;
+
+ corrupt:
+    print_error("view", "\"%s\" is not a valid read name index", fn);
+ fail:
+    if (fd >= 0)
+        close(fd);
+    qname_index_destroy(qi);
+    return NULL;
+}
+
+// Start of block i, or NULL if the offset is out of range
+static const char *qni_block(const qname_index_t *qi, uint64_t i) {
+    uint64_t off = le_to_u64(qi->offsets + i * 8);
+    if (off < (uint64_t)(qi->offsets - qi->data) + qi->nblocks * 8
+        || off >= qi->size)
+        return NULL;
+    return (const char *)qi->data + off;
+}
+
+int qname_index_has(const qname_index_t *qi, const char *name) {
+    uint64_t lo = 0, hi, i;
+    const char *p, *end;
+    char cur[QNI_MAX_NAME + 1];
+    size_t l;
+    int c;
+
+    if (!qi->nblocks
+        || !qni_bloom_test(qi->bloom, qi->bloom_mask, qi->bloom_k, name))
+        return 0;
+
+    // Last block whose first name is not after this one
+    hi = qi->nblocks - 1;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo + 1) / 2;
+        if (!(p = qni_block(qi, mid)))
+            return 0;
+        if (strcmp(p, name) <= 0)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    if (!(p = qni_block(qi, lo)))
+        return 0;
+    end = lo + 1 < qi->nblocks ? qni_block(qi, lo + 1)
+        : (const char *)qi->data + qi->size;
+    if (!end || end <= p)
+        return 0;
+
+    // The data ends with a NUL, so these string reads stay in the file
+    if ((l = strlen(p)) > QNI_MAX_NAME)
+        return 0;
+    memcpy(cur, p, l + 1);
+    p += l + 1;
+    for (i = 1; ; i++) {
+        if ((c = strcmp(cur, name)) >= 0)
+            return c == 0;
+        if (i >= qi->block_size || p >= end)
+            return 0;
+        size_t pre = (uint8_t)*p++;
+        if (pre > l || (l = pre + strlen(p)) > QNI_MAX_NAME)
+            return 0;
+        memcpy(cur + pre, p, l - pre + 1);
+        p += l - pre + 1;
+    }
+}
+
+void qname_index_destroy(qname_index_t *qi) {
+    if (!qi)
+        return;
+#ifndef _WIN32
+    if (qi->mapped)
+        munmap((void *)qi->data, qi->size);
+#else
+    free((void *)qi->data);
+#endif
+    free(qi);
+}
@@ -0,0 +1,61 @@
+/*  qname_index.h -- compact read name lists for samtools view -N.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef QNAME_INDEX_H
+#define QNAME_INDEX_H
+
+/*
+ * A read name index is a sorted, prefix-compressed list of names with a
+ * Bloom filter in front of it, written once by qname_index_build() and
+ * then mapped into memory by each run that uses it.  Lookups of names
+ * that are not in the list are nearly always answered by the Bloom
+ * filter alone.
+ */
+typedef struct qname_index qname_index_t;
+
+/// Check whether a file is a read name index
+/** @param fn  File name
+    @return 1 if it is an index, 0 if not, -1 if it could not be read
+*/
+int qname_index_is_index(const char *fn);
+
+/// Build an index from whitespace separated text name lists
+/** @param out_fn  Index file to write
+    @param fns     Name list files; a leading '^' on a file name is ignored
+    @param nfns    Number of files in fns
+    @return 0 on success, -1 on failure
+*/
+int qname_index_build(const char *out_fn, char **fns, int nfns);
+
+/// Map an index built by qname_index_build() into memory
+/** @return The index, or NULL on failure
+*/
+qname_index_t *qname_index_load(const char *fn);
+
+/// Look up a name
+/** @return 1 if present, 0 if not
+*/
+int qname_index_has(const qname_index_t *qi, const char *name);
+
+void qname_index_destroy(qname_index_t *qi);
+
+#endif
@@ -0,0 +1,196 @@
+/*  ref_cache.c -- reference sequences shared between users.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <htslib/khash.h>
+
+#include "ref_cache.h"
+
+typedef struct ref_entry {
+    char *name, *seq;
+    hts_pos_t len;
+    int nheld;
+    struct ref_entry *prev, *next;  // released list, newest first
+} ref_entry_t;
+
+KHASH_MAP_INIT_STR(ref, ref_entry_t *)
+
+struct ref_cache {
+    faidx_t *fai;
+    khash_t(ref) *h;
+    ref_entry_t *head, *tail;       // released entries
+    size_t max_bytes, bytes;        // limit and size of released entries
+    pthread_mutex_t lock;           // the table and released list
+    pthread_mutex_t fai_lock;       // fai, which is not thread safe
+};
+
+ref_cache_t *ref_cache_init(faidx_t *fai, size_t max_bytes) {
+    ref_cache_t *rc = calloc(1, sizeof(*rc));
+    if (!rc)
+        return NULL;
+    if (!(rc->h = kh_init(ref))) {
+        free(rc);
+        return NULL;
+    }
+    rc->fai = fai;
+    rc->max_bytes = max_bytes;
+    pthread_mutex_init(&rc->lock, NULL);
+    pthread_mutex_init(&rc->fai_lock, NULL);
+    return rc;
+}
+
+static void unlink_entry(ref_cache_t *rc, ref_entry_t *e) {
+    if (e->prev) e->prev->next = e->next; else rc->head = e->next;
+    if (e->next) e->next->prev = e->prev; else rc->tail = e->prev;
+    e->prev = e->next = NULL;
+    rc->bytes -= e->len;
+}
+
+static void free_entry(ref_cache_t *rc, ref_entry_t *e) {
+    khiter_t k = kh_get(ref, rc->h, e->name);
+    if (k != kh_end(rc->h))
+        kh_del(ref, rc->h, k);
+    free(e->name);
+    free(e->seq);
+    free(e);
+}
+
+// Drops the least recently released entries until within the limit
+static void trim(ref_cache_t *rc) {
+    while (rc->tail && rc->bytes > rc->max_bytes) {
+        ref_entry_t *e = rc->tail;
+        unlink_entry(rc, e);
+        free_entry(rc, e);
+    }
+}
+
+void ref_cache_set_limit(ref_cache_t *rc, size_t max_bytes) {
+    pthread_mutex_lock(&rc->lock);
+    rc->max_bytes = max_bytes;
+    trim(rc);
+    pthread_mutex_unlock(&rc->lock);
+}
+
+// Holds the entry for name if there is one.  Called with the lock held.
+static ref_entry_t *hold_entry(ref_cache_t *rc, const char *name) {
+    khiter_t k = kh_get(ref, rc->h, name);
+    ref_entry_t *e;
+    if (k == kh_end(rc->h))
+        return NULL;
+    e = kh_val(rc->h, k);
+    if (!e->nheld++)
+        unlink_entry(rc, e);
+    return e;
+}
+
+char *ref_cache_get(ref_cache_t *rc, const char *name, hts_pos_t *len) {
+    ref_entry_t *e;
+    khiter_t k;
+    int ret;
+
+    pthread_mutex_lock(&rc->lock);
+    e = hold_entry(rc, name);
+    pthread_mutex_unlock(&rc->lock);
+    if (e)
+        goto out;
+
+    // Load without the cache lock, so users of other sequences carry on.
+    // Loads are serialised by fai_lock, so a caller that waited there
+    // looks again in case the one before it loaded the same sequence.
+    pthread_mutex_lock(&rc->fai_lock);
+    pthread_mutex_lock(&rc->lock);
+    e = hold_entry(rc, name);
+    pthread_mutex_unlock(&rc->lock);
+    if (e) {
+        pthread_mutex_unlock(&rc->fai_lock);
+        goto out;
+    }
+
+    if (!(e = calloc(1, sizeof(*e))) || !(e->name = strdup(name))
+        || !(e->seq = faidx_fetch_seq64(rc->fai, name, 0, HTS_POS_MAX,
+                                        &e->len)))
+        goto fail;
+
+    pthread_mutex_lock(&rc->lock);
+    k = kh_put(ref, rc->h, e->name, &ret);
+    if (ret < 0) {
+        pthread_mutex_unlock(&rc->lock);
+        goto fail;
+    }
+    kh_val(rc->h, k) = e;
+    e->nheld = 1;
+    pthread_mutex_unlock(&rc->lock);
+    pthread_mutex_unlock(&rc->fai_lock);
+
+ out:
+    *len = e->len;
+    return e->seq;
+
+ fail:
+    pthread_mutex_unlock(&rc->fai_lock);
+    if (e) {
+        free(e->name);
+        free(e->seq);
+        free(e);
+    }
+    *len = 0;
+    return NULL;
+}
+
+void ref_cache_release(ref_cache_t *rc, const char *name) {
+    khiter_t k;
+    pthread_mutex_lock(&rc->lock);
+    k = kh_get(ref, rc->h, name);
+    if (k != kh_end(rc->h)) {
+        ref_entry_t *e = kh_val(rc->h, k);
+        if (e->nheld > 0 && !--e->nheld) {
+            e->next = rc->head;
+            if (rc->head) rc->head->prev = e; else rc->tail = e;
+            rc->head = e;
+            rc->bytes += e->len;
+            trim(rc);
+        }
+    }
+    pthread_mutex_unlock(&rc->lock);
+}
+
+void ref_cache_destroy(ref_cache_t *rc) {
+    khiter_t k;
+    if (!rc)
+        return;
+    for (k = kh_begin(rc->h); k != kh_end(rc->h); k++) {
+        if (kh_exist(rc->h, k)) {
+            ref_entry_t *e = kh_val(rc->h, k);
+            free(e->name);
+            free(e->seq);
+            free(e);
+        }
+    }
+    kh_destroy(ref, rc->h);
+    pthread_mutex_destroy(&rc->lock);
+    pthread_mutex_destroy(&rc->fai_lock);
+    free(rc);
+}
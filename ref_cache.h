@@ -0,0 +1,65 @@
+/*  ref_cache.h -- reference sequences shared between users.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef REF_CACHE_H
+#define REF_CACHE_H
+
+#include <stddef.h>
+#include <htslib/faidx.h>
+
+/*
+ * A cache of whole reference sequences loaded through faidx.  Users
+ * hold a sequence between ref_cache_get() and ref_cache_release(); while
+ * held, every user asking for the same name shares one copy.  Released
+ * sequences are kept, most recently used first, until their total size
+ * goes over the cache limit.  It may be used from several threads.
+ */
+typedef struct ref_cache ref_cache_t;
+
+/// Create a cache
+/** @param fai        Index to load from.  Not owned by the cache, but only
+                      used under its own loading lock once the cache is
+                      shared.
+    @param max_bytes  Size of released sequences to keep.  0 frees each
+                      one once nothing holds it.
+    @return The cache, or NULL on failure
+*/
+ref_cache_t *ref_cache_init(faidx_t *fai, size_t max_bytes);
+
+/// Change the size of released sequences that may be kept
+void ref_cache_set_limit(ref_cache_t *rc, size_t max_bytes);
+
+/// Get a reference sequence, loading it if needed
+/** @param name  Reference name
+    @param len   Set to the sequence length
+    @return The sequence, held until ref_cache_release(), or NULL if
+            it could not be loaded
+*/
+char *ref_cache_get(ref_cache_t *rc, const char *name, hts_pos_t *len);
+
+/// Release a sequence returned from ref_cache_get()
+void ref_cache_release(ref_cache_t *rc, const char *name);
+
+/// Free the cache and every sequence in it
+void ref_cache_destroy(ref_cache_t *rc);
+
+#endif
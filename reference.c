@@ -30,9 +30,11 @@ DEALINGS IN THE SOFTWARE.  */
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "htslib/sam.h"
 #include "htslib/cram.h"
+#include "htslib/thread_pool.h"
 #include "samtools.h"
 #include "sam_opts.h"
 
@@ -48,6 +50,10 @@ DEALINGS IN THE SOFTWARE.  */
  * the specific options (not commonly used and not the default).  The second
  * is a slow operation, but applies to any data type.
  *
+ * With threads, the first uncompresses the embedded reference blocks on the
+ * thread pool.  The second, given an index, splits each reference into
+ * segments that are rebuilt in parallel, each from its own file handle.
+ *
  * This is also a testing ground for a future CRAM auto-embed-ref option that
  * permits the use of an embedded reference without having to first extract
  * the reference.  (Note this may require the creation of MD tags during
@@ -132,12 +138,104 @@ static int dump_ref(sam_hdr_t *h, hts_itr_t *iter, int ref_id,
  * CRAM embedded reference method of reference construction
  */
 
+static void ref_block_copy(cram_block *blk, hts_pos_t ref_start,
+                           char *ref, uint64_t ref_len) {
+    int32_t usize = cram_block_get_uncomp_size(blk);
+    hts_pos_t ref_end = ref_start + usize;
+    if (ref_end > ref_len+1)
+        ref_end = ref_len+1;
+    if (ref_end > ref_start)
+        memcpy(ref + ref_start-1, cram_block_get_data(blk),
+               ref_end - ref_start);
+}
+
+/*
+ * With a thread pool, the embedded reference blocks are uncompressed by
+ * the pool and copied into the reference in order as they come back, so
+ * overlapping slices give the same result as without threads.
+ */
+typedef struct {
+    cram_block *blk;
+    hts_pos_t ref_start;
+    int ret;
+} ref_block_job;
+
+typedef struct {
+    hts_tpool *pool;
+    hts_tpool_process *q;
+    ref_block_job *job;
+    int njob, next, in_flight;
+} ref_block_queue;
+
+static void *ref_block_uncompress(void *arg) {
+    ref_block_job *j = (ref_block_job *)arg;
+    j->ret = cram_uncompress_block(j->blk);
+    return j;
+}
+
+// Copies the oldest block in flight into ref.
+// Returns 0 on success, -1 on failure.
+static int ref_block_collect(ref_block_queue *bq, char *ref, uint64_t ref_len) {
+    hts_tpool_result *res = hts_tpool_next_result_wait(bq->q);
+    ref_block_job *j;
+    int ret;
+
+    if (!res)
+        return -1;
+    j = (ref_block_job *)hts_tpool_result_data(res);
+    hts_tpool_delete_result(res, 0);
+    bq->in_flight--;
+
+    ret = j->ret;
+    if (ret == 0)
+        ref_block_copy(j->blk, j->ref_start, ref, ref_len);
+    cram_free_block(j->blk);
+    j->blk = NULL;
+    return ret < 0 ? -1 : 0;
+}
+
+// Collects every block in flight.
+// Returns 0 on success, -1 on failure.
+static int ref_block_drain(ref_block_queue *bq, char *ref, uint64_t ref_len) {
+    int ret = 0;
+    // After an error the remaining jobs are only collected
+    while (bq->in_flight)
+        if (ref_block_collect(bq, ref, ret == 0 ? ref_len : 0) < 0)
+            ret = -1;
+    return ret;
+}
+
+// Takes ownership of blk.  Returns 0 on success, -1 on failure.
+static int ref_block_dispatch(ref_block_queue *bq, cram_block *blk,
+                              hts_pos_t ref_start, char *ref,
+                              uint64_t ref_len) {
+    ref_block_job *j;
+
+    // The ring of jobs is no larger than the queue, so dispatching
+    // never waits on results yet to be collected
+    if (bq->in_flight == bq->njob && ref_block_collect(bq, ref, ref_len) < 0) {
+        cram_free_block(blk);
+        return -1;
+    }
+    j = &bq->job[bq->next];
+    j->blk = blk;
+    j->ref_start = ref_start;
+    if (hts_tpool_dispatch(bq->pool, bq->q, ref_block_uncompress, j) < 0) {
+        cram_free_block(blk);
+        j->blk = NULL;
+        return -1;
+    }
+    bq->next = (bq->next + 1) % bq->njob;
+    bq->in_flight++;
+    return 0;
+}
+
 /*
  * Extracts an embedded reference from a sorted CRAM file.
  * Modelled on the CRAM container copy loop from bam_cat.c.
  */
 static int cram2ref(samFile *in, sam_hdr_t *h, hts_idx_t *idx, char *reg,
-                    FILE *outfp, int verbose) {
+                    hts_tpool *pool, FILE *outfp, int verbose) {
     cram_fd *in_c;
     cram_container *c = NULL;
     cram_block *blk = NULL;
@@ -146,6 +244,17 @@ static int cram2ref(samFile *in, sam_hdr_t *h, hts_idx_t *idx, char *reg,
     int curr_ref_id = -99;
     char *ref = NULL;
     uint64_t ref_len = 0;
+    ref_block_queue bq = { pool, NULL, NULL, 0, 0, 0 };
+
+    if (pool) {
+        bq.njob = 2 * hts_tpool_size(pool);
+        if (!(bq.job = calloc(bq.njob, sizeof(*bq.job)))
+            || !(bq.q = hts_tpool_process_init(pool, bq.njob, 0))) {
+            print_error_errno("reference", "couldn't set up the thread pool");
+            free(bq.job);
+            return -1;
+        }
+    }
 
     // We have no direct public API for seeking in CRAM to a specific
     // location by genome coordinates.  The sam_itr_query API is
@@ -226,6 +335,8 @@ static int cram2ref(samFile *in, sam_hdr_t *h, hts_idx_t *idx, char *reg,
             }
 
             if (ref_id != curr_ref_id) {
+                if (bq.in_flight && ref_block_drain(&bq, ref, ref_len) < 0)
+                    goto err;
                 if (curr_ref_id >= 0) {
                     if (dump_ref(h, iter, curr_ref_id, ref, ref_len,
                                  outfp, verbose) < 0)
@@ -250,16 +361,17 @@ static int cram2ref(samFile *in, sam_hdr_t *h, hts_idx_t *idx, char *reg,
                 if (!(blk = cram_read_block(in_c)))
                     goto err;
                 if (cram_block_get_content_id(blk) == embed_id) {
+                    if (pool) {
+                        int r = ref_block_dispatch(&bq, blk, ref_start,
+                                                   ref, ref_len);
+                        blk = NULL;
+                        if (r < 0)
+                            goto err;
+                        continue;
+                    }
                     cram_uncompress_block(blk);
                     //printf("%.*s\n", blk->uncomp_size, blk->data);
-
-                    int32_t usize = cram_block_get_uncomp_size(blk);
-                    int ref_end = ref_start + usize;
-                    if (ref_end > ref_len+1)
-                        ref_end = ref_len+1;
-                    if (ref_end > ref_start)
-                        memcpy(ref + ref_start-1, cram_block_get_data(blk),
-                               ref_end - ref_start);
+                    ref_block_copy(blk, ref_start, ref, ref_len);
                 }
                 cram_free_block(blk);
                 blk = NULL;
@@ -272,6 +384,9 @@ static int cram2ref(samFile *in, sam_hdr_t *h, hts_idx_t *idx, char *reg,
         c = NULL;
     }
 
+    if (bq.in_flight && ref_block_drain(&bq, ref, ref_len) < 0)
+        goto err;
+
     int ret = 0;
     if (curr_ref_id >= 0) {
         ret = dump_ref(h, iter, curr_ref_id, ref, ref_len, outfp, verbose);
@@ -290,10 +405,18 @@ static int cram2ref(samFile *in, sam_hdr_t *h, hts_idx_t *idx, char *reg,
     free(ref);
     if (iter)
         hts_itr_destroy(iter);
+    if (bq.q)
+        hts_tpool_process_destroy(bq.q);
+    free(bq.job);
 
     return ret;
 
  err:
+    if (bq.in_flight)
+        ref_block_drain(&bq, ref, 0);
+    if (bq.q)
+        hts_tpool_process_destroy(bq.q);
+    free(bq.job);
     free(ref);
     if (blk)
         cram_free_block(blk);
@@ -342,12 +465,12 @@ int next_cigar_op(uint32_t *cigar, int *ncigar, int *skip, int *spos,
 }
 
 // Converts a bam object with SEQ, POS/CIGAR and MD:Z to a reference.
-// Updates ref[] array.
+// Updates ref[] array between beg and end (at most the reference length).
 //
 // Returns >0 on success,
 //          0 on no-MD found,
 //         -1 on failure (eg inconsistent data)
-static int build_ref(bam1_t *b, char *ref, size_t ref_len) {
+static int build_ref(bam1_t *b, char *ref, hts_pos_t beg, hts_pos_t end) {
     uint8_t *seq = bam_get_seq(b);
     uint32_t *cigar = bam_get_cigar(b);
     int ncigar = b->core.n_cigar;
@@ -359,7 +482,8 @@ static int build_ref(bam1_t *b, char *ref, size_t ref_len) {
     MD++;
 
     // Walk through MD + seq to generate ref
-    int iseq = 0, iref = b->core.pos, next_op;
+    int iseq = 0, next_op;
+    hts_pos_t iref = b->core.pos;
     int cig_skip[16] = {0,1,0,1,1,1,1,0,0,1,1,1,1,1,1,1};
     while (iseq < b->core.l_qseq && *MD) {
         if (isdigit(*MD)) {
@@ -378,7 +502,7 @@ static int build_ref(bam1_t *b, char *ref, size_t ref_len) {
                     return -1;
                 }
 
-                if (iref < ref_len)
+                if (iref >= beg && iref < end)
                     ref[iref] = seq_nt16_str[bam_seqi(seq, iseq)];
                 iseq++;
                 iref++;
@@ -399,7 +523,7 @@ static int build_ref(bam1_t *b, char *ref, size_t ref_len) {
                     return -1;
                 }
 
-                if (iref < ref_len)
+                if (iref >= beg && iref < end)
                     ref[iref] = *MD;
 
                 MD++;
@@ -416,7 +540,7 @@ static int build_ref(bam1_t *b, char *ref, size_t ref_len) {
                 print_error("MD2ref", "MD:Z and CIGAR are incompatible");
                 return -1;
             }
-            if (iref < ref_len)
+            if (iref >= beg && iref < end)
                 ref[iref] = *MD;
 
             MD++;
@@ -467,7 +591,7 @@ static int MD2ref(samFile *in, sam_hdr_t *h, hts_idx_t *idx, char *reg,
             }
         }
 
-        if (build_ref(b, ref, ref_len) < 0)
+        if (build_ref(b, ref, 0, ref_len) < 0)
             goto err;
     }
 
@@ -499,6 +623,238 @@ static int MD2ref(samFile *in, sam_hdr_t *h, hts_idx_t *idx, char *reg,
     return ret;
 }
 
+/*
+ * Threaded MD method, for indexed files.  References are rebuilt a round at
+ * a time, where a round is one reference or a run of them totalling up to
+ * REF_ROUND_LEN bases.  Each reference in the round is split into segments
+ * and one job per thread takes segments in turn, iterating over each with
+ * the index and only writing within it.  The records overlapping a base are
+ * all seen by the job rebuilding it, in file order, so the result is as
+ * without threads.  The jobs keep their own file handles, without the thread
+ * pool, which they occupy.
+ */
+#define REF_SEGMENT_LEN (1<<20)
+#define REF_ROUND_LEN   (1<<28)
+
+typedef struct {
+    int tid;
+    char *ref;
+    hts_pos_t beg, end;
+    int seen;               // set if any record was found
+} md_segment;
+
+typedef struct {
+    samFile *fp;
+    hts_idx_t *idx;
+    md_segment *seg;
+    int nseg, *next;
+    pthread_mutex_t *lock;
+    int ret;
+} md_worker;
+
+static void *md_worker_func(void *arg) {
+    md_worker *w = (md_worker *)arg;
+    bam1_t *b = bam_init1();
+    int r = 0;
+
+    w->ret = -1;
+    if (!b)
+        return w;
+    for (;;) {
+        md_segment *sg;
+        hts_itr_t *itr;
+        int i;
+
+        pthread_mutex_lock(w->lock);
+        i = (*w->next)++;
+        pthread_mutex_unlock(w->lock);
+        if (i >= w->nseg)
+            break;
+
+        sg = &w->seg[i];
+        memset(sg->ref + sg->beg, 'N', sg->end - sg->beg);
+        if (!(itr = sam_itr_queryi(w->idx, sg->tid, sg->beg, sg->end)))
+            goto out;
+        while ((r = sam_itr_next(w->fp, itr, b)) >= 0) {
+            sg->seen = 1;
+            if (build_ref(b, sg->ref, sg->beg, sg->end) < 0)
+                break;
+        }
+        hts_itr_destroy(itr);
+        if (r >= 0 || r < -1)
+            goto out;
+    }
+    w->ret = 0;
+
+ out:
+    bam_destroy1(b);
+    return w;
+}
+
+typedef struct {
+    int tid;
+    char *ref;
+    hts_pos_t len;
+    int seg0, nseg;
+} md_round_ref;
+
+// Returns 0 on success,
+//        -1 on failure
+static int MD2ref_threaded(const char *fn, sam_hdr_t *h, hts_idx_t *idx,
+                           char *reg, hts_tpool *pool,
+                           FILE *outfp, int verbose) {
+    int nref = sam_hdr_nref(h), njob = hts_tpool_size(pool);
+    int tid = 0, tid_end = nref, i, j, ret = -1, in_flight = 0, next;
+    hts_pos_t beg = 0, end = HTS_POS_MAX;
+    md_worker *w = calloc(njob, sizeof(*w));
+    md_round_ref *rr = NULL;
+    md_segment *seg = NULL;
+    int nrr = 0, mrr = 0, mseg = 0;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    hts_tpool_process *q = NULL;
+    hts_itr_t *iter = NULL;
+
+    if (!w || !(q = hts_tpool_process_init(pool, njob, 0))) {
+        print_error_errno("reference", "couldn't set up the thread pool");
+        goto out;
+    }
+    if (reg) {
+        if (!(iter = sam_itr_querys(idx, h, reg))) {
+            print_error("reference", "failed to parse region '%s'", reg);
+            goto out;
+        }
+        tid = iter->tid;
+        tid_end = tid + 1;
+        beg = iter->beg;
+        end = iter->end;
+    }
+    for (i = 0; i < njob; i++) {
+        w[i].lock = &lock;
+        w[i].next = &next;
+        if (!(w[i].fp = sam_open(fn, "r"))
+            || !(w[i].idx = sam_index_load3(w[i].fp, fn, NULL,
+                                            HTS_IDX_SILENT_FAIL))) {
+            print_error_errno("reference", "failed to open '%s' with its "
+                              "index", fn);
+            goto out;
+        }
+    }
+
+    while (tid < tid_end) {
+        int nseg = 0;
+        hts_pos_t round_len = 0;
+
+        // Gather the references in this round and split them
+        nrr = 0;
+        while (tid < tid_end) {
+            hts_pos_t len = sam_hdr_tid2len(h, tid), b0, e0, p;
+            if (nrr && round_len + len > REF_ROUND_LEN)
+                break;
+            if (nrr == mrr) {
+                int m = mrr ? mrr * 2 : 64;
+                md_round_ref *rr2 = realloc(rr, m * sizeof(*rr));
+                if (!rr2) goto out;
+                rr = rr2;
+                mrr = m;
+            }
+            b0 = beg < len ? beg : len;
+            e0 = end < len ? end : len;
+            rr[nrr].tid = tid;
+            rr[nrr].len = len;
+            rr[nrr].seg0 = nseg;
+            rr[nrr].nseg = (e0 - b0 + REF_SEGMENT_LEN - 1) / REF_SEGMENT_LEN;
+            if (!(rr[nrr].ref = malloc(len ? len : 1)))
+                goto out;
+            if (nseg + rr[nrr].nseg > mseg) {
+                int m = nseg + rr[nrr].nseg + 1024;
+                md_segment *seg2 = realloc(seg, m * sizeof(*seg));
+                if (!seg2) {
+                    free(rr[nrr].ref);
+                    goto out;
+                }
+                seg = seg2;
+                mseg = m;
+            }
+            for (p = b0; p < e0; p += REF_SEGMENT_LEN) {
+                md_segment *sg = &seg[nseg++];
+                sg->tid = tid;
+                sg->ref = rr[nrr].ref;
+                sg->beg = p;
+                sg->end = p + REF_SEGMENT_LEN < e0 ? p + REF_SEGMENT_LEN : e0;
+                sg->seen = 0;
+            }
+            round_len += len;
+            nrr++;
+            tid++;
+        }
+
+        next = 0;
+        for (i = 0; i < njob; i++) {
+            w[i].seg = seg;
+            w[i].nseg = nseg;
+            if (hts_tpool_dispatch(pool, q, md_worker_func, &w[i]) < 0)
+                break;
+            in_flight++;
+        }
+        int failed = i < njob;
+        while (in_flight) {
+            hts_tpool_result *res = hts_tpool_next_result_wait(q);
+            if (!res) {
+                failed = 1;
+                break;
+            }
+            md_worker *wr = (md_worker *)hts_tpool_result_data(res);
+            hts_tpool_delete_result(res, 0);
+            in_flight--;
+            if (wr->ret < 0)
+                failed = 1;
+        }
+
+        for (i = 0; i < nrr; i++) {
+            int seen = 0;
+            for (j = 0; j < rr[i].nseg; j++)
+                seen |= seg[rr[i].seg0 + j].seen;
+            if (!failed && seen) {
+                if (dump_ref(h, iter, rr[i].tid, rr[i].ref, rr[i].len,
+                             outfp, verbose) < 0)
+                    failed = 1;
+            } else if (!failed && reg) {
+                // no data present, but we explicitly asked for the
+                // reference so report it still as Ns.
+                hts_pos_t len = MIN(iter->end, rr[i].len);
+                memset(rr[i].ref, 'N', len);
+                if (dump_ref(h, iter, rr[i].tid, rr[i].ref, len,
+                             outfp, verbose) < 0)
+                    failed = 1;
+            }
+            free(rr[i].ref);
+            rr[i].ref = NULL;
+        }
+        if (failed)
+            goto out;
+    }
+    ret = 0;
+
+ out:
+    if (q)
+        hts_tpool_process_destroy(q);
+    for (i = 0; w && i < njob; i++) {
+        if (w[i].idx)
+            hts_idx_destroy(w[i].idx);
+        if (w[i].fp)
+            sam_close(w[i].fp);
+    }
+    pthread_mutex_destroy(&lock);
+    if (iter)
+        hts_itr_destroy(iter);
+    for (i = 0; i < nrr; i++)
+        free(rr[i].ref);
+    free(w);
+    free(rr);
+    free(seg);
+    return ret;
+}
+
 int main_reference(int argc, char *argv[])
 {
     int c, usage = 0, verbose = 1, use_embedded = 0;
@@ -508,13 +864,14 @@ int main_reference(int argc, char *argv[])
     sam_global_args ga;
     FILE *outfp = stdout;
     char *reg = NULL;
+    htsThreadPool p = {NULL, 0};
 
     static const struct option lopts[] = {
         {"output",   required_argument, NULL, 'o'},
         {"quiet",    no_argument,       NULL, 'q'},
         {"embedded", no_argument,       NULL, 'e'},
         {"region",   required_argument, NULL, 'r'},
-        SAM_OPT_GLOBAL_OPTIONS('-', '-', '-', '-', '-', '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', '-', '-', '-', '-', '@', '-', '-'),
         { NULL, 0, NULL, 0 }
     };
 
@@ -559,8 +916,13 @@ int main_reference(int argc, char *argv[])
         return 1;
     }
 
-    if (ga.nthreads > 0)
-        hts_set_threads(in, ga.nthreads);
+    if (ga.nthreads > 0) {
+        if (!(p.pool = hts_tpool_init(ga.nthreads))) {
+            print_error("reference", "failed to create the thread pool");
+            goto err;
+        }
+        hts_set_opt(in, HTS_OPT_THREAD_POOL, &p);
+    }
 
     if (!(h = sam_hdr_read(in)))
         goto err;
@@ -571,11 +933,18 @@ int main_reference(int argc, char *argv[])
             print_error_errno("reference", "Failed to load the index");
             goto err;
         }
+    } else if (p.pool && !use_embedded && strcmp(fn, "-") != 0) {
+        // Optional, as the threaded MD method needs it
+        idx = sam_index_load3(in, fn, NULL, HTS_IDX_SILENT_FAIL);
     }
 
-    int ret = use_embedded
-        ? cram2ref(in, h, idx, reg, outfp, verbose)
-        : MD2ref(in, h, idx, reg, outfp, verbose);
+    int ret;
+    if (use_embedded)
+        ret = cram2ref(in, h, idx, reg, p.pool, outfp, verbose);
+    else if (p.pool && idx)
+        ret = MD2ref_threaded(fn, h, idx, reg, p.pool, outfp, verbose);
+    else
+        ret = MD2ref(in, h, idx, reg, outfp, verbose);
 
     sam_hdr_destroy(h);
     if (outfp != stdout)
@@ -583,6 +952,8 @@ int main_reference(int argc, char *argv[])
     if (idx)
         hts_idx_destroy(idx);
     sam_close(in);
+    if (p.pool)
+        hts_tpool_destroy(p.pool);
 
     return ret;
 
@@ -593,6 +964,8 @@ int main_reference(int argc, char *argv[])
         sam_close(in);
     if (h)
         sam_hdr_destroy(h);
+    if (p.pool)
+        hts_tpool_destroy(p.pool);
 
     return 1;
 }
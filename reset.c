@@ -33,12 +33,14 @@ DEALINGS IN THE SOFTWARE
 #include "htslib/thread_pool.h"
 #include "htslib/khash.h"
 #include "sam_utils.h"
+#include "seq_utils.h"
 #include <unistd.h>
 
 #define TAGNUM(X) (((X)[0] << 8) | (X)[1])  //to create key for aux tags, like type key in htslib
 #define LONG_OPT(X) (128 + (X))             //to handle long and short options with same char
 
 #define RESET_KEEPDUPFLAG   1               //keep dup flag as such, as in initial implementation
+#define RESET_BATCH_SIZE    1024            //records per batch when using threads
 
 typedef struct conf_data
 {
@@ -127,35 +129,12 @@ returns nothing
 */
 void removeauxtags(bam1_t *bamdata, conf_data *config)
 {
-    uint8_t *auxdata = NULL;
-    const char *tag = NULL;
-    khint_t iter = 0;
-
     if (!bamdata || !config)
         return;
 
-    for (auxdata = bam_aux_first(bamdata); auxdata; ) {
-        tag = bam_aux_tag(auxdata);
-        if (config->aux_keep) {                         //keep option or remove option with ^ in use
-            iter = kh_get(aux_exists, config->aux_keep, TAGNUM(tag));
-            if (iter == kh_end(config->aux_keep)) {     //not present in keep, remove
-                auxdata = bam_aux_remove(bamdata, auxdata);
-            }
-            else {                                      //present, keep
-                auxdata = bam_aux_next(bamdata, auxdata);
-            }
-        }
-        else if (config->aux_remove) {                  //remove option in use
-            iter = kh_get(aux_exists, config->aux_remove, TAGNUM(tag));
-            if (iter != kh_end(config->aux_remove)) {   //present in remove, remove
-                auxdata = bam_aux_remove(bamdata, auxdata);
-            }
-            else {                                      //not present, keep
-                auxdata = bam_aux_next(bamdata, auxdata);
-            }
-        }
-        //else impossible
-    }
+    //keep set has priority over remove set; both are applied in one pass and no data is added,
+    //so this cannot fail
+    rewrite_aux(bamdata, config->aux_keep, config->aux_keep ? NULL : config->aux_remove, NULL, 0);
 }
 
 /// getRGlines - add RG lines from input header to output header
@@ -275,22 +254,190 @@ int getPGlines(sam_hdr_t *in_samhdr, sam_hdr_t *out_samhdr, conf_data *config, c
     return ret;
 }
 
+/// reset_record - reset a record to its unaligned state, in place
+/** @param bamdata - pointer to the bam data to be reset
+ *  @param config - pointer to internal configuration data
+returns 1 if the record is to be dropped, 0 otherwise
+*/
+static int reset_record(bam1_t *bamdata, conf_data *config)
+{
+    uint8_t *cigar = NULL;
+    size_t cigar_len = 0;
+
+    if (bamdata->core.flag & BAM_FSECONDARY || bamdata->core.flag & BAM_FSUPPLEMENTARY) {
+        return 1;
+    }
+    //update flags
+    uint16_t flags = bamdata->core.flag & ~BAM_FPROPER_PAIR;    //reset pair info
+    flags |= BAM_FUNMAP;                                        //mark as unmapped
+    if (bamdata->core.flag & BAM_FPAIRED) {
+        flags |= BAM_FMUNMAP;                                   //mark mate as unmapped, if it was a pair
+    }
+    flags &= ~BAM_FMREVERSE;                                    //reset mate orientation
+    if (!(config->ctrlFlags & RESET_KEEPDUPFLAG)) {
+        flags &= ~BAM_FDUP;                                     //reset dup flag from alignment
+    }
+
+    //drop the cigar, moving sequence, quality and aux data down over it
+    cigar = (uint8_t *)bam_get_cigar(bamdata);
+    cigar_len = bamdata->core.n_cigar * sizeof(uint32_t);
+    if (cigar_len) {
+        memmove(cigar, cigar + cigar_len, bamdata->data + bamdata->l_data - (cigar + cigar_len));
+        bamdata->l_data -= cigar_len;
+        bamdata->core.n_cigar = 0;
+    }
+
+    if (bamdata->core.flag & BAM_FREVERSE) {
+        //sequence data ordered as reverse complemented, reorder/complement sequence and quality data as read
+        //and clear the flag; done on the packed data
+        seq_nt16_revcomp_iupac(bam_get_seq(bamdata), bamdata->core.l_qseq);
+        qual_reverse(bam_get_qual(bamdata), bamdata->core.l_qseq);
+        flags &= ~BAM_FREVERSE;                                 //reset flag as well
+    }
+
+    //alignment fields as bam_set1 sets them for an unmapped read
+    bamdata->core.flag = flags;
+    bamdata->core.tid = -1;
+    bamdata->core.pos = -1;
+    bamdata->core.bin = hts_reg2bin(-1, 0, 14, 5);
+    bamdata->core.qual = 0;
+    bamdata->core.mtid = -1;
+    bamdata->core.mpos = -1;
+    bamdata->core.isize = 0;
+
+    removeauxtags(bamdata, config);
+    return 0;
+}
+
+typedef struct reset_batch
+{
+    conf_data *config;
+    bam1_t *bamdata[RESET_BATCH_SIZE];
+    int drop[RESET_BATCH_SIZE];
+    int n;
+} reset_batch;
+
+static void *reset_batch_func(void *arg)
+{
+    reset_batch *bt = (reset_batch *)arg;
+    int i = 0;
+
+    for (i = 0; i < bt->n; ++i) {
+        bt->drop[i] = reset_record(bt->bamdata[i], bt->config);
+    }
+    return bt;
+}
+
+/// reset_threaded - reset records in batches on the thread pool
+/** @param infile - input samfile pointer
+ *  @param in_samhdr - input header
+ *  @param outfile - output sam file pointer
+ *  @param out_samhdr - output header
+ *  @param config - pointer to internal configuration data
+ *  @param pool - the thread pool
+ *  @param ret_r - set to the last read result
+ *  @param ret_w - set to the last write result
+Records are read and written here, in order, while the thread pool resets them.
+returns nothing, errors are given via ret_r and ret_w
+*/
+static void reset_threaded(samFile *infile, sam_hdr_t *in_samhdr, samFile *outfile, sam_hdr_t *out_samhdr,
+                           conf_data *config, hts_tpool *pool, int *ret_r, int *ret_w)
+{
+    int nbatch = 2 * hts_tpool_size(pool), next = 0, in_flight = 0, i = 0, j = 0;
+    reset_batch *batch = calloc(nbatch, sizeof(*batch));
+    hts_tpool_process *queue = NULL;
+
+    *ret_r = 0; *ret_w = 0;
+    if (!batch) {
+        fprintf(stderr, "Failed to allocate data memory!\n");
+        *ret_w = -1;
+        return;
+    }
+    for (i = 0; i < nbatch; ++i) {
+        batch[i].config = config;
+        for (j = 0; j < RESET_BATCH_SIZE; ++j) {
+            if (!(batch[i].bamdata[j] = bam_init1())) {
+                fprintf(stderr, "Failed to allocate data memory!\n");
+                *ret_w = -1;
+                goto end;
+            }
+        }
+    }
+
+    //the ring of batches is no larger than the queue, so dispatching never waits on results yet to be collected
+    if (!(queue = hts_tpool_process_init(pool, nbatch, 0))) {
+        fprintf(stderr, "Failed to setup thread pool queue!\n");
+        *ret_w = -1;
+        goto end;
+    }
+
+    while (1) {
+        while (*ret_r >= 0 && *ret_w >= 0 && in_flight < nbatch) {
+            reset_batch *bt = &batch[next];
+            for (bt->n = 0; bt->n < RESET_BATCH_SIZE; ++bt->n) {
+                if (0 > (*ret_r = sam_read1(infile, in_samhdr, bt->bamdata[bt->n])))
+                    break;
+            }
+            if (!bt->n)
+                break;
+            if (0 > hts_tpool_dispatch(pool, queue, reset_batch_func, bt)) {
+                fprintf(stderr, "Failed to queue data!\n");
+                *ret_w = -1;
+                break;
+            }
+            next = (next + 1) % nbatch;
+            ++in_flight;
+        }
+        if (!in_flight)
+            break;
+
+        hts_tpool_result *res = hts_tpool_next_result_wait(queue);
+        if (!res) {
+            fprintf(stderr, "Failed to get results from thread pool!\n");
+            *ret_w = -1;
+            break;
+        }
+        reset_batch *bt = (reset_batch *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        --in_flight;
+
+        //after an error the remaining batches are only collected
+        for (i = 0; i < bt->n && *ret_w >= 0; ++i) {
+            if (bt->drop[i])
+                continue;
+            errno = 0;
+            if (0 > (*ret_w = sam_write1(outfile, out_samhdr, bt->bamdata[i]))) {
+                print_error_errno("reset", "Failed to write output data (%d)!\n", errno);
+            }
+        }
+    }
+
+end:
+    if (queue)
+        hts_tpool_process_destroy(queue);
+    for (i = 0; i < nbatch; ++i) {
+        for (j = 0; j < RESET_BATCH_SIZE; ++j) {
+            if (batch[i].bamdata[j])
+                bam_destroy1(batch[i].bamdata[j]);
+        }
+    }
+    free(batch);
+}
+
 /// reset - do the reset of data and create output; create output header with required rg/pg data, add bamdata with flags set to unmapped, pair info and orientation reset,
 // reerse and complement alignment if required
 /** @param infile - input samfile pointer
  *  @param outfile - output sam file pointer
  *  @param config - pointer to internal configuration data
  *  @param args - string containing dump of command line invocation
+ *  @param pool - thread pool to reset records on, or NULL
 returns 1 on failure 0 on success
 */
-int reset(samFile *infile, samFile *outfile, conf_data *config, char *args)
+int reset(samFile *infile, samFile *outfile, conf_data *config, char *args, hts_tpool *pool)
 {
     sam_hdr_t *in_samhdr = NULL, *out_samhdr = NULL;
-    int ret = EXIT_FAILURE, ret_r = 0, ret_w = 0, i = 0;
-    bam1_t *bamdata = NULL, *outdata = NULL;
-    kstring_t querydata = KS_INITIALIZE, qualdata = KS_INITIALIZE;
-    char *sp = NULL, *qp = NULL;
-    uint8_t *bamquery = NULL, *bamqual = NULL;
+    int ret = EXIT_FAILURE, ret_r = 0, ret_w = 0;
+    bam1_t *bamdata = NULL;
 
     if (!infile || !outfile) {
         fprintf(stderr, "Invalid parameters in reset!\n");
@@ -328,86 +475,35 @@ int reset(samFile *infile, samFile *outfile, conf_data *config, char *args)
         goto error;
     }
 
-    bamdata = bam_init1();      //input bam
-    outdata = bam_init1();      //output bam
-    if (!bamdata || !outdata)
-    {
-        fprintf(stderr, "Failed to allocate data memory!\n");
-        goto error;
+    errno = 0;
+    if (pool) {
+        reset_threaded(infile, in_samhdr, outfile, out_samhdr, config, pool, &ret_r, &ret_w);
     }
-
-    errno = 0; i = 0;
-    sp = NULL; qp = NULL;
-    bamquery = NULL; bamqual = NULL;
-
-    //get bam data, make updates and dump to output
-    while (0 <= (ret_r = sam_read1(infile, in_samhdr, bamdata)))
-    {
-        sp = NULL; qp = NULL;
-        bamquery = NULL; bamqual = NULL;
-
-        // read data
-        if (bamdata->core.flag & BAM_FSECONDARY || bamdata->core.flag & BAM_FSUPPLEMENTARY) {
-            continue;
-        }
-        //update flags
-        uint16_t flags = bamdata->core.flag & ~BAM_FPROPER_PAIR;    //reset pair info
-        flags |= BAM_FUNMAP;                                        //mark as unmapped
-        if (bamdata->core.flag & BAM_FPAIRED) {
-            flags |= BAM_FMUNMAP;                                   //mark mate as unmapped, if it was a pair
-        }
-        flags &= ~BAM_FMREVERSE;                                    //reset mate orientation
-        if (!(config->ctrlFlags & RESET_KEEPDUPFLAG)) {
-            flags &= ~BAM_FDUP;                                     //reset dup flag from alignment
+    else {
+        bamdata = bam_init1();      //input bam, reset in place for output
+        if (!bamdata)
+        {
+            fprintf(stderr, "Failed to allocate data memory!\n");
+            goto error;
         }
 
-        if (0 > ks_resize(&querydata, bamdata->core.l_qseq) ||
-            0 > ks_resize(&qualdata, bamdata->core.l_qseq)) {
-            fprintf(stderr, "Failed to get allocate memory!\n");
-            ret_r = -4;
-            break;
-        }
-        ks_clear(&querydata);
-        ks_clear(&qualdata);
-
-        sp = ks_str(&querydata);
-        qp = ks_str(&qualdata);
-        bamquery = bam_get_seq(bamdata);
-        bamqual = bam_get_qual(bamdata);
-        if (bamdata->core.flag & BAM_FREVERSE) {
-            //sequence data ordered as reverse complemented, reorder/complement sequence and quality data as read and clear the flag
-            for (i = bamdata->core.l_qseq - 1; i >= 0; --i) {
-                *sp++ = "=TGKCYSBAWRDMHVN"[bam_seqi(bamquery, i)];
-                *qp++ = bamqual[i];
-            }
-            flags &= ~BAM_FREVERSE;                                 //reset flag as well
-        }
-        else {
-            //data in read order itself
-            for (i = 0; i < bamdata->core.l_qseq ; ++i) {
-                *sp++ = seq_nt16_str[bam_seqi(bamquery, i)];
+        //get bam data, make updates and dump to output
+        while (0 <= (ret_r = sam_read1(infile, in_samhdr, bamdata)))
+        {
+            if (reset_record(bamdata, config)) {
+                continue;
             }
-            memcpy(qp, bam_get_qual(bamdata), bamdata->core.l_qseq);
-        }
-
-        removeauxtags(bamdata, config);
-        if (0 > (ret_w = bam_set1(outdata, bamdata->core.l_qname - bamdata->core.l_extranul - 1, bam_get_qname(bamdata), flags, -1, -1, 0, 0, NULL, -1, -1, 0, bamdata->core.l_qseq, querydata.s, qualdata.s, bam_get_l_aux(bamdata)))) {
-            print_error_errno("reset", "Failed to set output data (%d)!\n", errno);
-            break;
-        }
-
-        memcpy(bam_get_aux(outdata), bam_get_aux(bamdata), bam_get_l_aux(bamdata));
-        outdata->l_data += bam_get_l_aux(bamdata);
 
-        errno = 0;
-        //write bam data to output
-        if (0 > (ret_w = sam_write1(outfile, out_samhdr, outdata)))
-        {
-            print_error_errno("reset", "Failed to write output data (%d)!\n", errno);
-            break;
+            errno = 0;
+            //write bam data to output
+            if (0 > (ret_w = sam_write1(outfile, out_samhdr, bamdata)))
+            {
+                print_error_errno("reset", "Failed to write output data (%d)!\n", errno);
+                break;
+            }
+            // wrote the data, continue read/write cycle
+            errno = 0;
         }
-        // wrote the data, continue read/write cycle
-        errno = 0;
     }
 
     if (-1 > ret_r || 0 > ret_w) {
@@ -428,13 +524,6 @@ error:
 
     if (bamdata)
         bam_destroy1(bamdata);
-    if (outdata)
-        bam_destroy1(outdata);
-
-    if (qualdata.s)
-        ks_free(&qualdata);
-    if (querydata.s)
-        ks_free(&querydata);
     return ret;
 }
 
@@ -462,7 +551,7 @@ returns 1 on failure 0 on success
 int main_reset(int argc, char *argv[])
 {
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', '-', 'O', '-', '-', '@'),       //let output format and thread count be given by user - long options
+        SAM_OPT_GLOBAL_OPTIONS('-', '-', 'O', '-', '-', '@', '-', '-'),       //let output format and thread count be given by user - long options
         {"keep-tag", required_argument, NULL, LONG_OPT('x')},       //aux tags to be retained, supports ^ STR
         {"remove-tag", required_argument, NULL, 'x'},               //aux tags to be removed
         {"no-RG", no_argument, NULL, 1},                            //no RG lines in output, default is to keep them
@@ -604,7 +693,7 @@ int main_reset(int argc, char *argv[])
     args = stringify_argv(argc + 1, argv - 1);              //to dump invocation in PG line
 
     //do the reset!
-    ret = reset(infile, outfile, &resetconf, args);
+    ret = reset(infile, outfile, &resetconf, args, tpool.pool);
 
 exit:
     if (args)
@@ -0,0 +1,273 @@
+/*  sam_numa.c -- placing threads and buffers on NUMA nodes.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+
+#include <config.h>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for cpu_set_t and pthread_setaffinity_np()
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "sam_numa.h"
+#include "samtools.h"
+
+#if defined(__linux__) && defined(SYS_mbind) && defined(CPU_ALLOC)
+#define SAM_NUMA_LINUX 1
+#endif
+
+enum { NUMA_NONE, NUMA_NODE, NUMA_SPREAD };
+
+#define MAX_NODES 1024
+// From <linux/mempolicy.h>
+#define SAM_MPOL_PREFERRED  1
+#define SAM_MPOL_INTERLEAVE 3
+
+static int numa_mode = NUMA_NONE;
+
+#ifdef SAM_NUMA_LINUX
+
+static struct {
+    int n;              // nodes found
+    int id[MAX_NODES];  // node numbers, which may have gaps
+    cpu_set_t *cpus[MAX_NODES];
+    size_t cpus_size;
+    int node;           // index of the chosen node in NUMA_NODE mode
+} topo;
+
+// Parses a sysfs CPU list such as "0-31,64-95" into set
+static int parse_cpulist(const char *s, cpu_set_t *set, size_t size) {
+    CPU_ZERO_S(size, set);
+    while (*s && *s != '\n') {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s) return -1;
+        if (*end == '-') hi = strtol(end + 1, &end, 10);
+        for (; lo <= hi; lo++)
+            CPU_SET_S(lo, size, set);
+        s = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Reads the nodes and their CPUs.  Returns the number of nodes, or 0 if
+// they can't be read.
+static int read_topology(void) {
+    int node, ncpu = sysconf(_SC_NPROCESSORS_CONF);
+    char fn[64], line[4096];
+
+    if (topo.n)
+        return topo.n;
+    if (ncpu < 1) ncpu = 1;
+    topo.cpus_size = CPU_ALLOC_SIZE(ncpu);
+    for (node = 0; node < MAX_NODES && topo.n < MAX_NODES; node++) {
+        FILE *fp;
+        snprintf(fn, sizeof(fn), "/sys/devices/system/node/node%d/cpulist",
+                 node);
+        if (!(fp = fopen(fn, "r")))
+            continue;
+        if (fgets(line, sizeof(line), fp) && line[0] != '\n') {
+            cpu_set_t *set = CPU_ALLOC(ncpu);
+            if (set && parse_cpulist(line, set, topo.cpus_size) == 0) {
+                topo.id[topo.n] = node;
+                topo.cpus[topo.n++] = set;
+            } else {
+                CPU_FREE(set);
+            }
+        }
+        fclose(fp);
+    }
+    return topo.n;
+}
+
+// The index of the node the calling thread is running on
+static int current_node(void) {
+    int cpu = sched_getcpu(), i;
+    for (i = 0; cpu >= 0 && i < topo.n; i++)
+        if (CPU_ISSET_S(cpu, topo.cpus_size, topo.cpus[i]))
+            return i;
+    return 0;
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next, arrived, n;
+} pin_barrier_t;
+
+// Run once on each pool thread.  Every job waits until all have started,
+// so no thread can take two of them.
+static void *pin_worker(void *arg) {
+    pin_barrier_t *b = (pin_barrier_t *) arg;
+    int i, node;
+
+    pthread_mutex_lock(&b->lock);
+    i = b->next++;
+    pthread_mutex_unlock(&b->lock);
+
+    node = numa_mode == NUMA_NODE ? topo.node : i % topo.n;
+    pthread_setaffinity_np(pthread_self(), topo.cpus_size, topo.cpus[node]);
+
+    pthread_mutex_lock(&b->lock);
+    if (++b->arrived == b->n)
+        pthread_cond_broadcast(&b->cond);
+    while (b->arrived < b->n)
+        pthread_cond_wait(&b->cond, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+// Pins each of the n threads of p
+static int pin_pool(hts_tpool *p, int n) {
+    pin_barrier_t b = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                        0, 0, n };
+    hts_tpool_process *q = hts_tpool_process_init(p, n, 1);
+    int i, ret = 0;
+
+    if (!q)
+        return -1;
+    for (i = 0; i < n; i++) {
+        if (hts_tpool_dispatch(p, q, pin_worker, &b) < 0) {
+            // Release the jobs already waiting
+            pthread_mutex_lock(&b.lock);
+            b.n = b.arrived = i;
+            pthread_cond_broadcast(&b.cond);
+            pthread_mutex_unlock(&b.lock);
+            ret = -1;
+            break;
+        }
+    }
+    hts_tpool_process_flush(q);
+    hts_tpool_process_destroy(q);
+    pthread_mutex_destroy(&b.lock);
+    pthread_cond_destroy(&b.cond);
+    return ret;
+}
+
+static void set_mempolicy_range(void *p, size_t size) {
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) p + page - 1) & ~(uintptr_t) (page - 1);
+    uintptr_t end = ((uintptr_t) p + size) & ~(uintptr_t) (page - 1);
+    const size_t bits = 8 * sizeof(unsigned long);
+    int i, mode;
+
+    if (end <= start)
+        return;
+    if (numa_mode == NUMA_NODE) {
+        mode = SAM_MPOL_PREFERRED;
+        mask[topo.id[topo.node] / bits] |= 1UL << (topo.id[topo.node] % bits);
+    } else {
+        mode = SAM_MPOL_INTERLEAVE;
+        for (i = 0; i < topo.n; i++)
+            mask[topo.id[i] / bits] |= 1UL << (topo.id[i] % bits);
+    }
+    // Only a hint: the pages still come from elsewhere if it fails
+    syscall(SYS_mbind, (void *) start, end - start, mode, mask,
+            (unsigned long) MAX_NODES, 0);
+}
+
+#endif // SAM_NUMA_LINUX
+
+int sam_numa_set(const char *mode) {
+    int node = -1;
+
+    if (strcmp(mode, "none") == 0) {
+        numa_mode = NUMA_NONE;
+        return 0;
+    } else if (strcmp(mode, "spread") == 0) {
+        numa_mode = NUMA_SPREAD;
+    } else if (strcmp(mode, "node") == 0) {
+        numa_mode = NUMA_NODE;
+    } else if (strncmp(mode, "node=", 5) == 0 && mode[5]) {
+        char *end;
+        node = strtol(mode + 5, &end, 10);
+        if (*end || node < 0) {
+            print_error("affinity", "invalid node number in \"%s\"", mode);
+            return -1;
+        }
+        numa_mode = NUMA_NODE;
+    } else {
+        print_error("affinity", "unknown mode \"%s\"; "
+                    "expected none, node[=N] or spread", mode);
+        return -1;
+    }
+
+#ifdef SAM_NUMA_LINUX
+    if (read_topology() < 2 && node < 0) {
+        // A single node, so nothing to do
+        numa_mode = NUMA_NONE;
+        return 0;
+    }
+    if (numa_mode == NUMA_NODE) {
+        int i;
+        if (node < 0) {
+            topo.node = current_node();
+        } else {
+            for (i = 0; i < topo.n && topo.id[i] != node; i++)
+                ;
+            if (i == topo.n) {
+                print_error("affinity", "no NUMA node %d", node);
+                return -1;
+            }
+            topo.node = i;
+        }
+        // The main thread stays there too, so its allocations do
+        if (sched_setaffinity(0, topo.cpus_size, topo.cpus[topo.node]) < 0)
+            print_error_errno("affinity", "couldn't set the CPU affinity");
+    }
+#else
+    numa_mode = NUMA_NONE;
+#endif
+    return 0;
+}
+
+hts_tpool *sam_numa_tpool_init(int n) {
+    hts_tpool *p = hts_tpool_init(n);
+#ifdef SAM_NUMA_LINUX
+    if (p && numa_mode != NUMA_NONE && pin_pool(p, hts_tpool_size(p)) < 0)
+        print_error("affinity", "couldn't place the thread pool's threads");
+#endif
+    return p;
+}
+
+void *sam_numa_alloc(size_t size) {
+    void *p = malloc(size);
+#ifdef SAM_NUMA_LINUX
+    // Pages aren't given a node until first touched, so setting the policy
+    // now still places them.  Only whole pages within the buffer are
+    // changed, so nothing else is affected.
+    if (p && numa_mode != NUMA_NONE)
+        set_mempolicy_range(p, size);
+#endif
+    return p;
+}
@@ -0,0 +1,54 @@
+/*  sam_numa.h -- placing threads and buffers on NUMA nodes.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef SAM_NUMA_H
+#define SAM_NUMA_H
+
+#include <stddef.h>
+#include <htslib/thread_pool.h>
+
+/*
+ * The --affinity MODE global option places the threads of the command's
+ * pool, and its large buffers, on NUMA nodes:
+ *
+ *   none      Leave it to the operating system (the default)
+ *   node[=N]  Keep the main thread and all pool threads on one node, N or
+ *             the one the command started on, and allocate memory there
+ *   spread    Spread the pool threads over the nodes in turn, each pinned
+ *             to the CPUs of its node, and interleave large buffers
+ *
+ * The setting applies to the whole process.  Where the topology can't be
+ * read, as on non-Linux systems, every mode behaves as "none".
+ */
+
+/// Parse and apply an --affinity MODE argument
+/** @return 0 on success, -1 if mode is not recognised */
+int sam_numa_set(const char *mode);
+
+/// Make a thread pool with its threads placed as set by sam_numa_set()
+hts_tpool *sam_numa_tpool_init(int n);
+
+/// Allocate a large buffer, to be freed with free()
+/** Its pages are placed on the nodes used by the pool threads. */
+void *sam_numa_alloc(size_t size);
+
+#endif
@@ -28,6 +28,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdlib.h>
 #include <string.h>
 #include "sam_opts.h"
+#include "sam_numa.h"
 
 /*
  * Processes a standard "global" samtools long option.
@@ -96,6 +97,18 @@ int parse_sam_global_opt(int c, const char *optarg, const struct option *lopt,
         } else if (strcmp(lopt->name, "verbosity") == 0) {
             hts_verbose = atoi(optarg);
             break;
+        } else if (strcmp(lopt->name, "profile") == 0) {
+            free(ga->profile);
+            if (!(ga->profile = strdup(optarg))) {
+                fprintf(stderr, "Unable to allocate memory in "
+                                "parse_sam_global_opt.\n");
+
+                return -1;
+            }
+            break;
+        } else if (strcmp(lopt->name, "affinity") == 0) {
+            r = sam_numa_set(optarg);
+            break;
         }
     }
 
@@ -133,7 +146,7 @@ void sam_global_opt_help(FILE *fp, const char *shortopts) {
     int i = 0;
 
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS(0,0,0,0,0,0),
+        SAM_OPT_GLOBAL_OPTIONS(0,0,0,0,0,0,0,0),
         { NULL, 0, NULL, 0 }
     };
 
@@ -172,6 +185,12 @@ void sam_global_opt_help(FILE *fp, const char *shortopts) {
         else if (strcmp(lopts[i].name, "verbosity") == 0)
             fprintf(fp,"verbosity INT\n"
                     "               Set level of verbosity\n");
+        else if (strcmp(lopts[i].name, "profile") == 0)
+            fprintf(fp,"profile FILE\n"
+                    "               Write timings and counters as JSON to FILE\n");
+        else if (strcmp(lopts[i].name, "affinity") == 0)
+            fprintf(fp,"affinity none|node[=N]|spread\n"
+                    "               Place threads and large buffers on NUMA nodes [none]\n");
     }
 }
 
@@ -191,4 +210,6 @@ void sam_global_args_free(sam_global_args *ga) {
 
     if (ga->reference)
         free(ga->reference);
+
+    free(ga->profile);
 }
@@ -36,6 +36,7 @@ typedef struct sam_global_args {
     char *reference;
     int nthreads;
     int write_index;
+    char *profile;
 } sam_global_args;
 
 #define SAM_GLOBAL_ARGS_INIT {{0},{0}}
@@ -49,6 +50,8 @@ enum {
     SAM_OPT_NTHREADS,
     SAM_OPT_WRITE_INDEX,
     SAM_OPT_VERBOSITY,
+    SAM_OPT_PROFILE,
+    SAM_OPT_AFFINITY,
 };
 
 #define SAM_OPT_VAL(val, defval) ((val) == '-')? '?' : (val)? (val) : (defval)
@@ -59,7 +62,10 @@ enum {
 // 0      No short option has been assigned. Use --long-opt only.
 // '-'    Both long and short options are disabled.
 // <c>    Otherwise the equivalent short option is character <c>.
-#define SAM_OPT_GLOBAL_OPTIONS(o1, o2, o3, o4, o5, o6) \
+// o7 is --profile, which should only be enabled by commands that call
+// sam_prof_init(), and o8 is --affinity, for commands whose thread pool
+// and buffers come from sam_numa.
+#define SAM_OPT_GLOBAL_OPTIONS(o1, o2, o3, o4, o5, o6, o7, o8) \
     {"input-fmt",         required_argument, NULL, SAM_OPT_VAL(o1, SAM_OPT_INPUT_FMT)}, \
     {"input-fmt-option",  required_argument, NULL, SAM_OPT_VAL(o2, SAM_OPT_INPUT_FMT_OPTION)}, \
     {"output-fmt",        required_argument, NULL, SAM_OPT_VAL(o3, SAM_OPT_OUTPUT_FMT)}, \
@@ -67,7 +73,9 @@ enum {
     {"reference",         required_argument, NULL, SAM_OPT_VAL(o5, SAM_OPT_REFERENCE)}, \
     {"threads",           required_argument, NULL, SAM_OPT_VAL(o6, SAM_OPT_NTHREADS)}, \
     {"write-index",       no_argument,       NULL, SAM_OPT_WRITE_INDEX}, \
-    {"verbosity",         required_argument, NULL, SAM_OPT_VERBOSITY}
+    {"verbosity",         required_argument, NULL, SAM_OPT_VERBOSITY}, \
+    {"profile",           required_argument, NULL, SAM_OPT_VAL(o7, SAM_OPT_PROFILE)}, \
+    {"affinity",          required_argument, NULL, SAM_OPT_VAL(o8, SAM_OPT_AFFINITY)}
 
 /*
  * Processes a standard "global" samtools long option.
@@ -0,0 +1,322 @@
+/*  sam_pipe.c -- record channels between the stages of samtools pipeline.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sam_pipe.h"
+#include "sam_numa.h"
+
+#define PIPE_BATCH_SIZE 256
+
+typedef struct pipe_batch {
+    bam1_t *b[PIPE_BATCH_SIZE];
+    int n, next;
+    struct pipe_batch *link;
+} pipe_batch;
+
+struct sam_pipe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    sam_hdr_t *hdr;
+    int hdr_sent;
+    pipe_batch *head, *tail;    // full batches, oldest first
+    pipe_batch *spare;          // emptied batches for reuse
+    int n_queued, depth;
+    pipe_batch *wr, *rd;        // only touched by the writer / reader
+    int wr_done, wr_failed, rd_done;
+};
+
+static void batch_destroy(pipe_batch *bt) {
+    int i;
+    for (i = 0; i < PIPE_BATCH_SIZE; i++)
+        if (bt->b[i]) bam_destroy1(bt->b[i]);
+    free(bt);
+}
+
+static void batch_list_destroy(pipe_batch *bt) {
+    while (bt) {
+        pipe_batch *next = bt->link;
+        batch_destroy(bt);
+        bt = next;
+    }
+}
+
+sam_pipe *sam_pipe_init(int depth) {
+    sam_pipe *p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+    p->depth = depth > 0 ? depth : 1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    return p;
+}
+
+void sam_pipe_destroy(sam_pipe *p) {
+    if (!p)
+        return;
+    batch_list_destroy(p->head);
+    batch_list_destroy(p->spare);
+    if (p->wr) batch_destroy(p->wr);
+    if (p->rd) batch_destroy(p->rd);
+    if (p->hdr) sam_hdr_destroy(p->hdr);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free(p);
+}
+
+int sam_pipe_write_header(sam_pipe *p, const sam_hdr_t *h) {
+    sam_hdr_t *dup = sam_hdr_dup(h);
+    if (!dup)
+        return -1;
+    pthread_mutex_lock(&p->lock);
+    if (p->hdr_sent || p->rd_done) {
+        pthread_mutex_unlock(&p->lock);
+        sam_hdr_destroy(dup);
+        return -1;
+    }
+    p->hdr = dup;
+    p->hdr_sent = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+// Queue the writer's batch, waiting while the queue is full
+static int pipe_push(sam_pipe *p) {
+    pipe_batch *bt = p->wr;
+    p->wr = NULL;
+    pthread_mutex_lock(&p->lock);
+    while (p->n_queued >= p->depth && !p->rd_done)
+        pthread_cond_wait(&p->cond, &p->lock);
+    if (p->rd_done) {
+        bt->link = p->spare;
+        p->spare = bt;
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+    bt->link = NULL;
+    if (p->tail) p->tail->link = bt;
+    else p->head = bt;
+    p->tail = bt;
+    p->n_queued++;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+int sam_pipe_write(sam_pipe *p, const bam1_t *b) {
+    pipe_batch *bt = p->wr;
+
+    if (!bt) {
+        pthread_mutex_lock(&p->lock);
+        if ((bt = p->spare) != NULL)
+            p->spare = bt->link;
+        pthread_mutex_unlock(&p->lock);
+        if (!bt && !(bt = calloc(1, sizeof(*bt))))
+            return -1;
+        bt->n = bt->next = 0;
+        p->wr = bt;
+    }
+    if (!bt->b[bt->n] && !(bt->b[bt->n] = bam_init1()))
+        return -1;
+    if (!bam_copy1(bt->b[bt->n], b))
+        return -1;
+    if (++bt->n == PIPE_BATCH_SIZE)
+        return pipe_push(p);
+    return 0;
+}
+
+void sam_pipe_close_write(sam_pipe *p, int failed) {
+    if (!p)
+        return;
+    if (p->wr) {
+        if (!failed && p->wr->n > 0 && pipe_push(p) < 0)
+            failed = 1;
+        if (p->wr) {
+            batch_destroy(p->wr);
+            p->wr = NULL;
+        }
+    }
+    pthread_mutex_lock(&p->lock);
+    if (!p->wr_done) {
+        p->wr_done = 1;
+        p->wr_failed = failed;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+sam_hdr_t *sam_pipe_read_header(sam_pipe *p) {
+    sam_hdr_t *h;
+    pthread_mutex_lock(&p->lock);
+    while (!p->hdr_sent && !p->wr_done)
+        pthread_cond_wait(&p->cond, &p->lock);
+    h = p->hdr;
+    p->hdr = NULL;
+    pthread_mutex_unlock(&p->lock);
+    return h;
+}
+
+int sam_pipe_read(void *data, sam_hdr_t *h, bam1_t *b) {
+    sam_pipe *p = (sam_pipe *) data;
+    pipe_batch *bt = p->rd;
+    bam1_t *a, tmp;
+
+    if (!bt || bt->next == bt->n) {
+        pthread_mutex_lock(&p->lock);
+        if (bt) {
+            bt->link = p->spare;
+            p->spare = bt;
+            p->rd = NULL;
+        }
+        while (!p->head && !p->wr_done)
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (!(bt = p->head)) {
+            int r = p->wr_failed ? -2 : -1;
+            pthread_mutex_unlock(&p->lock);
+            return r;
+        }
+        if (!(p->head = bt->link))
+            p->tail = NULL;
+        p->n_queued--;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        bt->next = 0;
+        p->rd = bt;
+    }
+
+    // Hand the record over by swapping it with b, so it isn't copied
+    a = bt->b[bt->next++];
+    tmp = *b;
+    *b = *a;
+    *a = tmp;
+
+    return b->l_data;
+}
+
+void sam_pipe_close_read(sam_pipe *p) {
+    if (!p)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->rd_done = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Stages */
+
+static pthread_key_t stage_key;
+static pthread_once_t stage_once = PTHREAD_ONCE_INIT;
+
+static void stage_key_init(void) {
+    pthread_key_create(&stage_key, NULL);
+}
+
+static sam_stage *stage_self(void) {
+    pthread_once(&stage_once, stage_key_init);
+    return (sam_stage *) pthread_getspecific(stage_key);
+}
+
+int sam_stage_init(sam_stage *st, sam_pipe *in, sam_pipe *out,
+                   hts_tpool *pool) {
+    memset(st, 0, sizeof(*st));
+    st->in = in;
+    st->out = out;
+    st->pool = pool;
+    if (pthread_mutex_init(&st->lock, NULL) != 0)
+        return -1;
+    if (pthread_cond_init(&st->cond, NULL) != 0) {
+        pthread_mutex_destroy(&st->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void sam_stage_destroy(sam_stage *st) {
+    pthread_mutex_destroy(&st->lock);
+    pthread_cond_destroy(&st->cond);
+}
+
+void sam_stage_set(sam_stage *st) {
+    pthread_once(&stage_once, stage_key_init);
+    pthread_setspecific(stage_key, st);
+}
+
+sam_pipe *sam_stage_input(const char *fn) {
+    sam_stage *st = stage_self();
+    return st && fn && strcmp(fn, "-") == 0 ? st->in : NULL;
+}
+
+sam_pipe *sam_stage_output(const char *fn) {
+    sam_stage *st = stage_self();
+    return st && (!fn || strcmp(fn, "-") == 0) ? st->out : NULL;
+}
+
+static void stage_signal(sam_stage *st, int done, int failed) {
+    pthread_mutex_lock(&st->lock);
+    st->ready = 1;
+    if (done) {
+        st->done = 1;
+        st->failed = failed;
+    }
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+void sam_stage_ready(void) {
+    sam_stage *st = stage_self();
+    if (st)
+        stage_signal(st, 0, 0);
+}
+
+int sam_stage_wait_ready(sam_stage *st) {
+    int failed;
+    pthread_mutex_lock(&st->lock);
+    while (!st->ready)
+        pthread_cond_wait(&st->cond, &st->lock);
+    failed = st->done && st->failed;
+    pthread_mutex_unlock(&st->lock);
+    return failed ? -1 : 0;
+}
+
+void sam_stage_done(sam_stage *st, int failed) {
+    sam_pipe_close_write(st->out, failed);
+    sam_pipe_close_read(st->in);
+    stage_signal(st, 1, failed);
+}
+
+hts_tpool *sam_stage_tpool_init(int n) {
+    sam_stage *st = stage_self();
+    if (st && st->pool)
+        return st->pool;
+    return sam_numa_tpool_init(n);
+}
+
+void sam_stage_tpool_destroy(hts_tpool *p) {
+    sam_stage *st = stage_self();
+    if (p && !(st && p == st->pool))
+        hts_tpool_destroy(p);
+}
@@ -0,0 +1,107 @@
+/*  sam_pipe.h -- record channels between the stages of samtools pipeline.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef SAM_PIPE_H
+#define SAM_PIPE_H
+
+#include <pthread.h>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+
+/*
+ * A sam_pipe carries a header followed by alignment records from one
+ * thread to another, in batches.  At most a fixed number of batches are
+ * queued, so a writer that gets ahead waits for the reader.
+ */
+typedef struct sam_pipe sam_pipe;
+
+/// Make a pipe holding up to depth batches of records
+sam_pipe *sam_pipe_init(int depth);
+void sam_pipe_destroy(sam_pipe *p);
+
+/// Send the header; this must come before any records
+/** @return 0 on success, -1 on failure or if the reader has gone */
+int sam_pipe_write_header(sam_pipe *p, const sam_hdr_t *h);
+
+/// Send a copy of b
+/** @return 0 on success, -1 on failure or if the reader has gone */
+int sam_pipe_write(sam_pipe *p, const bam1_t *b);
+
+/// End the stream.  If failed is set, the reader sees an error, not EOF
+void sam_pipe_close_write(sam_pipe *p, int failed);
+
+/// Wait for the header, which the caller then owns
+/** @return the header, or NULL if the writer ended without sending one */
+sam_hdr_t *sam_pipe_read_header(sam_pipe *p);
+
+/// Read the next record, as a sam_rec_src read function
+/** The record is swapped into b.  Returns as sam_read1(). */
+int sam_pipe_read(void *p, sam_hdr_t *h, bam1_t *b);
+
+/// Stop reading; later writes fail so the writer doesn't wait forever
+void sam_pipe_close_read(sam_pipe *p);
+
+/*
+ * A stage of "samtools pipeline" runs a subcommand on its own thread.
+ * Commands that support it take "-" for their main input or output to
+ * mean the neighbouring stage, instead of standard input or output.
+ */
+typedef struct sam_stage {
+    sam_pipe *in, *out;     // NULL at the ends of the pipeline
+    hts_tpool *pool;        // shared by all stages, or NULL
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int ready, done, failed;
+} sam_stage;
+
+int sam_stage_init(sam_stage *st, sam_pipe *in, sam_pipe *out,
+                   hts_tpool *pool);
+void sam_stage_destroy(sam_stage *st);
+
+/// Make st the stage run by the calling thread
+void sam_stage_set(sam_stage *st);
+
+/// The calling thread's input pipe, if fn refers to it, otherwise NULL
+sam_pipe *sam_stage_input(const char *fn);
+
+/// The calling thread's output pipe, if fn refers to it, otherwise NULL
+sam_pipe *sam_stage_output(const char *fn);
+
+/// Called by a command once it no longer needs getopt()'s globals
+/** The next stage doesn't start parsing its options until then. */
+void sam_stage_ready(void);
+
+/// Wait for sam_stage_ready() or sam_stage_done() from st
+/** @return 0 if st is running, -1 if it has already failed */
+int sam_stage_wait_ready(sam_stage *st);
+
+/// Mark st finished, closing its ends of the pipes
+void sam_stage_done(sam_stage *st, int failed);
+
+/// Make a thread pool as sam_numa_tpool_init(), or in a pipeline stage
+/// return the shared one
+hts_tpool *sam_stage_tpool_init(int n);
+
+/// Destroy a pool from sam_stage_tpool_init(), unless it is shared
+void sam_stage_tpool_destroy(hts_tpool *p);
+
+#endif
@@ -0,0 +1,356 @@
+/*  sam_prof.c -- optional profiling of a subcommand run.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <htslib/hfile.h>
+
+#include "sam_prof.h"
+#include "samtools.h"
+
+#define PROF_MAX_STAGES   32
+#define PROF_MAX_COUNTERS 32
+#define PROF_MAX_QUEUES   16
+#define PROF_MAX_OUTPUTS  4
+#define PROF_SAMPLE_USEC  10000
+
+typedef struct {
+    const char *name;
+    double wall, cpu, wall0, cpu0;
+    uint64_t calls;
+} prof_stage_t;
+
+typedef struct {
+    const char *name;
+    uint64_t n;
+} prof_counter_t;
+
+typedef struct {
+    const char *name;
+    hts_tpool_process *q;   // NULL once done
+    uint64_t samples, sum;
+    int max;
+} prof_queue_t;
+
+// An output file, measured once the command has closed it
+typedef struct {
+    const char *name;
+    char *fn;               // NULL for standard output
+    int fd;                 // copy of standard output, or -1
+    uint64_t sofar;         // written before closing, if it can't be measured
+} prof_output_t;
+
+static struct {
+    int on;
+    char *fn;
+    const char *cmd;
+    int nthreads;
+    double wall0;
+    prof_stage_t stage[PROF_MAX_STAGES];
+    prof_counter_t counter[PROF_MAX_COUNTERS];
+    prof_queue_t queue[PROF_MAX_QUEUES];
+    prof_output_t output[PROF_MAX_OUTPUTS];
+    int nstage, ncounter, nqueue, noutput;
+    pthread_mutex_t lock;   // for the queues
+    pthread_t sampler;
+    int sampling, stop;
+} prof = { 0 };
+
+static double wall_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double thread_cpu_time(void) {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+    return 0;
+}
+
+static void *prof_sample(void *arg) {
+    for (;;) {
+        int i;
+        pthread_mutex_lock(&prof.lock);
+        if (prof.stop) {
+            pthread_mutex_unlock(&prof.lock);
+            break;
+        }
+        for (i = 0; i < prof.nqueue; i++) {
+            prof_queue_t *pq = &prof.queue[i];
+            int len;
+            if (!pq->q)
+                continue;
+            len = hts_tpool_process_len(pq->q);
+            pq->samples++;
+            pq->sum += len;
+            if (pq->max < len)
+                pq->max = len;
+        }
+        pthread_mutex_unlock(&prof.lock);
+        usleep(PROF_SAMPLE_USEC);
+    }
+    return NULL;
+}
+
+// JSON strings here are command, stage and counter names, but quote them
+// properly anyway.
+static void json_str(FILE *fp, const char *s) {
+    putc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            fprintf(fp, "\\u%04x", *s);
+        else
+            putc(*s, fp);
+    }
+    putc('"', fp);
+}
+
+static void prof_write(void) {
+    struct rusage ru;
+    long peak_rss = 0;
+    double user = 0, sys = 0;
+    FILE *fp;
+    int i;
+
+    if (!prof.on)
+        return;
+    if (prof.sampling) {
+        pthread_mutex_lock(&prof.lock);
+        prof.stop = 1;
+        pthread_mutex_unlock(&prof.lock);
+        pthread_join(prof.sampler, NULL);
+        prof.sampling = 0;
+    }
+    for (i = 0; i < prof.noutput; i++) {
+        prof_output_t *po = &prof.output[i];
+        struct stat st;
+        uint64_t n = po->sofar;
+        if ((po->fn ? stat(po->fn, &st) : fstat(po->fd, &st)) == 0
+            && S_ISREG(st.st_mode))
+            n = st.st_size;
+        sam_prof_add(po->name, n);
+        free(po->fn);
+        if (po->fd >= 0)
+            close(po->fd);
+    }
+    prof.noutput = 0;
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6;
+        sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+#ifdef __APPLE__
+        peak_rss = ru.ru_maxrss / 1024; // bytes
+#else
+        peak_rss = ru.ru_maxrss;        // kilobytes
+#endif
+    }
+
+    if (!(fp = fopen(prof.fn, "w"))) {
+        print_error_errno("profile", "couldn't write \"%s\"", prof.fn);
+        goto out;
+    }
+    fprintf(fp, "{\n  \"command\": ");
+    json_str(fp, prof.cmd);
+    fprintf(fp, ",\n  \"threads\": %d,\n", prof.nthreads);
+    fprintf(fp, "  \"wall_seconds\": %.6f,\n", wall_time() - prof.wall0);
+    fprintf(fp, "  \"user_seconds\": %.6f,\n", user);
+    fprintf(fp, "  \"sys_seconds\": %.6f,\n", sys);
+    fprintf(fp, "  \"peak_rss_kb\": %ld,\n", peak_rss);
+
+    fprintf(fp, "  \"stages\": [");
+    for (i = 0; i < prof.nstage; i++) {
+        prof_stage_t *s = &prof.stage[i];
+        fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+        json_str(fp, s->name);
+        fprintf(fp, ", \"calls\": %"PRIu64", \"wall_seconds\": %.6f, "
+                "\"main_cpu_seconds\": %.6f}", s->calls, s->wall, s->cpu);
+    }
+    fprintf(fp, "%s],\n", prof.nstage ? "\n  " : "");
+
+    fprintf(fp, "  \"counters\": {");
+    for (i = 0; i < prof.ncounter; i++) {
+        fprintf(fp, "%s\n    ", i ? "," : "");
+        json_str(fp, prof.counter[i].name);
+        fprintf(fp, ": %"PRIu64, prof.counter[i].n);
+    }
+    fprintf(fp, "%s},\n", prof.ncounter ? "\n  " : "");
+
+    fprintf(fp, "  \"queues\": [");
+    for (i = 0; i < prof.nqueue; i++) {
+        prof_queue_t *pq = &prof.queue[i];
+        fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+        json_str(fp, pq->name);
+        fprintf(fp, ", \"samples\": %"PRIu64", \"mean_depth\": %.3f, "
+                "\"max_depth\": %d}", pq->samples,
+                pq->samples ? (double) pq->sum / pq->samples : 0.0, pq->max);
+    }
+    fprintf(fp, "%s]\n}\n", prof.nqueue ? "\n  " : "");
+
+    if (fclose(fp) != 0)
+        print_error_errno("profile", "couldn't write \"%s\"", prof.fn);
+
+ out:
+    free(prof.fn);
+    prof.on = 0;
+}
+
+int sam_prof_init(const sam_global_args *ga, const char *cmd) {
+    if (!ga->profile || prof.on)
+        return 0;
+    if (!(prof.fn = strdup(ga->profile))) {
+        print_error_errno("profile", "couldn't start profiling");
+        return -1;
+    }
+    prof.cmd = cmd;
+    prof.nthreads = ga->nthreads;
+    prof.wall0 = wall_time();
+    pthread_mutex_init(&prof.lock, NULL);
+    if (atexit(prof_write) != 0) {
+        print_error("profile", "couldn't start profiling");
+        free(prof.fn);
+        prof.fn = NULL;
+        return -1;
+    }
+    prof.on = 1;
+    return 0;
+}
+
+int sam_prof_stage(const char *name) {
+    int i;
+    if (!prof.on)
+        return -1;
+    for (i = 0; i < prof.nstage; i++)
+        if (strcmp(prof.stage[i].name, name) == 0)
+            return i;
+    if (prof.nstage == PROF_MAX_STAGES)
+        return -1;
+    prof.stage[i].name = name;
+    return prof.nstage++;
+}
+
+void sam_prof_begin(int stage) {
+    if (!prof.on || stage < 0)
+        return;
+    prof.stage[stage].wall0 = wall_time();
+    prof.stage[stage].cpu0 = thread_cpu_time();
+}
+
+void sam_prof_end(int stage) {
+    prof_stage_t *s;
+    if (!prof.on || stage < 0)
+        return;
+    s = &prof.stage[stage];
+    s->wall += wall_time() - s->wall0;
+    s->cpu += thread_cpu_time() - s->cpu0;
+    s->calls++;
+}
+
+void sam_prof_add(const char *name, uint64_t n) {
+    int i;
+    if (!prof.on)
+        return;
+    for (i = 0; i < prof.ncounter; i++)
+        if (strcmp(prof.counter[i].name, name) == 0)
+            break;
+    if (i == prof.ncounter) {
+        if (i == PROF_MAX_COUNTERS)
+            return;
+        prof.counter[prof.ncounter++].name = name;
+    }
+    prof.counter[i].n += n;
+}
+
+void sam_prof_file(const char *name, samFile *fp) {
+    hFILE *hf;
+    off_t off;
+    if (!prof.on || !fp || !(hf = hts_hfile(fp)))
+        return;
+    if ((off = htell(hf)) > 0)
+        sam_prof_add(name, off);
+}
+
+void sam_prof_output(const char *name, samFile *fp) {
+    prof_output_t *po;
+    hFILE *hf;
+    off_t off;
+    if (!prof.on || !fp || prof.noutput == PROF_MAX_OUTPUTS)
+        return;
+    po = &prof.output[prof.noutput];
+    po->name = name;
+    po->fn = NULL;
+    po->fd = -1;
+    po->sofar = (hf = hts_hfile(fp)) && (off = htell(hf)) > 0 ? off : 0;
+    if (fp->fn && strcmp(fp->fn, "-") != 0) {
+        // Leave off any "##idx##" index name
+        char *idx;
+        if (!(po->fn = strdup(fp->fn)))
+            return;
+        if ((idx = strstr(po->fn, HTS_IDX_DELIM)))
+            *idx = '\0';
+    } else {
+        // Standard output is closed with fp, so keep a copy to check
+        po->fd = dup(STDOUT_FILENO);
+    }
+    prof.noutput++;
+}
+
+void sam_prof_queue(const char *name, hts_tpool_process *q) {
+    if (!prof.on || !q)
+        return;
+    pthread_mutex_lock(&prof.lock);
+    if (prof.nqueue < PROF_MAX_QUEUES) {
+        prof_queue_t *pq = &prof.queue[prof.nqueue++];
+        pq->name = name;
+        pq->q = q;
+    }
+    if (!prof.sampling && pthread_create(&prof.sampler, NULL,
+                                         prof_sample, NULL) == 0)
+        prof.sampling = 1;
+    pthread_mutex_unlock(&prof.lock);
+}
+
+void sam_prof_queue_done(hts_tpool_process *q) {
+    int i;
+    if (!prof.on || !q)
+        return;
+    pthread_mutex_lock(&prof.lock);
+    for (i = 0; i < prof.nqueue; i++)
+        if (prof.queue[i].q == q)
+            prof.queue[i].q = NULL;
+    pthread_mutex_unlock(&prof.lock);
+}
@@ -0,0 +1,77 @@
+/*  sam_prof.h -- optional profiling of a subcommand run.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef SAM_PROF_H
+#define SAM_PROF_H
+
+#include <stdint.h>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+#include "sam_opts.h"
+
+/*
+ * Profiling is turned on by the --profile FILE global option.  Commands
+ * mark stages of their work, count records and bytes, and register their
+ * thread pool queues, which are sampled in the background.  When the
+ * process exits the totals are written to FILE as JSON, with the process
+ * CPU times and peak RSS.
+ *
+ * Every call does nothing unless profiling is on.  Stages and counters
+ * belong to the main thread; queues may be registered from any thread.
+ */
+
+/// Start profiling if ga->profile is set
+/** @param ga   Global options of the command
+    @param cmd  Name of the command, for the report
+    @return 0 on success, -1 on failure
+*/
+int sam_prof_init(const sam_global_args *ga, const char *cmd);
+
+/// Find or add a stage, returning its id for sam_prof_begin/end()
+int sam_prof_stage(const char *name);
+
+/// Start timing a stage
+void sam_prof_begin(int stage);
+
+/// Stop timing a stage, adding the time since sam_prof_begin()
+void sam_prof_end(int stage);
+
+/// Add n to a named counter
+void sam_prof_add(const char *name, uint64_t n);
+
+/// Add the bytes read or written so far on fp to a named counter
+void sam_prof_file(const char *name, samFile *fp);
+
+/// Add the size of output file fp to a named counter, once it is closed
+/** Call before closing fp.  The file is measured when the report is
+    written, so includes data still buffered in fp.  Output to a pipe
+    can only be counted as far as it has got at the time of the call.
+*/
+void sam_prof_output(const char *name, samFile *fp);
+
+/// Sample the depth of q until sam_prof_queue_done() is called
+void sam_prof_queue(const char *name, hts_tpool_process *q);
+
+/// Stop sampling q; call before it is destroyed
+void sam_prof_queue_done(hts_tpool_process *q);
+
+#endif
@@ -29,7 +29,9 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 
+#include "htslib/hts_endian.h"
 #include "sam_utils.h"
 
 static htsFile *samtools_stdout = NULL;
@@ -191,3 +193,111 @@ int parse_aux_list(auxhash_t *h, char *optarg, const char *msgheader)
 
     return 0;
 }
+
+/// rewrite_aux - filters and appends aux tags in a single pass over the aux data
+/** @param b - pointer to the bam record to update
+ * @param keep - SET of tags to be retained, all others are removed; or NULL
+ * @param remove - SET of tags to be removed, used when keep is NULL; or NULL
+ * @param add - encoded tags (tag, type and value) to append; or NULL
+ * @param add_len - length of the data at add
+returns -1 on failure and 0 on success
+The retained tags are moved down in place, so the record's data is
+reallocated at most once, and only when growing.
+*/
+int rewrite_aux(bam1_t *b, auxhash_t keep, auxhash_t remove,
+                const uint8_t *add, size_t add_len)
+{
+    uint8_t *tag, *next, *end = b->data + b->l_data;
+    uint8_t *to = bam_get_aux(b);
+
+    if (keep || remove) {
+        for (tag = bam_aux_first(b); tag; tag = next) {
+            // A corrupt tag is taken to run to the end of the aux data
+            next = bam_aux_next(b, tag);
+            uint8_t *tag_end = next ? next-2 : end;
+            int x = tag[-2]<<8 | tag[-1];
+            int drop = keep
+                ? kh_get(aux_exists, keep, x) == kh_end(keep)
+                : kh_get(aux_exists, remove, x) != kh_end(remove);
+            if (!drop) {
+                if (to != tag-2)
+                    memmove(to, tag-2, tag_end - (tag-2));
+                to += tag_end - (tag-2);
+            }
+        }
+        b->l_data = to - b->data;
+    }
+
+    if (!add_len)
+        return 0;
+    if (b->l_data + add_len > b->m_data) {
+        // FIXME: make htslib's sam_realloc_bam_data public
+        uint8_t *new_data = realloc(b->data, b->l_data + add_len);
+        if (!new_data)
+            return -1;
+        b->data = new_data;
+        b->m_data = b->l_data + add_len;
+    }
+    memcpy(b->data + b->l_data, add, add_len);
+    b->l_data += add_len;
+
+    return 0;
+}
+
+int read_bam_core(BGZF *fp, bam1_core_t *c, uint8_t **buf, size_t *size)
+{
+    uint8_t x[36];
+    ssize_t r;
+    uint32_t len;
+
+    if ((r = bgzf_read(fp, x, 4)) != 4)
+        return r == 0 ? -1 : -2;
+    len = le_to_u32(x);
+    if (len < 32 || bgzf_read(fp, x + 4, 32) != 32)
+        return -2;
+
+    c->tid     = le_to_i32(x + 4);
+    c->pos     = le_to_i32(x + 8);
+    c->l_qname = x[12];
+    c->qual    = x[13];
+    c->bin     = le_to_u16(x + 14);
+    c->n_cigar = le_to_u16(x + 16);
+    c->flag    = le_to_u16(x + 18);
+    c->l_qseq  = le_to_i32(x + 20);
+    c->mtid    = le_to_i32(x + 24);
+    c->mpos    = le_to_i32(x + 28);
+    c->isize   = le_to_i32(x + 32);
+    c->l_extranul = 0;
+    if (c->l_qname == 0)
+        return -2;
+
+    len -= 32;
+    if (len > *size) {
+        uint8_t *tmp = realloc(*buf, len);
+        if (!tmp)
+            return -2;
+        *buf = tmp;
+        *size = len;
+    }
+    if (bgzf_read(fp, *buf, len) != (ssize_t) len)
+        return -2;
+    return 0;
+}
+
+int parse_mem_size(const char *arg, size_t *mem)
+{
+    unsigned long long v;
+    int shift = 0;
+    char *q;
+
+    errno = 0;
+    v = strtoull(arg, &q, 0);
+    if (*q == 'k' || *q == 'K') shift = 10, q++;
+    else if (*q == 'm' || *q == 'M') shift = 20, q++;
+    else if (*q == 'g' || *q == 'G') shift = 30, q++;
+    if (q == arg || *q || errno || v == 0 || *arg == '-'
+        || v > (SIZE_MAX >> shift))
+        return -1;
+    *mem = (size_t) v << shift;
+    return 0;
+}
@@ -27,6 +27,7 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include "htslib/khash.h"
 #include "htslib/sam.h"
+#include "htslib/bgzf.h"
 
 //this file may contain any utility functions and data types to be shared across
 
@@ -46,6 +47,35 @@ moved from sam_view.c to here for common usage at different source files
 */
 int parse_aux_list(auxhash_t *h, char *optarg, const char *msgheader);
 
+/// rewrite_aux - filters and appends aux tags in a single pass over the aux data
+/** @param b - pointer to the bam record to update
+ * @param keep - SET of tags to be retained, all others are removed; or NULL
+ * @param remove - SET of tags to be removed, used when keep is NULL; or NULL
+ * @param add - encoded tags (tag, type and value) to append; or NULL
+ * @param add_len - length of the data at add
+returns -1 on failure and 0 on success
+*/
+int rewrite_aux(bam1_t *b, auxhash_t keep, auxhash_t remove,
+                const uint8_t *add, size_t add_len);
+
+/// read_bam_core - reads the fixed-length fields of the next BAM record
+/** @param fp - BGZF handle positioned at the start of a record
+ * @param c - core to fill in; the variable-length data is skipped
+ * @param buf - scratch buffer for the skipped data, grown as needed
+ * @param size - allocated size of *buf
+returns 0 on success, -1 at end of file and < -1 on failure
+The reference ids are not checked against the header.
+*/
+int read_bam_core(BGZF *fp, bam1_core_t *c, uint8_t **buf, size_t *size);
+
+/// parse_mem_size - parses a memory size such as 768M
+/** @param arg - an integer, optionally followed by K, M or G
+ * @param mem - set to the size in bytes
+returns -1 if arg is empty, negative, zero, overflows or has anything
+after the suffix, and 0 on success
+*/
+int parse_mem_size(const char *arg, size_t *mem);
+
 
 // below utility function declarations moved from samtools.h to here and this header is included in samtools.h
 
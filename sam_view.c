@@ -28,11 +28,13 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <math.h>
 #include <inttypes.h>
 #include <getopt.h>
+#include <pthread.h>
 #include "htslib/sam.h"
 #include "htslib/faidx.h"
 #include "htslib/khash.h"
@@ -40,19 +42,41 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/hfile.h"
 #include "htslib/thread_pool.h"
 #include "htslib/hts_expr.h"
+#include "htslib/hts_endian.h"
+#include "htslib/bgzf.h"
 #include "samtools.h"
 #include "sam_opts.h"
 #include "bam.h" // for bam_get_library and bam_remove_B
 #include "bedidx.h"
 #include "sam_utils.h"
+#include "sam_prof.h"
+#include "sam_pipe.h"
+#include "qname_index.h"
 
 KHASH_SET_INIT_STR(str)
 typedef khash_t(str) *strhash_t;
 
+// A compiled form of the common filter expressions; see view_expr_compile
+typedef struct {
+    int field, op, flag_bit, tag_idx;
+    double val;
+    char *text;         // the term as written, for --expr-stats
+    uint64_t rejected;  // records for which this was the first false term
+} view_expr_term_t;
+
+#define VIEW_EXPR_MAX_TAGS 8
+typedef struct {
+    view_expr_term_t *t;
+    int n, ntags;
+    char tags[VIEW_EXPR_MAX_TAGS][2];
+    uint64_t evaluated, fallback;
+} view_expr_t;
+
 // This structure contains the settings for a samview run
 typedef struct samview_settings {
     strhash_t rghash;
     strhash_t rnhash;
+    qname_index_t *rnidx; // prebuilt -N list, used alongside rnhash
     strhash_t tvhash;
     int min_mapQ;
     int rghash_discard; // 0 keep, 1 discard
@@ -71,11 +95,16 @@ typedef struct samview_settings {
     double subsam_frac;
     char* library;
     void* bed;
+    bed_cursor_t bed_cur;
     size_t remove_aux_len;
     char** remove_aux;
     int multi_region;
     char* tag;
     hts_filter_t *filter;
+    char *filter_str;   // text of filter, to give each thread its own copy
+    view_expr_t *cfilter;
+    int expr_stats;
+    int passthrough;
     int remove_flag;
     int add_flag;
     int unmap;
@@ -85,6 +114,7 @@ typedef struct samview_settings {
     hts_idx_t *hts_idx;
     sam_hdr_t *header;
     samFile *in, *out, *un_out;
+    sam_pipe *pipe_in, *pipe_out; // neighbouring stages of samtools pipeline
     int64_t count;
     int64_t processed;
     int is_count;
@@ -94,6 +124,8 @@ typedef struct samview_settings {
     hts_reglist_t *reglist;
     int sanitize;
     int count_rf; // CRAM_OPT_REQUIRED_FIELDS for view -c
+    hts_tpool *pool;
+    const htsFormat *fmt_in; // for reopening the input on other threads
 } samview_settings_t;
 
 // Copied from htslib/sam.c.
@@ -144,11 +176,293 @@ static inline uint8_t *skip_aux(uint8_t *s, uint8_t *end)
     }
 }
 
+/*
+ * Most filter expressions in practice are a conjunction of simple tests,
+ * such as "[NM]<=3 && mapq>=30 && !flag.dup".  Rather than interpreting
+ * the expression tree and searching the aux data by name for each record,
+ * these are compiled into a list of terms, each a comparison of a numeric
+ * field or aux tag with a constant, or a flag test.  All the tags used are
+ * found in one pass over the aux data.
+ *
+ * Where a record can't be decided exactly, eg. a tag that is missing or
+ * not numeric, view_expr_eval returns -2 and sam_passes_filter is used for
+ * it instead, so the result is always as htslib would give.
+ */
+enum { VX_MAPQ, VX_FLAG, VX_POS, VX_MPOS, VX_TLEN, VX_NCIGAR,
+       VX_FLAGBIT, VX_TAG };
+enum { VX_EQ, VX_NE, VX_LT, VX_LE, VX_GT, VX_GE, VX_SET, VX_UNSET };
+
+static const char *vx_skip_space(const char *s) {
+    while (isspace((unsigned char)*s)) s++;
+    return s;
+}
+
+static int vx_parse_term(view_expr_t *vx, const char **sp) {
+    static const struct { const char *name; int field; } fields[] = {
+        {"mapq", VX_MAPQ}, {"flag", VX_FLAG}, {"pos", VX_POS},
+        {"mpos", VX_MPOS}, {"tlen", VX_TLEN}, {"ncigar", VX_NCIGAR},
+    };
+    static const struct { const char *name; int bit; } flags[] = {
+        {"paired", BAM_FPAIRED}, {"proper_pair", BAM_FPROPER_PAIR},
+        {"unmap", BAM_FUNMAP}, {"munmap", BAM_FMUNMAP},
+        {"reverse", BAM_FREVERSE}, {"mreverse", BAM_FMREVERSE},
+        {"read1", BAM_FREAD1}, {"read2", BAM_FREAD2},
+        {"secondary", BAM_FSECONDARY}, {"qcfail", BAM_FQCFAIL},
+        {"dup", BAM_FDUP}, {"supplementary", BAM_FSUPPLEMENTARY},
+    };
+    const char *s = vx_skip_space(*sp), *start = s, *e;
+    view_expr_term_t t = {0};
+    int neg = 0, i, len;
+    char *end;
+
+    if (*s == '!') {
+        neg = 1;
+        s = vx_skip_space(s+1);
+    }
+    for (e = s; isalnum((unsigned char)*e) || *e == '_' || *e == '.'; e++);
+    len = e - s;
+
+    if (len > 5 && strncmp(s, "flag.", 5) == 0) {
+        // A bare flag test, optionally negated
+        for (i = 0; i < (int)(sizeof(flags)/sizeof(*flags)); i++)
+            if (strlen(flags[i].name) == len-5 &&
+                strncmp(s+5, flags[i].name, len-5) == 0)
+                break;
+        if (i == (int)(sizeof(flags)/sizeof(*flags)))
+            return -1;
+        t.field = VX_FLAGBIT;
+        t.flag_bit = flags[i].bit;
+        t.op = neg ? VX_UNSET : VX_SET;
+        s = e;
+    } else {
+        if (neg)
+            return -1;
+        if (*s == '[') {
+            if (!isalpha((unsigned char)s[1]) || !isalnum((unsigned char)s[2])
+                || s[3] != ']')
+                return -1;
+            for (i = 0; i < vx->ntags; i++)
+                if (vx->tags[i][0] == s[1] && vx->tags[i][1] == s[2])
+                    break;
+            if (i == vx->ntags) {
+                if (vx->ntags == VIEW_EXPR_MAX_TAGS)
+                    return -1;
+                vx->tags[i][0] = s[1];
+                vx->tags[i][1] = s[2];
+                vx->ntags++;
+            }
+            t.field = VX_TAG;
+            t.tag_idx = i;
+            s += 4;
+        } else {
+            for (i = 0; i < (int)(sizeof(fields)/sizeof(*fields)); i++)
+                if (strlen(fields[i].name) == len &&
+                    strncmp(s, fields[i].name, len) == 0)
+                    break;
+            if (i == (int)(sizeof(fields)/sizeof(*fields)))
+                return -1;
+            t.field = fields[i].field;
+            s = e;
+        }
+
+        s = vx_skip_space(s);
+        if      (strncmp(s, "==", 2) == 0) t.op = VX_EQ, s += 2;
+        else if (strncmp(s, "!=", 2) == 0) t.op = VX_NE, s += 2;
+        else if (strncmp(s, "<=", 2) == 0) t.op = VX_LE, s += 2;
+        else if (strncmp(s, ">=", 2) == 0) t.op = VX_GE, s += 2;
+        else if (*s == '<') t.op = VX_LT, s++;
+        else if (*s == '>') t.op = VX_GT, s++;
+        else return -1;
+
+        s = vx_skip_space(s);
+        if (!isdigit((unsigned char)*s) && *s != '-' && *s != '.')
+            return -1;
+        t.val = strtod(s, &end);
+        if (end == s)
+            return -1;
+        s = end;
+    }
+
+    // The term must end the expression or be followed by && or )
+    e = vx_skip_space(s);
+    if (*e && strncmp(e, "&&", 2) != 0 && *e != ')')
+        return -1;
+
+    if (!(t.text = malloc(s - start + 1)))
+        return -1;
+    memcpy(t.text, start, s - start);
+    t.text[s - start] = 0;
+
+    view_expr_term_t *tmp = realloc(vx->t, (vx->n+1) * sizeof(*tmp));
+    if (!tmp) {
+        free(t.text);
+        return -1;
+    }
+    vx->t = tmp;
+    vx->t[vx->n++] = t;
+    *sp = e;
+    return 0;
+}
+
+// expr := term ("&&" term)*, where a term may also be a bracketed expr
+static int vx_parse_and(view_expr_t *vx, const char **sp, int depth) {
+    const char *s;
+    for (;;) {
+        s = vx_skip_space(*sp);
+        if (*s == '(') {
+            *sp = s+1;
+            if (depth > 16 || vx_parse_and(vx, sp, depth+1) < 0)
+                return -1;
+            s = vx_skip_space(*sp);
+            if (*s != ')')
+                return -1;
+            *sp = s+1;
+        } else if (vx_parse_term(vx, sp) < 0) {
+            return -1;
+        }
+        s = vx_skip_space(*sp);
+        if (strncmp(s, "&&", 2) != 0)
+            return 0;
+        *sp = s+2;
+    }
+}
+
+static void view_expr_free(view_expr_t *vx) {
+    int i;
+    if (!vx)
+        return;
+    for (i = 0; i < vx->n; i++)
+        free(vx->t[i].text);
+    free(vx->t);
+    free(vx);
+}
+
+// Returns the compiled expression, or NULL if it needs the full
+// interpreter (or memory ran out).
+static view_expr_t *view_expr_compile(const char *str) {
+    view_expr_t *vx = calloc(1, sizeof(*vx));
+    const char *s = str;
+    if (!vx)
+        return NULL;
+    if (vx_parse_and(vx, &s, 0) < 0 || *vx_skip_space(s) || vx->n == 0) {
+        view_expr_free(vx);
+        return NULL;
+    }
+    return vx;
+}
+
+// Returns 1 if b passes, 0 if not, or -2 if it is left to the interpreter
+static int view_expr_eval(view_expr_t *vx, const bam1_t *b) {
+    uint8_t *tag_ptr[VIEW_EXPR_MAX_TAGS] = {NULL};
+    int i, j, found = 0;
+
+    vx->evaluated++;
+    if (vx->ntags) {
+        uint8_t *s = bam_get_aux(b), *end = b->data + b->l_data;
+        while (s < end && found < vx->ntags) {
+            if (end - s < 3)
+                goto fallback;
+            for (j = 0; j < vx->ntags; j++)
+                if (s[0] == vx->tags[j][0] && s[1] == vx->tags[j][1]
+                    && !tag_ptr[j]) {
+                    tag_ptr[j] = s+2;
+                    found++;
+                }
+            if (!(s = skip_aux(s+2, end)))
+                goto fallback;
+        }
+    }
+
+    for (i = 0; i < vx->n; i++) {
+        view_expr_term_t *t = &vx->t[i];
+        double v;
+        int r;
+
+        switch (t->field) {
+        case VX_MAPQ:   v = b->core.qual; break;
+        case VX_FLAG:   v = b->core.flag; break;
+        case VX_POS:    v = b->core.pos + 1; break;
+        case VX_MPOS:   v = b->core.mpos + 1; break;
+        case VX_TLEN:   v = b->core.isize; break;
+        case VX_NCIGAR: v = b->core.n_cigar; break;
+        case VX_FLAGBIT:
+            v = (b->core.flag & t->flag_bit) != 0;
+            break;
+        case VX_TAG: {
+            uint8_t *a = tag_ptr[t->tag_idx];
+            if (!a)
+                goto fallback;
+            switch (*a) {
+            case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
+                v = bam_aux2i(a);
+                break;
+            case 'f': case 'd':
+                v = bam_aux2f(a);
+                break;
+            default:
+                goto fallback;
+            }
+            break;
+        }
+        default:
+            goto fallback;
+        }
+
+        switch (t->op) {
+        case VX_EQ:    r = v == t->val; break;
+        case VX_NE:    r = v != t->val; break;
+        case VX_LT:    r = v <  t->val; break;
+        case VX_LE:    r = v <= t->val; break;
+        case VX_GT:    r = v >  t->val; break;
+        case VX_GE:    r = v >= t->val; break;
+        case VX_SET:   r = v != 0; break;
+        case VX_UNSET: r = v == 0; break;
+        default:       goto fallback;
+        }
+        if (!r) {
+            t->rejected++;
+            return 0;
+        }
+    }
+    return 1;
+
+ fallback:
+    vx->fallback++;
+    return -2;
+}
+
+// Adds the counts from src, a copy of the same expression, into dst
+static void view_expr_merge(view_expr_t *dst, const view_expr_t *src) {
+    int i;
+    dst->evaluated += src->evaluated;
+    dst->fallback += src->fallback;
+    for (i = 0; i < dst->n && i < src->n; i++)
+        dst->t[i].rejected += src->t[i].rejected;
+}
+
+static void view_expr_report(const view_expr_t *vx, const char *str) {
+    int i;
+    if (!vx) {
+        fprintf(stderr, "[main_samview] expression \"%s\" was not compiled; "
+                "no term statistics\n", str);
+        return;
+    }
+    fprintf(stderr, "[main_samview] expression terms evaluated on %"PRIu64
+            " records, %"PRIu64" passed to the full interpreter\n",
+            vx->evaluated, vx->fallback);
+    for (i = 0; i < vx->n; i++)
+        fprintf(stderr, "[main_samview] term %d \"%s\" rejected %"PRIu64"\n",
+                i+1, vx->t[i].text, vx->t[i].rejected);
+}
+
 // Returns 0 to indicate read should be output 1 otherwise,
 // and -1 on error.
 static int process_aln(const sam_hdr_t *h, bam1_t *b, samview_settings_t* settings)
 {
-    if (settings->filter) {
+    int cr = settings->cfilter ? view_expr_eval(settings->cfilter, b) : -2;
+    if (cr == 0)
+        return 1;
+    if (settings->filter && cr < 0) {
         int r = sam_passes_filter(h, b, settings->filter);
         if (r < 0)  // err
             return -1;
@@ -171,7 +485,7 @@ static int process_aln(const sam_hdr_t *h, bam1_t *b, samview_settings_t* settin
         return 1;
     if (settings->flag_anyon && ((b->core.flag & settings->flag_anyon) == 0))
         return 1;
-    if (!settings->multi_region && settings->bed && (b->core.tid < 0 || !bed_overlap(settings->bed, sam_hdr_tid2name(h, b->core.tid), b->core.pos, bam_endpos(b))))
+    if (!settings->multi_region && settings->bed && (b->core.tid < 0 || !bed_overlap_sorted(settings->bed, &settings->bed_cur, sam_hdr_tid2name(h, b->core.tid), b->core.pos, bam_endpos(b))))
         return 1;
     if (settings->subsam_frac > 0.) {
         uint32_t k = __ac_Wang_hash(__ac_X31_hash_string(bam_get_qname(b)) ^ settings->subsam_seed);
@@ -208,12 +522,14 @@ static int process_aln(const sam_hdr_t *h, bam1_t *b, samview_settings_t* settin
             return 1;
         }
     }
-    if (settings->rnhash) {
+    if (settings->rnhash || settings->rnidx) {
         const char* rn = bam_get_qname(b);
         strhash_t h = settings->rnhash;
         if (!rn && !settings->rnhash_discard)
             return 1;
-        if ((kh_get(str, h, rn) == kh_end(h)) != settings->rnhash_discard)
+        int found = (h && kh_get(str, h, rn) != kh_end(h))
+            || (settings->rnidx && qname_index_has(settings->rnidx, rn));
+        if (found == settings->rnhash_discard)
             return 1;
     }
     if (settings->library) {
@@ -333,20 +649,38 @@ static int add_read_group_single(const char *subcmd, samview_settings_t *setting
 
 static int add_read_names_file(const char *subcmd, samview_settings_t *settings, char *fn)
 {
+    int is_index;
+    if ((settings->rnhash || settings->rnidx) &&
+        ((settings->rnhash_discard == 0 && *fn == '^') ||
+         (settings->rnhash_discard == 1 && *fn != '^'))) {
+        print_error("view", "cannot mix include and exclude read-name files in the same command line");
+        return -1;
+    }
+    settings->rnhash_discard = (*fn == '^');
+    fn += (*fn == '^');
+
+    // Files written by --write-qname-index are mapped, not loaded
+    if ((is_index = qname_index_is_index(fn)) < 0) {
+        print_error_errno(subcmd, "failed to open \"%s\" for reading", fn);
+        return -1;
+    }
+    if (is_index) {
+        if (settings->rnidx) {
+            print_error(subcmd, "only one read-name index file may be used");
+            return -1;
+        }
+        settings->rnidx = qname_index_load(fn);
+        return settings->rnidx ? 0 : -1;
+    }
+
     if (settings->rnhash == NULL) {
         settings->rnhash = kh_init(str);
         if (settings->rnhash == NULL) {
             perror(NULL);
             return -1;
         }
-    } else if ((settings->rnhash_discard == 0 && *fn == '^') ||
-        (settings->rnhash_discard == 1 && *fn != '^')) {
-        print_error("view", "cannot mix include and exclude read-name files in the same command line");
-        return -1;
     }
-    settings->rnhash_discard = (*fn == '^');
-    return populate_lookup_from_file(subcmd, settings->rnhash,
-                                     fn + (*fn == '^'));
+    return populate_lookup_from_file(subcmd, settings->rnhash, fn);
 }
 
 static int add_read_groups_file(const char *subcmd, samview_settings_t *settings, char *fn)
@@ -414,6 +748,24 @@ static inline int check_sam_write1(samFile *fp, const sam_hdr_t *h, const bam1_t
     return r;
 }
 
+static inline int view_read1(samview_settings_t *conf, bam1_t *b)
+{
+    return conf->pipe_in ? sam_pipe_read(conf->pipe_in, conf->header, b)
+                         : sam_read1(conf->in, conf->header, b);
+}
+
+// Writes to the main output, which may be the next stage of a pipeline
+static inline int view_write1(samview_settings_t *conf, const bam1_t *b, int *retp)
+{
+    if (!conf->pipe_out)
+        return check_sam_write1(conf->out, conf->header, b, conf->fn_out, retp);
+    if (sam_pipe_write(conf->pipe_out, b) == 0) return 0;
+
+    print_error("view", "writing to the next pipeline stage failed");
+    *retp = EXIT_FAILURE;
+    return -1;
+}
+
 static inline void change_flag(bam1_t *b, samview_settings_t *settings)
 {
     if (settings->add_flag)
@@ -681,8 +1033,7 @@ static int fetch_pairs_collect_mates(samview_settings_t *conf, hts_itr_multi_t *
         if ((p=process_aln(conf->header, rec, conf)) == 0) {
             if (adjust_tags(conf->header, rec, conf) != 0)
                 goto out;
-            if (check_sam_write1(conf->out, conf->header, rec, conf->fn_out,
-                                 &write_error) < 0)
+            if (view_write1(conf, rec, &write_error) < 0)
                 goto out;
             conf->count++;
         }
@@ -711,10 +1062,11 @@ static int fetch_pairs_collect_mates(samview_settings_t *conf, hts_itr_multi_t *
     return retval;
 }
 
-// Common code for processing and writing a record
-static inline int process_one_record(samview_settings_t *conf, bam1_t *b,
-                                     int *write_error) {
-    conf->processed++;
+// Filters a record and makes any changes needed before it is written.
+// Returns 0 if it should be output, 1 if filtered out and -1 on error.
+// This only reads conf, so it can be run on several threads as long as
+// each has its own copy of conf->filter.
+static int filter_one_record(samview_settings_t *conf, bam1_t *b) {
     if (conf->sanitize)
         if (bam_sanitize(conf->header, b, conf->sanitize) < 0)
             return -1;
@@ -724,17 +1076,11 @@ static inline int process_one_record(samview_settings_t *conf, bam1_t *b,
         // error
         return -1;
     } else if (p == 0) {
-        // emit read
         if (!conf->is_count) {
             change_flag(b, conf);
             if (adjust_tags(conf->header, b, conf) != 0)
                 return -1;
-            if (check_sam_write1(conf->out, conf->header,
-                                 b, conf->fn_out, write_error) < 0) {
-                return -1;
-            }
         }
-        conf->count++;
     } else if (conf->unmap) {
         b->core.flag |= BAM_FUNMAP;
         b->core.qual = 0;
@@ -747,9 +1093,23 @@ static inline int process_one_record(samview_settings_t *conf, bam1_t *b,
             b->l_data -= 4*b->core.n_cigar;
             b->core.n_cigar = 0;
         }
+    }
+    return p;
+}
 
-        if (check_sam_write1(conf->out, conf->header,
-                             b, conf->fn_out, write_error) < 0) {
+// Writes a record given the result of filter_one_record
+static int write_one_record(samview_settings_t *conf, bam1_t *b, int p,
+                            int *write_error) {
+    if (p == 0) {
+        // emit read
+        if (!conf->is_count) {
+            if (view_write1(conf, b, write_error) < 0) {
+                return -1;
+            }
+        }
+        conf->count++;
+    } else if (conf->unmap) {
+        if (view_write1(conf, b, write_error) < 0) {
             return -1;
         }
     } else {
@@ -763,7 +1123,384 @@ static inline int process_one_record(samview_settings_t *conf, bam1_t *b,
     return 0;
 }
 
+// Common code for processing and writing a record
+static inline int process_one_record(samview_settings_t *conf, bam1_t *b,
+                                     int *write_error) {
+    int p;
+    conf->processed++;
+    if ((p = filter_one_record(conf, b)) < 0)
+        return -1;
+    return write_one_record(conf, b, p, write_error);
+}
+
+// Filtering on several threads.  Records are read and written here in
+// batches, with the filtering and tag editing of each batch done by the
+// thread pool.  Results come back in dispatch order, so the output order
+// is unchanged.
+#define VIEW_BATCH_SIZE 1024
+
+typedef struct {
+    samview_settings_t conf;  // a copy, with its own filter
+    bam1_t *b[VIEW_BATCH_SIZE];
+    int res[VIEW_BATCH_SIZE];
+    int n;
+} view_batch_t;
+
+static void *filter_batch(void *arg) {
+    view_batch_t *bt = (view_batch_t *)arg;
+    int i;
+    for (i = 0; i < bt->n; i++)
+        bt->res[i] = filter_one_record(&bt->conf, bt->b[i]);
+    return bt;
+}
+
+// Only worth it where there is work beyond the flag and MAPQ tests
+static int view_filter_threaded(const samview_settings_t *conf) {
+    return conf->pool
+        && (conf->filter || conf->keep_tag || conf->remove_tag
+            || conf->rnhash || conf->rnidx || conf->tvhash || conf->sanitize);
+}
+
+static int stream_view_threaded(samview_settings_t *conf) {
+    int nbatch = 2 * hts_tpool_size(conf->pool), next = 0, in_flight = 0;
+    int write_error = 0, r = 0, p = 0, i, j;
+    view_batch_t *batch = calloc(nbatch, sizeof(*batch));
+    hts_tpool_process *q = NULL;
+
+    if (!batch)
+        goto nomem;
+    for (i = 0; i < nbatch; i++) {
+        batch[i].conf = *conf;
+        if (conf->filter_str &&
+            !(batch[i].conf.filter = hts_filter_init(conf->filter_str)))
+            goto nomem;
+        batch[i].conf.cfilter = NULL;
+        if (conf->cfilter &&
+            !(batch[i].conf.cfilter = view_expr_compile(conf->filter_str)))
+            goto nomem;
+        for (j = 0; j < VIEW_BATCH_SIZE; j++)
+            if (!(batch[i].b[j] = bam_init1()))
+                goto nomem;
+    }
+
+    // The header is parsed on first use, so do that before the threads
+    // start looking things up in it.
+    sam_hdr_count_lines(conf->header, "RG");
+
+    // The ring of batches is no larger than the queue, so dispatching
+    // never waits on results we have yet to collect.
+    if (!(q = hts_tpool_process_init(conf->pool, nbatch, 0)))
+        goto nomem;
+    sam_prof_queue("view.filter", q);
+    int st_read = sam_prof_stage("read"), st_wait = sam_prof_stage("wait");
+    int st_write = sam_prof_stage("write");
+
+    errno = 0; // prevent false error messages.
+    for (;;) {
+        while (r >= 0 && p >= 0 && in_flight < nbatch) {
+            view_batch_t *bt = &batch[next];
+            sam_prof_begin(st_read);
+            for (bt->n = 0; bt->n < VIEW_BATCH_SIZE; bt->n++)
+                if ((r = view_read1(conf, bt->b[bt->n])) < 0)
+                    break;
+            sam_prof_end(st_read);
+            if (!bt->n)
+                break;
+            if (hts_tpool_dispatch(conf->pool, q, filter_batch, bt) < 0) {
+                p = -1;
+                break;
+            }
+            next = (next + 1) % nbatch;
+            in_flight++;
+        }
+        if (!in_flight)
+            break;
+
+        sam_prof_begin(st_wait);
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        sam_prof_end(st_wait);
+        if (!res) {
+            p = -1;
+            break;
+        }
+        view_batch_t *bt = (view_batch_t *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+
+        // After an error the remaining batches are only collected
+        sam_prof_begin(st_write);
+        for (i = 0; i < bt->n && p >= 0; i++) {
+            conf->processed++;
+            if (bt->res[i] < 0 ||
+                write_one_record(conf, bt->b[i], bt->res[i], &write_error) < 0)
+                p = -1;
+        }
+        sam_prof_end(st_write);
+    }
+
+ out:
+    if (q) {
+        sam_prof_queue_done(q);
+        hts_tpool_process_destroy(q);
+    }
+    if (batch) {
+        for (i = 0; i < nbatch; i++) {
+            if (batch[i].conf.filter && conf->filter_str)
+                hts_filter_free(batch[i].conf.filter);
+            if (batch[i].conf.cfilter && conf->cfilter) {
+                view_expr_merge(conf->cfilter, batch[i].conf.cfilter);
+                view_expr_free(batch[i].conf.cfilter);
+            }
+            for (j = 0; j < VIEW_BATCH_SIZE; j++)
+                if (batch[i].b[j])
+                    bam_destroy1(batch[i].b[j]);
+        }
+        free(batch);
+    }
+    if (r < -1 || p < 0) {
+        print_error_errno("view", "error reading file \"%s\"", conf->fn_in);
+        return 1;
+    }
+    return write_error;
+
+ nomem:
+    print_error_errno("view", "could not set up the filtering threads");
+    p = -1;
+    goto out;
+}
+
+// Counting of BAM files filtered only on flags and MAPQ.  These are in
+// the fixed-length part of each record, so the rest is skipped without
+// filling in a bam1_t.  Not used with -U as the rejected reads still have
+// to be written out.
+static int view_count_fast(const samview_settings_t *conf) {
+    if (!conf->in)
+        return 0;
+    const htsFormat *fmt = hts_get_format(conf->in);
+    return conf->is_count && fmt->format == bam && !conf->un_out
+        && !conf->filter && !conf->cfilter && !conf->bed
+        && conf->subsam_frac <= 0 && !conf->rghash && !conf->tag
+        && !conf->rnhash && !conf->rnidx && !conf->library
+        && conf->min_qlen <= 0 && !conf->sanitize;
+}
+
+static int stream_count_fast(samview_settings_t *conf) {
+    BGZF *fp = conf->in->fp.bgzf;
+    uint8_t core[36], *skip = NULL;
+    size_t mskip = 0;
+    ssize_t r;
+
+    while ((r = bgzf_read(fp, core, 4)) == 4) {
+        uint32_t len = le_to_u32(core);
+        if (len < 32 || bgzf_read(fp, core + 4, 32) != 32) {
+            r = -1;
+            break;
+        }
+        len -= 32;
+        if (len > mskip) {
+            uint8_t *tmp = realloc(skip, len);
+            if (!tmp) {
+                r = -1;
+                break;
+            }
+            skip = tmp;
+            mskip = len;
+        }
+        if (bgzf_read(fp, skip, len) != len) {
+            r = -1;
+            break;
+        }
+
+        uint16_t flag = le_to_u16(core + 18);
+        conf->processed++;
+        if (core[13] < conf->min_mapQ
+            || (flag & conf->flag_on) != conf->flag_on
+            || (flag & conf->flag_off)
+            || (conf->flag_alloff
+                && (flag & conf->flag_alloff) == conf->flag_alloff)
+            || (conf->flag_anyon && !(flag & conf->flag_anyon)))
+            continue;
+        conf->count++;
+    }
+    free(skip);
+    if (r != 0) {
+        print_error_errno("view", "error reading file \"%s\"", conf->fn_in);
+        return 1;
+    }
+    return 0;
+}
+
+// Passthrough of unmodified BAM records (--passthrough).  Records are
+// gathered by the input BGZF block they start in.  When a block holds
+// exactly the records starting in it, so the first starts at the block
+// start and the next record at the start of the following block, and all
+// of them are to be output, the compressed block is copied from a second
+// handle on the input file instead of being written again.  Other blocks,
+// including those of records spanning several blocks, are written as
+// usual.
+typedef struct {
+    hFILE *raw;
+    int64_t raw_addr;   // compressed offset of raw
+    uint8_t *blk;
+    int64_t cur;        // address of the block being gathered, or -1
+    int aligned;        // its first record starts at the block start
+    bam1_t **b;
+    int *res, n, m;
+} view_passthrough_t;
+
+static int view_passthrough_ok(const samview_settings_t *conf) {
+    if (!conf->in)
+        return 0;
+    const htsFormat *in = hts_get_format(conf->in);
+    const htsFormat *out = conf->out ? hts_get_format(conf->out) : NULL;
+    return conf->passthrough && out
+        && in->format == bam && in->compression == bgzf
+        && out->format == bam && out->compression == bgzf
+        && strcmp(conf->fn_in, "-") != 0 && !conf->fn_out_idx
+        && !conf->remove_tag && !conf->keep_tag && !conf->add_flag
+        && !conf->remove_flag && !conf->sanitize && !conf->remove_B
+        && !conf->unmap;
+}
+
+// Copies block pt->cur if the block after it starts at next.  Returns 0
+// on success, 1 if it doesn't or the block header is not the usual BGZF
+// one, so the records must be written instead, and -1 on error.
+static int passthrough_copy_block(samview_settings_t *conf,
+                                  view_passthrough_t *pt, int64_t next) {
+    BGZF *out = conf->out->fp.bgzf;
+    ssize_t len;
+
+    if (pt->raw_addr != pt->cur) {
+        if (hseek(pt->raw, pt->cur, SEEK_SET) < 0)
+            return -1;
+        pt->raw_addr = pt->cur;
+    }
+    if (hread(pt->raw, pt->blk, 18) != 18)
+        return -1;
+    pt->raw_addr += 18;
+    if (memcmp(pt->blk, "\37\213\10\4", 4) != 0
+        || le_to_u16(pt->blk + 10) != 6
+        || pt->blk[12] != 'B' || pt->blk[13] != 'C')
+        return 1;
+    len = le_to_u16(pt->blk + 16) + 1;
+    if (pt->cur + len != next)
+        return 1;   // the last record runs on into later blocks
+    if (len < 18 || hread(pt->raw, pt->blk + 18, len - 18) != len - 18)
+        return -1;
+    pt->raw_addr += len - 18;
+
+    // Anything already buffered must reach the file first
+    if (bgzf_flush(out) < 0 || bgzf_raw_write(out, pt->blk, len) != len)
+        return -1;
+    return 0;
+}
+
+// Outputs the records gathered for block pt->cur.  next is the virtual
+// offset of the record after them.
+static int passthrough_flush(samview_settings_t *conf, view_passthrough_t *pt,
+                             int64_t next, int *write_error) {
+    int i, copy = pt->aligned && (next & 0xffff) == 0, r = 1;
+    for (i = 0; copy && i < pt->n; i++)
+        if (pt->res[i] != 0)
+            copy = 0;
+    if (copy && (r = passthrough_copy_block(conf, pt, next >> 16)) < 0) {
+        print_error_errno("view", "failed to copy a block of \"%s\"",
+                          conf->fn_in);
+        return -1;
+    }
+    if (r == 0)
+        conf->count += pt->n;
+    else
+        for (i = 0; i < pt->n; i++)
+            if (write_one_record(conf, pt->b[i], pt->res[i], write_error) < 0)
+                return -1;
+    pt->n = 0;
+    pt->cur = -1;
+    return 0;
+}
+
+static int stream_view_passthrough(samview_settings_t *conf) {
+    BGZF *in = conf->in->fp.bgzf;
+    view_passthrough_t pt = { NULL, 0, NULL, -1, 0, NULL, NULL, 0, 0 };
+    int write_error = 0, r = 0, p = 0, i;
+
+    if (!(pt.raw = hopen(conf->fn_in, "r"))) {
+        print_error_errno("view", "failed to reopen \"%s\"", conf->fn_in);
+        return 1;
+    }
+    if (!(pt.blk = malloc(BGZF_MAX_BLOCK_SIZE)))
+        goto nomem;
+
+    errno = 0; // prevent false error messages.
+    for (;;) {
+        if (pt.n == pt.m) {
+            int m = pt.m ? pt.m * 2 : 256;
+            bam1_t **b = realloc(pt.b, m * sizeof(*b));
+            if (!b)
+                goto nomem;
+            pt.b = b;
+            int *res = realloc(pt.res, m * sizeof(*res));
+            if (!res)
+                goto nomem;
+            pt.res = res;
+            for (i = pt.m; i < m; i++)
+                pt.b[i] = NULL;
+            pt.m = m;
+        }
+        if (!pt.b[pt.n] && !(pt.b[pt.n] = bam_init1()))
+            goto nomem;
+
+        int64_t off = bgzf_tell(in);
+        r = sam_read1(conf->in, conf->header, pt.b[pt.n]);
+        if (pt.cur >= 0 && (r < 0 || off >> 16 != pt.cur)) {
+            if ((p = passthrough_flush(conf, &pt, off, &write_error)) < 0)
+                break;
+        }
+        if (r < 0)
+            break;
+        if (pt.cur < 0) {
+            pt.cur = off >> 16;
+            pt.aligned = (off & 0xffff) == 0;
+        }
+        conf->processed++;
+        if ((p = pt.res[pt.n] = filter_one_record(conf, pt.b[pt.n])) < 0)
+            break;
+        pt.n++;
+    }
+
+ out:
+    if (pt.b) {
+        for (i = 0; i < pt.m; i++)
+            if (pt.b[i])
+                bam_destroy1(pt.b[i]);
+        free(pt.b);
+    }
+    free(pt.res);
+    free(pt.blk);
+    if (hclose(pt.raw) < 0 && p >= 0) {
+        print_error_errno("view", "error closing \"%s\"", conf->fn_in);
+        p = -1;
+    }
+    if (r < -1 || p < 0) {
+        print_error_errno("view", "error reading file \"%s\"", conf->fn_in);
+        return 1;
+    }
+    return write_error;
+
+ nomem:
+    print_error_errno("view", "could not allocate passthrough buffers");
+    p = -1;
+    goto out;
+}
+
 static int stream_view(samview_settings_t *conf) {
+    if (view_count_fast(conf))
+        return stream_count_fast(conf);
+    if (view_passthrough_ok(conf))
+        return stream_view_passthrough(conf);
+    if (view_filter_threaded(conf))
+        return stream_view_threaded(conf);
+
     bam1_t *b = bam_init1();
     int write_error = 0, r, p = 0;
     if (!b) {
@@ -771,7 +1508,7 @@ static int stream_view(samview_settings_t *conf) {
         return 1;
     }
     errno = 0; // prevent false error messages.
-    while ((r = sam_read1(conf->in, conf->header, b)) >= 0) {
+    while ((r = view_read1(conf, b)) >= 0) {
         if ((p = process_one_record(conf, b, &write_error)) < 0) break;
     }
     bam_destroy1(b);
@@ -804,6 +1541,370 @@ static int multi_region_view(samview_settings_t *conf, hts_itr_multi_t *iter)
     return write_error;
 }
 
+// Region-parallel fetching for -M with threads.  The merged regions are
+// cut into batches of up to VIEW_REGION_SPAN bases, which pool threads
+// fetch and filter using their own file handles, indices and iterators.
+// Batches are written back in order, so the output matches that of
+// multi_region_view.
+#define VIEW_REGION_SPAN (1 << 20)
+#define VIEW_REGION_MAX 64  // regions per batch
+
+typedef struct {
+    int tid;
+    hts_pos_t beg, end;
+} view_region_t;
+
+typedef struct {
+    samFile *fp;
+    sam_hdr_t *hdr;
+    hts_idx_t *idx;
+} view_reader_t;
+
+// Readers are opened by the first batch that needs them and handed
+// between batches, so there are never more than the pool has threads.
+typedef struct {
+    view_reader_t *r;
+    int *avail, navail, nr;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} view_readers_t;
+
+typedef struct {
+    samview_settings_t conf;  // a copy, with its own filter
+    view_readers_t *readers;
+    view_region_t *reg;
+    int nreg;
+    hts_pos_t skip_end; // records on reg[0].tid starting before this
+                        // were output by the previous batch
+    bam1_t **b;
+    int *res, n, m;
+    int ret;
+} view_region_batch_t;
+
+static void view_reader_close(view_reader_t *r) {
+    if (r->idx) hts_idx_destroy(r->idx);
+    if (r->hdr) sam_hdr_destroy(r->hdr);
+    if (r->fp) sam_close(r->fp);
+    r->idx = NULL;
+    r->hdr = NULL;
+    r->fp = NULL;
+}
+
+static int view_reader_open(const samview_settings_t *conf, view_reader_t *r) {
+    if (!(r->fp = sam_open_format(conf->fn_in, "r", conf->fmt_in))) {
+        print_error_errno("view", "failed to reopen \"%s\"", conf->fn_in);
+        return -1;
+    }
+    if (conf->fn_fai && hts_set_fai_filename(r->fp, conf->fn_fai) != 0)
+        goto fail;
+    if (!(r->hdr = sam_hdr_read(r->fp)))
+        goto fail;
+    r->idx = conf->fn_idx_in
+        ? sam_index_load2(r->fp, conf->fn_in, conf->fn_idx_in)
+        : sam_index_load(r->fp, conf->fn_in);
+    if (!r->idx)
+        goto fail;
+    if (conf->is_count)
+        hts_set_opt(r->fp, CRAM_OPT_REQUIRED_FIELDS, conf->count_rf);
+    return 0;
+
+ fail:
+    print_error("view", "failed to set up a reader for \"%s\"", conf->fn_in);
+    view_reader_close(r);
+    return -1;
+}
+
+static view_reader_t *view_reader_get(view_readers_t *rd) {
+    view_reader_t *r;
+    pthread_mutex_lock(&rd->lock);
+    while (!rd->navail)
+        pthread_cond_wait(&rd->cond, &rd->lock);
+    r = &rd->r[rd->avail[--rd->navail]];
+    pthread_mutex_unlock(&rd->lock);
+    return r;
+}
+
+static void view_reader_put(view_readers_t *rd, view_reader_t *r) {
+    pthread_mutex_lock(&rd->lock);
+    rd->avail[rd->navail++] = r - rd->r;
+    pthread_cond_signal(&rd->cond);
+    pthread_mutex_unlock(&rd->lock);
+}
+
+static void *fetch_region_batch(void *arg) {
+    view_region_batch_t *rb = (view_region_batch_t *)arg;
+    view_reader_t *r = view_reader_get(rb->readers);
+    hts_reglist_t *rl = NULL;
+    hts_itr_multi_t *iter = NULL;
+    int i, j, k, nrl = 0, r1 = 0;
+
+    rb->n = 0;
+    rb->ret = -1;
+    if (!r->fp && view_reader_open(&rb->conf, r) < 0)
+        goto out;
+
+    // One entry per contig, as sam_itr_regions expects
+    if (!(rl = calloc(rb->nreg, sizeof(*rl))))
+        goto nomem;
+    for (i = 0; i < rb->nreg; i = j) {
+        hts_reglist_t *e = &rl[nrl++];
+        for (j = i; j < rb->nreg && rb->reg[j].tid == rb->reg[i].tid; j++)
+            ;
+        e->tid = rb->reg[i].tid;
+        e->count = j - i;
+        e->min_beg = rb->reg[i].beg;
+        e->max_end = rb->reg[j-1].end;
+        if (!(e->intervals = malloc(e->count * sizeof(*e->intervals))))
+            goto nomem;
+        for (k = i; k < j; k++) {
+            e->intervals[k-i].beg = rb->reg[k].beg;
+            e->intervals[k-i].end = rb->reg[k].end;
+        }
+    }
+    iter = sam_itr_regions(r->idx, r->hdr, rl, nrl);
+    rl = NULL; // owned, and freed on failure, by the iterator
+    if (!iter) {
+        print_error("view", "Iterator could not be created. Aborting.");
+        goto out;
+    }
+
+    for (;;) {
+        if (rb->n == rb->m) {
+            int m = rb->m ? rb->m * 2 : 256;
+            bam1_t **b = realloc(rb->b, m * sizeof(*b));
+            if (!b)
+                goto nomem;
+            rb->b = b;
+            int *res = realloc(rb->res, m * sizeof(*res));
+            if (!res)
+                goto nomem;
+            rb->res = res;
+            for (i = rb->m; i < m; i++)
+                rb->b[i] = NULL;
+            rb->m = m;
+        }
+        if (!rb->b[rb->n] && !(rb->b[rb->n] = bam_init1()))
+            goto nomem;
+
+        bam1_t *b = rb->b[rb->n];
+        if ((r1 = sam_itr_multi_next(r->fp, iter, b)) < 0)
+            break;
+        if (b->core.tid == rb->reg[0].tid && b->core.pos < rb->skip_end)
+            continue;
+        if ((rb->res[rb->n++] = filter_one_record(&rb->conf, b)) < 0)
+            break;
+    }
+    if (r1 < -1) {
+        print_error("view", "retrieval of region #%d failed", iter->curr_tid);
+        goto out;
+    }
+    rb->ret = 0;
+
+ out:
+    if (rl) {
+        for (i = 0; i < nrl; i++)
+            free(rl[i].intervals);
+        free(rl);
+    }
+    if (iter)
+        hts_itr_multi_destroy(iter);
+    view_reader_put(rb->readers, r);
+    return rb;
+
+ nomem:
+    print_error_errno("view", "could not allocate region batch");
+    goto out;
+}
+
+static int view_region_threaded(const samview_settings_t *conf) {
+    return conf->pool && conf->fmt_in && strcmp(conf->fn_in, "-") != 0;
+}
+
+static int multi_region_view_threaded(samview_settings_t *conf,
+                                      hts_itr_multi_t *iter)
+{
+    int nthreads = hts_tpool_size(conf->pool), nslot = 2 * nthreads;
+    int nreg = iter->n_reg, nregion = 0, mregion = 0, per_batch;
+    int next_reg = 0, next = 0, in_flight = 0, write_error = 0, p = 0;
+    int i, j;
+    hts_reglist_t *reg = _reglist_dup(conf->header, iter->reg_list, nreg);
+    view_region_t *region = NULL;
+    view_region_batch_t *batch = NULL;
+    view_readers_t rd = { NULL, NULL, 0, nthreads };
+    hts_tpool_process *q = NULL;
+
+    if (!reg) {
+        hts_itr_multi_destroy(iter);
+        return 1;
+    }
+    // "." and "*" regions are left to the single iterator
+    for (i = 0; i < nreg; i++)
+        if (reg[i].tid < 0)
+            break;
+    if (i < nreg) {
+        for (i = 0; i < nreg; i++)
+            free(reg[i].intervals);
+        free(reg);
+        return multi_region_view(conf, iter);
+    }
+    hts_itr_multi_destroy(iter);
+
+    // Merging leaves disjoint, sorted intervals, so a record found in
+    // an earlier batch always starts before the next batch's first
+    // interval.  Long intervals are cut so that they spread across
+    // threads, but only within the contig.
+    for (i = 0, j = 0; i < nreg; i++) {
+        if (reg[i].count)
+            reg[j++] = reg[i];
+        else
+            free(reg[i].intervals);
+    }
+    nreg = j;
+    _reglist_merge(reg, nreg);
+    for (i = 0; i < nreg; i++) {
+        hts_pos_t len = sam_hdr_tid2len(conf->header, reg[i].tid);
+        for (j = 0; j < reg[i].count; j++) {
+            hts_pos_t beg = reg[i].intervals[j].beg;
+            hts_pos_t end = reg[i].intervals[j].end;
+            do {
+                hts_pos_t cut = end;
+                if (end - beg > VIEW_REGION_SPAN && beg + VIEW_REGION_SPAN < len)
+                    cut = beg + VIEW_REGION_SPAN;
+                if (nregion == mregion) {
+                    mregion = mregion ? mregion * 2 : 1024;
+                    view_region_t *tmp = realloc(region, mregion * sizeof(*tmp));
+                    if (!tmp)
+                        goto nomem;
+                    region = tmp;
+                }
+                region[nregion].tid = reg[i].tid;
+                region[nregion].beg = beg;
+                region[nregion].end = cut;
+                nregion++;
+                beg = cut;
+            } while (beg < end);
+        }
+    }
+    per_batch = nregion / (4 * nthreads);
+    if (per_batch < 1) per_batch = 1;
+    if (per_batch > VIEW_REGION_MAX) per_batch = VIEW_REGION_MAX;
+
+    if (!(rd.r = calloc(nthreads, sizeof(*rd.r)))
+        || !(rd.avail = malloc(nthreads * sizeof(*rd.avail))))
+        goto nomem;
+    for (rd.navail = 0; rd.navail < nthreads; rd.navail++)
+        rd.avail[rd.navail] = rd.navail;
+    pthread_mutex_init(&rd.lock, NULL);
+    pthread_cond_init(&rd.cond, NULL);
+
+    if (!(batch = calloc(nslot, sizeof(*batch))))
+        goto nomem;
+    for (i = 0; i < nslot; i++) {
+        batch[i].conf = *conf;
+        batch[i].readers = &rd;
+        if (conf->filter_str &&
+            !(batch[i].conf.filter = hts_filter_init(conf->filter_str)))
+            goto nomem;
+        batch[i].conf.cfilter = NULL;
+        if (conf->cfilter &&
+            !(batch[i].conf.cfilter = view_expr_compile(conf->filter_str)))
+            goto nomem;
+    }
+
+    // As for stream_view_threaded, parse the header before the threads
+    // start looking things up in it.
+    sam_hdr_count_lines(conf->header, "RG");
+
+    if (!(q = hts_tpool_process_init(conf->pool, nslot, 0)))
+        goto nomem;
+    sam_prof_queue("view.region", q);
+
+    for (;;) {
+        while (p >= 0 && next_reg < nregion && in_flight < nslot) {
+            view_region_batch_t *rb = &batch[next];
+            hts_pos_t span = 0;
+            rb->reg = &region[next_reg];
+            rb->skip_end = next_reg && region[next_reg-1].tid == rb->reg->tid
+                ? region[next_reg-1].end : 0;
+            for (rb->nreg = 0; next_reg < nregion && rb->nreg < per_batch
+                     && span < VIEW_REGION_SPAN; rb->nreg++, next_reg++)
+                span += region[next_reg].end - region[next_reg].beg;
+            if (hts_tpool_dispatch(conf->pool, q, fetch_region_batch, rb) < 0) {
+                p = -1;
+                break;
+            }
+            next = (next + 1) % nslot;
+            in_flight++;
+        }
+        if (!in_flight)
+            break;
+
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        if (!res) {
+            p = -1;
+            break;
+        }
+        view_region_batch_t *rb = (view_region_batch_t *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        in_flight--;
+
+        if (rb->ret < 0)
+            p = -1;
+        for (i = 0; i < rb->n && p >= 0; i++) {
+            conf->processed++;
+            if (rb->res[i] < 0 ||
+                write_one_record(conf, rb->b[i], rb->res[i], &write_error) < 0)
+                p = -1;
+        }
+    }
+
+ out:
+    if (q) {
+        sam_prof_queue_done(q);
+        hts_tpool_process_destroy(q);
+    }
+    if (batch) {
+        for (i = 0; i < nslot; i++) {
+            if (batch[i].conf.filter && conf->filter_str)
+                hts_filter_free(batch[i].conf.filter);
+            if (batch[i].conf.cfilter && conf->cfilter) {
+                view_expr_merge(conf->cfilter, batch[i].conf.cfilter);
+                view_expr_free(batch[i].conf.cfilter);
+            }
+            for (j = 0; j < batch[i].m; j++)
+                if (batch[i].b[j])
+                    bam_destroy1(batch[i].b[j]);
+            free(batch[i].b);
+            free(batch[i].res);
+        }
+        free(batch);
+    }
+    if (rd.avail) {
+        pthread_mutex_destroy(&rd.lock);
+        pthread_cond_destroy(&rd.cond);
+    }
+    if (rd.r) {
+        for (i = 0; i < nthreads; i++)
+            view_reader_close(&rd.r[i]);
+        free(rd.r);
+    }
+    free(rd.avail);
+    free(region);
+    for (i = 0; i < nreg; i++)
+        free(reg[i].intervals);
+    free(reg);
+    if (p < 0) {
+        print_error("view", "failed to fetch alignments from \"%s\"", conf->fn_in);
+        return 1;
+    }
+    return write_error;
+
+ nomem:
+    print_error_errno("view", "could not set up the region threads");
+    p = -1;
+    goto out;
+}
+
 // Make mnemonic distinct values for longoption-only options
 #define LONGOPT(c)  ((c) + 128)
 
@@ -873,6 +1974,8 @@ int main_samview(int argc, char *argv[])
     char out_mode[6] = {0}, out_un_mode[6] = {0};
     char *out_format = "";
     char *arg_list = NULL;
+    char **qname_fns = NULL, *fn_qname_index = NULL, *fn_bed_index = NULL;
+    int nqname_fns = 0, i;
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     htsThreadPool p = {NULL, 0};
 
@@ -881,7 +1984,7 @@ int main_samview(int argc, char *argv[])
     settings.count_rf = SAM_FLAG; // don't want 0, and this is quick
 
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 'T', '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 'T', '@', 0, 0),
         {"add-flags", required_argument, NULL, LONGOPT('a')},
         {"bam", no_argument, NULL, 'b'},
         {"count", no_argument, NULL, 'c'},
@@ -892,6 +1995,7 @@ int main_samview(int argc, char *argv[])
         {"exclude-flags", required_argument, NULL, 'F'},
         {"expr", required_argument, NULL, 'e'},
         {"expression", required_argument, NULL, 'e'},
+        {"expr-stats", no_argument, NULL, LONGOPT('e')},
         {"fai-reference", required_argument, NULL, 't'},
         {"fast", no_argument, NULL, '1'},
         {"fetch-pairs", no_argument, NULL, 'P'},
@@ -910,8 +2014,11 @@ int main_samview(int argc, char *argv[])
         {"no-PG", no_argument, NULL, LONGOPT('P')},
         {"output", required_argument, NULL, 'o'},
         {"output-unselected", required_argument, NULL, 'U'},
+        {"passthrough", no_argument, NULL, LONGOPT('p')},
         {"QNAME-file", required_argument, NULL, 'N'},
         {"qname-file", required_argument, NULL, 'N'},
+        {"write-qname-index", required_argument, NULL, LONGOPT('N')},
+        {"write-bed-index", required_argument, NULL, LONGOPT('B')},
         {"read-group", required_argument, NULL, 'r'},
         {"read-group-file", required_argument, NULL, 'R'},
         {"readgroup", required_argument, NULL, 'r'},
@@ -1084,13 +2191,21 @@ int main_samview(int argc, char *argv[])
             }
             settings.count_rf |= SAM_RGAUX;
             break;
-        case 'N':
-            if (add_read_names_file("view", &settings, optarg) != 0) {
+        case 'N': {
+            // Loaded after option parsing, unless building an index
+            char **tmp = realloc(qname_fns, (nqname_fns + 1) * sizeof(*tmp));
+            if (!tmp) {
+                perror(NULL);
                 ret = 1;
                 goto view_end;
             }
+            qname_fns = tmp;
+            qname_fns[nqname_fns++] = optarg;
             settings.count_rf |= SAM_QNAME;
             break;
+        }
+        case LONGOPT('N'): fn_qname_index = optarg; break;
+        case LONGOPT('B'): fn_bed_index = optarg; break;
 
         case 'd':
             if (strlen(optarg) < 2 || (strlen(optarg) > 2 && optarg[2] != ':')) {
@@ -1191,11 +2306,19 @@ int main_samview(int argc, char *argv[])
 
         case 'M': settings.multi_region = 1; break;
         case LONGOPT('P'): no_pg = 1; break;
+        case LONGOPT('e'): settings.expr_stats = 1; break;
+        case LONGOPT('p'): settings.passthrough = 1; break;
         case 'e':
+            if (settings.filter)
+                hts_filter_free(settings.filter);
+            view_expr_free(settings.cfilter);
+            settings.filter_str = optarg;
             if (!(settings.filter = hts_filter_init(optarg))) {
                 print_error("main_samview", "Couldn't initialise filter");
                 return 1;
             }
+            // NULL if the expression needs the full interpreter
+            settings.cfilter = view_expr_compile(optarg);
             settings.count_rf = INT_MAX; // no way to know what we need
             break;
         case LONGOPT('r'):
@@ -1252,6 +2375,25 @@ int main_samview(int argc, char *argv[])
         print_error("view","The options -P and -c cannot be combined\n");
         return 1;
     }
+    if (fn_bed_index) {
+        ret = bed_write_index(fn_bed_index) < 0;
+        goto view_end;
+    }
+    if (fn_qname_index) {
+        if (!nqname_fns) {
+            print_error("view", "--write-qname-index needs a name list given with -N");
+            ret = 1;
+        } else {
+            ret = qname_index_build(fn_qname_index, qname_fns, nqname_fns) < 0;
+        }
+        goto view_end;
+    }
+    for (i = 0; i < nqname_fns; i++) {
+        if (add_read_names_file("view", &settings, qname_fns[i]) != 0) {
+            ret = 1;
+            goto view_end;
+        }
+    }
     if (settings.fn_fai == 0 && ga.reference) settings.fn_fai = fai_path(ga.reference);
     if (is_header_only) is_header = 1;
     // File format auto-detection first
@@ -1301,42 +2443,65 @@ int main_samview(int argc, char *argv[])
         settings.subsam_seed = rand();
     }
 
-    settings.fn_in = (optind < argc)? argv[optind] : "-";
-    if ((settings.in = sam_open_format(settings.fn_in, "r", &ga.in)) == 0) {
-        print_error_errno("view", "failed to open \"%s\" for reading", settings.fn_in);
+    if (sam_prof_init(&ga, "view") < 0) {
         ret = 1;
         goto view_end;
     }
+    int st_records = sam_prof_stage("records");
 
-    if (settings.fn_fai) {
-        if (hts_set_fai_filename(settings.in, settings.fn_fai) != 0) {
-            fprintf(stderr, "[main_samview] failed to use reference \"%s\".\n", settings.fn_fai);
+    settings.fn_in = (optind < argc)? argv[optind] : "-";
+    settings.fmt_in = &ga.in;
+    if ((settings.pipe_in = sam_stage_input(settings.fn_in)) != NULL) {
+        if ((settings.header = sam_pipe_read_header(settings.pipe_in)) == 0) {
+            print_error("view", "no header from the previous pipeline stage");
             ret = 1;
             goto view_end;
         }
-    }
-    if ((settings.header = sam_hdr_read(settings.in)) == 0) {
-        fprintf(stderr, "[main_samview] fail to read the header from \"%s\".\n", settings.fn_in);
-        ret = 1;
-        goto view_end;
-    }
-    if (settings.rghash) {
-        sam_hdr_remove_lines(settings.header, "RG", "ID", settings.rghash);
-    }
-    if (!settings.is_count) {
-        if ((settings.out = sam_open_format(settings.fn_out? settings.fn_out : "-", out_mode, &ga.out)) == 0) {
-            print_error_errno("view", "failed to open \"%s\" for writing", settings.fn_out? settings.fn_out : "standard output");
+    } else {
+        if ((settings.in = sam_open_format(settings.fn_in, "r", &ga.in)) == 0) {
+            print_error_errno("view", "failed to open \"%s\" for reading", settings.fn_in);
             ret = 1;
             goto view_end;
         }
+
         if (settings.fn_fai) {
-            if (hts_set_fai_filename(settings.out, settings.fn_fai) != 0) {
+            if (hts_set_fai_filename(settings.in, settings.fn_fai) != 0) {
                 fprintf(stderr, "[main_samview] failed to use reference \"%s\".\n", settings.fn_fai);
                 ret = 1;
                 goto view_end;
             }
         }
-        autoflush_if_stdout(settings.out, settings.fn_out);
+        if ((settings.header = sam_hdr_read(settings.in)) == 0) {
+            fprintf(stderr, "[main_samview] fail to read the header from \"%s\".\n", settings.fn_in);
+            ret = 1;
+            goto view_end;
+        }
+    }
+    if (settings.rghash) {
+        sam_hdr_remove_lines(settings.header, "RG", "ID", settings.rghash);
+    }
+    if (!settings.is_count) {
+        if ((settings.pipe_out = sam_stage_output(settings.fn_out)) != NULL) {
+            if (ga.write_index) {
+                print_error("view", "can't index the output of a pipeline stage");
+                ret = 1;
+                goto view_end;
+            }
+        } else {
+            if ((settings.out = sam_open_format(settings.fn_out? settings.fn_out : "-", out_mode, &ga.out)) == 0) {
+                print_error_errno("view", "failed to open \"%s\" for writing", settings.fn_out? settings.fn_out : "standard output");
+                ret = 1;
+                goto view_end;
+            }
+            if (settings.fn_fai) {
+                if (hts_set_fai_filename(settings.out, settings.fn_fai) != 0) {
+                    fprintf(stderr, "[main_samview] failed to use reference \"%s\".\n", settings.fn_fai);
+                    ret = 1;
+                    goto view_end;
+                }
+            }
+            autoflush_if_stdout(settings.out, settings.fn_out);
+        }
 
         if (!no_pg) {
             if (!(arg_list = stringify_argv(argc+1, argv-1))) {
@@ -1355,7 +2520,13 @@ int main_samview(int argc, char *argv[])
             }
         }
 
-        if (ga.write_index || is_header ||
+        if (settings.pipe_out) {
+            if (sam_pipe_write_header(settings.pipe_out, settings.header) != 0) {
+                print_error("view", "failed to pass the header to the next pipeline stage");
+                ret = 1;
+                goto view_end;
+            }
+        } else if (ga.write_index || is_header ||
             out_mode[1] == 'b' || out_mode[1] == 'c' ||
             (ga.out.format != sam && ga.out.format != unknown_format))  {
             if (sam_hdr_write(settings.out, settings.header) != 0) {
@@ -1415,12 +2586,13 @@ int main_samview(int argc, char *argv[])
     }
 
     if (ga.nthreads > 0) {
-        if (!(p.pool = hts_tpool_init(ga.nthreads))) {
+        if (!(p.pool = sam_stage_tpool_init(ga.nthreads))) {
             fprintf(stderr, "Error creating thread pool\n");
             ret = 1;
             goto view_end;
         }
-        hts_set_opt(settings.in,  HTS_OPT_THREAD_POOL, &p);
+        if (settings.in) hts_set_opt(settings.in,  HTS_OPT_THREAD_POOL, &p);
+        settings.pool = p.pool;
         if (settings.out) hts_set_opt(settings.out, HTS_OPT_THREAD_POOL, &p);
     }
     if (is_header_only) goto view_end; // no need to print alignments
@@ -1445,6 +2617,12 @@ int main_samview(int argc, char *argv[])
 
     if ( settings.fn_idx_in || nregs || settings.multi_region )
     {
+        if ( settings.pipe_in )
+        {
+            print_error("view", "regions can't be read from a pipeline stage");
+            ret = 1;
+            goto view_end;
+        }
         settings.hts_idx = settings.fn_idx_in ? sam_index_load2(settings.in, settings.fn_in, settings.fn_idx_in) : sam_index_load(settings.in, settings.fn_in);
         if ( !settings.hts_idx )
         {
@@ -1453,10 +2631,14 @@ int main_samview(int argc, char *argv[])
         }
     }
 
-    if (settings.is_count)
+    if (settings.is_count && settings.in)
         // Won't fail, but also wouldn't matter if it did
         hts_set_opt(settings.in, CRAM_OPT_REQUIRED_FIELDS, settings.count_rf);
 
+    // Done with optind; another pipeline stage may now parse its options
+    sam_stage_ready();
+
+    sam_prof_begin(st_records);
     if ( settings.fetch_pairs )
     {
         hts_itr_multi_t *iter = multi_region_init(&settings, regs, nregs);
@@ -1466,19 +2648,24 @@ int main_samview(int argc, char *argv[])
     else if ( settings.multi_region )
     {
         hts_itr_multi_t *iter = multi_region_init(&settings, regs, nregs);
-        ret = iter ? multi_region_view(&settings, iter) : 1;
+        if (!iter)
+            ret = 1;
+        else if (view_region_threaded(&settings))
+            ret = multi_region_view_threaded(&settings, iter);
+        else
+            ret = multi_region_view(&settings, iter);
         if (ret) goto view_end;
     }
-    else if ( !settings.hts_idx || optind+1 >= argc-has_index_file ) {
+    else if ( !settings.hts_idx || nregs <= 0 ) {
         // stream through the entire file
         ret = stream_view(&settings);
         if (ret) goto view_end;
     } else {   // retrieve alignments in specified regions
         int i;
-        for (i = (has_index_file)? optind+2 : optind+1; i < argc; ++i) {
-            hts_itr_t *iter = sam_itr_querys(settings.hts_idx, settings.header, argv[i]); // parse a region in the format like `chr2:100-200'
+        for (i = 0; i < nregs; ++i) {
+            hts_itr_t *iter = sam_itr_querys(settings.hts_idx, settings.header, regs[i]); // parse a region in the format like `chr2:100-200'
             if (iter == NULL) { // region invalid or reference name not found
-                fprintf(stderr, "[main_samview] region \"%s\" specifies an invalid region or unknown reference. Continue anyway.\n", argv[i]);
+                fprintf(stderr, "[main_samview] region \"%s\" specifies an invalid region or unknown reference. Continue anyway.\n", regs[i]);
                 continue;
             }
             // fetch alignments
@@ -1486,6 +2673,7 @@ int main_samview(int argc, char *argv[])
             if (ret) goto view_end;
         }
     }
+    sam_prof_end(st_records);
 
     if (ga.write_index) {
         if (sam_idx_save(settings.out) < 0) {
@@ -1514,6 +2702,14 @@ view_end:
             ret = EXIT_FAILURE;
     }
 
+    if (settings.expr_stats && settings.filter_str)
+        view_expr_report(settings.cfilter, settings.filter_str);
+
+    sam_prof_add("records_processed", settings.processed);
+    sam_prof_add("records_counted", settings.count);
+    sam_prof_file("bytes_in", settings.in);
+    sam_prof_output("bytes_out", settings.out);
+
     // close files, free and return
     if (settings.in) check_sam_close("view", settings.in, settings.fn_in, "standard input", &ret);
     if (settings.out) check_sam_close("view", settings.out, settings.fn_out, "standard output", &ret);
@@ -1536,6 +2732,8 @@ view_end:
             if (kh_exist(settings.rnhash, k)) free((char*)kh_key(settings.rnhash, k));
         kh_destroy(str, settings.rnhash);
     }
+    qname_index_destroy(settings.rnidx);
+    free(qname_fns);
     if (settings.tvhash) {
         khint_t k;
         for (k = 0; k < kh_end(settings.tvhash); ++k)
@@ -1551,9 +2749,9 @@ view_end:
     }
     if (settings.filter)
         hts_filter_free(settings.filter);
+    view_expr_free(settings.cfilter);
 
-    if (p.pool)
-        hts_tpool_destroy(p.pool);
+    sam_stage_tpool_destroy(p.pool);
 
     if (settings.fn_out_idx)
         free(settings.fn_out_idx);
@@ -1583,12 +2781,18 @@ static int usage(FILE *fp, int exit_status, int is_long_help)
 "      --no-header            Print SAM alignment records only [default]\n"
 "  -c, --count                Print only the count of matching records\n"
 "      --save-counts FILE     Write counts of passed/failed records to FILE\n"
+"      --expr-stats           Report reads rejected by each term of -e to stderr\n"
+"      --write-qname-index FILE\n"
+"                             Write the -N name lists to FILE for reuse, then exit\n"
+"      --write-bed-index FILE\n"
+"                             Write FILE.bin to speed up reading BED FILE, then exit\n"
 "  -o, --output FILE          Write output to FILE [standard output]\n"
 "  -U, --unoutput FILE, --output-unselected FILE\n"
 "                             Output reads not selected by filters to FILE\n"
 "  -p, --unmap                Set flag to UNMAP on reads not selected\n"
 "                             then write to output file.\n"
 "  -P, --fetch-pairs          Retrieve complete pairs even when outside of region\n"
+"      --passthrough          Copy BGZF blocks unchanged where possible (BAM to BAM)\n"
 "Input options:\n"
 "  -t, --fai-reference FILE   FILE listing reference names and lengths\n"
 "  -M, --use-index            Use index and multi-region iterator for regions\n"
@@ -1633,7 +2837,7 @@ static int usage(FILE *fp, int exit_status, int is_long_help)
 "  -S           Ignored (input format is auto-detected)\n"
 "      --no-PG  Do not add a PG line\n");
 
-    sam_global_opt_help(fp, "-.O.T@..");
+    sam_global_opt_help(fp, "-.O.T@....");
     fprintf(fp, "\n");
 
     if (is_long_help)
@@ -1700,7 +2904,7 @@ static int head_usage(FILE *fp, int exit_status)
 int main_head(int argc, char *argv[])
 {
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 'T', '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 'T', '@', '-', '-'),
         { "headers", required_argument, NULL, 'h' },
         { "records", required_argument, NULL, 'n' },
         { NULL, 0, NULL, 0 }
@@ -51,4 +51,34 @@ int bam_sanitize_options(const char *str);
 //        <0 on failure.
 int bam_sanitize(sam_hdr_t *h, bam1_t *b, int flags);
 
+// A stream of alignment records, so that subcommands can be chained in
+// one process without encoding the records between them.  read() has the
+// same return values as sam_read1(), and may swap the contents of b
+// instead of copying into it.
+typedef struct sam_rec_src {
+    int (*read)(void *data, sam_hdr_t *h, bam1_t *b);
+    void *data;
+} sam_rec_src;
+
+// Collates a file by read name, as "samtools collate" does, for reading
+// back through collate_reader_read().  Temporary files are named from
+// prefix, which must remain valid until collate_reader_close().
+typedef struct collate_reader collate_reader;
+collate_reader *collate_reader_open(const char *fn, const htsFormat *in_fmt,
+                                    const char *prefix, size_t max_mem,
+                                    htsThreadPool *p);
+sam_hdr_t *collate_reader_header(collate_reader *cr);
+int collate_reader_read(void *cr, sam_hdr_t *h, bam1_t *b);
+void collate_reader_close(collate_reader *cr);
+
+// Sorts the records from src by coordinate, as "samtools sort" does with
+// the same arguments.  The header h is copied.
+// Returns 0 on success,
+//        <0 on failure.
+int bam_sort_records(const sam_rec_src *src, const sam_hdr_t *h,
+                     const char *prefix, const char *fnout,
+                     const char *modeout, size_t max_mem, int n_threads,
+                     const htsFormat *in_fmt, const htsFormat *out_fmt,
+                     char *arg_list, int no_pg, int write_index);
+
 #endif
@@ -0,0 +1,225 @@
+/*  seq_utils.c -- sequence and quality transcoding kernels.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "htslib/sam.h"
+#include "seq_utils.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SEQ_UTILS_SSSE3
+#include <tmmintrin.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Complements of =ACM GRSV TWYH KDBN.  '=' has none, so becomes N.
+// Y is left as Y, as sort's minimiser code has always done.
+static const uint8_t seq_nt16_comp[16] = {
+    15, 8, 4,12,   2,10, 6,14,   1, 9,10,13,   3,11, 7,15
+};
+
+// Full IUPAC complements, with '=' staying as '='
+static const uint8_t seq_nt16_comp_iupac[16] = {
+     0, 8, 4,12,   2,10, 6,14,   1, 9, 5,13,   3,11, 7,15
+};
+
+#ifdef SEQ_UTILS_SSSE3
+static int have_ssse3(void) {
+    static int have = -1;
+    if (have < 0)
+        have = __builtin_cpu_supports("ssse3") ? 1 : 0;
+    return have;
+}
+
+// 16 packed bytes become 32 characters: look up both nibbles of each
+// byte in a 16 entry table and interleave the results.
+__attribute__((target("ssse3")))
+static int unpack_ssse3(char *out, const uint8_t *nib, int len) {
+    const __m128i lut = _mm_loadu_si128((const __m128i *) seq_nt16_str);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    int i;
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (nib + i / 2));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+        __m128i lo = _mm_and_si128(v, mask);
+        __m128i bh = _mm_shuffle_epi8(lut, hi);
+        __m128i bl = _mm_shuffle_epi8(lut, lo);
+        _mm_storeu_si128((__m128i *) (out + i),
+                         _mm_unpacklo_epi8(bh, bl));
+        _mm_storeu_si128((__m128i *) (out + i + 16),
+                         _mm_unpackhi_epi8(bh, bl));
+    }
+    return i;
+}
+
+// Reverse the byte order of 16 packed bytes, then complement both
+// nibbles of each and swap them over.
+__attribute__((target("ssse3")))
+static inline __m128i revcomp16_ssse3(__m128i v, __m128i comp,
+                                      __m128i comp_hi, __m128i rev) {
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    v = _mm_shuffle_epi8(v, rev);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    __m128i lo = _mm_and_si128(v, mask);
+    return _mm_or_si128(_mm_shuffle_epi8(comp_hi, lo),
+                        _mm_shuffle_epi8(comp, hi));
+}
+
+// Swaps whole blocks from each end, returning the range still to do
+__attribute__((target("ssse3")))
+static void revcomp_ssse3(uint8_t *seq, int *start, int *end,
+                          const uint8_t *ctab) {
+    uint8_t comp_hi[16];
+    int i = *start, j = *end, k;
+    for (k = 0; k < 16; k++)
+        comp_hi[k] = ctab[k] << 4;
+    const __m128i comp = _mm_loadu_si128((const __m128i *) ctab);
+    const __m128i chi = _mm_loadu_si128((const __m128i *) comp_hi);
+    const __m128i rev = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                     8, 9,10,11,12,13,14,15);
+    while (j - i >= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (seq + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (seq + j - 16));
+        _mm_storeu_si128((__m128i *) (seq + i),
+                         revcomp16_ssse3(b, comp, chi, rev));
+        _mm_storeu_si128((__m128i *) (seq + j - 16),
+                         revcomp16_ssse3(a, comp, chi, rev));
+        i += 16;
+        j -= 16;
+    }
+    *start = i;
+    *end = j;
+}
+
+// Reverses whole blocks from each end, returning the range still to do
+__attribute__((target("ssse3")))
+static void reverse_ssse3(uint8_t *s, int *start, int *end) {
+    const __m128i rev = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                     8, 9,10,11,12,13,14,15);
+    int i = *start, j = *end;
+    while (j - i >= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (s + j - 16));
+        _mm_storeu_si128((__m128i *) (s + i), _mm_shuffle_epi8(b, rev));
+        _mm_storeu_si128((__m128i *) (s + j - 16), _mm_shuffle_epi8(a, rev));
+        i += 16;
+        j -= 16;
+    }
+    *start = i;
+    *end = j;
+}
+#endif
+
+void seq_nt16_unpack(char *out, const uint8_t *nib, int len) {
+    int i = 0;
+#ifdef SEQ_UTILS_SSSE3
+    if (have_ssse3())
+        i = unpack_ssse3(out, nib, len);
+#endif
+    for (; i + 2 <= len; i += 2) {
+        out[i]   = seq_nt16_str[nib[i/2] >> 4];
+        out[i+1] = seq_nt16_str[nib[i/2] & 15];
+    }
+    if (i < len)
+        out[i] = seq_nt16_str[nib[i/2] >> 4];
+}
+
+static void revcomp_tab(uint8_t *seq, int len, const uint8_t *ctab) {
+    int i, j;
+
+    if ((len & 1) == 0) {
+        // Whole bytes can be swapped, complementing both bases in each
+        int start = 0, end = len / 2;
+#ifdef SEQ_UTILS_SSSE3
+        if (have_ssse3())
+            revcomp_ssse3(seq, &start, &end, ctab);
+#endif
+        for (i = start, j = end - 1; i < j; i++, j--) {
+            uint8_t tmp = seq[i];
+            seq[i] = (ctab[seq[j] & 15] << 4) | ctab[seq[j] >> 4];
+            seq[j] = (ctab[tmp & 15] << 4) | ctab[tmp >> 4];
+        }
+        if (i == j)
+            seq[i] = (ctab[seq[i] & 15] << 4) | ctab[seq[i] >> 4];
+    } else {
+        for (i = 0, j = len - 1; i < j; i++, j--) {
+            int tmp = bam_seqi(seq, i);
+            bam_set_seqi(seq, i, ctab[bam_seqi(seq, j)]);
+            bam_set_seqi(seq, j, ctab[tmp]);
+        }
+        if (i == j)
+            bam_set_seqi(seq, i, ctab[bam_seqi(seq, i)]);
+    }
+}
+
+void seq_nt16_revcomp(uint8_t *seq, int len) {
+    revcomp_tab(seq, len, seq_nt16_comp);
+}
+
+void seq_nt16_revcomp_iupac(uint8_t *seq, int len) {
+    revcomp_tab(seq, len, seq_nt16_comp_iupac);
+}
+
+void qual_reverse(uint8_t *qual, int len) {
+    int i = 0, j = len;
+#ifdef SEQ_UTILS_SSSE3
+    if (have_ssse3())
+        reverse_ssse3(qual, &i, &j);
+#endif
+    for (j--; i < j; i++, j--) {
+        uint8_t tmp = qual[i];
+        qual[i] = qual[j];
+        qual[j] = tmp;
+    }
+}
+
+void qual_add_offset(char *out, const uint8_t *qual, int len, int offset) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i off = _mm_set1_epi8(offset);
+    for (; i + 16 <= len; i += 16) {
+        __m128i q = _mm_loadu_si128((const __m128i *) (qual + i));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_add_epi8(q, off));
+    }
+#endif
+    for (; i < len; i++)
+        out[i] = qual[i] + offset;
+}
+
+void qual_sub_offset(uint8_t *qual, int len, int offset) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i off = _mm_set1_epi8(offset);
+    for (; i + 16 <= len; i += 16) {
+        __m128i q = _mm_loadu_si128((const __m128i *) (qual + i));
+        _mm_storeu_si128((__m128i *) (qual + i), _mm_sub_epi8(q, off));
+    }
+#endif
+    for (; i < len; i++)
+        qual[i] -= offset;
+}
@@ -0,0 +1,62 @@
+/*  seq_utils.h -- sequence and quality transcoding kernels.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef SEQ_UTILS_H
+#define SEQ_UTILS_H
+
+#include <stdint.h>
+
+/*
+ * Conversions between the BAM 4-bit sequence and phred quality arrays
+ * and their text forms.  Where the CPU supports it these use SIMD code,
+ * chosen at run time, falling back to plain loops elsewhere.
+ */
+
+/// Convert 4-bit packed bases to IUPAC text
+/** @param out  Output buffer of at least len bytes; not NUL terminated
+    @param nib  Packed sequence, as from bam_get_seq()
+    @param len  Number of bases
+*/
+void seq_nt16_unpack(char *out, const uint8_t *nib, int len);
+
+/// Reverse complement 4-bit packed bases in place
+/** @param seq  Packed sequence, as from bam_get_seq()
+    @param len  Number of bases
+*/
+void seq_nt16_revcomp(uint8_t *seq, int len);
+
+/// As seq_nt16_revcomp(), but with the full IUPAC complements
+/** seq_nt16_revcomp() turns '=' into N and leaves Y as Y, as sort has
+    always done.  Here '=' stays as '=' and Y becomes R.
+*/
+void seq_nt16_revcomp_iupac(uint8_t *seq, int len);
+
+/// Reverse the order of len quality values in place
+void qual_reverse(uint8_t *qual, int len);
+
+/// Add an offset to each quality value, usually 33 to make FASTQ text
+void qual_add_offset(char *out, const uint8_t *qual, int len, int offset);
+
+/// Subtract an offset from each quality character, in place
+void qual_sub_offset(uint8_t *qual, int len, int offset);
+
+#endif
@@ -44,22 +44,26 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
 #include <ctype.h>
 #include <inttypes.h>
 #include <getopt.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 #include <zlib.h>   // for crc32
 #include <htslib/faidx.h>
 #include <htslib/sam.h>
 #include <htslib/hts.h>
 #include <htslib/hts_defs.h>
+#include <htslib/thread_pool.h>
 #include "samtools.h"
 #include <htslib/khash.h>
 #include <htslib/kstring.h>
 #include "stats_isize.h"
 #include "sam_opts.h"
+#include "sam_prof.h"
 #include "bedidx.h"
 
 #define BWA_MIN_RDLEN 35
@@ -98,11 +102,14 @@ typedef struct
 }
 gc_depth_t;
 
-// For coverage distribution, a simple pileup
+// For coverage distribution, a simple pileup. The buffer holds depth
+// differences rather than depths: the depth at a slot is the running sum of
+// the buffer walking forward from start, so a read is two updates regardless
+// of its length. Reads running to the last slot are counted in end instead.
 typedef struct
 {
     hts_pos_t pos;
-    int size, start;
+    int size, start, end;
     int *buffer;
 }
 round_buffer_t;
@@ -231,6 +238,8 @@ typedef struct
     int mrseq_buf;                  // The size of the buffer
     hts_pos_t rseq_pos;             // The coordinate of the first base in the buffer
     int64_t nrseq_buf;              // The used part of the buffer
+    uint32_t *rseq_ngc, *rseq_nacgt;    // Prefix counts of GC and ACGT bases in rseq_buf
+    int mrseq_cnt;                  // The size of the prefix count buffers
     uint64_t *mpc_buf;              // Mismatches per cycle
 
     // Target regions
@@ -297,52 +306,91 @@ static inline int coverage_idx(int min, int max, int n, int step, int depth)
     return 1 + (depth - min) / step;
 }
 
-static inline int round_buffer_lidx2ridx(int offset, int size, hts_pos_t refpos, hts_pos_t pos)
+// Add one to the depth of the logical slots [from, to), 0 <= from < to <= size
+static inline void round_buffer_add(round_buffer_t *rbuf, int from, int to)
 {
-    return (offset + (pos-refpos) % size) % size;
+    rbuf->buffer[(rbuf->start + from) % rbuf->size]++;
+    if ( to < rbuf->size )
+        rbuf->buffer[(rbuf->start + to) % rbuf->size]--;
+    else
+        rbuf->end++;
+}
+
+// Add the running depth of the slots [ifrom, ito) to the distribution, in runs
+// of equal depth, and clear them. Returns the depth at the last slot.
+static int round_buffer_flush_slots(stats_t *stats, int ifrom, int ito, int depth)
+{
+    int *buf = stats->cov_rbuf.buffer, ibuf, run = 0;
+    for (ibuf=ifrom; ibuf<ito; ibuf++)
+    {
+        if ( buf[ibuf] )
+        {
+            if ( run && depth )
+                stats->cov[coverage_idx(stats->info->cov_min,stats->info->cov_max,stats->ncov,stats->info->cov_step,depth)] += run;
+            run = 0;
+            depth += buf[ibuf];
+            buf[ibuf] = 0;
+        }
+        run++;
+    }
+    if ( run && depth )
+        stats->cov[coverage_idx(stats->info->cov_min,stats->info->cov_max,stats->ncov,stats->info->cov_step,depth)] += run;
+    return depth;
 }
 
 void round_buffer_flush(stats_t *stats, hts_pos_t pos)
 {
-    int ibuf,idp;
+    round_buffer_t *rbuf = &stats->cov_rbuf;
 
-    if ( pos==stats->cov_rbuf.pos )
+    if ( pos==rbuf->pos )
         return;
 
     hts_pos_t new_pos = pos;
-    if ( pos==-1 || pos - stats->cov_rbuf.pos >= stats->cov_rbuf.size )
+    if ( pos==-1 || pos - rbuf->pos >= rbuf->size )
     {
         // Flush the whole buffer, but in sequential order,
-        pos = stats->cov_rbuf.pos + stats->cov_rbuf.size - 1;
+        pos = rbuf->pos + rbuf->size - 1;
     }
 
-    if ( pos < stats->cov_rbuf.pos )
-        error("Expected coordinates in ascending order, got %"PRIhts_pos" after %"PRIhts_pos"\n", pos, stats->cov_rbuf.pos);
+    if ( pos < rbuf->pos )
+        error("Expected coordinates in ascending order, got %"PRIhts_pos" after %"PRIhts_pos"\n", pos, rbuf->pos);
 
-    int ifrom = stats->cov_rbuf.start;
-    int ito = round_buffer_lidx2ridx(stats->cov_rbuf.start, stats->cov_rbuf.size, stats->cov_rbuf.pos, pos-1);
-    if ( ifrom>ito )
+    // Flush the logical slots [0, n), n < size, walking the ring from start
+    int n = (pos - rbuf->pos) % rbuf->size;
+    int ifrom = rbuf->start, ito = ifrom + n, depth = 0;
+    if ( ito > rbuf->size )
     {
-        for (ibuf=ifrom; ibuf<stats->cov_rbuf.size; ibuf++)
+        depth = round_buffer_flush_slots(stats, ifrom, rbuf->size, depth);
+        ifrom = 0;
+        ito  -= rbuf->size;
+    }
+    depth = round_buffer_flush_slots(stats, ifrom, ito, depth);
+
+    // The first unflushed slot carries the depth accumulated so far
+    int inext = ito % rbuf->size;
+    rbuf->buffer[inext] += depth;
+    if ( new_pos==-1 )
+    {
+        // Rebase the ring at slot 0, keeping the depth of the one slot left
+        depth = rbuf->buffer[inext];
+        if ( inext+1 < rbuf->size )
         {
-            if ( !stats->cov_rbuf.buffer[ibuf] )
-                continue;
-            idp = coverage_idx(stats->info->cov_min,stats->info->cov_max,stats->ncov,stats->info->cov_step,stats->cov_rbuf.buffer[ibuf]);
-            stats->cov[idp]++;
-            stats->cov_rbuf.buffer[ibuf] = 0;
+            rbuf->buffer[inext+1] = -depth;
+            rbuf->end = 0;
         }
-        ifrom = 0;
+        else
+            rbuf->end = depth;
+        rbuf->start = 0;
     }
-    for (ibuf=ifrom; ibuf<=ito; ibuf++)
+    else
     {
-        if ( !stats->cov_rbuf.buffer[ibuf] )
-            continue;
-        idp = coverage_idx(stats->info->cov_min,stats->info->cov_max,stats->ncov,stats->info->cov_step,stats->cov_rbuf.buffer[ibuf]);
-        stats->cov[idp]++;
-        stats->cov_rbuf.buffer[ibuf] = 0;
+        // The flushed slots are now at the end of the window, reads which
+        // ran to the old end stop before them
+        rbuf->buffer[rbuf->start] -= rbuf->end;
+        rbuf->end   = 0;
+        rbuf->start = inext;
     }
-    stats->cov_rbuf.start = (new_pos==-1) ? 0 : round_buffer_lidx2ridx(stats->cov_rbuf.start, stats->cov_rbuf.size, stats->cov_rbuf.pos, pos);
-    stats->cov_rbuf.pos   = new_pos;
+    rbuf->pos = new_pos;
 }
 
 /**
@@ -355,17 +403,15 @@ static void round_buffer_insert_read(round_buffer_t *rbuf, hts_pos_t from, hts_p
     if ( from < rbuf->pos )
         error("The reads are not sorted (%"PRIhts_pos" comes after %"PRIhts_pos").\n", from, rbuf->pos);
 
-    int ifrom, ito, ibuf;
-    ifrom = round_buffer_lidx2ridx(rbuf->start, rbuf->size, rbuf->pos, from);
-    ito   = round_buffer_lidx2ridx(rbuf->start, rbuf->size, rbuf->pos, to);
-    if ( ifrom>ito )
+    int ifrom = (from - rbuf->pos) % rbuf->size;
+    int ito   = (to - rbuf->pos) % rbuf->size;
+    if ( ifrom < ito )
+        round_buffer_add(rbuf, ifrom, ito);
+    else if ( ifrom > ito )
     {
-        for (ibuf=ifrom; ibuf<rbuf->size; ibuf++)
-            rbuf->buffer[ibuf]++;
-        ifrom = 0;
+        round_buffer_add(rbuf, ifrom, rbuf->size);
+        if ( ito ) round_buffer_add(rbuf, 0, ito);
     }
-    for (ibuf=ifrom; ibuf<ito; ibuf++)
-        rbuf->buffer[ibuf]++;
 }
 
 // Calculate the number of bases in the read trimmed by BWA
@@ -558,6 +604,18 @@ void read_ref_seq(stats_t *stats, int32_t tid, hts_pos_t pos, hts_pos_t end)
     fai_ref = faidx_fetch_seq64(stats->info->fai, sam_hdr_tid2name(stats->info->sam_header, tid), pos, pos+stats->mrseq_buf-1, &fai_ref_len);
     if ( fai_ref_len < 0 ) error("Failed to fetch the sequence \"%s\"\n", sam_hdr_tid2name(stats->info->sam_header, tid));
 
+    if ( stats->mrseq_cnt < fai_ref_len+1 )
+    {
+        uint32_t *ngc = realloc(stats->rseq_ngc, (fai_ref_len+1)*sizeof(uint32_t));
+        uint32_t *nacgt = ngc ? realloc(stats->rseq_nacgt, (fai_ref_len+1)*sizeof(uint32_t)) : NULL;
+        if ( ngc ) stats->rseq_ngc = ngc;
+        if ( !ngc || !nacgt )
+            error("Couldn't expand the reference GC count buffer\n");
+        stats->rseq_nacgt = nacgt;
+        stats->mrseq_cnt  = fai_ref_len+1;
+    }
+    stats->rseq_ngc[0] = stats->rseq_nacgt[0] = 0;
+
     uint8_t *ptr = stats->rseq_buf;
     for (i=0; i<fai_ref_len; i++)
     {
@@ -576,6 +634,8 @@ void read_ref_seq(stats_t *stats, int32_t tid, hts_pos_t pos, hts_pos_t end)
             case 't': *ptr = 8; break;
             default:  *ptr = 0; break;
         }
+        stats->rseq_ngc[i+1]   = stats->rseq_ngc[i] + (*ptr==2 || *ptr==4);
+        stats->rseq_nacgt[i+1] = stats->rseq_nacgt[i] + (*ptr!=0);
         ptr++;
     }
     free(fai_ref);
@@ -588,30 +648,22 @@ void read_ref_seq(stats_t *stats, int32_t tid, hts_pos_t pos, hts_pos_t end)
 
 float fai_gc_content(stats_t *stats, hts_pos_t pos, int len)
 {
-    uint32_t gc,count,c;
+    uint32_t gc,count;
     hts_pos_t i = pos - stats->rseq_pos, ito = i + len;
     assert( i>=0 );
 
     if (  ito > stats->nrseq_buf ) ito = stats->nrseq_buf;
+    if ( i >= ito ) return 0;
 
-    // Count GC content
-    gc = count = 0;
-    for (; i<ito; i++)
-    {
-        c = stats->rseq_buf[i];
-        if ( c==2 || c==4 )
-        {
-            gc++;
-            count++;
-        }
-        else if ( c==1 || c==8 )
-            count++;
-    }
+    // Count GC content from the prefix counts filled by read_ref_seq
+    gc    = stats->rseq_ngc[ito] - stats->rseq_ngc[i];
+    count = stats->rseq_nacgt[ito] - stats->rseq_nacgt[i];
     return count ? (float)gc/count : 0;
 }
 
 void realloc_rseq_buffer(stats_t *stats)
 {
+    if ( !stats->info->fai ) return;    // the buffer holds the reference only
     int n = stats->nbases*10;
     if ( stats->info->gcd_bin_size > n ) n = stats->info->gcd_bin_size;
     if ( stats->mrseq_buf<n )
@@ -632,7 +684,9 @@ void realloc_gcd_buffer(stats_t *stats, int seq_len)
 
 void realloc_buffers(stats_t *stats, int seq_len)
 {
-    int n = 2*(1 + seq_len - stats->nbases) + stats->nbases;
+    // Arrays that start empty are sized to fit the first read exactly
+    int n = stats->nbases ? 2*(1 + seq_len - stats->nbases) + stats->nbases : seq_len + 1;
+    int m = stats->nbases ? stats->nbases + 1 : 0;  // initialised part of the cycle arrays
 
     stats->quals_1st = realloc(stats->quals_1st, n*stats->nquals*sizeof(uint64_t));
     if ( !stats->quals_1st )
@@ -644,7 +698,7 @@ void realloc_buffers(stats_t *stats, int seq_len)
         error("Could not realloc buffers, the sequence too long: %d (2x%ld)\n", seq_len,n*stats->nquals*sizeof(uint64_t));
     memset(stats->quals_2nd + stats->nbases*stats->nquals, 0, (n-stats->nbases)*stats->nquals*sizeof(uint64_t));
 
-    if ( stats->mpc_buf )
+    if ( stats->info->fai )
     {
         stats->mpc_buf = realloc(stats->mpc_buf, n*stats->nquals*sizeof(uint64_t));
         if ( !stats->mpc_buf )
@@ -682,51 +736,48 @@ void realloc_buffers(stats_t *stats, int seq_len)
         error("Could not realloc buffers, the sequence too long: %d (%ld)\n", seq_len,n*sizeof(uint64_t));
     memset(stats->read_lengths_2nd + stats->nbases, 0, (n-stats->nbases)*sizeof(uint64_t));
 
-    stats->insertions = realloc(stats->insertions, n*sizeof(uint64_t));
-    if ( !stats->insertions )
-        error("Could not realloc buffers, the sequence too long: %d (%ld)\n", seq_len,n*sizeof(uint64_t));
-    memset(stats->insertions + stats->nbases, 0, (n-stats->nbases)*sizeof(uint64_t));
-
-    stats->deletions = realloc(stats->deletions, n*sizeof(uint64_t));
-    if ( !stats->deletions )
-        error("Could not realloc buffers, the sequence too long: %d (%ld)\n", seq_len,n*sizeof(uint64_t));
-    memset(stats->deletions + stats->nbases, 0, (n-stats->nbases)*sizeof(uint64_t));
-
     stats->ins_cycles_1st = realloc(stats->ins_cycles_1st, (n+1)*sizeof(uint64_t));
     if ( !stats->ins_cycles_1st )
         error("Could not realloc buffers, the sequence too long: %d (%ld)\n", seq_len,(n+1)*sizeof(uint64_t));
-    memset(stats->ins_cycles_1st + stats->nbases + 1, 0, (n-stats->nbases)*sizeof(uint64_t));
+    memset(stats->ins_cycles_1st + m, 0, (n+1-m)*sizeof(uint64_t));
 
     stats->ins_cycles_2nd = realloc(stats->ins_cycles_2nd, (n+1)*sizeof(uint64_t));
     if ( !stats->ins_cycles_2nd )
         error("Could not realloc buffers, the sequence too long: %d (%ld)\n", seq_len,(n+1)*sizeof(uint64_t));
-    memset(stats->ins_cycles_2nd + stats->nbases + 1, 0, (n-stats->nbases)*sizeof(uint64_t));
+    memset(stats->ins_cycles_2nd + m, 0, (n+1-m)*sizeof(uint64_t));
 
     stats->del_cycles_1st = realloc(stats->del_cycles_1st, (n+1)*sizeof(uint64_t));
     if ( !stats->del_cycles_1st )
         error("Could not realloc buffers, the sequence too long: %d (%ld)\n", seq_len,(n+1)*sizeof(uint64_t));
-    memset(stats->del_cycles_1st + stats->nbases + 1, 0, (n-stats->nbases)*sizeof(uint64_t));
+    memset(stats->del_cycles_1st + m, 0, (n+1-m)*sizeof(uint64_t));
 
     stats->del_cycles_2nd = realloc(stats->del_cycles_2nd, (n+1)*sizeof(uint64_t));
     if ( !stats->del_cycles_2nd )
         error("Could not realloc buffers, the sequence too long: %d (%ld)\n", seq_len,(n+1)*sizeof(uint64_t));
-    memset(stats->del_cycles_2nd + stats->nbases + 1, 0, (n-stats->nbases)*sizeof(uint64_t));
+    memset(stats->del_cycles_2nd + m, 0, (n+1-m)*sizeof(uint64_t));
 
     stats->nbases = n;
 
-    // Realloc the coverage distribution buffer
-    int *rbuffer = calloc(sizeof(int),seq_len*5);
-    if (!rbuffer) {
-        error("Could not allocate coverage distribution buffer");
+    // Grow the coverage distribution buffer, which is never shrunk to fit
+    // the reads of split stats
+    if ( seq_len*5 > stats->cov_rbuf.size )
+    {
+        int *rbuffer = calloc(sizeof(int),seq_len*5);
+        if (!rbuffer) {
+            error("Could not allocate coverage distribution buffer");
+        }
+        // The differences are relative to start, copy them in logical order. Reads
+        // running to the old end stop there as the new buffer extends beyond it
+        int i;
+        for (i=0; i<stats->cov_rbuf.size; i++)
+            rbuffer[i] = stats->cov_rbuf.buffer[(stats->cov_rbuf.start + i) % stats->cov_rbuf.size];
+        rbuffer[stats->cov_rbuf.size] = -stats->cov_rbuf.end;
+        stats->cov_rbuf.end = 0;
+        stats->cov_rbuf.start = 0;
+        free(stats->cov_rbuf.buffer);
+        stats->cov_rbuf.buffer = rbuffer;
+        stats->cov_rbuf.size = seq_len*5;
     }
-    n = stats->cov_rbuf.size-stats->cov_rbuf.start;
-    memcpy(rbuffer,stats->cov_rbuf.buffer+stats->cov_rbuf.start,n);
-    if ( stats->cov_rbuf.start>1 )
-        memcpy(rbuffer+n,stats->cov_rbuf.buffer,stats->cov_rbuf.start);
-    stats->cov_rbuf.start = 0;
-    free(stats->cov_rbuf.buffer);
-    stats->cov_rbuf.buffer = rbuffer;
-    stats->cov_rbuf.size = seq_len*5;
 
     realloc_rseq_buffer(stats);
 }
@@ -748,6 +799,24 @@ void update_checksum(bam1_t *bam_line, stats_t *stats)
     stats->checksum.quals += crc32(0L, qual, (seq_len+1)/2);
 }
 
+// Make room for the counts of a barcode tag seen for the first time
+static void add_barcode_tag(stats_t* stats, uint32_t tag, uint32_t barcode_len) {
+    uint32_t offset = 0, i;
+    for (i = 0; i < stats->ntags; i++)
+        offset += stats->tags_barcode[i].nbases;
+
+    stats->tags_barcode[tag].offset = offset;
+    stats->tags_barcode[tag].nbases = barcode_len;
+    stats->acgtno_barcode = realloc(stats->acgtno_barcode, (offset + barcode_len) * sizeof(acgtno_count_t));
+    stats->quals_barcode  = realloc(stats->quals_barcode, (offset + barcode_len) * stats->nquals * sizeof(uint64_t));
+
+    if (!stats->acgtno_barcode || !stats->quals_barcode)
+        error("Error allocating memory. Aborting!\n");
+
+    memset(stats->acgtno_barcode + offset, 0, barcode_len*sizeof(acgtno_count_t));
+    memset(stats->quals_barcode + offset*stats->nquals, 0, barcode_len*stats->nquals*sizeof(uint64_t));
+}
+
 // Collect statistics about the barcode tags specified by init_barcode_tags method
 static void collect_barcode_stats(bam1_t* bam_line, stats_t* stats) {
     uint32_t nbases, tag, i;
@@ -769,22 +838,8 @@ static void collect_barcode_stats(bam1_t* bam_line, stats_t* stats) {
         if (!barcode_len) {
             continue;        //consider 0 size barcode same as no barcode - avoids issues with realloc below
         }
-        if (!stats->tags_barcode[tag].nbases) { // tag seen for the first time
-            uint32_t offset = 0;
-            for (i = 0; i < stats->ntags; i++)
-                offset += stats->tags_barcode[i].nbases;
-
-            stats->tags_barcode[tag].offset = offset;
-            stats->tags_barcode[tag].nbases = barcode_len;
-            stats->acgtno_barcode = realloc(stats->acgtno_barcode, (offset + barcode_len) * sizeof(acgtno_count_t));
-            stats->quals_barcode  = realloc(stats->quals_barcode, (offset + barcode_len) * stats->nquals * sizeof(uint64_t));
-
-            if (!stats->acgtno_barcode || !stats->quals_barcode)
-                error("Error allocating memory. Aborting!\n");
-
-            memset(stats->acgtno_barcode + offset, 0, barcode_len*sizeof(acgtno_count_t));
-            memset(stats->quals_barcode + offset*stats->nquals, 0, barcode_len*stats->nquals*sizeof(uint64_t));
-        }
+        if (!stats->tags_barcode[tag].nbases) // tag seen for the first time
+            add_barcode_tag(stats, tag, barcode_len);
 
         nbases = stats->tags_barcode[tag].nbases;
         if (barcode_len > nbases) {
@@ -864,6 +919,71 @@ static void collect_barcode_stats(bam1_t* bam_line, stats_t* stats) {
     }
 }
 
+// Where each base goes in acgtno_count_t, from the uint8_t coding:
+//      -12-4---8------5
+//      =ACMGRSVTWYHKDBN
+// "=" is counted in "other" along with the MRSVWYHKDB ambiguity codes.
+#define ACGTNO(x) offsetof(acgtno_count_t, x)
+#define ACGTNO_NONE ((size_t)-1)
+static const size_t acgtno_base[16] = {
+    ACGTNO(other), ACGTNO(a), ACGTNO(c), ACGTNO(other),
+    ACGTNO(g), ACGTNO(other), ACGTNO(other), ACGTNO(other),
+    ACGTNO(t), ACGTNO(other), ACGTNO(other), ACGTNO(other),
+    ACGTNO(other), ACGTNO(other), ACGTNO(other), ACGTNO(n)
+};
+// The original strand of the read only counts A, C, G and T
+static const size_t acgtno_revcomp_fwd[16] = {
+    ACGTNO_NONE, ACGTNO(a), ACGTNO(c), ACGTNO_NONE,
+    ACGTNO(g), ACGTNO_NONE, ACGTNO_NONE, ACGTNO_NONE,
+    ACGTNO(t), ACGTNO_NONE, ACGTNO_NONE, ACGTNO_NONE,
+    ACGTNO_NONE, ACGTNO_NONE, ACGTNO_NONE, ACGTNO_NONE
+};
+static const size_t acgtno_revcomp_rev[16] = {
+    ACGTNO_NONE, ACGTNO(t), ACGTNO(g), ACGTNO_NONE,
+    ACGTNO(c), ACGTNO_NONE, ACGTNO_NONE, ACGTNO_NONE,
+    ACGTNO(a), ACGTNO_NONE, ACGTNO_NONE, ACGTNO_NONE,
+    ACGTNO_NONE, ACGTNO_NONE, ACGTNO_NONE, ACGTNO_NONE
+};
+static const uint8_t gc_base[16] = { 0,0,1,0, 1,0,0,0, 0,0,0,0, 0,0,0,0 };
+
+static inline void acgtno_inc(acgtno_count_t *count, size_t field)
+{
+    (*(uint64_t *)((char *)count + field))++;
+}
+
+static inline void count_acgtno_base(acgtno_count_t *cycles, acgtno_count_t *revcomp, const size_t *revcomp_base, int cycle, int base)
+{
+    acgtno_inc(&cycles[cycle], acgtno_base[base]);
+    if ( revcomp_base[base] != ACGTNO_NONE )
+        acgtno_inc(&revcomp[cycle], revcomp_base[base]);
+}
+
+// Count the bases per read cycle, returning the number of G and C.  The
+// sequence is decoded a byte, so two bases, at a time and looked up in the
+// tables above rather than switched on, with the direction settled once
+// per read instead of once per base
+static int count_acgtno_cycles(const uint8_t *seq, int seq_len, int reverse, acgtno_count_t *cycles, acgtno_count_t *revcomp)
+{
+    const size_t *revcomp_base = reverse ? acgtno_revcomp_rev : acgtno_revcomp_fwd;
+    int i, gc_count = 0;
+    int cycle = reverse ? seq_len-1 : 0, step = reverse ? -1 : 1;
+
+    for (i=0; i+1<seq_len; i+=2, cycle+=2*step)
+    {
+        int hi = seq[i>>1] >> 4, lo = seq[i>>1] & 15;
+        count_acgtno_base(cycles, revcomp, revcomp_base, cycle, hi);
+        count_acgtno_base(cycles, revcomp, revcomp_base, cycle+step, lo);
+        gc_count += gc_base[hi] + gc_base[lo];
+    }
+    if ( i<seq_len )
+    {
+        int hi = seq[i>>1] >> 4;
+        count_acgtno_base(cycles, revcomp, revcomp_base, cycle, hi);
+        gc_count += gc_base[hi];
+    }
+    return gc_count;
+}
+
 // These stats should only be calculated for the original reads ignoring
 // supplementary artificial reads otherwise we'll accidentally double count
 void collect_orig_read_stats(bam1_t *bam_line, stats_t *stats, int* gc_count_out)
@@ -878,50 +998,11 @@ void collect_orig_read_stats(bam1_t *bam_line, stats_t *stats, int* gc_count_out
 
     // Count GC and ACGT per cycle. Note that cycle is approximate, clipping is ignored
     uint8_t *seq  = bam_get_seq(bam_line);
-    int i, read_cycle, gc_count = 0, reverse = IS_REVERSE(bam_line);
+    int i, gc_count = 0, reverse = IS_REVERSE(bam_line);
 
     acgtno_count_t *acgtno_cycles = (order == READ_ORDER_FIRST) ? stats->acgtno_cycles_1st : (order == READ_ORDER_LAST) ?  stats->acgtno_cycles_2nd : NULL ;
-    if (acgtno_cycles) {
-        for (i=0; i<seq_len; i++)
-        {
-            // Read cycle for current index
-            read_cycle = (reverse ? seq_len-i-1 : i);
-
-            // Conversion from uint8_t coding:
-            //      -12-4---8------5
-            //      =ACMGRSVTWYHKDBN
-            switch (bam_seqi(seq, i)) {
-            case 1:
-                acgtno_cycles[ read_cycle ].a++;
-                reverse ? stats->acgtno_revcomp[ read_cycle ].t++ : stats->acgtno_revcomp[ read_cycle ].a++;
-                break;
-            case 2:
-                acgtno_cycles[ read_cycle ].c++;
-                reverse ? stats->acgtno_revcomp[ read_cycle ].g++ : stats->acgtno_revcomp[ read_cycle ].c++;
-                gc_count++;
-                break;
-            case 4:
-                acgtno_cycles[ read_cycle ].g++;
-                reverse ? stats->acgtno_revcomp[ read_cycle ].c++ : stats->acgtno_revcomp[ read_cycle ].g++;
-                gc_count++;
-                break;
-            case 8:
-                reverse ? stats->acgtno_revcomp[ read_cycle ].a++ : stats->acgtno_revcomp[ read_cycle ].t++;
-                acgtno_cycles[ read_cycle ].t++;
-                break;
-            case 15:
-                acgtno_cycles[ read_cycle ].n++;
-                break;
-            default:
-                /*
-                 * count "=" sequences in "other" along
-                 * with MRSVWYHKDB ambiguity codes
-                 */
-                acgtno_cycles[ read_cycle ].other++;
-                break;
-            }
-        }
-    }
+    if (acgtno_cycles)
+        gc_count = count_acgtno_cycles(seq, seq_len, reverse, acgtno_cycles, stats->acgtno_revcomp);
     int gc_idx_min = gc_count*(stats->ngc-1)/seq_len;
     int gc_idx_max = (gc_count+1)*(stats->ngc-1)/seq_len;
     if ( gc_idx_max >= stats->ngc ) gc_idx_max = stats->ngc - 1;
@@ -954,18 +1035,26 @@ void collect_orig_read_stats(bam1_t *bam_line, stats_t *stats, int* gc_count_out
         stats->nbases_trimmed += bwa_trim_read(stats->info->trim_qual, bam_quals, seq_len, reverse);
 
     // Quality histogram and average quality. Clipping is neglected.
+    //  The maximum is found first so the checks are out of the counting loop
     if (quals) {
+        uint8_t qual_max = 0;
+        uint64_t qual_sum = 0;
         for (i=0; i<seq_len; i++)
+            if ( bam_quals[i]>qual_max ) qual_max = bam_quals[i];
+        if ( qual_max>=stats->nquals )
+            error("TODO: quality too high %d>=%d (%s %"PRIhts_pos" %s)\n", qual_max, stats->nquals, sam_hdr_tid2name(stats->info->sam_header, bam_line->core.tid), bam_line->core.pos+1, bam_get_qname(bam_line));
+        if ( qual_max>stats->max_qual )
+            stats->max_qual = qual_max;
+
+        // Row of the histogram for the read cycle of the first stored base
+        long row = reverse ? (long)(seq_len-1)*stats->nquals : 0;
+        long step = reverse ? -stats->nquals : stats->nquals;
+        for (i=0; i<seq_len; i++, row+=step)
         {
-            uint8_t qual = bam_quals[ reverse ? seq_len-i-1 : i];
-            if ( qual>=stats->nquals )
-                error("TODO: quality too high %d>=%d (%s %"PRIhts_pos" %s)\n", qual, stats->nquals, sam_hdr_tid2name(stats->info->sam_header, bam_line->core.tid), bam_line->core.pos+1, bam_get_qname(bam_line));
-            if ( qual>stats->max_qual )
-                stats->max_qual = qual;
-
-            quals[ i*stats->nquals+qual ]++;
-            stats->sum_qual += qual;
+            quals[ row+bam_quals[i] ]++;
+            qual_sum += bam_quals[i];
         }
+        stats->sum_qual += qual_sum;
     }
 
     // Barcode statistics
@@ -1155,29 +1244,31 @@ static void remove_overlaps(bam1_t *bam_line, khash_t(qn2pair) *read_pairs, stat
     round_buffer_insert_read(&(stats->cov_rbuf), pmin, pmax);
 }
 
-void collect_stats(bam1_t *bam_line, stats_t *stats, khash_t(qn2pair) *read_pairs)
+// The stats of a single read that do not depend on the reads around it.
+// Returns the unclipped read length if the read is also wanted for the
+// position based stats of collect_pos_stats(), otherwise 0.  With threads
+// this runs in the workers, each on its own shard of the stats
+static int collect_read_stats(bam1_t *bam_line, stats_t *stats, int *gc_count_out)
 {
-    if ( !is_in_regions(bam_line,stats) )
-        return;
     if ( stats->rg_hash )
     {
         const uint8_t *rg = bam_aux_get(bam_line, "RG");
-        if ( !rg ) return;  // certain read groups were requested but this record has none
+        if ( !rg ) return 0;  // certain read groups were requested but this record has none
         khint_t k = kh_get(rg, stats->rg_hash, (const char*)(rg + 1));
-        if ( k == kh_end((kh_rg_t *)stats->rg_hash) ) return;
+        if ( k == kh_end((kh_rg_t *)stats->rg_hash) ) return 0;
     }
     if ( stats->info->flag_require && (bam_line->core.flag & stats->info->flag_require)!=stats->info->flag_require )
     {
         stats->nreads_filtered++;
-        return;
+        return 0;
     }
     if ( stats->info->flag_filter && (bam_line->core.flag & stats->info->flag_filter) )
     {
         stats->nreads_filtered++;
-        return;
+        return 0;
     }
     if ( stats->info->filter_readlen!=-1 && bam_line->core.l_qseq!=stats->info->filter_readlen )
-        return;
+        return 0;
 
     update_checksum(bam_line, stats);
 
@@ -1185,7 +1276,7 @@ void collect_stats(bam1_t *bam_line, stats_t *stats, khash_t(qn2pair) *read_pair
     if ( bam_line->core.flag & BAM_FSECONDARY )
     {
         stats->nreads_secondary++;
-        return;
+        return 0;
     }
 
     if ( bam_line->core.flag & BAM_FSUPPLEMENTARY )
@@ -1195,7 +1286,7 @@ void collect_stats(bam1_t *bam_line, stats_t *stats, khash_t(qn2pair) *read_pair
 
     // If line has no sequence cannot continue
     int seq_len = bam_line->core.l_qseq;
-    if ( !seq_len ) return;
+    if ( !seq_len ) return 0;
 
     if ( IS_DUP(bam_line) )
     {
@@ -1218,8 +1309,7 @@ void collect_stats(bam1_t *bam_line, stats_t *stats, khash_t(qn2pair) *read_pair
     if ( ( bam_line->core.flag & (BAM_FUNMAP|BAM_FSECONDARY|BAM_FSUPPLEMENTARY|BAM_FQCFAIL|BAM_FDUP) ) == 0 )
         stats->mapping_qualities[bam_line->core.qual]++;
 
-    int i;
-    int gc_count = 0;
+    *gc_count_out = 0;
 
     // These stats should only be calculated for the original reads ignoring supplementary artificial reads
     // otherwise we'll accidentally double count
@@ -1227,11 +1317,11 @@ void collect_stats(bam1_t *bam_line, stats_t *stats, khash_t(qn2pair) *read_pair
         stats->read_lengths[read_len]++;
         if ( order == READ_ORDER_FIRST ) stats->read_lengths_1st[read_len]++;
         if ( order == READ_ORDER_LAST ) stats->read_lengths_2nd[read_len]++;
-        collect_orig_read_stats(bam_line, stats, &gc_count);
+        collect_orig_read_stats(bam_line, stats, gc_count_out);
     }
 
     // Look at the flags and increment appropriate counters (mapped, paired, etc)
-    if ( IS_UNMAPPED(bam_line) ) return;
+    if ( IS_UNMAPPED(bam_line) ) return 0;
 
     count_indels(stats, bam_line);
 
@@ -1276,6 +1366,22 @@ void collect_stats(bam1_t *bam_line, stats_t *stats, khash_t(qn2pair) *read_pair
     if (nm)
         stats->nmismatches += bam_aux2i(nm);
 
+    return read_len;
+}
+
+// The stats which need the reads in order: mapped bases on target, coverage,
+// GC-depth and mismatches per cycle.  Always run by the main thread
+static void collect_pos_stats(bam1_t *bam_line, stats_t *stats, khash_t(qn2pair) *read_pairs, int read_len, int gc_count)
+{
+    int seq_len = bam_line->core.l_qseq;
+    int i;
+
+    // Already done for this stats unless the read stats went to a shard
+    if ( read_len >= stats->nbases )
+        realloc_buffers(stats,read_len);
+    if ( stats->max_len<read_len )
+        stats->max_len = read_len;
+
     // Number of mapped bases from cigar
     if ( bam_line->core.n_cigar == 0)
         error("FIXME: mapped read with no cigar?\n");
@@ -1452,6 +1558,16 @@ void collect_stats(bam1_t *bam_line, stats_t *stats, khash_t(qn2pair) *read_pair
     }
 }
 
+void collect_stats(bam1_t *bam_line, stats_t *stats, khash_t(qn2pair) *read_pairs)
+{
+    int read_len, gc_count;
+
+    if ( !is_in_regions(bam_line,stats) )
+        return;
+    if ( (read_len = collect_read_stats(bam_line, stats, &gc_count)) )
+        collect_pos_stats(bam_line, stats, read_pairs, read_len, gc_count);
+}
+
 // Sort by GC and depth
 #define GCD_t(x) ((gc_depth_t *)x)
 static int gcd_cmp(const void *a, const void *b)
@@ -1486,6 +1602,11 @@ void output_stats(FILE *to, stats_t *stats, int sparse)
     int isize, ibulk=0, icov, imapq=0;
     uint64_t nisize=0, nisize_inward=0, nisize_outward=0, nisize_other=0, cov_sum=0;
     double bulk=0, avg_isize=0, sd_isize=0;
+
+    // Split stats whose reads were all filtered out have no per-cycle arrays
+    if ( !stats->nbases )
+        realloc_buffers(stats, 0);
+
     for (isize=0; isize<stats->isize->nitems(stats->isize->data); isize++)
     {
         // Each pair was counted twice
@@ -2118,7 +2239,7 @@ error(const char *format, ...)
         printf("    -x, --sparse                        Suppress outputting IS rows where there are no insertions.\n");
         printf("    -p, --remove-overlaps               Remove overlaps of paired-end reads from coverage and base count computations.\n");
         printf("    -g, --cov-threshold <int>           Only bases with coverage above this value will be included in the target percentage computation [0]\n");
-        sam_global_opt_help(stdout, "-.--.@-.");
+        sam_global_opt_help(stdout, "-.--.@-..");
         printf("\n");
     }
     else
@@ -2146,6 +2267,8 @@ void cleanup_stats(stats_t* stats)
     free(stats->isize);
     free(stats->gcd);
     free(stats->rseq_buf);
+    free(stats->rseq_ngc);
+    free(stats->rseq_nacgt);
     free(stats->mpc_buf);
     free(stats->acgtno_cycles_1st);
     free(stats->acgtno_cycles_2nd);
@@ -2313,10 +2436,6 @@ static void init_stat_structs(stats_t* stats, stats_info_t* info, const char* gr
     if (!stats->cov_rbuf.buffer) goto nomem;
     if ( group_id ) init_group_id(stats, info, group_id);
     // .. arrays
-    stats->quals_1st      = calloc(stats->nquals*stats->nbases,sizeof(uint64_t));
-    if (!stats->quals_1st) goto nomem;
-    stats->quals_2nd      = calloc(stats->nquals*stats->nbases,sizeof(uint64_t));
-    if (!stats->quals_2nd) goto nomem;
     stats->gc_1st         = calloc(stats->ngc,sizeof(uint64_t));
     if (!stats->gc_1st) goto nomem;
     stats->gc_2nd         = calloc(stats->ngc,sizeof(uint64_t));
@@ -2325,6 +2444,26 @@ static void init_stat_structs(stats_t* stats, stats_info_t* info, const char* gr
     if (!stats->isize) goto nomem;
     stats->gcd            = calloc(stats->ngcd,sizeof(gc_depth_t));
     if (!stats->gcd) goto nomem;
+    stats->insertions     = calloc(stats->nindels,sizeof(uint64_t));
+    if (!stats->insertions) goto nomem;
+    stats->deletions      = calloc(stats->nindels,sizeof(uint64_t));
+    if (!stats->deletions)  goto nomem;
+    stats->mapping_qualities = calloc(256,sizeof(uint64_t));
+    if(!stats->mapping_qualities) goto nomem;
+    if (init_barcode_tags(stats) < 0)
+        goto nomem;
+    if ( stats->split_name )
+    {
+        // There can be thousands of splits, so rather than guess the read
+        // length their per-cycle arrays are left to realloc_buffers()
+        stats->nbases = 0;
+        goto per_cycle_done;
+    }
+    // .. per-cycle arrays
+    stats->quals_1st      = calloc(stats->nquals*stats->nbases,sizeof(uint64_t));
+    if (!stats->quals_1st) goto nomem;
+    stats->quals_2nd      = calloc(stats->nquals*stats->nbases,sizeof(uint64_t));
+    if (!stats->quals_2nd) goto nomem;
     if (info->fai) {
         stats->mpc_buf    = calloc(stats->nquals*stats->nbases,sizeof(uint64_t));
         if (!stats->mpc_buf) goto nomem;
@@ -2343,10 +2482,6 @@ static void init_stat_structs(stats_t* stats, stats_info_t* info, const char* gr
     if (!stats->read_lengths_1st) goto nomem;
     stats->read_lengths_2nd   = calloc(stats->nbases,sizeof(uint64_t));
     if (!stats->read_lengths_2nd) goto nomem;
-    stats->insertions     = calloc(stats->nbases,sizeof(uint64_t));
-    if (!stats->insertions) goto nomem;
-    stats->deletions      = calloc(stats->nbases,sizeof(uint64_t));
-    if (!stats->deletions)  goto nomem;
     stats->ins_cycles_1st = calloc(stats->nbases+1,sizeof(uint64_t));
     if (!stats->ins_cycles_1st) goto nomem;
     stats->ins_cycles_2nd = calloc(stats->nbases+1,sizeof(uint64_t));
@@ -2355,10 +2490,7 @@ static void init_stat_structs(stats_t* stats, stats_info_t* info, const char* gr
     if (!stats->del_cycles_1st) goto nomem;
     stats->del_cycles_2nd = calloc(stats->nbases+1,sizeof(uint64_t));
     if (!stats->del_cycles_2nd) goto nomem;
-    stats->mapping_qualities = calloc(256,sizeof(uint64_t));
-    if(!stats->mapping_qualities) goto nomem;
-    if (init_barcode_tags(stats) < 0)
-        goto nomem;
+ per_cycle_done:
     realloc_rseq_buffer(stats);
     if ( targets )
         init_regions(stats, targets, info);
@@ -2383,8 +2515,8 @@ static stats_t* get_curr_split_stats(bam1_t* bam_line, khash_t(c2stats)* split_h
         if (!curr_stats) {
             error("Couldn't allocate split stats");
         }
-        init_stat_structs(curr_stats, info, NULL, targets);
         curr_stats->split_name = split_name;
+        init_stat_structs(curr_stats, info, NULL, targets);
 
         // Record index in hash
         int ret = 0;
@@ -2401,6 +2533,247 @@ static stats_t* get_curr_split_stats(bam1_t* bam_line, khash_t(c2stats)* split_h
     return curr_stats;
 }
 
+#define STATS_BATCH_SIZE 1024
+
+static void add_counts(uint64_t *dst, const uint64_t *src, size_t n)
+{
+    size_t i;
+    for (i=0; i<n; i++)
+        dst[i] += src[i];
+}
+
+static void add_acgtno_counts(acgtno_count_t *dst, const acgtno_count_t *src, size_t n)
+{
+    size_t i;
+    for (i=0; i<n; i++)
+    {
+        dst[i].a += src[i].a;
+        dst[i].c += src[i].c;
+        dst[i].g += src[i].g;
+        dst[i].t += src[i].t;
+        dst[i].n += src[i].n;
+        dst[i].other += src[i].other;
+    }
+}
+
+// Add the counts a shard collected with collect_read_stats() to stats
+static void merge_stats(stats_t *stats, stats_t *shard)
+{
+    int i, n;
+    uint32_t tag;
+
+    if ( shard->nbases > stats->nbases )
+        realloc_buffers(stats, shard->nbases);
+
+    n = shard->nbases;
+    add_counts(stats->quals_1st, shard->quals_1st, (size_t)n*shard->nquals);
+    add_counts(stats->quals_2nd, shard->quals_2nd, (size_t)n*shard->nquals);
+    add_counts(stats->gc_1st, shard->gc_1st, shard->ngc);
+    add_counts(stats->gc_2nd, shard->gc_2nd, shard->ngc);
+    add_acgtno_counts(stats->acgtno_cycles_1st, shard->acgtno_cycles_1st, n);
+    add_acgtno_counts(stats->acgtno_cycles_2nd, shard->acgtno_cycles_2nd, n);
+    add_acgtno_counts(stats->acgtno_revcomp, shard->acgtno_revcomp, n);
+    add_counts(stats->read_lengths, shard->read_lengths, n);
+    add_counts(stats->read_lengths_1st, shard->read_lengths_1st, n);
+    add_counts(stats->read_lengths_2nd, shard->read_lengths_2nd, n);
+    add_counts(stats->insertions, shard->insertions, shard->nindels);
+    add_counts(stats->deletions, shard->deletions, shard->nindels);
+    add_counts(stats->ins_cycles_1st, shard->ins_cycles_1st, n+1);
+    add_counts(stats->ins_cycles_2nd, shard->ins_cycles_2nd, n+1);
+    add_counts(stats->del_cycles_1st, shard->del_cycles_1st, n+1);
+    add_counts(stats->del_cycles_2nd, shard->del_cycles_2nd, n+1);
+    add_counts(stats->mapping_qualities, shard->mapping_qualities, 256);
+
+    isize_t *from = shard->isize, *to = stats->isize;
+    for (i=0; i<from->nitems(from->data); i++)
+    {
+        uint64_t count;
+        if ( (count = from->inward(from->data, i)) )
+            to->set_inward(to->data, i, to->inward(to->data, i) + count);
+        if ( (count = from->outward(from->data, i)) )
+            to->set_outward(to->data, i, to->outward(to->data, i) + count);
+        if ( (count = from->other(from->data, i)) )
+            to->set_other(to->data, i, to->other(to->data, i) + count);
+    }
+
+    if ( stats->max_len < shard->max_len ) stats->max_len = shard->max_len;
+    if ( stats->max_len_1st < shard->max_len_1st ) stats->max_len_1st = shard->max_len_1st;
+    if ( stats->max_len_2nd < shard->max_len_2nd ) stats->max_len_2nd = shard->max_len_2nd;
+    if ( stats->max_qual < shard->max_qual ) stats->max_qual = shard->max_qual;
+
+    stats->total_len += shard->total_len;
+    stats->total_len_1st += shard->total_len_1st;
+    stats->total_len_2nd += shard->total_len_2nd;
+    stats->total_len_dup += shard->total_len_dup;
+    stats->nreads_1st += shard->nreads_1st;
+    stats->nreads_2nd += shard->nreads_2nd;
+    stats->nreads_other += shard->nreads_other;
+    stats->nreads_filtered += shard->nreads_filtered;
+    stats->nreads_dup += shard->nreads_dup;
+    stats->nreads_unmapped += shard->nreads_unmapped;
+    stats->nreads_single_mapped += shard->nreads_single_mapped;
+    stats->nreads_paired_and_mapped += shard->nreads_paired_and_mapped;
+    stats->nreads_properly_paired += shard->nreads_properly_paired;
+    stats->nreads_paired_tech += shard->nreads_paired_tech;
+    stats->nreads_anomalous += shard->nreads_anomalous;
+    stats->nreads_mq0 += shard->nreads_mq0;
+    stats->nbases_mapped += shard->nbases_mapped;
+    stats->nbases_mapped_cigar += shard->nbases_mapped_cigar;
+    stats->nbases_trimmed += shard->nbases_trimmed;
+    stats->nmismatches += shard->nmismatches;
+    stats->nreads_QCfailed += shard->nreads_QCfailed;
+    stats->nreads_secondary += shard->nreads_secondary;
+    stats->nreads_supplementary += shard->nreads_supplementary;
+    stats->checksum.names += shard->checksum.names;
+    stats->checksum.reads += shard->checksum.reads;
+    stats->checksum.quals += shard->checksum.quals;
+    stats->sum_qual += shard->sum_qual;     // a sum of integers, so exact in any order
+    stats->error_number += shard->error_number;
+
+    for (tag = 0; tag < shard->ntags; tag++)
+    {
+        barcode_info_t *bc_from = &shard->tags_barcode[tag], *bc_to = &stats->tags_barcode[tag];
+        uint32_t nbases = bc_from->nbases;
+        if ( !nbases ) continue;
+
+        if ( !bc_to->nbases )
+            add_barcode_tag(stats, tag, nbases);
+        if ( nbases > bc_to->nbases )
+            nbases = bc_to->nbases;
+
+        add_acgtno_counts(stats->acgtno_barcode + bc_to->offset, shard->acgtno_barcode + bc_from->offset, nbases);
+        add_counts(stats->quals_barcode + (size_t)bc_to->offset*stats->nquals,
+                   shard->quals_barcode + (size_t)bc_from->offset*shard->nquals, (size_t)nbases*stats->nquals);
+        if ( bc_to->tag_sep < 0 ) bc_to->tag_sep = bc_from->tag_sep;
+        if ( bc_to->max_qual < bc_from->max_qual ) bc_to->max_qual = bc_from->max_qual;
+    }
+}
+
+// One shard of the stats per worker thread.  No more jobs run at once
+// than there are threads, so a job always finds a free shard
+typedef struct
+{
+    stats_t **shard;
+    int *free, nfree;
+    pthread_mutex_t lock;
+}
+stats_shards_t;
+
+typedef struct
+{
+    stats_shards_t *shards;
+    bam1_t *b[STATS_BATCH_SIZE];
+    int read_len[STATS_BATCH_SIZE];     // 0 if not wanted by collect_pos_stats()
+    int gc_count[STATS_BATCH_SIZE];
+    int n;
+}
+stats_batch_t;
+
+static void *collect_batch_stats(void *arg)
+{
+    stats_batch_t *bt = (stats_batch_t *)arg;
+    stats_shards_t *sh = bt->shards;
+    int i, s;
+
+    pthread_mutex_lock(&sh->lock);
+    assert(sh->nfree > 0);
+    s = sh->free[--sh->nfree];
+    pthread_mutex_unlock(&sh->lock);
+
+    for (i=0; i<bt->n; i++)
+        bt->read_len[i] = collect_read_stats(bt->b[i], sh->shard[s], &bt->gc_count[i]);
+
+    pthread_mutex_lock(&sh->lock);
+    sh->free[sh->nfree++] = s;
+    pthread_mutex_unlock(&sh->lock);
+    return bt;
+}
+
+// Stream the whole file sharing the per-read stats out between the threads.
+// Each worker takes a shard of the stats of its own for the batch of reads
+// it is given, so no two workers ever update the same counters.  The
+// coverage and GC-depth stats need the reads in order and are collected
+// here as the batches come back.  The shards are merged into stats at the
+// end.  Returns as sam_read1()
+static int collect_stats_threaded(stats_t *stats, khash_t(qn2pair) *read_pairs, hts_tpool *pool, const char *group_id)
+{
+    stats_info_t *info = stats->info;
+    int nthreads = hts_tpool_size(pool), nbatch = 2 * nthreads;
+    int next = 0, in_flight = 0, ret = 0, i, j;
+    stats_batch_t *batch = calloc(nbatch, sizeof(stats_batch_t));
+    stats_shards_t shards;
+    hts_tpool_process *q;
+
+    shards.shard = calloc(nthreads, sizeof(*shards.shard));
+    shards.free = malloc(nthreads * sizeof(*shards.free));
+    if ( !batch || !shards.shard || !shards.free ) error("Out of memory\n");
+    if ( pthread_mutex_init(&shards.lock, NULL) != 0 ) error("Could not initialise a mutex\n");
+    for (i=0; i<nthreads; i++)
+    {
+        if ( !(shards.shard[i] = stats_init()) ) error("Out of memory\n");
+        init_stat_structs(shards.shard[i], info, group_id, NULL);
+        shards.free[i] = i;
+    }
+    shards.nfree = nthreads;
+    for (i=0; i<nbatch; i++)
+    {
+        batch[i].shards = &shards;
+        for (j=0; j<STATS_BATCH_SIZE; j++)
+            if ( !(batch[i].b[j] = bam_init1()) ) error("Out of memory\n");
+    }
+
+    // the ring of batches is no larger than the queue, so dispatching
+    // never waits on results we have yet to collect
+    if ( !(q = hts_tpool_process_init(pool, nbatch, 0)) )
+        error("Could not create a thread pool queue\n");
+    sam_prof_queue("stats.collect", q);
+
+    while ( 1 )
+    {
+        while ( ret >= 0 && in_flight < nbatch )
+        {
+            stats_batch_t *bt = &batch[next];
+            for (bt->n=0; bt->n<STATS_BATCH_SIZE; bt->n++)
+                if ( (ret = sam_read1(info->sam, info->sam_header, bt->b[bt->n])) < 0 ) break;
+            if ( !bt->n ) break;
+            if ( hts_tpool_dispatch(pool, q, collect_batch_stats, bt) < 0 )
+                error("Could not pass the reads to the thread pool\n");
+            next = (next+1) % nbatch;
+            in_flight++;
+        }
+        if ( !in_flight ) break;
+
+        hts_tpool_result *res = hts_tpool_next_result_wait(q);
+        if ( !res ) error("Could not get the results from the thread pool\n");
+        stats_batch_t *bt = (stats_batch_t *)hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+
+        for (i=0; i<bt->n; i++)
+            if ( bt->read_len[i] )
+                collect_pos_stats(bt->b[i], stats, read_pairs, bt->read_len[i], bt->gc_count[i]);
+        in_flight--;
+    }
+    sam_prof_queue_done(q);
+    hts_tpool_process_destroy(q);
+
+    // merging can grow the buffers, so do not leave coverage in them
+    round_buffer_flush(stats, -1);
+    for (i=0; i<nthreads; i++)
+    {
+        merge_stats(stats, shards.shard[i]);
+        cleanup_stats(shards.shard[i]);
+    }
+    for (i=0; i<nbatch; i++)
+        for (j=0; j<STATS_BATCH_SIZE; j++)
+            bam_destroy1(batch[i].b[j]);
+    pthread_mutex_destroy(&shards.lock);
+    free(shards.shard);
+    free(shards.free);
+    free(batch);
+
+    return ret;
+}
+
 int main_stats(int argc, char *argv[])
 {
     char *targets = NULL;
@@ -2409,6 +2782,7 @@ int main_stats(int argc, char *argv[])
     char *group_id = NULL;
     int sparse = 0, has_index_file = 0, ret = 1;
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
+    htsThreadPool p = {NULL, 0};
 
     stats_info_t *info = stats_info_init(argc, argv);
     if (!info) {
@@ -2418,7 +2792,7 @@ int main_stats(int argc, char *argv[])
 
     static const struct option loptions[] =
     {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '@'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '@', 0, '-'),
         {"help", no_argument, NULL, 'h'},
         {"remove-dups", no_argument, NULL, 'd'},
         {"sam", no_argument, NULL, 's'},
@@ -2512,6 +2886,11 @@ int main_stats(int argc, char *argv[])
         bam_fname = "-";
     }
 
+    if (sam_prof_init(&ga, "stats") < 0) {
+        cleanup_stats_info(info);
+        return 1;
+    }
+
     if (init_stat_info_fname(info, bam_fname, &ga.in)) {
         cleanup_stats_info(info);
         return 1;
@@ -2523,13 +2902,21 @@ int main_stats(int argc, char *argv[])
         return 1;
     }
 
-    if (ga.nthreads > 0)
-        hts_set_threads(info->sam, ga.nthreads);
+    if (ga.nthreads > 0) {
+        // shared between decoding and the per-read stats
+        if (!(p.pool = hts_tpool_init(ga.nthreads))) {
+            fprintf(stderr, "Could not create thread pool.\n");
+            cleanup_stats_info(info);
+            return 1;
+        }
+        hts_set_opt(info->sam, HTS_OPT_THREAD_POOL, &p);
+    }
 
     stats_t *all_stats = stats_init();
     if (!all_stats) {
         fprintf(stderr, "Could not allocate memory for stats.\n");
         cleanup_stats_info(info);
+        if (p.pool) hts_tpool_destroy(p.pool);
         return 1;
     }
     stats_t *curr_stats = NULL;
@@ -2545,6 +2932,8 @@ int main_stats(int argc, char *argv[])
     // Collect statistics
     bam1_t *bam_line = bam_init1();
     if (!bam_line) goto cleanup_read_pairs;
+    int st_records = sam_prof_stage("records"), st_output = sam_prof_stage("output");
+    sam_prof_begin(st_records);
 
     if (optind < argc) {
         // Region:interval arguments in the command line
@@ -2601,12 +2990,16 @@ int main_stats(int argc, char *argv[])
         }
 
         // Stream through the entire BAM ignoring off-target regions if -t is given
-        while ((ret = sam_read1(info->sam, info->sam_header, bam_line)) >= 0) {
-            if (info->split_tag) {
-                curr_stats = get_curr_split_stats(bam_line, split_hash, info, targets);
-                collect_stats(bam_line, curr_stats, read_pairs);
+        if (p.pool && !targets && !info->split_tag) {
+            ret = collect_stats_threaded(all_stats, read_pairs, p.pool, group_id);
+        } else {
+            while ((ret = sam_read1(info->sam, info->sam_header, bam_line)) >= 0) {
+                if (info->split_tag) {
+                    curr_stats = get_curr_split_stats(bam_line, split_hash, info, targets);
+                    collect_stats(bam_line, curr_stats, read_pairs);
+                }
+                collect_stats(bam_line, all_stats, read_pairs);
             }
-            collect_stats(bam_line, all_stats, read_pairs);
         }
 
         if (ret < -1) {
@@ -2616,9 +3009,16 @@ int main_stats(int argc, char *argv[])
     }
 
     round_buffer_flush(all_stats, -1);
+    sam_prof_end(st_records);
+    sam_prof_begin(st_output);
     output_stats(stdout, all_stats, sparse);
     if (info->split_tag)
         output_split_stats(split_hash, bam_fname, sparse);
+    sam_prof_end(st_output);
+    sam_prof_add("raw_total_sequences", all_stats->nreads_filtered
+                 + all_stats->nreads_1st + all_stats->nreads_2nd
+                 + all_stats->nreads_other);
+    sam_prof_file("bytes_in", info->sam);
 
     ret = 0;
 cleanup:
@@ -2633,6 +3033,7 @@ cleanup_split_hash:
 cleanup_all_stats:
     cleanup_stats(all_stats);
     cleanup_stats_info(info);
+    if (p.pool) hts_tpool_destroy(p.pool);
 
     return ret;
 }
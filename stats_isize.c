@@ -1,6 +1,6 @@
 /*  stats_isize.c -- generalised insert size calculation for samtools stats.
 
-    Copyright (C) 2014, 2018 Genome Research Ltd.
+    Copyright (C) 2014, 2018, 2026 Genome Research Ltd.
 
     Author: Nicholas Clarke <nc6@sanger.ac.uk>
 
@@ -157,26 +157,139 @@ static int dense_nitems(isize_data_t data) {
     return a->total;
 }
 
-// Construct a relevant isize_t given the bound.
-isize_t *init_isize_t(int bound) {
-    if (bound <= 0) {
-        // Use sparse data structure.
-        isize_sparse_data_t *data = (isize_sparse_data_t *) malloc(sizeof(isize_sparse_data_t));
-        if (!data)
-            return NULL;
+static isize_sparse_data_t *sparse_data_init(void) {
+    isize_sparse_data_t *data = (isize_sparse_data_t *) malloc(sizeof(isize_sparse_data_t));
+    if (!data)
+        return NULL;
 
-        // Initialise
-        data->max = 0;
-        data->array = kh_init(m32);
-        if (!data->array) {
-            free(data);
-            return NULL;
+    data->max = 0;
+    data->array = kh_init(m32);
+    if (!data->array) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+static isize_dense_data_t *dense_data_init(int bound) {
+    uint64_t* in = calloc(bound,sizeof(uint64_t));
+    uint64_t* out = calloc(bound,sizeof(uint64_t));
+    uint64_t* other = calloc(bound,sizeof(uint64_t));
+    isize_dense_data_t *rec = (isize_dense_data_t *)malloc(sizeof(isize_dense_data_t));
+    if (!in || !out || !other || !rec) {
+        free(in);
+        free(out);
+        free(other);
+        free(rec);
+        return NULL;
+    }
+    rec->isize_inward = in;
+    rec->isize_outward = out;
+    rec->isize_other = other;
+    rec->total=bound;
+    return rec;
+}
+
+static isize_data_t as_sparse(isize_adaptive_data_t *a) { isize_data_t d; d.sparse = a->sparse; return d; }
+static isize_data_t as_dense(isize_adaptive_data_t *a) { isize_data_t d; d.dense = a->dense; return d; }
+
+// Once a quarter of the sizes have been seen the dense arrays take little
+// more memory than the hash, and are much quicker to update.  If they
+// can't be allocated, carry on with the hash.
+static void adaptive_promote(isize_adaptive_data_t *a) {
+    isize_sparse_data_t *s = a->sparse;
+    isize_dense_data_t *d;
+    khint_t k;
+
+    if (kh_size(s->array) < (khint_t) a->bound / 4 || s->max >= a->bound)
+        return;
+    if (!(d = dense_data_init(a->bound)))
+        return;
+    for (k = 0; k < kh_end(s->array); ++k) {
+        if (!kh_exist(s->array, k)) continue;
+        isize_sparse_record_t *rec = kh_val(s->array, k);
+        int at = kh_key(s->array, k);
+        d->isize_inward[at] = rec->isize_inward;
+        d->isize_outward[at] = rec->isize_outward;
+        d->isize_other[at] = rec->isize_other;
+    }
+    sparse_isize_free(as_sparse(a));
+    a->sparse = NULL;
+    a->dense = d;
+}
+
+static uint64_t adaptive_in_f(isize_data_t data, int at) {
+    isize_adaptive_data_t *a = data.adaptive;
+    return a->dense ? dense_in_f(as_dense(a), at) : sparse_in_f(as_sparse(a), at);
+}
+static uint64_t adaptive_out_f(isize_data_t data, int at) {
+    isize_adaptive_data_t *a = data.adaptive;
+    return a->dense ? dense_out_f(as_dense(a), at) : sparse_out_f(as_sparse(a), at);
+}
+static uint64_t adaptive_other_f(isize_data_t data, int at) {
+    isize_adaptive_data_t *a = data.adaptive;
+    return a->dense ? dense_other_f(as_dense(a), at) : sparse_other_f(as_sparse(a), at);
+}
+
+static void adaptive_set_f(isize_data_t data, int at, isize_insert_t field, uint64_t value) {
+    isize_adaptive_data_t *a = data.adaptive;
+    if (a->dense) {
+        if (field == IN) {
+            dense_set_in_f(as_dense(a), at, value);
+        } else if (field == OUT) {
+            dense_set_out_f(as_dense(a), at, value);
+        } else {
+            dense_set_other_f(as_dense(a), at, value);
         }
+    } else {
+        sparse_set_f(as_sparse(a), at, field, value);
+        adaptive_promote(a);
+    }
+}
 
-        isize_t *isize = (isize_t *)malloc(sizeof(isize_t));
-        if (!isize) {
-            kh_destroy(m32, data->array);
-            free(data);
+static void adaptive_set_in_f(isize_data_t data, int at, uint64_t value) { adaptive_set_f(data, at, IN, value); }
+static void adaptive_set_out_f(isize_data_t data, int at, uint64_t value) { adaptive_set_f(data, at, OUT, value); }
+static void adaptive_set_other_f(isize_data_t data, int at, uint64_t value) { adaptive_set_f(data, at, OTHER, value); }
+
+static void adaptive_inc_in_f(isize_data_t data, int at) {
+    if (data.adaptive->dense) dense_inc_in_f(as_dense(data.adaptive), at);
+    else adaptive_set_f(data, at, IN, sparse_in_f(as_sparse(data.adaptive), at) + 1);
+}
+static void adaptive_inc_out_f(isize_data_t data, int at) {
+    if (data.adaptive->dense) dense_inc_out_f(as_dense(data.adaptive), at);
+    else adaptive_set_f(data, at, OUT, sparse_out_f(as_sparse(data.adaptive), at) + 1);
+}
+static void adaptive_inc_other_f(isize_data_t data, int at) {
+    if (data.adaptive->dense) dense_inc_other_f(as_dense(data.adaptive), at);
+    else adaptive_set_f(data, at, OTHER, sparse_other_f(as_sparse(data.adaptive), at) + 1);
+}
+
+static void adaptive_isize_free(isize_data_t data) {
+    isize_adaptive_data_t *a = data.adaptive;
+    if (a->dense) dense_isize_free(as_dense(a));
+    if (a->sparse) sparse_isize_free(as_sparse(a));
+    free(a);
+}
+
+static int adaptive_nitems(isize_data_t data) {
+    isize_adaptive_data_t *a = data.adaptive;
+    return a->dense ? dense_nitems(as_dense(a)) : sparse_nitems(as_sparse(a));
+}
+
+// Construct a relevant isize_t given the bound.  With no bound the sizes
+// are kept in a hash.  With one, they start in a hash and move to arrays
+// once there are enough of them, so the many small sets of stats made by
+// --split don't each take arrays of the full bound.
+isize_t *init_isize_t(int bound) {
+    isize_t *isize = (isize_t *)malloc(sizeof(isize_t));
+    if (!isize)
+        return NULL;
+
+    if (bound <= 0) {
+        // Use sparse data structure.
+        isize_sparse_data_t *data = sparse_data_init();
+        if (!data) {
+            free(isize);
             return NULL;
         }
 
@@ -199,40 +312,31 @@ isize_t *init_isize_t(int bound) {
 
         return isize;
     } else {
-        uint64_t* in = calloc(bound,sizeof(uint64_t));
-        uint64_t* out = calloc(bound,sizeof(uint64_t));
-        uint64_t* other = calloc(bound,sizeof(uint64_t));
-        isize_dense_data_t *rec = (isize_dense_data_t *)malloc(sizeof(isize_dense_data_t));
-        isize_t *isize = (isize_t *)malloc(sizeof(isize_t));
-        if (!in || !out || !other || !rec || !isize) {
-            free(in);
-            free(out);
-            free(other);
-            free(rec);
+        isize_adaptive_data_t *data = (isize_adaptive_data_t *) malloc(sizeof(isize_adaptive_data_t));
+        if (!data || !(data->sparse = sparse_data_init())) {
+            free(data);
             free(isize);
             return NULL;
         }
-        rec->isize_inward = in;
-        rec->isize_outward = out;
-        rec->isize_other = other;
-        rec->total=bound;
+        data->bound = bound;
+        data->dense = NULL;
 
-        isize->data.dense = rec;
-        isize->nitems = & dense_nitems;
+        isize->data.adaptive = data;
+        isize->nitems = & adaptive_nitems;
 
-        isize->inward = & dense_in_f;
-        isize->outward = & dense_out_f;
-        isize->other = & dense_other_f;
+        isize->inward = & adaptive_in_f;
+        isize->outward = & adaptive_out_f;
+        isize->other = & adaptive_other_f;
 
-        isize->set_inward = & dense_set_in_f;
-        isize->set_outward = & dense_set_out_f;
-        isize->set_other = & dense_set_other_f;
+        isize->set_inward = & adaptive_set_in_f;
+        isize->set_outward = & adaptive_set_out_f;
+        isize->set_other = & adaptive_set_other_f;
 
-        isize->inc_inward = & dense_inc_in_f;
-        isize->inc_outward = & dense_inc_out_f;
-        isize->inc_other = & dense_inc_other_f;
+        isize->inc_inward = & adaptive_inc_in_f;
+        isize->inc_outward = & adaptive_inc_out_f;
+        isize->inc_other = & adaptive_inc_other_f;
 
-        isize->isize_free = & dense_isize_free;
+        isize->isize_free = & adaptive_isize_free;
 
         return isize;
     }
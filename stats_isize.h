@@ -47,9 +47,19 @@ typedef struct
 }
 isize_sparse_data_t;
 
+// Starts sparse and is converted to dense once enough sizes are seen
+typedef struct
+{
+    int bound;
+    isize_sparse_data_t *sparse;
+    isize_dense_data_t *dense;
+}
+isize_adaptive_data_t;
+
 typedef union {
     isize_sparse_data_t *sparse;
     isize_dense_data_t *dense;
+    isize_adaptive_data_t *adaptive;
 } isize_data_t;
 
 // Insert size structure
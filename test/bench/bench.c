@@ -0,0 +1,179 @@
+/*  test/bench/bench.c -- benchmark harness utility routines.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <htslib/sam.h>
+#include <htslib/kstring.h>
+
+#include "bench.h"
+
+#define BENCH_READ_LEN 100
+#define BENCH_MAX_READ_LEN 1000
+#define BENCH_QUAL 30
+
+volatile int64_t bench_sink;
+
+void bench_parse_args(int argc, char **argv, bench_opts_t *opts, int64_t def_n)
+{
+    int c;
+
+    opts->n = def_n;
+    opts->seed = 1;
+    opts->read_len = BENCH_READ_LEN;
+    opts->n_ref = 4;
+    opts->ref_len = 50000000;
+
+    while ((c = getopt(argc, argv, "n:s:l:")) >= 0) {
+        switch (c) {
+        case 'n': opts->n = strtoll(optarg, NULL, 0); break;
+        case 's': opts->seed = strtoull(optarg, NULL, 0); break;
+        case 'l': opts->read_len = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n COUNT] [-s SEED] [-l READ_LEN]\n",
+                    argv[0]);
+            exit(2);
+        }
+    }
+    if (opts->n < 1 || opts->read_len < 1
+        || opts->read_len > BENCH_MAX_READ_LEN) {
+        fprintf(stderr, "%s: invalid option value\n", argv[0]);
+        exit(2);
+    }
+}
+
+double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void bench_report(const char *name, int64_t n, double seconds)
+{
+    printf("{\"bench\": \"%s\", \"n\": %"PRId64", \"seconds\": %.6f, "
+           "\"per_second\": %.0f}\n", name, n, seconds,
+           seconds > 0 ? n / seconds : 0.0);
+    fflush(stdout);
+}
+
+uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+sam_hdr_t *bench_header(const bench_opts_t *opts)
+{
+    kstring_t ks = KS_INITIALIZE;
+    sam_hdr_t *h = NULL;
+    int i;
+
+    if (ksprintf(&ks, "@HD\tVN:1.6\tSO:unsorted\n") < 0)
+        goto out;
+    for (i = 0; i < opts->n_ref; i++)
+        if (ksprintf(&ks, "@SQ\tSN:chr%d\tLN:%"PRId64"\n",
+                     i + 1, (int64_t) opts->ref_len) < 0)
+            goto out;
+    if (ksprintf(&ks, "@RG\tID:bench\tSM:bench\tLB:bench\n") < 0)
+        goto out;
+    h = sam_hdr_parse(ks.l, ks.s);
+
+ out:
+    ks_free(&ks);
+    return h;
+}
+
+void bench_gen_init(bench_gen_t *g, const bench_opts_t *opts)
+{
+    memset(g, 0, sizeof(*g));
+    g->opts = opts;
+    g->state = opts->seed;
+    g->tid = -1;
+}
+
+static int bench_set_read(bam1_t *b, bench_gen_t *g, const char *name,
+                          uint16_t flag, int32_t tid, hts_pos_t pos,
+                          hts_pos_t mpos, hts_pos_t isize)
+{
+    char seq[BENCH_MAX_READ_LEN];
+    char qual[BENCH_MAX_READ_LEN];
+    char mc[16];
+    int len = g->opts->read_len, i;
+    uint32_t cigar = bam_cigar_gen(len, BAM_CMATCH);
+    int32_t ms = BENCH_QUAL * len;
+
+    for (i = 0; i < len; i++) {
+        seq[i] = "ACGT"[bench_rand(&g->state) & 3];
+        qual[i] = BENCH_QUAL;
+    }
+    if (bam_set1(b, strlen(name), name, flag, tid, pos, 60, 1, &cigar,
+                 tid, mpos, isize, len, seq, qual, 32) < 0)
+        return -1;
+
+    snprintf(mc, sizeof(mc), "%dM", len);
+    if (bam_aux_append(b, "RG", 'Z', 6, (const uint8_t *) "bench") < 0
+        || bam_aux_append(b, "MC", 'Z', strlen(mc) + 1,
+                          (const uint8_t *) mc) < 0
+        || bam_aux_update_int(b, "ms", ms) < 0)
+        return -1;
+    return 0;
+}
+
+int bench_pair(bench_gen_t *g, int64_t idx, double dup_frac,
+               bam1_t *r1, bam1_t *r2)
+{
+    const bench_opts_t *opts = g->opts;
+    char name[64];
+    int len = opts->read_len;
+    hts_pos_t isize;
+    double draw = (bench_rand(&g->state) >> 11) * (1.0 / 9007199254740992.0);
+
+    if (g->tid < 0 || draw >= dup_frac) {
+        hts_pos_t span = opts->ref_len - 2 * len - 1000;
+        g->tid = bench_rand(&g->state) % opts->n_ref;
+        g->pos = bench_rand(&g->state) % (span > 0 ? span : 1);
+        g->mpos = g->pos + len + bench_rand(&g->state) % 500;
+    }
+    isize = g->mpos + len - g->pos;
+
+    // Ends with x:y coordinates, as optical duplicate checks expect
+    snprintf(name, sizeof(name), "bench:1:%"PRId64":%"PRId64,
+             idx % 10000, idx / 10000);
+    if (bench_set_read(r1, g, name,
+                       BAM_FPAIRED|BAM_FPROPER_PAIR|BAM_FMREVERSE|BAM_FREAD1,
+                       g->tid, g->pos, g->mpos, isize) < 0)
+        return -1;
+    if (bench_set_read(r2, g, name,
+                       BAM_FPAIRED|BAM_FPROPER_PAIR|BAM_FREVERSE|BAM_FREAD2,
+                       g->tid, g->mpos, g->pos, -isize) < 0)
+        return -1;
+    return 0;
+}
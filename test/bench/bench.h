@@ -0,0 +1,84 @@
+/*  test/bench/bench.h -- benchmark harness utility routines.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <htslib/sam.h>
+
+/*
+ * Every benchmark program takes the same options, "-n INT" for the number
+ * of records or items and "-s INT" for the random seed, so that a run can
+ * be repeated exactly.  Results are printed one JSON object per line:
+ *
+ *   {"bench": "sort.mergesort.coordinate", "n": 1000000,
+ *    "seconds": 0.412, "per_second": 2427184}
+ */
+
+typedef struct {
+    int64_t n;
+    uint64_t seed;
+    int read_len;
+    int n_ref;
+    hts_pos_t ref_len;
+} bench_opts_t;
+
+/// Parses the common options, with def_n as the default count.  Exits on error.
+void bench_parse_args(int argc, char **argv, bench_opts_t *opts, int64_t def_n);
+
+/// Results are stored here so the work producing them is not optimised out
+extern volatile int64_t bench_sink;
+
+/// Monotonic time in seconds
+double bench_now(void);
+
+/// Prints a result line for n items handled in the given time
+void bench_report(const char *name, int64_t n, double seconds);
+
+/// The next number from a seeded generator (splitmix64)
+uint64_t bench_rand(uint64_t *state);
+
+/// A header with opts->n_ref references of opts->ref_len bases
+sam_hdr_t *bench_header(const bench_opts_t *opts);
+
+typedef struct {
+    const bench_opts_t *opts;
+    uint64_t state;
+    int32_t tid;            // position of the last pair, for duplicates
+    hts_pos_t pos, mpos;
+} bench_gen_t;
+
+/// Starts a generator of read pairs, seeded from opts
+void bench_gen_init(bench_gen_t *g, const bench_opts_t *opts);
+
+/*
+ * Fills r1 and r2 with a proper pair named after idx, at a random place
+ * with random sequences, carrying the MC and ms tags that fixmate -m adds.
+ * With probability dup_frac the pair is put where the last one was,
+ * making a duplicate.
+ * Returns 0 on success, -1 on failure.
+ */
+int bench_pair(bench_gen_t *g, int64_t idx, double dup_frac,
+               bam1_t *r1, bam1_t *r2);
+
+#endif
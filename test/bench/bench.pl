@@ -0,0 +1,205 @@
+#!/usr/bin/env perl
+#
+#    Copyright (C) 2026 Genome Research Ltd.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+# THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+# DEALINGS IN THE SOFTWARE.
+
+# Runs the benchmark programs in this directory, then times samtools
+# commands end to end on generated data.  Every result is written as one
+# line of JSON, so runs from different releases can be compared.
+
+use strict;
+use warnings;
+use Carp;
+use Cwd qw/ abs_path /;
+use FindBin;
+use Getopt::Long;
+use File::Temp;
+use File::Spec;
+use POSIX qw(strftime);
+use Time::HiRes qw(time);
+
+my $opts = parse_params();
+
+my $out = \*STDOUT;
+if ($$opts{out}) {
+    open($out, '>', $$opts{out}) or error("$$opts{out}: $!");
+}
+$out->autoflush(1);
+
+print $out json_line(bench => 'meta',
+                     version => samtools_version($opts),
+                     date => strftime("%Y-%m-%dT%H:%M:%SZ", gmtime()),
+                     host => (POSIX::uname())[1],
+                     seed => \$$opts{seed},
+                     pairs => \$$opts{pairs},
+                     threads => \"[$$opts{threads}]");
+
+run_micro($opts, $out, $_) for qw(sort markdup bedidx tmp_file pileup);
+run_end_to_end($opts, $out);
+
+close($out) or error("$$opts{out}: $!") if $$opts{out};
+exit 0;
+
+#--------------------
+
+sub error
+{
+    my (@msg) = @_;
+    if (scalar @msg) { confess @msg; }
+    print
+        "About: Benchmarks for samtools.  Results are written as JSON lines.\n",
+        "Usage: bench.pl [OPTIONS]\n",
+        "Options:\n",
+        "   -b, --bin DIR           Where the benchmark programs are [$FindBin::Bin]\n",
+        "   -e, --exec PATH         The samtools to time [./samtools]\n",
+        "   -n, --records INT       Items per microbenchmark [program default]\n",
+        "   -p, --pairs INT         Read pairs for the end-to-end runs [1000000]\n",
+        "   -s, --seed INT          Random seed [1]\n",
+        "   -t, --threads LIST      Comma separated -@ values for end-to-end runs [0,4]\n",
+        "   -o, --out FILE          Write the results to FILE [stdout]\n",
+        "   -k, --keep-files        Keep the generated data\n",
+        "   -h, -?, --help          This help message\n",
+        "\n";
+    exit 1;
+}
+
+sub parse_params
+{
+    my $opts = { bin => $FindBin::Bin, exec => './samtools', pairs => 1000000,
+                 seed => 1, threads => '0,4' };
+    Getopt::Long::Configure('bundling');
+    my $ret = GetOptions(
+            'b|bin=s' => \$$opts{bin},
+            'e|exec=s' => \$$opts{exec},
+            'n|records=i' => \$$opts{records},
+            'p|pairs=i' => \$$opts{pairs},
+            's|seed=i' => \$$opts{seed},
+            't|threads=s' => \$$opts{threads},
+            'o|out=s' => \$$opts{out},
+            'k|keep-files' => \$$opts{keep_files},
+            'h|?|help' => \$$opts{help}
+            );
+    if ( !$ret or $$opts{help} ) { error(); }
+    if ( $$opts{threads} !~ /^\d+(,\d+)*$/ ) { error("Bad --threads list\n"); }
+    # The microbenchmarks run in the temporary directory
+    $$opts{bin} = abs_path($$opts{bin}) or error("No directory $$opts{bin}\n");
+    $$opts{tmp} = File::Temp->newdir(CLEANUP => $$opts{keep_files} ? 0 : 1);
+    if ( $$opts{keep_files} ) { print STDERR "Keeping data in $$opts{tmp}\n"; }
+    return $opts;
+}
+
+sub json_str
+{
+    my ($s) = @_;
+    $s =~ s/(["\\])/\\$1/g;
+    $s =~ s/([\x00-\x1f])/sprintf("\\u%04x", ord($1))/eg;
+    return "\"$s\"";
+}
+
+# Values are quoted as strings, except those passed by reference, which
+# are numbers, lists or objects already in JSON
+sub json_line
+{
+    my (@kv) = @_;
+    my @fields;
+    while (my ($k, $v) = splice(@kv, 0, 2)) {
+        push @fields, json_str($k) . ': ' . (ref($v) ? $$v : json_str($v));
+    }
+    return '{' . join(', ', @fields) . "}\n";
+}
+
+sub samtools_version
+{
+    my ($opts) = @_;
+    my $version = `$$opts{exec} --version 2>/dev/null`;
+    if ( $? != 0 || !defined $version ) { error("Couldn't run $$opts{exec}\n"); }
+    ($version) = split(/\n/, $version);
+    $version =~ s/^samtools\s+//;
+    return $version;
+}
+
+# The microbenchmarks print their own JSON lines
+sub run_micro
+{
+    my ($opts, $out, $name) = @_;
+    my $cmd = "$$opts{bin}/bench_$name -s $$opts{seed}";
+    if ( defined $$opts{records} ) { $cmd .= " -n $$opts{records}"; }
+    print STDERR "$cmd\n";
+    open(my $fh, '-|', "cd $$opts{tmp} && $cmd")
+        or error("$cmd: $!");
+    while (my $line = <$fh>) {
+        print $out $line;
+    }
+    close($fh) or error("$cmd failed\n");
+}
+
+sub time_cmd
+{
+    my ($opts, $cmd) = @_;
+    print STDERR "$cmd\n";
+    my $start = time();
+    system($cmd) == 0 or error("$cmd failed: $?\n");
+    return time() - $start;
+}
+
+# The --profile output, folded onto one line
+sub read_profile
+{
+    my ($fn) = @_;
+    open(my $fh, '<', $fn) or return '{}';
+    local $/;
+    my $json = <$fh>;
+    close($fh);
+    $json =~ s/\s*\n\s*/ /g;
+    $json =~ s/\s+$//;
+    return $json;
+}
+
+sub run_end_to_end
+{
+    my ($opts, $out) = @_;
+    my $tmp = $$opts{tmp};
+    my $sam = $$opts{exec};
+    my $null = File::Spec->devnull();
+    my $records = 2 * $$opts{pairs};
+
+    time_cmd($opts, "$$opts{bin}/bench_gen -s $$opts{seed} -n $$opts{pairs} $tmp/input.bam");
+
+    for my $t (split(/,/, $$opts{threads})) {
+        my $sorted = "$tmp/sorted.$t.bam";
+        my @runs = (
+            [ 'sort', "$sam sort --profile $tmp/prof.json -@ $t -o $sorted $tmp/input.bam" ],
+            [ 'markdup', "$sam markdup --profile $tmp/prof.json -@ $t $sorted $tmp/markdup.$t.bam" ],
+            [ 'stats', "$sam stats --profile $tmp/prof.json -@ $t $sorted > $null" ],
+            [ 'depth', "$sam depth --profile $tmp/prof.json -@ $t -o $null $sorted" ],
+        );
+        for my $run (@runs) {
+            my ($name, $cmd) = @$run;
+            unlink("$tmp/prof.json");
+            my $secs = time_cmd($opts, $cmd);
+            my $rate = sprintf("%.0f", $secs > 0 ? $records / $secs : 0);
+            print $out json_line(bench => "e2e.$name", threads => \$t,
+                                 n => \$records,
+                                 seconds => \sprintf("%.6f", $secs),
+                                 per_second => \$rate,
+                                 profile => \read_profile("$tmp/prof.json"));
+        }
+    }
+}
@@ -0,0 +1,129 @@
+/*  test/bench/bench_bedidx.c -- benchmark BED region lookups.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "../../bedidx.h"
+#include "bench.h"
+
+// Region length, and the mean gap between regions, as for an exome
+#define BED_REG_LEN 200
+#define BED_REG_GAP 1800
+
+typedef struct {
+    int tid;
+    hts_pos_t beg;
+} query_t;
+
+static int cmp_query(const void *av, const void *bv)
+{
+    const query_t *a = av, *b = bv;
+    if (a->tid != b->tid)
+        return a->tid < b->tid ? -1 : 1;
+    return (a->beg > b->beg) - (a->beg < b->beg);
+}
+
+int main(int argc, char **argv)
+{
+    bench_opts_t opts;
+    uint64_t state;
+    char fn[] = "bench_bedidx.XXXXXX";
+    char chr[32];
+    FILE *fp = NULL;
+    void *bed = NULL;
+    query_t *q = NULL;
+    bed_cursor_t cur = BED_CURSOR_INIT;
+    int64_t i, n_reg = 0, hits = 0;
+    double t;
+    int ret = EXIT_FAILURE, fd, tid, last_tid = -1;
+
+    bench_parse_args(argc, argv, &opts, 5000000);
+    state = opts.seed;
+
+    // One region per couple of kilobases over the whole genome
+    if ((fd = mkstemp(fn)) < 0 || !(fp = fdopen(fd, "w"))) {
+        perror("bench_bedidx");
+        return EXIT_FAILURE;
+    }
+    for (tid = 0; tid < opts.n_ref; tid++) {
+        hts_pos_t pos = 0;
+        for (;;) {
+            pos += bench_rand(&state) % (2 * BED_REG_GAP);
+            if (pos + BED_REG_LEN > opts.ref_len)
+                break;
+            fprintf(fp, "chr%d\t%"PRId64"\t%"PRId64"\n", tid + 1,
+                    (int64_t) pos, (int64_t) pos + BED_REG_LEN);
+            pos += BED_REG_LEN;
+            n_reg++;
+        }
+    }
+    if (fclose(fp) != 0) {
+        perror("bench_bedidx");
+        goto out;
+    }
+
+    t = bench_now();
+    if (!(bed = bed_read(fn)))
+        goto out;
+    bench_report("bedidx.read", n_reg, bench_now() - t);
+
+    if (!(q = malloc(opts.n * sizeof(*q))))
+        goto out;
+    for (i = 0; i < opts.n; i++) {
+        q[i].tid = bench_rand(&state) % opts.n_ref;
+        q[i].beg = bench_rand(&state) % opts.ref_len;
+    }
+
+    t = bench_now();
+    for (i = 0; i < opts.n; i++) {
+        snprintf(chr, sizeof(chr), "chr%d", q[i].tid + 1);
+        hits += bed_overlap(bed, chr, q[i].beg, q[i].beg + 150);
+    }
+    bench_report("bedidx.overlap.random", opts.n, bench_now() - t);
+
+    // The same queries in order, as for a sorted input file
+    qsort(q, opts.n, sizeof(*q), cmp_query);
+    t = bench_now();
+    for (i = 0; i < opts.n; i++) {
+        if (q[i].tid != last_tid) {
+            snprintf(chr, sizeof(chr), "chr%d", q[i].tid + 1);
+            last_tid = q[i].tid;
+        }
+        hits += bed_overlap_sorted(bed, &cur, chr, q[i].beg, q[i].beg + 150);
+    }
+    bench_report("bedidx.overlap_sorted", opts.n, bench_now() - t);
+
+    bench_sink = hits;
+    ret = EXIT_SUCCESS;
+
+ out:
+    free(q);
+    if (bed) bed_destroy(bed);
+    unlink(fn);
+    return ret;
+}
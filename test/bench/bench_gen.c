@@ -0,0 +1,85 @@
+/*  test/bench/bench_gen.c -- write synthetic read pairs for the end-to-end
+    benchmarks.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Writes -n read pairs in random order, as they would come from an aligner
+ * after fixmate -m, with one pair in ten a duplicate of the one before.
+ * The output format is chosen from the file name.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+int main(int argc, char **argv)
+{
+    bench_opts_t opts;
+    bench_gen_t gen;
+    samFile *out = NULL;
+    sam_hdr_t *h = NULL;
+    bam1_t *r1 = bam_init1(), *r2 = bam_init1();
+    char mode[5] = "w";
+    int64_t i;
+    int ret = EXIT_FAILURE;
+
+    bench_parse_args(argc, argv, &opts, 1000000);
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-n PAIRS] [-s SEED] [-l READ_LEN] "
+                "OUT.{sam,bam,cram}\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    bench_gen_init(&gen, &opts);
+
+    if (!r1 || !r2 || !(h = bench_header(&opts)))
+        goto out;
+    if (sam_open_mode(mode + 1, argv[optind], NULL) < 0)
+        strcpy(mode, "wb");
+    if (!(out = sam_open(argv[optind], mode))) {
+        perror(argv[optind]);
+        goto out;
+    }
+    if (sam_hdr_write(out, h) < 0)
+        goto out;
+    for (i = 0; i < opts.n; i++) {
+        if (bench_pair(&gen, i, 0.1, r1, r2) < 0
+            || sam_write1(out, h, r1) < 0 || sam_write1(out, h, r2) < 0)
+            goto out;
+    }
+    ret = EXIT_SUCCESS;
+
+ out:
+    if (out && sam_close(out) < 0)
+        ret = EXIT_FAILURE;
+    if (ret != EXIT_SUCCESS)
+        fprintf(stderr, "%s: failed to write \"%s\"\n", argv[0],
+                optind < argc ? argv[optind] : "");
+    sam_hdr_destroy(h);
+    if (r1) bam_destroy1(r1);
+    if (r2) bam_destroy1(r2);
+    return ret;
+}
@@ -0,0 +1,106 @@
+/*  test/bench/bench_markdup.c -- benchmark the duplicate key hashing of
+    bam_markdup.c.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include "../../bam_markdup.c"
+#include "bench.h"
+
+#define BENCH_BATCH 1024
+
+int main(int argc, char **argv)
+{
+    bench_opts_t opts;
+    bench_gen_t gen;
+    md_param_t param;
+    bam1_t *batch[BENCH_BATCH], *mate = bam_init1();
+    key_data_t *keys = NULL;
+    khash_t(reads) *h = kh_init(reads);
+    read_queue_t dummy;
+    long warnings = 0;
+    int64_t i, j, n, n_dup = 0;
+    khint_t sum = 0;
+    double t;
+    int ret = EXIT_FAILURE, absent;
+
+    memset(batch, 0, sizeof(batch));
+    bench_parse_args(argc, argv, &opts, 2000000);
+    bench_gen_init(&gen, &opts);
+    memset(&param, 0, sizeof(param));
+    memset(&dummy, 0, sizeof(dummy));
+    if (!mate || !h || !(keys = calloc(opts.n, sizeof(*keys))))
+        goto out;
+    for (j = 0; j < BENCH_BATCH; j++)
+        if (!(batch[j] = bam_init1()))
+            goto out;
+
+    // Keys as markdup makes them from the first read of each pair,
+    // generated a batch at a time so only the key making is timed
+    t = 0;
+    for (i = 0; i < opts.n; i += n) {
+        double t0;
+        n = opts.n - i < BENCH_BATCH ? opts.n - i : BENCH_BATCH;
+        for (j = 0; j < n; j++)
+            if (bench_pair(&gen, i + j, 0.2, batch[j], mate) < 0)
+                goto out;
+        t0 = bench_now();
+        for (j = 0; j < n; j++) {
+            if (make_pair_key(&param, &keys[i + j], batch[j], 0,
+                              &warnings) != 0) {
+                fprintf(stderr, "make_pair_key failed\n");
+                goto out;
+            }
+        }
+        t += bench_now() - t0;
+    }
+    bench_report("markdup.pair_key", opts.n, t);
+
+    t = bench_now();
+    for (i = 0; i < opts.n; i++)
+        sum += hash_key(keys[i]);
+    bench_report("markdup.hash_key", opts.n, bench_now() - t);
+
+    // Insertions into the read hash, about a fifth of which find a duplicate
+    t = bench_now();
+    for (i = 0; i < opts.n; i++) {
+        khiter_t k = kh_put(reads, h, keys[i], &absent);
+        if (absent < 0)
+            goto out;
+        if (absent)
+            kh_value(h, k).p = &dummy;
+        else
+            n_dup++;
+    }
+    bench_report("markdup.read_hash", opts.n, bench_now() - t);
+
+    bench_sink = sum + n_dup;
+    ret = EXIT_SUCCESS;
+
+ out:
+    free(keys);
+    if (h) kh_destroy(reads, h);
+    for (j = 0; j < BENCH_BATCH; j++)
+        if (batch[j]) bam_destroy1(batch[j]);
+    if (mate) bam_destroy1(mate);
+    return ret;
+}
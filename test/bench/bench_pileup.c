@@ -0,0 +1,151 @@
+/*  test/bench/bench_pileup.c -- benchmark the pileup used by mpileup,
+    tview and friends.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+// Mean depth of the generated reads
+#define BENCH_DEPTH 30
+
+typedef struct {
+    bam1_t **recs;
+    int64_t n, next, step;
+} reader_t;
+
+static int read_next(void *data, bam1_t *b)
+{
+    reader_t *r = (reader_t *) data;
+    if (r->next >= r->n)
+        return -1;
+    if (!bam_copy1(b, r->recs[r->next]))
+        return -2;
+    r->next += r->step;
+    return 0;
+}
+
+static int cmp_pos(const void *av, const void *bv)
+{
+    const bam1_t *a = *(bam1_t * const *) av, *b = *(bam1_t * const *) bv;
+    if (a->core.tid != b->core.tid)
+        return a->core.tid < b->core.tid ? -1 : 1;
+    return (a->core.pos > b->core.pos) - (a->core.pos < b->core.pos);
+}
+
+// Pileup of one input, visiting every read at every position
+static int bench_plp(bam1_t **recs, int64_t n)
+{
+    reader_t r = { recs, n, 0, 1 };
+    bam_plp_t iter = bam_plp_init(read_next, &r);
+    const bam_pileup1_t *plp;
+    int tid, n_plp;
+    hts_pos_t pos;
+    int64_t n_pos = 0, depth = 0;
+    double t;
+
+    if (!iter)
+        return -1;
+    t = bench_now();
+    while ((plp = bam_plp64_auto(iter, &tid, &pos, &n_plp)) != NULL) {
+        int i;
+        for (i = 0; i < n_plp; i++)
+            depth += plp[i].is_del ? 0 : bam_get_qual(plp[i].b)[plp[i].qpos];
+        n_pos++;
+    }
+    bench_report("pileup.plp", n, bench_now() - t);
+    bench_sink = depth + n_pos;
+    bam_plp_destroy(iter);
+    return n_plp < 0 ? -1 : 0;
+}
+
+// The same reads dealt alternately to two inputs, merged as mpileup does
+static int bench_mplp(bam1_t **recs, int64_t n)
+{
+    int64_t depth = 0;
+    reader_t r[2] = { { recs, n, 0, 2 }, { recs, n, 1, 2 } };
+    void *data[2] = { &r[0], &r[1] };
+    const bam_pileup1_t *plp[2];
+    int n_plp[2], tid, i, j, res;
+    hts_pos_t pos;
+    bam_mplp_t iter;
+    double t;
+
+    if (!(iter = bam_mplp_init(2, read_next, data)))
+        return -1;
+    t = bench_now();
+    while ((res = bam_mplp64_auto(iter, &tid, &pos, n_plp, plp)) > 0) {
+        for (i = 0; i < 2; i++)
+            for (j = 0; j < n_plp[i]; j++)
+                depth += !plp[i][j].is_del;
+    }
+    bench_report("pileup.mplp.2", n, bench_now() - t);
+    bench_sink = depth;
+    bam_mplp_destroy(iter);
+    return res < 0 ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    bench_opts_t opts;
+    bench_gen_t gen;
+    bam1_t **recs = NULL;
+    int64_t i, n;
+    int ret = EXIT_FAILURE;
+
+    bench_parse_args(argc, argv, &opts, 1000000);
+    n = opts.n & ~(int64_t) 1;
+    if (n < 2) n = 2;
+
+    // Shrink the references to give the wanted depth
+    opts.ref_len = n * opts.read_len / (BENCH_DEPTH * opts.n_ref);
+    if (opts.ref_len < 4 * opts.read_len + 1000)
+        opts.ref_len = 4 * opts.read_len + 1000;
+    bench_gen_init(&gen, &opts);
+
+    if (!(recs = calloc(n, sizeof(*recs))))
+        goto out;
+    for (i = 0; i < n; i++)
+        if (!(recs[i] = bam_init1()))
+            goto out;
+    for (i = 0; i < n; i += 2)
+        if (bench_pair(&gen, i / 2, 0.1, recs[i], recs[i+1]) < 0)
+            goto out;
+    qsort(recs, n, sizeof(*recs), cmp_pos);
+
+    if (bench_plp(recs, n) < 0 || bench_mplp(recs, n) < 0)
+        goto out;
+
+    ret = EXIT_SUCCESS;
+
+ out:
+    if (recs) {
+        for (i = 0; i < n; i++)
+            if (recs[i]) bam_destroy1(recs[i]);
+    }
+    free(recs);
+    return ret;
+}
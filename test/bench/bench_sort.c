@@ -0,0 +1,117 @@
+/*  test/bench/bench_sort.c -- benchmark the in-memory sorts of bam_sort.c.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include "../../bam_sort.c"
+#include "bench.h"
+
+typedef int (*sort_fn)(size_t n, bam1_tag *buf, const sam_hdr_t *h);
+
+static int run_mergesort(size_t n, bam1_tag *buf, const sam_hdr_t *h)
+{
+    ks_mergesort(sort, n, buf, 0);
+    return 0;
+}
+
+static int run_radix_coordinate(size_t n, bam1_tag *buf, const sam_hdr_t *h)
+{
+    return radix_sort_coordinate(n, buf, h);
+}
+
+static int run_radix_prefix(size_t n, bam1_tag *buf, const sam_hdr_t *h)
+{
+    return radix_sort_prefix(n, buf);
+}
+
+// Sorts a fresh copy of the unsorted records, so every run does the same work
+static int bench_one(const char *name, SamOrder order, sort_fn fn,
+                     size_t n, const bam1_tag *orig, bam1_tag *buf,
+                     const sam_hdr_t *h)
+{
+    double t;
+
+    g_sam_order = order;
+    memcpy(buf, orig, n * sizeof(*buf));
+    t = bench_now();
+    if (fn(n, buf, h) != 0) {
+        fprintf(stderr, "%s failed\n", name);
+        return -1;
+    }
+    bench_report(name, n, bench_now() - t);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bench_opts_t opts;
+    bench_gen_t gen;
+    sam_hdr_t *h;
+    bam1_t *recs;
+    bam1_tag *orig, *buf;
+    size_t i, n;
+    int ret = EXIT_FAILURE;
+
+    bench_parse_args(argc, argv, &opts, 1000000);
+    n = opts.n & ~(int64_t) 1;
+    if (n < 2) n = 2;
+    if (!(h = bench_header(&opts)))
+        return EXIT_FAILURE;
+    bench_gen_init(&gen, &opts);
+
+    recs = calloc(n, sizeof(*recs));
+    orig = calloc(n, sizeof(*orig));
+    buf = calloc(n, sizeof(*buf));
+    if (!recs || !orig || !buf)
+        goto out;
+    for (i = 0; i < n; i += 2) {
+        if (bench_pair(&gen, i / 2, 0.1, &recs[i], &recs[i+1]) < 0)
+            goto out;
+        orig[i].bam_record = &recs[i];
+        orig[i+1].bam_record = &recs[i+1];
+    }
+
+    if (bench_one("sort.mergesort.coordinate", Coordinate, run_mergesort,
+                  n, orig, buf, h) < 0
+        || bench_one("sort.radix.coordinate", Coordinate,
+                     run_radix_coordinate, n, orig, buf, h) < 0
+        || bench_one("sort.ks_radixsort.coordinate", Coordinate,
+                     ks_radixsort, n, orig, buf, h) < 0
+        || bench_one("sort.mergesort.queryname", QueryName, run_mergesort,
+                     n, orig, buf, h) < 0
+        || bench_one("sort.radix.queryname", QueryName, run_radix_prefix,
+                     n, orig, buf, h) < 0)
+        goto out;
+
+    ret = EXIT_SUCCESS;
+
+ out:
+    if (recs) {
+        for (i = 0; i < n; i++)
+            free(recs[i].data);
+    }
+    free(recs);
+    free(orig);
+    free(buf);
+    sam_hdr_destroy(h);
+    return ret;
+}
@@ -0,0 +1,122 @@
+/*  test/bench/bench_tmp_file.c -- benchmark temporary file throughput.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "../../tmp_file.h"
+#include "bench.h"
+
+#define BENCH_BATCH 1024
+
+// codec < 0 is the default streaming format
+static int bench_codec(const char *label, int codec, const bench_opts_t *opts,
+                       bam1_t **batch, bam1_t *b)
+{
+    char name[64], prefix[] = "bench_tmp_file";
+    tmp_file_t tmp;
+    bench_gen_t gen;
+    int64_t i, j, n, n_read = 0;
+    double t_write = 0, t_read, t0;
+    int ret = -1, r;
+
+    memset(&tmp, 0, sizeof(tmp));
+    bench_gen_init(&gen, opts);
+    if (tmp_file_open_write(&tmp, prefix, 1) < 0)
+        return -1;
+    if (codec >= 0 && tmp_file_set_codec(&tmp, codec) < 0)
+        goto out;
+
+    // Records are made a batch at a time so only the writing is timed
+    for (i = 0; i < opts->n; i += n) {
+        n = opts->n - i < BENCH_BATCH ? opts->n - i : BENCH_BATCH;
+        for (j = 0; j + 1 < n; j += 2)
+            if (bench_pair(&gen, (i + j) / 2, 0.1, batch[j], batch[j+1]) < 0)
+                goto out;
+        if (j < n && bench_pair(&gen, (i + j) / 2, 0.1, batch[j], b) < 0)
+            goto out;
+        t0 = bench_now();
+        for (j = 0; j < n; j++)
+            if (tmp_file_write(&tmp, batch[j]) < 0)
+                goto out;
+        t_write += bench_now() - t0;
+    }
+    t0 = bench_now();
+    if (tmp_file_end_write(&tmp) < 0)
+        goto out;
+    t_write += bench_now() - t0;
+
+    t0 = bench_now();
+    if (tmp_file_begin_read(&tmp) < 0)
+        goto out;
+    while ((r = tmp_file_read(&tmp, b)) > 0)
+        n_read++;
+    t_read = bench_now() - t0;
+    if (r < 0 || n_read != opts->n) {
+        fprintf(stderr, "bench_tmp_file: read back %"PRId64" of %"PRId64
+                " records\n", n_read, opts->n);
+        goto out;
+    }
+
+    snprintf(name, sizeof(name), "tmp_file.%s.write", label);
+    bench_report(name, opts->n, t_write);
+    snprintf(name, sizeof(name), "tmp_file.%s.read", label);
+    bench_report(name, opts->n, t_read);
+    ret = 0;
+
+ out:
+    tmp_file_destroy(&tmp);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    bench_opts_t opts;
+    bam1_t *batch[BENCH_BATCH], *b = bam_init1();
+    int ret = EXIT_FAILURE, i;
+
+    memset(batch, 0, sizeof(batch));
+    bench_parse_args(argc, argv, &opts, 2000000);
+    if (!b)
+        goto out;
+    for (i = 0; i < BENCH_BATCH; i++)
+        if (!(batch[i] = bam_init1()))
+            goto out;
+
+    if (bench_codec("stream", -1, &opts, batch, b) < 0
+        || bench_codec("lz4", TMP_SAM_CODEC_LZ4, &opts, batch, b) < 0
+        || bench_codec("lz4-dict", TMP_SAM_CODEC_LZ4_DICT, &opts, batch, b) < 0
+        || bench_codec("deflate", TMP_SAM_CODEC_DEFLATE, &opts, batch, b) < 0)
+        goto out;
+
+    ret = EXIT_SUCCESS;
+
+ out:
+    for (i = 0; i < BENCH_BATCH; i++)
+        if (batch[i]) bam_destroy1(batch[i]);
+    if (b) bam_destroy1(b);
+    return ret;
+}
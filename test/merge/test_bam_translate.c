@@ -95,6 +95,8 @@ void trans_tbl_test_init(trans_tbl_t* tbl, int32_t n_targets)
     tbl->tid_trans = (int*)calloc(n_targets, sizeof(int32_t));
     tbl->rg_trans = kh_init(c2c);
     tbl->pg_trans = kh_init(c2c);
+    tbl->tid_identity = tbl->tag_identity = false;
+    tbl->last_rg = tbl->last_pg = NULL;
 }
 
 void setup_test_1(bam1_t** b_in, trans_tbl_t* tbl) {
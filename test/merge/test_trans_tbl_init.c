@@ -135,6 +135,7 @@ bool check_test_1(sam_hdr_t* translate, sam_hdr_t* out, trans_tbl_t* tbl) {
 
     // Check output tbl
     if (tbl[0].n_targets != 1 || tbl[0].tid_trans[0] != 0 || tbl[0].lost_coord_sort) return false;
+    if (!tbl[0].tid_identity || !tbl[0].tag_identity) return false;
 
     return true;
 }
@@ -177,6 +178,7 @@ bool check_test_2(sam_hdr_t* translate, sam_hdr_t* out, trans_tbl_t* tbl) {
 
     // Check output tbl
     if (tbl[0].n_targets != 2 || tbl[0].tid_trans[0] != 1 || tbl[0].tid_trans[1] != 0) return false;
+    if (tbl[0].tid_identity) return false;
 
     return true;
 }
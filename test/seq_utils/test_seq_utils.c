@@ -0,0 +1,148 @@
+/*  test/seq_utils/test_seq_utils.c -- sequence and quality kernel tests.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "htslib/sam.h"
+#include "htslib/hts_os.h"
+#include "../../seq_utils.h"
+
+// Each kernel is checked against a plain per-base version, over lengths
+// either side of the SIMD block sizes and at an unaligned start, so both
+// the vector loops and their scalar tails are covered.
+
+#define MAX_LEN 200
+
+// Complements as sort has always made them ('=' to N, Y kept), and the
+// full IUPAC ones
+static const char comp_sort[]  = "NTGKCYSBAWYDMHVN";
+static const char comp_iupac[] = "=TGKCYSBAWRDMHVN";
+
+static int verbose = 0;
+
+static void fill_random(uint8_t *buf, int len) {
+    int i;
+    for (i = 0; i < len; i++)
+        buf[i] = hts_lrand48() & 0xff;
+}
+
+static int check(const char *name, int len, const uint8_t *got,
+                 const uint8_t *want, int n) {
+    if (memcmp(got, want, n) == 0)
+        return 0;
+    fprintf(stderr, "FAIL %s, length %d\n", name, len);
+    return 1;
+}
+
+static int test_unpack(uint8_t *nib, int len) {
+    char got[MAX_LEN], want[MAX_LEN];
+    int i;
+    for (i = 0; i < len; i++)
+        want[i] = seq_nt16_str[bam_seqi(nib, i)];
+    memset(got, 0, sizeof(got));
+    seq_nt16_unpack(got, nib, len);
+    return check("seq_nt16_unpack", len, (uint8_t *) got,
+                 (uint8_t *) want, len);
+}
+
+static int test_revcomp(uint8_t *nib, int len, const char *comp,
+                        void (*fn)(uint8_t *, int), const char *name) {
+    uint8_t got[MAX_LEN/2 + 1], want[MAX_LEN/2 + 1];
+    int i, nbytes = (len + 1) / 2;
+    memcpy(got, nib, nbytes);
+    memcpy(want, nib, nbytes);
+    for (i = 0; i < len; i++) {
+        int base = bam_seqi(nib, len - 1 - i);
+        bam_set_seqi(want, i, seq_nt16_table[(unsigned char) comp[base]]);
+    }
+    fn(got, len);
+    return check(name, len, got, want, nbytes);
+}
+
+static int test_qual(uint8_t *qual, int len) {
+    uint8_t got[MAX_LEN], want[MAX_LEN];
+    char text[MAX_LEN];
+    int i, res = 0;
+
+    memcpy(got, qual, len);
+    for (i = 0; i < len; i++)
+        want[i] = qual[len - 1 - i];
+    qual_reverse(got, len);
+    res |= check("qual_reverse", len, got, want, len);
+
+    for (i = 0; i < len; i++) {
+        got[i] = qual[i] % 94;
+        want[i] = got[i] + 33;
+    }
+    qual_add_offset(text, got, len, 33);
+    res |= check("qual_add_offset", len, (uint8_t *) text, want, len);
+
+    memcpy(got, want, len);
+    for (i = 0; i < len; i++)
+        want[i] -= 33;
+    qual_sub_offset(got, len, 33);
+    res |= check("qual_sub_offset", len, got, want, len);
+    return res;
+}
+
+int main(int argc, char **argv)
+{
+    // One spare byte in front, to start the data unaligned
+    uint8_t nib[MAX_LEN/2 + 2], qual[MAX_LEN + 1];
+    int len, off, failure = 0, getopt_char;
+
+    while ((getopt_char = getopt(argc, argv, "v")) != -1) {
+        switch (getopt_char) {
+            case 'v':
+                ++verbose;
+                break;
+            default:
+                break;
+        }
+    }
+    hts_srand48(0x1234330e);
+
+    for (off = 0; off < 2; off++) {
+        for (len = 0; len <= MAX_LEN; len++) {
+            if (verbose) printf("RUN length %d, offset %d\n", len, off);
+            fill_random(nib + off, (len + 1) / 2);
+            fill_random(qual + off, len);
+            failure += test_unpack(nib + off, len);
+            failure += test_revcomp(nib + off, len, comp_sort,
+                                    seq_nt16_revcomp, "seq_nt16_revcomp");
+            failure += test_revcomp(nib + off, len, comp_iupac,
+                                    seq_nt16_revcomp_iupac,
+                                    "seq_nt16_revcomp_iupac");
+            failure += test_qual(qual + off, len);
+        }
+    }
+
+    if (failure) {
+        fprintf(stderr, "%d failures\n", failure);
+        return 1;
+    }
+    return 0;
+}
@@ -52,6 +52,10 @@ test_bam2fq($opts);
 test_bam2fq($opts, threads=>2);
 test_depad($opts);
 test_stats($opts);
+test_flagstat($opts);
+test_flagstat($opts, threads=>2);
+test_coverage($opts);
+test_coverage($opts, threads=>2);
 test_merge($opts);
 test_merge($opts, threads=>2);
 test_sort($opts);
@@ -69,14 +73,24 @@ test_addrprg($opts);
 test_addrprg($opts, threads=>2);
 test_markdup($opts);
 test_markdup($opts, threads=>2);
+test_rmdup($opts);
+test_rmdup($opts, threads=>2);
+test_pipeline($opts);
+test_pipeline($opts, threads=>2);
 test_bedcov($opts);
 test_split($opts);
 test_split($opts, threads=>2);
 test_large_positions($opts);
+test_depth_binary($opts);
+test_samples($opts);
+test_profile($opts);
+test_profile($opts, threads=>2);
 test_ampliconclip($opts);
 test_ampliconclip($opts, threads=>2);
 test_ampliconstats($opts, threads=>2);
 test_reset($opts);
+test_phase($opts);
+test_tview($opts);
 
 print "\nNumber of tests:\n";
 printf "    total            .. %d\n", $$opts{nok}+$$opts{nfailed}+$$opts{nxfail}+$$opts{nxpass};
@@ -636,6 +650,24 @@ sub test_faidx
     close $fh;
     cmd("$$opts{bin}/samtools faidx $$opts{tmp}/faidx.fa 1 2:5-10 3:20-30 > $$opts{tmp}/output_faidx_base.fa");
     cmd("$$opts{bin}/samtools faidx $$opts{tmp}/faidx.fa -r $$opts{tmp}/region.txt > $$opts{tmp}/output_faidx.fa && $$opts{diff} $$opts{tmp}/output_faidx.fa $$opts{tmp}/output_faidx_base.fa");
+    cmd("$$opts{bin}/samtools faidx --batch ${threads} $$opts{tmp}/faidx.fa -r $$opts{tmp}/region.txt > $$opts{tmp}/output_faidx.fa && $$opts{diff} $$opts{tmp}/output_faidx.fa $$opts{tmp}/output_faidx_base.fa");
+
+    # Enough regions for several batches, in no particular order, with
+    # some missing and truncated ones between them
+    open($fh,'>',"$$opts{tmp}/region_many.txt") or error("$$opts{tmp}/region_many.txt: $!");
+    for (my $i=0; $i<150_000; $i++)
+    {
+        if ($i % 40_000 == 39_999) { print $fh "nosuch:1-10\n"; next; }
+        if ($i % 30_000 == 29_999) { print $fh "2:99990-100100\n"; next; }
+        my $beg = 1 + ($i * 7919) % 99_900;
+        printf $fh "%d:%d-%d\n", 1 + $i % 3, $beg, $beg + $i % 90;
+    }
+    close($fh);
+    foreach my $opt ('', ' -i')
+    {
+        cmd("$$opts{bin}/samtools faidx --continue$opt $$opts{tmp}/faidx.fa -r $$opts{tmp}/region_many.txt > $$opts{tmp}/output_faidx_many_base.fa 2> $$opts{tmp}/output_faidx_many_base.err");
+        cmd("$$opts{bin}/samtools faidx --continue$opt --batch ${threads} $$opts{tmp}/faidx.fa -r $$opts{tmp}/region_many.txt > $$opts{tmp}/output_faidx_many.fa 2> $$opts{tmp}/output_faidx_many.err && $$opts{diff} $$opts{tmp}/output_faidx_many.fa $$opts{tmp}/output_faidx_many_base.fa && $$opts{diff} $$opts{tmp}/output_faidx_many.err $$opts{tmp}/output_faidx_many_base.err");
+    }
 
     # reverse complement test
     my $fseq = 'ATGAAATGTAACCCAAGAGATATACTCTTCAAGGTACTGTAAGCTATTTCTGTGGACACC';
@@ -846,6 +878,7 @@ sub test_dict
     test_cmd($opts,out=>'dat/dict.out',cmd=>"cat $$opts{path}/dat/dict.fa | $$opts{bin}/samtools dict -a hf37d5 -s 'Homo floresiensis' -u ftp://example.com/hf37d5.fa.gz");
     test_cmd($opts,out=>'dat/dict.alias.out',cmd=>"$$opts{bin}/samtools dict -AH < $$opts{path}/dat/dict.alias.fa");
     test_cmd($opts,out=>'dat/dict.alt.out',cmd=>"$$opts{bin}/samtools dict -H -l $$opts{path}/dat/dict.alt < $$opts{path}/dat/dict.alias.fa");
+    test_cmd($opts,out=>'dat/dict.out',cmd=>"$$opts{bin}/samtools dict -\@2 -a hf37d5 -s 'Homo floresiensis' -u ftp://example.com/hf37d5.fa.gz $$opts{tmp}/dict.fa.gz");
 }
 
 sub test_index
@@ -863,6 +896,7 @@ sub test_index
     cmd("$$opts{bin}/samtools index${threads} $$opts{path}/dat/test_input_1_b.bam $$opts{tmp}/test_input_1_b.bam.bai");
     test_cmd($opts,out=>'dat/test_input_1_b.X.expected',cmd=>"$$opts{bin}/samtools view${threads} -X $$opts{path}/dat/test_input_1_b.bam $$opts{tmp}/test_input_1_b.bam.bai ref2");
     test_cmd($opts,out=>'dat/test_input_1_b.X2.expected',cmd=>"$$opts{bin}/samtools view${threads} -X $$opts{path}/dat/test_input_1_b.bam $$opts{tmp}/test_input_1_b.bam.bai");
+    test_cmd($opts,out=>'dat/test_input_1_b.X2.expected',cmd=>"$$opts{bin}/samtools view${threads} --passthrough -b -o $$opts{tmp}/test_input_1_b.pt.bam $$opts{path}/dat/test_input_1_b.bam && $$opts{bin}/samtools view $$opts{tmp}/test_input_1_b.pt.bam");
     test_cmd($opts,out=>'dat/test_input_1_ab.X.expected', ignore_pg_header => 1, cmd=>"$$opts{bin}/samtools merge${threads} -O sam - -X -cp -R ref2 $$opts{path}/dat/test_input_1_a.bam $$opts{path}/dat/test_input_1_b.bam $$opts{path}/dat/test_input_1_a.bam.bai $$opts{tmp}/test_input_1_b.bam.bai");
 
     # Check -o option
@@ -926,7 +960,131 @@ sub test_mpileup
     # test that filter mask replaces (not just adds to) default mask
     test_cmd($opts,out=>'dat/mpileup.out.3',cmd=>"$$opts{bin}/samtools mpileup -B --ff 0x14 -f $$opts{tmp}/mpileup.ref.fa.gz -r17:1050-1060 $$opts{tmp}/mpileup.1.bam | grep -v mpileup");
     test_cmd($opts,out=>'dat/mpileup.out.3',cmd=>"$$opts{bin}/samtools mpileup -B --ff 0x14 -f $$opts{tmp}/mpileup.ref.fa.gz -r17:1050-1060 $$opts{tmp}/mpileup.1.cram | grep -v mpileup");
+    test_cmd($opts,out=>'dat/mpileup.out.1',err=>'dat/mpileup.err.1',cmd=>"$$opts{bin}/samtools mpileup -\@2 -b $$opts{tmp}/mpileup.bam.list -f $$opts{tmp}/mpileup.ref.fa.gz -r17:100-150");
+    test_cmd($opts,out=>'dat/mpileup.out.3',cmd=>"$$opts{bin}/samtools mpileup -\@2 -B --ff 0x14 -f $$opts{tmp}/mpileup.ref.fa.gz -r17:1050-1060 $$opts{tmp}/mpileup.1.cram | grep -v mpileup");
     test_cmd($opts,out=>'dat/mpileup.out.5',cmd=>"$$opts{bin}/samtools mpileup $$opts{path}/mpileup/overlap.bam | grep 128814202");
+
+    # Small chunks, so the threaded output is joined from many of them and
+    # the reads covering each chunk start are fetched from its margin
+    foreach my $opt ("-B", "-r 17:100-2000", "--output-QNAME")
+    {
+        my $serial = "$$opts{tmp}/mpileup.serial.out";
+        cmd("$$opts{bin}/samtools mpileup $opt -b $$opts{tmp}/mpileup.bam.list -f $$opts{tmp}/mpileup.ref.fa.gz > $serial 2>/dev/null");
+        foreach my $size (1000, 97)
+        {
+            test_cmd($opts,out=>'dat/empty.expected',cmd=>"$$opts{bin}/samtools mpileup -\@4 --chunk-size $size $opt -b $$opts{tmp}/mpileup.bam.list -f $$opts{tmp}/mpileup.ref.fa.gz 2>/dev/null | cmp - $serial");
+        }
+    }
+
+    # The --binary counts must agree with the text output, whether written
+    # to a file or to stdout
+    my $in = "-f $$opts{tmp}/mpileup.ref.fa.gz -b $$opts{tmp}/mpileup.bam.list";
+    my $text = mpileup_text_counts(cmd("$$opts{bin}/samtools mpileup --reverse-del $in"));
+    my $bin = "$$opts{tmp}/mpileup.bin";
+    foreach my $test ("$$opts{bin}/samtools mpileup --binary $in -o $bin",
+                      "$$opts{bin}/samtools mpileup --binary $in > $bin",
+                      "$$opts{bin}/samtools mpileup -\@2 --binary $in > $bin") {
+        print "$test\n";
+        cmd($test);
+        my $out = cmd("head -c 2 $bin", {binary=>1});
+        my $counts = $out eq "\x1f\x8b"
+            ? mpileup_binary_counts(cmd("$$opts{bgzip} -dc $bin", {binary=>1}))
+            : undef;
+        if (!defined($counts)) { failed($opts,msg=>$test,reason=>"Expected BGZF-compressed binary output"); }
+        elsif ($counts ne $text) { failed($opts,msg=>$test,reason=>"Counts differ from the text output"); }
+        else { passed($opts,msg=>$test); }
+    }
+}
+
+# Decodes mpileup --binary output into one line per column of the
+# reference name, position, reference base and the counts for each file.
+# Returns undef if the data is not valid.
+sub mpileup_binary_counts
+{
+    my ($data) = @_;
+    my $at = 0;
+    my $get = sub {
+        my ($len, $fmt) = @_;
+        die "truncated\n" if $at + $len > length($data);
+        my $v = substr($data, $at, $len);
+        $at += $len;
+        return defined($fmt) ? unpack($fmt, $v) : $v;
+    };
+    my $out = "";
+    my $ok = eval {
+        die "bad magic\n" unless $get->(4) eq "MPLP" && $get->(1, "C") == 1;
+        my $qual = $get->(1, "C");
+        my $nfiles = $get->(4, "V");
+        for (my $i = 0; $i < $nfiles; $i++) { $get->($get->(4, "V")); }
+        while ((my $ref_len = $get->(4, "V")) > 0) {
+            my $ref = $get->($ref_len);
+            my ($lo, $hi) = $get->(8, "VV");
+            my $pos = $lo + $hi * 2**32;
+            my $n = $get->(4, "V");
+            my @pos;
+            for (my $i = 0; $i < $n; $i++) {
+                my ($delta, $shift, $byte) = (0, 0);
+                do {
+                    $byte = $get->(1, "C");
+                    $delta += ($byte & 0x7f) * 2**$shift;
+                    $shift += 7;
+                } while ($byte & 0x80);
+                $pos += $delta;
+                push @pos, $pos;
+            }
+            my @base = split(//, $get->($n));
+            my @cnt;
+            for (my $i = 0; $i < $nfiles * 16; $i++) { push @cnt, [$get->(4 * $n, "V$n")]; }
+            $get->(4 * $n * $nfiles * 12) if $qual;
+            for (my $i = 0; $i < $n; $i++) {
+                $out .= "$ref\t" . ($pos[$i] + 1) . "\t$base[$i]";
+                for (my $f = 0; $f < $nfiles; $f++) {
+                    $out .= "\t" . join(",", map { $cnt[$f * 16 + $_][$i] } 0..15);
+                }
+                $out .= "\n";
+            }
+        }
+        die "trailing data\n" if $at != length($data);
+        1;
+    };
+    return $ok ? $out : undef;
+}
+
+# Counts the bases of mpileup --reverse-del text output in the layout of
+# mpileup_binary_counts().  Reference skips are not counted.
+sub mpileup_text_counts
+{
+    my ($text) = @_;
+    my %idx = (A=>0, C=>1, G=>2, T=>3);
+    my $out = "";
+    foreach my $line (split(/\n/, $text)) {
+        my ($ref, $pos, $ref_base, @files) = split(/\t/, $line);
+        my $ref_idx = $idx{uc($ref_base)} // 4;
+        $out .= "$ref\t$pos\t$ref_base";
+        for (my $f = 0; $f < @files; $f += 3) {
+            my @c = (0) x 16;
+            my $rev = 0;
+            my $bases = $files[$f] ? $files[$f + 1] : "";
+            while ($bases =~ /\G(?:\^.|\$|([+-])(\d+)|(.))/gs) {
+                if (defined($1)) {
+                    $c[($1 eq "+" ? 12 : 14) + $rev]++;
+                    pos($bases) += $2;
+                    next;
+                }
+                next unless defined($3);
+                my $b = $3;
+                next if $b eq "<" || $b eq ">";
+                $rev = ($b =~ /[a-z,#]/) ? 1 : 0;
+                my $a = $b eq "." || $b eq "," ? $ref_idx
+                    : $b eq "*" || $b eq "#" ? 5
+                    : $idx{uc($b)} // 4;
+                $c[$a + 6 * $rev]++;
+            }
+            $out .= "\t" . join(",", @c);
+        }
+        $out .= "\n";
+    }
+    return $out;
 }
 
 sub test_usage
@@ -1910,6 +2068,32 @@ sub gen_file
     return ($sam, $rnum * 2);
 }
 
+# Make a SAM file of reads up to several BGZF blocks long, with shorter
+# ones between them, so records both fill blocks and span them.
+
+sub gen_long_reads
+{
+    my ($opts, $sam) = @_;
+
+    open(my $s, '>', $sam) || die "Couldn't open $sam for writing : $!\n";
+    binmode($s);
+    print $s "\@HD\tVN:1.4\tSO:coordinate\n";
+    print $s "\@SQ\tSN:ref1\tLN:1000000\n";
+    srand(15);
+    my $pos = 1;
+    foreach my $read ([200000, 60], [150000, 60], [100, 0], [100, 60],
+                      [30000, 60], [30000, 60], [30000, 0], [70000, 60],
+                      [100, 60], [250000, 0], [80000, 60], [30000, 60],
+                      [120000, 60], [130000, 60], [100, 60]) {
+        my ($len, $mapq) = @$read;
+        my $seq = join('', map { (qw(A C G T))[int(rand(4))] } 1..$len);
+        print $s join("\t", "long$pos", 0, 'ref1', $pos, $mapq, "${len}M",
+                      '*', 0, 0, $seq, '*'), "\n";
+        $pos += 1000;
+    }
+    close($s) || die "Error writing to $sam : $!\n";
+}
+
 # Run samtools view tests.
 
 sub test_view
@@ -2150,6 +2334,8 @@ sub test_view
     open($f, '>', $forn) || die "Couldn't open $forn : $!\n";
     print $f "ref1_grp1_p001\nunaligned_grp3_p001\nr008\nr009\n" || die "Error writing to $forn : $!\n";
     close($f) || die "Error writing to $forn : $!\n";
+    my $forni = "$$opts{tmp}/view.001.forni";
+    system("$$opts{bin}/samtools view --write-qname-index $forni -N $forn") == 0 or die "failed to create $forni: $?";
 
     my @filter_tests = (
         # [test_name, {filter_sam options}, [samtools options], expect_fail]
@@ -2169,6 +2355,8 @@ sub test_view
         # Read names
         ['rn', { read_names => { 'unaligned_grp3_p001' => 1, 'ref1_grp1_p001' => 1, 'r008' => 1, 'r009' => 1 } },
          ['-N', $forn], 0],
+        ['rn_index', { read_names => { 'unaligned_grp3_p001' => 1, 'ref1_grp1_p001' => 1, 'r008' => 1, 'r009' => 1 } },
+         ['-N', $forni], 0],
         # Tag with values
         ['tv_BC', { tag => 'BC', tag_values => { ACGT => 1, TGCA => 1, AATTCCGG => 1 }},
          ['-d', 'BC'], 0],
@@ -2439,6 +2627,45 @@ sub test_view
                   compare => "$$opts{path}/dat/nested.expected.sam");
     $test++;
 
+    # The same, loading the regions from --write-bed-index output
+    my $nested_bed = "$$opts{tmp}/view.nested.bed";
+    cmd("cp $$opts{path}/dat/nested.bed $nested_bed");
+    system("$$opts{bin}/samtools view --write-bed-index $nested_bed") == 0 or die "failed to create $nested_bed.bin: $?";
+    run_view_test($opts,
+                  msg => "$test: -L with nested regions from a BED index",
+                  args => ['-h', '-L', $nested_bed, '--no-PG',
+                           "$$opts{path}/dat/large_chrom.sam"],
+                  out => sprintf("%s.test%03d.sam", $out, $test),
+                  compare => "$$opts{path}/dat/nested.expected.sam");
+    $test++;
+
+    # A BED index with a bad tree level or linear index entry is ignored
+    # and the BED file read instead.  The one ref2 entry has its 24 byte
+    # header at 40, with tree_level at +16, then the name padded to 8,
+    # three 16 byte regions and the linear index.
+    open(my $bin_fh, '<:raw', "$nested_bed.bin") || die "Couldn't open $nested_bed.bin : $!\n";
+    my $nested_bin = do { local $/; <$bin_fh> };
+    close($bin_fh);
+    my %bad_bin = (level => [56, 70], idx => [120, 3]);
+    foreach my $bad (sort keys %bad_bin) {
+        my ($off, $val) = @{$bad_bin{$bad}};
+        my $bad_bed = "$$opts{tmp}/view.nested.bad_$bad.bed";
+        cmd("cp $$opts{path}/dat/nested.bed $bad_bed");
+        utime((stat($nested_bed))[8,9], $bad_bed);
+        my $data = $nested_bin;
+        substr($data, $off, 4) = pack('l<', $val);
+        open(my $bad_fh, '>:raw', "$bad_bed.bin") || die "Couldn't write $bad_bed.bin : $!\n";
+        print $bad_fh $data;
+        close($bad_fh) || die "Couldn't write $bad_bed.bin : $!\n";
+        run_view_test($opts,
+                      msg => "$test: -L with a bad $bad in the BED index",
+                      args => ['-h', '-L', $bad_bed, '--no-PG',
+                               "$$opts{path}/dat/large_chrom.sam"],
+                      out => sprintf("%s.test%03d.sam", $out, $test),
+                      compare => "$$opts{path}/dat/nested.expected.sam");
+        $test++;
+    }
+
     # -T / -t options
     my $sam_no_sq = "$$opts{tmp}/view.001.no_sq.sam";
     filter_sam($sam_no_ur, $sam_no_sq, {no_sq => 1});
@@ -2653,6 +2880,106 @@ sub test_view
             out => sprintf("%s.fetch-pairs.test%03d.bam", $out, $test),
             compare_sam => 'test/dat/view.fetch-pairs.filter1.expected.sam',
             check_save_counts => [$count_output, 31, 28]);
+
+    # Passthrough with records spanning several BGZF blocks
+    $test++;
+    my $long_sam = "$$opts{tmp}/view.long.sam";
+    gen_long_reads($opts, $long_sam);
+    my $long_bam = sprintf("%s.test%03d.bam", $out, $test);
+    run_view_test($opts,
+                  msg => "$test: Long reads SAM -> BAM",
+                  args => ['-b', $long_sam, '--no-PG'],
+                  out => $long_bam,
+                  compare_sam => $long_sam);
+    $test++;
+    run_view_test($opts,
+                  msg => "$test: Long reads BAM -> BAM (passthrough)",
+                  args => ['--passthrough', '-b', $long_bam, '--no-PG'],
+                  out => sprintf("%s.test%03d.bam", $out, $test),
+                  compare_sam => $long_sam);
+    $test++;
+    my $long_filtered = sprintf("%s.test%03d.bam", $out, $test);
+    run_view_test($opts,
+                  msg => "$test: Long reads BAM -> BAM (filtered)",
+                  args => ['-b', '-q', '10', $long_bam, '--no-PG'],
+                  out => $long_filtered);
+    $test++;
+    run_view_test($opts,
+                  msg => "$test: Long reads BAM -> BAM (filtered, passthrough)",
+                  args => ['--passthrough', '-b', '-q', '10', $long_bam, '--no-PG'],
+                  out => sprintf("%s.test%03d.bam", $out, $test),
+                  compare_bam => $long_filtered);
+
+    # Counting with the rejected reads written to -U
+    $test++;
+    my $long_unout = sprintf("%s.test%03d.unout.sam", $out, $test);
+    run_view_test($opts,
+                  msg => "$test: Count with -U (BAM input)",
+                  args => ['-c', '-q', '10', '-U', $long_unout, $long_bam, '--no-PG'],
+                  out => sprintf("%s.test%03d.count", $out, $test),
+                  redirect => 1,
+                  compare_count => 12);
+    $test++;
+    run_view_test($opts,
+                  msg => "$test: Reads written to -U while counting",
+                  args => ['-c', $long_unout],
+                  out => sprintf("%s.test%03d.count", $out, $test),
+                  redirect => 1,
+                  compare_count => 3);
+
+    # Thread placement must not change the output
+    my $plain = "$out.affinity.sam";
+    cmd("$$opts{bin}/samtools view --no-PG -h -o $plain $$opts{path}/dat/test_input_1_a.bam");
+    foreach my $mode (qw(none node spread)) {
+        test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools view --no-PG -@ 2 --affinity $mode -b -o $out.affinity.$mode.bam $$opts{path}/dat/test_input_1_a.bam && $$opts{bin}/samtools view --no-PG -h $out.affinity.$mode.bam | cmp - $plain");
+    }
+    foreach my $mode (qw(bogus node=x)) {
+        test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools view --no-PG -@ 2 --affinity $mode $$opts{path}/dat/test_input_1_a.bam", want_fail=>1);
+    }
+    # Commands that do not place their threads reject the option
+    foreach my $args ("flagstat -@ 2 --affinity none $$opts{path}/dat/test_input_1_a.bam",
+                      "collate -@ 2 --affinity none -o $out.affinity.collate.bam $$opts{path}/dat/test_input_1_a.bam") {
+        test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools $args 2>/dev/null", want_fail=>1);
+    }
+
+    # Filtering on the thread pool must give the same records, in the same
+    # order, as a serial run.  Use enough records for several batches.
+    my $many = "$out.threaded";
+    open(my $fh, '>', "$many.sam") || die "$many.sam: $!";
+    print $fh "\@HD\tVN:1.6\tSO:coordinate\n\@SQ\tSN:c1\tLN:2000000\n\@SQ\tSN:c2\tLN:2000000\n\@RG\tID:a\n\@RG\tID:b\n";
+    for (my $i = 0; $i < 5000; $i++) {
+        printf $fh "r%d\t%d\t%s\t%d\t%d\t10M\t*\t0\t0\tACGTACGTAC\tIIIIIIIIII\tRG:Z:%s\tXN:i:%d\n",
+            $i, $i % 7 ? 0 : 16, $i < 3000 ? "c1" : "c2", ($i % 3000) * 400 + 1,
+            $i % 60, $i % 3 ? "a" : "b", $i % 11;
+    }
+    for (my $i = 0; $i < 50; $i++) {
+        print $fh "u$i\t4\t*\t0\t0\t*\t*\t0\t0\tACGTACGTAC\tIIIIIIIIII\tRG:Z:a\tXN:i:$i\n";
+    }
+    close($fh) || die "$many.sam: $!";
+    cmd("$$opts{bin}/samtools view --no-PG -b -o $many.bam $many.sam && $$opts{bin}/samtools index $many.bam");
+    my $n = 0;
+    foreach my $args ("-e '[XN] > 5'", "-q 30", "-q 30 -x XN", "-d RG:b", "-d XN:3 -e 'flag.reverse'", "-x XN", "-x RG -x XN -q 10") {
+        my $serial = sprintf("%s.serial%d.sam", $many, $n++);
+        cmd("$$opts{bin}/samtools view --no-PG $args $many.bam > $serial");
+        test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools view --no-PG -\@4 $args $many.bam | cmp - $serial");
+    }
+
+    # Region-parallel -M must match the order and de-duplication of a
+    # serial -M run: many regions spread over several batches, overlapping
+    # regions, and regions mixed with "." and "*".
+    my $many_regs = join(" ", map { sprintf("c1:%d-%d", $_ * 5000 + 1, $_ * 5000 + 3000) } (0 .. 239));
+    foreach my $regs ($many_regs,
+                      "c1:1-600000 c1:500000-1100000 c1:1000000-1200000 c2:1-50000 c2:40000-90000",
+                      "c2:100000-200000 c1:1000-1600000 c1:800000-900000",
+                      "c1:1-5000 . *",
+                      "* c2:1-1000",
+                      ". c1:1-1000") {
+        foreach my $args ("-M", "-M -e '[XN] > 5'") {
+            my $serial = sprintf("%s.serial%d.sam", $many, $n++);
+            cmd("$$opts{bin}/samtools view --no-PG $args $many.bam $regs > $serial");
+            test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools view --no-PG -\@4 $args $many.bam $regs | cmp - $serial");
+        }
+    }
 }
 
 sub gen_head_output
@@ -2750,6 +3077,197 @@ sub cat_sams
 
 # Large position tests
 
+sub test_depth_binary
+{
+    my ($opts) = @_;
+
+    # Two chunks at positions beyond 32 bits, then a few references
+    my $longref = "$$opts{tmp}/depth_bin.longref.bam";
+    cmd("$$opts{bin}/samtools view --no-PG -b -o $longref $$opts{path}/large_pos/longref.sam");
+    cmd("$$opts{bin}/samtools index -c $longref");
+    my $mp = join(" ", map { "$$opts{path}/dat/mpileup.$_.sam" } 1..3);
+    my @tests = ("-a -r CHROMOSOME_I:10000000001-10000020000 $longref $longref",
+                 "-a $mp");
+
+    my $bin = "$$opts{tmp}/depth.bin";
+    foreach my $args (@tests) {
+        my $test = "$$opts{bin}/samtools depth --binary -o $bin $args";
+        print "$test\n";
+        my $text = cmd("$$opts{bin}/samtools depth $args");
+        cmd($test);
+        my $data = cmd("$$opts{bgzip} -dc $bin", {binary=>1});
+        my ($at, $out) = (0, "");
+        my $ok = eval {
+            die "bad magic\n" unless substr($data, 0, 5) eq "DPTH\x01";
+            my $nfiles = unpack("V", substr($data, 5, 4));
+            $at = 9;
+            for (my $i = 0; $i < $nfiles; $i++) { $at += 4 + unpack("V", substr($data, $at, 4)); }
+            my $chunk;
+            while (defined($chunk = depth_binary_chunk($data, \$at, $nfiles)) && $chunk ne "") { $out .= $chunk; }
+            die "bad chunk\n" unless defined($chunk) && $at == length($data);
+
+            # Each index entry must lead to a chunk covering its range
+            my $idx = "";
+            open(my $fh, '<', "$bin.idx") or die "$bin.idx: $!\n";
+            while (my $line = <$fh>) {
+                chomp($line);
+                my ($ref, $beg, $end, $voff) = split(/\t/, $line);
+                my $coff = int($voff / 65536);
+                my $block = cmd("tail -c +" . ($coff + 1) . " $bin | $$opts{bgzip} -dc", {binary=>1});
+                my $pos = $voff % 65536;
+                my $c = depth_binary_chunk($block, \$pos, $nfiles);
+                die "bad chunk at $voff\n" unless defined($c) && $c ne "";
+                my @lines = split(/\n/, $c);
+                my @first = split(/\t/, $lines[0]);
+                my @last = split(/\t/, $lines[-1]);
+                die "index entry $line does not match\n"
+                    unless $first[0] eq $ref && $first[1] == $beg && $last[1] == $end;
+                $idx .= $c;
+            }
+            close($fh);
+            die "indexed chunks differ\n" unless $idx eq $out;
+            1;
+        };
+        if (!$ok) { failed($opts,msg=>$test,reason=>"Bad binary output: $@"); }
+        elsif ($out ne $text) { failed($opts,msg=>$test,reason=>"Depths differ from the text output"); }
+        else { passed($opts,msg=>$test); }
+    }
+}
+
+# samples -@ reads the headers on a thread pool, but must print the same
+# as reading the files one by one
+sub test_samples
+{
+    my ($opts,%args) = @_;
+
+    my $out = "$$opts{tmp}/samples";
+    my @bams;
+    foreach my $f (qw(a b c)) {
+        cmd("cp $$opts{path}/dat/test_input_1_$f.bam $out.$f.bam");
+        push(@bams, "$out.$f.bam");
+    }
+    cmd("$$opts{bin}/samtools index $out.a.bam");
+    cmd("$$opts{bin}/samtools index -c $out.c.bam");
+
+    # A reference matching the @SQ lines of test_input_1_c only
+    open(my $fa, '>', "$out.c.fa") || die "Couldn't write $out.c.fa : $!\n";
+    print $fa ">ref1\n", "A" x 45, "\n>ref2\n", "C" x 40, "\n";
+    close($fa) || die "Couldn't write $out.c.fa : $!\n";
+    cmd("$$opts{bin}/samtools faidx $out.c.fa");
+
+    # Enough files to keep all the threads busy
+    my $many = join(" ", (@bams) x 4);
+    my $many_x = join(" ", ("$out.a.bam", "$out.c.bam") x 4,
+                      ("$out.a.bam.bai", "$out.c.bam.csi") x 4);
+    my @tests = ("-h -T ID $many",
+                 "-h -i -T ID $many",
+                 "-h -T ID -f $out.c.fa -f $$opts{path}/dat/view.001.fa $many",
+                 "-h -i -T ID -X $many_x");
+    foreach my $args (@tests) {
+        cmd("$$opts{bin}/samtools samples $args > $out.serial");
+        test_cmd($opts, out=>'dat/empty.expected',
+                 cmd=>"$$opts{bin}/samtools samples -@ 4 $args | cmp - $out.serial");
+    }
+
+    # A bad line in a -X list on stdin fails, after printing the files
+    # listed before it
+    open(my $list, '>', "$out.list") || die "Couldn't write $out.list : $!\n";
+    print $list "$out.a.bam\t$out.a.bam.bai\n$out.c.bam\t$out.c.bam.csi\n",
+        "$out.b.bam\n$out.a.bam\t$out.a.bam.bai\n";
+    close($list) || die "Couldn't write $out.list : $!\n";
+    cmd("$$opts{bin}/samtools samples -X -T ID < $out.list > $out.serial 2> /dev/null || true");
+    test_cmd($opts, out=>'dat/empty.expected',
+             cmd=>"! $$opts{bin}/samtools samples -@ 4 -X -T ID < $out.list > $out.mt 2> /dev/null && test `wc -l < $out.serial` -eq 2 && cmp $out.mt $out.serial");
+}
+
+# --profile writes a JSON report with these keys, counting the bytes
+# written by the time the output is closed
+sub test_profile
+{
+    my ($opts,%args) = @_;
+
+    my $threads = exists($args{threads}) ? " -@ $args{threads}" : "";
+    my $out = "$$opts{tmp}/profile" . (exists($args{threads}) ? ".t$args{threads}" : "");
+    my @keys = qw(command threads wall_seconds user_seconds sys_seconds
+                  peak_rss_kb stages counters queues);
+    my @tests = (['view', "$out.view.bam",
+                  "view${threads} --profile $out.json -b -o $out.view.bam $$opts{path}/dat/mpileup.1.sam"],
+                 ['view', "$out.stdout.bam",
+                  "view${threads} --profile $out.json -b $$opts{path}/dat/mpileup.1.sam > $out.stdout.bam"],
+                 ['markdup', "$out.markdup.bam",
+                  "markdup${threads} --profile $out.json $$opts{path}/markdup/5_markdup.sam $out.markdup.bam"]);
+
+    foreach my $t (@tests) {
+        my ($cmd, $file, $args) = @$t;
+        my $test = "$$opts{bin}/samtools $args";
+        print "$test\n";
+        unlink("$out.json");
+        cmd($test);
+        my $json = cmd("cat $out.json");
+        my @missing = grep { $json !~ /"$_":/ } @keys;
+        my ($bytes) = $json =~ /"bytes_out": (\d+)/;
+        if (@missing) { failed($opts,msg=>$test,reason=>"Missing keys: @missing"); }
+        elsif ($json !~ /"command": "$cmd"/) { failed($opts,msg=>$test,reason=>"Wrong command"); }
+        elsif (!defined($bytes) || $bytes != -s $file) {
+            failed($opts,msg=>$test,reason=>"bytes_out is " . ($bytes // "missing") . ", not the size of $file");
+        }
+        else { passed($opts,msg=>$test); }
+    }
+
+    # Commands that don't record a profile reject the option
+    foreach my $args ("flagstat --profile $out.json $$opts{path}/dat/mpileup.1.sam",
+                      "collate --profile $out.json -o $out.collate.bam $$opts{path}/dat/mpileup.1.sam") {
+        test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools $args 2>/dev/null", want_fail=>1);
+    }
+}
+
+# Decodes the samtools depth --binary chunk at $$at in $data, into text
+# output lines.  Returns "" for the terminating chunk or undef if the data
+# is not valid.
+sub depth_binary_chunk
+{
+    my ($data, $at, $nfiles) = @_;
+    my $get = sub {
+        my ($len, $fmt) = @_;
+        die "truncated\n" if $$at + $len > length($data);
+        my $v = substr($data, $$at, $len);
+        $$at += $len;
+        return defined($fmt) ? unpack($fmt, $v) : $v;
+    };
+    my $out = "";
+    my $ok = eval {
+        my $ref_len = $get->(4, "V");
+        if ($ref_len) {
+            my $ref = $get->($ref_len);
+            my ($lo, $hi) = $get->(8, "VV");
+            my $pos = $lo + $hi * 2**32;
+            my $n = $get->(4, "V");
+            my $w = $get->(1, "C");
+            die "bad width\n" unless $w == 2 || $w == 4;
+            my @pos;
+            for (my $i = 0; $i < $n; $i++) {
+                my ($delta, $shift, $byte) = (0, 0);
+                do {
+                    $byte = $get->(1, "C");
+                    $delta += ($byte & 0x7f) * 2**$shift;
+                    $shift += 7;
+                } while ($byte & 0x80);
+                $pos += $delta;
+                push @pos, $pos;
+            }
+            my @d;
+            for (my $f = 0; $f < $nfiles; $f++) {
+                push @d, [$get->($w * $n, ($w == 2 ? "v" : "V") . $n)];
+            }
+            for (my $i = 0; $i < $n; $i++) {
+                $out .= join("\t", $ref, $pos[$i] + 1, map { $d[$_][$i] } 0..$nfiles-1) . "\n";
+            }
+        }
+        1;
+    };
+    return $ok ? $out : undef;
+}
+
 sub test_large_positions
 {
     my ($opts) = @_;
@@ -2785,16 +3303,31 @@ sub test_large_positions
              cmd => "$$opts{bin}/samtools depth $$opts{path}/large_pos/longref.sam");
     test_cmd($opts, out => 'large_pos/depth_bed.expected.out',
              cmd => "$$opts{bin}/samtools depth -b $$opts{path}/large_pos/test.bed $$opts{path}/large_pos/longref.sam");
+    test_cmd($opts, out => 'large_pos/depth_bedgraph.expected.out',
+             cmd => "$$opts{bin}/samtools depth --bedgraph $$opts{path}/large_pos/longref.sam");
+    test_cmd($opts, out => 'large_pos/depth_summary.expected.out',
+             cmd => "$$opts{bin}/samtools depth --summary -b $$opts{path}/large_pos/test.bed - < $$opts{path}/large_pos/longref.sam");
 
     # tview
     test_cmd($opts, out => 'large_pos/tview.expected.out',
              cmd => "$$opts{bin}/samtools tview -d T -p CHROMOSOME_I:10000000000 $longref");
+    test_cmd($opts, out => 'large_pos/tview.expected.out',
+             cmd => "$$opts{bin}/samtools tview -d T -V -p CHROMOSOME_I:10000000000 $longref");
 
     # Sort and fixmates
     test_cmd($opts, out => 'large_pos/longref3.expected.sam',
              cmd => "$$opts{bin}/samtools sort    -O sam --no-PG -n -m 10M test/large_pos/longref3.sam |
                      $$opts{bin}/samtools fixmate -O sam --no-PG - - |
                      $$opts{bin}/samtools sort    -O sam --no-PG -m 10M");
+    test_cmd($opts, out => 'large_pos/longref3.expected.sam',
+             cmd => "$$opts{bin}/samtools fixmate --collate-sort --sort-mem 10M -O sam --no-PG test/large_pos/longref3.sam -");
+    test_cmd($opts, out => 'large_pos/longref3.expected.sam',
+             cmd => "$$opts{bin}/samtools fixmate --collate-sort --sort-mem 10M -\@2 -O sam --no-PG test/large_pos/longref3.sam -");
+    # Bad and too small --sort-mem values are rejected
+    foreach my $mem (qw(0 12X K 10MB -10M 99999999999G 512K)) {
+        test_cmd($opts, out => 'dat/empty.expected', want_fail => 1,
+                 cmd => "$$opts{bin}/samtools fixmate --collate-sort --sort-mem $mem -O sam --no-PG test/large_pos/longref3.sam - 2>/dev/null");
+    }
 }
 
 # Test samtools cat.
@@ -2921,6 +3454,40 @@ sub test_cat
                   compare_sam => $catsam1);
     $test++;
 
+    # Threaded, which reads the CRAM containers being copied in parallel.
+    # The bytes written should not change.
+    run_view_test($opts,
+                  msg =>  "$test: cat BAM files with threads",
+                  cmd => 'cat',
+                  args => ['-@', 4, @bams],
+                  out => sprintf("%s.test%03d.bam", $out, $test),
+                  compare_sam => $catsam1);
+    $test++;
+
+    run_view_test($opts,
+                  msg =>  "$test: cat CRAM files with threads",
+                  cmd => 'cat',
+                  args => ['-@', 4, @crams],
+                  out => sprintf("%s.test%03d.cram", $out, $test),
+                  compare_sam => $catsam1);
+    $test++;
+
+    run_view_test($opts,
+                  msg =>  "$test: cat CRAM subregion files with threads",
+                  cmd => 'cat',
+                  args => ['-@', 4, '-r', 'ref1:4240-7150', @crams],
+                  out => sprintf("%s.test%03d.cram", $out, $test),
+                  compare_sam => $catsam1r);
+    $test++;
+
+    foreach my $sel (['-p', '2/3'], ['-r', "'#:3-7'"], []) {
+        my $serial = sprintf("%s.test%03d.cram", $out, $test);
+        cmd("$$opts{bin}/samtools cat --no-PG @$sel -o $serial @crams");
+        test_cmd($opts, out=>'dat/empty.expected',
+                 cmd=>"$$opts{bin}/samtools cat --no-PG -\@4 @$sel @crams | cmp - $serial");
+        $test++;
+    }
+
     # Test reheader option
     my $hdr_no_ur   = "$$opts{path}/dat/cat.hdr";
     my $header      = "$$opts{tmp}/cat.hdr";
@@ -3063,6 +3630,29 @@ sub test_import
              cmd=>"$$opts{bin}/samtools import --no-PG --i1 test/import/5-i1.fq --i2  test/import/5-i2.fq --r1 test/import/5-r1.fq --r2 test/import/5-r2.fq");
     test_cmd($opts, out=>'import/5-OX.expected.sam',
              cmd=>"$$opts{bin}/samtools import --no-PG --i1 test/import/5-i1.fq --i2  test/import/5-i2.fq --r1 test/import/5-r1.fq --r2 test/import/5-r2.fq --barcode-tag OX --quality-tag BZ");
+
+    # Threaded, with a reader per input file
+    test_cmd($opts, out=>'import/1.expected.sam',
+             cmd=>"$$opts{bin}/samtools import --no-PG -\@2 test/bam2fq/1.1.fq.expected test/bam2fq/1.2.fq.expected -R rgid");
+    test_cmd($opts, out=>'import/2.expected.sam',
+             cmd=>"$$opts{bin}/samtools import --no-PG -\@2 test/import/2.interleaved.fq -T \"\"");
+    test_cmd($opts, out=>'import/5-BC.expected.sam',
+             cmd=>"$$opts{bin}/samtools import --no-PG -\@2 --i1 test/import/5-i1.fq --i2  test/import/5-i2.fq --r1 test/import/5-r1.fq --r2 test/import/5-r2.fq");
+
+    # Enough records to fill several reader batches, which must still
+    # pair up R1 with R2
+    my $big = "$$opts{tmp}/import_big";
+    for my $r (1, 2) {
+        open(my $fq, '>', "$big.$r.fq") || die "$big.$r.fq: $!";
+        for (my $i = 0; $i < 5000; $i++) {
+            my $seq = substr("ACGTTGCA" x 4, $i % 8, 20 + $i % 7);
+            print $fq "\@r$i/$r\n$seq\n+\n", "I" x length($seq), "\n";
+        }
+        close($fq) || die "$big.$r.fq: $!";
+    }
+    cmd("$$opts{bin}/samtools import --no-PG -1 $big.1.fq -2 $big.2.fq > $big.sam");
+    test_cmd($opts, out=>'dat/empty.expected',
+             cmd=>"$$opts{bin}/samtools import --no-PG -\@4 -1 $big.1.fq -2 $big.2.fq | cmp - $big.sam");
 }
 
 sub test_bam2fq
@@ -3124,6 +3714,22 @@ sub test_bam2fq
     test_cmd($opts, out=>'dat/empty.expected', out_map=>{'1.fq' => 'bam2fq/1.1.fq.expected', '2.fq' => 'bam2fq/1.2.fq.expected'},cmd=>"$$opts{bin}/samtools fastq @$threads -1 $$opts{path}/1.fq -2 $$opts{path}/2.fq $$opts{path}/dat/bam2fq.001.sam");
     # basic 2 output test with singleton tracking but no singleton
     test_cmd($opts, out=>'dat/empty.expected', out_map=>{'1.fq' => 'bam2fq/2.1.fq.expected', '2.fq' => 'bam2fq/2.2.fq.expected', 's.fq' => 'bam2fq/2.s.fq.expected'}, cmd=>"$$opts{bin}/samtools fastq @$threads -s $$opts{path}/s.fq -1 $$opts{path}/1.fq -2 $$opts{path}/2.fq $$opts{path}/dat/bam2fq.001.sam");
+    # --pair-mates, with singletons pushed out to the temporary file
+    test_cmd($opts, out=>'dat/empty.expected', out_map=>{'1.fq' => 'bam2fq/2.1.fq.expected', '2.fq' => 'bam2fq/2.2.fq.expected', 's.fq' => 'bam2fq/2.s.fq.expected'}, cmd=>"$$opts{bin}/samtools fastq @$threads --pair-mates --max-unpaired 1 --tmp-prefix $$opts{tmp} -s $$opts{path}/s.fq -1 $$opts{path}/1.fq -2 $$opts{path}/2.fq $$opts{path}/dat/bam2fq.001.sam");
+    # --pair-mates on coordinate sorted input, holding so few reads that
+    # the mates spanning references take several sweeps of the spill file.
+    # Pairs come out in a different order, so compare sorted records.
+    my $pm = "$out.pair_mates";
+    cmd("$$opts{bin}/samtools fastq -1 $pm.exp.1.fq -2 $pm.exp.2.fq -s $pm.exp.s.fq $sam 2>/dev/null");
+    cmd("paste - - - - < $pm.exp.$_.fq | sort > $pm.exp.$_.sorted") foreach (1, 2, 's');
+    cmd("$$opts{bin}/samtools sort --no-PG -o $pm.pos.bam $sam");
+    foreach my $max (1, 2, 3) {
+        my $cmp = join(" && ", map { "paste - - - - < $pm.$_.fq | sort | cmp - $pm.exp.$_.sorted" } (1, 2, 's'));
+        test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools fastq @$threads --pair-mates --max-unpaired $max --tmp-prefix $pm.tmp -1 $pm.1.fq -2 $pm.2.fq -s $pm.s.fq $pm.pos.bam 2>/dev/null && $cmp");
+    }
+    foreach my $max ("", "0", "-3", "5x", "99999999999999999999") {
+        test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools fastq --pair-mates --max-unpaired '$max' $pm.pos.bam 2>/dev/null", want_fail=>1);
+    }
     # basic 2 output test with singleton tracking with a singleton in the middle
     test_cmd($opts, out=>'dat/empty.expected', out_map=>{'1.fq' => 'bam2fq/3.1.fq.expected', '2.fq' => 'bam2fq/3.2.fq.expected', 's.fq' => 'bam2fq/3.s.fq.expected'}, cmd=>"$$opts{bin}/samtools fastq @$threads -s $$opts{path}/s.fq -1 $$opts{path}/1.fq -2 $$opts{path}/2.fq $$opts{path}/dat/bam2fq.002.sam");
     # basic 2 output test with singleton tracking with a singleton as last read
@@ -3179,6 +3785,37 @@ sub test_bam2fq
     # -D TAG
     test_cmd($opts, out=>'bam2fq/20.fq.expected', cmd=>"$$opts{bin}/samtools fastq @$threads -D NM:test/dat/bam2fq.NM-D $$opts{path}/dat/bam2fq.001.sam");
     test_cmd($opts, out=>'bam2fq/19.fq.expected', cmd=>"$$opts{bin}/samtools fastq @$threads -D MD:test/dat/bam2fq.MD-D $$opts{path}/dat/bam2fq.001.sam");
+
+    # The writer threads must produce the files a serial run does, with
+    # enough records to cycle the queue of every output several times
+    return unless exists($args{threads});
+    my $big = "$out.writers";
+    open(my $fh, '>', "$big.sam") || die "$big.sam: $!";
+    print $fh "\@HD\tVN:1.6\tSO:unsorted\n";
+    for (my $i = 0; $i < 12000; $i++) {
+        my $seq = substr("ACGTTGCAAC" x 4, $i % 10, 20 + $i % 9);
+        my $qual = "I" x length($seq);
+        if ($i % 13 == 0) {
+            print $fh "u$i\t4\t*\t0\t0\t*\t*\t0\t0\t$seq\t$qual\n";
+            next;
+        }
+        print $fh "p$i\t77\t*\t0\t0\t*\t*\t0\t0\t$seq\t$qual\n";
+        print $fh "p$i\t141\t*\t0\t0\t*\t*\t0\t0\t$seq\t$qual\n" if $i % 10;
+    }
+    close($fh) || die "$big.sam: $!";
+    foreach my $outs ("-1 %s.1.fq -2 %s.2.fq -s %s.s.fq -0 %s.0.fq",
+                      "-1 %s.1.fq.gz -2 %s.2.fq.gz -s %s.s.fq -0 %s.0.fq",
+                      "-o %s.1.fq -s %s.s.fq -0 %s.0.fq",
+                      "-1 %s.1.fq -2 %s.2.fq") {
+        my @files = ($outs =~ /%s(\.\S+)/g);
+        my $serial = sprintf($outs, ("$big.serial") x 4);
+        my $threaded = sprintf($outs, ("$big.threaded") x 4);
+        cmd("$$opts{bin}/samtools fastq $serial $big.sam 2>/dev/null");
+        my $cmp = join(" && ", map { /\.gz$/
+                                         ? "gzip -dc $big.serial$_ > $big.serial.plain && gzip -dc $big.threaded$_ | cmp - $big.serial.plain"
+                                         : "cmp $big.serial$_ $big.threaded$_" } @files);
+        test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools fastq @$threads $threaded $big.sam 2>/dev/null && $cmp");
+    }
 }
 
 
@@ -3244,6 +3881,59 @@ sub test_depad
     }
 }
 
+sub test_flagstat
+{
+    my ($opts,%args) = @_;
+
+    my $threads = exists($args{threads}) ? " -@ $args{threads}" : "";
+    my $sam = "$$opts{path}/dat/flagstat.sam";
+    my $out = "$$opts{tmp}/flagstat" . (exists($args{threads}) ? ".t$args{threads}" : "");
+    cmd("$$opts{bin}/samtools view --no-PG -b -o $out.bam $sam");
+    cmd("$$opts{bin}/samtools view --no-PG -O cram,no_ref -o $out.cram $sam");
+
+    # The counts do not depend on the input format.  CRAM checks the
+    # different chr rows, which need the read's reference to be decoded.
+    test_cmd($opts, out=>'dat/flagstat.expected', cmd=>"$$opts{bin}/samtools flagstat${threads} $sam");
+    test_cmd($opts, out=>'dat/flagstat.expected', cmd=>"$$opts{bin}/samtools flagstat${threads} $out.bam");
+    test_cmd($opts, out=>'dat/flagstat.expected', cmd=>"$$opts{bin}/samtools flagstat${threads} $out.cram");
+
+    # Totals over several files
+    test_cmd($opts, out=>'dat/flagstat.2.expected', cmd=>"$$opts{bin}/samtools flagstat${threads} $out.bam $out.cram");
+    test_cmd($opts, out=>'dat/flagstat.2.expected', cmd=>"$$opts{bin}/samtools flagstat${threads} $sam $out.bam");
+}
+
+sub test_coverage
+{
+    my ($opts,%args) = @_;
+
+    my $threads = exists($args{threads}) ? " -@ $args{threads}" : "";
+    my $in = "$$opts{path}/coverage";
+    my $out = "$$opts{tmp}/coverage" . (exists($args{threads}) ? ".t$args{threads}" : "");
+    cmd("$$opts{bin}/samtools view --no-PG -b -o $out.1.bam $in/1.sam");
+    cmd("$$opts{bin}/samtools index $out.1.bam");
+
+    test_cmd($opts, out=>'coverage/1.expected', cmd=>"$$opts{bin}/samtools coverage${threads} $in/1.sam");
+    test_cmd($opts, out=>'coverage/1.Q20.expected', cmd=>"$$opts{bin}/samtools coverage${threads} -Q 20 $in/1.sam");
+    test_cmd($opts, out=>'coverage/1.d2.expected', cmd=>"$$opts{bin}/samtools coverage${threads} -d 2 $in/1.sam");
+    test_cmd($opts, out=>'coverage/1.w10.expected', cmd=>"$$opts{bin}/samtools coverage${threads} -A -w 10 $in/1.sam");
+    test_cmd($opts, out=>'coverage/1.r.expected', cmd=>"$$opts{bin}/samtools coverage${threads} -r r1:21-60 $out.1.bam");
+
+    # Several inputs add up, with -d applied to each one separately
+    test_cmd($opts, out=>'coverage/1+2.expected', cmd=>"$$opts{bin}/samtools coverage${threads} $in/1.sam $in/2.sam");
+    test_cmd($opts, out=>'coverage/1+2.Q20.d2.expected', cmd=>"$$opts{bin}/samtools coverage${threads} -Q 20 -d 2 $in/1.sam $in/2.sam");
+
+    # Indexed inputs, which -@ shares out between the threads by contig.
+    # The output must be the same as that of the serial code above.
+    cmd("$$opts{bin}/samtools view --no-PG -b -o $out.2.bam $in/2.sam");
+    cmd("$$opts{bin}/samtools index $out.2.bam");
+    test_cmd($opts, out=>'coverage/1.expected', cmd=>"$$opts{bin}/samtools coverage${threads} $out.1.bam");
+    test_cmd($opts, out=>'coverage/1.Q20.expected', cmd=>"$$opts{bin}/samtools coverage${threads} -Q 20 $out.1.bam");
+    test_cmd($opts, out=>'coverage/1.d2.expected', cmd=>"$$opts{bin}/samtools coverage${threads} -d 2 $out.1.bam");
+    test_cmd($opts, out=>'coverage/1.w10.expected', cmd=>"$$opts{bin}/samtools coverage${threads} -A -w 10 $out.1.bam");
+    test_cmd($opts, out=>'coverage/1+2.expected', cmd=>"$$opts{bin}/samtools coverage${threads} $out.1.bam $out.2.bam");
+    test_cmd($opts, out=>'coverage/1+2.Q20.d2.expected', cmd=>"$$opts{bin}/samtools coverage${threads} -Q 20 -d 2 $out.1.bam $out.2.bam");
+}
+
 sub test_stats
 {
     my ($opts,%args) = @_;
@@ -3286,6 +3976,14 @@ sub test_stats
     test_cmd($opts,out=>'stat/14.rg.grp3.expected',cmd=>"$$opts{bin}/samtools stats -I grp3 $$opts{path}/stat/11_target.bam | tail -n+4", exp_fix=>$efix);
     test_cmd($opts,out=>'stat/14.rg.Sample.expected',cmd=>"$$opts{bin}/samtools stats -I Sample $$opts{path}/stat/11_target.bam | tail -n+4", exp_fix=>$efix);
     test_cmd($opts,out=>'stat/15.stats.expected',cmd=>"$$opts{bin}/samtools stats -r $$opts{path}/mpileup/ce.fa $$opts{path}/stat/15.big_del.sam | tail -n+4", exp_fix=>$efix);
+
+    # Per-read stats sharded between threads
+    test_cmd($opts,out=>'stat/1.stats.expected',cmd=>"$$opts{bin}/samtools stats -@ 2 -r $$opts{path}/stat/test.fa $$opts{path}/stat/1_map_cigar.sam | tail -n+4", exp_fix=>$efix);
+    test_cmd($opts,out=>'stat/5.stats.large.expected',cmd=>"$$opts{bin}/samtools stats -@ 2 $$opts{path}/stat/5_insert_cigar_large.sam | tail -n+4", exp_fix=>$efix);
+    test_cmd($opts,out=>'stat/6.stats.expected',cmd=>"$$opts{bin}/samtools stats -@ 2 -r $$opts{path}/stat/test.fa -i 0 $$opts{path}/stat/5_insert_cigar.sam | tail -n+4", exp_fix=>$efix);
+    test_cmd($opts,out=>'stat/7.stats.large.expected',cmd=>"$$opts{bin}/samtools stats -@ 2 $$opts{path}/stat/7_supp_large.sam | tail -n+4", exp_fix=>$efix);
+    test_cmd($opts,out=>'stat/13.barcodes.bc.ok.expected',cmd=>"$$opts{bin}/samtools stats -@ 2 $$opts{path}/stat/13_barcodes_ok.sam | tail -n+4", exp_fix=>$efix);
+    test_cmd($opts,out=>'stat/14.rg.grp2.expected',cmd=>"$$opts{bin}/samtools stats -@ 2 -I grp2 $$opts{path}/stat/11_target.bam | tail -n+4", exp_fix=>$efix);
 }
 
 sub test_merge
@@ -3300,6 +3998,18 @@ sub test_merge
     test_cmd($opts,out=>'merge/2.merge.expected.sam', ignore_pg_header => 1, cmd=>"$$opts{bin}/samtools merge${threads} -s 1 -O sam - $$opts{path}/dat/test_input_1_a.sam $$opts{path}/dat/test_input_1_b.sam $$opts{path}/dat/test_input_1_c.sam");
     # Merge 2 - Standard 3 file BAM merge all files presented on the command line
     test_cmd($opts,out=>'merge/2.merge.expected.sam', ignore_pg_header => 1, cmd=>"$$opts{bin}/samtools merge${threads} -s 1 -O sam - $$opts{path}/dat/test_input_1_a.bam $$opts{path}/dat/test_input_1_b.bam $$opts{path}/dat/test_input_1_c.bam");
+    # --parallel-regions falls back to a serial merge here, as
+    # test_input_1_c.bam has different targets and SAM output is wanted
+    test_cmd($opts,out=>'merge/2.merge.expected.sam', ignore_pg_header => 1, cmd=>"$$opts{bin}/samtools merge${threads} --parallel-regions -s 1 -O sam - $$opts{path}/dat/test_input_1_a.bam $$opts{path}/dat/test_input_1_b.bam $$opts{path}/dat/test_input_1_c.bam");
+    # Indexed inputs with the same targets and BAM output are merged in
+    # parallel, with the RG and PG tags translated as in merge 6 below.
+    # The command fails if it had to fall back to a serial merge.
+    my $par = "$$opts{tmp}/merge.par" . (exists($args{threads}) ? ".t$args{threads}" : "");
+    foreach my $x (qw(a b)) {
+        cmd("cp $$opts{path}/dat/test_input_1_$x.bam $par.$x.bam");
+        cmd("$$opts{bin}/samtools index $par.$x.bam");
+    }
+    test_cmd($opts,out=>'merge/6.merge.expected.sam', ignore_pg_header => 1, cmd=>"$$opts{bin}/samtools merge -@ 2 --parallel-regions -cp -s 1 -O bam -o $par.bam $par.a.bam $par.b.bam 2> $par.err && ! grep -q 'merging serially' $par.err && $$opts{bin}/samtools view --no-PG -h $par.bam");
     # Merge 3 - Standard 3 file BAM merge 2 files in fofn 1 on command line
     open(my $fofn, "$$opts{path}/merge/test_3.fofn");
     my ($tmpfile_fh, $tmpfile_filename) = tempfile(UNLINK => 1);
@@ -3364,12 +4074,20 @@ sub test_sort
 
     # Pos sort
     test_cmd($opts, out=>"sort/pos.sort.expected.sam", ignore_pg_header => 1, cmd=>"$$opts{bin}/samtools sort${threads} -m 10M $$opts{path}/dat/test_input_1_a.bam -O SAM -o -");
+    test_cmd($opts, out=>"sort/pos.sort.expected.sam", ignore_pg_header => 1, cmd=>"$$opts{bin}/samtools sort${threads} -m 1M --tmp-level 0 $$opts{path}/dat/test_input_1_a.bam -O SAM -o -");
+    foreach my $level ("-1", "10", "", "1x") {
+        test_cmd($opts, out=>"dat/empty.expected", want_fail=>1, cmd=>"$$opts{bin}/samtools sort${threads} --tmp-level '$level' $$opts{path}/dat/test_input_1_a.bam -O SAM -o - 2>/dev/null");
+    }
 
     # Name sort
     test_cmd($opts, out=>"sort/name.sort.expected.sam", ignore_pg_header => 1, cmd=>"$$opts{bin}/samtools sort${threads} -n -m 10M $$opts{path}/dat/test_input_1_a.bam -O SAM -o -");
     test_cmd($opts, out=>"sort/name2.sort.expected.sam", ignore_pg_header => 1, cmd=>"$$opts{bin}/samtools sort${threads} -N -m 10M $$opts{path}/dat/test_input_1_b.bam -O SAM -o -");
     test_cmd($opts, out=>"sort/name3.sort.expected.sam", ignore_pg_header => 1, cmd=>"$$opts{bin}/samtools sort${threads} -n -m 10M $$opts{path}/dat/sort_name_input_1.sam -O SAM -o -");
 
+    # Name sort of numbers of mixed lengths, merged from many blocks
+    gen_sort_names("$$opts{tmp}/sort_names.sam", "$$opts{tmp}/sort_names.expected.sam");
+    test_cmd($opts, out=>"dat/empty.expected", cmd=>"$$opts{bin}/samtools sort${threads} -n -m 1M $$opts{tmp}/sort_names.sam -O SAM -o - | grep -v '^\@' > $$opts{tmp}/sort_names.out.sam && $$opts{diff} $$opts{tmp}/sort_names.expected.sam $$opts{tmp}/sort_names.out.sam");
+
     # Tag sort (RG)
     test_cmd($opts, out=>"sort/tag.rg.sort.expected.sam", ignore_pg_header => 1, cmd=>"$$opts{bin}/samtools sort${threads} -t RG -m 10M $$opts{path}/dat/test_input_1_a.bam -O SAM -o -");
 
@@ -3395,6 +4113,59 @@ sub test_sort
     test_cmd($opts, out=>"sort/minimiser-indexed-poly.sam", ignore_pg_header => 1, cmd=>"$$opts{bin}/samtools reset  --dupflag $$opts{path}/dat/auto_indexed.tmp.bam | $$opts{bin}/samtools sort${threads} -MH -K10 -I $$opts{path}/dat/mpileup.ref.fa -O SAM -o -");
 }
 
+# Compare read names as strnum_cmp() in bam_sort.c does
+sub natural_cmp
+{
+    my ($x, $y) = @_;
+    my @a = $x =~ /(\d+|\D)/g;
+    my @b = $y =~ /(\d+|\D)/g;
+    for (my $i = 0; $i < @a && $i < @b; $i++) {
+        my ($p, $q) = ($a[$i], $b[$i]);
+        if ($p =~ /^\d/ && $q =~ /^\d/) {
+            $p =~ s/^0+//;
+            $q =~ s/^0+//;
+            my $c = length($p) <=> length($q) || $p cmp $q;
+            return $c if $c;
+        } elsif ((my $c = ord($p) <=> ord($q))) {
+            return $c;
+        }
+    }
+    return @a <=> @b;
+}
+
+# Write unmapped reads with names holding numbers of different lengths,
+# some zero padded, in a shuffled order, and the same reads sorted
+sub gen_sort_names
+{
+    my ($sam, $expected) = @_;
+    my @prefixes = ('r', 'r.', 'r-', 'rA', 'read', 'r:');
+    my %names;
+    srand(7);
+    while (keys(%names) < 20000) {
+        my $num = int(rand(10 ** (1 + int(rand(6)))));
+        my $name = $prefixes[int(rand(@prefixes))]
+            . (rand() < 0.3 ? sprintf("%07d", $num) : $num);
+        $name .= ':' . int(rand(100)) if (rand() < 0.5);
+        # Names equal in number alone would be left in input order
+        (my $key = $name) =~ s/(\d+)/$1 + 0/ge;
+        $names{$key} //= $name;
+    }
+    my @names = map { $names{$_} } sort keys(%names);
+    for (my $i = @names - 1; $i > 0; $i--) {
+        my $j = int(rand($i + 1));
+        @names[$i, $j] = @names[$j, $i];
+    }
+    my $seq = 'ACGT' x 25;
+    my $qual = 'I' x 100;
+    open(my $out, '>', $sam) || die "Couldn't open $sam : $!\n";
+    print $out "\@HD\tVN:1.6\tSO:unsorted\n";
+    print $out "$_\t4\t*\t0\t0\t*\t*\t0\t0\t$seq\t$qual\n" foreach (@names);
+    close($out) || die "Error writing $sam : $!\n";
+    open($out, '>', $expected) || die "Couldn't open $expected : $!\n";
+    print $out "$_\t4\t*\t0\t0\t*\t*\t0\t0\t$seq\t$qual\n" foreach (sort { natural_cmp($a, $b) } @names);
+    close($out) || die "Error writing $expected : $!\n";
+}
+
 sub test_collate
 {
     my ($opts, %args) = @_;
@@ -3405,6 +4176,35 @@ sub test_collate
     test_cmd($opts, out=>"collate/collate.expected.sam", ignore_pg_header => 1,
              cmd=>"$$opts{bin}/samtools collate${threads} --output-fmt=sam -O $$opts{path}/dat/test_input_1_d.sam");
 
+    # Output to stdout, with all or some of the reads in temporary files
+    test_cmd($opts, out=>"collate/collate.expected.sam", ignore_pg_header => 1,
+             cmd=>"$$opts{bin}/samtools collate${threads} --output-fmt=sam -m 1 -O $$opts{path}/dat/test_input_1_d.sam $$opts{path}/collate/collate0.tmp");
+    test_cmd($opts, out=>"collate/collate.expected.sam", ignore_pg_header => 1,
+             cmd=>"$$opts{bin}/samtools collate${threads} --output-fmt=sam -m 8K -O $$opts{path}/dat/test_input_1_d.sam $$opts{path}/collate/collate0.tmp");
+    test_cmd($opts, out=>"collate/collate.expected.sam", ignore_pg_header => 1,
+             cmd=>"$$opts{bin}/samtools collate${threads} --output-fmt=sam -m 1 --tmp-codec lz4-dict -O $$opts{path}/dat/test_input_1_d.sam $$opts{path}/collate/collate0.tmp");
+    test_cmd($opts, out=>"collate/collate.expected.sam", ignore_pg_header => 1,
+             cmd=>"$$opts{bin}/samtools collate${threads} --output-fmt=sam -m 8K --tmp-codec deflate -O $$opts{path}/dat/test_input_1_d.sam $$opts{path}/collate/collate0.tmp");
+
+    # Bad memory limits are rejected
+    foreach my $mem (qw(0 12X K)) {
+        test_cmd($opts, out=>"dat/empty.expected", want_fail=>1,
+                 cmd=>"$$opts{bin}/samtools collate${threads} --output-fmt=sam -m $mem -O $$opts{path}/dat/test_input_1_d.sam $$opts{path}/collate/collate0.tmp");
+    }
+
+    # Several groups of records in one temporary file, which the
+    # dictionary codecs compress against the first group.  The output
+    # must match that of the default codec.
+    my $spill = "$$opts{tmp}/collate_spill" . (exists($args{threads}) ? ".t$args{threads}" : "");
+    cmd("$$opts{bin}/samtools collate${threads} --output-fmt=sam --no-PG -n 1 -m 1K -o $spill.lz4.sam $$opts{path}/dat/mpileup.1.sam $spill.tmp");
+    foreach my $codec (qw(lz4-dict deflate)) {
+        test_cmd($opts, out=>"dat/empty.expected",
+                 cmd=>"$$opts{bin}/samtools collate${threads} --output-fmt=sam --no-PG -n 1 -m 1K --tmp-codec $codec -o $spill.$codec.sam $$opts{path}/dat/mpileup.1.sam $spill.tmp && cmp $spill.lz4.sam $spill.$codec.sam");
+    }
+    test_cmd($opts, out=>"dat/empty.expected",
+             out_map=>{"collate/3_fast_collate_with_tmp.sam" => "collate/2_fast_collate_with_tmp_used.sam.expected"}, ignore_pg_header => 1,
+             cmd=>"$$opts{bin}/samtools collate${threads} --output-fmt=sam -f -r 4 -m 1 $$opts{path}/collate/fast_collate.sam -o $$opts{path}/collate/3_fast_collate_with_tmp.sam");
+
     # Output to file
     test_cmd($opts, out=>"dat/empty.expected",
              out_map=>{"collate/collate1.tmp.sam"
@@ -3451,7 +4251,7 @@ sub test_fixmate
 
     # fixmate -M base-modification tests
     foreach (qw/ok+ ok- draft not_updated not_updated_noML not_updated_noMN
-                bad_MN MN_only ML_only ML_wrong_len noseq bounds/) {
+                bad_MN MN_only ML_only ML_wrong_len noseq bounds edit/) {
         test_cmd($opts,
                  out=>"fixmate/mod_$_.sam.expected",
                  ignore_pg_header => 1,
@@ -3484,6 +4284,45 @@ sub test_reference
 
     test_cmd($opts,out=>'reference/mpileup.MD.fa.reg.tmp.expected', cmd=>"$$opts{bin}/samtools reference${threads} -r 17:1000-1500 test/reference/mpileup.1.tmp.cram");
     test_cmd($opts,out=>'reference/mpileup.embed.fa.reg.tmp.expected', cmd=>"$$opts{bin}/samtools reference${threads} -r 17:1000-1500 -e test/reference/mpileup.1.tmp.cram");
+
+    # References longer than the 1Mbp segments the MD:Z mode shares out
+    # between threads, with reads across the segment boundaries and reads
+    # disagreeing on a base, so the later one wins.  The threaded output
+    # must match the serial one.
+    my $long = "$$opts{tmp}/reference.long" . (exists($args{threads}) ? ".t$args{threads}" : "");
+    my @refs = (['c1', 2200000, 0, 1048550, 1048560, 2097140, 2199900],
+                ['c2', 1000, 100],
+                ['c3', 1100000, 500000, 1048570]);
+    my @bases = qw(A C G T);
+    my $base = sub { return ($_[0] * 7 + int($_[0] / 3)) % 4; };
+    my $seq = sub { return join("", map { $bases[$base->($_)] } @_); };
+    open(my $sam, '>', "$long.sam") || die "Couldn't write $long.sam : $!\n";
+    print $sam "\@HD\tVN:1.6\tSO:coordinate\n";
+    print $sam map { "\@SQ\tSN:$$_[0]\tLN:$$_[1]\n" } @refs;
+    my $n = 0;
+    foreach my $r (@refs) {
+        my ($name, $len, @pos) = @$r;
+        foreach my $p (@pos) {
+            my $q = $p + 10;
+            my $mis = $seq->($q .. $q + 39);
+            substr($mis, 10, 1) = $bases[($base->($q + 10) + 1) % 4];
+            print $sam join("\t", "r" . $n++, 0, $name, $p + 1, 60, "40M", "*", 0, 0,
+                            $seq->($p .. $p + 39), "*", "MD:Z:40"), "\n";
+            print $sam join("\t", "r" . $n++, 0, $name, $p + 6, 60, "20M2D20M", "*", 0, 0,
+                            $seq->($p + 5 .. $p + 24, $p + 27 .. $p + 46), "*",
+                            "MD:Z:20^" . $seq->($p + 25, $p + 26) . "20"), "\n";
+            print $sam join("\t", "r" . $n++, 0, $name, $q + 1, 60, "40M", "*", 0, 0,
+                            $mis, "*", "MD:Z:10" . $bases[($base->($q + 10) + 2) % 4] . "29"), "\n";
+        }
+    }
+    close($sam) || die "Couldn't write $long.sam : $!\n";
+    cmd("$$opts{bin}/samtools sort --no-PG -o $long.bam $long.sam");
+    cmd("$$opts{bin}/samtools index $long.bam");
+    foreach my $reg ("", "-r c1:1048000-2097500", "-r c3") {
+        cmd("$$opts{bin}/samtools reference $reg $long.bam > $long.serial.fa");
+        test_cmd($opts, out=>'dat/empty.expected',
+                 cmd=>"$$opts{bin}/samtools reference -@ 3 $reg $long.bam | cmp - $long.serial.fa");
+    }
 }
 
 sub test_calmd
@@ -3496,6 +4335,27 @@ sub test_calmd
     my $out = cmd($test);
     if (substr($out, 0, 2) eq "\x1f\x8b") { passed($opts,msg=>$test); }
     else { failed($opts,msg=>$test,reason=>"Expected BGZF-compressed output"); }
+
+    # Several batches of records, switching between the references and
+    # going back to ones already released, should give the same output
+    # from the shared reference cache with threads as without
+    return unless exists($args{threads});
+    my $many = "$$opts{tmp}/calmd.many.sam";
+    open(my $in, '<', "$$opts{path}/dat/view.001.sam") || die "view.001.sam: $!";
+    my @hdr = grep { /^\@/ } <$in>;
+    seek($in, 0, 0);
+    my @recs = grep { !/^\@/ } <$in>;
+    close($in);
+    open(my $fh, '>', $many) || die "$many: $!";
+    print $fh grep { !/^\@HD/ } @hdr;
+    for (my $i = 0; $i < 100; $i++) { print $fh map { "c$i.$_" } @recs; }
+    close($fh) || die "$many: $!";
+    foreach my $opt ("", " -eA")
+    {
+        my $serial = "$$opts{tmp}/calmd.many.out";
+        cmd("$$opts{bin}/samtools calmd --no-PG$opt $many $$opts{path}/dat/view.001.fa > $serial 2>/dev/null");
+        test_cmd($opts,out=>'dat/empty.expected',cmd=>"$$opts{bin}/samtools calmd${threads} --no-PG$opt $many $$opts{path}/dat/view.001.fa 2>/dev/null | cmp - $serial");
+    }
 }
 
 sub test_idxstat
@@ -3505,6 +4365,31 @@ sub test_idxstat
     test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats $$opts{path}/dat/test_input_1_a.bam", expect_fail=>0);
     test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats $$opts{path}/dat/test_input_1_a.cram", expect_fail=>0);
     test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats $$opts{path}/dat/test_input_1_a.sam", expect_fail=>0);
+    test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats -\@2 $$opts{path}/dat/test_input_1_a.cram", expect_fail=>0);
+
+    # An indexed CRAM file is counted a reference at a time with -@
+    cmd("cp $$opts{path}/dat/test_input_1_a.cram $$opts{tmp}/idxstats.cram");
+    cmd("$$opts{bin}/samtools index $$opts{tmp}/idxstats.cram");
+    test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats -\@2 $$opts{tmp}/idxstats.cram", expect_fail=>0);
+
+    # Saving the counts, then reusing them.  The saved counts are replaced
+    # by made up ones, so the output shows whether they were used.
+    my $cache = "$$opts{tmp}/idxstats_cache.cram";
+    cmd("cp $$opts{path}/dat/test_input_1_a.cram $cache");
+    test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats -C $cache", expect_fail=>0);
+    test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', cmd=>"tail -n +2 $cache.idxstats");
+    my @st = stat($cache);
+    open(my $fh, '>', "$cache.idxstats") or error("$cache.idxstats: $!");
+    print $fh "#idxstats\t$st[7]\t$st[9]\n";
+    open(my $in, '<', "$$opts{path}/idxstats/test_input_1_a.cache.expected") or error("test_input_1_a.cache.expected: $!");
+    print $fh $_ while (<$in>);
+    close($in);
+    close($fh) or error("$cache.idxstats: $!");
+    test_cmd($opts,out=>'idxstats/test_input_1_a.cache.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats -C $cache", expect_fail=>0);
+
+    # The cache is ignored once the file changes
+    utime(978307200, 978307200, $cache) or error("$cache: $!");
+    test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats -C $cache", expect_fail=>0);
 }
 
 sub test_quickcheck
@@ -3538,6 +4423,28 @@ sub test_quickcheck
 
     test_cmd($opts, out => 'dat/empty.expected', want_fail => 0,
         cmd => "$$opts{bin}/samtools quickcheck -uv $$opts{path}/quickcheck/10.quickcheck.notargets.bam | sed 's,.*/quickcheck/,,'");
+
+    # Deep check, with and without threads
+    test_cmd($opts, out => 'quickcheck/all.expected', want_fail => 1,
+        cmd => "$$opts{bin}/samtools quickcheck -d -v $all_testfiles | sed 's,.*/quickcheck/,,'");
+    test_cmd($opts, out => 'quickcheck/all.expected', want_fail => 1,
+        cmd => "$$opts{bin}/samtools quickcheck -d -\@2 -v $all_testfiles | sed 's,.*/quickcheck/,,'");
+
+    # A bad CRC32 in the second block is only found by the deep check
+    open(my $in, '<:raw', "$$opts{path}/quickcheck/3.quickcheck.ok.bam") || die "$!";
+    local $/;
+    my $bam = <$in>;
+    close($in);
+    substr($bam, 1192, 1) = chr(ord(substr($bam, 1192, 1)) ^ 0xff);
+    open(my $out, '>:raw', "$$opts{tmp}/quickcheck.badcrc.bam") || die "$!";
+    print $out $bam;
+    close($out);
+    test_cmd($opts, out => 'dat/empty.expected', want_fail => 0,
+        cmd => "$$opts{bin}/samtools quickcheck $$opts{tmp}/quickcheck.badcrc.bam");
+    test_cmd($opts, out => 'dat/empty.expected', want_fail => 1,
+        cmd => "$$opts{bin}/samtools quickcheck -q -d $$opts{tmp}/quickcheck.badcrc.bam");
+    test_cmd($opts, out => 'dat/empty.expected', want_fail => 1,
+        cmd => "$$opts{bin}/samtools quickcheck -q -d -\@2 $$opts{tmp}/quickcheck.badcrc.bam");
 }
 
 sub test_reheader
@@ -3592,6 +4499,23 @@ sub test_reheader
              exp_fix=>1,
              reorder_header => 1);
 
+    # BAM in-place, into a file with a larger header to make room
+    system("(grep '^\@' $fn.sam; perl -e 'print qq{\\\@CO\\t\$_\\n} for 1..20000') > $fn.tmp.big.sam") == 0 or die "failed to create header: $?";
+    system("(cat $fn.tmp.big.sam; grep -v '^\@' $fn.sam) | $$opts{bin}/samtools view -b --no-PG -o $fn.tmp.inplace.bam") == 0 or die "failed to create bam: $?";
+    system("cp $fn.tmp.bam $fn.tmp.small.bam") == 0 or die "failed to copy bam: $?";
+    test_cmd($opts,
+             out=>'reheader/1_view1.sam.expected',
+             err=>'reheader/1_view1.sam.expected.err',
+             cmd=>"$$opts{bin}/samtools reheader --in-place $$opts{path}/reheader/hdr.sam $fn.tmp.inplace.bam && $$opts{bin}/samtools view -h --no-PG $fn.tmp.inplace.bam | perl -pe 's/\tVN:.*//'",
+             exp_fix=>1,
+             reorder_header => 1);
+
+    # Too big to fit in the space of the old header
+    test_cmd($opts,
+             out=>'dat/empty.expected',
+             cmd=>"$$opts{bin}/samtools reheader --in-place $fn.tmp.big.sam $fn.tmp.small.bam",
+             want_fail=>1);
+
     test_cmd($opts,
              out=>'reheader/4_view1.sam.expected',
              err=>'reheader/1_view1.sam.expected.err',
@@ -3631,11 +4555,41 @@ sub test_markdup
     test_cmd($opts, out=>'markdup/3_missing_mc.expected.sam', err=>'3_missing_mc.expected.sam.err', cmd=>"$$opts{bin}/samtools markdup${threads} -O sam --no-PG $$opts{path}/markdup/3_missing_mc.sam -", expect_fail=>1);
     test_cmd($opts, out=>'markdup/4_missing_ms.expected.sam', err=>'4_missing_ms.expected.sam.err', cmd=>"$$opts{bin}/samtools markdup${threads} -O sam --no-PG $$opts{path}/markdup/4_missing_ms.sam -", expect_fail=>1);
     test_cmd($opts, out=>'markdup/5_markdup.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -O sam --no-PG $$opts{path}/markdup/5_markdup.sam -");
+    test_cmd($opts, out=>'markdup/5_markdup.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} --mate-window 1000 -O sam --no-PG $$opts{path}/markdup/5_markdup_no_mate_tags.sam -");
+    test_cmd($opts, out=>'markdup/5_markdup.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} --mate-window 1000 -O sam --no-PG $$opts{path}/markdup/5_markdup_part_mate_tags.sam -");
+    my $progress = "$$opts{tmp}/markdup.progress" . (exists($args{threads}) ? ".t$args{threads}" : "");
+    test_cmd($opts, out=>'markdup/5_markdup.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} --progress $progress --progress-interval 4 -O sam --no-PG $$opts{path}/markdup/5_markdup.sam - && test -s $progress");
+    foreach my $bad ("", "0", "-4", "4x", "99999999999999999999") {
+        test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools markdup${threads} --progress $progress --progress-interval '$bad' -O sam --no-PG $$opts{path}/markdup/5_markdup.sam -", want_fail=>1);
+    }
+    test_cmd($opts, out=>'markdup/5_markdup.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} --mate-window 1000 -O sam --no-PG $$opts{path}/markdup/5_markdup.sam -");
+    # Pairs out of reach of --mate-window but already through fixmate are
+    # still marked as pairs; C1 and C2 are not duplicates as pairs
+    test_cmd($opts, out=>'markdup/19_distant_mates.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -O sam --no-PG $$opts{path}/markdup/19_distant_mates.sam -");
+    test_cmd($opts, out=>'markdup/19_distant_mates.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} --mate-window 100 -O sam --no-PG $$opts{path}/markdup/19_distant_mates.sam -");
+    foreach my $bad ("", "-1", "10x", "99999999999") {
+        test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools markdup${threads} --mate-window '$bad' -O sam --no-PG $$opts{path}/markdup/5_markdup.sam -", want_fail=>1);
+    }
     test_cmd($opts, out=>'markdup/6_remove_dups.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -O sam -r --no-PG $$opts{path}/markdup/6_remove_dups.sam -");
     test_cmd($opts, out=>'markdup/7_mark_supp_dup.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -S -O sam --no-PG $$opts{path}/markdup/7_mark_supp_dup.sam -");
+    test_cmd($opts, out=>'markdup/7_mark_supp_dup.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -S --max-dup-mem 1 -O sam --no-PG $$opts{path}/markdup/7_mark_supp_dup.sam -");
+    foreach my $bad ("", "1x", "1KB", "-5", "99999999999G") {
+        test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools markdup${threads} -S --max-dup-mem '$bad' -O sam --no-PG $$opts{path}/markdup/7_mark_supp_dup.sam -", want_fail=>1);
+    }
+    test_cmd($opts, out=>'markdup/7_mark_supp_dup.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -S --tmp-codec lz4-dict -O sam --no-PG $$opts{path}/markdup/7_mark_supp_dup.sam -");
+    test_cmd($opts, out=>'markdup/7_mark_supp_dup.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -S --tmp-codec deflate -O sam --no-PG $$opts{path}/markdup/7_mark_supp_dup.sam -");
+    # With -S every record goes through the temporary file, so this one
+    # holds several groups.  The output must match that of the default codec.
+    my $spill = "$$opts{tmp}/markdup_spill" . (exists($args{threads}) ? ".t$args{threads}" : "");
+    cmd("$$opts{bin}/samtools collate -O -u $$opts{path}/dat/mpileup.1.sam | $$opts{bin}/samtools fixmate -m -u - - | $$opts{bin}/samtools sort -u -o $spill.bam -");
+    cmd("$$opts{bin}/samtools markdup${threads} -S -O sam --no-PG $spill.bam $spill.lz4.sam");
+    foreach my $codec (qw(lz4-dict deflate)) {
+        test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools markdup${threads} -S --tmp-codec $codec -O sam --no-PG $spill.bam $spill.$codec.sam && cmp $spill.lz4.sam $spill.$codec.sam");
+    }
     test_cmd($opts, out=>'markdup/8_optical_dup.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -S -d 100 --mode s -t -O sam --no-PG $$opts{path}/markdup/8_optical_dup.sam -");
     test_cmd($opts, out=>'markdup/9_optical_dup_qcfail.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -S -d 2500 --mode s -t --include-fails -O sam --no-PG $$opts{path}/markdup/9_optical_dup_qcfail.sam -");
     test_cmd($opts, out=>'markdup/10_optical_chain.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -S -d 2500 --mode s -t -O sam --no-PG -S $$opts{path}/markdup/10_optical_chain.sam -");
+    test_cmd($opts, out=>'markdup/10_optical_chain.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -S -d 2500 --mode s -t -O sam --no-PG --max-dup-mem 1 $$opts{path}/markdup/10_optical_chain.sam -");
     test_cmd($opts, out=>'markdup/10_optical_chain.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -S -d 2500 --mode s -t -O sam --read-coords '([[:digit:]]+):([[:digit:]]+):([[:digit:]]+)\$' --no-PG -S $$opts{path}/markdup/10_optical_chain.sam -");
     test_cmd($opts, out=>'markdup/11_optical_dup_regex.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -S -d 100 --mode s -t -O sam --read-coords '^([0-9]+):([0-9]+):([[:print:]]+)' --coords-order xyt --no-PG $$opts{path}/markdup/11_optical_dup_regex.sam -");
     test_cmd($opts, out=>'markdup/11_optical_dup_regex.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} -S -d 100 --mode s -t -O sam --read-coords '^([0-9]+):([0-9]+)' --coords-order xy --no-PG $$opts{path}/markdup/11_optical_dup_regex.sam -");
@@ -3648,6 +4602,49 @@ sub test_markdup
     test_cmd($opts, out=>'markdup/18_primary_duplicate_count.expected.sam', cmd=>"$$opts{bin}/samtools markdup${threads} --mode t -t -O sam --no-PG --duplicate-count --barcode-tag BC -S $$opts{path}/markdup/18_primary_duplicate_count.sam -");
 }
 
+sub test_rmdup
+{
+    my ($opts,%args) = @_;
+
+    my $threads = exists($args{threads}) ? " -@ $args{threads}" : "";
+    my $out = "$$opts{tmp}/rmdup" . (exists($args{threads}) ? ".t$args{threads}" : "");
+    test_cmd($opts, out=>'rmdup/1_pe.expected.sam', cmd=>"$$opts{bin}/samtools rmdup${threads} $$opts{path}/rmdup/1_pe.sam $out.1_pe.sam && cat $out.1_pe.sam");
+    test_cmd($opts, out=>'rmdup/1_pe.force_se.expected.sam', cmd=>"$$opts{bin}/samtools rmdup${threads} -S $$opts{path}/rmdup/1_pe.sam $out.1_pe_S.sam && cat $out.1_pe_S.sam");
+    test_cmd($opts, out=>'rmdup/2_se.expected.sam', cmd=>"$$opts{bin}/samtools rmdup${threads} -s $$opts{path}/rmdup/2_se.sam $out.2_se.sam && cat $out.2_se.sam");
+    test_cmd($opts, out=>'rmdup/2_se.expected.sam', cmd=>"$$opts{bin}/samtools rmdup${threads} -S $$opts{path}/rmdup/2_se.sam $out.2_se_S.sam && cat $out.2_se_S.sam");
+}
+
+sub test_pipeline
+{
+    my ($opts,%args) = @_;
+
+    my $threads = exists($args{threads}) ? " -@ $args{threads}" : "";
+    my $stage_threads = exists($args{threads}) ? " -@ 1" : "";
+    my $pipeline = "$$opts{bin}/samtools pipeline${threads}";
+
+    # Sort reading from, and writing to, another stage
+    test_cmd($opts, out=>"sort/pos.sort.expected.sam", ignore_pg_header => 1, cmd=>"$pipeline view $$opts{path}/dat/test_input_1_a.bam :: sort${stage_threads} -m 10M -O SAM -o -");
+    test_cmd($opts, out=>"sort/pos.sort.expected.sam", ignore_pg_header => 1, cmd=>"$pipeline view $$opts{path}/dat/test_input_1_a.bam :: sort${stage_threads} -m 1M :: view -h");
+    test_cmd($opts, out=>"sort/name.sort.expected.sam", ignore_pg_header => 1, cmd=>"$pipeline view $$opts{path}/dat/test_input_1_a.bam :: sort${stage_threads} -n -m 1M :: view -h");
+
+    # Markdup
+    test_cmd($opts, out=>'markdup/5_markdup.expected.sam', cmd=>"$pipeline view${stage_threads} --no-PG $$opts{path}/markdup/5_markdup.sam :: markdup${stage_threads} -O sam --no-PG - -");
+    test_cmd($opts, out=>'markdup/7_mark_supp_dup.expected.sam', cmd=>"$pipeline view --no-PG $$opts{path}/markdup/7_mark_supp_dup.sam :: markdup${stage_threads} -S --no-PG - - :: view -h --no-PG");
+
+    # Errors
+    test_cmd($opts, out=>"dat/empty.expected", cmd=>"$pipeline view $$opts{path}/dat/test_input_1_a.bam :: sort :: sort", want_fail=>1);
+    test_cmd($opts, out=>"dat/empty.expected", cmd=>"$pipeline view $$opts{path}/dat/test_input_1_a.bam :: flagstat", want_fail=>1);
+    test_cmd($opts, out=>"dat/empty.expected", cmd=>"$pipeline view $$opts{path}/dat/test_input_1_a.bam :: view - 1:100-200", want_fail=>1);
+    test_cmd($opts, out=>"dat/empty.expected", cmd=>"$pipeline view $$opts{path}/dat/test_input_1_a.bam :: markdup - - ::", want_fail=>1);
+    test_cmd($opts, out=>"dat/empty.expected", cmd=>"$pipeline view --affinity node $$opts{path}/dat/test_input_1_a.bam :: view", want_fail=>1);
+    test_cmd($opts, out=>"dat/empty.expected", cmd=>"$pipeline --affinity bogus view $$opts{path}/dat/test_input_1_a.bam :: view", want_fail=>1);
+
+    # Thread placement for the shared pool
+    foreach my $mode (qw(none node spread)) {
+        test_cmd($opts, out=>"sort/pos.sort.expected.sam", ignore_pg_header => 1, cmd=>"$pipeline --affinity $mode view $$opts{path}/dat/test_input_1_a.bam :: sort${stage_threads} -m 1M :: view -h");
+    }
+}
+
 sub test_bedcov
 {
     my ($opts,%args) = @_;
@@ -3792,6 +4789,24 @@ sub test_ampliconclip
              },
              cmd=>"$$opts{bin}/samtools ampliconclip${threads} --no-PG --output-fmt=sam --keep-tag --primer-counts $$opts{path}/ampliconclip/primer_counts.tsv -b $$opts{path}/ampliconclip/multi_ref.bed $$opts{path}/ampliconclip/3_multi_ref_data.sam");
     test_cmd($opts, out=>'ampliconclip/4_total_hc_data.expected.sam', cmd=>"$$opts{bin}/samtools ampliconclip${threads} --no-PG --output-fmt=sam --hard-clip -b $$opts{path}/ampliconclip/ac_test2.bed $$opts{path}/ampliconclip/4_total_hc_data.sam");
+
+    # Enough records for several batches per thread, checked against a
+    # run without threads
+    return if (!exists($args{threads}));
+    my $big = "$$opts{tmp}/ampliconclip.big.sam";
+    my $out = "$$opts{tmp}/ampliconclip.big.t$args{threads}";
+    open(my $in, '<', "$$opts{path}/ampliconclip/1_test_data.sam") || die "$$opts{path}/ampliconclip/1_test_data.sam: $!";
+    my @lines = <$in>;
+    close($in);
+    open(my $fh, '>', $big) || die "$big: $!";
+    print $fh grep { /^@/ } @lines;
+    my @recs = grep { !/^@/ } @lines;
+    for (my $i = 0; $i < 1000; $i++) { print $fh @recs; }
+    close($fh) || die "$big: $!";
+    my $clip = "ampliconclip --no-PG --keep-tag --output-fmt=sam --strand -b $$opts{path}/ampliconclip/ac_test.bed";
+    cmd("$$opts{bin}/samtools $clip --primer-counts $out.counts.expected -f $out.stats $big > $out.expected.sam");
+    cmd("grep -v '^COMMAND' $out.stats > $out.stats.expected");
+    test_cmd($opts, out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools $clip${threads} --primer-counts $out.counts -f $out.stats $big | cmp - $out.expected.sam && cmp $out.counts $out.counts.expected && grep -v '^COMMAND' $out.stats | cmp - $out.stats.expected");
 }
 
 sub test_ampliconstats
@@ -3850,4 +4865,32 @@ sub test_reset
     test_cmd($opts, out=>"reset/empty.expected", err=>"reset/empty.expected", hskip=>1, ignore_pg_header=>1, out_map=>{"reset/output" => "reset/output.flg.1.expected"}, cmd=>"$$opts{bin}/samtools reset  --dupflag $$opts{bin}/test/reset/seq.sam -o $$opts{bin}/test/reset/output");
     #flag update default
     test_cmd($opts, out=>"reset/empty.expected", err=>"reset/empty.expected", hskip=>1, ignore_pg_header=>1, out_map=>{"reset/output" => "reset/output.flg.2.expected"}, cmd=>"$$opts{bin}/samtools reset $$opts{bin}/test/reset/seq.sam -o $$opts{bin}/test/reset/output");
+    #threaded, with reverse flip and tag removal
+    test_cmd($opts, out=>"reset/empty.expected", err=>"reset/empty.expected", hskip=>1, ignore_pg_header=>1, out_map=>{"reset/output" => "reset/output.flg.1.expected"}, cmd=>"$$opts{bin}/samtools reset -@ 2 --dupflag $$opts{bin}/test/reset/seq.sam -o $$opts{bin}/test/reset/output");
+    test_cmd($opts, out=>"reset/empty.expected", err=>"reset/empty.expected", hskip=>1, ignore_pg_header=>1, out_map=>{"reset/output" => "reset/output.keep.2.expected"}, cmd=>"$$opts{bin}/samtools reset -@ 2 --dupflag --reject-PG bwa_index $$opts{bin}/test/dat/mpileup.1.sam --no-RG -x X0,X1,MD -o $$opts{bin}/test/reset/output");
+}
+
+sub test_phase
+{
+    my ($opts, %args) = @_;
+
+    # chr2 has reads spanning 18 variants, so fragments must grow.
+    # EV lines for fragments starting at the same variant are printed in
+    # hash order, so they are sorted before comparing.
+    my $out = "$$opts{tmp}/phase.out";
+    foreach my $k ("", " -k 2") {
+        test_cmd($opts, out=>"phase/phase.expected", cmd=>"$$opts{bin}/samtools phase$k $$opts{path}/phase/phase.sam > $out && grep -v '^EV' $out && grep '^EV' $out | LC_ALL=C sort");
+    }
+}
+
+sub test_tview
+{
+    my ($opts, %args) = @_;
+
+    # With -V, reads up to a screen width before the view are laid out too:
+    # H ends before the view but takes the second row, so B is on the third.
+    my $bam = "$$opts{tmp}/tview.stacked.bam";
+    cmd("$$opts{bin}/samtools view -b --no-PG -o $bam $$opts{path}/tview/stacked.sam");
+    cmd("$$opts{bin}/samtools index $bam");
+    test_cmd($opts, out=>'tview/stacked.V.expected', cmd=>"$$opts{bin}/samtools tview -d T -V -w 40 -p tv1:41 $bam $$opts{path}/tview/stacked.fa");
 }
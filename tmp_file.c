@@ -34,9 +34,11 @@ DEALINGS IN THE SOFTWARE
 #include <stdarg.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <zlib.h>
 
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
 #endif /* _WIN32 */
 
 #include "tmp_file.h"
@@ -57,6 +59,7 @@ tmp_print_error(tmp_file_t *tmp, const char *fmt, ...) {
 
 static int tmp_file_init(tmp_file_t *tmp, int verbose) {
     tmp->stream       = LZ4_createStream();
+    tmp->dstream      = NULL;
     tmp->data_size    = 0;
     tmp->group_size   = TMP_SAM_GROUP_SIZE;
     tmp->input_size   = 0;
@@ -73,6 +76,18 @@ static int tmp_file_init(tmp_file_t *tmp, int verbose) {
     tmp->verbose = verbose;
     tmp->dict = NULL;
     tmp->groups_written = 0;
+    tmp->indexed = 0;
+    tmp->codec = TMP_SAM_CODEC_LZ4;
+    tmp->dict_size = 0;
+    tmp->index = NULL;
+    tmp->nindex = tmp->mindex = 0;
+    tmp->write_offset = 0;
+    tmp->next_group = 0;
+    tmp->pool = NULL;
+    tmp->queue = NULL;
+    tmp->jobs = NULL;
+    tmp->njobs = tmp->next_job = tmp->in_flight = 0;
+    tmp->cur = NULL;
 
     if (!tmp->ring_buffer || !tmp->comp_buffer || !tmp->stream) {
         tmp_print_error(tmp, "[tmp_file] Error: unable to allocate compression buffers.\n");
@@ -145,6 +160,587 @@ int tmp_file_open_write(tmp_file_t *tmp, char *tmp_name, int verbose) {
 }
 
 
+/*
+ * Indexed mode.  Alignments are gathered into the input of the next free
+ * group and each full group is compressed on its own, on the thread pool
+ * if there is one.  Finished groups are written in order as a size_t
+ * compressed size, a size_t uncompressed size and the data, and the
+ * position of each is kept in the index.  Reading uses the index to
+ * fetch groups with pread, so it does not disturb the file position and
+ * any number of groups can be read at once.  With a thread pool the next
+ * few groups are read and decompressed ahead of the one being returned.
+ */
+static int tmp_file_init_groups(tmp_file_t *tmp, int njobs) {
+    if (tmp->groups_written || tmp->entry_number) {
+        tmp_print_error(tmp, "[tmp_file] Error: indexing set after writing.\n");
+        return TMP_SAM_INPUT_ERROR;
+    }
+
+    free(tmp->jobs);
+
+    if ((tmp->jobs = calloc(njobs, sizeof(*tmp->jobs))) == NULL) {
+        tmp_print_error(tmp, "[tmp_file] Error: unable to allocate memory for groups.\n");
+        return TMP_SAM_MEM_ERROR;
+    }
+
+    // The ring buffer is only used for the single stream
+    free(tmp->ring_buffer);
+    free(tmp->comp_buffer);
+    tmp->ring_buffer = NULL;
+    tmp->comp_buffer = NULL;
+    tmp->njobs = njobs;
+    tmp->next_job = tmp->in_flight = 0;
+    tmp->indexed = 1;
+
+    return TMP_SAM_OK;
+}
+
+
+int tmp_file_set_indexed(tmp_file_t *tmp) {
+    if (tmp->indexed)
+        return TMP_SAM_OK;
+
+    return tmp_file_init_groups(tmp, 1);
+}
+
+
+int tmp_file_set_codec(tmp_file_t *tmp, int codec) {
+    int ret;
+
+    if (codec < TMP_SAM_CODEC_LZ4 || codec > TMP_SAM_CODEC_DEFLATE) {
+        tmp_print_error(tmp, "[tmp_file] Error: unknown codec %d.\n", codec);
+        return TMP_SAM_INPUT_ERROR;
+    }
+
+    if ((ret = tmp_file_set_indexed(tmp)))
+        return ret;
+
+    if (tmp->groups_written || tmp->entry_number) {
+        tmp_print_error(tmp, "[tmp_file] Error: codec set after writing.\n");
+        return TMP_SAM_INPUT_ERROR;
+    }
+
+    tmp->codec = codec;
+
+    return TMP_SAM_OK;
+}
+
+
+int tmp_file_codec(const char *name) {
+    if (strcmp(name, "lz4") == 0)
+        return TMP_SAM_CODEC_LZ4;
+    if (strcmp(name, "lz4-dict") == 0)
+        return TMP_SAM_CODEC_LZ4_DICT;
+    if (strcmp(name, "deflate") == 0)
+        return TMP_SAM_CODEC_DEFLATE;
+
+    return -1;
+}
+
+
+int tmp_file_set_thread_pool(tmp_file_t *tmp, hts_tpool *pool) {
+    int ret, njobs;
+
+    if (!pool || tmp->pool)
+        return TMP_SAM_OK;
+
+    njobs = 2 * hts_tpool_size(pool);
+    if (njobs > TMP_SAM_MAX_JOBS)
+        njobs = TMP_SAM_MAX_JOBS;
+    if (njobs < 2)
+        njobs = 2;
+
+    if ((ret = tmp_file_init_groups(tmp, njobs)))
+        return ret;
+
+    if ((tmp->queue = hts_tpool_process_init(pool, tmp->njobs, 0)) == NULL) {
+        tmp_print_error(tmp, "[tmp_file] Error: unable to set up threaded compression.\n");
+        return TMP_SAM_MEM_ERROR;
+    }
+
+    tmp->pool = pool;
+
+    return TMP_SAM_OK;
+}
+
+
+static int tmp_file_group_grow(uint8_t **buf, size_t *alloc, size_t size) {
+    uint8_t *tmp_buf;
+
+    if (size <= *alloc)
+        return 0;
+
+    kroundup_size_t(size);
+    if ((tmp_buf = realloc(*buf, size)) == NULL)
+        return -1;
+
+    *buf = tmp_buf;
+    *alloc = size;
+    return 0;
+}
+
+
+// Reads len bytes at offset without moving the file position.
+static int tmp_file_pread(int fd, uint8_t *buf, size_t len, off_t offset) {
+    while (len > 0) {
+    #ifdef _WIN32
+        OVERLAPPED ov = {0};
+        DWORD got;
+        DWORD want = len > 0x40000000 ? 0x40000000 : (DWORD)len;
+
+        ov.Offset = (DWORD)((uint64_t)offset & 0xffffffff);
+        ov.OffsetHigh = (DWORD)((uint64_t)offset >> 32);
+
+        if (!ReadFile((HANDLE)_get_osfhandle(fd), buf, want, &got, &ov) || got == 0)
+            return -1;
+    #else
+        ssize_t got = pread(fd, buf, len, offset);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+
+        if (got <= 0)
+            return -1;
+    #endif /* _WIN32 */
+
+        buf += got;
+        len -= got;
+        offset += got;
+    }
+
+    return 0;
+}
+
+
+static int tmp_file_deflate(tmp_file_group_t *job) {
+    z_stream zs;
+    int ret = TMP_SAM_ZLIB_ERROR;
+
+    memset(&zs, 0, sizeof(zs));
+    // Raw deflate, as the sizes are kept in the file already
+    if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return TMP_SAM_ZLIB_ERROR;
+
+    if (job->dict && deflateSetDictionary(&zs, (const Bytef *)job->dict,
+                                          job->dict_size) != Z_OK)
+        goto out;
+
+    if (tmp_file_group_grow(&job->out, &job->out_alloc,
+                            deflateBound(&zs, job->in_size)) < 0) {
+        ret = TMP_SAM_MEM_ERROR;
+        goto out;
+    }
+
+    zs.next_in = job->in;
+    zs.avail_in = job->in_size;
+    zs.next_out = job->out;
+    zs.avail_out = job->out_alloc;
+
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+        job->out_size = zs.total_out;
+        ret = TMP_SAM_OK;
+    }
+
+ out:
+    deflateEnd(&zs);
+    return ret;
+}
+
+
+static int tmp_file_inflate(tmp_file_group_t *job) {
+    z_stream zs;
+    int ret = TMP_SAM_ZLIB_ERROR;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK)
+        return TMP_SAM_ZLIB_ERROR;
+
+    if (job->dict && inflateSetDictionary(&zs, (const Bytef *)job->dict,
+                                          job->dict_size) != Z_OK)
+        goto out;
+
+    zs.next_in = job->in;
+    zs.avail_in = job->in_size;
+    zs.next_out = job->out;
+    zs.avail_out = job->raw_size;
+
+    if (inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == job->raw_size) {
+        job->out_size = zs.total_out;
+        ret = TMP_SAM_OK;
+    }
+
+ out:
+    inflateEnd(&zs);
+    return ret;
+}
+
+
+static void *tmp_file_compress_job(void *arg) {
+    tmp_file_group_t *job = (tmp_file_group_t *)arg;
+    int bound = LZ4_compressBound(job->in_size);
+
+    job->raw_size = job->in_size;
+
+    if (job->codec == TMP_SAM_CODEC_DEFLATE) {
+        job->ret = tmp_file_deflate(job);
+        return job;
+    }
+
+    job->ret = TMP_SAM_MEM_ERROR;
+    if (tmp_file_group_grow(&job->out, &job->out_alloc, bound) < 0)
+        return job;
+
+    if (job->dict) {
+        if (!job->lz4 && (job->lz4 = LZ4_createStream()) == NULL)
+            return job;
+
+        LZ4_resetStream(job->lz4);
+        LZ4_loadDict(job->lz4, job->dict, job->dict_size);
+        job->out_size = LZ4_compress_fast_continue(job->lz4, (const char *)job->in,
+                                                   (char *)job->out, job->in_size, bound, 1);
+    } else {
+        job->out_size = LZ4_compress_default((const char *)job->in, (char *)job->out,
+                                             job->in_size, bound);
+    }
+    job->ret = job->out_size ? TMP_SAM_OK : TMP_SAM_LZ4_ERROR;
+
+    return job;
+}
+
+
+static void *tmp_file_decompress_job(void *arg) {
+    tmp_file_group_t *job = (tmp_file_group_t *)arg;
+    int size;
+
+    job->ret = TMP_SAM_MEM_ERROR;
+    if (tmp_file_group_grow(&job->in, &job->in_alloc, job->in_size) < 0
+        || tmp_file_group_grow(&job->out, &job->out_alloc, job->raw_size) < 0)
+        return job;
+
+    job->ret = TMP_SAM_FILE_ERROR;
+    if (tmp_file_pread(job->fd, job->in, job->in_size, job->offset) < 0)
+        return job;
+
+    job->read_offset = 0;
+
+    if (job->codec == TMP_SAM_CODEC_DEFLATE) {
+        job->out_size = 0;
+        job->ret = tmp_file_inflate(job);
+        return job;
+    }
+
+    if (job->dict)
+        size = LZ4_decompress_safe_usingDict((const char *)job->in, (char *)job->out,
+                                             job->in_size, job->raw_size,
+                                             job->dict, job->dict_size);
+    else
+        size = LZ4_decompress_safe((const char *)job->in, (char *)job->out,
+                                   job->in_size, job->raw_size);
+    job->out_size = size > 0 ? size : 0;
+    job->ret = size >= 0 && (size_t)size == job->raw_size
+        ? TMP_SAM_OK : TMP_SAM_LZ4_ERROR;
+
+    return job;
+}
+
+
+// Writes out a compressed group and adds it to the index.
+static int tmp_file_write_group(tmp_file_t *tmp, tmp_file_group_t *job) {
+    tmp_file_index_t *idx;
+
+    if (job->ret) {
+        tmp_print_error(tmp, "[tmp_file] Error: compression failed.\n");
+        return job->ret;
+    }
+
+    if (tmp->nindex == tmp->mindex) {
+        size_t new_size = tmp->mindex ? tmp->mindex * 2 : 256;
+
+        if ((idx = realloc(tmp->index, new_size * sizeof(*idx))) == NULL) {
+            tmp_print_error(tmp, "[tmp_file] Error: unable to allocate memory for index.\n");
+            return TMP_SAM_MEM_ERROR;
+        }
+
+        tmp->index = idx;
+        tmp->mindex = new_size;
+    }
+
+    if (fwrite(&job->out_size, sizeof(size_t), 1, tmp->fp) < 1
+        || fwrite(&job->raw_size, sizeof(size_t), 1, tmp->fp) < 1
+        || fwrite(job->out, 1, job->out_size, tmp->fp) < job->out_size) {
+        tmp_print_error(tmp, "[tmp_file] Error: tmp file write data failed.\n");
+        return TMP_SAM_FILE_ERROR;
+    }
+
+    idx = &tmp->index[tmp->nindex++];
+    idx->offset = tmp->write_offset + 2 * sizeof(size_t);
+    idx->comp_size = job->out_size;
+    idx->raw_size = job->raw_size;
+    idx->dict = job->dict != NULL;
+    tmp->write_offset = idx->offset + job->out_size;
+    tmp->groups_written++;
+
+    return TMP_SAM_OK;
+}
+
+
+// Writes out the next compressed group from the thread pool, waiting for
+// it if block is set.  Returns 1 if none were ready.
+static int tmp_file_write_result(tmp_file_t *tmp, int block) {
+    hts_tpool_result *res;
+    tmp_file_group_t *job;
+
+    res = block ? hts_tpool_next_result_wait(tmp->queue)
+        : hts_tpool_next_result(tmp->queue);
+
+    if (!res)
+        return block ? TMP_SAM_MEM_ERROR : 1;
+
+    job = (tmp_file_group_t *)hts_tpool_result_data(res);
+    hts_tpool_delete_result(res, 0);
+    tmp->in_flight--;
+
+    return tmp_file_write_group(tmp, job);
+}
+
+
+// Compresses the group in the current job, or sends it off to be.
+static int tmp_file_dispatch_write(tmp_file_t *tmp) {
+    tmp_file_group_t *job = &tmp->jobs[tmp->next_job];
+    int ret;
+
+    tmp->input_size = 0;
+    tmp->entry_number = 0;
+
+    job->codec = tmp->codec;
+    job->dict = tmp->dict;
+    job->dict_size = tmp->dict_size;
+
+    if (tmp->codec != TMP_SAM_CODEC_LZ4 && !tmp->dict) {
+        // The first group is compressed without, and supplies the dictionary
+        size_t size = job->in_size < TMP_SAM_DICT_SIZE ? job->in_size : TMP_SAM_DICT_SIZE;
+
+        if ((tmp->dict = malloc(size)) == NULL) {
+            tmp_print_error(tmp, "[tmp_file] Error: unable to allocate memory for compression dictionary.\n");
+            return TMP_SAM_MEM_ERROR;
+        }
+
+        memcpy(tmp->dict, job->in + job->in_size - size, size);
+        tmp->dict_size = size;
+    }
+
+    if (!tmp->pool) {
+        tmp_file_compress_job(job);
+        return tmp_file_write_group(tmp, job);
+    }
+
+    if (hts_tpool_dispatch(tmp->pool, tmp->queue, tmp_file_compress_job,
+                           job) < 0) {
+        tmp_print_error(tmp, "[tmp_file] Error: unable to queue compression.\n");
+        return TMP_SAM_MEM_ERROR;
+    }
+
+    tmp->in_flight++;
+    tmp->next_job = (tmp->next_job + 1) % tmp->njobs;
+
+    // Write out whatever is finished, and make sure the next job is free
+    while ((ret = tmp_file_write_result(tmp, tmp->in_flight == tmp->njobs)) == 0)
+        ;
+
+    return ret < 0 ? ret : TMP_SAM_OK;
+}
+
+
+static void tmp_file_group_setup(tmp_file_t *tmp, size_t group, tmp_file_group_t *grp) {
+    grp->fd = fileno(tmp->fp);
+    grp->offset = tmp->index[group].offset;
+    grp->in_size = tmp->index[group].comp_size;
+    grp->raw_size = tmp->index[group].raw_size;
+    grp->codec = tmp->codec;
+    grp->dict = tmp->index[group].dict ? tmp->dict : NULL;
+    grp->dict_size = tmp->dict_size;
+}
+
+
+// Queues the next group in the file for reading into the next free job.
+// Returns 1 if queued, 0 at the end of the file or a negative number on
+// failure.
+static int tmp_file_read_ahead(tmp_file_t *tmp) {
+    tmp_file_group_t *job = &tmp->jobs[tmp->next_job];
+
+    if (tmp->next_group >= tmp->nindex)
+        return 0;
+
+    tmp_file_group_setup(tmp, tmp->next_group++, job);
+
+    if (hts_tpool_dispatch(tmp->pool, tmp->queue, tmp_file_decompress_job,
+                           job) < 0) {
+        tmp_print_error(tmp, "[tmp_file] Error: unable to queue decompression.\n");
+        return TMP_SAM_MEM_ERROR;
+    }
+
+    tmp->in_flight++;
+    tmp->next_job = (tmp->next_job + 1) % tmp->njobs;
+    return 1;
+}
+
+
+// Moves tmp->cur on to the next group to be read.  Returns 1 on success,
+// 0 at the end of the file or a negative number on failure.
+static int tmp_file_next_group(tmp_file_t *tmp) {
+    hts_tpool_result *res;
+    int ret;
+
+    if (!tmp->pool) {
+        if (tmp->next_group >= tmp->nindex)
+            return 0;
+
+        tmp->cur = &tmp->jobs[0];
+        if ((ret = tmp_file_read_group(tmp, tmp->next_group++, tmp->cur)))
+            return ret;
+
+        return 1;
+    }
+
+    // The finished group's job is free to read the next one into
+    if (tmp->cur) {
+        tmp->cur = NULL;
+        if ((ret = tmp_file_read_ahead(tmp)) < 0)
+            return ret;
+    }
+
+    if (tmp->in_flight == 0)
+        return 0;
+
+    if ((res = hts_tpool_next_result_wait(tmp->queue)) == NULL)
+        return TMP_SAM_MEM_ERROR;
+
+    tmp->cur = (tmp_file_group_t *)hts_tpool_result_data(res);
+    hts_tpool_delete_result(res, 0);
+    tmp->in_flight--;
+
+    if (tmp->cur->ret) {
+        tmp_print_error(tmp, "[tmp_file] Error: decompression failed.\n");
+        return tmp->cur->ret;
+    }
+
+    return 1;
+}
+
+
+// Waits for and discards any groups still in flight.
+static void tmp_file_drain(tmp_file_t *tmp) {
+    while (tmp->in_flight > 0) {
+        hts_tpool_result *res = hts_tpool_next_result_wait(tmp->queue);
+        if (!res)
+            break;
+        hts_tpool_delete_result(res, 0);
+        tmp->in_flight--;
+    }
+}
+
+
+int tmp_file_read_group(tmp_file_t *tmp, size_t group, tmp_file_group_t *grp) {
+    if (!tmp->indexed || group >= tmp->nindex) {
+        tmp_print_error(tmp, "[tmp_file] Error: no group %zu in tmp file.\n", group);
+        return TMP_SAM_INPUT_ERROR;
+    }
+
+    tmp_file_group_setup(tmp, group, grp);
+    tmp_file_decompress_job(grp);
+
+    if (grp->ret)
+        tmp_print_error(tmp, "[tmp_file] Error: unable to read group %zu.\n", group);
+
+    return grp->ret;
+}
+
+
+int tmp_file_group_next(tmp_file_t *tmp, tmp_file_group_t *grp, bam1_t *inbam) {
+    uint8_t *data = inbam->data;
+    uint32_t m_data = inbam->m_data;
+    const uint8_t *src;
+    int entry_size;
+
+    if (grp->read_offset >= grp->out_size)
+        return 0;
+
+    if (grp->out_size - grp->read_offset < sizeof(bam1_t)) {
+        tmp_print_error(tmp, "[tmp_file] Error: truncated group.\n");
+        return TMP_SAM_LZ4_ERROR;
+    }
+
+    src = grp->out + grp->read_offset;
+    memcpy(inbam, src, sizeof(bam1_t));
+    inbam->data = data;
+    inbam->m_data = m_data;
+
+    if (inbam->l_data < 0 || (size_t)inbam->l_data > grp->out_size
+        - grp->read_offset - sizeof(bam1_t)) {
+        tmp_print_error(tmp, "[tmp_file] Error: truncated group.\n");
+        return TMP_SAM_LZ4_ERROR;
+    }
+
+    if ((uint32_t)inbam->l_data > inbam->m_data) {
+        size_t new_size = inbam->l_data;
+        uint8_t *tmp_data;
+        kroundup_size_t(new_size);
+
+        if ((tmp_data = realloc(inbam->data, new_size)) == NULL) {
+            tmp_print_error(tmp, "[tmp_file] Error: unable to allocate tmp bam data memory.\n");
+            return TMP_SAM_MEM_ERROR;
+        }
+
+        inbam->data = tmp_data;
+        inbam->m_data = new_size;
+    }
+
+    memcpy(inbam->data, src + sizeof(bam1_t), inbam->l_data);
+    entry_size = sizeof(bam1_t) + inbam->l_data;
+    grp->read_offset += entry_size;
+
+    return entry_size;
+}
+
+
+void tmp_file_group_free(tmp_file_group_t *grp) {
+    free(grp->in);
+    free(grp->out);
+    LZ4_freeStream(grp->lz4);
+    memset(grp, 0, sizeof(*grp));
+}
+
+
+size_t tmp_file_group_count(tmp_file_t *tmp) {
+    return tmp->nindex;
+}
+
+
+int tmp_file_begin_read_group(tmp_file_t *tmp, size_t group) {
+    int i, ret;
+
+    if (!tmp->indexed) {
+        tmp_print_error(tmp, "[tmp_file] Error: tmp file is not indexed.\n");
+        return TMP_SAM_INPUT_ERROR;
+    }
+
+    // Drop anything left from an earlier read
+    tmp_file_drain(tmp);
+    tmp->next_job = 0;
+    tmp->cur = NULL;
+    tmp->next_group = group;
+
+    if (tmp->pool) {
+        for (i = 0; i < tmp->njobs; i++) {
+            if ((ret = tmp_file_read_ahead(tmp)) <= 0)
+                return ret;
+        }
+    }
+
+    return TMP_SAM_OK;
+}
+
+
 /*
  * The ring buffer stores precompressionn/post decompression data.  LZ4 requires that
  * previous data (64K worth) be available for efficient compression.  This function grows
@@ -250,6 +846,26 @@ static int tmp_file_write_to_file(tmp_file_t *tmp) {
  */
 int tmp_file_write(tmp_file_t *tmp, bam1_t *inbam) {
 
+    if (tmp->indexed) {
+        tmp_file_group_t *job = &tmp->jobs[tmp->next_job];
+
+        if (tmp_file_group_grow(&job->in, &job->in_alloc,
+                              tmp->input_size + sizeof(bam1_t) + inbam->l_data) < 0) {
+            tmp_print_error(tmp, "[tmp_file] Error: unable to allocate memory for group.\n");
+            return TMP_SAM_MEM_ERROR;
+        }
+
+        memcpy(job->in + tmp->input_size, inbam, sizeof(bam1_t));
+        memcpy(job->in + tmp->input_size + sizeof(bam1_t), inbam->data, inbam->l_data);
+        tmp->input_size += sizeof(bam1_t) + inbam->l_data;
+        job->in_size = tmp->input_size;
+
+        if (++tmp->entry_number == tmp->group_size)
+            return tmp_file_dispatch_write(tmp);
+
+        return TMP_SAM_OK;
+    }
+
     if ((tmp->offset + tmp->input_size + sizeof(bam1_t) + inbam->l_data) >= tmp->ring_buffer_size) {
         int ret;
 
@@ -290,7 +906,17 @@ int tmp_file_write(tmp_file_t *tmp, bam1_t *inbam) {
 int tmp_file_end_write(tmp_file_t *tmp) {
     size_t terminator = 0;
 
-    if (tmp->entry_number) {
+    if (tmp->indexed) {
+        int ret;
+
+        if (tmp->entry_number && (ret = tmp_file_dispatch_write(tmp)))
+            return ret;
+
+        while (tmp->in_flight > 0) {
+            if ((ret = tmp_file_write_result(tmp, 1)))
+                return ret;
+        }
+    } else if (tmp->entry_number) {
         int ret;
 
         if ((ret = tmp_file_write_to_file(tmp))) {
@@ -313,13 +939,20 @@ int tmp_file_end_write(tmp_file_t *tmp) {
 
 /*
  * Prepares the file for reading.
- * Companion function to tmp_file_end_write above.
+ * Companion function to tmp_file_end_write above.  Can be called again
+ * to read the file from the start once more.
  * Returns 0 on success, a negative number on failure.
  */
 int tmp_file_begin_read(tmp_file_t *tmp) {
 
+    if (tmp->indexed)
+        return tmp_file_begin_read_group(tmp, 0);
+
     rewind(tmp->fp);
 
+    if (tmp->dstream)
+        LZ4_freeStreamDecode(tmp->dstream);
+
     tmp->dstream = LZ4_createStreamDecode();
     tmp->offset  = 0;
     tmp->entry_number = tmp->group_size;
@@ -341,6 +974,18 @@ int tmp_file_read(tmp_file_t *tmp, bam1_t *inbam) {
     int entry_size;
     uint8_t *data = inbam->data;
 
+    if (tmp->indexed) {
+        int ret;
+
+        for (;;) {
+            if (tmp->cur && (ret = tmp_file_group_next(tmp, tmp->cur, inbam)) != 0)
+                return ret;
+
+            if ((ret = tmp_file_next_group(tmp)) <= 0)
+                return ret;
+        }
+    }
+
     /* while tmp_file_read assumes that the same bam1_t variable
        is being used in each call, this may not be the case. So
        default to the lowest memory size for safety. */
@@ -427,6 +1072,20 @@ int tmp_file_read(tmp_file_t *tmp, bam1_t *inbam) {
 int tmp_file_destroy(tmp_file_t *tmp) {
     int ret = 0;
 
+    if (tmp->queue) {
+        tmp_file_drain(tmp);
+        hts_tpool_process_destroy(tmp->queue);
+    }
+
+    if (tmp->jobs) {
+        int i;
+        for (i = 0; i < tmp->njobs; i++)
+            tmp_file_group_free(&tmp->jobs[i]);
+        free(tmp->jobs);
+    }
+
+    free(tmp->index);
+
     ret = fclose(tmp->fp);
 
     LZ4_freeStreamDecode(tmp->dstream);
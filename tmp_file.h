@@ -28,8 +28,10 @@ DEALINGS IN THE SOFTWARE
 #ifndef _TMP_SAM_FILE_H_
 #define _TMP_SAM_FILE_H_
 
+#include <sys/types.h>
 #include <lz4.h>
 #include "htslib/sam.h"
+#include "htslib/thread_pool.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,12 +44,52 @@ extern "C" {
 #define TMP_SAM_MAX_DATA 1024
 #define TMP_SAM_RING_SIZE 1048576
 
+// Most groups compressed or decompressed at once with a thread pool.
+#define TMP_SAM_MAX_JOBS 8
+
+// Group codecs for indexed files.  LZ4_DICT and DEFLATE compress each
+// group after the first using the end of the first group as a preset
+// dictionary, which pays off on the very repetitive records in a spill.
+#define TMP_SAM_CODEC_LZ4 0
+#define TMP_SAM_CODEC_LZ4_DICT 1
+#define TMP_SAM_CODEC_DEFLATE 2
+
+// Most of the first group kept as the dictionary.
+#define TMP_SAM_DICT_SIZE 32768
+
 // Error numbers.
 #define TMP_SAM_OK 0
 #define TMP_SAM_MEM_ERROR -1
 #define TMP_SAM_FILE_ERROR -2
 #define TMP_SAM_LZ4_ERROR -3
 #define TMP_SAM_INPUT_ERROR -4
+#define TMP_SAM_ZLIB_ERROR -5
+
+// A group of alignments compressed on its own in an indexed file.  When
+// reading, in holds the compressed data and out the alignments.
+typedef struct {
+    uint8_t *in;
+    size_t in_size, in_alloc;
+    uint8_t *out;
+    size_t out_size, out_alloc;
+    size_t raw_size;
+    size_t read_offset;         // next alignment in out
+    off_t offset;               // compressed data position in the file
+    int fd;
+    int codec;
+    const char *dict;           // preset dictionary, if any
+    size_t dict_size;
+    LZ4_stream_t *lz4;          // for compressing with a dictionary
+    int ret;
+} tmp_file_group_t;
+
+// Location of each group in an indexed file.
+typedef struct {
+    off_t offset;
+    size_t comp_size;
+    size_t raw_size;
+    int dict;                   // compressed with the dictionary
+} tmp_file_index_t;
 
 typedef struct {
     FILE *fp;
@@ -70,6 +112,18 @@ typedef struct {
     int verbose;
     char *dict;
     size_t groups_written;
+    int indexed;                // groups compressed independently
+    int codec;
+    size_t dict_size;
+    tmp_file_index_t *index;
+    size_t nindex, mindex;
+    off_t write_offset;
+    size_t next_group;
+    hts_tpool *pool;            // optional, indexed files only
+    hts_tpool_process *queue;
+    tmp_file_group_t *jobs;
+    int njobs, next_job, in_flight;
+    tmp_file_group_t *cur;      // group being read in indexed mode
 } tmp_file_t;
 
 
@@ -81,6 +135,45 @@ typedef struct {
 int tmp_file_open_write(tmp_file_t *tmp, char *tmp_name, int verbose);
 
 
+/*
+ * Switches the file to the indexed format, where each group is compressed
+ * on its own rather than as part of one LZ4 stream and its position is
+ * kept.  This allows groups to be read in any order, and by several
+ * threads at once, with tmp_file_read_group.  Compresses a little less
+ * well than the default.  Must be called after tmp_file_open_write and
+ * before anything is written.
+ * Returns 0 on success, a negative number on failure.
+ */
+int tmp_file_set_indexed(tmp_file_t *tmp);
+
+
+/*
+ * As tmp_file_set_indexed, and also chooses how groups are compressed,
+ * one of the TMP_SAM_CODEC values.  The dictionary codecs give smaller
+ * files at some cost in speed, for when disk rather than CPU is the
+ * limit.
+ * Returns 0 on success, a negative number on failure.
+ */
+int tmp_file_set_codec(tmp_file_t *tmp, int codec);
+
+
+/*
+ * Returns the TMP_SAM_CODEC value for a codec name ("lz4", "lz4-dict" or
+ * "deflate"), or -1 if not recognised.
+ */
+int tmp_file_codec(const char *name);
+
+
+/*
+ * As tmp_file_set_indexed, and also compresses and decompresses groups
+ * on the thread pool, with a few in flight at once, instead of inline.
+ * Does nothing if pool is NULL.  tmp_file_write and tmp_file_read must
+ * not then be called from inside jobs on the same pool.
+ * Returns 0 on success, a negative number on failure.
+ */
+int tmp_file_set_thread_pool(tmp_file_t *tmp, hts_tpool *pool);
+
+
 /*
  * Stores an in memory bam structure for writing and if enough are gathered together writes
  * it to a file.  Multiple alignments compress better that single ones though after a certain number
@@ -99,7 +192,8 @@ int tmp_file_end_write(tmp_file_t *tmp);
 
 /*
  * Prepares the file for reading.
- * Companion function to tmp_file_end_write above.
+ * Companion function to tmp_file_end_write above.  Can be called again
+ * to read the file from the start once more.
  * Returns 0 on success, a negative number on failure.
  */
 int tmp_file_begin_read(tmp_file_t *tmp);
@@ -111,6 +205,46 @@ int tmp_file_begin_read(tmp_file_t *tmp);
 int tmp_file_read(tmp_file_t *tmp, bam1_t *inbam);
 
 
+/*
+ * Indexed files only.  As tmp_file_begin_read, but tmp_file_read then
+ * starts from the given group.
+ * Returns 0 on success, a negative number on failure.
+ */
+int tmp_file_begin_read_group(tmp_file_t *tmp, size_t group);
+
+
+/*
+ * The number of groups in an indexed file, once tmp_file_end_write has
+ * been called.
+ */
+size_t tmp_file_group_count(tmp_file_t *tmp);
+
+
+/*
+ * Indexed files only.  Reads and decompresses one group into grp, which
+ * should start zeroed and can be reused for other groups.  The records
+ * are then fetched with tmp_file_group_next.  Independent of
+ * tmp_file_read, and safe to call from several threads at once after
+ * tmp_file_end_write, as long as each has its own grp.
+ * Returns 0 on success, a negative number on failure.
+ */
+int tmp_file_read_group(tmp_file_t *tmp, size_t group, tmp_file_group_t *grp);
+
+
+/*
+ * Copies the next alignment in a group read by tmp_file_read_group into
+ * inbam.
+ * Returns size of entry on success, 0 on end of group or a negative on error.
+ */
+int tmp_file_group_next(tmp_file_t *tmp, tmp_file_group_t *grp, bam1_t *inbam);
+
+
+/*
+ * Frees the memory held by a group.
+ */
+void tmp_file_group_free(tmp_file_group_t *grp);
+
+
 /*
  * Frees up memory, closes the file and deletes it.
  * Returns 0 on success or EOF on failure.